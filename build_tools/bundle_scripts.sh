@@ -0,0 +1,34 @@
+#!/bin/sh
+# Writes C++ source for arrays of builtin_script_t, one array for each
+# given directory of .fish files, to standard output. The arrays are
+# sorted by name, as autoload_t's binary search requires.
+#
+# Usage: bundle_scripts.sh array_name directory [array_name directory ...]
+
+# Some scripts have DOS line endings
+cr=$(printf '\r')
+
+echo "/* Generated by build_tools/bundle_scripts.sh. Do not edit. */"
+
+while test $# -ge 2
+do
+	array=$1
+	dir=$2
+	shift 2
+
+	echo
+	echo "const builtin_script_t ${array}[] ="
+	echo "{"
+	for file in $(cd "$dir" && ls | LC_ALL=C sort | grep '\.fish$')
+	do
+		name=${file%.fish}
+		echo "    {"
+		echo "        L\"$name\","
+		echo "        \"\""
+		# Escape each line into a string literal. Question marks are escaped so they never form trigraphs.
+		sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' -e 's/?/\\?/g' -e "s/$cr/\\\\r/g" -e 's/^/        "/' -e 's/$/\\n"/' "$dir/$file"
+		echo "    },"
+	done
+	echo "};"
+	echo "const size_t ${array}_count = sizeof ${array} / sizeof *${array};"
+done
@@ -0,0 +1,272 @@
+#!/bin/sh
+# Writes C++ source for fish_wcwidth's lookup table to standard output.
+#
+# The table is split in two levels. wcwidth_block_index maps the high
+# bits of a code point (ucs >> 8) to one of the blocks in wcwidth_blocks,
+# which holds the width of each of the 256 code points in that block.
+# Most blocks are identical (all width 1, or all width 2 for CJK), so the
+# whole of Unicode needs only a few dozen distinct blocks.
+#
+# The widths are those of Markus Kuhn's wcwidth (2007-05-26, Unicode 5.0):
+#
+#    - The null character (U+0000) has a column width of 0.
+#
+#    - Other C0/C1 control characters and DEL have a width of -1.
+#
+#    - Non-spacing and enclosing combining characters (general
+#      category code Mn or Me in the Unicode database), format
+#      characters (Cf) other than SOFT HYPHEN (U+00AD), ZERO WIDTH
+#      SPACE (U+200B) and Hangul Jamo medial vowels and final
+#      consonants (U+1160-U+11FF) have a column width of 0.
+#
+#    - Spacing characters in the East Asian Wide (W) or East Asian
+#      Full-width (F) category as defined in Unicode Technical
+#      Report #11 have a column width of 2.
+#
+#    - All remaining characters have a column width of 1.
+#
+# http://www.cl.cam.ac.uk/~mgk25/ucs/wcwidth.c
+#
+# Usage: wcwidth_table.sh
+
+LC_ALL=C awk '
+function hex(str,    i, val)
+{
+    val = 0
+    for (i = 1; i <= length(str); i++)
+        val = val * 16 + index("0123456789ABCDEF", substr(str, i, 1)) - 1
+    return val
+}
+
+/^[0-9A-F]/ {
+    first = hex($1)
+    last = hex($2)
+    for (ucs = first; ucs <= last; ucs++)
+        width[ucs] = $3
+}
+
+END {
+    nblocks = 0
+    for (hi = 0; hi < 4352; hi++)
+    {
+        key = ""
+        for (lo = 0; lo < 256; lo++)
+        {
+            ucs = hi * 256 + lo
+            key = key ((ucs in width) ? width[ucs] : 1) ","
+        }
+        if (! (key in block_of))
+        {
+            block_of[key] = nblocks
+            blocks[nblocks] = key
+            nblocks++
+        }
+        index_of[hi] = block_of[key]
+    }
+    if (nblocks > 256)
+    {
+        print "wcwidth_table.sh: too many distinct blocks" > "/dev/stderr"
+        exit 1
+    }
+
+    print "/* Generated by build_tools/wcwidth_table.sh. Do not edit. */"
+    print ""
+    print "static const unsigned char wcwidth_block_index[4352] ="
+    print "{"
+    line = "   "
+    for (hi = 0; hi < 4352; hi++)
+    {
+        line = line " " index_of[hi] ","
+        if (hi % 16 == 15)
+        {
+            print line
+            line = "   "
+        }
+    }
+    print "};"
+    print ""
+    print "static const signed char wcwidth_blocks[" nblocks "][256] ="
+    print "{"
+    for (b = 0; b < nblocks; b++)
+    {
+        print "    {"
+        n = split(blocks[b], vals, ",")
+        line = "       "
+        for (lo = 0; lo < 256; lo++)
+        {
+            line = line " " vals[lo + 1] ","
+            if (lo % 32 == 31)
+            {
+                print line
+                line = "       "
+            }
+        }
+        print "    },"
+    }
+    print "};"
+}
+' <<'EOF'
+# first last width
+0000 0000 0
+0001 001F -1
+007F 009F -1
+
+# East Asian Wide and Full-width
+1100 115F 2
+2329 232A 2
+2E80 303E 2
+3040 A4CF 2
+AC00 D7A3 2
+F900 FAFF 2
+FE10 FE19 2
+FE30 FE6F 2
+FF00 FF60 2
+FFE0 FFE6 2
+20000 2FFFD 2
+30000 3FFFD 2
+
+# Non-spacing characters, from
+# uniset +cat=Me +cat=Mn +cat=Cf -00AD +1160-11FF +200B c
+0300 036F 0
+0483 0486 0
+0488 0489 0
+0591 05BD 0
+05BF 05BF 0
+05C1 05C2 0
+05C4 05C5 0
+05C7 05C7 0
+0600 0603 0
+0610 0615 0
+064B 065E 0
+0670 0670 0
+06D6 06E4 0
+06E7 06E8 0
+06EA 06ED 0
+070F 070F 0
+0711 0711 0
+0730 074A 0
+07A6 07B0 0
+07EB 07F3 0
+0901 0902 0
+093C 093C 0
+0941 0948 0
+094D 094D 0
+0951 0954 0
+0962 0963 0
+0981 0981 0
+09BC 09BC 0
+09C1 09C4 0
+09CD 09CD 0
+09E2 09E3 0
+0A01 0A02 0
+0A3C 0A3C 0
+0A41 0A42 0
+0A47 0A48 0
+0A4B 0A4D 0
+0A70 0A71 0
+0A81 0A82 0
+0ABC 0ABC 0
+0AC1 0AC5 0
+0AC7 0AC8 0
+0ACD 0ACD 0
+0AE2 0AE3 0
+0B01 0B01 0
+0B3C 0B3C 0
+0B3F 0B3F 0
+0B41 0B43 0
+0B4D 0B4D 0
+0B56 0B56 0
+0B82 0B82 0
+0BC0 0BC0 0
+0BCD 0BCD 0
+0C3E 0C40 0
+0C46 0C48 0
+0C4A 0C4D 0
+0C55 0C56 0
+0CBC 0CBC 0
+0CBF 0CBF 0
+0CC6 0CC6 0
+0CCC 0CCD 0
+0CE2 0CE3 0
+0D41 0D43 0
+0D4D 0D4D 0
+0DCA 0DCA 0
+0DD2 0DD4 0
+0DD6 0DD6 0
+0E31 0E31 0
+0E34 0E3A 0
+0E47 0E4E 0
+0EB1 0EB1 0
+0EB4 0EB9 0
+0EBB 0EBC 0
+0EC8 0ECD 0
+0F18 0F19 0
+0F35 0F35 0
+0F37 0F37 0
+0F39 0F39 0
+0F71 0F7E 0
+0F80 0F84 0
+0F86 0F87 0
+0F90 0F97 0
+0F99 0FBC 0
+0FC6 0FC6 0
+102D 1030 0
+1032 1032 0
+1036 1037 0
+1039 1039 0
+1058 1059 0
+1160 11FF 0
+135F 135F 0
+1712 1714 0
+1732 1734 0
+1752 1753 0
+1772 1773 0
+17B4 17B5 0
+17B7 17BD 0
+17C6 17C6 0
+17C9 17D3 0
+17DD 17DD 0
+180B 180D 0
+18A9 18A9 0
+1920 1922 0
+1927 1928 0
+1932 1932 0
+1939 193B 0
+1A17 1A18 0
+1B00 1B03 0
+1B34 1B34 0
+1B36 1B3A 0
+1B3C 1B3C 0
+1B42 1B42 0
+1B6B 1B73 0
+1DC0 1DCA 0
+1DFE 1DFF 0
+200B 200F 0
+202A 202E 0
+2060 2063 0
+206A 206F 0
+20D0 20EF 0
+302A 302F 0
+3099 309A 0
+A806 A806 0
+A80B A80B 0
+A825 A826 0
+FB1E FB1E 0
+FE00 FE0F 0
+FE20 FE23 0
+FEFF FEFF 0
+FFF9 FFFB 0
+10A01 10A03 0
+10A05 10A06 0
+10A0C 10A0F 0
+10A38 10A3A 0
+10A3F 10A3F 0
+1D167 1D169 0
+1D173 1D182 0
+1D185 1D18B 0
+1D1AA 1D1AD 0
+1D242 1D244 0
+E0001 E0001 0
+E0020 E007F 0
+E0100 E01EF 0
+EOF
@@ -123,6 +123,12 @@
 /* Define to 1 if the sys_errlist array is available. */
 #define HAVE_SYS_ERRLIST 1
 
+/* Define to 1 if you have the <sys/event.h> header file. */
+#define HAVE_SYS_EVENT_H 1
+
+/* Define to 1 if you have the <sys/inotify.h> header file. */
+/* #undef HAVE_SYS_INOTIFY_H */
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 #define HAVE_SYS_IOCTL_H 1
 
@@ -242,6 +248,9 @@
 /* Evil kludge to get Power based machines to work */
 /* #undef TPUTS_KLUDGE */
 
+/* Compile the shipped functions and completions into fish */
+/* #undef USE_BUNDLED_SCRIPTS */
+
 /* Perform string translations with gettext */
 /* #undef USE_GETTEXT */
 
@@ -4,4 +4,5 @@ complete -c history -l search --description "Print matching history items, which
 complete -c history -l delete --description "Interactively delete matching history items"
 complete -c history -l clear --description "Clear your entire history"
 complete -c history -l merge --description "Incorporate history changes from other sessions"
+complete -c history -x -l format -a "text binary" --description "Rewrite the history file in the given format"
 # --save is not completed; it is for internal use
@@ -12,3 +12,11 @@ complete -c status -s t -l print-stack-trace --description "Print a list of all
 complete -c status -s f -l current-filename --description "Print the filename of the currently running script"
 complete -c status -s n -l current-line-number --description "Print the line number of the currently running script"
 complete -c status -s t -l print-stack-trace --description "Prints a trace of all function calls on the stack"
+complete -c status -l print-autoload-stats --description "Print how well the function and completion caches work"
+complete -c status -l print-intern-stats --description "Print the size of the pool of shared strings"
+complete -c status -l profile-start -r --description "Start writing a streaming profile to a file"
+complete -c status -l profile-folded --description "Write the streaming profile as folded stacks for flame graphs"
+complete -c status -l profile-stop --description "Write the final streaming profile and stop it"
+complete -c status -l print-memory-stats --description "Print an estimate of the memory each part of fish uses"
+complete -c status -l print-syscall-stats --description "Print how many file system calls, forks and command substitutions fish made"
+complete -c status -l reset-syscall-stats --description "Reset the counts printed by --print-syscall-stats"
@@ -0,0 +1,20 @@
+complete -c string -s h -l help --description "Display help and exit"
+complete -f -c string -n "__fish_use_subcommand" -a length --description "Print the length of each string"
+complete -f -c string -n "__fish_use_subcommand" -a sub --description "Print a substring of each string"
+complete -f -c string -n "__fish_use_subcommand" -a split --description "Split strings on a separator"
+complete -f -c string -n "__fish_use_subcommand" -a join --description "Join strings with a separator"
+complete -f -c string -n "__fish_use_subcommand" -a trim --description "Remove leading and trailing characters"
+complete -f -c string -n "__fish_use_subcommand" -a match --description "Print strings that match a pattern"
+complete -f -c string -n "__fish_use_subcommand" -a replace --description "Replace a pattern in strings"
+complete -f -c string -s q -l quiet --description "Do not print output"
+complete -x -c string -n "__fish_seen_subcommand_from sub" -s s -l start --description "Position to start from"
+complete -x -c string -n "__fish_seen_subcommand_from sub" -s l -l length --description "Maximum length of the substring"
+complete -x -c string -n "__fish_seen_subcommand_from split" -s m -l max --description "Maximum number of splits"
+complete -f -c string -n "__fish_seen_subcommand_from split" -s r -l right --description "Split from the right"
+complete -f -c string -n "__fish_seen_subcommand_from trim" -s l -l left --description "Only trim the start"
+complete -f -c string -n "__fish_seen_subcommand_from trim" -s r -l right --description "Only trim the end"
+complete -x -c string -n "__fish_seen_subcommand_from trim" -s c -l chars --description "Characters to remove"
+complete -f -c string -n "__fish_seen_subcommand_from match replace" -s a -l all --description "Report every match"
+complete -f -c string -n "__fish_seen_subcommand_from match replace" -s i -l ignore-case --description "Ignore case"
+complete -f -c string -n "__fish_seen_subcommand_from match replace" -s r -l regex --description "Use a regular expression"
+complete -f -c string -n "__fish_seen_subcommand_from match" -s n -l index --description "Print the position and length of each match"
@@ -7,6 +7,7 @@ function history --description "Deletes an item from history"
 	set -l argc (count $argv)
 	set -l prefix_args ""
 	set -l contains_args ""
+	set -l format_args ""
 
 	set -l cmd print
 
@@ -32,6 +33,9 @@ function history --description "Deletes an item from history"
 				set cmd save
 			case --clear
 				set cmd clear
+			case --format
+				set cmd format
+				set format_args $argv[(math $i + 1)]
 			case --search
 				set cmd print
 			case --
@@ -127,6 +131,9 @@ function history --description "Deletes an item from history"
 	case save
 		#Save changes to history file
 		builtin history $argv
+	case format
+		#Rewrite the history file in the given format
+		builtin history --format $format_args
 	case clear
 		# Erase the entire history
 		echo "Are you sure you want to clear history ? (y/n)"
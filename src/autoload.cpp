@@ -6,6 +6,7 @@ The classes responsible for autoloading functions and completions.
 #include "config.h" // IWYU pragma: keep
 #include "autoload.h"
 #include "wutil.h"
+#include "util.h"
 #include "common.h"
 #include "signal.h" // IWYU pragma: keep - needed for CHECK_BLOCK
 #include "env.h"
@@ -23,6 +24,41 @@ The classes responsible for autoloading functions and completions.
 /* The time before we'll recheck an autoloaded file */
 static const int kAutoloadStalenessInterval = 15;
 
+/* The time before we'll recheck the modification time of a directory we have listed */
+static const int kAutoloadDirectoryStalenessInterval = 1;
+
+/* The number of entries an autoloader caches, unless fish_autoload_cache_size says otherwise */
+static const size_t kAutoloadDefaultCacheCapacity = 1024;
+
+/* Every autoloader, so that they can be resized and inspected together. Autoloaders are created in static initializers, so this is created on first use. It is only touched on the main thread. */
+static std::vector<autoload_t *> &all_autoloaders()
+{
+    static std::vector<autoload_t *> autoloaders;
+    return autoloaders;
+}
+
+void autoload_set_cache_capacity(size_t capacity)
+{
+    ASSERT_IS_MAIN_THREAD();
+    const std::vector<autoload_t *> &autoloaders = all_autoloaders();
+    for (size_t i=0; i < autoloaders.size(); i++)
+    {
+        autoloaders.at(i)->set_cache_capacity(capacity ? capacity : kAutoloadDefaultCacheCapacity);
+    }
+}
+
+std::vector<autoload_stats_t> autoload_get_stats()
+{
+    ASSERT_IS_MAIN_THREAD();
+    std::vector<autoload_stats_t> result;
+    const std::vector<autoload_t *> &autoloaders = all_autoloaders();
+    for (size_t i=0; i < autoloaders.size(); i++)
+    {
+        result.push_back(autoloaders.at(i)->get_stats());
+    }
+    return result;
+}
+
 file_access_attempt_t access_file(const wcstring &path, int mode)
 {
     //printf("Touch %ls\n", path.c_str());
@@ -51,20 +87,71 @@ file_access_attempt_t access_file(const wcstring &path, int mode)
     return result;
 }
 
-autoload_t::autoload_t(const wcstring &env_var_name_var, const builtin_script_t * const scripts, size_t script_count) :
+/* The data directory, which the builtin scripts were bundled from */
+static wcstring s_data_directory;
+
+void autoload_set_data_directory(const wcstring &dir)
+{
+    ASSERT_IS_MAIN_THREAD();
+    s_data_directory = dir;
+}
+
+autoload_t::autoload_t(const wcstring &env_var_name_var, const builtin_script_t * const scripts, size_t script_count, const wchar_t *script_subdirectory) :
+    lru_cache_t<autoload_function_t>(kAutoloadDefaultCacheCapacity, true /* segmented */),
     lock(),
     env_var_name(env_var_name_var),
+    hit_count(0),
+    miss_count(0),
     builtin_scripts(scripts),
-    builtin_script_count(script_count)
+    builtin_script_count(script_count),
+    builtin_script_subdirectory(script_subdirectory ? script_subdirectory : L"")
 {
     pthread_mutex_init(&lock, NULL);
+    all_autoloaders().push_back(this);
 }
 
 autoload_t::~autoload_t()
 {
+    std::vector<autoload_t *> &autoloaders = all_autoloaders();
+    autoloaders.erase(std::find(autoloaders.begin(), autoloaders.end(), this));
     pthread_mutex_destroy(&lock);
 }
 
+autoload_stats_t autoload_t::get_stats()
+{
+    scoped_lock locker(lock);
+    autoload_stats_t result;
+    result.env_var_name = env_var_name;
+    result.size = this->size();
+    result.capacity = this->capacity();
+    result.hits = hit_count;
+    result.misses = miss_count;
+    result.evictions = this->evictions();
+
+    result.bytes = 0;
+    for (iterator iter = this->begin(); iter != this->end(); ++iter)
+    {
+        result.bytes += sizeof(lru_node_t *) + sizeof(autoload_function_t) + wcstring_heap_size((*iter)->key);
+    }
+    for (std::map<wcstring, autoload_directory_t>::const_iterator iter = directory_listings.begin(); iter != directory_listings.end(); ++iter)
+    {
+        result.bytes += TREE_NODE_OVERHEAD + sizeof *iter + wcstring_heap_size(iter->first);
+        const std::set<wcstring> &names = iter->second.names;
+        for (std::set<wcstring>::const_iterator name = names.begin(); name != names.end(); ++name)
+        {
+            result.bytes += TREE_NODE_OVERHEAD + sizeof(wcstring) + wcstring_heap_size(*name);
+        }
+    }
+    return result;
+}
+
+void autoload_t::set_cache_capacity(size_t new_capacity)
+{
+    ASSERT_IS_MAIN_THREAD();
+    scoped_lock locker(lock);
+    this->set_capacity(new_capacity);
+}
+
 void autoload_t::node_was_evicted(autoload_function_t *node)
 {
     // This should only ever happen on the main thread
@@ -147,6 +234,75 @@ static bool script_name_precedes_script_name(const builtin_script_t &script1, co
     return wcscmp(script1.name, script2.name) < 0;
 }
 
+const builtin_script_t *autoload_t::find_builtin_script(const wcstring &cmd) const
+{
+    /* Look for built-in scripts via a binary search */
+    if (builtin_script_count == 0)
+        return NULL;
+
+    const builtin_script_t test_script = {cmd.c_str(), NULL};
+    const builtin_script_t *array_end = builtin_scripts + builtin_script_count;
+    const builtin_script_t *found = std::lower_bound(builtin_scripts, array_end, test_script, script_name_precedes_script_name);
+    if (found != array_end && ! wcscmp(found->name, test_script.name))
+    {
+        return found;
+    }
+    return NULL;
+}
+
+bool autoload_t::directory_may_have_file(const wcstring &dir, const wcstring &name)
+{
+    /* Note that we are NOT locked in this function, and we don't hold the lock while touching the filesystem */
+    const time_t now = time(NULL);
+    {
+        scoped_lock locker(lock);
+        std::map<wcstring, autoload_directory_t>::const_iterator where = directory_listings.find(dir);
+        if (where != directory_listings.end() && now - where->second.last_checked < kAutoloadDirectoryStalenessInterval)
+        {
+            return where->second.may_have_file(name);
+        }
+    }
+
+    struct stat buf = {};
+    const bool exists = (0 == wstat(dir, &buf));
+    {
+        scoped_lock locker(lock);
+        autoload_directory_t &listing = directory_listings[dir];
+        if (! exists || (listing.exists && listing.trusted && listing.mod_time == buf.st_mtime))
+        {
+            /* Gone, or unchanged since we listed it */
+            listing.exists = exists;
+            listing.last_checked = now;
+            return listing.may_have_file(name);
+        }
+    }
+
+    /* The directory is new to us or has changed, so list it */
+    std::set<wcstring> names;
+    bool complete = false;
+    DIR *d = wopendir(dir);
+    if (d != NULL)
+    {
+        wcstring file_name;
+        while (wreaddir(d, file_name))
+        {
+            names.insert(file_name);
+        }
+        closedir(d);
+        complete = true;
+    }
+
+    scoped_lock locker(lock);
+    autoload_directory_t &listing = directory_listings[dir];
+    listing.exists = true;
+    /* Adding a file in the same second as we list the directory would not change its modification time, so only trust listings made after that second */
+    listing.trusted = complete && now > buf.st_mtime;
+    listing.mod_time = buf.st_mtime;
+    listing.last_checked = now;
+    listing.names.swap(names);
+    return listing.may_have_file(name);
+}
+
 /** Check whether the given command is loaded. */
 bool autoload_t::has_tried_loading(const wcstring &cmd)
 {
@@ -234,8 +390,10 @@ bool autoload_t::locate_file_and_maybe_load_it(const wcstring &cmd, bool really_
         if (use_cached)
         {
             assert(func != NULL);
+            hit_count++;
             return func->is_internalized || func->access.accessible;
         }
+        miss_count++;
     }
     /* The source of the script will end up here */
     wcstring script_source;
@@ -244,124 +402,138 @@ bool autoload_t::locate_file_and_maybe_load_it(const wcstring &cmd, bool really_
     /* Whether we found an accessible file */
     bool found_file = false;
 
-    /* Look for built-in scripts via a binary search */
-    const builtin_script_t *matching_builtin_script = NULL;
-    if (builtin_script_count > 0)
+    /* Look for a built-in script. If it stands in for a directory in the path, only the directories before that one need to be searched, and the script is used if none of them have the file. */
+    const builtin_script_t *matching_builtin_script = this->find_builtin_script(cmd);
+    size_t path_count = path_list.size();
+    if (matching_builtin_script && ! builtin_script_subdirectory.empty())
     {
-        const builtin_script_t test_script = {cmd.c_str(), NULL};
-        const builtin_script_t *array_end = builtin_scripts + builtin_script_count;
-        const builtin_script_t *found = std::lower_bound(builtin_scripts, array_end, test_script, script_name_precedes_script_name);
-        if (found != array_end && ! wcscmp(found->name, test_script.name))
+        const wcstring bundled_dir = s_data_directory + L"/" + builtin_script_subdirectory;
+        wcstring_list_t::const_iterator where = std::find(path_list.begin(), path_list.end(), bundled_dir);
+        if (s_data_directory.empty() || where == path_list.end())
+        {
+            matching_builtin_script = NULL;
+        }
+        else
         {
-            /* We found it */
-            matching_builtin_script = found;
+            path_count = where - path_list.begin();
         }
     }
-    if (matching_builtin_script)
+    else if (matching_builtin_script)
     {
-        has_script_source = true;
-        script_source = str2wcstring(matching_builtin_script->def);
-
-        /* Make a node representing this function */
-        scoped_lock locker(lock);
-        autoload_function_t *func = this->get_autoloaded_function_with_creation(cmd, really_load);
-
-        /* This function is internalized */
-        func->is_internalized = true;
-
-        /* It's a fiction to say the script is loaded at this point, but we're definitely going to load it down below. */
-        if (really_load) func->is_loaded = true;
+        path_count = 0;
     }
 
-    if (! has_script_source)
+    /* Iterate over path searching for suitable completion files */
+    const wcstring file_name = cmd + L".fish";
+    for (size_t i=0; i<path_count; i++)
     {
-        /* Iterate over path searching for suitable completion files */
-        for (size_t i=0; i<path_list.size(); i++)
+        const wcstring &next = path_list.at(i);
+        if (! this->directory_may_have_file(next, file_name))
         {
-            wcstring next = path_list.at(i);
-            wcstring path = next + L"/" + cmd + L".fish";
-
-            const file_access_attempt_t access = access_file(path, R_OK);
-            if (access.accessible)
-            {
-                /* Found it! */
-                found_file = true;
+            continue;
+        }
 
-                /* Now we're actually going to take the lock. */
-                scoped_lock locker(lock);
-                autoload_function_t *func = this->get_node(cmd);
+        wcstring path = next + L"/" + file_name;
 
-                /* Generate the source if we need to load it */
-                bool need_to_load_function = really_load && (func == NULL || func->access.mod_time != access.mod_time || ! func->is_loaded);
-                if (need_to_load_function)
-                {
+        const file_access_attempt_t access = access_file(path, R_OK);
+        if (access.accessible)
+        {
+            /* Found it! */
+            found_file = true;
 
-                    /* Generate the script source */
-                    wcstring esc = escape_string(path, 1);
-                    script_source = L"source " + esc;
-                    has_script_source = true;
+            /* Now we're actually going to take the lock. */
+            scoped_lock locker(lock);
+            autoload_function_t *func = this->get_node(cmd);
 
-                    /* Remove any loaded command because we are going to reload it. Note that this will deadlock if command_removed calls back into us. */
-                    if (func && func->is_loaded)
-                    {
-                        command_removed(cmd);
-                        func->is_placeholder = false;
-                    }
+            /* Generate the source if we need to load it */
+            bool need_to_load_function = really_load && (func == NULL || func->access.mod_time != access.mod_time || ! func->is_loaded);
+            if (need_to_load_function)
+            {
 
-                    /* Mark that we're reloading it */
-                    reloaded = true;
-                }
+                /* Generate the script source */
+                wcstring esc = escape_string(path, 1);
+                script_source = L"source " + esc;
+                has_script_source = true;
 
-                /* Create the function if we haven't yet. This does not load it. Do not trigger eviction unless we are actually loading, because we don't want to evict off of the main thread. */
-                if (! func)
+                /* Remove any loaded command because we are going to reload it. Note that this will deadlock if command_removed calls back into us. */
+                if (func && func->is_loaded)
                 {
-                    func = get_autoloaded_function_with_creation(cmd, really_load);
+                    command_removed(cmd);
+                    func->is_placeholder = false;
                 }
 
-                /* It's a fiction to say the script is loaded at this point, but we're definitely going to load it down below. */
-                if (need_to_load_function) func->is_loaded = true;
-
-                /* Unconditionally record our access time */
-                func->access = access;
+                /* Mark that we're reloading it */
+                reloaded = true;
+            }
 
-                break;
+            /* Create the function if we haven't yet. This does not load it. Do not trigger eviction unless we are actually loading, because we don't want to evict off of the main thread. */
+            if (! func)
+            {
+                func = get_autoloaded_function_with_creation(cmd, really_load);
             }
+
+            /* It's a fiction to say the script is loaded at this point, but we're definitely going to load it down below. */
+            if (need_to_load_function) func->is_loaded = true;
+
+            /* Unconditionally record our access time */
+            func->access = access;
+
+            break;
         }
+    }
+
+    if (matching_builtin_script && ! found_file)
+    {
+        has_script_source = true;
+        script_source = str2wcstring(matching_builtin_script->def);
+
+        /* Make a node representing this function */
+        scoped_lock locker(lock);
+        autoload_function_t *func = this->get_autoloaded_function_with_creation(cmd, really_load);
+
+        /* This function is internalized */
+        func->is_internalized = true;
+
+        /* It's a fiction to say the script is loaded at this point, but we're definitely going to load it down below. */
+        if (really_load) func->is_loaded = true;
+    }
 
-        /*
-          If no file or builtin script was found we insert a placeholder function.
-          Later we only research if the current time is at least five seconds later.
-          This way, the files won't be searched over and over again.
-        */
-        if (! found_file && ! has_script_source)
+    /*
+      If no file or builtin script was found we insert a placeholder function.
+      Later we only research if the current time is at least five seconds later.
+      This way, the files won't be searched over and over again.
+    */
+    if (! found_file && ! has_script_source)
+    {
+        scoped_lock locker(lock);
+        /* Generate a placeholder */
+        autoload_function_t *func = this->get_node(cmd);
+        if (! func)
         {
-            scoped_lock locker(lock);
-            /* Generate a placeholder */
-            autoload_function_t *func = this->get_node(cmd);
-            if (! func)
+            func = new autoload_function_t(cmd);
+            func->is_placeholder = true;
+            if (really_load)
             {
-                func = new autoload_function_t(cmd);
-                func->is_placeholder = true;
-                if (really_load)
-                {
-                    this->add_node(func);
-                }
-                else
-                {
-                    this->add_node_without_eviction(func);
-                }
+                this->add_node(func);
+            }
+            else
+            {
+                this->add_node_without_eviction(func);
             }
-            func->access.last_checked = time(NULL);
         }
+        func->access.last_checked = time(NULL);
     }
 
     /* If we have a script, either built-in or a file source, then run it */
     if (really_load && has_script_source)
     {
+        long long start_time = get_monotonic_time();
         if (exec_subshell(script_source, false /* do not apply exit status */) == -1)
         {
             /* Do nothing on failure */
         }
+        if (g_startup_timings_active)
+            startup_timing_report(L"autoload " + cmd + L" from $" + env_var_name, start_time);
 
     }
 
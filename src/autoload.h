@@ -10,6 +10,8 @@
 #include <stddef.h>
 #include <time.h>
 #include <set>
+#include <map>
+#include <vector>
 #include "common.h"
 #include "lru.h"
 
@@ -25,6 +27,23 @@ struct file_access_attempt_t
 
 file_access_attempt_t access_file(const wcstring &path, int mode);
 
+/** A cached listing of a directory in an autoload path, which lets us skip the directory when it does not have a file */
+struct autoload_directory_t
+{
+    autoload_directory_t() : exists(false), trusted(false), mod_time(0), last_checked(0) { }
+    bool exists; /** Whether the directory existed when we last checked */
+    bool trusted; /** Whether the listing is complete and newer than the directory's modification time */
+    time_t mod_time; /** The modification time of the directory when we listed it */
+    time_t last_checked; /** When we last checked the modification time */
+    std::set<wcstring> names; /** The names of the files in the directory */
+
+    /** Return whether the directory may have a file with the given name */
+    bool may_have_file(const wcstring &name) const
+    {
+        return exists && (! trusted || names.count(name) > 0);
+    }
+};
+
 struct autoload_function_t : public lru_node_t
 {
     autoload_function_t(const wcstring &key) : lru_node_t(key), access(), is_loaded(false), is_placeholder(false), is_internalized(false) { }
@@ -42,6 +61,27 @@ struct builtin_script_t
 
 class env_vars_snapshot_t;
 
+/** Counters describing how well an autoloader's cache works */
+struct autoload_stats_t
+{
+    wcstring env_var_name; /** The name of the path variable the autoloader searches */
+    size_t size; /** How many entries are cached */
+    size_t capacity; /** How many entries may be cached */
+    unsigned long hits; /** Lookups answered from the cache */
+    unsigned long misses; /** Lookups that searched the path */
+    unsigned long evictions; /** Entries evicted to stay within the capacity */
+    size_t bytes; /** An estimate of the bytes the cached entries and directory listings take */
+};
+
+/** Set how many entries every autoloader may cache. Zero means the default. Must be called on the main thread. */
+void autoload_set_cache_capacity(size_t capacity);
+
+/** Return the counters of every autoloader */
+std::vector<autoload_stats_t> autoload_get_stats();
+
+/** Set the directory whose functions and completions subdirectories may be replaced by builtin scripts. Call this on the main thread, before anything is autoloaded. */
+void autoload_set_data_directory(const wcstring &dir);
+
 /**
   A class that represents a path from which we can autoload, and the autoloaded contents.
  */
@@ -55,12 +95,27 @@ private:
     /** The environment variable name */
     const wcstring env_var_name;
 
+    /** Counts of lookups answered from the cache, and of those that searched the path */
+    unsigned long hit_count, miss_count;
+
     /** Builtin script array */
     const struct builtin_script_t *const builtin_scripts;
 
     /** Builtin script count */
     const size_t builtin_script_count;
 
+    /** If not empty, the builtin scripts are copies of the scripts in this subdirectory of the data directory */
+    const wcstring builtin_script_subdirectory;
+
+    /** Return the builtin script with the given name, or NULL */
+    const builtin_script_t *find_builtin_script(const wcstring &cmd) const;
+
+    /** Listings of the directories we have searched, keyed by path */
+    std::map<wcstring, autoload_directory_t> directory_listings;
+
+    /** Return whether the given directory may have a file with the given name, consulting and updating its cached listing. A false result means the file is definitely not there. */
+    bool directory_may_have_file(const wcstring &dir, const wcstring &name);
+
     /** The path from which we most recently autoloaded */
     wcstring last_path;
 
@@ -90,8 +145,8 @@ protected:
 
 public:
 
-    /** Create an autoload_t for the given environment variable name */
-    autoload_t(const wcstring &env_var_name_var, const builtin_script_t *scripts, size_t script_count);
+    /** Create an autoload_t for the given environment variable name. If script_subdirectory is given, the builtin scripts stand in for the files in that subdirectory of the data directory, and are only used when it comes up in the path. Otherwise they take precedence over the whole path. */
+    autoload_t(const wcstring &env_var_name_var, const builtin_script_t *scripts, size_t script_count, const wchar_t *script_subdirectory = NULL);
 
     /** Destructor */
     virtual ~autoload_t();
@@ -125,6 +180,12 @@ public:
     /** Check whether the given command could be loaded, but do not load it. */
     bool can_load(const wcstring &cmd, const env_vars_snapshot_t &vars);
 
+    /** Return our counters */
+    autoload_stats_t get_stats();
+
+    /** Set how many entries we may cache, unloading the least recently used ones if there are too many. Must be called on the main thread. */
+    void set_cache_capacity(size_t capacity);
+
 };
 
 #endif
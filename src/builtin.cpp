@@ -40,6 +40,7 @@
 #include "fallback.h" // IWYU pragma: keep
 
 #include "wutil.h"
+#include "util.h"
 #include "builtin.h"
 #include "function.h"
 #include "complete.h"
@@ -63,6 +64,7 @@
 #include "parse_tree.h"
 #include "parse_constants.h"
 #include "wcstringutil.h"
+#include "autoload.h"
 
 /**
    The default prompt for the read command
@@ -130,6 +132,45 @@ const wcstring &get_stderr_buffer()
     return stderr_buffer;
 }
 
+/**
+   The number of characters a builtin may accumulate in stdout_buffer before builtin_flush_stdout writes them out
+*/
+#define BUILTIN_STDOUT_FLUSH_SIZE 16384
+
+/**
+   Where the output of the running builtin may be written while it runs: a file descriptor, or a buffer. If neither
+   is set, the output is only written once the builtin has finished.
+*/
+static int stdout_stream_fd = -1;
+static io_buffer_t *stdout_stream_buffer = NULL;
+
+void builtin_set_stdout_stream(int fd, io_buffer_t *buffer)
+{
+    ASSERT_IS_MAIN_THREAD();
+    stdout_stream_fd = fd;
+    stdout_stream_buffer = buffer;
+}
+
+void builtin_flush_stdout()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (stdout_buffer.size() < BUILTIN_STDOUT_FLUSH_SIZE || (stdout_stream_fd < 0 && stdout_stream_buffer == NULL))
+        return;
+
+    const std::string narrow = wcs2string(stdout_buffer);
+    if (stdout_stream_buffer != NULL)
+    {
+        stdout_stream_buffer->out_buffer_append(narrow.data(), narrow.size());
+    }
+    else if (write_loop(stdout_stream_fd, narrow.data(), narrow.size()) < 0)
+    {
+        /* Keep the output, and leave reporting the error to whoever writes it at the end */
+        stdout_stream_fd = -1;
+        return;
+    }
+    stdout_buffer.clear();
+}
+
 void builtin_show_error(const wcstring &err)
 {
     ASSERT_IS_MAIN_THREAD();
@@ -144,6 +185,8 @@ struct io_stack_elem_t
     int in;
     wcstring out;
     wcstring err;
+    int stream_fd;
+    io_buffer_t *stream_buffer;
 };
 static std::stack<io_stack_elem_t, std::vector<io_stack_elem_t> > io_stack;
 
@@ -399,6 +442,8 @@ static void builtin_missing_argument(parser_t &parser, const wchar_t *cmd, const
 #include "builtin_jobs.cpp"
 #include "builtin_set_color.cpp"
 #include "builtin_printf.cpp"
+#include "builtin_string.cpp"
+#include "builtin_math.cpp"
 
 /* builtin_test lives in builtin_test.cpp */
 int builtin_test(parser_t &parser, wchar_t **argv);
@@ -1597,6 +1642,8 @@ static int builtin_functions(parser_t &parser, wchar_t **argv)
     {
         int is_screen = !builtin_out_redirect && isatty(1);
         size_t i;
+        /* Scripts may list functions right after adding a file for one, so don't trust directory listings made just now */
+        path_cache_recheck();
         wcstring_list_t names = function_get_names(show_hidden);
         std::sort(names.begin(), names.end());
         if (is_screen)
@@ -1877,6 +1924,7 @@ static int builtin_echo(parser_t &parser, wchar_t **argv)
         {
             stdout_buffer.push_back(' ');
         }
+        builtin_flush_stdout();
 
         const wchar_t *str = args_to_echo[idx];
         for (size_t j=0; continue_output && str[j]; j++)
@@ -2449,6 +2497,114 @@ static int builtin_random(parser_t &parser, wchar_t **argv)
 }
 
 
+/**
+   The number of bytes read at a time from files
+*/
+#define READ_CHUNK_SIZE 4096
+
+/**
+   Decode one byte of input for the read builtin. Returns true if a character is complete, which is stored in res.
+   Bytes that are no valid character are dropped.
+*/
+static bool read_decode_byte(char b, wchar_t *res, mbstate_t *state)
+{
+    /* ASCII is the same in every supported encoding, and by far the most common */
+    if ((unsigned char)b < 0x80 && mbsinit(state))
+    {
+        *res = (wchar_t)(unsigned char)b;
+        return true;
+    }
+
+    switch (mbrtowc(res, &b, 1, state))
+    {
+        case (size_t)(-1):
+            memset(state, '\0', sizeof(*state));
+            return false;
+
+        case (size_t)(-2):
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/**
+   Add the character res to buff, unless it ends the line. Returns true when reading should stop.
+*/
+static bool read_append_char(wcstring &buff, wchar_t res, int nchars, bool split_null)
+{
+    if (res == (split_null ? L'\0' : L'\n'))
+        return true;
+
+    buff.push_back(res);
+    return 0 < nchars && (size_t)nchars <= buff.size();
+}
+
+/**
+   Read a line from fd a byte at a time, so that nothing past the end of the line is consumed. This is needed for
+   pipes and terminals, where the rest of the input belongs to whoever reads next. Returns 1 at end of file, 0
+   otherwise.
+*/
+static int read_one_char_at_a_time(int fd, wcstring &buff, int nchars, bool split_null)
+{
+    mbstate_t state = {};
+    for (;;)
+    {
+        char b;
+        if (read_blocked(fd, &b, 1) <= 0)
+            return 1;
+
+        wchar_t res;
+        if (read_decode_byte(b, &res, &state) && read_append_char(buff, res, nchars, split_null))
+            return 0;
+    }
+}
+
+/**
+   Read a line from fd in blocks, and seek back to just after the end of the line, so the file is left where reading
+   a byte at a time would have left it. Returns -1 without reading anything if fd is not a regular file, otherwise
+   the same as read_one_char_at_a_time.
+*/
+static int read_in_chunks(int fd, wcstring &buff, int nchars, bool split_null)
+{
+    struct stat buf;
+    if (fstat(fd, &buf) != 0 || ! S_ISREG(buf.st_mode))
+        return -1;
+
+    const off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start == (off_t)-1)
+        return -1;
+
+    mbstate_t state = {};
+    off_t consumed = 0;
+    int eof = 0;
+    bool finished = false;
+    while (! finished)
+    {
+        char inbuf[READ_CHUNK_SIZE];
+        long amt = read_blocked(fd, inbuf, sizeof inbuf);
+        if (amt <= 0)
+        {
+            eof = 1;
+            break;
+        }
+
+        long offset = 0;
+        while (offset < amt && ! finished)
+        {
+            wchar_t res;
+            if (read_decode_byte(inbuf[offset++], &res, &state))
+                finished = read_append_char(buff, res, nchars, split_null);
+        }
+        consumed += offset;
+    }
+
+    /* Give back whatever was read past the end of the line */
+    lseek(fd, start + consumed, SEEK_SET);
+    return eof;
+}
+
 /**
    The read builtin. Reads from stdin and stores the values in environment variables.
 */
@@ -2753,63 +2909,11 @@ static int builtin_read(parser_t &parser, wchar_t **argv)
     }
     else
     {
-        int eof=0;
-
         buff.clear();
 
-        while (1)
-        {
-            int finished=0;
-
-            wchar_t res=0;
-            mbstate_t state = {};
-
-            while (!finished)
-            {
-                char b;
-                if (read_blocked(builtin_stdin, &b, 1) <= 0)
-                {
-                    eof=1;
-                    break;
-                }
-
-                size_t sz = mbrtowc(&res, &b, 1, &state);
-
-                switch (sz)
-                {
-                    case (size_t)(-1):
-                        memset(&state, '\0', sizeof(state));
-                        break;
-
-                    case (size_t)(-2):
-                        break;
-                    case 0:
-                        finished = 1;
-                        break;
-
-                    default:
-                        finished=1;
-                        break;
-
-                }
-            }
-
-            if (eof)
-                break;
-
-            if (!split_null && res == L'\n')
-                break;
-
-            if (split_null && res == L'\0')
-                break;
-
-            buff.push_back(res);
-
-            if (0 < nchars && (size_t)nchars <= buff.size())
-            {
-                break;
-            }
-        }
+        int eof = read_in_chunks(builtin_stdin, buff, nchars, split_null);
+        if (eof == -1)
+            eof = read_one_char_at_a_time(builtin_stdin, buff, nchars, split_null);
 
         if (buff.empty() && eof)
         {
@@ -2911,11 +3015,20 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
         STACK_TRACE,
         DONE,
         CURRENT_FILENAME,
-        CURRENT_LINE_NUMBER
+        CURRENT_LINE_NUMBER,
+        AUTOLOAD_STATS,
+        INTERN_STATS,
+        MEMORY_STATS,
+        SYSCALL_STATS,
+        SYSCALL_STATS_RESET,
+        PROFILE_START,
+        PROFILE_STOP
     }
     ;
 
     int mode = NORMAL;
+    int profile_folded = 0;
+    wcstring profile_path;
 
     int argc = builtin_count_args(argv);
     int res=STATUS_BUILTIN_OK;
@@ -2972,6 +3085,38 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
             L"print-stack-trace", no_argument, 0, 't'
         }
         ,
+        {
+            L"print-autoload-stats", no_argument, &mode, AUTOLOAD_STATS
+        }
+        ,
+        {
+            L"print-intern-stats", no_argument, &mode, INTERN_STATS
+        }
+        ,
+        {
+            L"print-memory-stats", no_argument, &mode, MEMORY_STATS
+        }
+        ,
+        {
+            L"print-syscall-stats", no_argument, &mode, SYSCALL_STATS
+        }
+        ,
+        {
+            L"reset-syscall-stats", no_argument, &mode, SYSCALL_STATS_RESET
+        }
+        ,
+        {
+            L"profile-start", required_argument, 0, 'P'
+        }
+        ,
+        {
+            L"profile-folded", no_argument, &profile_folded, 1
+        }
+        ,
+        {
+            L"profile-stop", no_argument, &mode, PROFILE_STOP
+        }
+        ,
         {
             0, 0, 0, 0
         }
@@ -3051,6 +3196,10 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
                 mode = STACK_TRACE;
                 break;
 
+            case 'P':
+                mode = PROFILE_START;
+                profile_path = w.woptarg;
+                break;
 
             case ':':
                 builtin_missing_argument(parser, argv[0], argv[w.woptind-1]);
@@ -3114,6 +3263,95 @@ static int builtin_status(parser_t &parser, wchar_t **argv)
                 break;
             }
 
+            case AUTOLOAD_STATS:
+            {
+                const std::vector<autoload_stats_t> stats = autoload_get_stats();
+                for (size_t i=0; i < stats.size(); i++)
+                {
+                    const autoload_stats_t &st = stats.at(i);
+                    append_format(stdout_buffer, _(L"%ls: %lu of %lu entries cached, %lu hits, %lu misses, %lu evictions\n"),
+                                  st.env_var_name.c_str(), (unsigned long)st.size, (unsigned long)st.capacity, st.hits, st.misses, st.evictions);
+                }
+                break;
+            }
+
+            case INTERN_STATS:
+            {
+                const intern_stats_t st = intern_get_stats();
+                append_format(stdout_buffer, _(L"%lu strings in %lu slots, %lu bytes, %lu locked lookups\n"),
+                              (unsigned long)st.count, (unsigned long)st.capacity, (unsigned long)st.bytes, st.locked_lookups);
+                break;
+            }
+
+            case MEMORY_STATS:
+            {
+                std::vector<memory_stats_t> stats;
+                history_get_memory_stats(&stats);
+                env_get_memory_stats(&stats);
+                function_get_memory_stats(&stats);
+                complete_get_memory_stats(&stats);
+
+                const std::vector<autoload_stats_t> autoload_stats = autoload_get_stats();
+                for (size_t i=0; i < autoload_stats.size(); i++)
+                {
+                    const autoload_stats_t &st = autoload_stats.at(i);
+                    memory_stats_t autoload_memory(st.env_var_name + L" autoload cache");
+                    autoload_memory.entries = st.size;
+                    autoload_memory.bytes = st.bytes;
+                    stats.push_back(autoload_memory);
+                }
+
+                const intern_stats_t st = intern_get_stats();
+                memory_stats_t intern_memory(L"intern'd strings");
+                intern_memory.entries = st.count;
+                intern_memory.bytes = st.bytes + st.capacity * (sizeof(size_t) + sizeof(const wchar_t *));
+                stats.push_back(intern_memory);
+
+                size_t total = 0;
+                for (size_t i=0; i < stats.size(); i++)
+                {
+                    const memory_stats_t &ms = stats.at(i);
+                    append_format(stdout_buffer, _(L"%ls: %lu entries, %lu bytes\n"), ms.name.c_str(), (unsigned long)ms.entries, (unsigned long)ms.bytes);
+                    total += ms.bytes;
+                }
+                append_format(stdout_buffer, _(L"total: %lu bytes\n"), (unsigned long)total);
+                break;
+            }
+
+            case SYSCALL_STATS:
+            {
+                for (int i=0; i < SYSCALL_COUNTER_COUNT; i++)
+                {
+                    syscall_counter_t which = static_cast<syscall_counter_t>(i);
+                    append_format(stdout_buffer, L"%ls: %lu\n", syscall_counter_name(which), syscall_counter_get(which));
+                }
+                break;
+            }
+
+            case SYSCALL_STATS_RESET:
+            {
+                syscall_counters_reset();
+                break;
+            }
+
+            case PROFILE_START:
+            {
+                profile_stream_t &stream = parser.stream_profiler();
+                stream.stop();
+                if (! stream.start(profile_path, profile_folded != 0))
+                {
+                    append_format(stderr_buffer, _(L"%ls: Could not write profile to '%ls': %s\n"), argv[0], profile_path.c_str(), strerror(errno));
+                    res = STATUS_BUILTIN_ERROR;
+                }
+                break;
+            }
+
+            case PROFILE_STOP:
+            {
+                parser.stream_profiler().stop();
+                break;
+            }
+
             case NORMAL:
             {
                 if (is_login)
@@ -3213,6 +3451,8 @@ static int builtin_cd(parser_t &parser, wchar_t **argv)
     bool got_cd_path = false;
     if (! dir_in.missing())
     {
+        /* Scripts may cd into a directory right after creating it, so don't trust results cached just now */
+        path_cache_recheck();
         got_cd_path = path_get_cdpath(dir_in, &dir);
     }
 
@@ -3448,7 +3688,10 @@ static int builtin_source(parser_t &parser, wchar_t ** argv)
 
     env_set_argv((argc>2)?(argv+2):(argv+1));
 
+    long long start_time = get_monotonic_time();
     res = reader_read(fd, real_io ? *real_io : io_chain_t());
+    if (g_startup_timings_active)
+        startup_timing_report(wcstring(L"source ") + fn_intern, start_time);
 
     parser.pop_block();
 
@@ -3882,6 +4125,7 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
     bool save_history = false;
     bool clear_history = false;
     bool merge_history = false;
+    const wchar_t *file_format = NULL;
 
     static const struct woption long_options[] =
     {
@@ -3892,6 +4136,7 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
         { L"save", no_argument, 0, 'v' },
         { L"clear", no_argument, 0, 'l' },
         { L"merge", no_argument, 0, 'm' },
+        { L"format", required_argument, 0, 'f' },
         { L"help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 }
     };
@@ -3930,6 +4175,9 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
             case 'm':
                 merge_history = true;
                 break;
+            case 'f':
+                file_format = w.woptarg;
+                break;
             case 'h':
                 builtin_print_help(parser, argv[0], stdout_buffer);
                 return STATUS_BUILTIN_OK;
@@ -3949,9 +4197,7 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
 
     if (argc == 1)
     {
-        wcstring full_history;
-        history->get_string_representation(&full_history, wcstring(L"\n"));
-        stdout_buffer.append(full_history);
+        history->get_string_representation(&stdout_buffer, wcstring(L"\n"), &builtin_flush_stdout);
         stdout_buffer.push_back('\n');
         return STATUS_BUILTIN_OK;
     }
@@ -3961,6 +4207,25 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
         history->incorporate_external_changes();
     }
 
+    if (file_format != NULL)
+    {
+        history_file_type_t type;
+        if (! wcscmp(file_format, L"text"))
+        {
+            type = history_type_fish_2_0;
+        }
+        else if (! wcscmp(file_format, L"binary"))
+        {
+            type = history_type_fish_binary;
+        }
+        else
+        {
+            append_format(stderr_buffer, _(L"%ls: Unknown history format '%ls'\n"), argv[0], file_format);
+            return STATUS_BUILTIN_ERROR;
+        }
+        return history->set_file_format(type) ? STATUS_BUILTIN_OK : STATUS_BUILTIN_ERROR;
+    }
+
     if (search_history)
     {
         int res = STATUS_BUILTIN_ERROR;
@@ -3978,6 +4243,7 @@ static int builtin_history(parser_t &parser, wchar_t **argv)
             {
                 stdout_buffer.append(searcher.current_string());
                 stdout_buffer.append(L"\n");
+                builtin_flush_stdout();
                 res = STATUS_BUILTIN_OK;
             }
         }
@@ -4112,6 +4378,7 @@ static const builtin_data_t builtin_datas[]=
     { 		L"history",  &builtin_history, N_(L"History of commands executed by user")   },
     { 		L"if",  &builtin_generic, N_(L"Evaluate block if condition is true")   },
     { 		L"jobs",  &builtin_jobs, N_(L"Print currently running jobs")   },
+    { 		L"math",  &builtin_math, N_(L"Perform mathematics calculations")  },
     { 		L"not",  &builtin_generic, N_(L"Negate exit status of job")  },
     { 		L"or",  &builtin_generic, N_(L"Execute command if previous command failed")  },
     { 		L"printf",  &builtin_printf, N_(L"Prints formatted text")  },
@@ -4123,6 +4390,7 @@ static const builtin_data_t builtin_datas[]=
     { 		L"set_color",  &builtin_set_color, N_(L"Set the terminal color")   },
     { 		L"source",  &builtin_source, N_(L"Evaluate contents of file")   },
     { 		L"status",  &builtin_status, N_(L"Return status information about fish")  },
+    { 		L"string",  &builtin_string, N_(L"Manipulate strings")  },
     { 		L"switch",  &builtin_generic, N_(L"Conditionally execute a block of commands")   },
     { 		L"test",  &builtin_test, N_(L"Test a condition")   },
     { 		L"true",  &builtin_true, N_(L"Return a successful result") },
@@ -4249,12 +4517,13 @@ void builtin_push_io(parser_t &parser, int in)
     ASSERT_IS_MAIN_THREAD();
     if (builtin_stdin != -1)
     {
-        struct io_stack_elem_t elem = {builtin_stdin, stdout_buffer, stderr_buffer};
+        struct io_stack_elem_t elem = {builtin_stdin, stdout_buffer, stderr_buffer, stdout_stream_fd, stdout_stream_buffer};
         io_stack.push(elem);
     }
     builtin_stdin = in;
     stdout_buffer.clear();
     stderr_buffer.clear();
+    builtin_set_stdout_stream(-1, NULL);
 }
 
 void builtin_pop_io(parser_t &parser)
@@ -4267,6 +4536,7 @@ void builtin_pop_io(parser_t &parser)
         stderr_buffer = elem.err;
         stdout_buffer = elem.out;
         builtin_stdin = elem.in;
+        builtin_set_stdout_stream(elem.stream_fd, elem.stream_buffer);
         io_stack.pop();
     }
     else
@@ -4274,5 +4544,6 @@ void builtin_pop_io(parser_t &parser)
         stdout_buffer.clear();
         stderr_buffer.clear();
         builtin_stdin = 0;
+        builtin_set_stdout_stream(-1, NULL);
     }
 }
@@ -132,6 +132,19 @@ void builtin_push_io(parser_t &parser, int stdin_fd);
 */
 void builtin_pop_io(parser_t &parser);
 
+/**
+   Let the current builtin write its output while it runs instead of only after it has finished, either straight to
+   the file descriptor fd or into buffer. Pass -1 and NULL to turn this off. Only set this where nothing is waiting to
+   be written before the output, and writing cannot block on another process of the same job.
+*/
+void builtin_set_stdout_stream(int fd, io_buffer_t *buffer);
+
+/**
+   Write out the output the current builtin has accumulated, if there is a lot of it and it can be written while the
+   builtin runs. Builtins that may print a lot call this as they go.
+*/
+void builtin_flush_stdout();
+
 
 /**
    Return a one-line description of the specified builtin.
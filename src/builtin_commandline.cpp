@@ -200,14 +200,14 @@ static void write_part(const wchar_t *begin,
         while (tok.next(&token))
         {
             if ((cut_at_cursor) &&
-                    (token.offset + token.text.size() >= pos))
+                    (token.offset + token.length >= pos))
                 break;
 
             switch (token.type)
             {
                 case TOK_STRING:
                 {
-                    wcstring tmp = token.text;
+                    wcstring tmp(buff + token.offset, token.length);
                     unescape_string_in_place(&tmp, UNESCAPE_INCOMPLETE);
                     out.append(tmp);
                     out.push_back(L'\n');
@@ -12,6 +12,8 @@ Functions used for implementing the complete builtin.
 #include <sys/types.h>
 #include <termios.h>
 #include <signal.h>
+#include <set>
+#include <vector>
 
 #include "fallback.h"
 #include "util.h"
@@ -34,77 +36,49 @@ Functions used for implementing the complete builtin.
 */
 
 /**
-   Silly function
+   Conditions and argument lists that were checked and found free of
+   syntax errors. Completion scripts use the same few conditions for
+   many options, so remembering them saves parsing them over and over.
+   The sets are emptied once they grow large, which only costs parsing
+   some of the strings again.
 */
-static void  builtin_complete_add2(const wchar_t *cmd,
-                                   int cmd_type,
-                                   const wchar_t *short_opt,
-                                   const wcstring_list_t &gnu_opt,
-                                   const wcstring_list_t &old_opt,
-                                   int result_mode,
-                                   const wchar_t *condition,
-                                   const wchar_t *comp,
-                                   const wchar_t *desc,
-                                   int flags)
-{
-    size_t i;
-    const wchar_t *s;
-
-    for (s=short_opt; *s; s++)
-    {
-        complete_add(cmd,
-                     cmd_type,
-                     *s,
-                     0,
-                     0,
-                     result_mode,
-                     condition,
-                     comp,
-                     desc,
-                     flags);
-    }
+static std::set<wcstring> valid_conditions, valid_arguments;
 
-    for (i=0; i<gnu_opt.size(); i++)
-    {
-        complete_add(cmd,
-                     cmd_type,
-                     0,
-                     gnu_opt.at(i).c_str(),
-                     0,
-                     result_mode,
-                     condition,
-                     comp,
-                     desc,
-                     flags);
-    }
+/** Size above which the sets above are emptied */
+#define VALID_STRING_CACHE_SIZE 1024
 
-    for (i=0; i<old_opt.size(); i++)
+static void remember_valid_string(std::set<wcstring> *cache, const wcstring &str)
+{
+    if (cache->size() >= VALID_STRING_CACHE_SIZE)
     {
-        complete_add(cmd,
-                     cmd_type,
-                     0,
-                     old_opt.at(i).c_str(),
-                     1,
-                     result_mode,
-                     condition,
-                     comp,
-                     desc,
-                     flags);
+        cache->clear();
     }
+    cache->insert(str);
+}
 
-    if (old_opt.empty() && gnu_opt.empty() && wcslen(short_opt) == 0)
-    {
-        complete_add(cmd,
-                     cmd_type,
-                     0,
-                     0,
-                     0,
-                     result_mode,
-                     condition,
-                     comp,
-                     desc,
-                     flags);
-    }
+/**
+   Append an option to a list of options to add
+*/
+static void builtin_complete_append_opt(std::vector<complete_entry_opt_t> *opts,
+                                        wchar_t short_opt,
+                                        const wchar_t *long_opt,
+                                        int old_mode,
+                                        int result_mode,
+                                        const wchar_t *condition,
+                                        const wchar_t *comp,
+                                        const wchar_t *desc,
+                                        int flags)
+{
+    opts->push_back(complete_entry_opt_t());
+    complete_entry_opt_t &opt = opts->back();
+    opt.short_opt = short_opt;
+    if (long_opt) opt.long_opt = long_opt;
+    opt.old_mode = old_mode;
+    opt.result_mode = result_mode;
+    if (condition) opt.condition = condition;
+    if (comp) opt.comp = comp;
+    if (desc) opt.desc = desc;
+    opt.flags = flags;
 }
 
 /**
@@ -122,18 +96,31 @@ static void  builtin_complete_add(const wcstring_list_t &cmd,
                                   const wchar_t *desc,
                                   int flags)
 {
+    /* The options are the same for every command, so build them once, and add them all at once */
+    std::vector<complete_entry_opt_t> opts;
+    for (const wchar_t *s=short_opt; *s; s++)
+    {
+        builtin_complete_append_opt(&opts, *s, 0, 0, result_mode, condition, comp, desc, flags);
+    }
+
+    for (size_t i=0; i<gnu_opt.size(); i++)
+    {
+        builtin_complete_append_opt(&opts, 0, gnu_opt.at(i).c_str(), 0, result_mode, condition, comp, desc, flags);
+    }
+
+    for (size_t i=0; i<old_opt.size(); i++)
+    {
+        builtin_complete_append_opt(&opts, 0, old_opt.at(i).c_str(), 1, result_mode, condition, comp, desc, flags);
+    }
+
+    if (opts.empty())
+    {
+        builtin_complete_append_opt(&opts, 0, 0, 0, result_mode, condition, comp, desc, flags);
+    }
+
     for (size_t i=0; i<cmd.size(); i++)
     {
-        builtin_complete_add2(cmd.at(i).c_str(),
-                              COMMAND,
-                              short_opt,
-                              gnu_opt,
-                              old_opt,
-                              result_mode,
-                              condition,
-                              comp,
-                              desc,
-                              flags);
+        complete_add_options(cmd.at(i), COMMAND, opts);
 
         if (authoritative != -1)
         {
@@ -146,16 +133,7 @@ static void  builtin_complete_add(const wcstring_list_t &cmd,
 
     for (size_t i=0; i<path.size(); i++)
     {
-        builtin_complete_add2(path.at(i).c_str(),
-                              PATH,
-                              short_opt,
-                              gnu_opt,
-                              old_opt,
-                              result_mode,
-                              condition,
-                              comp,
-                              desc,
-                              flags);
+        complete_add_options(path.at(i), PATH, opts);
 
         if (authoritative != -1)
         {
@@ -452,11 +430,15 @@ static int builtin_complete(parser_t &parser, wchar_t **argv)
 
     if (!res)
     {
-        if (condition && wcslen(condition))
+        if (condition && wcslen(condition) && valid_conditions.find(condition) == valid_conditions.end())
         {
             const wcstring condition_string = condition;
             parse_error_list_t errors;
-            if (parse_util_detect_errors(condition_string, &errors, false /* do not accept incomplete */))
+            if (! parse_util_detect_errors(condition_string, &errors, false /* do not accept incomplete */))
+            {
+                remember_valid_string(&valid_conditions, condition_string);
+            }
+            else
             {
                 append_format(stderr_buffer,
                               L"%ls: Condition '%ls' contained a syntax error",
@@ -474,7 +456,7 @@ static int builtin_complete(parser_t &parser, wchar_t **argv)
 
     if (!res)
     {
-        if (comp && wcslen(comp))
+        if (comp && wcslen(comp) && valid_arguments.find(comp) == valid_arguments.end())
         {
             wcstring prefix;
             if (argv[0])
@@ -484,7 +466,11 @@ static int builtin_complete(parser_t &parser, wchar_t **argv)
             }
 
             wcstring err_text;
-            if (parser.detect_errors_in_argument_list(comp, &err_text, prefix.c_str()))
+            if (! parser.detect_errors_in_argument_list(comp, &err_text, prefix.c_str()))
+            {
+                remember_valid_string(&valid_arguments, comp);
+            }
+            else
             {
                 append_format(stderr_buffer,
                               L"%ls: Completion '%ls' contained a syntax error\n",
@@ -535,7 +521,7 @@ static int builtin_complete(parser_t &parser, wchar_t **argv)
                     stdout_buffer.append(faux_cmdline_with_completion);
 
                     /* Append any description */
-                    if (! next.description.empty())
+                    if (next.description[0] != L'\0')
                     {
                         stdout_buffer.push_back(L'\t');
                         stdout_buffer.append(next.description);
@@ -50,6 +50,10 @@ static int cpu_use(const job_t *j)
 
     for (p=j->first_process; p; p=p->next)
     {
+        /* proc_update_jiffies skips completed processes */
+        if (p->completed)
+            continue;
+
         struct timeval t;
         int jiffies;
         gettimeofday(&t, 0);
@@ -0,0 +1,779 @@
+/** \file builtin_math.cpp
+  Functions for executing the math builtin.
+
+  The math builtin evaluates arithmetic expressions in the shell itself, so that scripts doing counting or other
+  simple arithmetic do not need to start bc for every calculation. The syntax is the arithmetic subset of bc.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <vector>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "wutil.h"
+#include "builtin.h"
+#include "parser.h"
+#include "common.h"
+
+/** Exit status when the result is zero, like test and bc based scripts expect */
+#define MATH_STATUS_ZERO 1
+
+/** Exit status for an invalid expression */
+#define MATH_STATUS_ERROR 2
+
+/* We know about these buffers */
+extern wcstring stdout_buffer, stderr_buffer;
+
+/** The largest scale, and about the most digits a power may produce, so that an expression can not keep the shell busy for long */
+#define MATH_MAX_SCALE 1000
+#define MATH_MAX_DIGITS 20000
+
+/** Decimal digits, least significant first, without leading zeros. Zero has no digits. */
+typedef std::vector<unsigned char> math_digits_t;
+
+/**
+   A number in an expression. Like in bc, numbers are decimals of arbitrary precision, and each has a scale, the
+   number of digits after the decimal point. Its value is digits / 10^scale.
+*/
+struct math_number_t
+{
+    bool negative;
+    math_digits_t digits;
+    long scale;
+
+    math_number_t() : negative(false), scale(0)
+    {
+    }
+
+    bool is_zero() const
+    {
+        return digits.empty();
+    }
+};
+
+static void math_trim(math_digits_t *digits)
+{
+    while (! digits->empty() && digits->back() == 0)
+        digits->pop_back();
+}
+
+/* Multiply by 10^count */
+static void math_shift(math_digits_t *digits, long count)
+{
+    if (! digits->empty() && count > 0)
+        digits->insert(digits->begin(), count, 0);
+}
+
+static int math_compare_digits(const math_digits_t &a, const math_digits_t &b)
+{
+    if (a.size() != b.size())
+        return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0;)
+    {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static math_digits_t math_add_digits(const math_digits_t &a, const math_digits_t &b)
+{
+    math_digits_t result;
+    int carry = 0;
+    for (size_t i=0; i < a.size() || i < b.size() || carry; i++)
+    {
+        int sum = carry + (i < a.size() ? a[i] : 0) + (i < b.size() ? b[i] : 0);
+        result.push_back(sum % 10);
+        carry = sum / 10;
+    }
+    return result;
+}
+
+/* Returns a - b, which must not be negative */
+static math_digits_t math_subtract_digits(const math_digits_t &a, const math_digits_t &b)
+{
+    math_digits_t result(a);
+    int borrow = 0;
+    for (size_t i=0; i < result.size(); i++)
+    {
+        int diff = result[i] - borrow - (i < b.size() ? b[i] : 0);
+        borrow = (diff < 0);
+        result[i] = diff + (borrow ? 10 : 0);
+    }
+    math_trim(&result);
+    return result;
+}
+
+static math_digits_t math_multiply_digits(const math_digits_t &a, const math_digits_t &b)
+{
+    if (a.empty() || b.empty())
+        return math_digits_t();
+
+    /* Sum the digit products first and carry once; a column sums at most 81 per digit of the shorter number */
+    std::vector<unsigned long> sums(a.size() + b.size(), 0);
+    for (size_t i=0; i < a.size(); i++)
+    {
+        for (size_t j=0; j < b.size(); j++)
+        {
+            sums[i + j] += a[i] * b[j];
+        }
+    }
+
+    math_digits_t result(sums.size());
+    unsigned long carry = 0;
+    for (size_t i=0; i < sums.size(); i++)
+    {
+        unsigned long sum = sums[i] + carry;
+        result[i] = sum % 10;
+        carry = sum / 10;
+    }
+    math_trim(&result);
+    return result;
+}
+
+/* Returns a / b, truncated. b must not be zero. */
+static math_digits_t math_divide_digits(const math_digits_t &a, const math_digits_t &b)
+{
+    math_digits_t quotient(a.size(), 0), remainder;
+    for (size_t i = a.size(); i-- > 0;)
+    {
+        remainder.insert(remainder.begin(), a[i]);
+        math_trim(&remainder);
+        while (math_compare_digits(remainder, b) >= 0)
+        {
+            remainder = math_subtract_digits(remainder, b);
+            quotient[i]++;
+        }
+    }
+    math_trim(&quotient);
+    return quotient;
+}
+
+static math_number_t math_from_bool(bool value)
+{
+    math_number_t result;
+    if (value)
+        result.digits.push_back(1);
+    return result;
+}
+
+/* Give n more decimals, without changing its value */
+static void math_extend_scale(math_number_t *n, long scale)
+{
+    if (scale <= n->scale)
+        return;
+    math_shift(&n->digits, scale - n->scale);
+    n->scale = scale;
+}
+
+/* Drop the decimals of n beyond scale. Like bc, this truncates rather than rounds. */
+static void math_truncate_scale(math_number_t *n, long scale)
+{
+    if (scale >= n->scale)
+        return;
+    size_t drop = mini((size_t)(n->scale - scale), n->digits.size());
+    n->digits.erase(n->digits.begin(), n->digits.begin() + drop);
+    math_trim(&n->digits);
+    n->scale = scale;
+    if (n->is_zero())
+        n->negative = false;
+}
+
+static int math_compare(math_number_t a, math_number_t b)
+{
+    math_extend_scale(&a, b.scale);
+    math_extend_scale(&b, a.scale);
+    if (a.negative != b.negative)
+        return a.negative ? -1 : 1;
+    int cmp = math_compare_digits(a.digits, b.digits);
+    return a.negative ? -cmp : cmp;
+}
+
+static math_number_t math_negate(math_number_t n)
+{
+    if (! n.is_zero())
+        n.negative = ! n.negative;
+    return n;
+}
+
+/* The sum has the larger scale of the two */
+static math_number_t math_add(math_number_t a, math_number_t b)
+{
+    math_extend_scale(&a, b.scale);
+    math_extend_scale(&b, a.scale);
+
+    math_number_t result;
+    result.scale = a.scale;
+    if (a.negative == b.negative)
+    {
+        result.digits = math_add_digits(a.digits, b.digits);
+        result.negative = a.negative;
+    }
+    else if (math_compare_digits(a.digits, b.digits) >= 0)
+    {
+        result.digits = math_subtract_digits(a.digits, b.digits);
+        result.negative = a.negative;
+    }
+    else
+    {
+        result.digits = math_subtract_digits(b.digits, a.digits);
+        result.negative = b.negative;
+    }
+    if (result.is_zero())
+        result.negative = false;
+    return result;
+}
+
+/* The product keeps all its decimals, up to the larger of scale and the scales of a and b */
+static math_number_t math_multiply(const math_number_t &a, const math_number_t &b, long scale)
+{
+    math_number_t result;
+    result.digits = math_multiply_digits(a.digits, b.digits);
+    result.scale = a.scale + b.scale;
+    result.negative = (a.negative != b.negative) && ! result.is_zero();
+    math_truncate_scale(&result, mini(result.scale, maxi(scale, maxi(a.scale, b.scale))));
+    return result;
+}
+
+/* The quotient has scale decimals. b must not be zero. */
+static math_number_t math_divide(const math_number_t &a, const math_number_t &b, long scale)
+{
+    /* a / b * 10^scale is a.digits * 10^(b.scale + scale) / (b.digits * 10^a.scale) */
+    math_digits_t numerator(a.digits), denominator(b.digits);
+    long shift = b.scale + scale - a.scale;
+    if (shift >= 0)
+        math_shift(&numerator, shift);
+    else
+        math_shift(&denominator, -shift);
+
+    math_number_t result;
+    result.digits = math_divide_digits(numerator, denominator);
+    result.scale = scale;
+    result.negative = (a.negative != b.negative) && ! result.is_zero();
+    return result;
+}
+
+/* a - (a / b) * b, with the division done to scale, like bc. b must not be zero. */
+static math_number_t math_modulo(const math_number_t &a, const math_number_t &b, long scale)
+{
+    long result_scale = maxi(a.scale, b.scale + scale);
+    const math_number_t product = math_multiply(math_divide(a, b, scale), b, result_scale);
+    math_number_t result = math_add(a, math_negate(product));
+    math_extend_scale(&result, result_scale);
+    return result;
+}
+
+/* base^exponent. A negative exponent gives 1 / base^-exponent with scale decimals, and base must then not be zero. */
+static math_number_t math_power(const math_number_t &base, long exponent, long scale)
+{
+    math_number_t result = math_from_bool(true);
+    if (exponent == 0)
+        return result;
+
+    unsigned long remaining = exponent < 0 ? -(unsigned long)exponent : exponent;
+    const unsigned long magnitude = remaining;
+    math_number_t square = base;
+    for (;;)
+    {
+        if (remaining & 1)
+            result = math_multiply(result, square, LONG_MAX);
+        remaining >>= 1;
+        if (! remaining)
+            break;
+        square = math_multiply(square, square, LONG_MAX);
+    }
+
+    if (exponent < 0)
+        return math_divide(math_from_bool(true), result, scale);
+    math_truncate_scale(&result, mini((long)(base.scale * magnitude), maxi(scale, base.scale)));
+    return result;
+}
+
+/* The square root of n, which must not be negative, with the larger of scale and its scale of decimals */
+static math_number_t math_sqrt(const math_number_t &n, long scale)
+{
+    /* bc gives 0 and 1 back without decimals */
+    const math_number_t one = math_from_bool(true);
+    if (n.is_zero() || math_compare(n, one) == 0)
+        return n.is_zero() ? n : one;
+
+    const long result_scale = maxi(scale, n.scale);
+    math_digits_t target(n.digits);
+    math_shift(&target, 2 * result_scale - n.scale);
+
+    /* Newton's method on integers, starting from a power of ten above the root, decreases to the truncated root */
+    math_digits_t two(1, 2);
+    math_digits_t root((target.size() + 1) / 2 + 1, 0);
+    root.back() = 1;
+    for (;;)
+    {
+        math_digits_t next = math_divide_digits(math_add_digits(root, math_divide_digits(target, root)), two);
+        if (math_compare_digits(next, root) >= 0)
+            break;
+        root.swap(next);
+    }
+
+    math_number_t result;
+    result.digits = root;
+    result.scale = result_scale;
+    return result;
+}
+
+/* The absolute value of an exponent of at most nine digits */
+static long math_exponent_magnitude(const math_number_t &exponent)
+{
+    long result = 0;
+    for (size_t i = exponent.digits.size(); i-- > 0;)
+        result = result * 10 + exponent.digits[i];
+    return result;
+}
+
+/**
+   A recursive descent evaluator. The precedence follows bc, from lowest to highest: ||, &&, !, the comparisons,
+   + and -, *, / and %, ^ (right associative), unary minus.
+*/
+class math_parser_t
+{
+    const wcstring &text;
+    size_t pos;
+    long scale;
+    wcstring error;
+
+    void skip_space()
+    {
+        while (pos < text.size() && iswspace(text.at(pos)))
+            pos++;
+    }
+
+    /* Consume the operator op if it is next */
+    bool accept(const wchar_t *op)
+    {
+        skip_space();
+        size_t len = wcslen(op);
+        if (text.compare(pos, len, op) != 0)
+            return false;
+
+        /* Don't take the start of a longer operator, like < out of <= */
+        if (len == 1 && pos + 1 < text.size() && text.at(pos + 1) == L'=' && wcschr(L"<>!=", op[0]))
+            return false;
+        pos += len;
+        return true;
+    }
+
+    void fail(const wchar_t *msg)
+    {
+        if (error.empty())
+            error = msg;
+    }
+
+    bool failed() const
+    {
+        return ! error.empty();
+    }
+
+    math_number_t parse_or()
+    {
+        math_number_t left = parse_and();
+        while (! failed() && accept(L"||"))
+        {
+            math_number_t right = parse_and();
+            left = math_from_bool(! left.is_zero() || ! right.is_zero());
+        }
+        return left;
+    }
+
+    math_number_t parse_and()
+    {
+        math_number_t left = parse_not();
+        while (! failed() && accept(L"&&"))
+        {
+            math_number_t right = parse_not();
+            left = math_from_bool(! left.is_zero() && ! right.is_zero());
+        }
+        return left;
+    }
+
+    math_number_t parse_not()
+    {
+        if (accept(L"!"))
+            return math_from_bool(parse_not().is_zero());
+        return parse_comparison();
+    }
+
+    math_number_t parse_comparison()
+    {
+        math_number_t left = parse_sum();
+        while (! failed())
+        {
+            int op;
+            if (accept(L"<="))
+                op = 'l';
+            else if (accept(L">="))
+                op = 'g';
+            else if (accept(L"=="))
+                op = '=';
+            else if (accept(L"!="))
+                op = '!';
+            else if (accept(L"<"))
+                op = '<';
+            else if (accept(L">"))
+                op = '>';
+            else
+                break;
+
+            math_number_t right = parse_sum();
+            int cmp = math_compare(left, right);
+            bool result = false;
+            switch (op)
+            {
+                case 'l': result = cmp <= 0; break;
+                case 'g': result = cmp >= 0; break;
+                case '=': result = cmp == 0; break;
+                case '!': result = cmp != 0; break;
+                case '<': result = cmp < 0; break;
+                case '>': result = cmp > 0; break;
+            }
+            left = math_from_bool(result);
+        }
+        return left;
+    }
+
+    math_number_t parse_sum()
+    {
+        math_number_t left = parse_product();
+        while (! failed())
+        {
+            bool add;
+            if (accept(L"+"))
+                add = true;
+            else if (accept(L"-"))
+                add = false;
+            else
+                break;
+
+            math_number_t right = parse_product();
+            left = math_add(left, add ? right : math_negate(right));
+        }
+        return left;
+    }
+
+    math_number_t parse_product()
+    {
+        math_number_t left = parse_power();
+        while (! failed())
+        {
+            wchar_t op;
+            if (accept(L"*"))
+                op = L'*';
+            else if (accept(L"/"))
+                op = L'/';
+            else if (accept(L"%"))
+                op = L'%';
+            else
+                break;
+
+            math_number_t right = parse_power();
+            if (failed())
+                break;
+
+            if (op != L'*' && right.is_zero())
+            {
+                fail(op == L'/' ? _(L"Division by zero") : _(L"Modulo by zero"));
+                break;
+            }
+
+            if (op == L'*')
+                left = math_multiply(left, right, scale);
+            else if (op == L'/')
+                left = math_divide(left, right, scale);
+            else
+                left = math_modulo(left, right, scale);
+        }
+        return left;
+    }
+
+    math_number_t parse_power()
+    {
+        math_number_t base = parse_unary();
+        if (failed() || ! accept(L"^"))
+            return base;
+
+        /* Right associative, so 2^3^2 is 2^9 */
+        math_number_t exponent = parse_power();
+        if (failed())
+            return base;
+
+        /* Like bc, only integer exponents are allowed, and an exponent written with decimals counts as one that is not */
+        if (exponent.scale != 0)
+        {
+            fail(_(L"Non-zero scale in exponent"));
+            return base;
+        }
+
+        /* The result has about as many digits as the base for each step of the exponent */
+        if (exponent.digits.size() > 9 || base.digits.size() * math_exponent_magnitude(exponent) > MATH_MAX_DIGITS)
+        {
+            fail(_(L"Exponent too large"));
+            return base;
+        }
+
+        long e = math_exponent_magnitude(exponent);
+        if (exponent.negative)
+        {
+            if (base.is_zero())
+            {
+                fail(_(L"Division by zero"));
+                return base;
+            }
+            e = -e;
+        }
+        return math_power(base, e, scale);
+    }
+
+    math_number_t parse_unary()
+    {
+        if (accept(L"-"))
+            return math_negate(parse_unary());
+        if (accept(L"+"))
+            return parse_unary();
+        return parse_primary();
+    }
+
+    math_number_t parse_primary()
+    {
+        skip_space();
+        if (accept(L"("))
+        {
+            math_number_t value = parse_or();
+            if (! failed() && ! accept(L")"))
+                fail(_(L"Expected ')'"));
+            return value;
+        }
+
+        if (text.compare(pos, 4, L"sqrt") == 0)
+        {
+            pos += 4;
+            if (! accept(L"("))
+            {
+                fail(_(L"Expected '(' after sqrt"));
+                return math_number_t();
+            }
+            math_number_t value = parse_or();
+            if (! failed() && ! accept(L")"))
+                fail(_(L"Expected ')'"));
+            if (failed())
+                return value;
+            if (value.negative)
+            {
+                fail(_(L"Square root of a negative number"));
+                return value;
+            }
+            return math_sqrt(value, scale);
+        }
+
+        return parse_number();
+    }
+
+    /* A number is digits with at most one decimal point, whose position gives its scale */
+    math_number_t parse_number()
+    {
+        const size_t start = pos;
+        math_number_t result;
+        bool seen_point = false, seen_digit = false;
+        for (; pos < text.size(); pos++)
+        {
+            const wchar_t c = text.at(pos);
+            if (c == L'.' && ! seen_point)
+            {
+                seen_point = true;
+            }
+            else if (c >= L'0' && c <= L'9')
+            {
+                seen_digit = true;
+                result.digits.insert(result.digits.begin(), (unsigned char)(c - L'0'));
+                if (seen_point)
+                    result.scale++;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if (! seen_digit)
+        {
+            pos = start;
+            fail(pos < text.size() ? _(L"Unexpected token") : _(L"Unexpected end of expression"));
+            return math_number_t();
+        }
+        math_trim(&result.digits);
+        return result;
+    }
+
+public:
+    math_parser_t(const wcstring &t, long s) : text(t), pos(0), scale(s)
+    {
+    }
+
+    /* Evaluate the whole text. Returns false and sets the error if it is not a valid expression. */
+    bool evaluate(math_number_t *result)
+    {
+        *result = parse_or();
+        skip_space();
+        if (! failed() && pos < text.size())
+            fail(_(L"Unexpected token"));
+        return ! failed();
+    }
+
+    const wcstring &get_error() const
+    {
+        return error;
+    }
+
+    size_t get_error_pos() const
+    {
+        return pos;
+    }
+};
+
+/* Parse a scale, which must be a nonnegative integer of at most MATH_MAX_SCALE */
+static bool math_parse_scale(const wchar_t *str, long *out)
+{
+    wchar_t *end;
+    errno = 0;
+    long result = wcstol(str, &end, 10);
+    if (errno || *str == L'\0' || *end != L'\0' || result < 0 || result > MATH_MAX_SCALE)
+    {
+        append_format(stderr_buffer, _(L"math: Invalid scale '%ls'\n"), str);
+        return false;
+    }
+    *out = result;
+    return true;
+}
+
+/* Format a number like bc: without a zero before the decimal point, and with all the decimals of its scale */
+static wcstring math_format(const math_number_t &value)
+{
+    if (value.is_zero())
+        return L"0";
+
+    wcstring result;
+    if (value.negative)
+        result.push_back(L'-');
+    const size_t fraction_digits = (size_t)value.scale;
+    for (size_t i = value.digits.size(); i-- > fraction_digits;)
+        result.push_back(L'0' + value.digits[i]);
+    if (fraction_digits > 0)
+    {
+        result.push_back(L'.');
+        for (size_t i = fraction_digits; i-- > 0;)
+            result.push_back(i < value.digits.size() ? L'0' + value.digits[i] : L'0');
+    }
+    return result;
+}
+
+/**
+   The math builtin. The arguments are joined with spaces into one expression, as if they were fed to bc.
+   An expression may start with a bc style "scale=N;" to set the number of decimals, like the -s option.
+*/
+static int builtin_math(parser_t &parser, wchar_t **argv)
+{
+    int argc = builtin_count_args(argv);
+    long scale = 0;
+    int argidx = 1;
+
+    /* Parse options by hand, because an expression may start with a minus sign */
+    while (argidx < argc)
+    {
+        const wchar_t *arg = argv[argidx];
+        if (wcscmp(arg, L"-h") == 0 || wcscmp(arg, L"--help") == 0)
+        {
+            builtin_print_help(parser, argv[0], stdout_buffer);
+            return STATUS_BUILTIN_OK;
+        }
+        else if (wcscmp(arg, L"-s") == 0 || wcscmp(arg, L"--scale") == 0)
+        {
+            if (argidx + 1 >= argc)
+            {
+                append_format(stderr_buffer, _(L"%ls: Expected scale after %ls\n"), argv[0], arg);
+                return MATH_STATUS_ERROR;
+            }
+            if (! math_parse_scale(argv[argidx + 1], &scale))
+                return MATH_STATUS_ERROR;
+            argidx += 2;
+        }
+        else if (wcsncmp(arg, L"-s", 2) == 0 && iswdigit(arg[2]))
+        {
+            /* Like -s3. Something like -sqrt(4) is an expression. */
+            if (! math_parse_scale(arg + 2, &scale))
+                return MATH_STATUS_ERROR;
+            argidx++;
+        }
+        else if (wcsncmp(arg, L"--scale=", 8) == 0)
+        {
+            if (! math_parse_scale(arg + 8, &scale))
+                return MATH_STATUS_ERROR;
+            argidx++;
+        }
+        else if (wcscmp(arg, L"--") == 0)
+        {
+            argidx++;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argidx >= argc)
+    {
+        append_format(stderr_buffer, _(L"%ls: Expected expression\n"), argv[0]);
+        builtin_print_help(parser, argv[0], stderr_buffer);
+        return MATH_STATUS_ERROR;
+    }
+
+    wcstring expression;
+    for (int i=argidx; i < argc; i++)
+    {
+        if (i > argidx)
+            expression.push_back(L' ');
+        expression.append(argv[i]);
+    }
+
+    /* Accept a leading bc scale statement */
+    size_t start = expression.find_first_not_of(L" \t");
+    if (start != wcstring::npos && expression.compare(start, 5, L"scale") == 0)
+    {
+        size_t eq = expression.find_first_not_of(L" \t", start + 5);
+        size_t semi = expression.find(L';', start);
+        if (eq != wcstring::npos && expression.at(eq) == L'=' && semi != wcstring::npos)
+        {
+            wcstring value = expression.substr(eq + 1, semi - eq - 1);
+            value.erase(0, value.find_first_not_of(L" \t"));
+            value.erase(value.find_last_not_of(L" \t") + 1);
+            if (! math_parse_scale(value.c_str(), &scale))
+                return MATH_STATUS_ERROR;
+            expression.erase(0, semi + 1);
+        }
+    }
+
+    math_number_t result;
+    math_parser_t mp(expression, scale);
+    if (! mp.evaluate(&result))
+    {
+        append_format(stderr_buffer, _(L"%ls: Error in expression '%ls': %ls\n"), argv[0], expression.c_str(), mp.get_error().c_str());
+        return MATH_STATUS_ERROR;
+    }
+
+    stdout_buffer.append(math_format(result));
+    stdout_buffer.push_back(L'\n');
+    return result.is_zero() ? MATH_STATUS_ZERO : STATUS_BUILTIN_OK;
+}
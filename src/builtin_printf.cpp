@@ -74,6 +74,13 @@ struct builtin_printf_state_t
                      bool have_precision, int precision,
                      wchar_t const *argument);
 
+    bool print_direc_directly(const wchar_t *start, size_t length, wchar_t conversion,
+                              bool have_field_width, int field_width,
+                              bool have_precision, int precision,
+                              wchar_t const *argument);
+
+    void append_padded_output(const wchar_t *str, size_t len, size_t width, bool left_justify, wchar_t pad);
+
     int print_formatted(const wchar_t *format, int argc, wchar_t **argv);
 
     void fatal_error(const wchar_t *format, ...);
@@ -231,6 +238,21 @@ void builtin_printf_state_t::append_output(const wchar_t *c)
     stdout_buffer.append(c);
 }
 
+/* Append str, of length len, padded with the pad character to the given width, on the left unless left_justify is set */
+void builtin_printf_state_t::append_padded_output(const wchar_t *str, size_t len, size_t width, bool left_justify, wchar_t pad)
+{
+    // Don't output if we're done
+    if (early_exit)
+        return;
+
+    const size_t padding = (width > len ? width - len : 0);
+    if (! left_justify)
+        stdout_buffer.append(padding, pad);
+    stdout_buffer.append(str, len);
+    if (left_justify)
+        stdout_buffer.append(padding, pad);
+}
+
 void builtin_printf_state_t::append_format_output(const wchar_t *fmt, ...)
 {
     // Don't output if we're done
@@ -441,11 +463,139 @@ void builtin_printf_state_t::print_esc_string(const wchar_t *str)
    HAVE_PRECISION are true, respectively.  ARGUMENT is the argument to
    be formatted.  */
 
+/* Print the %s, %d, %i, %o, %u, %x and %X directives that have at most a
+   width, a precision for %s, and the - or 0 flags, without going through
+   vswprintf, which is slow. Like vswprintf, this pads to the width in
+   characters. Returns false, printing nothing, for any other directive. */
+
+bool builtin_printf_state_t::print_direc_directly(const wchar_t *start, size_t length, wchar_t conversion,
+        bool have_field_width, int field_width,
+        bool have_precision, int precision,
+        wchar_t const *argument)
+{
+    const bool is_string = (conversion == L's');
+    if (! is_string && ! wcschr(L"dioux", conversion) && conversion != L'X')
+        return false;
+
+    /* Parse the directive, which we know to be well formed. Length modifiers are not part of it. */
+    bool left_justify = false, zero_pad = false;
+    size_t idx = 1;
+    for (; idx < length && (start[idx] == L'-' || start[idx] == L'0'); idx++)
+    {
+        if (start[idx] == L'-')
+            left_justify = true;
+        else
+            zero_pad = true;
+    }
+
+    long width = 0;
+    if (have_field_width)
+    {
+        /* A negative width from an argument means to left justify */
+        if (field_width == INT_MIN)
+            return false;
+        if (field_width < 0)
+            left_justify = true;
+        width = labs(field_width);
+        idx++;
+    }
+    else
+    {
+        for (; idx < length && iswdigit(start[idx]); idx++)
+        {
+            width = width * 10 + (start[idx] - L'0');
+            if (width > INT_MAX)
+                return false;
+        }
+    }
+
+    long max_len = -1;
+    if (idx < length && start[idx] == L'.')
+    {
+        /* Precision means a minimum number of digits for numbers; leave that to vswprintf */
+        if (! is_string)
+            return false;
+        idx++;
+        if (have_precision)
+        {
+            max_len = precision;
+            idx++;
+        }
+        else
+        {
+            max_len = 0;
+            for (; idx < length && iswdigit(start[idx]); idx++)
+            {
+                max_len = max_len * 10 + (start[idx] - L'0');
+                if (max_len > INT_MAX)
+                    return false;
+            }
+        }
+    }
+
+    /* Other flags, like + and #, are left to vswprintf */
+    if (idx != length)
+        return false;
+
+    if (is_string)
+    {
+        size_t len = wcslen(argument);
+        if (max_len >= 0 && (size_t)max_len < len)
+            len = max_len;
+        this->append_padded_output(argument, len, width, left_justify, L' ');
+        return true;
+    }
+
+    /* Format the number backwards, from its last digit */
+    uintmax_t magnitude;
+    bool negative = false;
+    if (conversion == L'd' || conversion == L'i')
+    {
+        intmax_t arg = string_to_scalar_type<intmax_t>(argument, this);
+        negative = (arg < 0);
+        magnitude = negative ? -(uintmax_t)arg : (uintmax_t)arg;
+    }
+    else
+    {
+        magnitude = string_to_scalar_type<uintmax_t>(argument, this);
+    }
+
+    const unsigned base = (conversion == L'o' ? 8 : (conversion == L'x' || conversion == L'X') ? 16 : 10);
+    const wchar_t *digits = (conversion == L'X' ? L"0123456789ABCDEF" : L"0123456789abcdef");
+    wchar_t buff[sizeof(uintmax_t) * CHAR_BIT + 1];
+    wchar_t *const buff_end = buff + sizeof buff / sizeof *buff;
+    wchar_t *cursor = buff_end;
+    do
+    {
+        *--cursor = digits[magnitude % base];
+        magnitude /= base;
+    } while (magnitude > 0);
+
+    if (zero_pad && ! left_justify)
+    {
+        /* Zeros go between the sign and the digits */
+        if (negative)
+        {
+            this->append_output(L'-');
+            width = (width > 0 ? width - 1 : 0);
+        }
+        this->append_padded_output(cursor, buff_end - cursor, width, false, L'0');
+        return true;
+    }
+    if (negative)
+        *--cursor = L'-';
+    this->append_padded_output(cursor, buff_end - cursor, width, left_justify, L' ');
+    return true;
+}
+
 void builtin_printf_state_t::print_direc(const wchar_t *start, size_t length, wchar_t conversion,
         bool have_field_width, int field_width,
         bool have_precision, int precision,
         wchar_t const *argument)
 {
+    if (this->print_direc_directly(start, length, conversion, have_field_width, field_width, have_precision, precision, argument))
+        return;
+
     // Start with everything except the conversion specifier
     wcstring fmt(start, length);
 
@@ -454,7 +604,10 @@ void builtin_printf_state_t::print_direc(const wchar_t *start, size_t length, wc
     {
         case L'd':
         case L'i':
+        case L'o':
         case L'u':
+        case L'x':
+        case L'X':
             fmt.append(L"ll");
             break;
         case L'a':
@@ -779,6 +932,7 @@ static int builtin_printf(parser_t &parser, wchar_t **argv)
     do
     {
         args_used = state.print_formatted(format, argc, argv);
+        builtin_flush_stdout();
         argc -= args_used;
         argv += args_used;
     }
@@ -0,0 +1,24 @@
+/** \file builtin_scripts.cpp
+
+    The functions and completions that ship with fish. When bundling is
+    enabled, the arrays are generated from share/functions and
+    share/completions by build_tools/bundle_scripts.sh.
+*/
+
+#include "config.h" // IWYU pragma: keep
+#include "builtin_scripts.h"
+
+#if USE_BUNDLED_SCRIPTS
+
+#include "builtin_scripts.inc"
+
+#else
+
+/* Nothing is bundled. The arrays can't be empty, so they hold one unused entry. */
+const builtin_script_t internal_function_scripts[] = {{NULL, NULL}};
+const size_t internal_function_scripts_count = 0;
+
+const builtin_script_t internal_completion_scripts[] = {{NULL, NULL}};
+const size_t internal_completion_scripts_count = 0;
+
+#endif
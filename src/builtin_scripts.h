@@ -0,0 +1,21 @@
+/** \file builtin_scripts.h
+
+    The functions and completions that ship with fish, compiled into
+    the executable when configured with --enable-bundled-scripts.
+*/
+
+#ifndef FISH_BUILTIN_SCRIPTS_H
+#define FISH_BUILTIN_SCRIPTS_H
+
+#include <stddef.h>
+#include "autoload.h"
+
+/** The shipped functions, sorted by name */
+extern const builtin_script_t internal_function_scripts[];
+extern const size_t internal_function_scripts_count;
+
+/** The shipped completions, sorted by name */
+extern const builtin_script_t internal_completion_scripts[];
+extern const size_t internal_completion_scripts_count;
+
+#endif
@@ -52,6 +52,39 @@ static int is_path_variable(const wchar_t *env)
     return contains(env, L"PATH", L"CDPATH");
 }
 
+/**
+   Print a description of an error code returned by env_set. Returns the exit status for it.
+*/
+static int report_env_set_error(const wchar_t *key, int code)
+{
+    int retcode = 0;
+    switch (code)
+    {
+        case ENV_PERM:
+        {
+            append_format(stderr_buffer, _(L"%ls: Tried to change the read-only variable '%ls'\n"), L"set", key);
+            retcode=1;
+            break;
+        }
+
+        case ENV_SCOPE:
+        {
+            append_format(stderr_buffer, _(L"%ls: Tried to set the special variable '%ls' with the wrong scope\n"), L"set", key);
+            retcode=1;
+            break;
+        }
+
+        case ENV_INVALID:
+        {
+            append_format(stderr_buffer, _(L"%ls: Tried to set the special variable '%ls' to an invalid value\n"), L"set", key);
+            retcode=1;
+            break;
+        }
+    }
+
+    return retcode;
+}
+
 /**
    Call env_set. If this is a path variable, e.g. PATH, validate the
    elements. On error, print a description of the problem to stderr.
@@ -59,7 +92,6 @@ static int is_path_variable(const wchar_t *env)
 static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope)
 {
     size_t i;
-    int retcode = 0;
     const wchar_t *val_str=NULL;
 
     if (is_path_variable(key))
@@ -148,35 +180,31 @@ static int my_env_set(const wchar_t *key, const wcstring_list_t &val, int scope)
         val_str = sb.c_str();
     }
 
-    switch (env_set(key, val_str, scope | ENV_USER))
-    {
-        case ENV_PERM:
-        {
-            append_format(stderr_buffer, _(L"%ls: Tried to change the read-only variable '%ls'\n"), L"set", key);
-            retcode=1;
-            break;
-        }
+    return report_env_set_error(key, env_set(key, val_str, scope | ENV_USER));
+}
 
-        case ENV_SCOPE:
-        {
-            append_format(stderr_buffer, _(L"%ls: Tried to set the special variable '%ls' with the wrong scope\n"), L"set", key);
-            retcode=1;
-            break;
-        }
 
-        case ENV_INVALID:
-        {
-            append_format(stderr_buffer, _(L"%ls: Tried to set the special variable '%ls' to an invalid value\n"), L"set", key);
-            retcode=1;
-            break;
-        }
+
+/**
+   Add values to the end or the start of a variable. Path variables go through my_env_set so the new elements are
+   validated, everything else is extended in place by env_set_append.
+*/
+static int my_env_append(const wchar_t *key, const wcstring_list_t &val, int scope, bool prepend)
+{
+    if (is_path_variable(key))
+    {
+        wcstring_list_t result;
+        const env_var_t existing = env_get_string(key, scope);
+        if (! existing.missing())
+            tokenize_variable_array(existing, result);
+        result.insert(prepend ? result.begin() : result.end(), val.begin(), val.end());
+        return my_env_set(key, result, scope);
     }
 
-    return retcode;
+    return report_env_set_error(key, env_set_append(key, val, scope | ENV_USER, prepend));
 }
 
 
-
 /**
   Extract indexes from a destination argument of the form name[index1 index2...]
 
@@ -385,6 +413,7 @@ static void print_variables(int include_values, int esc, bool shorten_ok, int sc
         }
 
         stdout_buffer.append(L"\n");
+        builtin_flush_stdout();
     }
 }
 
@@ -409,11 +438,13 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
         { L"universal", no_argument, 0, 'U' },
         { L"long", no_argument, 0, 'L' },
         { L"query", no_argument, 0, 'q' },
+        { L"append", no_argument, 0, 'a' },
+        { L"prepend", no_argument, 0, 'p' },
         { L"help", no_argument, 0, 'h' },
         { 0, 0, 0, 0 }
     } ;
 
-    const wchar_t *short_options = L"+xglenuULqh";
+    const wchar_t *short_options = L"+xglenuULqaph";
 
     int argc = builtin_count_args(argv);
 
@@ -423,6 +454,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
     int local = 0, global = 0, exportv = 0;
     int erase = 0, list = 0, unexport=0;
     int universal = 0, query=0;
+    int append = 0, prepend = 0;
     bool shorten_ok = true;
     bool preserve_incoming_failure_exit_status = true;
     const int incoming_exit_status = proc_get_last_status();
@@ -494,6 +526,14 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
                 preserve_incoming_failure_exit_status = false;
                 break;
 
+            case 'a':
+                append = 1;
+                break;
+
+            case 'p':
+                prepend = 1;
+                break;
+
             case 'h':
                 builtin_print_help(parser, argv[0], stdout_buffer);
                 return 0;
@@ -516,7 +556,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
       also specify scope
     */
 
-    if (query && (erase || list))
+    if (query && (erase || list || append || prepend))
     {
         append_format(stderr_buffer,
                       BUILTIN_ERR_COMBO,
@@ -527,8 +567,8 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
     }
 
 
-    /* We can't both list and erase variables */
-    if (erase && list)
+    /* We can't both list and erase variables, or add to them at the same time */
+    if (erase + list + append + prepend > 1)
     {
         append_format(stderr_buffer,
                       BUILTIN_ERR_COMBO,
@@ -691,7 +731,15 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
       using the whole array. We detect which mode is used here.
     */
 
-    if (slice)
+    if (slice && (append || prepend))
+    {
+        append_format(stderr_buffer,
+                      _(L"%ls: Values cannot be appended or prepended to a slice\n"),
+                      argv[0]);
+        builtin_print_help(parser, argv[0], stderr_buffer);
+        retcode = 1;
+    }
+    else if (slice)
     {
 
         /*
@@ -804,7 +852,10 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
             wcstring_list_t val;
             for (i=w.woptind; i<argc; i++)
                 val.push_back(argv[i]);
-            retcode = my_env_set(dest, val, scope);
+            if (append || prepend)
+                retcode = my_env_append(dest, val, scope, prepend != 0);
+            else
+                retcode = my_env_set(dest, val, scope);
         }
     }
 
@@ -812,8 +863,7 @@ static int builtin_set(parser_t &parser, wchar_t **argv)
        See https://github.com/fish-shell/fish-shell/issues/806
      */
 
-    env_var_t global_dest = env_get_string(dest, ENV_GLOBAL);
-    if (universal && ! global_dest.missing())
+    if (universal && ! env_get_string(dest, ENV_GLOBAL).missing())
     {
         append_format(stderr_buffer, _(L"%ls: Warning: universal scope selected, but a global variable '%ls' exists.\n"), L"set", dest);
     }
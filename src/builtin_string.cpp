@@ -0,0 +1,845 @@
+/** \file builtin_string.cpp
+  Functions for executing the string builtin.
+
+  The string builtin does the simple string manipulation that scripts would otherwise fork sed, tr, cut or grep for.
+  Each subcommand works on its arguments, or when it has none, on the lines of standard input.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <regex.h>
+#include <string>
+
+#include "fallback.h"
+#include "util.h"
+
+#include "wutil.h"
+#include "builtin.h"
+#include "proc.h"
+#include "parser.h"
+#include "common.h"
+#include "wgetopt.h"
+#include "wildcard.h"
+
+/** Exit status when the subcommand had nothing to do, e.g. nothing matched */
+#define STRING_STATUS_NONE 1
+
+/** Exit status for bad arguments */
+#define STRING_STATUS_ERROR 2
+
+/** The characters trimmed by default */
+#define STRING_TRIM_CHARS L" \f\n\r\t"
+
+/* We know about these buffers */
+extern wcstring stdout_buffer, stderr_buffer;
+
+/**
+   The strings a subcommand works on: the arguments after its options, or when there are none and standard input is
+   not a terminal, the lines of standard input. Lines are read as they are needed, so a subcommand streams over its
+   input.
+*/
+class string_args_t
+{
+    wchar_t **argv;
+    bool from_stdin;
+    bool at_eof;
+    std::string buffer;
+    size_t buffer_pos;
+    wcstring line;
+
+public:
+    string_args_t(wchar_t **args) : argv(args), from_stdin(false), at_eof(false), buffer_pos(0)
+    {
+        from_stdin = (*argv == NULL) && (builtin_stdin != STDIN_FILENO || ! isatty(builtin_stdin));
+    }
+
+    /* Returns the next string, or NULL if there are no more. The string is valid until the next call. */
+    const wchar_t *next()
+    {
+        if (! from_stdin)
+            return *argv ? *argv++ : NULL;
+
+        for (;;)
+        {
+            size_t line_end = buffer.find('\n', buffer_pos);
+            if (line_end != std::string::npos || (at_eof && buffer_pos < buffer.size()))
+            {
+                size_t end = (line_end == std::string::npos ? buffer.size() : line_end);
+                line = str2wcstring(buffer.data() + buffer_pos, end - buffer_pos);
+                buffer_pos = (line_end == std::string::npos ? buffer.size() : line_end + 1);
+                return line.c_str();
+            }
+            if (at_eof)
+                return NULL;
+
+            /* Drop the lines we have returned, and read more */
+            buffer.erase(0, buffer_pos);
+            buffer_pos = 0;
+            char buff[4096];
+            ssize_t amt = read_loop(builtin_stdin, buff, sizeof buff);
+            if (amt <= 0)
+                at_eof = true;
+            else
+                buffer.append(buff, amt);
+        }
+    }
+};
+
+/* Print a result on its own line, unless we are quiet */
+static void string_output(const wcstring &str, bool quiet)
+{
+    if (! quiet)
+    {
+        stdout_buffer.append(str);
+        stdout_buffer.push_back(L'\n');
+        builtin_flush_stdout();
+    }
+}
+
+static wcstring string_lowercase(const wchar_t *str)
+{
+    wcstring result(str);
+    for (size_t i=0; i < result.size(); i++)
+    {
+        result[i] = towlower(result[i]);
+    }
+    return result;
+}
+
+/* Report an option the subcommand does not know. The subcommand name is argv[0]. */
+static int string_unknown_option(parser_t &parser, wchar_t **argv, const wgetopter_t &w)
+{
+    append_format(stderr_buffer, BUILTIN_ERR_UNKNOWN, L"string", argv[w.woptind-1]);
+    builtin_print_help(parser, L"string", stderr_buffer);
+    return STRING_STATUS_ERROR;
+}
+
+static int string_missing_argument(parser_t &parser, wchar_t **argv)
+{
+    append_format(stderr_buffer, _(L"string %ls: Expected argument\n"), argv[0]);
+    builtin_print_help(parser, L"string", stderr_buffer);
+    return STRING_STATUS_ERROR;
+}
+
+/* Parse a number option, reporting an error if it is not a number */
+static bool string_parse_number(const wchar_t *subcmd, const wchar_t *arg, long *out)
+{
+    wchar_t *end;
+    errno = 0;
+    long result = wcstol(arg, &end, 10);
+    if (errno || *arg == L'\0' || *end != L'\0')
+    {
+        append_format(stderr_buffer, _(L"string %ls: Argument '%ls' is not a number\n"), subcmd, arg);
+        return false;
+    }
+    *out = result;
+    return true;
+}
+
+/* string length [-q] [STRING...] */
+static int string_length(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"q", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    int result = STRING_STATUS_NONE;
+    string_args_t args(argv + w.woptind);
+    while (const wchar_t *arg = args.next())
+    {
+        size_t len = wcslen(arg);
+        if (len > 0)
+            result = STATUS_BUILTIN_OK;
+        string_output(to_string(len), quiet);
+    }
+    return result;
+}
+
+/* string sub [-s START] [-l LENGTH] [-q] [STRING...] */
+static int string_sub(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"start", required_argument, 0, 's' },
+        { L"length", required_argument, 0, 'l' },
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false;
+    long start = 1, length = -1;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"s:l:q", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 's':
+                if (! string_parse_number(argv[0], w.woptarg, &start))
+                    return STRING_STATUS_ERROR;
+                if (start == 0)
+                {
+                    append_format(stderr_buffer, _(L"string %ls: The start must not be zero\n"), argv[0]);
+                    return STRING_STATUS_ERROR;
+                }
+                break;
+            case 'l':
+                if (! string_parse_number(argv[0], w.woptarg, &length))
+                    return STRING_STATUS_ERROR;
+                if (length < 0)
+                {
+                    append_format(stderr_buffer, _(L"string %ls: The length must not be negative\n"), argv[0]);
+                    return STRING_STATUS_ERROR;
+                }
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    int result = STRING_STATUS_NONE;
+    string_args_t args(argv + w.woptind);
+    while (const wchar_t *arg = args.next())
+    {
+        /* Positive starts count from 1 at the beginning, negative ones from -1 at the end */
+        const size_t len = wcslen(arg);
+        size_t pos;
+        if (start > 0)
+            pos = mini((size_t)(start - 1), len);
+        else
+            pos = (size_t)-start > len ? 0 : len - (size_t)-start;
+
+        size_t count = len - pos;
+        if (length >= 0 && (size_t)length < count)
+            count = (size_t)length;
+
+        if (count > 0)
+            result = STATUS_BUILTIN_OK;
+        string_output(wcstring(arg + pos, count), quiet);
+    }
+    return result;
+}
+
+/* string split [-m MAX] [-r] [-q] SEP [STRING...] */
+static int string_split(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"max", required_argument, 0, 'm' },
+        { L"right", no_argument, 0, 'r' },
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false, right = false;
+    long max = -1;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"m:rq", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'm':
+                if (! string_parse_number(argv[0], w.woptarg, &max))
+                    return STRING_STATUS_ERROR;
+                break;
+            case 'r':
+                right = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    if (w.woptind >= argc)
+        return string_missing_argument(parser, argv);
+    const wcstring sep = argv[w.woptind];
+
+    int result = STRING_STATUS_NONE;
+    string_args_t args(argv + w.woptind + 1);
+    while (const wchar_t *arg = args.next())
+    {
+        const wcstring str = arg;
+        wcstring_list_t pieces;
+
+        if (sep.empty())
+        {
+            /* Split into characters, keeping whatever the maximum leaves over in one piece */
+            size_t count = str.size();
+            if (max >= 0 && (size_t)max + 1 < count)
+                count = (size_t)max + 1;
+            for (size_t i=0; i < count; i++)
+            {
+                size_t idx = right ? str.size() - count + i : i;
+                bool last = right ? i == 0 : i + 1 == count;
+                if (last)
+                    pieces.push_back(right ? str.substr(0, idx + 1) : str.substr(idx));
+                else
+                    pieces.push_back(str.substr(idx, 1));
+            }
+            if (pieces.empty())
+                pieces.push_back(str);
+        }
+        else if (! right)
+        {
+            size_t start = 0, found;
+            while ((max < 0 || (long)pieces.size() < max) && (found = str.find(sep, start)) != wcstring::npos)
+            {
+                pieces.push_back(str.substr(start, found - start));
+                start = found + sep.size();
+            }
+            pieces.push_back(str.substr(start));
+        }
+        else
+        {
+            /* Split from the right, which only makes a difference with a maximum */
+            size_t end = str.size(), found;
+            wcstring_list_t reversed;
+            while ((max < 0 || (long)reversed.size() < max) && end >= sep.size() && (found = str.rfind(sep, end - sep.size())) != wcstring::npos)
+            {
+                reversed.push_back(str.substr(found + sep.size(), end - found - sep.size()));
+                end = found;
+            }
+            reversed.push_back(str.substr(0, end));
+            pieces.assign(reversed.rbegin(), reversed.rend());
+        }
+
+        if (pieces.size() > 1)
+            result = STATUS_BUILTIN_OK;
+        for (size_t i=0; i < pieces.size(); i++)
+        {
+            string_output(pieces.at(i), quiet);
+        }
+    }
+    return result;
+}
+
+/* string join [-q] SEP [STRING...] */
+static int string_join(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"q", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    if (w.woptind >= argc)
+        return string_missing_argument(parser, argv);
+    const wchar_t *sep = argv[w.woptind];
+
+    size_t count = 0;
+    wcstring joined;
+    string_args_t args(argv + w.woptind + 1);
+    while (const wchar_t *arg = args.next())
+    {
+        if (count++ > 0)
+            joined.append(sep);
+        joined.append(arg);
+    }
+
+    if (count > 0)
+        string_output(joined, quiet);
+    return count > 1 ? STATUS_BUILTIN_OK : STRING_STATUS_NONE;
+}
+
+/* string trim [-l] [-r] [-c CHARS] [-q] [STRING...] */
+static int string_trim(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"left", no_argument, 0, 'l' },
+        { L"right", no_argument, 0, 'r' },
+        { L"chars", required_argument, 0, 'c' },
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false, left = false, right = false;
+    const wchar_t *chars = STRING_TRIM_CHARS;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"lrc:q", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'l':
+                left = true;
+                break;
+            case 'r':
+                right = true;
+                break;
+            case 'c':
+                chars = w.woptarg;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    /* Neither side means both */
+    if (! left && ! right)
+        left = right = true;
+
+    int result = STRING_STATUS_NONE;
+    string_args_t args(argv + w.woptind);
+    while (const wchar_t *arg = args.next())
+    {
+        const size_t len = wcslen(arg);
+        size_t begin = 0, end = len;
+        if (left)
+        {
+            while (begin < end && wcschr(chars, arg[begin]))
+                begin++;
+        }
+        if (right)
+        {
+            while (end > begin && wcschr(chars, arg[end - 1]))
+                end--;
+        }
+        if (end - begin < len)
+            result = STATUS_BUILTIN_OK;
+        string_output(wcstring(arg + begin, end - begin), quiet);
+    }
+    return result;
+}
+
+/**
+   A POSIX extended regular expression, matched against the multibyte form of strings. Match positions are converted
+   back to character offsets.
+*/
+class string_regex_t
+{
+    regex_t regex;
+    bool compiled;
+
+public:
+    string_regex_t() : compiled(false)
+    {
+    }
+
+    ~string_regex_t()
+    {
+        if (compiled)
+            regfree(&regex);
+    }
+
+    /* Compile the pattern, reporting any error for the given subcommand */
+    bool compile(const wchar_t *subcmd, const wchar_t *pattern, bool ignore_case)
+    {
+        int err = regcomp(&regex, wcs2string(pattern).c_str(), REG_EXTENDED | (ignore_case ? REG_ICASE : 0));
+        if (err)
+        {
+            char msg[256];
+            regerror(err, &regex, msg, sizeof msg);
+            append_format(stderr_buffer, _(L"string %ls: Invalid regular expression '%ls': %s\n"), subcmd, pattern, msg);
+            return false;
+        }
+        compiled = true;
+        return true;
+    }
+
+    size_t group_count() const
+    {
+        return regex.re_nsub + 1;
+    }
+
+    /* Match against the narrow string starting at byte offset 'from'. The groups are byte ranges in the whole string; unmatched groups have rm_so of -1. */
+    bool match(const std::string &narrow, size_t from, std::vector<regmatch_t> *groups) const
+    {
+        groups->resize(group_count());
+        if (regexec(&regex, narrow.c_str() + from, groups->size(), &groups->at(0), from > 0 ? REG_NOTBOL : 0) != 0)
+            return false;
+        for (size_t i=0; i < groups->size(); i++)
+        {
+            regmatch_t &group = groups->at(i);
+            if (group.rm_so >= 0)
+            {
+                group.rm_so += from;
+                group.rm_eo += from;
+            }
+        }
+        return true;
+    }
+};
+
+/* The number of bytes of the (UTF-8) character at the given byte offset, for stepping past an empty match */
+static size_t string_char_bytes(const std::string &narrow, size_t byte_offset)
+{
+    size_t len = 1;
+    while (byte_offset + len < narrow.size() && (narrow.at(byte_offset + len) & 0xC0) == 0x80)
+        len++;
+    return len;
+}
+
+/* The characters of the narrow string up to the given byte offset */
+static size_t string_char_offset(const std::string &narrow, size_t byte_offset)
+{
+    return str2wcstring(narrow.data(), byte_offset).size();
+}
+
+/* Turn a glob with * and ? into a wildcard. A backslash makes the next character literal. */
+static wcstring string_glob_to_wildcard(const wchar_t *glob)
+{
+    wcstring result;
+    for (; *glob; glob++)
+    {
+        if (*glob == L'\\' && glob[1])
+            result.push_back(*++glob);
+        else if (*glob == L'*')
+            result.push_back(ANY_STRING);
+        else if (*glob == L'?')
+            result.push_back(ANY_CHAR);
+        else
+            result.push_back(*glob);
+    }
+    return result;
+}
+
+/* string match [-a] [-i] [-r] [-n] [-q] PATTERN [STRING...] */
+static int string_match(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"all", no_argument, 0, 'a' },
+        { L"ignore-case", no_argument, 0, 'i' },
+        { L"regex", no_argument, 0, 'r' },
+        { L"index", no_argument, 0, 'n' },
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false, all = false, ignore_case = false, regex = false, index = false;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"airnq", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                ignore_case = true;
+                break;
+            case 'r':
+                regex = true;
+                break;
+            case 'n':
+                index = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    if (w.woptind >= argc)
+        return string_missing_argument(parser, argv);
+    const wchar_t *pattern = argv[w.woptind];
+
+    string_regex_t re;
+    if (regex && ! re.compile(argv[0], pattern, ignore_case))
+        return STRING_STATUS_ERROR;
+    const wildcard_pattern_t glob(string_glob_to_wildcard(ignore_case ? string_lowercase(pattern).c_str() : pattern));
+
+    int result = STRING_STATUS_NONE;
+    std::vector<regmatch_t> groups;
+    string_args_t args(argv + w.woptind + 1);
+    while (const wchar_t *arg = args.next())
+    {
+        if (! regex)
+        {
+            /* A glob matches the whole string */
+            if (glob.match(ignore_case ? string_lowercase(arg) : wcstring(arg)))
+            {
+                result = STATUS_BUILTIN_OK;
+                string_output(index ? format_string(L"1 %lu", (unsigned long)wcslen(arg)) : wcstring(arg), quiet);
+            }
+            continue;
+        }
+
+        /* A regular expression prints the match and each of its groups */
+        const std::string narrow = wcs2string(arg);
+        size_t from = 0;
+        while (from <= narrow.size() && re.match(narrow, from, &groups))
+        {
+            result = STATUS_BUILTIN_OK;
+            if (quiet)
+                break;
+
+            for (size_t i=0; i < groups.size(); i++)
+            {
+                const regmatch_t &group = groups.at(i);
+                if (group.rm_so < 0)
+                    continue;
+                if (index)
+                {
+                    size_t start = string_char_offset(narrow, group.rm_so);
+                    size_t end = string_char_offset(narrow, group.rm_eo);
+                    string_output(format_string(L"%lu %lu", (unsigned long)start + 1, (unsigned long)(end - start)), quiet);
+                }
+                else
+                {
+                    string_output(str2wcstring(narrow.data() + group.rm_so, group.rm_eo - group.rm_so), quiet);
+                }
+            }
+
+            if (! all)
+                break;
+            /* Step past an empty match so we make progress */
+            from = groups.at(0).rm_eo;
+            if (groups.at(0).rm_eo == groups.at(0).rm_so)
+                from += string_char_bytes(narrow, from);
+        }
+    }
+    return result;
+}
+
+/* Expand \0 through \9 in a regular expression replacement to the groups of a match. A backslash before anything else is kept literally, except that \\ is a backslash. */
+static void string_append_replacement(std::string *out, const std::string &replacement, const std::string &narrow, const std::vector<regmatch_t> &groups)
+{
+    for (size_t i=0; i < replacement.size(); i++)
+    {
+        char c = replacement.at(i);
+        if (c == '\\' && i + 1 < replacement.size())
+        {
+            char next = replacement.at(i + 1);
+            if (next >= '0' && next <= '9')
+            {
+                size_t group_idx = next - '0';
+                if (group_idx < groups.size() && groups.at(group_idx).rm_so >= 0)
+                {
+                    const regmatch_t &group = groups.at(group_idx);
+                    out->append(narrow, group.rm_so, group.rm_eo - group.rm_so);
+                }
+                i++;
+                continue;
+            }
+            if (next == '\\')
+            {
+                out->push_back('\\');
+                i++;
+                continue;
+            }
+        }
+        out->push_back(c);
+    }
+}
+
+/* string replace [-a] [-i] [-r] [-q] PATTERN REPLACEMENT [STRING...] */
+static int string_replace(parser_t &parser, int argc, wchar_t **argv)
+{
+    const struct woption long_options[] =
+    {
+        { L"all", no_argument, 0, 'a' },
+        { L"ignore-case", no_argument, 0, 'i' },
+        { L"regex", no_argument, 0, 'r' },
+        { L"quiet", no_argument, 0, 'q' },
+        { 0, 0, 0, 0 }
+    };
+    bool quiet = false, all = false, ignore_case = false, regex = false;
+
+    wgetopter_t w;
+    for (;;)
+    {
+        int c = w.wgetopt_long(argc, argv, L"airq", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c)
+        {
+            case 'a':
+                all = true;
+                break;
+            case 'i':
+                ignore_case = true;
+                break;
+            case 'r':
+                regex = true;
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                return string_unknown_option(parser, argv, w);
+        }
+    }
+
+    if (w.woptind + 1 >= argc)
+        return string_missing_argument(parser, argv);
+    const wchar_t *pattern = argv[w.woptind];
+    const wchar_t *replacement = argv[w.woptind + 1];
+
+    string_regex_t re;
+    if (regex && ! re.compile(argv[0], pattern, ignore_case))
+        return STRING_STATUS_ERROR;
+    const std::string narrow_replacement = wcs2string(replacement);
+    const wcstring needle = ignore_case ? string_lowercase(pattern) : wcstring(pattern);
+
+    int result = STRING_STATUS_NONE;
+    std::vector<regmatch_t> groups;
+    string_args_t args(argv + w.woptind + 2);
+    while (const wchar_t *arg = args.next())
+    {
+        wcstring replaced;
+        bool did_replace = false;
+
+        if (! regex)
+        {
+            /* Literal replacement. An empty pattern never matches. */
+            const wcstring str = arg;
+            const wcstring haystack = ignore_case ? string_lowercase(arg) : str;
+            size_t start = 0, found;
+            while (! needle.empty() && (found = haystack.find(needle, start)) != wcstring::npos)
+            {
+                replaced.append(str, start, found - start);
+                replaced.append(replacement);
+                start = found + needle.size();
+                did_replace = true;
+                if (! all)
+                    break;
+            }
+            replaced.append(str, start, wcstring::npos);
+        }
+        else
+        {
+            const std::string narrow = wcs2string(arg);
+            std::string out;
+            size_t from = 0;
+            while (from <= narrow.size() && re.match(narrow, from, &groups))
+            {
+                const regmatch_t &whole = groups.at(0);
+                out.append(narrow, from, whole.rm_so - from);
+                string_append_replacement(&out, narrow_replacement, narrow, groups);
+                did_replace = true;
+                from = whole.rm_eo;
+                if (! all)
+                    break;
+                if (whole.rm_eo == whole.rm_so)
+                {
+                    /* Keep the character after an empty match, and look for the next match after it */
+                    size_t step = string_char_bytes(narrow, from);
+                    if (from < narrow.size())
+                        out.append(narrow, from, step);
+                    from += step;
+                }
+            }
+            if (from < narrow.size())
+                out.append(narrow, from, std::string::npos);
+            replaced = str2wcstring(out);
+        }
+
+        if (did_replace)
+            result = STATUS_BUILTIN_OK;
+        string_output(replaced, quiet);
+    }
+    return result;
+}
+
+/** The string subcommands */
+static const struct string_subcommand_t
+{
+    const wchar_t *name;
+    int (*handler)(parser_t &, int argc, wchar_t **argv);
+}
+string_subcommands[] =
+{
+    { L"join", &string_join },
+    { L"length", &string_length },
+    { L"match", &string_match },
+    { L"replace", &string_replace },
+    { L"split", &string_split },
+    { L"sub", &string_sub },
+    { L"trim", &string_trim },
+};
+
+/**
+   The string builtin
+*/
+static int builtin_string(parser_t &parser, wchar_t **argv)
+{
+    int argc = builtin_count_args(argv);
+    if (argc <= 1)
+    {
+        append_format(stderr_buffer, _(L"string: Expected subcommand\n"));
+        builtin_print_help(parser, L"string", stderr_buffer);
+        return STRING_STATUS_ERROR;
+    }
+
+    if (wcscmp(argv[1], L"-h") == 0 || wcscmp(argv[1], L"--help") == 0)
+    {
+        builtin_print_help(parser, L"string", stdout_buffer);
+        return STATUS_BUILTIN_OK;
+    }
+
+    for (size_t i=0; i < sizeof string_subcommands / sizeof *string_subcommands; i++)
+    {
+        if (wcscmp(argv[1], string_subcommands[i].name) == 0)
+        {
+            /* The subcommand sees itself as argv[0] */
+            return string_subcommands[i].handler(parser, argc - 1, argv + 1);
+        }
+    }
+
+    append_format(stderr_buffer, _(L"string: Unknown subcommand '%ls'\n"), argv[1]);
+    builtin_print_help(parser, L"string", stderr_buffer);
+    return STRING_STATUS_ERROR;
+}
@@ -13,7 +13,9 @@ Implemented from scratch (yes, really) by way of IEEE 1003.1 as reference.
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <memory>
+#include <vector>
 
 
 enum
@@ -75,14 +77,61 @@ enum token_t
     test_paren_close,             // ")", close paren
 };
 
+/* The results of the system calls made for one file while evaluating an expression */
+struct file_status_t
+{
+    wcstring path;
+
+    /* Whether wstat and lwstat have been called, and the errno they failed with, or 0 */
+    bool stat_done;
+    bool lstat_done;
+    int stat_error;
+    int lstat_error;
+    struct stat stat_buf;
+    struct stat lstat_buf;
+
+    /* Access modes that have been tested, and those of them that were granted */
+    int access_tested;
+    int access_granted;
+
+    /* Access modes the expression asks about, which are tested together the first time one of them is needed */
+    int access_wanted;
+
+    file_status_t() : stat_done(false), lstat_done(false), stat_error(0), lstat_error(0), access_tested(0), access_granted(0), access_wanted(0)
+    { }
+};
+
+/* Remembers the status of each file an expression tests, so that tests like 'test -f $f -a -r $f -a -x $f' call stat and access once per file rather than once per primary. It lives only as long as one evaluation, so it never returns stale results across invocations. */
+class file_cache_t
+{
+private:
+    /* Expressions name few files, so a list is quicker than a map */
+    std::vector<file_status_t> files;
+
+    /* Returns the status of the file, adding an untested one if there is none */
+    file_status_t &status_for(const wcstring &path);
+
+public:
+    /* Notes that the expression will test the access mode on the file */
+    void want_access(const wcstring &path, int mode);
+
+    /* Returns the result of stat or lstat on the file, or NULL if it failed */
+    const struct stat *stat(const wcstring &path);
+    const struct stat *lstat(const wcstring &path);
+
+    /* Returns whether access grants the mode on the file */
+    bool access(const wcstring &path, int mode);
+};
+
 static bool binary_primary_evaluate(test_expressions::token_t token, const wcstring &left, const wcstring &right, wcstring_list_t &errors);
-static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg, wcstring_list_t &errors);
+static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg, file_cache_t &files, wcstring_list_t &errors);
 
 
 enum
 {
     UNARY_PRIMARY = 1 << 0,
-    BINARY_PRIMARY = 1 << 1
+    BINARY_PRIMARY = 1 << 1,
+    FILE_PRIMARY = 1 << 2
 };
 
 static const struct token_info_t
@@ -94,24 +143,24 @@ static const struct token_info_t
 {
     {test_unknown, L"", 0},
     {test_bang, L"!", 0},
-    {test_filetype_b, L"-b", UNARY_PRIMARY},
-    {test_filetype_c, L"-c", UNARY_PRIMARY},
-    {test_filetype_d, L"-d", UNARY_PRIMARY},
-    {test_filetype_e, L"-e", UNARY_PRIMARY},
-    {test_filetype_f, L"-f", UNARY_PRIMARY},
-    {test_filetype_G, L"-G", UNARY_PRIMARY},
-    {test_filetype_g, L"-g", UNARY_PRIMARY},
-    {test_filetype_h, L"-h", UNARY_PRIMARY},
-    {test_filetype_L, L"-L", UNARY_PRIMARY},
-    {test_filetype_O, L"-O", UNARY_PRIMARY},
-    {test_filetype_p, L"-p", UNARY_PRIMARY},
-    {test_filetype_S, L"-S", UNARY_PRIMARY},
-    {test_filesize_s, L"-s", UNARY_PRIMARY},
+    {test_filetype_b, L"-b", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_c, L"-c", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_d, L"-d", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_e, L"-e", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_f, L"-f", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_G, L"-G", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_g, L"-g", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_h, L"-h", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_L, L"-L", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_O, L"-O", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_p, L"-p", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filetype_S, L"-S", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_filesize_s, L"-s", UNARY_PRIMARY | FILE_PRIMARY},
     {test_filedesc_t, L"-t", UNARY_PRIMARY},
-    {test_fileperm_r, L"-r", UNARY_PRIMARY},
-    {test_fileperm_u, L"-u", UNARY_PRIMARY},
-    {test_fileperm_w, L"-w", UNARY_PRIMARY},
-    {test_fileperm_x, L"-x", UNARY_PRIMARY},
+    {test_fileperm_r, L"-r", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_fileperm_u, L"-u", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_fileperm_w, L"-w", UNARY_PRIMARY | FILE_PRIMARY},
+    {test_fileperm_x, L"-x", UNARY_PRIMARY | FILE_PRIMARY},
     {test_string_n, L"-n", UNARY_PRIMARY},
     {test_string_z, L"-z", UNARY_PRIMARY},
     {test_string_equal, L"=", BINARY_PRIMARY},
@@ -158,11 +207,13 @@ const token_info_t *token_for_string(const wcstring &str)
 */
 
 class expression;
+struct range_t;
 class test_parser
 {
 private:
     wcstring_list_t strings;
     wcstring_list_t errors;
+    file_cache_t *files;
 
     expression *error(const wchar_t *fmt, ...);
     void add_error(const wchar_t *fmt, ...);
@@ -173,7 +224,7 @@ private:
     }
 
 public:
-    test_parser(const wcstring_list_t &val) : strings(val)
+    test_parser(const wcstring_list_t &val, file_cache_t *f) : strings(val), files(f)
     { }
 
     expression *parse_expression(unsigned int start, unsigned int end);
@@ -187,8 +238,13 @@ public:
     expression *parse_unary_primary(unsigned int start, unsigned int end);
     expression *parse_binary_primary(unsigned int start, unsigned int end);
     expression *parse_just_a_string(unsigned int start, unsigned int end);
+    expression *parse_file_list(unsigned int start, unsigned int end);
 
-    static expression *parse_args(const wcstring_list_t &args, wcstring &err);
+    /* Creates a unary primary, noting any access mode it tests */
+    expression *make_unary_primary(token_t tok, range_t where, const wcstring &what);
+
+    /* Parses the arguments into an expression, telling files which access modes it tests */
+    static expression *parse_args(const wcstring_list_t &args, wcstring &err, file_cache_t *files);
 };
 
 struct range_t
@@ -213,7 +269,7 @@ public:
     virtual ~expression() { }
 
     // evaluate returns true if the expression is true (i.e. BUILTIN_TEST_SUCCESS)
-    virtual bool evaluate(wcstring_list_t &errors) = 0;
+    virtual bool evaluate(file_cache_t &files, wcstring_list_t &errors) = 0;
 };
 
 typedef std::auto_ptr<expression> expr_ref_t;
@@ -224,7 +280,7 @@ class unary_primary : public expression
 public:
     wcstring arg;
     unary_primary(token_t tok, range_t where, const wcstring &what) : expression(tok, where), arg(what) { }
-    bool evaluate(wcstring_list_t &errors);
+    bool evaluate(file_cache_t &files, wcstring_list_t &errors);
 };
 
 /* Two argument primary like foo != bar */
@@ -236,7 +292,7 @@ public:
 
     binary_primary(token_t tok, range_t where, const wcstring &left, const wcstring &right) : expression(tok, where), arg_left(left), arg_right(right)
     { }
-    bool evaluate(wcstring_list_t &errors);
+    bool evaluate(file_cache_t &files, wcstring_list_t &errors);
 };
 
 /* Unary operator like bang */
@@ -245,7 +301,7 @@ class unary_operator : public expression
 public:
     expr_ref_t subject;
     unary_operator(token_t tok, range_t where, expr_ref_t &exp) : expression(tok, where), subject(exp) { }
-    bool evaluate(wcstring_list_t &errors);
+    bool evaluate(file_cache_t &files, wcstring_list_t &errors);
 };
 
 /* Combining expression. Contains a list of AND or OR expressions. It takes more than two so that we don't have to worry about precedence in the parser. */
@@ -270,7 +326,7 @@ public:
         }
     }
 
-    bool evaluate(wcstring_list_t &errors);
+    bool evaluate(file_cache_t &files, wcstring_list_t &errors);
 };
 
 /* Parenthetical expression */
@@ -280,7 +336,7 @@ public:
     expr_ref_t contents;
     parenthetical_expression(token_t tok, range_t where, expr_ref_t &expr) : expression(tok, where), contents(expr) { }
 
-    virtual bool evaluate(wcstring_list_t &errors);
+    virtual bool evaluate(file_cache_t &files, wcstring_list_t &errors);
 };
 
 void test_parser::add_error(const wchar_t *fmt, ...)
@@ -403,7 +459,29 @@ expression *test_parser::parse_unary_primary(unsigned int start, unsigned int en
     if (!(info->flags & UNARY_PRIMARY))
         return NULL;
 
-    return new unary_primary(info->tok, range_t(start, start + 2), arg(start + 1));
+    return make_unary_primary(info->tok, range_t(start, start + 2), arg(start + 1));
+}
+
+expression *test_parser::make_unary_primary(token_t tok, range_t where, const wcstring &what)
+{
+    int mode = 0;
+    switch (tok)
+    {
+        case test_fileperm_r:
+            mode = R_OK;
+            break;
+        case test_fileperm_w:
+            mode = W_OK;
+            break;
+        case test_fileperm_x:
+            mode = X_OK;
+            break;
+        default:
+            break;
+    }
+    if (mode)
+        files->want_access(what, mode);
+    return new unary_primary(tok, where, what);
 }
 
 expression *test_parser::parse_just_a_string(unsigned int start, unsigned int end)
@@ -429,6 +507,32 @@ expression *test_parser::parse_just_a_string(unsigned int start, unsigned int en
     return new unary_primary(test_string_n, range_t(start, start + 1), arg(start));
 }
 
+/* Parse a file primary followed by several files, like 'test -f a b c', as the primary applied to each file, combined with AND. Such a list does not parse as any other expression, so this does not change the meaning of a valid one. The files must not look like operators. */
+expression *test_parser::parse_file_list(unsigned int start, unsigned int end)
+{
+    /* We need the primary and at least two files */
+    if (start + 3 > end)
+        return NULL;
+
+    const token_info_t *info = token_for_string(arg(start));
+    if (!(info->flags & FILE_PRIMARY))
+        return NULL;
+
+    for (unsigned int idx = start + 1; idx < end; idx++)
+    {
+        if (token_for_string(arg(idx))->tok != test_unknown)
+            return NULL;
+    }
+
+    std::vector<expression *> subjects;
+    for (unsigned int idx = start + 1; idx < end; idx++)
+    {
+        subjects.push_back(make_unary_primary(info->tok, range_t(idx, idx + 1), arg(idx)));
+    }
+    const std::vector<token_t> combiners(subjects.size() - 1, test_combine_and);
+    return new combining_expression(test_combine_and, range_t(start, end), subjects, combiners);
+}
+
 #if 0
 expression *test_parser::parse_unary_primary(unsigned int start, unsigned int end)
 {
@@ -639,14 +743,26 @@ expression *test_parser::parse_expression(unsigned int start, unsigned int end)
     }
 }
 
-expression *test_parser::parse_args(const wcstring_list_t &args, wcstring &err)
+expression *test_parser::parse_args(const wcstring_list_t &args, wcstring &err, file_cache_t *files)
 {
     /* Empty list and one-arg list should be handled by caller */
     assert(args.size() > 1);
 
-    test_parser parser(args);
+    test_parser parser(args, files);
     expression *result = parser.parse_expression(0, (unsigned int)args.size());
 
+    /* Arguments that are not an expression may still be a list of files */
+    if (! result || result->range.end < args.size())
+    {
+        expression *file_list = parser.parse_file_list(0, (unsigned int)args.size());
+        if (file_list)
+        {
+            delete result;
+            result = file_list;
+            parser.errors.clear();
+        }
+    }
+
     /* Handle errors */
     for (size_t i = 0; i < parser.errors.size(); i++)
     {
@@ -676,23 +792,23 @@ expression *test_parser::parse_args(const wcstring_list_t &args, wcstring &err)
     return result;
 }
 
-bool unary_primary::evaluate(wcstring_list_t &errors)
+bool unary_primary::evaluate(file_cache_t &files, wcstring_list_t &errors)
 {
-    return unary_primary_evaluate(token, arg, errors);
+    return unary_primary_evaluate(token, arg, files, errors);
 }
 
-bool binary_primary::evaluate(wcstring_list_t &errors)
+bool binary_primary::evaluate(file_cache_t &files, wcstring_list_t &errors)
 {
     return binary_primary_evaluate(token, arg_left, arg_right, errors);
 }
 
-bool unary_operator::evaluate(wcstring_list_t &errors)
+bool unary_operator::evaluate(file_cache_t &files, wcstring_list_t &errors)
 {
     switch (token)
     {
         case test_bang:
             assert(subject.get());
-            return ! subject->evaluate(errors);
+            return ! subject->evaluate(files, errors);
         default:
             errors.push_back(format_string(L"Unknown token type in %s", __func__));
             return false;
@@ -700,7 +816,7 @@ bool unary_operator::evaluate(wcstring_list_t &errors)
     }
 }
 
-bool combining_expression::evaluate(wcstring_list_t &errors)
+bool combining_expression::evaluate(file_cache_t &files, wcstring_list_t &errors)
 {
     switch (token)
     {
@@ -709,7 +825,7 @@ bool combining_expression::evaluate(wcstring_list_t &errors)
         {
             /* One-element case */
             if (subjects.size() == 1)
-                return subjects.at(0)->evaluate(errors);
+                return subjects.at(0)->evaluate(files, errors);
 
             /* Evaluate our lists, remembering that AND has higher precedence than OR. We can visualize this as a sequence of OR expressions of AND expressions. */
             assert(combiners.size() + 1 == subjects.size());
@@ -730,7 +846,7 @@ bool combining_expression::evaluate(wcstring_list_t &errors)
                 for (; idx < max; idx++)
                 {
                     /* Evaluate it, short-circuiting */
-                    and_result = and_result && subjects.at(idx)->evaluate(errors);
+                    and_result = and_result && subjects.at(idx)->evaluate(files, errors);
 
                     /* If the combiner at this index (which corresponding to how we combine with the next subject) is not AND, then exit the loop */
                     if (idx + 1 < max && combiners.at(idx) != test_combine_and)
@@ -753,9 +869,90 @@ bool combining_expression::evaluate(wcstring_list_t &errors)
     }
 }
 
-bool parenthetical_expression::evaluate(wcstring_list_t &errors)
+bool parenthetical_expression::evaluate(file_cache_t &files, wcstring_list_t &errors)
+{
+    return contents->evaluate(files, errors);
+}
+
+file_status_t &file_cache_t::status_for(const wcstring &path)
+{
+    for (size_t i=0; i < files.size(); i++)
+    {
+        if (files[i].path == path)
+            return files[i];
+    }
+    files.resize(files.size() + 1);
+    files.back().path = path;
+    return files.back();
+}
+
+void file_cache_t::want_access(const wcstring &path, int mode)
+{
+    status_for(path).access_wanted |= mode;
+}
+
+const struct stat *file_cache_t::stat(const wcstring &path)
 {
-    return contents->evaluate(errors);
+    file_status_t &status = status_for(path);
+    if (! status.stat_done)
+    {
+        status.stat_done = true;
+        if (status.lstat_done && status.lstat_error == 0 && ! S_ISLNK(status.lstat_buf.st_mode))
+        {
+            /* Not a symlink, so stat would find the same file */
+            status.stat_buf = status.lstat_buf;
+        }
+        else if (status.lstat_done && (status.lstat_error == ENOENT || status.lstat_error == ENOTDIR))
+        {
+            status.stat_error = status.lstat_error;
+        }
+        else if (wstat(path, &status.stat_buf))
+        {
+            status.stat_error = errno;
+        }
+    }
+    return status.stat_error ? NULL : &status.stat_buf;
+}
+
+const struct stat *file_cache_t::lstat(const wcstring &path)
+{
+    file_status_t &status = status_for(path);
+    if (! status.lstat_done)
+    {
+        status.lstat_done = true;
+        if (lwstat(path, &status.lstat_buf))
+        {
+            status.lstat_error = errno;
+        }
+    }
+    return status.lstat_error ? NULL : &status.lstat_buf;
+}
+
+bool file_cache_t::access(const wcstring &path, int mode)
+{
+    file_status_t &status = status_for(path);
+    if ((status.access_tested & mode) != mode)
+    {
+        /* Try all the modes we are going to want at once; if that fails, fall back to just this one */
+        const int together = (status.access_wanted & ~status.access_tested) | mode;
+        if (status.stat_done && (status.stat_error == ENOENT || status.stat_error == ENOTDIR))
+        {
+            /* The file does not exist, so access would fail too */
+            status.access_tested |= mode;
+        }
+        else if (together != mode && ! waccess(path, together))
+        {
+            status.access_tested |= together;
+            status.access_granted |= together;
+        }
+        else
+        {
+            status.access_tested |= mode;
+            if (! waccess(path, mode))
+                status.access_granted |= mode;
+        }
+    }
+    return (status.access_granted & mode) == mode;
 }
 
 /* IEEE 1003.1 says nothing about what it means for two strings to be "algebraically equal". For example, should we interpret 0x10 as 0, 10, or 16? Here we use only base 10 and use wcstoll, which allows for leading + and -, and leading whitespace. This matches bash. */
@@ -804,64 +1001,64 @@ static bool binary_primary_evaluate(test_expressions::token_t token, const wcstr
 }
 
 
-static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg, wcstring_list_t &errors)
+static bool unary_primary_evaluate(test_expressions::token_t token, const wcstring &arg, file_cache_t &files, wcstring_list_t &errors)
 {
     using namespace test_expressions;
-    struct stat buf;
+    const struct stat *buf;
     long long num;
     switch (token)
     {
         case test_filetype_b:            // "-b", for block special files
-            return !wstat(arg, &buf) && S_ISBLK(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISBLK(buf->st_mode);
 
         case test_filetype_c:            // "-c", for character special files
-            return !wstat(arg, &buf) && S_ISCHR(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISCHR(buf->st_mode);
 
         case test_filetype_d:            // "-d", for directories
-            return !wstat(arg, &buf) && S_ISDIR(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISDIR(buf->st_mode);
 
         case test_filetype_e:            // "-e", for files that exist
-            return !wstat(arg, &buf);
+            return files.stat(arg) != NULL;
 
         case test_filetype_f:            // "-f", for for regular files
-            return !wstat(arg, &buf) && S_ISREG(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISREG(buf->st_mode);
 
         case test_filetype_G:            // "-G", for check effective group id
-            return !wstat(arg, &buf) && getegid() == buf.st_gid;
+            return (buf = files.stat(arg)) && getegid() == buf->st_gid;
 
         case test_filetype_g:            // "-g", for set-group-id
-            return !wstat(arg, &buf) && (S_ISGID & buf.st_mode);
+            return (buf = files.stat(arg)) && (S_ISGID & buf->st_mode);
 
         case test_filetype_h:            // "-h", for symbolic links
         case test_filetype_L:            // "-L", same as -h
-            return !lwstat(arg, &buf) && S_ISLNK(buf.st_mode);
+            return (buf = files.lstat(arg)) && S_ISLNK(buf->st_mode);
 
         case test_filetype_O:            // "-O", for check effective user id
-            return !wstat(arg, &buf) && geteuid() == buf.st_uid;
+            return (buf = files.stat(arg)) && geteuid() == buf->st_uid;
 
         case test_filetype_p:            // "-p", for FIFO
-            return !wstat(arg, &buf) && S_ISFIFO(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISFIFO(buf->st_mode);
 
         case test_filetype_S:            // "-S", socket
-            return !wstat(arg, &buf) && S_ISSOCK(buf.st_mode);
+            return (buf = files.stat(arg)) && S_ISSOCK(buf->st_mode);
 
         case test_filesize_s:            // "-s", size greater than zero
-            return !wstat(arg, &buf) && buf.st_size > 0;
+            return (buf = files.stat(arg)) && buf->st_size > 0;
 
         case test_filedesc_t:            // "-t", whether the fd is associated with a terminal
             return parse_number(arg, &num) && num == (int)num && isatty((int)num);
 
         case test_fileperm_r:            // "-r", read permission
-            return !waccess(arg, R_OK);
+            return files.access(arg, R_OK);
 
         case test_fileperm_u:            // "-u", whether file is setuid
-            return !wstat(arg, &buf) && (S_ISUID & buf.st_mode);
+            return (buf = files.stat(arg)) && (S_ISUID & buf->st_mode);
 
         case test_fileperm_w:            // "-w", whether file write permission is allowed
-            return !waccess(arg, W_OK);
+            return files.access(arg, W_OK);
 
         case test_fileperm_x:            // "-x", whether file execute/search is allowed
-            return !waccess(arg, X_OK);
+            return files.access(arg, X_OK);
 
         case test_string_n:              // "-n", non-empty string
             return ! arg.empty();
@@ -937,7 +1134,8 @@ int builtin_test(parser_t &parser, wchar_t **argv)
         {
             // Try parsing. If expr is not nil, we are responsible for deleting it.
             wcstring err;
-            expression *expr = test_parser::parse_args(args, err);
+            file_cache_t files;
+            expression *expr = test_parser::parse_args(args, err, &files);
             if (! expr)
             {
 #if 0
@@ -954,7 +1152,7 @@ int builtin_test(parser_t &parser, wchar_t **argv)
             else
             {
                 wcstring_list_t eval_errors;
-                bool result = expr->evaluate(eval_errors);
+                bool result = expr->evaluate(files, eval_errors);
                 if (! eval_errors.empty())
                 {
                     printf("test returned eval errors:\n");
@@ -47,6 +47,7 @@ parts of fish.
 #include "common.h"
 #include "expand.h"
 #include "wildcard.h"
+#include "utf8.h"
 
 #include "util.cpp"
 #include "fallback.cpp"
@@ -64,17 +65,27 @@ wchar_t omitted_newline_char;
 
 bool g_profiling_active = false;
 
+bool g_startup_timings_active = false;
+
+/* When startup timings began */
+static long long s_startup_time = 0;
+
 const wchar_t *program_name;
 
 int debug_level=1;
 
 /**
-   This struct maintains the current state of the terminal size. It is updated on demand after receiving a SIGWINCH.
-   Do not touch this struct directly, it's managed with a rwlock. Use common_get_width()/common_get_height().
+   The current terminal size, which is updated on demand after receiving a SIGWINCH. Use common_get_width()/common_get_height().
+
+   The size is packed into one word, with the rows in the high half, so that it is always read and written whole.
+   termsize_generation counts the SIGWINCHes, and termsize_read_generation is the count when the size was last read
+   from the terminal; while they are equal, the size is current, and getting it takes just two loads. Reading the size
+   from the terminal is serialized by termsize_update_lock. With C++11 these would be atomics.
 */
-static struct winsize termsize;
-static volatile bool termsize_valid;
-static rwlock_t termsize_rwlock;
+static volatile unsigned int termsize_packed;
+static volatile unsigned int termsize_generation = 1;
+static volatile unsigned int termsize_read_generation;
+static pthread_mutex_t termsize_update_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static char *wcs2str_internal(const wchar_t *in, char *out);
 
@@ -148,19 +159,27 @@ int fgetws2(wcstring *s, FILE *f)
    way using the private use area.
 */
 
-static wcstring str2wcs_internal(const char *in, const size_t in_len)
+static void str2wcs_internal_append(const char *in, const size_t in_len, wcstring &result)
 {
     if (in_len == 0)
-        return wcstring();
+        return;
 
     assert(in != NULL);
 
-    wcstring result;
-    result.reserve(in_len);
+    result.reserve(result.size() + in_len);
     mbstate_t state = {};
     size_t in_pos = 0;
     while (in_pos < in_len)
     {
+        /* ASCII is the same in every locale we support, as long as we aren't in a shift sequence. Copy runs of it without asking mbrtowc. */
+        if ((in[in_pos] & 0x80) == 0 && mbsinit(&state))
+        {
+            size_t run = utf8_ascii_prefix_length(in + in_pos, in_len - in_pos);
+            result.append(in + in_pos, in + in_pos + run);
+            in_pos += run;
+            continue;
+        }
+
         wchar_t wc = 0;
         size_t ret = mbrtowc(&wc, &in[in_pos], in_len-in_pos, &state);
 
@@ -211,6 +230,12 @@ static wcstring str2wcs_internal(const char *in, const size_t in_len)
             in_pos += ret;
         }
     }
+}
+
+static wcstring str2wcs_internal(const char *in, const size_t in_len)
+{
+    wcstring result;
+    str2wcs_internal_append(in, in_len, result);
     return result;
 }
 
@@ -230,6 +255,11 @@ wcstring str2wcstring(const std::string &in)
     return str2wcs_internal(in.data(), in.size());
 }
 
+void str2wcstring_append(const char *in, size_t len, wcstring *out)
+{
+    str2wcs_internal_append(in, len, *out);
+}
+
 char *wcs2str(const wchar_t *in)
 {
     if (! in)
@@ -283,7 +313,12 @@ std::string wcs2string(const wcstring &input)
     for (size_t i=0; i < input.size(); i++)
     {
         wchar_t wc = input[i];
-        if (wc == INTERNAL_SEPARATOR)
+        if (wc >= 0 && wc < 0x80 && mbsinit(&state))
+        {
+            /* ASCII; see str2wcs_internal_append */
+            result.push_back((char)wc);
+        }
+        else if (wc == INTERNAL_SEPARATOR)
         {
         }
         else if ((wc >= ENCODE_DIRECT_BASE) &&
@@ -332,7 +367,12 @@ static char *wcs2str_internal(const wchar_t *in, char *out)
 
     while (in[in_pos])
     {
-        if (in[in_pos] == INTERNAL_SEPARATOR)
+        if (in[in_pos] > 0 && in[in_pos] < 0x80 && mbsinit(&state))
+        {
+            /* ASCII; see str2wcs_internal_append */
+            out[out_pos++] = (char)in[in_pos];
+        }
+        else if (in[in_pos] == INTERNAL_SEPARATOR)
         {
         }
         else if ((in[in_pos] >= ENCODE_DIRECT_BASE) &&
@@ -370,9 +410,132 @@ wcstring format_string(const wchar_t *format, ...)
     return result;
 }
 
+/* Whether format only uses the conversions append_format_simple() handles: %ls, %lc, and %d, %i and %u with no, l or ll length, as well as %%. Flags, widths and precisions are not handled. */
+static bool format_is_simple(const wchar_t *format)
+{
+    for (const wchar_t *cursor = format; *cursor; cursor++)
+    {
+        if (*cursor != L'%')
+            continue;
+
+        cursor++;
+        if (*cursor == L'%')
+            continue;
+        if (*cursor == L'l')
+        {
+            cursor++;
+            if (*cursor == L's' || *cursor == L'c')
+                continue;
+            if (*cursor == L'l')
+                cursor++;
+        }
+        if (*cursor != L'd' && *cursor != L'i' && *cursor != L'u')
+            return false;
+    }
+    return true;
+}
+
+/* Append the decimal digits of magnitude, preceded by a minus sign if negative */
+static void append_decimal(wcstring &target, unsigned long long magnitude, bool negative)
+{
+    wchar_t digits[32];
+    wchar_t * const end = digits + sizeof digits / sizeof *digits;
+    wchar_t *cursor = end;
+    do
+    {
+        *--cursor = L'0' + (wchar_t)(magnitude % 10);
+        magnitude /= 10;
+    }
+    while (magnitude > 0);
+    if (negative)
+        *--cursor = L'-';
+    target.append(cursor, end - cursor);
+}
+
+static void append_signed(wcstring &target, long long val)
+{
+    /* Negate as unsigned, so that LLONG_MIN works */
+    append_decimal(target, val < 0 ? -(unsigned long long)val : (unsigned long long)val, val < 0);
+}
+
+/* Like append_formatv, for a format that format_is_simple() accepts. Output is the same as vswprintf's, but is appended in one pass without a scratch buffer. */
+static void append_format_simple(wcstring &target, const wchar_t *format, va_list va)
+{
+    const wchar_t *literal_start = format;
+    const wchar_t *cursor = format;
+    while (*cursor)
+    {
+        if (*cursor != L'%')
+        {
+            cursor++;
+            continue;
+        }
+
+        target.append(literal_start, cursor - literal_start);
+        cursor++;
+        int longs = 0;
+        while (*cursor == L'l')
+        {
+            longs++;
+            cursor++;
+        }
+        switch (*cursor)
+        {
+            case L'%':
+                target.push_back(L'%');
+                break;
+
+            case L's':
+            {
+                const wchar_t *str = va_arg(va, const wchar_t *);
+                target.append(str ? str : L"(null)");
+                break;
+            }
+
+            case L'c':
+                target.push_back((wchar_t)va_arg(va, wint_t));
+                break;
+
+            case L'd':
+            case L'i':
+                if (longs == 0)
+                    append_signed(target, va_arg(va, int));
+                else if (longs == 1)
+                    append_signed(target, va_arg(va, long));
+                else
+                    append_signed(target, va_arg(va, long long));
+                break;
+
+            case L'u':
+                if (longs == 0)
+                    append_decimal(target, va_arg(va, unsigned int), false);
+                else if (longs == 1)
+                    append_decimal(target, va_arg(va, unsigned long), false);
+                else
+                    append_decimal(target, va_arg(va, unsigned long long), false);
+                break;
+        }
+        cursor++;
+        literal_start = cursor;
+    }
+    target.append(literal_start, cursor - literal_start);
+}
+
 void append_formatv(wcstring &target, const wchar_t *format, va_list va_orig)
 {
     const int saved_err = errno;
+
+    /* Most formats only substitute strings and integers, which we can do without guessing at buffer sizes */
+    if (format_is_simple(format))
+    {
+        va_list va;
+        va_copy(va, va_orig);
+        append_format_simple(target, format, va);
+        va_end(va);
+        errno = saved_err;
+        return;
+    }
+
     /*
       As far as I know, there is no way to check if a
       vswprintf-call failed because of a badly formated string
@@ -894,6 +1057,45 @@ void write_screen(const wcstring &msg, wcstring &buff)
     buff.push_back(L'\n');
 }
 
+/* Whether escape_string_internal copies c unchanged, without c making the string need escaping. Most characters are like this, so runs of them are copied in one go. */
+static inline bool escape_char_is_plain(wchar_t c)
+{
+    if (c < 128)
+    {
+        switch (c)
+        {
+            case L'\\':
+            case L'\'':
+            case L'&':
+            case L'$':
+            case L' ':
+            case L'#':
+            case L'^':
+            case L'<':
+            case L'>':
+            case L'(':
+            case L')':
+            case L'[':
+            case L']':
+            case L'{':
+            case L'}':
+            case L'?':
+            case L'*':
+            case L'|':
+            case L';':
+            case L'"':
+            case L'%':
+            case L'~':
+                return false;
+
+            default:
+                /* Control characters, and anything negative, are escaped */
+                return c >= 32;
+        }
+    }
+    return ! (c >= ENCODE_DIRECT_BASE && c < ENCODE_DIRECT_BASE + 256) && c != ANY_CHAR && c != ANY_STRING && c != ANY_STRING_RECURSIVE;
+}
+
 /* Escape a string, storing the result in out_str */
 static void escape_string_internal(const wchar_t *orig_in, size_t in_len, wcstring *out_str, escape_flags_t flags)
 {
@@ -916,8 +1118,24 @@ static void escape_string_internal(const wchar_t *orig_in, size_t in_len, wcstri
         return;
     }
 
+    out.reserve(in_len);
     while (*in != 0)
     {
+        /* Copy the run of characters that need no escaping */
+        const wchar_t *plain_end = in;
+        while (escape_char_is_plain(*plain_end))
+        {
+            plain_end++;
+        }
+        if (plain_end != in)
+        {
+            out.append(in, plain_end - in);
+            in = plain_end;
+            if (*in == 0)
+            {
+                break;
+            }
+        }
 
         if ((*in >= ENCODE_DIRECT_BASE) &&
                 (*in < ENCODE_DIRECT_BASE+256))
@@ -1338,6 +1556,29 @@ static size_t read_unquoted_escape(const wchar_t *input, wcstring *result, bool
     return errored ? 0 : in_pos;
 }
 
+/* Whether unescape_string_internal has to look at c outside of quotes, instead of just copying it */
+static inline bool unquoted_char_is_special(wchar_t c)
+{
+    switch (c)
+    {
+        case L'\\':
+        case L'~':
+        case L'%':
+        case L'*':
+        case L'?':
+        case L'$':
+        case L'{':
+        case L'}':
+        case L',':
+        case L'\'':
+        case L'"':
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 /* Returns the unescaped version of input_str into output_str (by reference). Returns true if successful. If false, the contents of output_str are undefined (!) */
 static bool unescape_string_internal(const wchar_t * const input, const size_t input_len, wcstring *output_str, unescape_flags_t flags)
 {
@@ -1360,6 +1601,39 @@ static bool unescape_string_internal(const wchar_t * const input, const size_t i
 
     for (size_t input_position = 0; input_position < input_len && ! errored; input_position++)
     {
+        /* Copy the run of characters that stand for themselves in the current mode */
+        size_t plain_end = input_position;
+        if (mode == mode_unquoted)
+        {
+            while (plain_end < input_len && ! unquoted_char_is_special(input[plain_end]))
+            {
+                plain_end++;
+            }
+        }
+        else if (mode == mode_single_quotes)
+        {
+            while (plain_end < input_len && input[plain_end] != L'\\' && input[plain_end] != L'\'')
+            {
+                plain_end++;
+            }
+        }
+        else
+        {
+            while (plain_end < input_len && input[plain_end] != L'\\' && input[plain_end] != L'"' && input[plain_end] != L'$')
+            {
+                plain_end++;
+            }
+        }
+        if (plain_end != input_position)
+        {
+            result.append(input + input_position, plain_end - input_position);
+            input_position = plain_end;
+            if (input_position == input_len)
+            {
+                break;
+            }
+        }
+
         const wchar_t c = input[input_position];
         /* Here's the character we'll append to result, or NOT_A_WCHAR to suppress it */
         wint_t to_append_or_none = c;
@@ -1649,31 +1923,39 @@ bool unescape_string(const wcstring &input, wcstring *output, unescape_flags_t e
 void common_handle_winch(int signal)
 {
     /* don't run ioctl() here, it's not safe to use in signals */
-    termsize_valid = false;
+    __sync_fetch_and_add(&termsize_generation, 1);
 }
 
 /* updates termsize as needed, and returns a copy of the winsize. */
 static struct winsize get_current_winsize()
 {
-#ifndef HAVE_WINSIZE
     struct winsize retval = {0};
+#ifndef HAVE_WINSIZE
     retval.ws_col = 80;
     retval.ws_row = 24;
     return retval;
 #endif
-    scoped_rwlock guard(termsize_rwlock, true);
-    struct winsize retval = termsize;
-    if (!termsize_valid)
+    if (termsize_read_generation != termsize_generation)
     {
-        struct winsize size;
-        if (ioctl(1,TIOCGWINSZ,&size) == 0)
+        scoped_lock locker(termsize_update_lock);
+        const unsigned int generation = termsize_generation;
+        if (termsize_read_generation != generation)
         {
-            retval = size;
-            guard.upgrade();
-            termsize = retval;
+            struct winsize size;
+            if (ioctl(1,TIOCGWINSZ,&size) == 0)
+            {
+                termsize_packed = (static_cast<unsigned int>(size.ws_row) << 16) | size.ws_col;
+            }
+            /* Publish the size before marking it current */
+            __sync_synchronize();
+            termsize_read_generation = generation;
         }
-        termsize_valid = true;
     }
+    /* Pairs with the barrier above: do not read the size before the generation that says it is current */
+    __sync_synchronize();
+    const unsigned int packed = termsize_packed;
+    retval.ws_row = packed >> 16;
+    retval.ws_col = packed & 0xFFFF;
     return retval;
 }
 
@@ -1704,6 +1986,11 @@ void tokenize_variable_array(const wcstring &val, std::vector<wcstring> &out)
     }
 }
 
+size_t count_variable_array(const wcstring &val)
+{
+    return 1 + std::count(val.begin(), val.end(), ARRAY_SEP);
+}
+
 bool string_prefixes_string(const wchar_t *proposed_prefix, const wcstring &value)
 {
     size_t prefix_size = wcslen(proposed_prefix);
@@ -1716,10 +2003,39 @@ bool string_prefixes_string(const wcstring &proposed_prefix, const wcstring &val
     return prefix_size <= value.size() && value.compare(0, prefix_size, proposed_prefix) == 0;
 }
 
+/* Fold the case of a character for case insensitive comparisons, as wcsncasecmp does. ASCII, by far the most common case, does not need to consult the locale. */
+static inline wchar_t fold_case(wchar_t c)
+{
+    if (c < 0x80)
+    {
+        return (c >= L'A' && c <= L'Z') ? c + (L'a' - L'A') : c;
+    }
+    return towlower(c);
+}
+
+/* Returns the length of the longest common prefix of a and b, ignoring case. Equal characters are not folded. */
+static size_t case_insensitive_prefix_length(const wchar_t *a, size_t a_len, const wchar_t *b, size_t b_len)
+{
+    const size_t len = std::min(a_len, b_len);
+    size_t i = 0;
+    while (i < len)
+    {
+        if (a[i] == b[i] || fold_case(a[i]) == fold_case(b[i]))
+        {
+            i++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return i;
+}
+
 bool string_prefixes_string_case_insensitive(const wcstring &proposed_prefix, const wcstring &value)
 {
     size_t prefix_size = proposed_prefix.size();
-    return prefix_size <= value.size() && wcsncasecmp(proposed_prefix.c_str(), value.c_str(), prefix_size) == 0;
+    return prefix_size <= value.size() && case_insensitive_prefix_length(proposed_prefix.data(), prefix_size, value.data(), value.size()) == prefix_size;
 }
 
 bool string_suffixes_string(const wcstring &proposed_suffix, const wcstring &value)
@@ -1735,40 +2051,62 @@ bool string_suffixes_string(const wchar_t *proposed_suffix, const wcstring &valu
 }
 
 // Returns true if seq, represented as a subsequence, is contained within string
-static bool subsequence_in_string(const wcstring &seq, const wcstring &str)
+static bool subsequence_in_string(const wchar_t *seq, size_t seq_len, const wchar_t *str, size_t str_len)
 {
     /* Impossible if seq is larger than string */
-    if (seq.size() > str.size())
+    if (seq_len > str_len)
     {
         return false;
     }
 
     /* Empty strings are considered to be subsequences of everything */
-    if (seq.empty())
+    size_t seq_idx, str_idx;
+    for (seq_idx = str_idx = 0; seq_idx < seq_len; seq_idx++)
     {
-        return true;
+        /* There must be room for the rest of the sequence */
+        if (seq_len - seq_idx > str_len - str_idx)
+        {
+            return false;
+        }
+
+        const wchar_t *char_loc = wmemchr(str + str_idx, seq[seq_idx], str_len - str_idx);
+        if (char_loc == NULL)
+        {
+            /* Didn't find this character */
+            return false;
+        }
+
+        /* We found it. Continue the search just after it. */
+        str_idx = char_loc - str + 1;
     }
+    return true;
+}
 
-    size_t str_idx, seq_idx;
-    for (seq_idx = str_idx = 0; seq_idx < seq.size() && str_idx < str.size(); seq_idx++)
+// Returns the offset of the first occurrence of needle in haystack, or npos
+static size_t find_substring(const wchar_t *needle, size_t needle_len, const wchar_t *haystack, size_t haystack_len)
+{
+    if (needle_len == 0)
+    {
+        return 0;
+    }
+
+    /* Look for the first character with wmemchr, then compare the rest */
+    size_t idx = 0;
+    while (needle_len <= haystack_len - idx)
     {
-        wchar_t c = seq.at(seq_idx);
-        size_t char_loc = str.find(c, str_idx);
-        if (char_loc == wcstring::npos)
+        const wchar_t *loc = wmemchr(haystack + idx, needle[0], haystack_len - idx - needle_len + 1);
+        if (loc == NULL)
         {
-            /* Didn't find this character */
             break;
         }
-        else
+        idx = loc - haystack;
+        if (wmemcmp(loc + 1, needle + 1, needle_len - 1) == 0)
         {
-            /* We found it. Continue the search just after it. */
-            str_idx = char_loc + 1;
+            return idx;
         }
+        idx++;
     }
-
-    /* We succeeded if we exhausted our sequence */
-    assert(seq_idx <= seq.size());
-    return seq_idx == seq.size();
+    return wcstring::npos;
 }
 
 string_fuzzy_match_t::string_fuzzy_match_t(enum fuzzy_match_type_t t, size_t distance_first, size_t distance_second) :
@@ -1778,50 +2116,78 @@ string_fuzzy_match_t::string_fuzzy_match_t(enum fuzzy_match_type_t t, size_t dis
 {
 }
 
-
-string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type)
+/*
+   The tests go from the best match type to the worst, but share their work:
+   the exact and case insensitive comparisons all come from the length of the
+   common prefix, computed once. Nothing that needs string to be no longer
+   than match_against is tried when it is longer.
+*/
+static string_fuzzy_match_t fuzzy_match(const wchar_t *string, size_t string_len, const wchar_t *match_against, size_t against_len, fuzzy_match_type_t limit_type)
 {
     // Distances are generally the amount of text not matched
     string_fuzzy_match_t result(fuzzy_match_none, 0, 0);
-    size_t location;
-    if (limit_type >= fuzzy_match_exact && string == match_against)
-    {
-        result.type = fuzzy_match_exact;
-    }
-    else if (limit_type >= fuzzy_match_prefix && string_prefixes_string(string, match_against))
+    if (string_len > against_len)
     {
-        result.type = fuzzy_match_prefix;
-        assert(match_against.size() >= string.size());
-        result.match_distance_first = match_against.size() - string.size();
+        return result;
     }
-    else if (limit_type >= fuzzy_match_case_insensitive && wcscasecmp(string.c_str(), match_against.c_str()) == 0)
+
+    const size_t remainder = against_len - string_len;
+    if (wmemcmp(string, match_against, string_len) == 0)
     {
-        result.type = fuzzy_match_case_insensitive;
+        if (remainder == 0 && limit_type >= fuzzy_match_exact)
+        {
+            result.type = fuzzy_match_exact;
+            return result;
+        }
+        if (remainder > 0 && limit_type >= fuzzy_match_prefix)
+        {
+            result.type = fuzzy_match_prefix;
+            result.match_distance_first = remainder;
+            return result;
+        }
     }
-    else if (limit_type >= fuzzy_match_prefix_case_insensitive && string_prefixes_string_case_insensitive(string, match_against))
+    else if (limit_type >= fuzzy_match_case_insensitive && case_insensitive_prefix_length(string, string_len, match_against, against_len) == string_len)
     {
-        result.type = fuzzy_match_prefix_case_insensitive;
-        assert(match_against.size() >= string.size());
-        result.match_distance_first = match_against.size() - string.size();
+        if (remainder == 0)
+        {
+            result.type = fuzzy_match_case_insensitive;
+            return result;
+        }
+        if (limit_type >= fuzzy_match_prefix_case_insensitive)
+        {
+            result.type = fuzzy_match_prefix_case_insensitive;
+            result.match_distance_first = remainder;
+            return result;
+        }
     }
-    else if (limit_type >= fuzzy_match_substring && (location = match_against.find(string)) != wcstring::npos)
+
+    size_t location;
+    if (limit_type >= fuzzy_match_substring && (location = find_substring(string, string_len, match_against, against_len)) != wcstring::npos)
     {
         // string is contained within match against
         result.type = fuzzy_match_substring;
-        assert(match_against.size() >= string.size());
-        result.match_distance_first = match_against.size() - string.size();
+        result.match_distance_first = remainder;
         result.match_distance_second = location; //prefer earlier matches
     }
-    else if (limit_type >= fuzzy_match_subsequence_insertions_only && subsequence_in_string(string, match_against))
+    else if (limit_type >= fuzzy_match_subsequence_insertions_only && subsequence_in_string(string, string_len, match_against, against_len))
     {
         result.type = fuzzy_match_subsequence_insertions_only;
-        assert(match_against.size() >= string.size());
-        result.match_distance_first = match_against.size() - string.size();
+        result.match_distance_first = remainder;
         // it would be nice to prefer matches with greater matching runs here
     }
     return result;
 }
 
+string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type)
+{
+    return fuzzy_match(string.data(), string.size(), match_against.data(), match_against.size(), limit_type);
+}
+
+string_fuzzy_match_t string_fuzzy_match_string(const wchar_t *string, const wchar_t *match_against, fuzzy_match_type_t limit_type)
+{
+    return fuzzy_match(string, wcslen(string), match_against, wcslen(match_against), limit_type);
+}
+
 template<typename T>
 static inline int compare_ints(T a, T b)
 {
@@ -1899,6 +2265,12 @@ void bugreport()
           PACKAGE_BUGREPORT);
 }
 
+size_t wcstring_heap_size(const wcstring &str)
+{
+    static const size_t inline_capacity = wcstring().capacity();
+    return str.capacity() > inline_capacity ? (str.capacity() + 1) * sizeof(wchar_t) : 0;
+}
+
 wcstring format_size(long long sz)
 {
     wcstring result;
@@ -2400,3 +2772,27 @@ char **make_null_terminated_array(const std::vector<std::string> &lst)
 {
     return make_null_terminated_array_helper(lst);
 }
+
+void startup_timings_begin()
+{
+    g_startup_timings_active = true;
+    s_startup_time = get_monotonic_time();
+}
+
+void startup_timing_report(const wcstring &what, long long start_time)
+{
+    if (g_startup_timings_active)
+    {
+        long long now = get_monotonic_time();
+        fwprintf(stderr, L"startup: %9.3f ms %9.3f ms  %ls\n", (now - s_startup_time) / 1000.0, (now - start_time) / 1000.0, what.c_str());
+    }
+}
+
+void startup_timings_end()
+{
+    if (g_startup_timings_active)
+    {
+        startup_timing_report(L"total", s_startup_time);
+        g_startup_timings_active = false;
+    }
+}
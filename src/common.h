@@ -161,6 +161,26 @@ extern int debug_level;
 */
 extern bool g_profiling_active;
 
+/**
+   Startup timings flag. True if fish was started with --print-startup-timings and has not finished starting up.
+*/
+extern bool g_startup_timings_active;
+
+/**
+   Start printing startup timings. Times are measured from this call.
+*/
+void startup_timings_begin();
+
+/**
+   If startup timings are active, print to stderr how far into startup we are and how long what has just finished took, given the time it started as returned by get_monotonic_time(). Callers that build the label at runtime should check g_startup_timings_active first so normal startup does not pay for the string.
+*/
+void startup_timing_report(const wcstring &what, long long start_time);
+
+/**
+   If startup timings are active, print the total startup time and stop printing timings.
+*/
+void startup_timings_end();
+
 /**
    Name of the current program. Should be set at startup. Used by the
    debug function.
@@ -273,6 +293,11 @@ wcstring str2wcstring(const char *in);
 wcstring str2wcstring(const char *in, size_t len);
 wcstring str2wcstring(const std::string &in);
 
+/**
+ Like str2wcstring, but appends the result to \c out, reusing its storage. Decoding a buffer of several newline-separated lines in one call gives the same characters as decoding each line separately.
+ */
+void str2wcstring_append(const char *in, size_t len, wcstring *out);
+
 /**
    Returns a newly allocated multibyte character string equivalent of
    the specified wide character string
@@ -365,6 +390,7 @@ struct string_fuzzy_match_t
 
 /* Compute a fuzzy match for a string. If maximum_match is not fuzzy_match_none, limit the type to matches at or below that type. */
 string_fuzzy_match_t string_fuzzy_match_string(const wcstring &string, const wcstring &match_against, fuzzy_match_type_t limit_type = fuzzy_match_none);
+string_fuzzy_match_t string_fuzzy_match_string(const wchar_t *string, const wchar_t *match_against, fuzzy_match_type_t limit_type = fuzzy_match_none);
 
 
 /** Test if a list contains a string using a linear search. */
@@ -389,6 +415,22 @@ wcstring format_size(long long sz);
 /** Version of format_size that does not allocate memory. */
 void format_size_safe(char buff[128], unsigned long long sz);
 
+/** An estimate of the memory one part of fish holds, as printed by status --print-memory-stats. The bytes count the contents of strings and containers, but not the allocator's own overhead. */
+struct memory_stats_t
+{
+    wcstring name; /** What the memory is used for */
+    size_t entries; /** How many entries it holds */
+    size_t bytes; /** How many bytes they take */
+
+    explicit memory_stats_t(const wcstring &n) : name(n), entries(0), bytes(0) { }
+};
+
+/** The number of bytes a string has allocated outside itself, which is zero for strings short enough to be stored inline */
+size_t wcstring_heap_size(const wcstring &str);
+
+/** An estimate of the bytes taken by a node of a std::set or std::map, not counting the value */
+#define TREE_NODE_OVERHEAD (4 * sizeof(void *))
+
 /** Our crappier versions of debug which is guaranteed to not allocate any memory, or do anything other than call write(). This is useful after a call to fork() with threads. */
 void debug_safe(int level, const char *msg, const char *param1 = NULL, const char *param2 = NULL, const char *param3 = NULL, const char *param4 = NULL, const char *param5 = NULL, const char *param6 = NULL, const char *param7 = NULL, const char *param8 = NULL, const char *param9 = NULL, const char *param10 = NULL, const char *param11 = NULL, const char *param12 = NULL);
 
@@ -870,6 +912,12 @@ void write_screen(const wcstring &msg, wcstring &buff);
 */
 void tokenize_variable_array(const wcstring &val, wcstring_list_t &out);
 
+/**
+   Count the elements of an array variable value without splitting it. The count is that of the list
+   tokenize_variable_array would produce.
+*/
+size_t count_variable_array(const wcstring &val);
+
 /**
    Make sure the specified direcotry exists. If needed, try to create
    it and any currently not existing parent directories..
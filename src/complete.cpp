@@ -10,13 +10,16 @@
 #include <wchar.h>
 #include <wctype.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include <algorithm>
 #include <list>
 #include <map>
+#include <memory> // IWYU pragma: keep - suggests <tr1/memory> instead
 #include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "fallback.h" // IWYU pragma: keep
 #include "util.h"
@@ -37,7 +40,11 @@
 #include "parse_tree.h"
 #include "iothread.h"
 #include "autoload.h"
+#include "lru.h"
+#include "builtin_scripts.h"
+#include "reader.h"
 #include "parse_constants.h"
+#include "intern.h"
 
 /*
   Completion description strings, mostly for different types of files, such as sockets, block devices, etc.
@@ -95,43 +102,156 @@ static inline wcstring_list_t complete_get_variable_names(void)
     }
 }
 
+const wcstring complete_entry_opt_t::localized_desc() const
+{
+    return C_(desc);
+}
+
 /**
-   Struct describing a completion option entry.
+   An immutable snapshot of the options of a completion entry, with
+   indexes so that complete_param only has to look at the options that
+   can possibly match the current token, instead of all of them. This
+   matters for commands like git that have hundreds of options.
+
+   Snapshots are shared between the entry and any completion in
+   progress, and are replaced (not modified) when the entry changes, so
+   they may be used without holding completion_lock.
+*/
+class completion_option_index_t
+{
+    /* Key used for long options. Lowercased so that case insensitive prefix matches can be found too. */
+    typedef std::pair<wcstring, size_t> long_key_t;
 
-   If short_opt and long_opt are both zero, the comp field must not be
-   empty and contains a list of arguments to the command.
+    /* Long options (both old and GNU style), sorted by lowercased name */
+    std::vector<long_key_t> long_opts;
 
-   If either short_opt or long_opt are non-zero, they specify a switch
-   for the command. If \c comp is also not empty, it contains a list
-   of non-switch arguments that may only follow directly after the
-   specified switch.
-*/
-typedef struct complete_entry_opt
-{
-    /** Short style option */
-    wchar_t short_opt;
-    /** Long style option */
-    wcstring long_opt;
-    /** Arguments to the option */
-    wcstring comp;
-    /** Description of the completion */
-    wcstring desc;
-    /** Condition under which to use the option */
-    wcstring condition;
-    /** Must be one of the values SHARED, NO_FILES, NO_COMMON,
-      EXCLUSIVE, and determines how completions should be performed
-      on the argument after the switch. */
-    int result_mode;
-    /** True if old style long options are used */
-    int old_mode;
-    /** Completion flags */
-    complete_flags_t flags;
-
-    const wcstring localized_desc() const
-    {
-        return C_(desc);
-    }
-} complete_entry_opt_t;
+    /* Short options, by option character */
+    std::map<wchar_t, std::vector<size_t> > short_opts;
+
+    /* Indexes of all short options, and of the options that are neither short nor long */
+    std::vector<size_t> all_short_opts;
+    std::vector<size_t> plain_opts;
+
+    static wcstring lowercase(const wcstring &str)
+    {
+        wcstring result(str.size(), L'\0');
+        for (size_t i=0; i < str.size(); i++)
+            result.at(i) = towlower(str.at(i));
+        return result;
+    }
+
+public:
+    /** All options, in the order complete_param tries them */
+    const std::vector<complete_entry_opt_t> options;
+
+    /** String containing all short option characters */
+    const wcstring short_opt_str;
+
+    completion_option_index_t(const std::list<complete_entry_opt_t> &opts, const wcstring &short_str);
+
+    /** Appends the indexes of options with the short option character c to out */
+    void find_short(wchar_t c, std::vector<size_t> *out) const;
+
+    /** Appends the indexes of all short options to out */
+    void find_all_short(std::vector<size_t> *out) const;
+
+    /** Appends the indexes of options that are neither short nor long to out */
+    void find_plain(std::vector<size_t> *out) const;
+
+    /**
+       Appends the indexes of long options whose name starts with prefix,
+       ignoring case, to out. If exact is set, the name must equal prefix
+       (still ignoring case). Callers must check the options they get back
+       with the exact match they need.
+    */
+    void find_long(const wcstring &prefix, bool exact, std::vector<size_t> *out) const;
+
+    /** Returns an estimate of the bytes the snapshot takes */
+    size_t memory_size() const;
+};
+
+/** Returns an estimate of the bytes an option takes */
+static size_t complete_option_memory_size(const complete_entry_opt_t &o)
+{
+    return sizeof o + wcstring_heap_size(o.long_opt) + wcstring_heap_size(o.comp) + wcstring_heap_size(o.desc) + wcstring_heap_size(o.condition);
+}
+
+completion_option_index_t::completion_option_index_t(const std::list<complete_entry_opt_t> &opts, const wcstring &short_str) :
+    options(opts.begin(), opts.end()),
+    short_opt_str(short_str)
+{
+    for (size_t i=0; i < options.size(); i++)
+    {
+        const complete_entry_opt_t &o = options.at(i);
+        if (o.short_opt != L'\0')
+        {
+            short_opts[o.short_opt].push_back(i);
+            all_short_opts.push_back(i);
+        }
+        if (! o.long_opt.empty())
+        {
+            long_opts.push_back(long_key_t(lowercase(o.long_opt), i));
+        }
+        if (o.short_opt == L'\0' && o.long_opt.empty())
+        {
+            plain_opts.push_back(i);
+        }
+    }
+    std::sort(long_opts.begin(), long_opts.end());
+}
+
+void completion_option_index_t::find_short(wchar_t c, std::vector<size_t> *out) const
+{
+    std::map<wchar_t, std::vector<size_t> >::const_iterator iter = short_opts.find(c);
+    if (iter != short_opts.end())
+    {
+        out->insert(out->end(), iter->second.begin(), iter->second.end());
+    }
+}
+
+void completion_option_index_t::find_all_short(std::vector<size_t> *out) const
+{
+    out->insert(out->end(), all_short_opts.begin(), all_short_opts.end());
+}
+
+void completion_option_index_t::find_plain(std::vector<size_t> *out) const
+{
+    out->insert(out->end(), plain_opts.begin(), plain_opts.end());
+}
+
+void completion_option_index_t::find_long(const wcstring &prefix, bool exact, std::vector<size_t> *out) const
+{
+    const wcstring key = lowercase(prefix);
+    std::vector<long_key_t>::const_iterator iter = std::lower_bound(long_opts.begin(), long_opts.end(), long_key_t(key, 0));
+    for (; iter != long_opts.end() && string_prefixes_string(key, iter->first); ++iter)
+    {
+        if (! exact || iter->first.size() == key.size())
+        {
+            out->push_back(iter->second);
+        }
+    }
+}
+
+size_t completion_option_index_t::memory_size() const
+{
+    size_t result = sizeof *this + wcstring_heap_size(short_opt_str);
+    result += options.capacity() * sizeof(complete_entry_opt_t);
+    for (size_t i=0; i < options.size(); i++)
+    {
+        result += complete_option_memory_size(options.at(i)) - sizeof(complete_entry_opt_t);
+    }
+    result += long_opts.capacity() * sizeof(long_key_t);
+    for (size_t i=0; i < long_opts.size(); i++)
+    {
+        result += wcstring_heap_size(long_opts.at(i).first);
+    }
+    for (std::map<wchar_t, std::vector<size_t> >::const_iterator iter = short_opts.begin(); iter != short_opts.end(); ++iter)
+    {
+        result += TREE_NODE_OVERHEAD + sizeof *iter + iter->second.capacity() * sizeof(size_t);
+    }
+    result += (all_short_opts.capacity() + plain_opts.capacity()) * sizeof(size_t);
+    return result;
+}
 
 /* Last value used in the order field of completion_entry_t */
 static unsigned int kCompleteOrder = 0;
@@ -149,6 +269,9 @@ public:
     /** String containing all short option characters */
     wcstring short_opt_str;
 
+    /** Cached snapshot of options and short_opt_str, or empty if they changed since it was made */
+    mutable shared_ptr<const completion_option_index_t> option_index;
+
 public:
 
     /** Command string */
@@ -166,6 +289,9 @@ public:
     /** Getters for option list. */
     const option_list_t &get_options() const;
 
+    /** Returns the indexed snapshot of the options, building it if the options changed since the last call. */
+    shared_ptr<const completion_option_index_t> get_option_index() const;
+
     /** Adds or removes an option. */
     void add_option(const complete_entry_opt_t &opt);
     bool remove_option(wchar_t short_opt, const wchar_t *long_opt, int old_mode);
@@ -188,7 +314,7 @@ public:
 struct completion_entry_set_comparer
 {
     /** Comparison for std::set */
-    bool operator()(completion_entry_t *p1, completion_entry_t *p2) const
+    bool operator()(const completion_entry_t *p1, const completion_entry_t *p2) const
     {
         /* Paths always come last for no particular reason */
         if (p1->cmd_is_path != p2->cmd_is_path)
@@ -204,44 +330,65 @@ struct completion_entry_set_comparer
 typedef std::set<completion_entry_t *, completion_entry_set_comparer> completion_entry_set_t;
 static completion_entry_set_t completion_set;
 
+/** The entries of completion_set whose command is a wildcard. All other entries are found by exact lookup. */
+static completion_entry_set_t wildcard_completion_set;
+
 // Comparison function to sort completions by their order field
 static bool compare_completions_by_order(const completion_entry_t *p1, const completion_entry_t *p2)
 {
     return p1->order < p2->order;
 }
 
-/** The lock that guards the list of completion entries */
-static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
-
 /**
- * The lock that guards the options list of individual completion entries.
- * If both completion_lock and completion_entry_lock are to be taken,
- * completion_lock must be taken first.
- */
-static pthread_mutex_t completion_entry_lock = PTHREAD_MUTEX_INITIALIZER;
+   The lock that guards the list of completion entries and their options.
+   Completions in progress only hold it while collecting the option
+   snapshots of the matching entries.
+*/
+static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 void completion_entry_t::add_option(const complete_entry_opt_t &opt)
 {
-    ASSERT_IS_LOCKED(completion_entry_lock);
+    ASSERT_IS_LOCKED(completion_lock);
+    if (opt.short_opt != L'\0')
+    {
+        short_opt_str.push_back(opt.short_opt);
+        if (opt.result_mode & NO_COMMON)
+        {
+            short_opt_str.push_back(L':');
+        }
+    }
     options.push_front(opt);
+    option_index.reset();
 }
 
 const option_list_t &completion_entry_t::get_options() const
 {
-    ASSERT_IS_LOCKED(completion_entry_lock);
+    ASSERT_IS_LOCKED(completion_lock);
     return options;
 }
 
+shared_ptr<const completion_option_index_t> completion_entry_t::get_option_index() const
+{
+    ASSERT_IS_LOCKED(completion_lock);
+    if (! option_index)
+    {
+        option_index.reset(new completion_option_index_t(options, short_opt_str));
+    }
+    return option_index;
+}
+
 wcstring &completion_entry_t::get_short_opt_str()
 {
-    ASSERT_IS_LOCKED(completion_entry_lock);
+    ASSERT_IS_LOCKED(completion_lock);
+    /* The caller may modify it */
+    option_index.reset();
     return short_opt_str;
 }
 
 const wcstring &completion_entry_t::get_short_opt_str() const
 {
-    ASSERT_IS_LOCKED(completion_entry_lock);
+    ASSERT_IS_LOCKED(completion_lock);
     return short_opt_str;
 }
 
@@ -262,16 +409,30 @@ static complete_flags_t resolve_auto_space(const wcstring &comp, complete_flags_
     return flags;
 }
 
+/* Most completions have no description, which needs no lookup */
+completion_fixed_desc_t::completion_fixed_desc_t(const wcstring &desc) : str(desc.empty() ? L"" : intern(desc.c_str()))
+{
+}
+
 /* completion_t functions. Note that the constructor resolves flags! */
 completion_t::completion_t(const wcstring &comp, const wcstring &desc, string_fuzzy_match_t mat, complete_flags_t flags_val) :
     completion(comp),
-    description(desc),
+    description(L""),
     match(mat),
     flags(resolve_auto_space(comp, flags_val))
 {
+    this->set_description(desc);
 }
 
-completion_t::completion_t(const completion_t &him) : completion(him.completion), description(him.description), match(him.match), flags(him.flags)
+completion_t::completion_t(const wcstring &comp, const completion_fixed_desc_t &desc, string_fuzzy_match_t mat, complete_flags_t flags_val) :
+    completion(comp),
+    description(desc.str),
+    match(mat),
+    flags(resolve_auto_space(comp, flags_val))
+{
+}
+
+completion_t::completion_t(const completion_t &him) : completion(him.completion), description(him.description), description_storage(him.description_storage), match(him.match), flags(him.flags)
 {
 }
 
@@ -281,12 +442,27 @@ completion_t &completion_t::operator=(const completion_t &him)
     {
         this->completion = him.completion;
         this->description = him.description;
+        this->description_storage = him.description_storage;
         this->match = him.match;
         this->flags = him.flags;
     }
     return *this;
 }
 
+void completion_t::set_description(const wcstring &desc)
+{
+    if (desc.empty())
+    {
+        this->description_storage.reset();
+        this->description = L"";
+    }
+    else
+    {
+        this->description_storage.reset(new wcstring(desc));
+        this->description = this->description_storage->c_str();
+    }
+}
+
 bool completion_t::is_naturally_less_than(const completion_t &a, const completion_t &b)
 {
     return wcsfilecmp(a.completion.c_str(), b.completion.c_str()) < 0;
@@ -312,8 +488,11 @@ class completer_t
     const wcstring initial_cmd;
     std::vector<completion_t> completions;
 
+public:
     /** Table of completions conditions that have already been tested and the corresponding test results */
     typedef std::map<wcstring, bool> condition_cache_t;
+
+private:
     condition_cache_t condition_cache;
 
     enum complete_type_t
@@ -355,6 +534,18 @@ public:
     {
         return completions.empty();
     }
+
+    /** The condition results of this completer */
+    const condition_cache_t &get_condition_cache() const
+    {
+        return condition_cache;
+    }
+
+    /** Use the given condition results instead of running those conditions again */
+    void set_condition_cache(const condition_cache_t &cache)
+    {
+        condition_cache = cache;
+    }
     const std::vector<completion_t> &get_completions(void)
     {
         return completions;
@@ -419,7 +610,7 @@ public:
 static completion_autoload_t completion_autoloader;
 
 /** Constructor */
-completion_autoload_t::completion_autoload_t() : autoload_t(L"fish_complete_path", NULL, 0)
+completion_autoload_t::completion_autoload_t() : autoload_t(L"fish_complete_path", internal_completion_scripts, internal_completion_scripts_count, L"completions")
 {
 }
 
@@ -438,18 +629,21 @@ void append_completion(std::vector<completion_t> *completions, const wcstring &c
        Nasty hack for #1241 - since the constructor needs the completion string to resolve AUTO_SPACE, and we aren't providing it with the completion, we have to do the resolution ourselves. We should get this resolving out of the constructor.
     */
     assert(completions != NULL);
-    const wcstring empty;
-    completions->push_back(completion_t(empty, empty, match, resolve_auto_space(comp, flags)));
-    completion_t *last = &completions->back();
-    last->completion = comp;
-    last->description = desc;
+    completions->push_back(completion_t(wcstring(), desc, match, resolve_auto_space(comp, flags)));
+    completions->back().completion = comp;
+}
+
+void append_completion(std::vector<completion_t> *completions, const wcstring &comp, const completion_fixed_desc_t &desc, complete_flags_t flags, string_fuzzy_match_t match)
+{
+    assert(completions != NULL);
+    completions->push_back(completion_t(wcstring(), desc, match, resolve_auto_space(comp, flags)));
+    completions->back().completion = comp;
 }
 
 /**
    Test if the specified script returns zero. The result is cached, so
    that if multiple completions use the same condition, it needs only
-   be evaluated once. condition_cache_clear must be called after a
-   completion run to make sure that there are no stale completions.
+   be evaluated once.
 */
 bool completer_t::condition_test(const wcstring &condition)
 {
@@ -467,6 +661,12 @@ bool completer_t::condition_test(const wcstring &condition)
 
     ASSERT_IS_MAIN_THREAD();
 
+    if (reader_thread_job_is_stale())
+    {
+        /* The user has moved on; don't run any more commands for this completion */
+        return 0;
+    }
+
     bool test_res;
     condition_cache_t::iterator cached_entry = condition_cache.find(condition);
     if (cached_entry == condition_cache.end())
@@ -510,11 +710,44 @@ static completion_entry_t *complete_get_exact_entry(const wcstring &cmd, bool cm
     {
         c = new completion_entry_t(cmd, cmd_is_path, L"", false);
         completion_set.insert(c);
+        if (wildcard_has(cmd, true))
+        {
+            wildcard_completion_set.insert(c);
+        }
     }
 
     return c;
 }
 
+/**
+   Find the entries that apply to a command whose name is cmd and whose
+   full path is path, ordered like completion_set. Entries with a literal
+   command are looked up directly; only the wildcard entries are tested
+   one by one. Must be called while locked.
+*/
+static void complete_find_matching_entries(const wcstring &cmd, const wcstring &path, std::vector<const completion_entry_t *> *out)
+{
+    ASSERT_IS_LOCKED(completion_lock);
+    const completion_entry_t *entry;
+    if ((entry = complete_find_exact_entry(cmd, false)) != NULL && ! wildcard_has(entry->cmd, true))
+    {
+        out->push_back(entry);
+    }
+    if ((entry = complete_find_exact_entry(path, true)) != NULL && ! wildcard_has(entry->cmd, true))
+    {
+        out->push_back(entry);
+    }
+    for (completion_entry_set_t::const_iterator iter = wildcard_completion_set.begin(); iter != wildcard_completion_set.end(); ++iter)
+    {
+        const completion_entry_t *i = *iter;
+        const wcstring &match = i->cmd_is_path ? path : cmd;
+        if (wildcard_match(match, i->cmd))
+        {
+            out->push_back(i);
+        }
+    }
+    std::sort(out->begin(), out->end(), completion_entry_set_comparer());
+}
 
 void complete_set_authoritative(const wchar_t *cmd, bool cmd_is_path, bool authoritative)
 {
@@ -540,28 +773,8 @@ void complete_add(const wchar_t *cmd,
 {
     CHECK(cmd,);
 
-    /* Lock the lock that allows us to edit the completion entry list */
-    scoped_lock lock(completion_lock);
-
-    /* Lock the lock that allows us to edit individual completion entries */
-    scoped_lock lock2(completion_entry_lock);
-
-    completion_entry_t *c;
-    c = complete_get_exact_entry(cmd, cmd_is_path);
-
     /* Create our new option */
     complete_entry_opt_t opt;
-    if (short_opt != L'\0')
-    {
-        int len = 1 + ((result_mode & NO_COMMON) != 0);
-
-        c->get_short_opt_str().push_back(short_opt);
-        if (len == 2)
-        {
-            c->get_short_opt_str().push_back(L':');
-        }
-    }
-
     opt.short_opt = short_opt;
     opt.result_mode = result_mode;
     opt.old_mode=old_mode;
@@ -572,7 +785,19 @@ void complete_add(const wchar_t *cmd,
     if (desc) opt.desc = desc;
     opt.flags = flags;
 
-    c->add_option(opt);
+    complete_add_options(cmd, cmd_is_path, std::vector<complete_entry_opt_t>(1, opt));
+}
+
+void complete_add_options(const wcstring &cmd, bool cmd_is_path, const std::vector<complete_entry_opt_t> &opts)
+{
+    /* Lock the lock that allows us to edit the completion entry list */
+    scoped_lock lock(completion_lock);
+
+    completion_entry_t *c = complete_get_exact_entry(cmd, cmd_is_path);
+    for (size_t i=0; i < opts.size(); i++)
+    {
+        c->add_option(opts.at(i));
+    }
 }
 
 /**
@@ -583,7 +808,7 @@ void complete_add(const wchar_t *cmd,
 bool completion_entry_t::remove_option(wchar_t short_opt, const wchar_t *long_opt, int old_mode)
 {
     ASSERT_IS_LOCKED(completion_lock);
-    ASSERT_IS_LOCKED(completion_entry_lock);
+    this->option_index.reset();
     if ((short_opt == 0) && (long_opt == 0))
     {
         this->options.clear();
@@ -637,7 +862,6 @@ void complete_remove(const wchar_t *cmd,
 {
     CHECK(cmd,);
     scoped_lock lock(completion_lock);
-    scoped_lock lock2(completion_entry_lock);
 
     completion_entry_t tmp_entry(cmd, cmd_is_path, L"", false);
     completion_entry_set_t::iterator iter = completion_set.find(&tmp_entry);
@@ -649,6 +873,7 @@ void complete_remove(const wchar_t *cmd,
         {
             /* Delete this entry */
             completion_set.erase(iter);
+            wildcard_completion_set.erase(entry);
             delete entry;
         }
     }
@@ -764,16 +989,11 @@ int complete_is_valid_option(const wcstring &str,
     }
 
     scoped_lock lock(completion_lock);
-    scoped_lock lock2(completion_entry_lock);
-    for (completion_entry_set_t::const_iterator iter = completion_set.begin(); iter != completion_set.end(); ++iter)
+    std::vector<const completion_entry_t *> entries;
+    complete_find_matching_entries(cmd, path, &entries);
+    for (std::vector<const completion_entry_t *>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
     {
         const completion_entry_t *i = *iter;
-        const wcstring &match = i->cmd_is_path ? path : cmd;
-
-        if (!wildcard_match(match, i->cmd))
-        {
-            continue;
-        }
 
         found_match = true;
 
@@ -935,7 +1155,7 @@ void completer_t::complete_strings(const wcstring &wc_escaped,
     if (! expand_one(tmp, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_WILDCARDS | this->expand_flags(), NULL))
         return;
 
-    const wcstring wc = parse_util_unescape_wildcards(tmp);
+    const wildcard_pattern_t wc(parse_util_unescape_wildcards(tmp));
 
     for (size_t i=0; i< possible_comp.size(); i++)
     {
@@ -944,11 +1164,138 @@ void completer_t::complete_strings(const wcstring &wc_escaped,
 
         if (next_str)
         {
-            wildcard_complete(next_str, wc.c_str(), desc, desc_func, &this->completions, this->expand_flags(), flags);
+            wc.complete(next_str, desc, desc_func, &this->completions, this->expand_flags(), flags);
         }
     }
 }
 
+/** The descriptions of all commands whose names start with some prefix, as found by __fish_describe_command. The prefix is the key. */
+class command_descriptions_node_t : public lru_node_t
+{
+public:
+    /** Descriptions keyed by command name */
+    std::map<wcstring, wcstring> descriptions;
+
+    command_descriptions_node_t(const wcstring &prefix) : lru_node_t(prefix) {}
+};
+
+class command_descriptions_cache_t : public lru_cache_t<command_descriptions_node_t>
+{
+    virtual void node_was_evicted(command_descriptions_node_t *node)
+    {
+        delete node;
+    }
+
+public:
+    /** The modification time of the whatis database when the cached descriptions were looked up */
+    time_t database_mtime;
+
+    command_descriptions_cache_t() : lru_cache_t<command_descriptions_node_t>(16), database_mtime(0) {}
+};
+
+/** Command descriptions we have looked up. Only used from the main thread. */
+static command_descriptions_cache_t s_command_descriptions;
+
+/** Files and directories that apropos reads, or that change when its database is rebuilt */
+static const char * const k_whatis_database_paths[] =
+{
+    "/var/cache/man",
+    "/var/cache/man/index.db",
+    "/var/cache/man/whatis",
+    "/usr/share/man/index.db",
+    "/usr/share/man/whatis",
+    "/usr/local/share/man/whatis"
+};
+
+/** Return the latest modification time of the whatis database, so we know when cached descriptions are stale */
+static time_t whatis_database_mtime()
+{
+    time_t result = 0;
+    for (size_t i=0; i < sizeof k_whatis_database_paths / sizeof *k_whatis_database_paths; i++)
+    {
+        struct stat buf;
+        if (stat(k_whatis_database_paths[i], &buf) == 0 && buf.st_mtime > result)
+        {
+            result = buf.st_mtime;
+        }
+    }
+    return result;
+}
+
+/**
+   Return the descriptions of the commands whose names start with the given prefix. These come from the cache if we looked up this prefix, or a shorter one, since the whatis database last changed. Otherwise run __fish_describe_command, which can take some time on slower systems with a large set of manuals. Returns NULL if the lookup fails.
+*/
+static const command_descriptions_node_t *lookup_command_descriptions(const wcstring &prefix)
+{
+    ASSERT_IS_MAIN_THREAD();
+    
+    const time_t mtime = whatis_database_mtime();
+    if (mtime != s_command_descriptions.database_mtime)
+    {
+        s_command_descriptions.evict_all_nodes();
+        s_command_descriptions.database_mtime = mtime;
+    }
+    
+    /* A shorter prefix finds every command that this one does. Prefixes shorter than two characters are never looked up. */
+    for (size_t len = prefix.size(); len >= 2; len--)
+    {
+        command_descriptions_node_t *node = s_command_descriptions.get_node(wcstring(prefix, 0, len));
+        if (node != NULL)
+        {
+            return node;
+        }
+    }
+
+    wcstring lookup_cmd(L"__fish_describe_command ");
+    lookup_cmd.append(escape_string(prefix, 1));
+
+    /*
+      Locate a list of possible descriptions using a single
+      call to apropos or a direct search if we know the location
+      of the whatis database.
+    */
+    wcstring_list_t list;
+    if (exec_subshell(lookup_cmd, list, false /* don't apply exit status */) == -1)
+    {
+        return NULL;
+    }
+
+    /*
+      Then discard anything that is not a possible completion and put
+      the result into a map with the command name as key and the
+      description as value.
+    */
+    command_descriptions_node_t *node = new command_descriptions_node_t(prefix);
+    for (size_t i=0; i < list.size(); i++)
+    {
+        const wcstring &elstr = list.at(i);
+
+        size_t tab_idx = elstr.find(L'\t');
+        if (tab_idx == wcstring::npos || tab_idx < prefix.size())
+            continue;
+
+        const wcstring key(elstr, 0, tab_idx);
+        wcstring val(elstr, tab_idx + 1);
+
+        /*
+          And once again I make sure the first character is uppercased
+          because I like it that way, and I get to decide these
+          things.
+        */
+        if (! val.empty())
+            val[0]=towupper(val[0]);
+
+        node->descriptions[key] = val;
+    }
+    
+    if (! s_command_descriptions.add_node(node))
+    {
+        delete node;
+        return NULL;
+    }
+    return node;
+}
+
 /**
    If command to complete is short enough, substitute
    the description with the whatis information for the executable.
@@ -995,79 +1342,34 @@ void completer_t::complete_cmd_desc(const wcstring &str)
 
     }
 
-    if (skip)
+    if (skip || reader_thread_job_is_stale())
     {
         return;
     }
 
 
-    wcstring lookup_cmd(L"__fish_describe_command ");
-    lookup_cmd.append(escape_string(cmd_start, 1));
-
-    std::map<wcstring, wcstring> lookup;
+    const command_descriptions_node_t *node = lookup_command_descriptions(cmd_start);
+    if (node == NULL)
+    {
+        return;
+    }
 
     /*
-      First locate a list of possible descriptions using a single
-      call to apropos or a direct search if we know the location
-      of the whatis database. This can take some time on slower
-      systems with a large set of manuals, but it should be ok
-      since apropos is only called once.
+      Then do a lookup on every completion and if a match is found,
+      change to the new description.
     */
-    wcstring_list_t list;
-    if (exec_subshell(lookup_cmd, list, false /* don't apply exit status */) != -1)
+    const wcstring prefix = cmd_start;
+    for (size_t i=0; i<this->completions.size(); i++)
     {
+        completion_t &completion = this->completions.at(i);
+        const wcstring &el = completion.completion;
+        if (el.empty())
+            continue;
 
-        /*
-          Then discard anything that is not a possible completion and put
-          the result into a hashtable with the completion as key and the
-          description as value.
-
-          Should be reasonably fast, since no memory allocations are needed.
-        */
-        for (size_t i=0; i < list.size(); i++)
-        {
-            const wcstring &elstr = list.at(i);
-
-            const wcstring fullkey(elstr, wcslen(cmd_start));
-
-            size_t tab_idx = fullkey.find(L'\t');
-            if (tab_idx == wcstring::npos)
-                continue;
-
-            const wcstring key(fullkey, 0, tab_idx);
-            wcstring val(fullkey, tab_idx + 1);
-
-            /*
-              And once again I make sure the first character is uppercased
-              because I like it that way, and I get to decide these
-              things.
-            */
-            if (! val.empty())
-                val[0]=towupper(val[0]);
-
-            lookup[key] = val;
-        }
-
-        /*
-          Then do a lookup on every completion and if a match is found,
-          change to the new description.
-
-          This needs to do a reallocation for every description added, but
-          there shouldn't be that many completions, so it should be ok.
-        */
-        for (size_t i=0; i<this->completions.size(); i++)
-        {
-            completion_t &completion = this->completions.at(i);
-            const wcstring &el = completion.completion;
-            if (el.empty())
-                continue;
-
-            std::map<wcstring, wcstring>::iterator new_desc_iter = lookup.find(el);
-            if (new_desc_iter != lookup.end())
-                completion.description = new_desc_iter->second;
-        }
+        std::map<wcstring, wcstring>::const_iterator new_desc_iter = node->descriptions.find(prefix + el);
+        if (new_desc_iter != node->descriptions.end())
+            completion.set_description(new_desc_iter->second);
     }
-
 }
 
 /**
@@ -1085,6 +1387,21 @@ static wcstring complete_function_desc(const wcstring &fn)
 }
 
 
+/**
+   Returns whether the command token str is just a name, which expands to
+   itself. Such tokens are completed from cached directory listings.
+*/
+static bool command_token_is_literal(const wcstring &str)
+{
+    for (size_t i=0; i < str.size(); i++)
+    {
+        wchar_t c = str.at(i);
+        if (! iswalnum(c) && ! wcschr(L"-_.+,:@=", c))
+            return false;
+    }
+    return true;
+}
+
 /**
    Complete the specified command name. Search for executables in the
    path, executables defined using an absolute path, functions,
@@ -1132,9 +1449,10 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
             const env_var_t path = env_get_string(L"PATH");
             if (!path.missing())
             {
+                const bool cmd_is_literal = command_token_is_literal(str_cmd);
                 wcstring base_path;
                 wcstokenizer tokenizer(path, ARRAY_SEP_STR);
-                while (tokenizer.next(base_path))
+                while (! reader_thread_job_is_stale() && tokenizer.next(base_path))
                 {
                     if (base_path.empty())
                         continue;
@@ -1143,6 +1461,13 @@ void completer_t::complete_cmd(const wcstring &str_cmd, bool use_function, bool
                     if (base_path.at(base_path.size() - 1) != L'/')
                         base_path.push_back(L'/');
 
+                    if (cmd_is_literal)
+                    {
+                        /* The common case. Complete from the cached listing of the directory. */
+                        wildcard_complete_dir_entries(str_cmd, base_path, EXPAND_FOR_COMPLETIONS | EXECUTABLES_ONLY | this->expand_flags(), &this->completions);
+                        continue;
+                    }
+
                     wcstring nxt_completion = base_path;
                     nxt_completion.append(str_cmd);
 
@@ -1209,6 +1534,10 @@ void completer_t::complete_from_args(const wcstring &str,
                                      const wcstring &desc,
                                      complete_flags_t flags)
 {
+    /* Expanding the arguments may run commands, which is wasted work if the user has moved on */
+    if (reader_thread_job_is_stale())
+        return;
+
     bool is_autosuggest = (this->type() == COMPLETE_AUTOSUGGEST);
     parser_t parser(is_autosuggest ? PARSER_TYPE_COMPLETIONS_ONLY : PARSER_TYPE_GENERAL, false /* don't show errors */);
 
@@ -1320,6 +1649,11 @@ void complete_load(const wcstring &name, bool reload)
     completion_autoloader.load(name, reload);
 }
 
+bool complete_can_load(const wcstring &cmd, const env_vars_snapshot_t &vars)
+{
+    return completion_autoloader.can_load(cmd, vars);
+}
+
 // Performed on main thread, from background thread. Return type is ignored.
 static int complete_load_no_reload(wcstring *name)
 {
@@ -1339,11 +1673,15 @@ static int complete_load_no_reload(wcstring *name)
  
    Insert results into comp_out. Return true to perform file completion, false to disable it.
 */
-struct local_options_t
+typedef std::vector<shared_ptr<const completion_option_index_t> > option_index_list_t;
+
+/* Sorts the option indexes found by the completion_option_index_t lookups and removes duplicates, so options are tried in their usual order */
+static void sort_option_candidates(std::vector<size_t> *candidates)
 {
-    wcstring short_opt_str;
-    option_list_t options;
-};
+    std::sort(candidates->begin(), candidates->end());
+    candidates->erase(std::unique(candidates->begin(), candidates->end()), candidates->end());
+}
+
 bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spopt, const wcstring &sstr, bool use_switches)
 {
     const wchar_t * const cmd_orig = scmd_orig.c_str();
@@ -1369,33 +1707,26 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
         }
     }
 
-    /* Make a list of lists of all options that we care about */
-    std::vector<local_options_t> all_options;
+    /* Get the option snapshots of all entries that we care about */
+    option_index_list_t all_options;
     {
         scoped_lock lock(completion_lock);
-        scoped_lock lock2(completion_entry_lock);
-        for (completion_entry_set_t::const_iterator iter = completion_set.begin(); iter != completion_set.end(); ++iter)
+        std::vector<const completion_entry_t *> entries;
+        complete_find_matching_entries(cmd, path, &entries);
+        for (std::vector<const completion_entry_t *>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
         {
-            const completion_entry_t *i = *iter;
-            const wcstring &match = i->cmd_is_path ? path : cmd;
-            if (! wildcard_match(match, i->cmd))
-            {
-                continue;
-            }
-
-            /* Copy all of their options into our list */
-            all_options.push_back(local_options_t());
-            all_options.back().short_opt_str = i->get_short_opt_str();
-            all_options.back().options = i->get_options(); //Oof, this is a lot of copying
+            all_options.push_back((*iter)->get_option_index());
         }
     }
 
     /* Now release the lock and test each option that we captured above.
        We have to do this outside the lock because callouts (like the condition) may add or remove completions.
        See https://github.com/ridiculousfish/fishfish/issues/2 */
-    for (std::vector<local_options_t>::const_iterator iter = all_options.begin(); iter != all_options.end(); ++iter)
+    std::vector<size_t> candidates;
+    for (option_index_list_t::const_iterator iter = all_options.begin(); iter != all_options.end(); ++iter)
     {
-        const option_list_t &options = iter->options;
+        const completion_option_index_t &index = **iter;
+        const std::vector<complete_entry_opt_t> &options = index.options;
         use_common=1;
         if (use_switches)
         {
@@ -1404,9 +1735,20 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
             {
                 /* Check if we are entering a combined option and argument
                    (like --color=auto or -I/usr/include) */
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                candidates.clear();
+                index.find_short(str[1], &candidates);
+                if (str[1] == L'-')
+                {
+                    for (const wchar_t *eq = wcschr(str + 2, L'='); eq != NULL; eq = wcschr(eq + 1, L'='))
+                    {
+                        index.find_long(wcstring(str + 2, eq), true, &candidates);
+                    }
+                }
+                sort_option_candidates(&candidates);
+
+                for (std::vector<size_t>::const_iterator citer = candidates.begin(); citer != candidates.end(); ++citer)
                 {
-                    const complete_entry_opt_t *o = &*oiter;
+                    const complete_entry_opt_t *o = &options.at(*citer);
                     wchar_t *arg;
                     if ((arg=param_match2(o, str))!=0 && this->condition_test(o->condition))
                     {
@@ -1426,9 +1768,13 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                   If we are using old style long options, check for them
                   first
                 */
-                for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                candidates.clear();
+                index.find_long(popt + 1, true, &candidates);
+                sort_option_candidates(&candidates);
+
+                for (std::vector<size_t>::const_iterator citer = candidates.begin(); citer != candidates.end(); ++citer)
                 {
-                    const complete_entry_opt_t *o = &*oiter;
+                    const complete_entry_opt_t *o = &options.at(*citer);
                     if (o->old_mode)
                     {
                         if (param_match_old(o, popt) && this->condition_test(o->condition))
@@ -1448,9 +1794,17 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                 */
                 if (!old_style_match)
                 {
-                    for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+                    candidates.clear();
+                    index.find_short(popt[1], &candidates);
+                    if (popt[1] == L'-')
+                    {
+                        index.find_long(popt + 2, true, &candidates);
+                    }
+                    sort_option_candidates(&candidates);
+
+                    for (std::vector<size_t>::const_iterator citer = candidates.begin(); citer != candidates.end(); ++citer)
                     {
-                        const complete_entry_opt_t *o = &*oiter;
+                        const complete_entry_opt_t *o = &options.at(*citer);
                         /*
                           Gnu-style options with _optional_ arguments must
                           be specified as a single token, so that it can
@@ -1473,10 +1827,26 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
 
         if (use_common)
         {
+            /* Only options without a switch, and switches that the current token may be the start of, can produce completions here */
+            candidates.clear();
+            index.find_plain(&candidates);
+            if (str[0] == L'-' && use_switches)
+            {
+                if (str[1] != L'-')
+                {
+                    index.find_all_short(&candidates);
+                }
+                index.find_long(str + 1, false, &candidates);
+                if (str[1] == L'-')
+                {
+                    index.find_long(str + 2, false, &candidates);
+                }
+            }
+            sort_option_candidates(&candidates);
 
-            for (option_list_t::const_iterator oiter = options.begin(); oiter != options.end(); ++oiter)
+            for (std::vector<size_t>::const_iterator citer = candidates.begin(); citer != candidates.end(); ++citer)
             {
-                const complete_entry_opt_t *o = &*oiter;
+                const complete_entry_opt_t *o = &options.at(*citer);
                 /*
                   If this entry is for the base command,
                   check if any of the arguments match
@@ -1498,14 +1868,14 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                       Check if the short style option matches
                     */
                     if (o->short_opt != L'\0' &&
-                            short_ok(str, o->short_opt, iter->short_opt_str))
+                            short_ok(str, o->short_opt, index.short_opt_str))
                     {
                         const wcstring desc = o->localized_desc();
                         wchar_t completion[2];
                         completion[0] = o->short_opt;
                         completion[1] = 0;
 
-                        append_completion(&this->completions, completion, desc, 0);
+                        append_completion(&this->completions, completion, completion_fixed_desc_t(desc), 0);
 
                     }
 
@@ -1562,14 +1932,14 @@ bool completer_t::complete_param(const wcstring &scmd_orig, const wcstring &spop
                                 wcstring completion = format_string(L"%ls=", whole_opt.c_str()+offset);
                                 append_completion(&this->completions,
                                                   completion,
-                                                  C_(o->desc),
+                                                  completion_fixed_desc_t(C_(o->desc)),
                                                   flags);
 
                             }
 
                             append_completion(&this->completions,
                                               whole_opt.c_str() + offset,
-                                              C_(o->desc),
+                                              completion_fixed_desc_t(C_(o->desc)),
                                               flags);
                         }
                     }
@@ -1836,6 +2206,25 @@ bool completer_t::try_complete_user(const wcstring &str)
     return res;
 }
 
+/**
+   Condition results kept across completion requests that pass
+   COMPLETION_REQUEST_REUSE_CONDITIONS. Conditions nearly always only
+   look at the command line and the working directory, so the results
+   stay valid as long as neither changes, e.g. when the user presses tab
+   again. Only used on the main thread.
+*/
+static completer_t::condition_cache_t s_reusable_conditions;
+
+/** The command line and working directory that s_reusable_conditions were computed for */
+static wcstring s_reusable_conditions_key;
+
+void complete_invalidate_conditions()
+{
+    ASSERT_IS_MAIN_THREAD();
+    s_reusable_conditions.clear();
+    s_reusable_conditions_key.clear();
+}
+
 void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps, completion_request_flags_t flags)
 {
     /* Determine the innermost subcommand */
@@ -1847,6 +2236,23 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps
     /* Make our completer */
     completer_t completer(cmd, flags);
 
+    wcstring conditions_key;
+    const bool reuse_conditions = (flags & COMPLETION_REQUEST_REUSE_CONDITIONS) && !(flags & COMPLETION_REQUEST_AUTOSUGGESTION);
+    if (reuse_conditions)
+    {
+        ASSERT_IS_MAIN_THREAD();
+        const wchar_t *buff = reader_get_buffer();
+        conditions_key = cmd_with_subcmds;
+        conditions_key.push_back(L'\0');
+        conditions_key.append(buff ? buff : L"");
+        conditions_key.push_back(L'\0');
+        conditions_key.append(env_get_pwd_slash());
+        if (conditions_key == s_reusable_conditions_key)
+        {
+            completer.set_condition_cache(s_reusable_conditions);
+        }
+    }
+
     wcstring current_command;
     const size_t pos = cmd.size();
     bool done=false;
@@ -1873,6 +2279,12 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps
         done = completer.try_complete_variable(current_token) || completer.try_complete_user(current_token);
     }
 
+    /* A superseded autosuggestion need not look any further */
+    if (!done)
+    {
+        done = reader_thread_job_is_stale();
+    }
+
     if (!done)
     {
         //const size_t prev_token_len = (prev_begin ? prev_end - prev_begin : 0);
@@ -2033,7 +2445,7 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps
                         // If any command disables do_file, then they all do
                         do_file = true;
                         const wcstring_list_t wrap_chain = complete_get_wrap_chain(current_command_unescape);
-                        for (size_t i=0; i < wrap_chain.size(); i++)
+                        for (size_t i=0; i < wrap_chain.size() && ! reader_thread_job_is_stale(); i++)
                         {
                             // Hackish, this. The first command in the chain is always the given command. For every command past the first, we need to create a transient commandline for builtin_commandline. But not for COMPLETION_REQUEST_AUTOSUGGESTION, which may occur on background threads.
                             builtin_commandline_scoped_transient_t *transient_cmd = NULL;
@@ -2073,12 +2485,20 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> &comps
                     }
                 }
 
-                /* This function wants the unescaped string */
-                completer.complete_param_expand(current_token, do_file, directories_only);
+                /* This function wants the unescaped string. Skip it if we are an autosuggestion that the user has typed past. */
+                if (! reader_thread_job_is_stale())
+                    completer.complete_param_expand(current_token, do_file, directories_only);
             }
         }
     }
 
+    /* Keep the condition results for the next request, unless some conditions were cut short */
+    if (reuse_conditions && ! reader_thread_job_is_stale())
+    {
+        s_reusable_conditions = completer.get_condition_cache();
+        s_reusable_conditions_key = conditions_key;
+    }
+
     comps = completer.get_completions();
 }
 
@@ -2103,7 +2523,6 @@ static void append_switch(wcstring &out,
 void complete_print(wcstring &out)
 {
     scoped_lock locker(completion_lock);
-    scoped_lock locker2(completion_entry_lock);
 
     // Get a list of all completions in a vector, then sort it by order
     std::vector<const completion_entry_t *> all_completions(completion_set.begin(), completion_set.end());
@@ -2290,3 +2709,31 @@ wcstring_list_t complete_get_wrap_pairs()
     }
     return result;
 }
+
+void complete_get_memory_stats(std::vector<memory_stats_t> *out)
+{
+    memory_stats_t entry_stats(L"completion commands"), option_stats(L"completion options");
+    scoped_lock lock(completion_lock);
+    for (completion_entry_set_t::const_iterator iter = completion_set.begin(); iter != completion_set.end(); ++iter)
+    {
+        const completion_entry_t *entry = *iter;
+        entry_stats.entries++;
+        entry_stats.bytes += TREE_NODE_OVERHEAD + sizeof *entry + wcstring_heap_size(entry->cmd) + wcstring_heap_size(entry->get_short_opt_str());
+
+        const option_list_t &options = entry->get_options();
+        for (option_list_t::const_iterator opt = options.begin(); opt != options.end(); ++opt)
+        {
+            option_stats.entries++;
+            option_stats.bytes += 2 * sizeof(void *) + complete_option_memory_size(*opt);
+        }
+
+        /* The indexed snapshot holds a second copy of the options */
+        if (entry->option_index)
+        {
+            option_stats.bytes += entry->option_index->memory_size();
+        }
+    }
+    entry_stats.bytes += wildcard_completion_set.size() * (TREE_NODE_OVERHEAD + sizeof(completion_entry_t *));
+    out->push_back(entry_stats);
+    out->push_back(option_stats);
+}
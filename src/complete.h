@@ -16,6 +16,10 @@
 #include <stdint.h>
 
 #include "common.h"
+#include "io.h"
+
+class env_vars_snapshot_t;
+
 /**
  * Use all completions
  */
@@ -78,6 +82,19 @@ enum
 typedef int complete_flags_t;
 
 
+/**
+   A completion description that is one of a fixed set, such as a translated
+   message or the description of an option given to complete. Completions
+   share an interned copy of it. The intern table is never emptied, so
+   descriptions that include values, like those of variables, must not be
+   made fixed.
+*/
+struct completion_fixed_desc_t
+{
+    const wchar_t *str;
+    explicit completion_fixed_desc_t(const wcstring &desc);
+};
+
 class completion_t
 {
 
@@ -92,8 +109,14 @@ public:
     /** The completion string */
     wcstring completion;
 
-    /** The description for this completion */
-    wcstring description;
+    /** The description for this completion. Never NULL. Fixed descriptions, such as those of options, repeat across many completions, so they are interned. Others are stored once, in description_storage, which copies of the completion share. */
+    const wchar_t *description;
+
+private:
+    /** The description, unless it is fixed or empty */
+    shared_ptr<const wcstring> description_storage;
+
+public:
 
     /** The type of fuzzy match */
     string_fuzzy_match_t match;
@@ -112,9 +135,13 @@ public:
 
     /* Construction. Note: defining these so that they are not inlined reduces the executable size. */
     completion_t(const wcstring &comp, const wcstring &desc = wcstring(), string_fuzzy_match_t match = string_fuzzy_match_t(fuzzy_match_exact), complete_flags_t flags_val = 0);
+    completion_t(const wcstring &comp, const completion_fixed_desc_t &desc, string_fuzzy_match_t match = string_fuzzy_match_t(fuzzy_match_exact), complete_flags_t flags_val = 0);
     completion_t(const completion_t &);
     completion_t &operator=(const completion_t &);
 
+    /** Replaces the description */
+    void set_description(const wcstring &desc);
+
     /* Compare two completions. No operating overlaoding to make this always explicit (there's potentially multiple ways to compare completions). */
     
     /* "Naturally less than" means in a natural ordering, where digits are treated as numbers. For example, foo10 is naturally greater than foo2 (but alphabetically less than it) */
@@ -130,10 +157,47 @@ enum
     COMPLETION_REQUEST_DEFAULT = 0,
     COMPLETION_REQUEST_AUTOSUGGESTION = 1 << 0, // indicates the completion is for an autosuggestion
     COMPLETION_REQUEST_DESCRIPTIONS = 1 << 1, // indicates that we want descriptions
-    COMPLETION_REQUEST_FUZZY_MATCH = 1 << 2 // indicates that we don't require a prefix match
+    COMPLETION_REQUEST_FUZZY_MATCH = 1 << 2, // indicates that we don't require a prefix match
+    COMPLETION_REQUEST_REUSE_CONDITIONS = 1 << 3 // indicates that condition results of an earlier request for the same command line may be reused
 };
 typedef uint32_t completion_request_flags_t;
 
+/**
+   Struct describing a completion option entry.
+
+   If short_opt and long_opt are both zero, the comp field must not be
+   empty and contains a list of arguments to the command.
+
+   If either short_opt or long_opt are non-zero, they specify a switch
+   for the command. If \c comp is also not empty, it contains a list
+   of non-switch arguments that may only follow directly after the
+   specified switch.
+*/
+typedef struct complete_entry_opt
+{
+    /** Short style option */
+    wchar_t short_opt;
+    /** Long style option */
+    wcstring long_opt;
+    /** Arguments to the option */
+    wcstring comp;
+    /** Description of the completion */
+    wcstring desc;
+    /** Condition under which to use the option */
+    wcstring condition;
+    /** Must be one of the values SHARED, NO_FILES, NO_COMMON,
+      EXCLUSIVE, and determines how completions should be performed
+      on the argument after the switch. */
+    int result_mode;
+    /** True if old style long options are used */
+    int old_mode;
+    /** Completion flags */
+    complete_flags_t flags;
+
+    /** The description, translated */
+    const wcstring localized_desc() const;
+} complete_entry_opt_t;
+
 /**
 
   Add a completion.
@@ -189,6 +253,14 @@ void complete_add(const wchar_t *cmd,
                   const wchar_t *comp,
                   const wchar_t *desc,
                   int flags);
+/**
+  Add many completions for one command at once, in order, as if by
+  calling complete_add for each of them. This looks up the command's
+  entry and takes the lock only once, which makes a difference for
+  commands with hundreds of options.
+*/
+void complete_add_options(const wcstring &cmd, bool cmd_is_path, const std::vector<complete_entry_opt_t> &opts);
+
 /**
   Sets whether the completion list for this command is complete. If
   true, any options not matching one of the provided options will be
@@ -249,6 +321,11 @@ bool complete_is_valid_argument(const wcstring &str,
 */
 void complete_load(const wcstring &cmd, bool reload);
 
+/**
+   Returns whether completions for the given command could be autoloaded, given the values of the variables in vars. This only looks for the file, and may be called from a background thread.
+*/
+bool complete_can_load(const wcstring &cmd, const env_vars_snapshot_t &vars);
+
 /**
    Create a new completion entry
 
@@ -259,10 +336,14 @@ void complete_load(const wcstring &cmd, bool reload);
 
 */
 void append_completion(std::vector<completion_t> *completions, const wcstring &comp, const wcstring &desc = wcstring(), int flags = 0, string_fuzzy_match_t match = string_fuzzy_match_t(fuzzy_match_exact));
+void append_completion(std::vector<completion_t> *completions, const wcstring &comp, const completion_fixed_desc_t &desc, int flags = 0, string_fuzzy_match_t match = string_fuzzy_match_t(fuzzy_match_exact));
 
 /* Function used for testing */
 void complete_set_variable_names(const wcstring_list_t *names);
 
+/** Forget the condition results kept for COMPLETION_REQUEST_REUSE_CONDITIONS. Call this whenever the state that conditions test may have changed, e.g. when a new command line is begun. */
+void complete_invalidate_conditions();
+
 /* Support for "wrap targets." A wrap target is a command that completes liek another command. The target chain is the sequence of wraps (A wraps B wraps C...). Any loops in the chain are silently ignored. */
 bool complete_add_wrapper(const wcstring &command, const wcstring &wrap_target);
 bool complete_remove_wrapper(const wcstring &command, const wcstring &wrap_target);
@@ -271,4 +352,7 @@ wcstring_list_t complete_get_wrap_chain(const wcstring &command);
 /* Wonky interface: returns all wraps. Even-values are the commands, odd values are the targets. */
 wcstring_list_t complete_get_wrap_pairs();
 
+/** Appends estimates of the memory held by the completion definitions to out */
+void complete_get_memory_stats(std::vector<memory_stats_t> *out);
+
 #endif
@@ -23,6 +23,7 @@
 #include "fallback.h"
 
 #include "wutil.h"
+#include "util.h"
 #include "proc.h"
 #include "common.h"
 #include "env.h"
@@ -34,6 +35,9 @@
 #include "input.h"
 #include "event.h"
 #include "path.h"
+#include "iothread.h"
+#include "io.h"
+#include "autoload.h"
 
 #include "fish_version.h"
 
@@ -60,6 +64,223 @@ bool g_log_forks = false;
 bool g_use_posix_spawn = false; //will usually be set to true
 
 
+/**
+   Hashes a variable name for env_var_table_t (FNV-1a). A lookup that searches several scopes computes this once.
+*/
+static size_t env_hash_key(const wcstring &key)
+{
+    size_t hash = 2166136261u;
+    for (size_t i=0; i < key.size(); i++)
+    {
+        hash ^= (size_t)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+   The variables of one scope. This is a hash table using open addressing with linear probing, so a lookup typically touches one or two adjacent slots instead of doing a string comparison at each level of a tree.
+*/
+class env_var_table_t
+{
+public:
+    enum slot_state_t
+    {
+        slot_empty,
+        slot_used,
+        slot_erased
+    };
+
+    struct slot_t
+    {
+        wcstring key;
+        var_entry_t entry;
+        size_t hash;
+        slot_state_t state;
+
+        slot_t() : hash(0), state(slot_empty) { }
+    };
+
+    class const_iterator
+    {
+        const std::vector<slot_t> *slots;
+        size_t idx;
+
+        void skip_unused()
+        {
+            while (idx < slots->size() && slots->at(idx).state != slot_used)
+                idx++;
+        }
+
+    public:
+        const_iterator() : slots(NULL), idx(0) { }
+
+        const_iterator(const std::vector<slot_t> *s, size_t i) : slots(s), idx(i)
+        {
+            skip_unused();
+        }
+
+        const slot_t *operator->() const
+        {
+            return &slots->at(idx);
+        }
+
+        const_iterator &operator++()
+        {
+            idx++;
+            skip_unused();
+            return *this;
+        }
+
+        bool operator!=(const const_iterator &rhs) const
+        {
+            return idx != rhs.idx;
+        }
+    };
+
+private:
+    /* The slots. The count is zero or a power of two. */
+    std::vector<slot_t> slots;
+
+    /* Number of used slots */
+    size_t used_count;
+
+    /* Number of erased slots. These still have to be probed past, so they count towards the load. */
+    size_t erased_count;
+
+    /* Returns the index of the slot holding the key, or of the empty slot that ends its probe sequence. The table must not be empty. */
+    size_t probe(const wcstring &key, size_t hash) const
+    {
+        const size_t mask = slots.size() - 1;
+        size_t idx = hash & mask;
+        for (;;)
+        {
+            const slot_t &slot = slots[idx];
+            if (slot.state == slot_empty || (slot.state == slot_used && slot.hash == hash && slot.key == key))
+                return idx;
+            idx = (idx + 1) & mask;
+        }
+    }
+
+    /* Rebuilds the table with the given number of slots, dropping erased slots */
+    void rehash(size_t new_size)
+    {
+        std::vector<slot_t> old_slots(new_size);
+        old_slots.swap(slots);
+        erased_count = 0;
+        const size_t mask = slots.size() - 1;
+        for (size_t i=0; i < old_slots.size(); i++)
+        {
+            slot_t &old_slot = old_slots[i];
+            if (old_slot.state != slot_used)
+                continue;
+            size_t idx = old_slot.hash & mask;
+            while (slots[idx].state != slot_empty)
+                idx = (idx + 1) & mask;
+            slot_t &slot = slots[idx];
+            slot.key.swap(old_slot.key);
+            slot.entry.val.swap(old_slot.entry.val);
+            slot.entry.exportv = old_slot.entry.exportv;
+            slot.hash = old_slot.hash;
+            slot.state = slot_used;
+        }
+    }
+
+public:
+    env_var_table_t() : used_count(0), erased_count(0) { }
+
+    /* Returns the entry for the key, whose hash is given, or NULL */
+    const var_entry_t *find(const wcstring &key, size_t hash) const
+    {
+        if (slots.empty())
+            return NULL;
+        const slot_t &slot = slots[probe(key, hash)];
+        return slot.state == slot_used ? &slot.entry : NULL;
+    }
+
+    var_entry_t *find(const wcstring &key, size_t hash)
+    {
+        return const_cast<var_entry_t *>(static_cast<const env_var_table_t *>(this)->find(key, hash));
+    }
+
+    const var_entry_t *find(const wcstring &key) const
+    {
+        return find(key, env_hash_key(key));
+    }
+
+    var_entry_t *find(const wcstring &key)
+    {
+        return find(key, env_hash_key(key));
+    }
+
+    /* Returns the entry for the key, creating an empty one if it is not present */
+    var_entry_t &operator[](const wcstring &key)
+    {
+        const size_t hash = env_hash_key(key);
+
+        /* Keep the load, including erased slots, at most three quarters */
+        if ((used_count + erased_count + 1) * 4 > slots.size() * 3)
+        {
+            size_t new_size = 8;
+            while ((used_count + 1) * 2 > new_size)
+                new_size *= 2;
+            rehash(new_size);
+        }
+
+        slot_t &slot = slots[probe(key, hash)];
+        if (slot.state != slot_used)
+        {
+            slot.key = key;
+            slot.hash = hash;
+            slot.state = slot_used;
+            used_count++;
+        }
+        return slot.entry;
+    }
+
+    /* Removes the key. Returns true if it was present. */
+    bool erase(const wcstring &key)
+    {
+        if (slots.empty())
+            return false;
+        slot_t &slot = slots[probe(key, env_hash_key(key))];
+        if (slot.state != slot_used)
+            return false;
+        wcstring().swap(slot.key);
+        slot.entry = var_entry_t();
+        slot.state = slot_erased;
+        used_count--;
+        erased_count++;
+        return true;
+    }
+
+    size_t size() const
+    {
+        return used_count;
+    }
+
+    /* Returns an estimate of the bytes the table takes */
+    size_t memory_size() const
+    {
+        size_t result = slots.capacity() * sizeof(slot_t);
+        for (size_t i=0; i < slots.size(); i++)
+        {
+            result += wcstring_heap_size(slots[i].key) + wcstring_heap_size(slots[i].entry.val);
+        }
+        return result;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(&slots, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(&slots, slots.size());
+    }
+};
+
 /**
    Struct representing one level in the function variable stack
 */
@@ -68,7 +289,7 @@ struct env_node_t
     /**
       Variable table
     */
-    var_table_t env;
+    env_var_table_t env;
     /**
       Does this node imply a new variable scope? If yes, all
       non-global variables below this one in the stack are
@@ -86,10 +307,21 @@ struct env_node_t
     */
     struct env_node_t *next;
 
+    /**
+      Copy of the variable table last published for background threads, or empty if the table has changed since
+    */
+    shared_ptr<const env_var_table_t> published_env;
 
     env_node_t() : new_scope(false), exportv(false), next(NULL) { }
 
-    /* Returns a pointer to the given entry if present, or NULL. */
+    /* Returns the entry for the key, creating an empty one if it is not present, and notes that the table changed */
+    var_entry_t &entry_for_modification(const wcstring &key);
+
+    /* Removes the key, noting that the table changed. Returns true if it was present. */
+    bool erase_entry(const wcstring &key);
+
+    /* Returns a pointer to the given entry if present, or NULL. The hash is that of the key, from env_hash_key. */
+    const var_entry_t *find_entry(const wcstring &key, size_t hash);
     const var_entry_t *find_entry(const wcstring &key);
 
     /* Returns the next scope to search in order, respecting the new_scope flag, or NULL if we're done. */
@@ -101,8 +333,61 @@ class variable_entry_t
     wcstring value; /**< Value of the variable */
 };
 
+/**
+   An immutable copy of the variable scopes visible from the top of the stack, which background threads read instead of the live scopes. Scopes whose variables did not change between publications share their tables.
+*/
+class env_published_t
+{
+public:
+    /* The tables of the scopes, in search order. The last one is the global scope. */
+    std::vector<shared_ptr<const env_var_table_t> > scopes;
+
+    /* Looks up a variable the way env_get_string does in the live scopes */
+    const var_entry_t *find(const wcstring &key, bool search_local, bool search_global, bool has_scope, bool search_exported, bool search_unexported) const
+    {
+        const size_t hash = env_hash_key(key);
+        const size_t global_idx = scopes.size() - 1;
+        size_t idx = search_local ? 0 : global_idx;
+        while (idx < scopes.size())
+        {
+            const var_entry_t *entry = scopes.at(idx)->find(key, hash);
+            if (entry != NULL && (entry->exportv ? search_exported : search_unexported))
+            {
+                return entry;
+            }
+
+            if (has_scope)
+            {
+                if (!search_global || idx == global_idx) break;
+                idx = global_idx;
+            }
+            else
+            {
+                idx++;
+            }
+        }
+        return NULL;
+    }
+};
+
+/**
+   Lock protecting s_published_env. Only held to copy or replace the pointer; variable lookups on background threads take no lock.
+*/
 static pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/** The variables last published for background threads */
+static shared_ptr<const env_published_t> s_published_env;
+
+/** Whether variables or scopes changed since they were last published */
+static bool s_env_publish_needed = true;
+
+/** Returns the variables last published for background threads */
+static shared_ptr<const env_published_t> env_get_published()
+{
+    scoped_lock lock(env_lock);
+    return s_published_env;
+}
+
 /** Top node on the function stack */
 static env_node_t *top = NULL;
 
@@ -117,10 +402,13 @@ static env_universal_t *uvars() {
     return s_universal_variables;
 }
 
+/** Whether this shell changed universal variables without writing them out yet */
+static bool s_universal_changes_pending = false;
+
 /**
    Table for global variables
 */
-static var_table_t *global;
+static env_var_table_t *global;
 
 /* Helper class for storing constant strings, without needing to wrap them in a wcstring */
 
@@ -153,18 +441,39 @@ static bool is_electric(const wcstring &key)
 }
 
 /**
-   Exported variable array used by execv
+   The exported variables, as the key=value strings passed to execv, by name
 */
-static null_terminated_array_t<char> export_array;
+static std::map<wcstring, std::string> export_table;
+
+/**
+   Exported variable array used by execv. Points into the strings of export_table.
+*/
+static std::vector<const char *> export_array;
 
 /**
    Flag for checking if we need to regenerate the exported variable
-   array
+   array from scratch
 */
 static bool has_changed_exported = true;
+
+/**
+   Names of variables whose entries in export_table may be out of date. Only these are looked up again, unless the whole table must be regenerated.
+*/
+static std::set<wcstring> changed_exported_keys;
+
 static void mark_changed_exported()
 {
     has_changed_exported = true;
+    changed_exported_keys.clear();
+}
+
+/**
+   Notes that the given variable's export status or exported value may have changed, without affecting other variables
+*/
+static void mark_changed_exported(const wcstring &key)
+{
+    if (! has_changed_exported)
+        changed_exported_keys.insert(key);
 }
 
 /**
@@ -184,15 +493,14 @@ static const wchar_t * const locale_variable[] =
 };
 
 
+const var_entry_t *env_node_t::find_entry(const wcstring &key, size_t hash)
+{
+    return env.find(key, hash);
+}
+
 const var_entry_t *env_node_t::find_entry(const wcstring &key)
 {
-    const var_entry_t *result = NULL;
-    var_table_t::const_iterator where = env.find(key);
-    if (where != env.end())
-    {
-        result = &where->second;
-    }
-    return result;
+    return env.find(key);
 }
 
 env_node_t *env_node_t::next_scope_to_search(void)
@@ -200,6 +508,45 @@ env_node_t *env_node_t::next_scope_to_search(void)
     return this->new_scope ? global_env : this->next;
 }
 
+var_entry_t &env_node_t::entry_for_modification(const wcstring &key)
+{
+    ASSERT_IS_MAIN_THREAD();
+    published_env.reset();
+    s_env_publish_needed = true;
+    return env[key];
+}
+
+bool env_node_t::erase_entry(const wcstring &key)
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (! env.erase(key))
+        return false;
+    published_env.reset();
+    s_env_publish_needed = true;
+    return true;
+}
+
+void env_publish()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (! s_env_publish_needed)
+        return;
+
+    shared_ptr<env_published_t> published(new env_published_t());
+    for (env_node_t *node = top; node != NULL; node = node->next_scope_to_search())
+    {
+        if (node->published_env.get() == NULL)
+        {
+            node->published_env.reset(new env_var_table_t(node->env));
+        }
+        published->scopes.push_back(node->published_env);
+    }
+
+    scoped_lock lock(env_lock);
+    s_published_env = published;
+    s_env_publish_needed = false;
+}
+
 /**
    Return the current umask value.
 */
@@ -296,6 +643,12 @@ static void handle_locale()
 }
 
 
+/** Return whether the given variable sets a color used by highlighting or the pager */
+static bool var_is_color(const wcstring &key)
+{
+    return string_prefixes_string(L"fish_color_", key) || string_prefixes_string(L"fish_pager_color_", key);
+}
+
 /** React to modifying hte given variable */
 static void react_to_variable_change(const wcstring &key)
 {
@@ -308,10 +661,50 @@ static void react_to_variable_change(const wcstring &key)
         update_fish_color_support();
         reader_react_to_color_change();
     }
-    else if (string_prefixes_string(L"fish_color_", key))
+    else if (var_is_color(key))
     {
         reader_react_to_color_change();
     }
+    else if (key == L"PATH")
+    {
+        path_invalidate_cache();
+    }
+    else if (key == USER_ABBREVIATIONS_VARIABLE_NAME)
+    {
+        expand_abbreviations_changed();
+    }
+    else if (key == L"fish_iothread_max" && is_main_thread())
+    {
+        const env_var_t val = env_get_string(key);
+        iothread_set_max_threads(val.missing_or_empty() ? 0 : fish_wcstoi(val.c_str(), NULL, 10));
+    }
+    else if (key == L"fish_autoload_cache_size" && is_main_thread())
+    {
+        const env_var_t val = env_get_string(key);
+        int capacity = val.missing_or_empty() ? 0 : fish_wcstoi(val.c_str(), NULL, 10);
+        autoload_set_cache_capacity(capacity > 0 ? capacity : 0);
+    }
+}
+
+/**
+   Fire the event for the variable \c name having been set or erased,
+   as given by \c action. The arguments are only built if a handler
+   may run.
+*/
+static void fire_variable_event(const wchar_t *action, const wcstring &name)
+{
+    if (! event_is_variable_observed(name))
+    {
+        event_fire(NULL);
+        return;
+    }
+
+    event_t ev = event_t::variable_event(name);
+    ev.arguments.reserve(3);
+    ev.arguments.push_back(L"VARIABLE");
+    ev.arguments.push_back(action);
+    ev.arguments.push_back(name);
+    event_fire(&ev);
 }
 
 /**
@@ -343,13 +736,9 @@ static void universal_callback(fish_message_type_t type, const wchar_t *name, co
 
     if (str)
     {
-        mark_changed_exported();
+        mark_changed_exported(name);
 
-        event_t ev = event_t::variable_event(name);
-        ev.arguments.push_back(L"VARIABLE");
-        ev.arguments.push_back(str);
-        ev.arguments.push_back(name);
-        event_fire(&ev);
+        fire_variable_event(str, name);
     }
 
     if (name)
@@ -540,8 +929,10 @@ void env_init(const struct config_paths_t *paths /* or NULL */)
 
     /* Set up universal variables. The empty string means to use the deafult path. */
     assert(s_universal_variables == NULL);
+    long long uvars_start = get_monotonic_time();
     s_universal_variables = new env_universal_t(L"");
     s_universal_variables->load();
+    startup_timing_report(L"universal variables", uvars_start);
 
     /* Set g_log_forks */
     env_var_t log_forks = env_get_string(L"fish_log_forks");
@@ -561,6 +952,7 @@ void env_init(const struct config_paths_t *paths /* or NULL */)
       command-line don't affect the global scope.
     */
     env_push(false);
+    env_publish();
 }
 
 /**
@@ -569,10 +961,11 @@ void env_init(const struct config_paths_t *paths /* or NULL */)
 */
 static env_node_t *env_get_node(const wcstring &key)
 {
+    const size_t hash = env_hash_key(key);
     env_node_t *env = top;
     while (env != NULL)
     {
-        if (env->find_entry(key) != NULL)
+        if (env->find_entry(key, hash) != NULL)
         {
             break;
         }
@@ -582,10 +975,19 @@ static env_node_t *env_get_node(const wcstring &key)
     return env;
 }
 
+/**
+   Fire the event for a variable having been set, and apply its side effects
+*/
+static void variable_was_set(const wcstring &key)
+{
+    fire_variable_event(L"SET", key);
+
+    react_to_variable_change(key);
+}
+
 int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
 {
     ASSERT_IS_MAIN_THREAD();
-    bool has_changed_old = has_changed_exported;
     bool has_changed_new = false;
     int done=0;
 
@@ -668,10 +1070,10 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         if (uvars())
         {
             uvars()->set(key, val, new_export);
-            env_universal_barrier();
+            s_universal_changes_pending = true;
             if (old_export || new_export)
             {
-                mark_changed_exported();
+                mark_changed_exported(key);
             }
         }
     }
@@ -683,10 +1085,9 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         bool preexisting_entry_exportv = false;
         if (preexisting_node != NULL)
         {
-            var_table_t::const_iterator result = preexisting_node->env.find(key);
-            assert(result != preexisting_node->env.end());
-            const var_entry_t &entry = result->second;
-            if (entry.exportv)
+            const var_entry_t *entry = preexisting_node->find_entry(key);
+            assert(entry != NULL);
+            if (entry->exportv)
             {
                 preexisting_entry_exportv = true;
                 has_changed_new = true;
@@ -737,7 +1138,7 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
                 }
 
                 uvars()->set(key, val, exportv);
-                env_universal_barrier();
+                s_universal_changes_pending = true;
 
                 done = 1;
 
@@ -762,7 +1163,7 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         {
             // Set the entry in the node
             // Note that operator[] accesses the existing entry, or creates a new one
-            var_entry_t &entry = node->env[key];
+            var_entry_t &entry = node->entry_for_modification(key);
             if (entry.exportv)
             {
                 // this variable already existed, and was exported
@@ -781,23 +1182,86 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
                 entry.exportv = false;
             }
 
-            if (has_changed_old || has_changed_new)
-                mark_changed_exported();
+            if (has_changed_new)
+                mark_changed_exported(key);
         }
     }
 
-    event_t ev = event_t::variable_event(key);
-    ev.arguments.reserve(3);
-    ev.arguments.push_back(L"VARIABLE");
-    ev.arguments.push_back(L"SET");
-    ev.arguments.push_back(key);
+    variable_was_set(key);
 
-    //  debug( 1, L"env_set: fire events on variable %ls", key );
-    event_fire(&ev);
-    //  debug( 1, L"env_set: return from event firing" );
+    return 0;
+}
 
-    react_to_variable_change(key);
+int env_set_append(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t var_mode, bool prepend)
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    /*
+     Extend the entry in place when the variable already lives in the
+     scope we would set it in and neither its export status nor any
+     special handling is involved. That's the common case of building
+     up a list in a loop, and it needs no copy of the existing value.
+     */
+    env_node_t *node = NULL;
+    if (! (var_mode & (ENV_UNIVERSAL | ENV_EXPORT | ENV_UNEXPORT)) && ! is_read_only(key) && ! is_electric(key) && ! contains(key, L"PWD", L"HOME", L"umask"))
+    {
+        node = env_get_node(key);
+        if ((var_mode & ENV_GLOBAL) && node != global_env)
+            node = NULL;
+        if ((var_mode & ENV_LOCAL) && node != top)
+            node = NULL;
+    }
 
+    if (node == NULL)
+    {
+        /* Take the slow path through env_set, which knows about all the special cases */
+        const env_var_t existing = env_get_string(key, var_mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL));
+        wcstring_list_t list;
+        if (! existing.missing())
+            tokenize_variable_array(existing, list);
+        list.insert(prepend ? list.begin() : list.end(), vals.begin(), vals.end());
+
+        wcstring joined;
+        for (size_t i=0; i < list.size(); i++)
+        {
+            if (i > 0)
+                joined.push_back(ARRAY_SEP);
+            joined.append(list.at(i));
+        }
+        return env_set(key, list.empty() ? NULL : joined.c_str(), var_mode);
+    }
+
+    var_entry_t &entry = node->entry_for_modification(key);
+    if (! vals.empty())
+    {
+        wcstring added;
+        for (size_t i=0; i < vals.size(); i++)
+        {
+            if (i > 0)
+                added.push_back(ARRAY_SEP);
+            added.append(vals.at(i));
+        }
+
+        if (entry.val == ENV_NULL)
+        {
+            entry.val.swap(added);
+        }
+        else if (prepend)
+        {
+            added.push_back(ARRAY_SEP);
+            entry.val.insert(0, added);
+        }
+        else
+        {
+            entry.val.push_back(ARRAY_SEP);
+            entry.val.append(added);
+        }
+    }
+
+    if (entry.exportv)
+        mark_changed_exported(key);
+
+    variable_was_set(key);
     return 0;
 }
 
@@ -815,14 +1279,10 @@ static bool try_remove(env_node_t *n, const wchar_t *key, int var_mode)
         return false;
     }
 
-    var_table_t::iterator result = n->env.find(key);
-    if (result != n->env.end())
+    if (n->erase_entry(key))
     {
-        if (result->second.exportv)
-        {
-            mark_changed_exported();
-        }
-        n->env.erase(result);
+        /* Even an unexported variable may have been hiding an exported one */
+        mark_changed_exported(key);
         return true;
     }
 
@@ -865,11 +1325,7 @@ int env_remove(const wcstring &key, int var_mode)
 
         if (try_remove(first_node, key.c_str(), var_mode))
         {
-            event_t ev = event_t::variable_event(key);
-            ev.arguments.push_back(L"VARIABLE");
-            ev.arguments.push_back(L"ERASE");
-            ev.arguments.push_back(key);
-            event_fire(&ev);
+            fire_variable_event(L"ERASE", key);
 
             erased = 1;
         }
@@ -883,16 +1339,12 @@ int env_remove(const wcstring &key, int var_mode)
         erased = uvars() && uvars()->remove(key);
         if (erased)
         {
-            env_universal_barrier();
-            event_t ev = event_t::variable_event(key);
-            ev.arguments.push_back(L"VARIABLE");
-            ev.arguments.push_back(L"ERASE");
-            ev.arguments.push_back(key);
-            event_fire(&ev);
+            s_universal_changes_pending = true;
+            fire_variable_event(L"ERASE", key);
         }
         
         if (is_exported)
-            mark_changed_exported();
+            mark_changed_exported(key);
     }
 
     react_to_variable_change(key);
@@ -906,6 +1358,20 @@ const wchar_t *env_var_t::c_str(void) const
     return wcstring::c_str();
 }
 
+history_t *env_get_history()
+{
+    /* Big hack...we only allow getting the history on the main thread */
+    if (! is_main_thread())
+        return NULL;
+
+    history_t *history = reader_get_history();
+    if (! history)
+    {
+        history = &history_t::history_with_name(L"fish");
+    }
+    return history;
+}
+
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
 {
     const bool has_scope = mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL);
@@ -920,18 +1386,12 @@ env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
     if (is_electric(key))
     {
         if (!search_global) return env_var_t::missing_var();
-        /* Big hack...we only allow getting the history on the main thread. Note that history_t may ask for an environment variable, so don't take the lock here (we don't need it) */
-        if (key == L"history" && is_main_thread())
+        /* Note that history_t may ask for an environment variable, so don't take the lock here (we don't need it) */
+        history_t *history = (key == L"history" ? env_get_history() : NULL);
+        if (history)
         {
             env_var_t result;
-
-            history_t *history = reader_get_history();
-            if (! history)
-            {
-                history = &history_t::history_with_name(L"fish");
-            }
-            if (history)
-                history->get_string_representation(&result, ARRAY_SEP_STR);
+            history->get_string_representation(&result, ARRAY_SEP_STR);
             return result;
         }
         else if (key == L"COLUMNS")
@@ -953,15 +1413,32 @@ env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode)
         // we should never get here unless the electric var list is out of sync
     }
 
-    if (search_local || search_global) {
-        /* Lock around a local region */
-        scoped_lock lock(env_lock);
-
+    if ((search_local || search_global) && ! is_main_thread())
+    {
+        /* Background threads read the published copy of the variables */
+        const shared_ptr<const env_published_t> published = env_get_published();
+        const var_entry_t *entry = NULL;
+        if (published.get() != NULL)
+        {
+            entry = published->find(key, search_local, search_global, has_scope, search_exported, search_unexported);
+        }
+        if (entry != NULL)
+        {
+            if (entry->val == ENV_NULL)
+            {
+                return env_var_t::missing_var();
+            }
+            return entry->val;
+        }
+    }
+    else if (search_local || search_global)
+    {
+        const size_t hash = env_hash_key(key);
         env_node_t *env = search_local ? top : global_env;
 
         while (env != NULL)
         {
-            const var_entry_t *entry = env->find_entry(key);
+            const var_entry_t *entry = env->find_entry(key, hash);
             if (entry != NULL && (entry->exportv ? search_exported : search_unexported))
             {
                 if (entry->val == ENV_NULL)
@@ -1037,16 +1514,15 @@ bool env_exist(const wchar_t *key, env_mode_flags_t mode)
 
     if (test_local || test_global)
     {
+        const size_t hash = env_hash_key(key);
         env = test_local ? top : global_env;
 
         while (env)
         {
-            var_table_t::iterator result = env->env.find(key);
-
-            if (result != env->env.end())
+            const var_entry_t *res = env->find_entry(key, hash);
+            if (res != NULL)
             {
-                const var_entry_t &res = result->second;
-                return res.exportv ? test_exported : test_unexported;
+                return res->exportv ? test_exported : test_unexported;
             }
 
             if (has_scope)
@@ -1096,16 +1572,35 @@ static int local_scope_exports(env_node_t *n)
     return local_scope_exports(n->next);
 }
 
+/**
+   Whether a local scope that is visible from \c n defines the abbreviations. A new scope hides it, and popping
+   that scope shows it again.
+*/
+static bool local_scope_has_abbreviations(env_node_t *n)
+{
+    for (; n != global_env; n = n->next)
+    {
+        if (n->find_entry(USER_ABBREVIATIONS_VARIABLE_NAME) != NULL)
+            return true;
+        if (n->new_scope)
+            break;
+    }
+    return false;
+}
+
 void env_push(bool new_scope)
 {
     env_node_t *node = new env_node_t;
     node->next = top;
     node->new_scope=new_scope;
+    s_env_publish_needed = true;
 
     if (new_scope)
     {
         if (local_scope_exports(top))
             mark_changed_exported();
+        if (local_scope_has_abbreviations(top))
+            expand_abbreviations_changed();
     }
     top = node;
 
@@ -1116,45 +1611,49 @@ void env_pop()
 {
     if (&top->env != global)
     {
-        int i;
-        int locale_changed = 0;
-
         env_node_t *killme = top;
 
-        for (i=0; locale_variable[i]; i++)
-        {
-            var_table_t::iterator result =  killme->env.find(locale_variable[i]);
-            if (result != killme->env.end())
-            {
-                locale_changed = 1;
-                break;
-            }
-        }
-
         if (killme->new_scope)
         {
             if (killme->exportv || local_scope_exports(killme->next))
                 mark_changed_exported();
+            if (local_scope_has_abbreviations(killme->next))
+                expand_abbreviations_changed();
         }
 
         top = top->next;
+        s_env_publish_needed = true;
 
-        var_table_t::iterator iter;
+        /* Look at what goes away with the scope. Scopes popped by loops and blocks usually hold a variable or two, so this is cheaper than looking up every variable we care about. */
+        bool exports_changed = false, colors_changed = false, locale_changed = false;
+        env_var_table_t::const_iterator iter;
         for (iter = killme->env.begin(); iter != killme->env.end(); ++iter)
         {
-            const var_entry_t &entry = iter->second;
-            if (entry.exportv)
-            {
-                mark_changed_exported();
-                break;
-            }
+            if (iter->entry.exportv)
+                exports_changed = true;
+
+            /* A local color goes away with its scope */
+            if (var_is_color(iter->key))
+                colors_changed = true;
+
+            if (var_is_locale(iter->key))
+                locale_changed = true;
+
+            /* A local set of abbreviations goes away with its scope */
+            if (iter->key == USER_ABBREVIATIONS_VARIABLE_NAME)
+                expand_abbreviations_changed();
         }
+        if (exports_changed)
+            mark_changed_exported();
 
         delete killme;
 
         if (locale_changed)
             handle_locale();
 
+        if (colors_changed)
+            reader_react_to_color_change();
+
     }
     else
     {
@@ -1167,34 +1666,52 @@ void env_pop()
 /**
    Function used with to insert keys of one table into a set::set<wcstring>
 */
-static void add_key_to_string_set(const var_table_t &envs, std::set<wcstring> *str_set, bool show_exported, bool show_unexported)
+static void add_key_to_string_set(const env_var_table_t &envs, std::set<wcstring> *str_set, bool show_exported, bool show_unexported)
 {
-    var_table_t::const_iterator iter;
+    env_var_table_t::const_iterator iter;
     for (iter = envs.begin(); iter != envs.end(); ++iter)
     {
-        const var_entry_t &e = iter->second;
+        const var_entry_t &e = iter->entry;
 
         if ((e.exportv && show_exported) ||
                 (!e.exportv && show_unexported))
         {
             /* Insert this key */
-            str_set->insert(iter->first);
+            str_set->insert(iter->key);
         }
 
     }
 }
 
-wcstring_list_t env_get_names(int flags)
+void env_get_memory_stats(std::vector<memory_stats_t> *out)
 {
-    scoped_lock lock(env_lock);
+    ASSERT_IS_MAIN_THREAD();
+    memory_stats_t var_stats(L"environment variables"), scope_stats(L"environment scopes");
+    for (const env_node_t *node = top; node != NULL; node = node->next)
+    {
+        var_stats.entries += node->env.size();
+        var_stats.bytes += node->env.memory_size();
+        scope_stats.entries++;
+        scope_stats.bytes += sizeof *node;
+
+        /* A snapshot published for background threads is a copy of the table */
+        if (node->published_env)
+        {
+            scope_stats.bytes += node->published_env->memory_size();
+        }
+    }
+    out->push_back(var_stats);
+    out->push_back(scope_stats);
+}
 
+wcstring_list_t env_get_names(int flags)
+{
     wcstring_list_t result;
     std::set<wcstring> names;
     int show_local = flags & ENV_LOCAL;
     int show_global = flags & ENV_GLOBAL;
     int show_universal = flags & ENV_UNIVERSAL;
 
-    env_node_t *n=top;
     const bool show_exported = (flags & ENV_EXPORT) || !(flags & ENV_UNEXPORT);
     const bool show_unexported = (flags & ENV_UNEXPORT) || !(flags & ENV_EXPORT);
 
@@ -1203,25 +1720,38 @@ wcstring_list_t env_get_names(int flags)
         show_local =show_universal = show_global=1;
     }
 
-    if (show_local)
+    /* The visible local scopes, and the global scope. Background threads use the published copies. */
+    std::vector<const env_var_table_t *> local_tables;
+    const env_var_table_t *global_table = NULL;
+    const shared_ptr<const env_published_t> published = is_main_thread() ? shared_ptr<const env_published_t>() : env_get_published();
+    if (published.get() != NULL)
     {
-        while (n)
+        for (size_t i=0; i + 1 < published->scopes.size(); i++)
         {
-            if (n == global_env)
-                break;
-
-            add_key_to_string_set(n->env, &names, show_exported, show_unexported);
-            if (n->new_scope)
-                break;
-            else
-                n = n->next;
+            local_tables.push_back(published->scopes.at(i).get());
+        }
+        global_table = published->scopes.back().get();
+    }
+    else if (is_main_thread())
+    {
+        for (env_node_t *n = top; n != NULL && n != global_env; n = n->next_scope_to_search())
+        {
+            local_tables.push_back(&n->env);
+        }
+        global_table = &global_env->env;
+    }
 
+    if (show_local)
+    {
+        for (size_t i=0; i < local_tables.size(); i++)
+        {
+            add_key_to_string_set(*local_tables.at(i), &names, show_exported, show_unexported);
         }
     }
 
-    if (show_global)
+    if (show_global && global_table != NULL)
     {
-        add_key_to_string_set(global_env->env, &names, show_exported, show_unexported);
+        add_key_to_string_set(*global_table, &names, show_exported, show_unexported);
         if (show_unexported)
         {
             result.insert(result.end(), env_electric.begin(), env_electric.end());
@@ -1252,11 +1782,11 @@ static void get_exported(const env_node_t *n, std::map<wcstring, wcstring> *h)
     else
         get_exported(n->next, h);
 
-    var_table_t::const_iterator iter;
+    env_var_table_t::const_iterator iter;
     for (iter = n->env.begin(); iter != n->env.end(); ++iter)
     {
-        const wcstring &key = iter->first;
-        const var_entry_t &val_entry = iter->second;
+        const wcstring &key = iter->key;
+        const var_entry_t &val_entry = iter->entry;
 
         if (val_entry.exportv && val_entry.val != ENV_NULL)
         {
@@ -1274,34 +1804,62 @@ static void get_exported(const env_node_t *n, std::map<wcstring, wcstring> *h)
     }
 }
 
-/* Given a map from key to value, add values to out of the form key=value */
-static void export_func(const std::map<wcstring, wcstring> &envs, std::vector<std::string> &out)
+/**
+  Get the exported value of a single variable, looking it up the way get_exported and update_export_array_if_necessary do. Returns false if the variable is not exported.
+*/
+static bool get_exported_value(const wcstring &key, wcstring *out)
 {
-    out.reserve(out.size() + envs.size());
-    std::map<wcstring, wcstring>::const_iterator iter;
-    for (iter = envs.begin(); iter != envs.end(); ++iter)
+    const size_t hash = env_hash_key(key);
+    const env_node_t *n = top;
+    while (n != NULL)
     {
-        const wcstring &key = iter->first;
-        const std::string &ks = wcs2string(key);
-        std::string vs = wcs2string(iter->second);
+        const var_entry_t *result = n->env.find(key, hash);
+        if (result != NULL)
+        {
+            const var_entry_t &val_entry = *result;
+            if (val_entry.exportv && val_entry.val != ENV_NULL)
+            {
+                out->assign(val_entry.val);
+                return true;
+            }
+            // An unexported variable does not hide an exported universal variable
+            break;
+        }
+        n = n->new_scope ? global_env : n->next;
+    }
 
-        /* Arrays in the value are ASCII record separator (0x1e) delimited. But some variables should have colons. Add those. */
-        if (variable_is_colon_delimited_array(key))
+    if (uvars() && uvars()->get_export(key))
+    {
+        const env_var_t val = uvars()->get(key);
+        if (! val.missing() && val != ENV_NULL)
         {
-            /* Replace ARRAY_SEP with colon */
-            std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
+            out->assign(val);
+            return true;
         }
+    }
+    return false;
+}
 
-        /* Put a string on the vector */
-        out.push_back(std::string());
-        std::string &str = out.back();
-        str.reserve(ks.size() + 1 + vs.size());
+/* Given a key and value, set out to a string of the form key=value */
+static void export_func(const wcstring &key, const wcstring &val, std::string &out)
+{
+    const std::string &ks = wcs2string(key);
+    std::string vs = wcs2string(val);
 
-        /* Append our environment variable data to it */
-        str.append(ks);
-        str.append("=");
-        str.append(vs);
+    /* Arrays in the value are ASCII record separator (0x1e) delimited. But some variables should have colons. Add those. */
+    if (variable_is_colon_delimited_array(key))
+    {
+        /* Replace ARRAY_SEP with colon */
+        std::replace(vs.begin(), vs.end(), (char)ARRAY_SEP, ':');
     }
+
+    out.clear();
+    out.reserve(ks.size() + 1 + vs.size());
+
+    /* Append our environment variable data to it */
+    out.append(ks);
+    out.append("=");
+    out.append(vs);
 }
 
 static void update_export_array_if_necessary(bool recalc)
@@ -1339,19 +1897,55 @@ static void update_export_array_if_necessary(bool recalc)
             }
         }
 
-        std::vector<std::string> local_export_buffer;
-        export_func(vals, local_export_buffer);
-        export_array.set(local_export_buffer);
-        has_changed_exported=false;
+        export_table.clear();
+        std::map<wcstring, wcstring>::const_iterator iter;
+        for (iter = vals.begin(); iter != vals.end(); ++iter)
+        {
+            export_func(iter->first, iter->second, export_table[iter->first]);
+        }
     }
+    else if (! changed_exported_keys.empty())
+    {
+        /* Only some variables changed; look just them up again */
+        debug(4, L"env_export_arr() update %lu", (unsigned long)changed_exported_keys.size());
 
+        wcstring val;
+        std::set<wcstring>::const_iterator iter;
+        for (iter = changed_exported_keys.begin(); iter != changed_exported_keys.end(); ++iter)
+        {
+            if (get_exported_value(*iter, &val))
+            {
+                export_func(*iter, val, export_table[*iter]);
+            }
+            else
+            {
+                export_table.erase(*iter);
+            }
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    export_array.clear();
+    export_array.reserve(export_table.size() + 1);
+    std::map<wcstring, std::string>::const_iterator iter;
+    for (iter = export_table.begin(); iter != export_table.end(); ++iter)
+    {
+        export_array.push_back(iter->second.c_str());
+    }
+    export_array.push_back(NULL);
+
+    has_changed_exported = false;
+    changed_exported_keys.clear();
 }
 
 const char * const *env_export_arr(bool recalc)
 {
     ASSERT_IS_MAIN_THREAD();
     update_export_array_if_necessary(recalc);
-    return export_array.get();
+    return &export_array.at(0);
 }
 
 void env_set_argv(const wchar_t * const * argv)
@@ -1399,6 +1993,7 @@ void env_universal_barrier()
     ASSERT_IS_MAIN_THREAD();
     if (uvars())
     {
+        s_universal_changes_pending = false;
         callback_data_list_t changes;
         bool changed = uvars()->sync(&changes);
         if (changed)
@@ -1415,6 +2010,15 @@ void env_universal_barrier()
     }
 }
 
+void env_universal_flush()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (s_universal_changes_pending)
+    {
+        env_universal_barrier();
+    }
+}
+
 env_vars_snapshot_t::env_vars_snapshot_t() { }
 
 /* The "current" variables are not a snapshot at all, but instead trampoline to env_get_string, etc. We identify the current snapshot based on pointer values. */
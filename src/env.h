@@ -86,6 +86,13 @@ void env_init(const struct config_paths_t *paths = NULL);
 
 int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t mode);
 
+/**
+   Add elements to the end of the array variable key, or to its start if prepend is set, creating it if it does not
+   exist. The mode and error codes are the same as for env_set. An existing variable is extended in place where
+   possible, so building up a list one element at a time does not copy it every time.
+*/
+int env_set_append(const wcstring &key, const wcstring_list_t &vals, env_mode_flags_t mode, bool prepend);
+
 
 /**
   Return the value of the variable with the specified name.  Returns 0
@@ -174,6 +181,13 @@ public:
 */
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
 
+class history_t;
+
+/**
+   Returns the history that the $history variable lists, or NULL if it cannot be read from this thread.
+*/
+history_t *env_get_history();
+
 /**
    Returns true if the specified key exists. This can't be reliably done
    using env_get, since env_get returns null for 0-element arrays
@@ -206,6 +220,16 @@ void env_pop();
 /** Synchronizes all universal variable changes: writes everything out, reads stuff in */
 void env_universal_barrier();
 
+/**
+   Writes out universal variable changes that this shell has not written yet. Setting or erasing universal variables does not write them right away; consecutive changes are batched, and written together with a single notification when fish is about to wait for input, run an external command, or exit, or at the next barrier.
+*/
+void env_universal_flush();
+
+/**
+   Publishes a copy of the current variables, which is what env_get_string and env_get_names read on background threads; they never see the live variables. Call this on the main thread before starting background work that reads variables. Scopes that have not changed since the last publication are not copied again.
+*/
+void env_publish();
+
 /** Returns an array containing all exported variables in a format suitable for execv. */
 const char * const * env_export_arr(bool recalc);
 
@@ -217,6 +241,9 @@ void env_set_argv(const wchar_t * const * argv);
 */
 wcstring_list_t env_get_names(int flags);
 
+/** Appends estimates of the memory held by the variables of every scope, and by the scopes themselves, to out */
+void env_get_memory_stats(std::vector<memory_stats_t> *out);
+
 /** Update the PWD variable directory */
 int env_set_pwd();
 
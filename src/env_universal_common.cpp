@@ -49,6 +49,14 @@
 #include <notify.h>
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+#define FISH_INOTIFY_AVAILABLE 1
+#include <sys/inotify.h>
+#elif HAVE_SYS_EVENT_H
+#define FISH_KQUEUE_AVAILABLE 1
+#include <sys/event.h>
+#endif
+
 // NAME_MAX is not defined on Solaris and suggests the use of pathconf()
 // There is no obvious sensible pathconf() for shared memory and _XPG_NAME_MAX
 // seems a reasonable choice.
@@ -887,6 +895,9 @@ var_table_t env_universal_t::read_message_internal(int fd)
     // Temp value used to avoid repeated allocations
     wcstring storage;
     
+    // The parsed lines of this read, which replace those of the previous read
+    std::map<std::string, std::pair<wcstring, var_entry_t> > new_parsed_lines;
+    
     // The line we construct (and then parse)
     std::string line;
     wcstring wide_line;
@@ -918,9 +929,33 @@ var_table_t env_universal_t::read_message_internal(int fd)
             // Process it if it's a newline (which is true if we are before the end of the buffer)
             if (cursor < bufflen && ! line.empty())
             {
-                if (utf8_to_wchar_string(line, &wide_line))
+                std::map<std::string, std::pair<wcstring, var_entry_t> >::iterator parsed = new_parsed_lines.find(line);
+                if (parsed == new_parsed_lines.end())
+                {
+                    std::map<std::string, std::pair<wcstring, var_entry_t> >::iterator previous = this->parsed_lines.find(line);
+                    if (previous != this->parsed_lines.end())
+                    {
+                        // We read this same line last time; reuse what it parsed to
+                        parsed = new_parsed_lines.insert(std::make_pair(line, std::pair<wcstring, var_entry_t>())).first;
+                        parsed->second.first.swap(previous->second.first);
+                        parsed->second.second = previous->second.second;
+                        this->parsed_lines.erase(previous);
+                    }
+                    else if (utf8_to_wchar_string(line, &wide_line))
+                    {
+                        // A line sets at most one variable
+                        var_table_t line_vars;
+                        env_universal_t::parse_message_internal(wide_line, &line_vars, &storage);
+                        if (! line_vars.empty())
+                        {
+                            parsed = new_parsed_lines.insert(std::make_pair(line, *line_vars.begin())).first;
+                        }
+                    }
+                }
+                
+                if (parsed != new_parsed_lines.end())
                 {
-                    env_universal_t::parse_message_internal(wide_line, &result, &storage);
+                    result[parsed->second.first] = parsed->second.second;
                 }
                 line.clear();
             }
@@ -931,6 +966,7 @@ var_table_t env_universal_t::read_message_internal(int fd)
     }
     
     // We make no effort to handle an unterminated last line
+    this->parsed_lines.swap(new_parsed_lines);
     return result;
 }
 
@@ -1569,6 +1605,127 @@ class universal_notifier_named_pipe_t : public universal_notifier_t
     }
 };
 
+/* Notifier that watches the directory containing the variables file, using inotify on Linux and kqueue on BSD. Shells never write the variables file in place; they rename a new one over it, so we have to watch the directory for the file's name appearing rather than the file itself. There is nothing to post, because writing the file is the notification, and idle shells are never woken up. */
+class universal_notifier_file_watch_t : public universal_notifier_t
+{
+    int watch_fd;
+    int dir_fd;
+    
+    /* The name of the variables file within the watched directory */
+    std::string file_name;
+    
+    void setup_watch(const wchar_t *test_path)
+    {
+        const wcstring vars_path = test_path ? wcstring(test_path) : default_vars_path();
+        if (vars_path.empty())
+        {
+            return;
+        }
+        const std::string narrow_dir = wcs2string(wdirname(vars_path));
+        file_name = wcs2string(wbasename(vars_path));
+        
+#if FISH_INOTIFY_AVAILABLE
+        watch_fd = inotify_init();
+        if (watch_fd >= 0)
+        {
+            set_cloexec(watch_fd);
+            int flags = fcntl(watch_fd, F_GETFL, 0);
+            if (flags >= 0)
+            {
+                fcntl(watch_fd, F_SETFL, flags | O_NONBLOCK);
+            }
+            if (inotify_add_watch(watch_fd, narrow_dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+            {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+        }
+#elif FISH_KQUEUE_AVAILABLE
+        dir_fd = open(narrow_dir.c_str(), O_RDONLY);
+        if (dir_fd >= 0)
+        {
+            set_cloexec(dir_fd);
+            watch_fd = kqueue();
+        }
+        if (watch_fd >= 0)
+        {
+            /* The directory is written whenever an entry is added or renamed */
+            struct kevent change;
+            EV_SET(&change, dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+            if (kevent(watch_fd, &change, 1, NULL, 0, NULL) < 0)
+            {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+        }
+#endif
+        if (watch_fd < 0)
+        {
+            UNIVERSAL_LOG("Unable to watch the universal variables file");
+        }
+    }
+    
+public:
+    universal_notifier_file_watch_t(const wchar_t *test_path) : watch_fd(-1), dir_fd(-1)
+    {
+        setup_watch(test_path);
+    }
+    
+    ~universal_notifier_file_watch_t()
+    {
+        if (watch_fd >= 0)
+        {
+            close(watch_fd);
+        }
+        if (dir_fd >= 0)
+        {
+            close(dir_fd);
+        }
+    }
+    
+    int notification_fd()
+    {
+        return watch_fd;
+    }
+    
+    bool notification_fd_became_readable(int fd)
+    {
+        assert(fd == watch_fd);
+        bool changed = false;
+#if FISH_INOTIFY_AVAILABLE
+        /* Read all the queued events, and see if any of them are about our file */
+        union
+        {
+            struct inotify_event event;
+            char bytes[4096];
+        } buff;
+        ssize_t amt_read;
+        while ((amt_read = read(watch_fd, buff.bytes, sizeof buff.bytes)) > 0)
+        {
+            size_t offset = 0;
+            while (offset + sizeof(struct inotify_event) <= (size_t)amt_read)
+            {
+                const struct inotify_event *event = (const struct inotify_event *)(buff.bytes + offset);
+                if ((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && file_name == event->name))
+                {
+                    changed = true;
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+#elif FISH_KQUEUE_AVAILABLE
+        /* Any change to the directory might be our file */
+        struct kevent events[8];
+        const struct timespec no_wait = {0, 0};
+        while (kevent(watch_fd, NULL, 0, events, 8, &no_wait) > 0)
+        {
+            changed = true;
+        }
+#endif
+        return changed;
+    }
+};
+
 class universal_notifier_null_t : public universal_notifier_t
 {
     /* Does nothing! */
@@ -1587,7 +1744,8 @@ static universal_notifier_t::notifier_strategy_t fetch_default_strategy_from_env
         {"default", universal_notifier_t::strategy_default},
         {"shmem", universal_notifier_t::strategy_shmem_polling},
         {"pipe", universal_notifier_t::strategy_named_pipe},
-        {"notifyd", universal_notifier_t::strategy_notifyd}
+        {"notifyd", universal_notifier_t::strategy_notifyd},
+        {"watch", universal_notifier_t::strategy_file_watch}
     };
     const size_t opt_count = sizeof options / sizeof *options;
 
@@ -1628,6 +1786,8 @@ universal_notifier_t::notifier_strategy_t universal_notifier_t::resolve_default_
     return strategy_notifyd;
 #elif defined(__CYGWIN__)
     return strategy_shmem_polling;
+#elif FISH_INOTIFY_AVAILABLE || FISH_KQUEUE_AVAILABLE
+    return strategy_file_watch;
 #else
     return strategy_named_pipe;
 #endif
@@ -1644,6 +1804,17 @@ universal_notifier_t *universal_notifier_t::new_notifier_for_strategy(universal_
     if (strat == strategy_default)
     {
         strat = resolve_default_strategy();
+        if (strat == strategy_file_watch)
+        {
+            /* If the variables file can't be watched (say, its directory is missing), fall back to named pipes */
+            universal_notifier_t *result = new universal_notifier_file_watch_t(test_path);
+            if (result->notification_fd() >= 0)
+            {
+                return result;
+            }
+            delete result;
+            strat = strategy_named_pipe;
+        }
     }
     switch (strat)
     {
@@ -1656,6 +1827,9 @@ universal_notifier_t *universal_notifier_t::new_notifier_for_strategy(universal_
         case strategy_named_pipe:
             return new universal_notifier_named_pipe_t(test_path);
             
+        case strategy_file_watch:
+            return new universal_notifier_file_watch_t(test_path);
+            
         case strategy_null:
             return new universal_notifier_null_t();
         
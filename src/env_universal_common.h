@@ -3,6 +3,7 @@
 
 #include <string>
 #include <set>
+#include <map>
 #include <pthread.h>
 #include <stdio.h>
 #include <vector>
@@ -65,6 +66,9 @@ class env_universal_t
     /* File id from which we last read */
     file_id_t last_read_file;
     
+    /* The variable set by each line of the file we last read, keyed by the text of the line. Lines that are unchanged when the file is read again are not decoded and unescaped again. */
+    std::map<std::string, std::pair<wcstring, var_entry_t> > parsed_lines;
+    
     /* Given a variable table, generate callbacks representing the difference between our vars and the new vars */
     void generate_callbacks(const var_table_t &new_vars, callback_data_list_t *callbacks) const;
     
@@ -72,7 +76,7 @@ class env_universal_t
     void acquire_variables(var_table_t *vars_to_acquire);
     
     static void parse_message_internal(const wcstring &msg, var_table_t *vars, wcstring *storage);
-    static var_table_t read_message_internal(int fd);
+    var_table_t read_message_internal(int fd);
     
 public:
     env_universal_t(const wcstring &path);
@@ -128,6 +132,9 @@ public:
         // Strategy that uses notify(3). Simple and efficient, but OS X only.
         strategy_notifyd,
         
+        // Strategy that watches the variables file with inotify (Linux) or kqueue (BSD). Needs no polling, and nothing to post.
+        strategy_file_watch,
+        
         // Null notifier, does nothing
         strategy_null
     };
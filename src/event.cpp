@@ -7,6 +7,7 @@
 
 #include <signal.h>
 #include <algorithm>
+#include <map>
 #include <assert.h>
 #include <stddef.h>
 #include <string>
@@ -66,6 +67,41 @@ typedef std::vector<event_t *> event_list_t;
    List of event handlers.
 */
 static event_list_t s_event_handlers;
+/**
+   The key that an event handler is indexed by: the event type and
+   the signal, pid or job id, or the variable or generic event name.
+   The name points into the event, so a key may be built for lookup
+   without copying it.
+*/
+struct event_key_t
+{
+    int type;
+    long param;
+    const wcstring *name;
+
+    bool operator<(const event_key_t &other) const
+    {
+        if (type != other.type)
+            return type < other.type;
+        if (param != other.param)
+            return param < other.param;
+        return *name < *other.name;
+    }
+};
+
+/**
+   The handlers in s_event_handlers, indexed by key, each list in the
+   order the handlers were added.
+*/
+static std::map<event_key_t, event_list_t> s_handler_index;
+
+/**
+   The number of handlers that match more than one key, and so are not
+   in s_handler_index. While there are any, firing an event scans every
+   handler.
+*/
+static size_t s_unindexed_handler_count = 0;
+
 /**
    List of event handlers that should be removed
 */
@@ -145,9 +181,86 @@ static int event_match(const event_t &classv, const event_t &instance)
 
 
 /**
-   Test if specified event is blocked
+   Build the index key for the event or handler \c e. Returns false if
+   \c e is a handler that matches more than one key.
 */
-static int event_is_blocked(const event_t &e)
+static bool event_key(const event_t &e, event_key_t *key)
+{
+    static const wcstring no_name;
+    key->type = e.type;
+    key->param = 0;
+    key->name = &no_name;
+    switch (e.type)
+    {
+        case EVENT_SIGNAL:
+            key->param = e.param1.signal;
+            return e.param1.signal != EVENT_ANY_SIGNAL;
+
+        case EVENT_EXIT:
+            key->param = e.param1.pid;
+            return e.param1.pid != EVENT_ANY_PID;
+
+        case EVENT_JOB_ID:
+            key->param = e.param1.job_id;
+            return true;
+
+        case EVENT_VARIABLE:
+        case EVENT_GENERIC:
+            key->name = &e.str_param1;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+   Add a handler to the index
+*/
+static void index_handler(event_t *handler)
+{
+    event_key_t key;
+    if (event_key(*handler, &key))
+    {
+        s_handler_index[key].push_back(handler);
+    }
+    else
+    {
+        s_unindexed_handler_count++;
+    }
+}
+
+/**
+   Rebuild the index from s_event_handlers
+*/
+static void rebuild_handler_index()
+{
+    s_handler_index.clear();
+    s_unindexed_handler_count = 0;
+    for_each(s_event_handlers.begin(), s_event_handlers.end(), index_handler);
+}
+
+/**
+   Return the handlers that may match the event \c instance, which has no
+   function name. These are the indexed handlers for its key, or every
+   handler if some are not indexed. Returns NULL if there are none.
+*/
+static const event_list_t *event_candidate_handlers(const event_t &instance)
+{
+    if (s_unindexed_handler_count > 0)
+        return &s_event_handlers;
+
+    event_key_t key;
+    if (! event_key(instance, &key))
+        return NULL;
+    std::map<event_key_t, event_list_t>::const_iterator where = s_handler_index.find(key);
+    return where == s_handler_index.end() ? NULL : &where->second;
+}
+
+/**
+   Test if events of the specified type are blocked
+*/
+static bool event_type_is_blocked(int type)
 {
     const block_t *block;
     parser_t &parser = parser_t::principal_parser();
@@ -155,11 +268,19 @@ static int event_is_blocked(const event_t &e)
     size_t idx = 0;
     while ((block = parser.block_at_index(idx++)))
     {
-        if (event_block_list_blocks_type(block->event_blocks, e.type))
+        if (event_block_list_blocks_type(block->event_blocks, type))
             return true;
 
     }
-    return event_block_list_blocks_type(parser.global_event_blocks, e.type);
+    return event_block_list_blocks_type(parser.global_event_blocks, type);
+}
+
+/**
+   Test if specified event is blocked
+*/
+static int event_is_blocked(const event_t &e)
+{
+    return event_type_is_blocked(e.type);
 }
 
 wcstring event_get_desc(const event_t &e)
@@ -333,6 +454,7 @@ void event_add_handler(const event_t &event)
     }
 
     s_event_handlers.push_back(e);
+    index_handler(e);
 }
 
 void event_remove(const event_t &criterion)
@@ -385,6 +507,7 @@ void event_remove(const event_t &criterion)
         }
     }
     s_event_handlers.swap(new_list);
+    rebuild_handler_index();
 }
 
 int event_get(const event_t &criterion, std::vector<event_t *> *out)
@@ -415,6 +538,22 @@ bool event_is_signal_observed(int sig)
     return result;
 }
 
+bool event_is_observed(const event_t &event)
+{
+    return event_candidate_handlers(event) != NULL || event_is_blocked(event);
+}
+
+bool event_is_variable_observed(const wcstring &name)
+{
+    if (s_unindexed_handler_count == 0)
+    {
+        const event_key_t key = {EVENT_VARIABLE, 0, &name};
+        if (s_handler_index.find(key) == s_handler_index.end())
+            return event_type_is_blocked(EVENT_VARIABLE);
+    }
+    return true;
+}
+
 /**
    Free all events in the kill list
 */
@@ -460,19 +599,20 @@ static void event_fire_internal(const event_t &event)
     if (is_event <= 1)
         event_free_kills();
 
-    if (s_event_handlers.empty())
+    const event_list_t *candidates = event_candidate_handlers(event);
+    if (candidates == NULL)
         return;
 
     /*
-      Then we iterate over all events, adding events that should be
-      fired to a second list. We need to do this in a separate step
-      since an event handler might call event_remove or
+      Then we iterate over the handlers that may match, adding events
+      that should be fired to a second list. We need to do this in a
+      separate step since an event handler might call event_remove or
       event_add_handler, which will change the contents of the \c
       events list.
     */
-    for (size_t i=0; i<s_event_handlers.size(); i++)
+    for (size_t i=0; i<candidates->size(); i++)
     {
-        event_t *criterion = s_event_handlers.at(i);
+        event_t *criterion = candidates->at(i);
 
         /*
           Check if this event is a match
@@ -684,6 +824,8 @@ void event_destroy()
 
     for_each(s_event_handlers.begin(), s_event_handlers.end(), event_free);
     s_event_handlers.clear();
+    s_handler_index.clear();
+    s_unindexed_handler_count = 0;
 
     for_each(killme.begin(), killme.end(), event_free);
     killme.clear();
@@ -701,6 +843,12 @@ void event_fire_generic(const wchar_t *name, wcstring_list_t *args)
 
     event_t ev(EVENT_GENERIC);
     ev.str_param1 = name;
+    if (! event_is_observed(ev))
+    {
+        /* Nothing to run, but deliver pending signals as firing would */
+        event_fire(NULL);
+        return;
+    }
     if (args)
         ev.arguments = *args;
     event_fire(&ev);
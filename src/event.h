@@ -122,6 +122,23 @@ void event_remove(const event_t &event);
 */
 int event_get(const event_t &criterion, std::vector<event_t *> *out);
 
+/**
+   Returns whether firing the specified event could run a handler: a
+   handler is registered for it, or events of its type are blocked and
+   so would be kept to fire later. If not, callers may skip building
+   the event's arguments and call event_fire(NULL) instead, which only
+   delivers pending signals.
+*/
+bool event_is_observed(const event_t &event);
+
+/**
+   Like event_is_observed for the event of the variable \c name
+   changing, but without building the event. Like
+   event_is_signal_observed, this lets the many callers that set
+   variables skip event handling when nothing listens.
+*/
+bool event_is_variable_observed(const wcstring &name);
+
 /**
     Returns whether an event listener is registered for the given signal.
     This is safe to call from a signal handler.
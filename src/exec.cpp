@@ -24,6 +24,9 @@
 #include <string>
 #include <memory> // IWYU pragma: keep - suggests <tr1/memory> instead
 #include <utility>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_SIGINFO_H
 #include <siginfo.h>
@@ -43,6 +46,10 @@
 #include "parse_util.h"
 #include "io.h"
 #include "parse_tree.h"
+#include "util.h"
+#include "expand.h"
+#include "path.h"
+#include "complete.h"
 
 /**
    file descriptor redirection error message
@@ -141,6 +148,17 @@ static bool redirection_is_to_real_file(const io_data_t *io)
     return result;
 }
 
+/* Returns true if the redirection is a file redirection to /dev/null */
+static bool redirection_is_to_dev_null(const io_data_t *io)
+{
+    if (io != NULL && io->io_mode == IO_FILE)
+    {
+        CAST_INIT(const io_file_t *, io_file, io);
+        return strcmp(io_file->filename_cstr, "/dev/null") == 0;
+    }
+    return false;
+}
+
 static bool chain_contains_redirection_to_real_file(const io_chain_t &io_chain)
 {
     bool result = false;
@@ -156,6 +174,64 @@ static bool chain_contains_redirection_to_real_file(const io_chain_t &io_chain)
     return result;
 }
 
+/**
+   Returns whether the output of an internal process in a pipeline can be written to the pipe by the shell itself, instead of by a
+   forked child that applies the io chain first. That's the case if stdout ends up in the pipe to the next process, and applying the
+   chain would have no other visible effect, like truncating a file.
+*/
+static bool can_write_to_pipe_directly(const io_chain_t &io_chain, const io_pipe_t *pipe_write)
+{
+    return pipe_write != NULL && io_chain.get_io_for_fd(STDOUT_FILENO).get() == pipe_write && ! chain_contains_redirection_to_real_file(io_chain);
+}
+
+#ifdef F_SETPIPE_SZ
+/** The largest size write_to_pipe_without_blocking grows a pipe to. This is the default limit for unprivileged users on Linux. */
+static const size_t kMaxGrownPipeSize = 1024 * 1024;
+#endif
+
+/**
+   Writes as much of buff as we can to the given pipe without blocking, and returns how much that was. The pipe to the next process
+   is made right before launching the process that writes to it, so it's empty, and output that fits into its buffer is written
+   entirely. Whatever is left must be written by a child, since the next process isn't running yet to read it.
+*/
+static size_t write_to_pipe_without_blocking(int fd, const char *buff, size_t count)
+{
+#ifdef F_SETPIPE_SZ
+    /* Where we can, grow the pipe so that larger output fits too. Stages of a pipeline that run inside fish take turns, so this lets them hand over their output without a writer process. */
+    int capacity = fcntl(fd, F_GETPIPE_SZ);
+    if (capacity >= 0 && (size_t)capacity < count)
+    {
+        /* This fails harmlessly if we exceed the system's limit for pipes */
+        fcntl(fd, F_SETPIPE_SZ, (int)std::min(count, kMaxGrownPipeSize));
+    }
+#endif
+
+    size_t written = 0;
+    if (make_fd_nonblocking(fd) == 0)
+    {
+        while (written < count)
+        {
+            ssize_t amt = write(fd, buff + written, count - written);
+            if (amt > 0)
+            {
+                written += amt;
+            }
+            else if (amt < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else
+            {
+                /* EAGAIN, the pipe is full */
+                break;
+            }
+        }
+        /* A child that writes the rest must not see a non-blocking fd */
+        make_fd_blocking(fd);
+    }
+    return written;
+}
+
 /**
    Returns the interpreter for the specified script. Returns NULL if file
    is not a script with a shebang.
@@ -275,7 +351,7 @@ static void launch_process_nofork(process_t *p)
 */
 static int has_fd(const io_chain_t &d, int fd)
 {
-    return io_chain_get(d, fd).get() != NULL;
+    return d.has_io_for_fd(fd);
 }
 
 /**
@@ -397,6 +473,7 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain, s
    passing to eval, call eval, and clean up morphed redirections.
 
    \param def the code to evaluate, or the empty string if none
+   \param def_tree the parse tree of def, or NULL to parse it
    \param node_offset the offset of the node to evalute, or NODE_OFFSET_INVALID
    \param block_type the type of block to push on evaluation
    \param io the io redirections to be performed on this block
@@ -404,6 +481,7 @@ static bool io_transmogrify(const io_chain_t &in_chain, io_chain_t *out_chain, s
 
 static void internal_exec_helper(parser_t &parser,
                                  const wcstring &def,
+                                 const shared_ptr<const parse_node_tree_t> &def_tree,
                                  node_offset_t node_offset,
                                  enum block_type_t block_type,
                                  const io_chain_t &ios)
@@ -426,7 +504,11 @@ static void internal_exec_helper(parser_t &parser,
 
     signal_unblock();
 
-    if (node_offset == NODE_OFFSET_INVALID)
+    if (node_offset == NODE_OFFSET_INVALID && def_tree.get() != NULL)
+    {
+        parser.eval(def, def_tree, morphed_chain, block_type);
+    }
+    else if (node_offset == NODE_OFFSET_INVALID)
     {
         parser.eval(def, morphed_chain, block_type);
     }
@@ -443,30 +525,107 @@ static void internal_exec_helper(parser_t &parser,
 }
 
 /* Returns whether we can use posix spawn for a given process in a given job.
- Per https://github.com/fish-shell/fish-shell/issues/364 , error handling for file redirections is too difficult with posix_spawn,
- so in that case we use fork/exec.
 
- Furthermore, to avoid the race between the caller calling tcsetpgrp() and the client checking the foreground process group, we don't use posix_spawn if we're going to foreground the process. (If we use fork(), we can call tcsetpgrp after the fork, before the exec, and avoid the race).
+ To avoid the race between the caller calling tcsetpgrp() and the client checking the foreground process group, a process that will be foregrounded in a new process group must get the terminal before it runs. With fork(), we call tcsetpgrp after the fork, before the exec. posix_spawn can only do that with posix_spawn_file_actions_addtcsetpgrp_np. Later processes of the job join a group that already has the terminal, so they are fine either way.
+
+ File redirections are handled by open_redirection_files_for_spawn.
 */
-static bool can_use_posix_spawn_for_job(const job_t *job, const process_t *process)
+static bool can_use_posix_spawn_for_job(const job_t *job)
 {
-    if (job_get_flag(job, JOB_CONTROL))
+    if (job_get_flag(job, JOB_CONTROL) && job_get_flag(job, JOB_TERMINAL) && job_get_flag(job, JOB_FOREGROUND) && job->pgid == 0)
     {
-        /* We are going to use job control; therefore when we launch this job it will get its own process group ID. But will it be foregrounded? */
-        if (job_get_flag(job, JOB_TERMINAL) && job_get_flag(job, JOB_FOREGROUND))
+        /* This process will start a new process group that gets the terminal */
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+        return true;
+#else
+        return false;
+#endif
+    }
+    return true;
+}
+
+/**
+   Per https://github.com/fish-shell/fish-shell/issues/364 , error handling for file redirections is too difficult inside posix_spawn, so
+   we open the redirected files before spawning. Makes a copy of in_chain in out_chain where every file redirection is replaced by a
+   redirection of the file we opened, and stores the opened fds in out_opened_fds; the caller must close them after spawning. The fds are
+   close-on-exec and never one of the fds the chain redirects, so the redirections of the chain can't clobber them.
+
+   If a file can't be opened, reports nothing, leaves nothing behind, and returns false. The caller should then fork, so that the child
+   reports the error and fails exactly as usual.
+
+   Only regular files are opened here. Opening a FIFO or a device may block, e.g. until a FIFO has a reader, which must happen in the
+   child rather than in fish itself; for those we return false too. Files are opened with O_NONBLOCK, so that one replaced by a FIFO
+   after we looked at it cannot block us either, and the flag is cleared before the file is handed to the child.
+*/
+static bool open_redirection_files_for_spawn(const io_chain_t &in_chain, io_chain_t *out_chain, std::vector<int> *out_opened_fds)
+{
+    bool success = true;
+    io_chain_t result_chain;
+    std::vector<int> opened_fds;
+    std::vector<const char *> created_files;
+
+    for (size_t idx = 0; idx < in_chain.size() && success; idx++)
+    {
+        const shared_ptr<io_data_t> &in = in_chain.at(idx);
+        if (in->io_mode != IO_FILE)
         {
-            /* It will be foregrounded, so we will call tcsetpgrp(), therefore do not use posix_spawn */
-            return false;
+            result_chain.push_back(in);
+            continue;
+        }
+
+        CAST_INIT(const io_file_t *, in_file, in.get());
+        struct stat buf;
+        if (stat(in_file->filename_cstr, &buf) == 0 && ! S_ISREG(buf.st_mode))
+        {
+            success = false;
+            break;
+        }
+
+        int fd;
+        do
+        {
+            fd = open(in_file->filename_cstr, in_file->flags | O_NONBLOCK, OPEN_MASK);
+        }
+        while (fd < 0 && errno == EINTR);
+        if (fd >= 0 && (in_file->flags & O_EXCL))
+        {
+            /* We made this file, so we must remove it again if we end up forking, or the child would fail to create it */
+            created_files.push_back(in_file->filename_cstr);
+        }
+        if (fd >= 0 && (fstat(fd, &buf) != 0 || ! S_ISREG(buf.st_mode) || make_fd_blocking(fd) != 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0)
+        {
+            set_cloexec(fd);
+            fd = move_fd_to_unused(fd, in_chain);
         }
+        if (fd < 0)
+        {
+            success = false;
+            break;
+        }
+
+        opened_fds.push_back(fd);
+        result_chain.push_back(shared_ptr<io_data_t>(new io_fd_t(in->fd, fd, false)));
     }
 
-    /* Now see if we have a redirection involving a file. The only one we allow is /dev/null, which we assume will not fail. */
-    bool result = true;
-    if (chain_contains_redirection_to_real_file(job->block_io_chain()) || chain_contains_redirection_to_real_file(process->io_chain()))
+    if (success)
     {
-        result = false;
+        out_chain->swap(result_chain);
+        out_opened_fds->swap(opened_fds);
     }
-    return result;
+    else
+    {
+        io_cleanup_fds(opened_fds);
+        for (size_t i=0; i < created_files.size(); i++)
+        {
+            unlink(created_files.at(i));
+        }
+    }
+    return success;
 }
 
 void exec_job(parser_t &parser, job_t *j)
@@ -513,6 +672,9 @@ void exec_job(parser_t &parser, job_t *j)
 
     if (j->first_process->type==INTERNAL_EXEC)
     {
+        /* We are about to be replaced; write out universal variables first */
+        env_universal_flush();
+
         /*
           Do a regular launch -  but without forking first...
         */
@@ -720,7 +882,11 @@ void exec_job(parser_t &parser, job_t *j)
            uniprocessor systems.
         */
         if (p->type == EXTERNAL)
+        {
+            /* The command may read universal variables we changed, so write them out */
+            env_universal_flush();
             env_export_arr(true);
+        }
 
 
         /* Set up fds that will be used in the pipe. */
@@ -776,7 +942,8 @@ void exec_job(parser_t &parser, job_t *j)
                 signal_unblock();
                 const wcstring func_name = p->argv0();
                 wcstring def;
-                bool function_exists = function_get_definition(func_name, &def);
+                shared_ptr<const parse_node_tree_t> def_tree;
+                bool function_exists = function_get_parsed_definition(func_name, &def, &def_tree);
 
                 bool shadows = function_get_shadows(func_name);
                 const std::map<wcstring,env_var_t> inherit_vars = function_get_inherit_vars(func_name);
@@ -820,7 +987,8 @@ void exec_job(parser_t &parser, job_t *j)
 
                 if (! exec_error)
                 {
-                    internal_exec_helper(parser, def, NODE_OFFSET_INVALID, TOP, process_net_io_chain);
+                    scoped_profile_frame_t profile_frame(parser.stream_profiler(), func_name, true);
+                    internal_exec_helper(parser, def, def_tree, NODE_OFFSET_INVALID, TOP, process_net_io_chain);
                 }
 
                 parser.allow_function();
@@ -849,7 +1017,7 @@ void exec_job(parser_t &parser, job_t *j)
 
                 if (! exec_error)
                 {
-                    internal_exec_helper(parser, wcstring(), p->internal_block_node, TOP, process_net_io_chain);
+                    internal_exec_helper(parser, wcstring(), shared_ptr<const parse_node_tree_t>(), p->internal_block_node, TOP, process_net_io_chain);
                 }
                 break;
             }
@@ -969,6 +1137,21 @@ void exec_job(parser_t &parser, job_t *j)
 
                     builtin_push_io(parser, local_builtin_stdin);
 
+                    /* Let a builtin at the end of the job write its output as it goes, if that output goes to our own stdout or into a buffer. Anything else has to wait for the fork below. */
+                    if (p->next == NULL)
+                    {
+                        const shared_ptr<io_data_t> out_io = process_net_io_chain.get_io_for_fd(STDOUT_FILENO);
+                        if (out_io.get() == NULL && process_net_io_chain.get_io_for_fd(STDERR_FILENO).get() == NULL)
+                        {
+                            builtin_set_stdout_stream(STDOUT_FILENO, NULL);
+                        }
+                        else if (out_io.get() != NULL && out_io->io_mode == IO_BUFFER)
+                        {
+                            CAST_INIT(io_buffer_t *, out_buffer, out_io.get());
+                            builtin_set_stdout_stream(-1, out_buffer);
+                        }
+                    }
+
                     builtin_out_redirect = has_fd(process_net_io_chain, STDOUT_FILENO);
                     builtin_err_redirect = has_fd(process_net_io_chain, STDERR_FILENO);
 
@@ -1055,7 +1238,15 @@ void exec_job(parser_t &parser, job_t *j)
                 const char *buffer = block_output_io_buffer->out_buffer_ptr();
                 size_t count = block_output_io_buffer->out_buffer_size();
 
-                if (block_output_io_buffer->out_buffer_size() > 0)
+                /* Put the output into the pipe ourselves if it fits, so that we needn't fork just to write it */
+                if (count > 0 && can_write_to_pipe_directly(process_net_io_chain, pipe_write.get()))
+                {
+                    size_t written = write_to_pipe_without_blocking(pipe_write->pipe_fd[1], buffer, count);
+                    buffer += written;
+                    count -= written;
+                }
+
+                if (count > 0)
                 {
                     /* We don't have to drain threads here because our child process is simple */
                     if (g_log_forks)
@@ -1114,6 +1305,9 @@ void exec_job(parser_t &parser, job_t *j)
 
                 bool fork_was_skipped = false;
 
+                /* How much of stdout went into the pipe to the next process already */
+                size_t stdout_written = 0;
+
                 const shared_ptr<io_data_t> stdout_io = process_net_io_chain.get_io_for_fd(STDOUT_FILENO);
                 const shared_ptr<io_data_t> stderr_io = process_net_io_chain.get_io_for_fd(STDERR_FILENO);
 
@@ -1150,16 +1344,15 @@ void exec_job(parser_t &parser, job_t *j)
                             io_buffer->out_buffer_append(res.data(), res.size());
                             fork_was_skipped = true;
                         }
-                        else if (stdout_io.get() == NULL && stderr_io.get() == NULL)
+                        else if ((stdout_io.get() == NULL || redirection_is_to_dev_null(stdout_io.get())) && (stderr_io.get() == NULL || redirection_is_to_dev_null(stderr_io.get())))
                         {
-                            /* We are writing to normal stdout and stderr. Just do it - no need to fork. */
+                            /* We are writing to normal stdout and stderr, or to /dev/null. Just write the former and drop the latter - no need to fork. This makes the common "2>/dev/null" cheap. */
                             if (g_log_forks)
                             {
                                 printf("fork #-: Skipping fork due to ordinary output for internal builtin for '%ls'\n", p->argv0());
                             }
-                            const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
-                            const std::string outbuff = wcs2string(out);
-                            const std::string errbuff = wcs2string(err);
+                            const std::string outbuff = stdout_io.get() == NULL ? wcs2string(get_stdout_buffer()) : std::string();
+                            const std::string errbuff = stderr_io.get() == NULL ? wcs2string(get_stderr_buffer()) : std::string();
                             bool builtin_io_done = do_builtin_io(outbuff.data(), outbuff.size(), errbuff.data(), errbuff.size());
                             if (! builtin_io_done)
                             {
@@ -1168,6 +1361,26 @@ void exec_job(parser_t &parser, job_t *j)
                             fork_was_skipped = true;
                         }
                     }
+                    else if (can_write_to_pipe_directly(process_net_io_chain, pipe_write.get()) && (get_stderr_buffer().empty() || stderr_io.get() == NULL))
+                    {
+                        /* The builtin writes into a pipe, and any stderr goes to our own stderr. Put stdout into the pipe ourselves if it fits. */
+                        const std::string outbuff = wcs2string(get_stdout_buffer());
+                        stdout_written = write_to_pipe_without_blocking(pipe_write->pipe_fd[1], outbuff.data(), outbuff.size());
+                        if (stdout_written == outbuff.size())
+                        {
+                            if (g_log_forks)
+                            {
+                                printf("fork #-: Skipping fork due to output fitting into pipe for internal builtin for '%ls'\n", p->argv0());
+                            }
+                            const std::string errbuff = wcs2string(get_stderr_buffer());
+                            bool builtin_io_done = do_builtin_io(NULL, 0, errbuff.data(), errbuff.size());
+                            if (! builtin_io_done)
+                            {
+                                show_stackframe();
+                            }
+                            fork_was_skipped = true;
+                        }
+                    }
                 }
 
 
@@ -1191,10 +1404,10 @@ void exec_job(parser_t &parser, job_t *j)
                     /* Get the strings we'll write before we fork (since they call malloc) */
                     const wcstring &out = get_stdout_buffer(), &err = get_stderr_buffer();
 
-                    /* These strings may contain embedded nulls, so don't treat them as C strings */
+                    /* These strings may contain embedded nulls, so don't treat them as C strings. Skip what is in the pipe already. */
                     const std::string outbuff_str = wcs2string(out);
-                    const char *outbuff = outbuff_str.data();
-                    size_t outbuff_len = outbuff_str.size();
+                    const char *outbuff = outbuff_str.data() + stdout_written;
+                    size_t outbuff_len = outbuff_str.size() - stdout_written;
 
                     const std::string errbuff_str = wcs2string(err);
                     const char *errbuff = errbuff_str.data();
@@ -1259,18 +1472,31 @@ void exec_job(parser_t &parser, job_t *j)
 
 #if FISH_USE_POSIX_SPAWN
                 /* Prefer to use posix_spawn, since it's faster on some systems like OS X */
-                bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j, p);
+                bool use_posix_spawn = g_use_posix_spawn && can_use_posix_spawn_for_job(j);
+
+                /* Open any redirected files up front. If one can't be opened, fork instead and let the child report it. */
+                io_chain_t spawn_io_chain;
+                std::vector<int> spawn_opened_fds;
+                if (use_posix_spawn)
+                {
+                    use_posix_spawn = open_redirection_files_for_spawn(process_net_io_chain, &spawn_io_chain, &spawn_opened_fds);
+                }
+
                 if (use_posix_spawn)
                 {
                     /* Create posix spawn attributes and actions */
                     posix_spawnattr_t attr = posix_spawnattr_t();
                     posix_spawn_file_actions_t actions = posix_spawn_file_actions_t();
-                    bool made_it = fork_actions_make_spawn_properties(&attr, &actions, j, p, process_net_io_chain);
+                    bool made_it = fork_actions_make_spawn_properties(&attr, &actions, j, p, spawn_io_chain);
                     if (made_it)
                     {
                         /* We successfully made the attributes and actions; actually call posix_spawn */
                         int spawn_ret = posix_spawn(&pid, actual_cmd, &actions, &attr, const_cast<char * const *>(argv), const_cast<char * const *>(envv));
 
+                        /* Spawning a process costs like a fork, so count it as one */
+                        g_fork_count++;
+                        syscall_count(SYSCALL_SPAWN);
+
                         /* This usleep can be used to test for various race conditions (https://github.com/fish-shell/fish-shell/issues/360) */
                         //usleep(10000);
 
@@ -1286,6 +1512,9 @@ void exec_job(parser_t &parser, job_t *j)
                         posix_spawnattr_destroy(&attr);
                     }
 
+                    /* The child has its own copies of the files now */
+                    io_cleanup_fds(spawn_opened_fds);
+
                     /* A 0 pid means we failed to posix_spawn. Since we have no pid, we'll never get told when it's exited, so we have to mark the process as failed. */
                     if (pid == 0)
                     {
@@ -1376,6 +1605,7 @@ void exec_job(parser_t &parser, job_t *j)
 
     debug(3, L"Job is constructed");
 
+    job_index_pids(j);
     job_set_flag(j, JOB_CONSTRUCTED, 1);
 
     if (!job_get_flag(j, JOB_FOREGROUND))
@@ -1396,9 +1626,73 @@ void exec_job(parser_t &parser, job_t *j)
 }
 
 
+/**
+   The most command substitutions subshell_prefetch_t runs at once
+*/
+#define SUBSHELL_PREFETCH_MAX 16
+
+/** The output of a command substitution run ahead of time by subshell_prefetch_t */
+struct prefetched_subshell_t
+{
+    /** The command */
+    wcstring cmd;
+
+    /** The lines of output, split as exec_subshell would */
+    wcstring_list_t lines;
+
+    /** The exit status of the command, or -1 if its output was too long */
+    int status;
+
+    /** Whether exec_subshell has returned this output already */
+    bool used;
+
+    prefetched_subshell_t() : status(-1), used(false)
+    {
+    }
+};
+
+/** The results of the innermost subshell_prefetch_t, or NULL */
+static std::vector<prefetched_subshell_t> *s_prefetched_subshells = NULL;
+
+/**
+   Returns the output of cmd from the innermost subshell_prefetch_t, if it ran
+   cmd and the output has not been returned yet
+*/
+static prefetched_subshell_t *take_prefetched_subshell(const wcstring &cmd)
+{
+    if (s_prefetched_subshells != NULL)
+    {
+        for (size_t i=0; i < s_prefetched_subshells->size(); i++)
+        {
+            prefetched_subshell_t &result = s_prefetched_subshells->at(i);
+            if (! result.used && result.cmd == cmd)
+            {
+                result.used = true;
+                return &result;
+            }
+        }
+    }
+    return NULL;
+}
+
 static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, bool apply_exit_status)
 {
     ASSERT_IS_MAIN_THREAD();
+
+    prefetched_subshell_t *prefetched = lst ? take_prefetched_subshell(cmd) : NULL;
+    if (prefetched != NULL)
+    {
+        if (apply_exit_status)
+            proc_set_last_status(prefetched->status == -1 ? STATUS_READ_TOO_MUCH : prefetched->status);
+        lst->insert(lst->end(), prefetched->lines.begin(), prefetched->lines.end());
+        return prefetched->status;
+    }
+
+    syscall_count(SYSCALL_SUBSHELL);
+
+    /* Substitutions run by this command are not the ones that were run ahead of time */
+    std::vector<prefetched_subshell_t> * const outer_prefetched = s_prefetched_subshells;
+    s_prefetched_subshells = NULL;
     int prev_subshell = is_subshell;
     const int prev_status = proc_get_last_status();
     bool split_output=false;
@@ -1421,6 +1715,19 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
     const shared_ptr<io_buffer_t> io_buffer(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
     if (io_buffer.get() != NULL)
     {
+        // Split the output into lines as it arrives, so it is never held as bytes and wide strings at once
+        if (split_output && lst != NULL)
+        {
+            io_buffer->split_lines_as_they_arrive();
+        }
+
+        const env_var_t read_limit = env_get_string(L"fish_read_limit");
+        if (! read_limit.missing_or_empty())
+        {
+            int limit = fish_wcstoi(read_limit.c_str(), NULL, 10);
+            io_buffer->set_limit(limit > 0 ? (size_t)limit : 0);
+        }
+
         parser_t &parser = parser_t::principal_parser();
         if (parser.eval(cmd, io_chain_t(io_buffer), SUBST) == 0)
         {
@@ -1428,12 +1735,26 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
         }
 
         io_buffer->read();
+
+        if (io_buffer->output_discarded())
+        {
+            subcommand_status = STATUS_READ_TOO_MUCH;
+        }
     }
 
     // If the caller asked us to preserve the exit status, restore the old status
     // Otherwise set the status of the subcommand
     proc_set_last_status(apply_exit_status ? subcommand_status : prev_status);
 
+    s_prefetched_subshells = outer_prefetched;
+
+    // Output larger than the limit was thrown away; that's an error
+    if (io_buffer.get() != NULL && io_buffer->output_discarded())
+    {
+        is_subshell = prev_subshell;
+        return -1;
+    }
+
 
     is_subshell = prev_subshell;
 
@@ -1443,24 +1764,8 @@ static int exec_subshell_internal(const wcstring &cmd, wcstring_list_t *lst, boo
         const char *end = begin + io_buffer->out_buffer_size();
         if (split_output)
         {
-            const char *cursor = begin;
-            while (cursor < end)
-            {
-                // Look for the next separator
-                const char *stop = (const char *)memchr(cursor, '\n', end - cursor);
-                const bool hit_separator = (stop != NULL);
-                if (! hit_separator)
-                {
-                    // If it's not found, just use the end
-                    stop = end;
-                }
-                // Stop now points at the first character we do not want to copy
-                const wcstring wc = str2wcstring(cursor, stop - cursor);
-                lst->push_back(wc);
-
-                // If we hit a separator, skip over it; otherwise we're at the end
-                cursor = stop + (hit_separator ? 1 : 0);
-            }
+            // The lines were split as the output arrived
+            io_buffer->take_lines(lst);
         }
         else
         {
@@ -1488,3 +1793,268 @@ int exec_subshell(const wcstring &cmd, bool apply_exit_status)
     ASSERT_IS_MAIN_THREAD();
     return exec_subshell_internal(cmd, NULL, apply_exit_status);
 }
+
+/** A command substitution that subshell_prefetch_t can launch directly */
+struct prefetch_launch_t
+{
+    /** The command substitution */
+    wcstring cmd;
+
+    /** The path of the external command it runs */
+    std::string path;
+
+    /** The expanded arguments, including the command */
+    std::vector<std::string> argv;
+};
+
+/**
+   Checks whether cmd is a single external command with arguments, which
+   subshell_prefetch_t may run without the parser: no pipes, redirections,
+   blocks, functions, builtins or nested command substitutions. If so, stores
+   what is needed to launch it in out and returns true. Expanding the
+   arguments has no side effects, so if this returns false, nothing has
+   changed.
+*/
+static bool get_prefetch_launch(const wcstring &cmd, prefetch_launch_t *out)
+{
+    parse_node_tree_t tree;
+    if (! parse_tree_from_string(cmd, parse_flag_none, &tree, NULL) || tree.empty())
+        return false;
+
+    const parse_node_t &root = tree.at(0);
+    const parse_node_tree_t::parse_node_list_t jobs = tree.find_nodes(root, symbol_job, 2);
+    const parse_node_tree_t::parse_node_list_t statements = tree.find_nodes(root, symbol_plain_statement, 2);
+    if (jobs.size() != 1 || statements.size() != 1 || ! tree.find_nodes(root, symbol_redirection, 1).empty())
+        return false;
+
+    /* The statement must not be part of a boolean statement like 'not cmd', which changes its status */
+    const parse_node_t &job = *jobs.at(0);
+    const parse_node_t *statement = tree.get_child(job, 0, symbol_statement);
+    if (statement == NULL || tree.get_child(*statement, 0)->type != symbol_decorated_statement || tree.job_should_be_backgrounded(job))
+        return false;
+
+    const parse_node_t &plain_statement = *statements.at(0);
+    const enum parse_statement_decoration_t decoration = tree.decoration_for_plain_statement(plain_statement);
+    if (decoration == parse_statement_decoration_builtin || decoration == parse_statement_decoration_exec)
+        return false;
+
+    wcstring name;
+    if (! tree.command_for_plain_statement(plain_statement, cmd, &name) || ! expand_one(name, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES, NULL))
+        return false;
+    if (decoration == parse_statement_decoration_none && (function_exists(name) || builtin_exists(name)))
+        return false;
+
+    wcstring path;
+    if (! path_get_path(name, &path))
+        return false;
+
+    out->cmd = cmd;
+    out->path = wcs2string(path);
+    out->argv.clear();
+    out->argv.push_back(wcs2string(name));
+
+    const parse_node_tree_t::parse_node_list_t argument_nodes = tree.find_nodes(plain_statement, symbol_argument);
+    for (size_t i=0; i < argument_nodes.size(); i++)
+    {
+        /* Run in order, an earlier substitution would have set $status before this one was expanded */
+        const wcstring arg_str = argument_nodes.at(i)->get_source(cmd);
+        if (arg_str.find(L"$status") != wcstring::npos)
+            return false;
+
+        std::vector<completion_t> arg_expanded;
+        int expand_ret = expand_string(arg_str, &arg_expanded, EXPAND_NO_DESCRIPTIONS | EXPAND_SKIP_CMDSUBST, NULL);
+        if (expand_ret != EXPAND_OK && expand_ret != EXPAND_WILDCARD_MATCH)
+            return false;
+        for (size_t j=0; j < arg_expanded.size(); j++)
+        {
+            out->argv.push_back(wcs2string(arg_expanded.at(j).completion));
+        }
+    }
+    return true;
+}
+
+/**
+   Runs the given commands at once, each in its own child, and appends their
+   results to out.
+*/
+static void prefetch_subshells(const std::vector<prefetch_launch_t> &launches, std::vector<prefetched_subshell_t> *out)
+{
+    const env_var_t ifs = env_get_string(L"IFS");
+    const bool split_output = ! ifs.missing_or_empty();
+
+    size_t limit = 0;
+    const env_var_t read_limit = env_get_string(L"fish_read_limit");
+    if (! read_limit.missing_or_empty())
+    {
+        int val = fish_wcstoi(read_limit.c_str(), NULL, 10);
+        limit = val > 0 ? (size_t)val : 0;
+    }
+
+    const char * const *envv = env_export_arr(false);
+
+    /* As for any external command, see issue #176 */
+    make_fd_blocking(STDIN_FILENO);
+
+    /* Start the children, each writing to its own buffer. Like any external command, each child only sets up its output and execs, so it takes no locks and runs no other code of ours. As in exec_job, signals are blocked while we fork, and setup_child_process removes the block in the child. */
+    std::vector<shared_ptr<io_buffer_t> > buffers;
+    std::vector<pid_t> pids;
+    std::vector<wcstring> started;
+    signal_block();
+    for (size_t i=0; i < launches.size(); i++)
+    {
+        const prefetch_launch_t &launch = launches.at(i);
+        const shared_ptr<io_buffer_t> io_buffer(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
+        if (io_buffer.get() == NULL)
+            break;
+        if (split_output)
+            io_buffer->split_lines_as_they_arrive();
+        io_buffer->set_limit(limit);
+
+        const null_terminated_array_t<char> argv_array(launch.argv);
+        const io_chain_t child_io(io_buffer);
+        if (g_log_forks)
+        {
+            printf("fork #%d: forking for command substitution '%s'\n", g_fork_count, launch.path.c_str());
+        }
+        syscall_count(SYSCALL_SUBSHELL);
+        pid_t pid = execute_fork(false);
+        if (pid == 0)
+        {
+            /* This is the child process. */
+            setup_child_process(NULL, NULL, child_io);
+            safe_launch_process(NULL, launch.path.c_str(), argv_array.get(), envv);
+        }
+
+        exec_close(io_buffer->pipe_fd[1]);
+        io_buffer->pipe_fd[1] = -1;
+        buffers.push_back(io_buffer);
+        pids.push_back(pid);
+        started.push_back(launch.cmd);
+    }
+    signal_unblock();
+
+    /* Read all their output as it arrives, so that none of them waits for its pipe to be emptied. Stop reading a pipe at eof, or once its child has exited and what it wrote has been read, so that a process it left running with the pipe open cannot make us wait forever. */
+    std::vector<bool> reading(buffers.size(), true);
+    std::vector<bool> exited(buffers.size(), false);
+    std::vector<int> wait_statuses(buffers.size(), 0);
+    size_t open_count = buffers.size();
+    while (open_count > 0)
+    {
+        for (size_t i=0; i < buffers.size(); i++)
+        {
+            if (! exited.at(i) && waitpid(pids.at(i), &wait_statuses.at(i), WNOHANG) == pids.at(i))
+            {
+                exited.at(i) = true;
+                if (reading.at(i))
+                {
+                    buffers.at(i)->read_available();
+                    reading.at(i) = false;
+                    open_count--;
+                }
+            }
+        }
+        if (open_count == 0)
+            break;
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        int max_fd = -1;
+        for (size_t i=0; i < buffers.size(); i++)
+        {
+            if (reading.at(i))
+            {
+                FD_SET(buffers.at(i)->pipe_fd[0], &fds);
+                max_fd = maxi(max_fd, buffers.at(i)->pipe_fd[0]);
+            }
+        }
+
+        /* Wake up now and then to see whether the children have exited */
+        struct timeval timeout = {0, 100000};
+        int ready = select(max_fd + 1, &fds, NULL, NULL, &timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            wperror(L"select");
+            break;
+        }
+
+        for (size_t i=0; ready > 0 && i < buffers.size(); i++)
+        {
+            if (reading.at(i) && FD_ISSET(buffers.at(i)->pipe_fd[0], &fds) && ! buffers.at(i)->read_available())
+            {
+                reading.at(i) = false;
+                open_count--;
+            }
+        }
+    }
+
+    /* Collect the statuses and lines */
+    for (size_t i=0; i < buffers.size(); i++)
+    {
+        int wait_status = wait_statuses.at(i);
+        if (! exited.at(i))
+        {
+            while (waitpid(pids.at(i), &wait_status, 0) < 0 && errno == EINTR)
+                ;
+        }
+
+        out->push_back(prefetched_subshell_t());
+        prefetched_subshell_t &result = out->back();
+        result.cmd = started.at(i);
+
+        io_buffer_t *io_buffer = buffers.at(i).get();
+        if (io_buffer->output_discarded())
+        {
+            result.status = -1;
+            continue;
+        }
+        result.status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+
+        if (split_output)
+        {
+            io_buffer->take_lines(&result.lines);
+        }
+        else
+        {
+            // As in exec_subshell, we're not splitting output, but we still want to trim off a trailing newline
+            const char *begin = io_buffer->out_buffer_ptr();
+            const char *end = begin + io_buffer->out_buffer_size();
+            if (end != begin && end[-1] == '\n')
+            {
+                --end;
+            }
+            result.lines.push_back(str2wcstring(begin, end - begin));
+        }
+    }
+}
+
+subshell_prefetch_t::subshell_prefetch_t(const wcstring_list_t &cmds) : results(new std::vector<prefetched_subshell_t>()), outer(s_prefetched_subshells)
+{
+    ASSERT_IS_MAIN_THREAD();
+
+    /* Only if all of them are plain external commands, since any other one might change what a later one does, for example by setting a variable */
+    std::vector<prefetch_launch_t> launches(cmds.size());
+    for (size_t i=0; i < cmds.size(); i++)
+    {
+        if (! get_prefetch_launch(cmds.at(i), &launches.at(i)))
+        {
+            launches.clear();
+            break;
+        }
+    }
+
+    for (size_t i=0; i < launches.size(); i += SUBSHELL_PREFETCH_MAX)
+    {
+        const std::vector<prefetch_launch_t> batch(launches.begin() + i, launches.begin() + mini(launches.size(), i + SUBSHELL_PREFETCH_MAX));
+        prefetch_subshells(batch, results);
+    }
+    s_prefetched_subshells = results;
+}
+
+subshell_prefetch_t::~subshell_prefetch_t()
+{
+    ASSERT_IS_MAIN_THREAD();
+    s_prefetched_subshells = outer;
+    delete results;
+}
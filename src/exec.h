@@ -56,6 +56,34 @@ void exec_job(parser_t &parser, job_t *j);
 int exec_subshell(const wcstring &cmd, std::vector<wcstring> &outputs, bool preserve_exit_status);
 int exec_subshell(const wcstring &cmd, bool preserve_exit_status);
 
+struct prefetched_subshell_t;
+
+/**
+   Runs several command substitutions at once, ahead of their expansion.
+
+   While an instance exists, exec_subshell returns the output and status of
+   each of the commands it was given, in the order given, instead of running
+   them. Commands are only run ahead of time if every one of them is a single
+   external command, whose arguments are expanded when the instance is
+   created; such commands cannot change the shell, so running them early
+   gives the same results. Otherwise nothing is run ahead of time, and
+   exec_subshell runs the commands as usual. The shell is never forked to run
+   the parser. Instances may nest; only the innermost one is used.
+*/
+class subshell_prefetch_t
+{
+    std::vector<prefetched_subshell_t> *results;
+    std::vector<prefetched_subshell_t> *outer;
+
+    /* No copying */
+    subshell_prefetch_t(const subshell_prefetch_t &);
+    void operator=(const subshell_prefetch_t &);
+
+public:
+    explicit subshell_prefetch_t(const wcstring_list_t &cmds);
+    ~subshell_prefetch_t();
+};
+
 
 /**
    Loops over close until the syscall was run without being
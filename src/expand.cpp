@@ -23,6 +23,7 @@ parameter expansion.
 
 #include <assert.h>
 #include <vector>
+#include <map>
 
 #ifdef SunOS
 #include <procfs.h>
@@ -42,6 +43,7 @@ parameter expansion.
 #include "tokenizer.h"
 #include "complete.h"
 #include "iothread.h"
+#include "history.h"
 
 #include "parse_util.h"
 
@@ -555,15 +557,60 @@ bool process_iterator_t::next_process(wcstring *out_str, pid_t *out_pid)
 
 #endif
 
-std::vector<wcstring> expand_get_all_process_names(void)
+/**
+   How long, in seconds, a snapshot of the process table may be reused for completions. Listing every process means reading a file for each one, which takes seconds on a host with many thousands of processes, and completing the same command line again shortly after should not repeat that.
+*/
+#define PROCESS_SNAPSHOT_MAX_AGE 2.0
+
+/** A process listed by process_iterator_t */
+struct process_snapshot_entry_t
 {
     wcstring name;
     pid_t pid;
+};
+typedef std::vector<process_snapshot_entry_t> process_snapshot_t;
+
+/** The last snapshot of the process table, and when it was taken. Protected by s_process_snapshot_lock. */
+static pthread_mutex_t s_process_snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_ptr<const process_snapshot_t> s_process_snapshot;
+static double s_process_snapshot_time = 0;
+
+/**
+   Return a list of the user's processes, listed in a single pass. If allow_cached is set, a recent enough snapshot may be returned instead of listing them again. Expanding a process name in a command always takes a fresh snapshot, so that processes started a moment ago are found.
+*/
+static shared_ptr<const process_snapshot_t> get_process_snapshot(bool allow_cached)
+{
+    if (allow_cached)
+    {
+        scoped_lock lock(s_process_snapshot_lock);
+        if (s_process_snapshot && timef() - s_process_snapshot_time <= PROCESS_SNAPSHOT_MAX_AGE)
+            return s_process_snapshot;
+    }
+
+    double now = timef();
+    process_snapshot_t *snapshot = new process_snapshot_t();
+    process_snapshot_entry_t entry;
     process_iterator_t iterator;
+    while (iterator.next_process(&entry.name, &entry.pid))
+    {
+        snapshot->push_back(entry);
+    }
+
+    shared_ptr<const process_snapshot_t> result(snapshot);
+    scoped_lock lock(s_process_snapshot_lock);
+    s_process_snapshot = result;
+    s_process_snapshot_time = now;
+    return result;
+}
+
+std::vector<wcstring> expand_get_all_process_names(void)
+{
+    const shared_ptr<const process_snapshot_t> snapshot = get_process_snapshot(true);
     std::vector<wcstring> result;
-    while (iterator.next_process(&name, &pid))
+    result.reserve(snapshot->size());
+    for (size_t i = 0; i < snapshot->size(); i++)
     {
-        result.push_back(name);
+        result.push_back(snapshot->at(i).name);
     }
     return result;
 }
@@ -755,11 +802,11 @@ static void find_process(const wchar_t *proc, expand_flags_t flags, std::vector<
     }
 
     /* Iterate over all processes */
-    wcstring process_name;
-    pid_t process_pid;
-    process_iterator_t iterator;
-    while (iterator.next_process(&process_name, &process_pid))
+    const shared_ptr<const process_snapshot_t> snapshot = get_process_snapshot((flags & EXPAND_FOR_COMPLETIONS) != 0);
+    for (size_t i = 0; i < snapshot->size(); i++)
     {
+        const wcstring &process_name = snapshot->at(i).name;
+        pid_t process_pid = snapshot->at(i).pid;
         size_t offset;
         if (match_pid(process_name, proc, flags, &offset))
         {
@@ -945,6 +992,36 @@ static size_t parse_slice(const wchar_t *in, wchar_t **end_ptr, std::vector<long
 }
 
 
+/**
+   Indexed access to the elements of an array variable value. Element boundaries are found as they are needed,
+   scanning only as far as the highest element asked for, so $list[1] does not look at the rest of a long list.
+*/
+class variable_array_elements_t
+{
+    const wcstring &val;
+
+    /* Offsets of the starts of the elements found so far. The end of an element is one before the start of the next. */
+    std::vector<size_t> starts;
+
+public:
+    variable_array_elements_t(const wcstring &v) : val(v)
+    {
+        starts.push_back(0);
+    }
+
+    /* Returns the element at the zero based index idx, which must be less than count_variable_array(val) */
+    wcstring at(size_t idx)
+    {
+        while (starts.size() <= idx + 1)
+        {
+            size_t sep = val.find(ARRAY_SEP, starts.back());
+            starts.push_back(sep == wcstring::npos ? val.size() + 1 : sep + 1);
+        }
+        const size_t start = starts.at(idx);
+        return wcstring(val, start, starts.at(idx + 1) - 1 - start);
+    }
+};
+
 /**
    Expand all environment variables in the string *ptr.
 
@@ -1035,10 +1112,17 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
 
             var_tmp.append(instr, start_pos, var_len);
             env_var_t var_val;
+
+            /* $history is read item by item, so that a slice only looks at the items it needs, and the whole history is never joined into one string */
+            history_t *history = (var_tmp == L"history" ? env_get_history() : NULL);
             if (var_len == 1 && var_tmp[0] == VARIABLE_EXPAND_EMPTY)
             {
                 var_val = env_var_t::missing_var();
             }
+            else if (history)
+            {
+                var_val = env_var_t();
+            }
             else
             {
                 var_val = expand_var(var_tmp.c_str());
@@ -1051,8 +1135,6 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
 
                 if (is_ok)
                 {
-                    tokenize_variable_array(var_val, var_item_list);
-
                     const size_t slice_start = stop_pos;
                     if (slice_start < insize && instr.at(slice_start) == L'[')
                     {
@@ -1060,7 +1142,27 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                         size_t bad_pos;
                         all_vars=0;
                         const wchar_t *in = instr.c_str();
-                        bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, var_item_list.size());
+                        if (history)
+                        {
+                            /* Counting the history means looking at all of it, so only do that if the slice counts from the end */
+                            bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, 0);
+                            bool counts_from_end = false;
+                            for (size_t j=0; j < var_idx_list.size(); j++)
+                            {
+                                if (var_idx_list.at(j) < 1)
+                                    counts_from_end = true;
+                            }
+                            if (bad_pos == 0 && counts_from_end)
+                            {
+                                var_idx_list.clear();
+                                var_pos_list.clear();
+                                bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, history->distinct_item_count());
+                            }
+                        }
+                        else
+                        {
+                            bad_pos = parse_slice(in + slice_start, &slice_end, var_idx_list, var_pos_list, count_variable_array(var_val));
+                        }
                         if (bad_pos != 0)
                         {
                             append_syntax_error(errors,
@@ -1072,14 +1174,37 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                         stop_pos = (slice_end-in);
                     }
 
-                    if (!all_vars)
+                    if (all_vars && history)
+                    {
+                        for (size_t j=1;; j++)
+                        {
+                            const history_item_t item = history->distinct_item_at_index(j);
+                            if (item.empty())
+                                break;
+                            var_item_list.push_back(item.str());
+                        }
+                    }
+                    else if (all_vars)
+                    {
+                        tokenize_variable_array(var_val, var_item_list);
+                    }
+                    else
                     {
-                        wcstring_list_t string_values(var_idx_list.size());
+                        /* Only pull out the elements the slice asks for */
+                        const size_t item_count = history ? 0 : count_variable_array(var_val);
+                        variable_array_elements_t elements(var_val);
+                        var_item_list.reserve(var_idx_list.size());
                         for (size_t j=0; j<var_idx_list.size(); j++)
                         {
                             long tmp = var_idx_list.at(j);
+
+                            /* History items are never empty, so an empty item means the index is past the end */
+                            wcstring history_item;
+                            if (history && tmp >= 1)
+                                history_item = history->distinct_item_at_index(tmp).str();
+
                             /* Check that we are within array bounds. If not, truncate the list to exit. */
-                            if (tmp < 1 || (size_t)tmp > var_item_list.size())
+                            if (tmp < 1 || (history ? history_item.empty() : (size_t)tmp > item_count))
                             {
                                 size_t var_src_pos = var_pos_list.at(j);
                                 /* The slice was parsed starting at stop_pos, so we have to add that to the error position */
@@ -1090,16 +1215,11 @@ static int expand_variables(parser_t &parser, const wcstring &instr, std::vector
                                 var_idx_list.resize(j);
                                 break;
                             }
+                            if (history)
+                                var_item_list.push_back(history_item);
                             else
-                            {
-                                /* Replace each index in var_idx_list inplace with the string value at the specified index */
-                                //al_set( var_idx_list, j, wcsdup((const wchar_t *)al_get( &var_item_list, tmp-1 ) ) );
-                                string_values.at(j) = var_item_list.at(tmp-1);
-                            }
+                                var_item_list.push_back(elements.at(tmp-1));
                         }
-
-                        // string_values is the new var_item_list
-                        var_item_list.swap(string_values);
                     }
                 }
 
@@ -1409,7 +1529,10 @@ static int expand_cmdsubst(parser_t &parser, const wcstring &input, std::vector<
 
     if (exec_subshell(subcmd, sub_res, true /* do apply exit status */) == -1)
     {
-        append_cmdsub_error(errors, SOURCE_LOCATION_UNKNOWN, L"Unknown error while evaulating command substitution");
+        if (proc_get_last_status() == STATUS_READ_TOO_MUCH)
+            append_cmdsub_error(errors, SOURCE_LOCATION_UNKNOWN, L"Too much data emitted by command substitution so it was discarded");
+        else
+            append_cmdsub_error(errors, SOURCE_LOCATION_UNKNOWN, L"Unknown error while evaulating command substitution");
         return 0;
     }
 
@@ -2003,22 +2126,26 @@ bool fish_openSUSE_dbus_hack_hack_hack_hack(std::vector<completion_t> *args)
     return result;
 }
 
-bool expand_abbreviation(const wcstring &src, wcstring *output)
-{
-    if (src.empty())
-        return false;
+/** Abbreviations and what they expand to */
+typedef std::map<wcstring, wcstring> abbreviation_map_t;
 
-    /* Get the abbreviations. Return false if we have none */
-    env_var_t var = env_get_string(USER_ABBREVIATIONS_VARIABLE_NAME);
-    if (var.missing_or_empty())
-        return false;
+/**
+   The parsed abbreviations. They are parsed again only when the variable has changed, which is counted by
+   s_abbreviations_generation. These may be used from the highlighting threads, so they are protected by a lock.
+*/
+static pthread_mutex_t s_abbreviations_lock = PTHREAD_MUTEX_INITIALIZER;
+static abbreviation_map_t s_abbreviations;
+static unsigned long s_abbreviations_generation = 1;
+static unsigned long s_abbreviations_parsed_generation = 0;
 
-    bool result = false;
+/* Parse the abbreviations variable into a map. The first abbreviation for a command wins. */
+static void parse_abbreviations(const wcstring &var, abbreviation_map_t *abbreviations)
+{
     wcstring line;
     wcstokenizer tokenizer(var, ARRAY_SEP_STR);
     while (tokenizer.next(line))
     {
-        /* Line is expected to be of the form 'foo=bar' or 'foo bar'. Parse out the first = or space. Silently skip on failure (no equals, or equals at the end or beginning). Try to avoid copying any strings until we are sure this is a match. */
+        /* Line is expected to be of the form 'foo=bar' or 'foo bar'. Parse out the first = or space. Silently skip on failure (no equals, or equals at the end or beginning). */
         size_t equals_pos = line.find(L'=');
         size_t space_pos = line.find(L' ');
         size_t separator = mini(equals_pos, space_pos);
@@ -2030,16 +2157,71 @@ bool expand_abbreviation(const wcstring &src, wcstring *output)
         while (cmd_end > 0 && iswspace(line.at(cmd_end - 1)))
             cmd_end--;
 
-        /* See if this command matches */
-        if (line.compare(0, cmd_end, src) == 0)
-        {
-            /* Success. Set output to everythign past the end of the string. */
-            if (output != NULL)
-                output->assign(line, separator + 1, wcstring::npos);
+        abbreviations->insert(abbreviation_map_t::value_type(line.substr(0, cmd_end), line.substr(separator + 1)));
+    }
+}
 
-            result = true;
-            break;
-        }
+static bool lookup_abbreviation(const abbreviation_map_t &abbreviations, const wcstring &src, wcstring *output)
+{
+    abbreviation_map_t::const_iterator iter = abbreviations.find(src);
+    if (iter == abbreviations.end())
+        return false;
+
+    if (output != NULL)
+        output->assign(iter->second);
+    return true;
+}
+
+void expand_abbreviations_changed()
+{
+    scoped_lock locker(s_abbreviations_lock);
+    s_abbreviations_generation++;
+}
+
+/**
+   Parse the abbreviations again if the variable changed since they were last parsed. Only the main thread keeps
+   what it parsed: a highlighting thread may read the variable while the main thread is in a scope that hides or
+   shadows it, and would then store the wrong abbreviations under the current generation.
+*/
+void expand_abbreviations_update()
+{
+    ASSERT_IS_MAIN_THREAD();
+    {
+        scoped_lock locker(s_abbreviations_lock);
+        if (s_abbreviations_parsed_generation == s_abbreviations_generation)
+            return;
     }
-    return result;
+
+    /* Parse the variable without holding the lock, since getting it takes the environment lock. Generations are
+       only bumped on the main thread, so it can not change meanwhile. */
+    abbreviation_map_t abbreviations;
+    const env_var_t var = env_get_string(USER_ABBREVIATIONS_VARIABLE_NAME);
+    if (! var.missing_or_empty())
+        parse_abbreviations(var, &abbreviations);
+
+    scoped_lock locker(s_abbreviations_lock);
+    s_abbreviations.swap(abbreviations);
+    s_abbreviations_parsed_generation = s_abbreviations_generation;
+}
+
+bool expand_abbreviation(const wcstring &src, wcstring *output)
+{
+    if (src.empty())
+        return false;
+
+    if (is_main_thread())
+        expand_abbreviations_update();
+
+    {
+        scoped_lock locker(s_abbreviations_lock);
+        if (s_abbreviations_parsed_generation == s_abbreviations_generation)
+            return lookup_abbreviation(s_abbreviations, src, output);
+    }
+
+    /* A highlighting thread got here before the main thread parsed the changed variable. Use what it reads, but don't keep it. */
+    abbreviation_map_t abbreviations;
+    const env_var_t var = env_get_string(USER_ABBREVIATIONS_VARIABLE_NAME);
+    if (! var.missing_or_empty())
+        parse_abbreviations(var, &abbreviations);
+    return lookup_abbreviation(abbreviations, src, output);
 }
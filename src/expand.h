@@ -203,6 +203,12 @@ std::vector<wcstring> expand_get_all_process_names(void);
 #define USER_ABBREVIATIONS_VARIABLE_NAME L"fish_user_abbreviations"
 bool expand_abbreviation(const wcstring &src, wcstring *output);
 
+/** Tell the abbreviation support that the abbreviations variable may have changed, so it is parsed again on next use */
+void expand_abbreviations_changed();
+
+/** Parse the abbreviations variable now if it changed, so that highlighting threads find it parsed. Main thread only. */
+void expand_abbreviations_update();
+
 /* Terrible hacks */
 bool fish_xdm_login_hack_hack_hack_hack(std::vector<std::string> *cmds, int argc, const char * const *argv);
 bool fish_openSUSE_dbus_hack_hack_hack_hack(std::vector<completion_t> *args);
@@ -52,6 +52,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "builtin.h"
 #include "function.h"
 #include "wutil.h"
+#include "util.h"
 #include "env.h"
 #include "proc.h"
 #include "parser.h"
@@ -62,6 +63,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "path.h"
 #include "input.h"
 #include "io.h"
+#include "autoload.h"
 #include "fish_version.h"
 
 /* PATH_MAX may not exist */
@@ -224,6 +226,16 @@ static struct config_paths_t determine_config_directory_paths(const char *argv0)
 /* Source the file config.fish in the given directory */
 static void source_config_in_directory(const wcstring &dir)
 {
+    long long start_time = get_monotonic_time();
+
+    /* Most directories have no config.fish. Not even parsing the command below for them keeps startup short, which matters for scripts and fish -c. */
+    if (waccess(dir + L"/config.fish", R_OK) != 0)
+    {
+        if (g_startup_timings_active)
+            startup_timing_report(L"no config in " + dir, start_time);
+        return;
+    }
+
     /* We want to execute a command like 'builtin source dir/config.fish 2>/dev/null' */
     const wcstring escaped_dir = escape_string(dir, ESCAPE_ALL);
     const wcstring cmd = L"builtin source " + escaped_dir + L"/config.fish 2>/dev/null";
@@ -231,6 +243,9 @@ static void source_config_in_directory(const wcstring &dir)
     parser.set_is_within_fish_initialization(true);
     parser.eval(cmd, io_chain_t(), TOP);
     parser.set_is_within_fish_initialization(false);
+
+    if (g_startup_timings_active)
+        startup_timing_report(L"config in " + dir, start_time);
 }
 
 static int try_connect_socket(std::string &name)
@@ -367,6 +382,7 @@ static int fish_parse_opt(int argc, char **argv, std::vector<std::string> *out_c
             { "login", no_argument, 0, 'l' },
             { "no-execute", no_argument, 0, 'n' },
             { "profile", required_argument, 0, 'p' },
+            { "print-startup-timings", no_argument, 0, 'T' },
             { "help", no_argument, 0, 'h' },
             { "version", no_argument, 0, 'v' },
             { 0, 0, 0, 0 }
@@ -451,6 +467,12 @@ static int fish_parse_opt(int argc, char **argv, std::vector<std::string> *out_c
                 break;
             }
 
+            case 'T':
+            {
+                startup_timings_begin();
+                break;
+            }
+
             case 'v':
             {
                 fwprintf(stderr,
@@ -519,17 +541,34 @@ int main(int argc, char **argv)
         save_term_foreground_process_group();
     }
 
+    long long phase_start = get_monotonic_time();
     const struct config_paths_t paths = determine_config_directory_paths(argv[0]);
+    autoload_set_data_directory(paths.data);
+    startup_timing_report(L"config paths", phase_start);
 
+    phase_start = get_monotonic_time();
     proc_init();
     event_init();
     builtin_init();
     function_init();
+    startup_timing_report(L"proc, event, builtin and function init", phase_start);
+
+    phase_start = get_monotonic_time();
     env_init(&paths);
+    startup_timing_report(L"env_init", phase_start);
+
+    phase_start = get_monotonic_time();
     reader_init();
+    startup_timing_report(L"reader_init", phase_start);
+
+    phase_start = get_monotonic_time();
     history_init();
+    startup_timing_report(L"history_init", phase_start);
+
     /* For setcolor to support term256 in config.fish (#1022) */
+    phase_start = get_monotonic_time();
     update_fish_color_support();
+    startup_timing_report(L"color support", phase_start);
 
     parser_t &parser = parser_t::principal_parser();
 
@@ -542,6 +581,12 @@ int main(int argc, char **argv)
         /* Stop the exit status of any initialization commands (#635) */
         proc_set_last_status(STATUS_BUILTIN_OK);
 
+        /* An interactive shell has started up once it shows its first prompt; anything else once its config is read */
+        if (! is_interactive_session || ! cmds.empty() || my_optind != argc)
+        {
+            startup_timings_end();
+        }
+
         /* Run the commands specified as arguments, if any */
         if (! cmds.empty())
         {
@@ -623,6 +668,9 @@ int main(int argc, char **argv)
 
     proc_fire_event(L"PROCESS_EXIT", EVENT_EXIT, getpid(), exit_status);
 
+    /* Write out any universal variable changes that are still batched */
+    env_universal_flush();
+
     restore_term_mode();
     restore_term_foreground_process_group();
 
@@ -631,6 +679,9 @@ int main(int argc, char **argv)
         parser.emit_profiling(s_profiling_output_filename);
     }
 
+    /* Write the final statistics of a streaming profile started with 'status --profile-start' */
+    parser.stream_profiler().stop();
+
     history_destroy();
     proc_destroy();
     builtin_destroy();
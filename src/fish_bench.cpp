@@ -0,0 +1,941 @@
+/** \file fish_bench.cpp
+  Microbenchmarks for the hot paths of fish.
+
+  Each benchmark runs a fixed workload a number of rounds and prints one tab
+  separated line per benchmark to stdout:
+
+      name  iterations  rounds  min_ns_per_op  median_ns_per_op
+
+  The first line is a header naming these columns. Inputs are fixed, so the
+  numbers of two builds on the same machine can be compared directly.
+  Arguments, if any, are prefixes of the benchmarks to run, as with
+  fish_tests.
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <locale.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <wchar.h>
+
+#if HAVE_NCURSES_H
+#include <ncurses.h>
+#elif HAVE_NCURSES_CURSES_H
+#include <ncurses/curses.h>
+#else
+#include <curses.h>
+#endif
+
+#if HAVE_TERM_H
+#include <term.h>
+#elif HAVE_NCURSES_TERM_H
+#include <ncurses/term.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "fallback.h" // IWYU pragma: keep
+#include "util.h"
+#include "common.h"
+#include "proc.h"
+#include "reader.h"
+#include "builtin.h"
+#include "function.h"
+#include "complete.h"
+#include "wutil.h"
+#include "env.h"
+#include "path.h"
+#include "expand.h"
+#include "event.h"
+#include "tokenizer.h"
+#include "output.h"
+#include "history.h"
+#include "signal.h"
+#include "parser.h"
+#include "parse_tree.h"
+#include "pager.h"
+#include "screen.h"
+#include "wildcard.h"
+#include "lru.h"
+#include "iothread.h"
+#include "io.h"
+
+/**
+   Number of times each benchmark is run. The minimum and median over the rounds are reported.
+*/
+#define ROUNDS 7
+
+/**
+   Directory of files used by the wildcard benchmarks
+*/
+#define BENCH_DIR "/tmp/fish_bench"
+
+/**
+   Number of files in BENCH_DIR
+*/
+#define BENCH_FILE_COUNT 500
+
+/**
+   Directory of function files used by the function listing benchmark, and how many it has
+*/
+#define BENCH_FUNCTION_DIR BENCH_DIR "/functions"
+#define BENCH_FUNCTION_COUNT 300
+
+/**
+   Number of items in the history searched by the history benchmark
+*/
+#define BENCH_HISTORY_COUNT 2000
+
+/**
+   Number of variable handlers registered while setting variables
+*/
+#define BENCH_HANDLER_COUNT 500
+
+/**
+   Arguments naming the benchmarks to run
+*/
+static const char * const *s_arguments;
+
+/**
+   Results of the benchmarks are accumulated here so the work they do cannot be optimized away
+*/
+static volatile size_t s_sink;
+
+/**
+   A script of the kind found in config.fish and completions, used by the tokenizer and parser benchmarks
+*/
+static const wchar_t * const s_script =
+    L"function fish_prompt --description 'Write out the prompt'\n"
+    L"    set -l last_status $status\n"
+    L"    if not set -q __fish_prompt_normal\n"
+    L"        set -g __fish_prompt_normal (set_color normal)\n"
+    L"    end\n"
+    L"    switch $USER\n"
+    L"        case root toor\n"
+    L"            echo -n -s \"$USER\" @ (prompt_hostname) ' ' (prompt_pwd) '# '\n"
+    L"        case '*'\n"
+    L"            echo -n -s \"$USER\" @ (prompt_hostname) ' ' (prompt_pwd) '> '\n"
+    L"    end\n"
+    L"end\n"
+    L"for i in (seq 10) a b c\n"
+    L"    test $i = b; and continue\n"
+    L"    printf '%s\\n' \"item $i\" >> /tmp/out 2>&1 | cat\n"
+    L"end\n"
+    L"begin; ls -la *.txt ~/src/{a,b}/**.cpp ; end &\n";
+
+/**
+   Return whether the named benchmark was asked for
+*/
+static bool should_run(const char *name)
+{
+    if (! s_arguments || ! s_arguments[0])
+        return true;
+
+    for (size_t i=0; s_arguments[i] != NULL; i++)
+    {
+        if (! strncmp(name, s_arguments[i], strlen(s_arguments[i])))
+            return true;
+    }
+    return false;
+}
+
+/**
+   Run func(iterations) ROUNDS times and print how long it took per iteration
+*/
+static void bench(const char *name, void (*func)(size_t), size_t iterations)
+{
+    if (! should_run(name))
+        return;
+
+    /* One untimed round to warm caches and fault in whatever gets loaded lazily */
+    func(iterations);
+
+    std::vector<double> ns_per_op;
+    for (size_t round=0; round < ROUNDS; round++)
+    {
+        long long start = get_monotonic_time();
+        func(iterations);
+        long long elapsed = get_monotonic_time() - start;
+        ns_per_op.push_back(elapsed * 1000.0 / iterations);
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+
+    printf("%s\t%lu\t%d\t%.1f\t%.1f\n", name, (unsigned long)iterations, ROUNDS, ns_per_op.front(), ns_per_op.at(ROUNDS / 2));
+    fflush(stdout);
+}
+
+static void bench_tokenize(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        tokenizer_t tok(s_script, TOK_SHOW_COMMENTS);
+        tok_t token;
+        while (tok.next(&token))
+        {
+            s_sink += token.offset;
+        }
+    }
+}
+
+static void bench_parse(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        parse_node_tree_t tree;
+        parse_tree_from_string(s_script, parse_flag_none, &tree, NULL);
+        s_sink += tree.size();
+    }
+}
+
+static void bench_expand(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        std::vector<completion_t> output;
+        if (expand_string(L"~/{src,doc}/$USER-{a,b,c}.$PATH[1]", &output, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_WILDCARDS, NULL) != EXPAND_ERROR)
+        {
+            s_sink += output.size();
+        }
+    }
+}
+
+static void bench_expand_wildcard(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        std::vector<completion_t> output;
+        if (expand_string(L"" BENCH_DIR "/file_*7.txt", &output, EXPAND_SKIP_CMDSUBST, NULL) != EXPAND_ERROR)
+        {
+            s_sink += output.size();
+        }
+    }
+}
+
+/* The screen and pager ask for the terminal size many times per repaint */
+static void bench_termsize(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += common_get_width();
+        s_sink += common_get_height();
+    }
+}
+
+/* Function names of the kind autoloaded from share/functions, which share long prefixes */
+class bench_lru_cache_t : public lru_cache_t<lru_node_t>
+{
+public:
+    bench_lru_cache_t() : lru_cache_t<lru_node_t>(1024) { }
+
+    virtual void node_was_evicted(lru_node_t *node)
+    {
+        delete node;
+    }
+};
+
+static void bench_lru_lookup(size_t iterations)
+{
+    bench_lru_cache_t cache;
+    wcstring_list_t names;
+    for (size_t i=0; i < 1000; i++)
+    {
+        names.push_back(format_string(L"__fish_complete_function_%lu", (unsigned long)i));
+        cache.add_node(new lru_node_t(names.back()));
+    }
+    for (size_t i=0; i < iterations; i++)
+    {
+        for (size_t j=0; j < names.size(); j++)
+        {
+            s_sink += (cache.get_node(names.at(j)) != NULL);
+        }
+        s_sink += (cache.get_node(L"__fish_complete_function_missing") != NULL);
+    }
+    cache.evict_all_nodes();
+}
+
+static void bench_wildcard_match(size_t iterations)
+{
+    const wcstring str = L"/usr/local/share/fish/completions/git-annex.fish";
+    const wcstring matching = L"*/share/*/comp*/git*.f?sh";
+    const wcstring failing = L"*/share/*/comp*/svn*.f?sh";
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += wildcard_match(str, matching);
+        s_sink += wildcard_match(str, failing);
+    }
+}
+
+/* A loop of the kind found in scripts, which enters a few blocks and runs a few jobs per iteration */
+static const wchar_t * const s_loop_script =
+    L"for i in $fish_bench_items\n"
+    L"    if test $i -gt 50\n"
+    L"        set -l x $i\n"
+    L"    else if true\n"
+    L"        begin; set -l y $i; end\n"
+    L"    end\n"
+    L"end\n";
+
+static void bench_eval_loop(size_t iterations)
+{
+    wcstring items;
+    for (size_t i=1; i <= 100; i++)
+    {
+        if (! items.empty())
+            items.push_back(ARRAY_SEP);
+        append_format(items, L"%lu", (unsigned long)i);
+    }
+    env_set(L"fish_bench_items", items.c_str(), ENV_GLOBAL);
+
+    parser_t &parser = parser_t::principal_parser();
+    const io_chain_t empty_ios;
+    for (size_t i=0; i < iterations; i++)
+    {
+        parser.eval(s_loop_script, empty_ios, TOP);
+    }
+    env_remove(L"fish_bench_items", ENV_GLOBAL);
+}
+
+/* Nested function calls whose output is captured, as in a command substitution, so that every job and block inherits a redirection */
+static const wchar_t * const s_nested_calls_script =
+    L"function fish_bench_inner; set -l y $argv; end\n"
+    L"function fish_bench_outer; fish_bench_inner $argv; fish_bench_inner $argv; end\n"
+    L"for i in $fish_bench_items\n"
+    L"    fish_bench_outer $i\n"
+    L"end\n";
+
+static void bench_eval_captured(size_t iterations)
+{
+    wcstring items;
+    for (size_t i=1; i <= 100; i++)
+    {
+        if (! items.empty())
+            items.push_back(ARRAY_SEP);
+        append_format(items, L"%lu", (unsigned long)i);
+    }
+    env_set(L"fish_bench_items", items.c_str(), ENV_GLOBAL);
+
+    parser_t &parser = parser_t::principal_parser();
+    for (size_t i=0; i < iterations; i++)
+    {
+        const shared_ptr<io_buffer_t> buffer(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
+        parser.eval(s_nested_calls_script, io_chain_t(buffer), SUBST);
+        buffer->read();
+    }
+    env_remove(L"fish_bench_items", ENV_GLOBAL);
+    parser.eval(L"functions -e fish_bench_inner fish_bench_outer", io_chain_t(), TOP);
+}
+
+/* A table printed through the printf builtin, run directly so that argument expansion is not measured */
+static void bench_printf(size_t iterations)
+{
+    wcstring_list_t args;
+    args.push_back(L"printf");
+    args.push_back(L"%-12s %6d %x\\n");
+    for (size_t i=1; i <= 100; i++)
+    {
+        args.push_back(format_string(L"item%lu", (unsigned long)i));
+        args.push_back(to_string(i * 37));
+        args.push_back(to_string(i * 4099));
+    }
+    null_terminated_array_t<wchar_t> argv(args);
+
+    parser_t &parser = parser_t::principal_parser();
+    for (size_t i=0; i < iterations; i++)
+    {
+        builtin_push_io(parser, STDIN_FILENO);
+        builtin_run(parser, argv.get(), io_chain_t());
+        builtin_pop_io(parser);
+    }
+}
+
+/* The file checks scripts make in loops, run directly through the test builtin */
+static void bench_test_files(size_t iterations)
+{
+    const wchar_t * const argv[] = {L"test", L"-f", L"/bin/sh", L"-a", L"-r", L"/bin/sh", L"-a", L"-x", L"/bin/sh", NULL};
+    parser_t &parser = parser_t::principal_parser();
+    for (size_t i=0; i < iterations; i++)
+    {
+        builtin_push_io(parser, STDIN_FILENO);
+        builtin_run(parser, argv, io_chain_t());
+        builtin_pop_io(parser);
+    }
+}
+
+/* An option parser of the kind found in functions, with a switch of many cases, most of them literal */
+static const wchar_t * const s_switch_script =
+    L"function fish_bench_switch\n"
+    L"    for arg in $argv\n"
+    L"        switch $arg\n"
+    L"            case -a --all; set -l all\n"
+    L"            case -b --brief; set -l brief\n"
+    L"            case -c --color; set -l color\n"
+    L"            case -d --directory; set -l directory\n"
+    L"            case -e --erase; set -l erase\n"
+    L"            case -f --force; set -l force\n"
+    L"            case -g --global; set -l global\n"
+    L"            case -h --help; set -l help\n"
+    L"            case -i --interactive; set -l interactive\n"
+    L"            case -l --long; set -l long\n"
+    L"            case -n --dry-run; set -l dry_run\n"
+    L"            case -q --quiet; set -l quiet\n"
+    L"            case -r --recursive; set -l recursive\n"
+    L"            case -s --silent; set -l silent\n"
+    L"            case -v --verbose; set -l verbose\n"
+    L"            case '--*'; set -l unknown_long\n"
+    L"            case '-*'; set -l unknown_short\n"
+    L"            case '*'; set -l positional\n"
+    L"        end\n"
+    L"    end\n"
+    L"end\n";
+
+static void bench_eval_switch(size_t iterations)
+{
+    parser_t &parser = parser_t::principal_parser();
+    const io_chain_t empty_ios;
+    parser.eval(s_switch_script, empty_ios, TOP);
+    for (size_t i=0; i < iterations; i++)
+    {
+        parser.eval(L"fish_bench_switch -v --recursive -q file1 --other -x --quiet file2 -s --dry-run", empty_ios, TOP);
+    }
+    parser.eval(L"functions -e fish_bench_switch", empty_ios, TOP);
+}
+
+/* Names like those in a large bin directory */
+static wcstring_list_t candidate_names()
+{
+    wcstring_list_t names;
+    for (size_t i=0; i < 2000; i++)
+    {
+        names.push_back(format_string(L"%ls-tool%lu", (i % 3) ? L"x86_64-linux-gnu" : L"Python", (unsigned long)i));
+    }
+    return names;
+}
+
+static void bench_fuzzy_match(size_t iterations)
+{
+    const wcstring_list_t names = candidate_names();
+    const wcstring needles[] = {L"x86_64-linux-gnu-tool1", L"python-tool", L"gnu-tool19", L"xtl9", L"zz"};
+    for (size_t i=0; i < iterations; i++)
+    {
+        for (size_t j=0; j < names.size(); j++)
+        {
+            for (size_t k=0; k < sizeof needles / sizeof *needles; k++)
+            {
+                s_sink += string_fuzzy_match_string(needles[k], names.at(j)).type;
+            }
+        }
+    }
+}
+
+static void bench_wildcard_complete(size_t iterations)
+{
+    const wcstring_list_t names = candidate_names();
+    for (size_t i=0; i < iterations; i++)
+    {
+        std::vector<completion_t> completions;
+        for (size_t j=0; j < names.size(); j++)
+        {
+            wildcard_complete(names.at(j), L"pyth", NULL, NULL, &completions, 0, 0);
+            wildcard_complete(names.at(j), L"gnu-tool1", NULL, NULL, &completions, EXPAND_FUZZY_MATCH, 0);
+        }
+        s_sink += completions.size();
+    }
+}
+
+static void bench_history_search(size_t iterations)
+{
+    history_t &history = history_t::history_with_name(L"fish_bench");
+    for (size_t i=0; i < iterations; i++)
+    {
+        history_search_t search(history, L"item 17");
+        while (search.go_backwards())
+        {
+            s_sink++;
+        }
+    }
+}
+
+/* Terms this short cannot use the trigram index, so every item is compared. The items are read back from the file, as they are in a new session. */
+static void bench_history_search_short(size_t iterations)
+{
+    history_t &history = history_t::history_with_name(L"fish_bench_old");
+    for (size_t i=0; i < iterations; i++)
+    {
+        history_search_t search(history, L"17");
+        while (search.go_backwards())
+        {
+            s_sink++;
+        }
+    }
+}
+
+static void bench_history_prefix(size_t iterations)
+{
+    history_t &history = history_t::history_with_name(L"fish_bench");
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += history.items_with_prefix(L"echo history item 1", 16).size();
+    }
+}
+
+/* Adds a session's worth of commands, most of them repeated, and saves them */
+static void bench_history_add(size_t iterations)
+{
+    history_t &history = history_t::history_with_name(L"fish_bench_add");
+    for (size_t i=0; i < iterations; i++)
+    {
+        history.clear();
+        history.disable_automatic_saving();
+        for (size_t j=0; j < 2000; j++)
+        {
+            history.add(format_string(L"make -j%lu", (unsigned long)(j % 20)));
+        }
+        history.enable_automatic_saving();
+    }
+    history.clear();
+}
+
+/* Adds commands with path arguments as fast as they can be typed, and waits for their paths to be tested */
+static void bench_history_file_detection(size_t iterations)
+{
+    history_t &history = history_t::history_with_name(L"fish_bench_file_detection");
+    for (size_t i=0; i < iterations; i++)
+    {
+        history.clear();
+        for (size_t j=0; j < 100; j++)
+        {
+            history.add_pending_with_file_detection(format_string(L"ls /usr/bin /usr/lib /tmp/fish_bench_missing_%lu", (unsigned long)(j % 10)));
+        }
+        history.resolve_pending();
+        iothread_drain_all();
+        iothread_drain_all();
+    }
+    history.clear();
+}
+
+/* Builds a string containing every kind of character that needs escaping */
+static wcstring escape_input()
+{
+    wcstring result;
+    for (size_t i=0; i < 20; i++)
+    {
+        result.append(L"plain text with spaces, $vars, 'quotes', \"doubles\", back\\slash, \033 and \xe9t\xe9 ");
+    }
+    return result;
+}
+
+static void bench_escape(size_t iterations)
+{
+    const wcstring input = escape_input();
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += escape_string(input, ESCAPE_ALL).size();
+    }
+}
+
+static void bench_unescape(size_t iterations)
+{
+    const wcstring input = escape_string(escape_input(), ESCAPE_ALL);
+    wcstring output;
+    for (size_t i=0; i < iterations; i++)
+    {
+        if (unescape_string(input, &output, UNESCAPE_DEFAULT))
+        {
+            s_sink += output.size();
+        }
+    }
+}
+
+/* Builds a long string of the kind found in paths and history items, with nothing to escape */
+static wcstring plain_input()
+{
+    wcstring result;
+    for (size_t i=0; i < 20; i++)
+    {
+        result.append(L"/usr/local/share/fish/completions/git-annex.fish_");
+    }
+    return result;
+}
+
+static void bench_escape_plain(size_t iterations)
+{
+    const wcstring input = plain_input();
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += escape_string(input, ESCAPE_ALL).size();
+    }
+}
+
+static void bench_unescape_plain(size_t iterations)
+{
+    const wcstring input = plain_input();
+    wcstring output;
+    for (size_t i=0; i < iterations; i++)
+    {
+        if (unescape_string(input, &output, UNESCAPE_SPECIAL))
+        {
+            s_sink += output.size();
+        }
+    }
+}
+
+static void bench_format(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += format_string(L"%ls: %lu of %lu entries cached, %d", L"completions", (unsigned long)i, 4096UL, -1).size();
+    }
+}
+
+static void bench_format_long(size_t iterations)
+{
+    /* Longer than the initial vswprintf buffer */
+    const wcstring path = plain_input();
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += format_string(L"%ls: %d", path.c_str(), (int)i).size();
+    }
+}
+
+static void bench_wcswidth(size_t iterations)
+{
+    const wcstring input = plain_input() + L"\u4E00\u4E8C\u4E09 caf\u00E9 \u0301 \uAC00";
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += fish_wcswidth(input.c_str(), input.size());
+    }
+}
+
+static void bench_cdpath(size_t iterations)
+{
+    env_set(L"CDPATH", L"/usr" ARRAY_SEP_STR L"/usr/share" ARRAY_SEP_STR L"/usr/lib", ENV_GLOBAL);
+    const env_vars_snapshot_t vars(env_vars_snapshot_t::highlighting_keys);
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += path_get_cdpath(L"fish_bench_missing", NULL, L"/tmp/", vars);
+        s_sink += path_get_cdpath(L"bin", NULL, L"/tmp/", vars);
+    }
+    env_remove(L"CDPATH", ENV_GLOBAL);
+}
+
+static void bench_env_get_string(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += env_get_string(L"PATH").size();
+        s_sink += env_get_string(L"fish_bench_missing").missing();
+    }
+}
+
+static void bench_set_watched(size_t iterations)
+{
+    /* setup_fixtures registered handlers for other variables, as plugin frameworks do */
+    for (size_t i=0; i < iterations; i++)
+    {
+        env_set(L"fish_bench_var", (i & 1) ? L"odd" : L"even", ENV_GLOBAL);
+    }
+}
+
+static void bench_signal_block(size_t iterations)
+{
+    /* exec_job blocks and unblocks around every builtin and function it runs */
+    for (size_t i=0; i < iterations; i++)
+    {
+        signal_block();
+        signal_unblock();
+    }
+}
+
+/* Output writer that throws away what the screen benchmark draws */
+static int discard_writer(char c)
+{
+    return 0;
+}
+
+static void bench_screen_update(size_t iterations)
+{
+    const wcstring left_prompt = L"user@host ~/src/fish-shell> ";
+    const wcstring right_prompt = L"(master)";
+    const wcstring commandline = L"for f in *.cpp; echo (basename $f .cpp); end";
+    const std::vector<highlight_spec_t> colors(commandline.size() + 1, highlight_spec_normal);
+    const std::vector<int> indents(commandline.size() + 1, 0);
+    const page_rendering_t pager_data;
+
+    int (*const saved_writer)(char) = output_get_writer();
+    output_set_writer(discard_writer);
+    screen_t screen;
+    for (size_t i=0; i < iterations; i++)
+    {
+        /* Move the cursor along the line, so every update has something to draw */
+        size_t cursor = i % (commandline.size() + 1);
+        s_write(&screen, left_prompt, right_prompt, commandline, commandline.size(), &colors[0], &indents[0], cursor, (size_t)(-1), (size_t)(-1), pager_data, false);
+    }
+    output_set_writer(saved_writer);
+}
+
+static void bench_highlight_color(size_t iterations)
+{
+    const highlight_spec_t specs[] = {highlight_spec_command, highlight_spec_param, highlight_spec_param | highlight_modifier_valid_path, highlight_spec_operator, highlight_spec_quote, highlight_spec_autosuggestion};
+    const size_t spec_count = sizeof specs / sizeof *specs;
+    for (size_t i=0; i < iterations; i++)
+    {
+        /* What s_set_color asks for each time the color changes */
+        highlight_get_color(specs[i % spec_count], false);
+        highlight_get_color(highlight_spec_normal, true);
+    }
+}
+
+static void bench_set_color(size_t iterations)
+{
+    const rgb_color_t colors[] = {rgb_color_t(L"red"), rgb_color_t(L"green"), rgb_color_t(L"blue"), rgb_color_t(L"yellow")};
+    const size_t color_count = sizeof colors / sizeof *colors;
+
+    int (*const saved_writer)(char) = output_get_writer();
+    output_set_writer(discard_writer);
+    for (size_t i=0; i < iterations; i++)
+    {
+        /* Change the foreground every time and the background every other time, like a highlighted command line */
+        set_color(colors[i % color_count], colors[(i / 2) % color_count]);
+    }
+    set_color(rgb_color_t::reset(), rgb_color_t::reset());
+    output_set_writer(saved_writer);
+}
+
+static void bench_complete(size_t iterations)
+{
+    for (size_t i=0; i < iterations; i++)
+    {
+        std::vector<completion_t> completions;
+        complete(L"set fish_", completions, COMPLETION_REQUEST_DEFAULT);
+        complete(L"ls " BENCH_DIR "/file_1", completions, COMPLETION_REQUEST_DEFAULT);
+        s_sink += completions.size();
+    }
+}
+
+static void bench_complete_command(size_t iterations)
+{
+    env_set(L"PATH", L"/usr/local/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR L"/bin" ARRAY_SEP_STR L"/usr/sbin" ARRAY_SEP_STR L"/sbin", ENV_GLOBAL | ENV_EXPORT);
+    for (size_t i=0; i < iterations; i++)
+    {
+        std::vector<completion_t> completions;
+        complete(L"gi", completions, COMPLETION_REQUEST_DEFAULT);
+        complete(L"xz", completions, COMPLETION_REQUEST_DEFAULT);
+        s_sink += completions.size();
+    }
+}
+
+/* Listing every function, as the functions builtin and command completion do */
+static void bench_function_names(size_t iterations)
+{
+    env_set(L"fish_function_path", L"" BENCH_FUNCTION_DIR, ENV_GLOBAL);
+    for (size_t i=0; i < iterations; i++)
+    {
+        s_sink += function_get_names(true).size();
+    }
+    env_remove(L"fish_function_path", ENV_GLOBAL);
+}
+
+/* Completions like those of share/completions/git.fish, which defines hundreds of them */
+static const wchar_t * const s_complete_script =
+    L"complete -c fish_bench_cmd -n '__fish_use_subcommand' -x -a add -d 'Add file contents to the index'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from add' -s n -l dry-run -d 'Don\\'t actually add the file(s)'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from add' -s v -l verbose -d 'Be verbose'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from add' -s f -l force -d 'Allow adding otherwise ignored files'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from add' -s A -l all -d 'Match files both in working tree and index'\n"
+    L"complete -c fish_bench_cmd -n '__fish_use_subcommand' -x -a checkout -d 'Checkout and switch to a branch'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from checkout' -x -a '(__fish_complete_suffix .txt)' -d 'File'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from checkout' -s b -d 'Create a new branch'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from checkout' -s t -l track -d 'Track a new branch'\n"
+    L"complete -c fish_bench_cmd -n '__fish_seen_subcommand_from checkout' -l theirs -d 'Keep staged changes'\n";
+
+static void bench_complete_define(size_t iterations)
+{
+    parser_t &parser = parser_t::principal_parser();
+    const io_chain_t empty_ios;
+    for (size_t i=0; i < iterations; i++)
+    {
+        parser.eval(s_complete_script, empty_ios, TOP);
+        parser.eval(L"complete -e -c fish_bench_cmd", empty_ios, TOP);
+    }
+}
+
+/**
+   Create the files and history the benchmarks work on
+*/
+static void setup_fixtures()
+{
+    if (mkdir(BENCH_DIR, 0700) && errno != EEXIST)
+    {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i=0; i < BENCH_FILE_COUNT; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, BENCH_DIR "/file_%lu.txt", (unsigned long)i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0600);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    mkdir(BENCH_FUNCTION_DIR, 0700);
+    for (size_t i=0; i < BENCH_FUNCTION_COUNT; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, BENCH_FUNCTION_DIR "/fish_bench_function_%lu.fish", (unsigned long)i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0600);
+        if (fd >= 0)
+            close(fd);
+    }
+    /* Make the directory look like one that has not changed in a while, as function directories usually haven't */
+    struct timeval times[2] = {};
+    times[0].tv_sec = times[1].tv_sec = time(NULL) - 3600;
+    utimes(BENCH_FUNCTION_DIR, times);
+
+    for (size_t i=0; i < BENCH_HANDLER_COUNT; i++)
+    {
+        event_t handler = event_t::variable_event(format_string(L"fish_bench_watched_%lu", (unsigned long)i));
+        handler.function_name = L"fish_bench_handler";
+        event_add_handler(handler);
+    }
+
+    history_t &history = history_t::history_with_name(L"fish_bench");
+    history.clear();
+    for (size_t i=0; i < BENCH_HISTORY_COUNT; i++)
+    {
+        history.add(format_string(L"echo history item %lu", (unsigned long)i));
+    }
+
+    /* Move the file where another history will read the items as old ones */
+    history.save();
+    wcstring config_dir;
+    if (path_get_config(config_dir))
+    {
+        wrename(config_dir + L"/fish_bench_history", config_dir + L"/fish_bench_old_history");
+    }
+
+    /* Items from the second a history is created in count as newer than it, so wait for the next second before anything creates that history */
+    const time_t saved = time(NULL);
+    while (time(NULL) <= saved)
+    {
+        usleep(10000);
+    }
+}
+
+/**
+   Remove what setup_fixtures created
+*/
+static void teardown_fixtures()
+{
+    history_t::history_with_name(L"fish_bench").clear();
+    history_t::history_with_name(L"fish_bench_old").clear();
+
+    event_t handlers(EVENT_ANY);
+    handlers.function_name = L"fish_bench_handler";
+    event_remove(handlers);
+
+    for (size_t i=0; i < BENCH_FILE_COUNT; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, BENCH_DIR "/file_%lu.txt", (unsigned long)i);
+        unlink(path);
+    }
+    for (size_t i=0; i < BENCH_FUNCTION_COUNT; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, BENCH_FUNCTION_DIR "/fish_bench_function_%lu.fish", (unsigned long)i);
+        unlink(path);
+    }
+    rmdir(BENCH_FUNCTION_DIR);
+    rmdir(BENCH_DIR);
+}
+
+int main(int argc, char **argv)
+{
+    setlocale(LC_ALL, "");
+    program_name = L"fish_bench";
+    s_arguments = argv + 1;
+
+    set_main_thread();
+    setup_fork_guards();
+    proc_init();
+    event_init();
+    function_init();
+    builtin_init();
+    reader_init();
+    env_init();
+
+    /* Set default signal handlers, so we can ctrl-C out of this */
+    signal_reset_handlers();
+
+    setup_fixtures();
+
+    printf("name\titerations\trounds\tmin_ns_per_op\tmedian_ns_per_op\n");
+
+    bench("tokenize", bench_tokenize, 2000);
+    bench("parse", bench_parse, 1000);
+    bench("eval_loop", bench_eval_loop, 50);
+    bench("eval_captured", bench_eval_captured, 20);
+    bench("eval_switch", bench_eval_switch, 200);
+    bench("printf", bench_printf, 100);
+    bench("test_files", bench_test_files, 20000);
+    bench("expand", bench_expand, 20000);
+    bench("expand_wildcard", bench_expand_wildcard, 200);
+    bench("wildcard_match", bench_wildcard_match, 200000);
+    bench("termsize", bench_termsize, 1000000);
+    bench("lru_lookup", bench_lru_lookup, 200);
+    bench("fuzzy_match", bench_fuzzy_match, 20);
+    bench("wildcard_complete", bench_wildcard_complete, 20);
+    bench("history_search", bench_history_search, 100);
+    bench("history_search_short", bench_history_search_short, 100);
+    bench("history_prefix", bench_history_prefix, 100);
+    bench("history_add", bench_history_add, 20);
+    bench("history_file_detection", bench_history_file_detection, 20);
+    bench("escape", bench_escape, 5000);
+    bench("unescape", bench_unescape, 5000);
+    bench("escape_plain", bench_escape_plain, 5000);
+    bench("unescape_plain", bench_unescape_plain, 5000);
+    bench("format", bench_format, 200000);
+    bench("format_long", bench_format_long, 20000);
+    bench("wcswidth", bench_wcswidth, 20000);
+    bench("env_get_string", bench_env_get_string, 200000);
+    bench("cdpath", bench_cdpath, 20000);
+    bench("set_watched", bench_set_watched, 20000);
+    bench("signal_block", bench_signal_block, 200000);
+    bench("highlight_color", bench_highlight_color, 200000);
+
+    /* The screen needs a terminal description to draw with */
+    int errret;
+    if (cur_term != NULL || setupterm(const_cast<char *>("ansi"), STDOUT_FILENO, &errret) != ERR)
+    {
+        bench("screen_update", bench_screen_update, 20000);
+        bench("set_color", bench_set_color, 200000);
+    }
+    else
+    {
+        fprintf(stderr, "Could not set up terminal, skipping screen_update and set_color\n");
+    }
+
+    bench("complete", bench_complete, 20);
+    bench("complete_define", bench_complete_define, 200);
+    bench("complete_command", bench_complete_command, 200);
+    bench("function_names", bench_function_names, 200);
+
+    teardown_fixtures();
+
+    reader_destroy();
+    builtin_destroy();
+    event_destroy();
+    proc_destroy();
+
+    return 0;
+}
@@ -31,6 +31,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <assert.h>
 #include <locale.h>
 #include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <string>
 
 #include "color.h"
@@ -44,6 +50,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "parse_tree.h"
 #include "print_help.h"
 #include "fish_version.h"
+#include "iothread.h"
 
 #define SPACES_PER_INDENT 4
 
@@ -278,6 +285,141 @@ static std::string no_colorize(const wcstring &text)
     return wcs2string(text);
 }
 
+/* A file named on the command line. The files are formatted in parallel on the iothreads; everything that needs the shell's global state, like colorizing, is done on the main thread afterwards. */
+struct indent_file_t
+{
+    /* The path of the file */
+    std::string path;
+
+    /* Whether to indent, and whether to write the result back to the file instead of to stdout */
+    bool do_indent;
+    bool write_back;
+
+    /* The formatted text */
+    wcstring output;
+
+    /* The name of the call that failed, and its errno, or NULL if everything worked */
+    const char *failed_call;
+    int failed_errno;
+};
+
+/* Read the entire contents of a file, as bytes */
+static bool read_file_bytes(int fd, std::string *out_contents)
+{
+    char buff[8192];
+    for (;;)
+    {
+        ssize_t amt = read(fd, buff, sizeof buff);
+        if (amt > 0)
+        {
+            out_contents->append(buff, amt);
+        }
+        else if (amt == 0)
+        {
+            return true;
+        }
+        else if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+/* Replace the contents of a file. The new contents go into a temporary file in the same directory, which is then renamed over the old one, so that the file is never left half written. */
+static const char *replace_file_contents(const std::string &given_path, const struct stat &orig, const std::string &contents)
+{
+    /* Replace the file a symlink points to, not the symlink */
+    char buff[PATH_MAX];
+    if (realpath(given_path.c_str(), buff) == NULL)
+    {
+        return "realpath";
+    }
+    const std::string path = buff;
+
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path.at(0));
+    if (fd < 0)
+    {
+        return "mkstemp";
+    }
+
+    /* The new file belongs to us. Give it the owner and group of the original, and then its mode, since changing the owner may clear the set-user-ID and set-group-ID bits. */
+    const char *failed_call = NULL;
+    struct stat tmp_stat = {};
+    if (fstat(fd, &tmp_stat) != 0)
+    {
+        failed_call = "fstat";
+    }
+    else if ((tmp_stat.st_uid != orig.st_uid || tmp_stat.st_gid != orig.st_gid) && fchown(fd, orig.st_uid, orig.st_gid) != 0)
+    {
+        failed_call = "fchown";
+    }
+    else if (fchmod(fd, orig.st_mode & 07777) != 0)
+    {
+        failed_call = "fchmod";
+    }
+    else if (write_loop(fd, contents.data(), contents.size()) < 0)
+    {
+        failed_call = "write";
+    }
+
+    int saved_errno = errno;
+    if (close(fd) != 0 && failed_call == NULL)
+    {
+        failed_call = "close";
+        saved_errno = errno;
+    }
+    if (failed_call == NULL && rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        failed_call = "rename";
+        saved_errno = errno;
+    }
+    if (failed_call != NULL)
+    {
+        unlink(tmp_path.c_str());
+    }
+    errno = saved_errno;
+    return failed_call;
+}
+
+/* Format one file. This runs on a background thread. */
+static int indent_file(indent_file_t *file)
+{
+    int fd = open(file->path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        file->failed_call = "open";
+        file->failed_errno = errno;
+        return 0;
+    }
+
+    struct stat orig = {};
+    std::string contents;
+    bool read_ok = fstat(fd, &orig) == 0 && read_file_bytes(fd, &contents);
+    int saved_errno = errno;
+    close(fd);
+    if (! read_ok)
+    {
+        file->failed_call = "read";
+        file->failed_errno = saved_errno;
+        return 0;
+    }
+
+    file->output = prettify(str2wcstring(contents), file->do_indent);
+    if (file->write_back)
+    {
+        /* Leave files that are already formatted alone, so that their modification time does not change */
+        const std::string new_contents = wcs2string(file->output);
+        if (new_contents != contents)
+        {
+            file->failed_call = replace_file_contents(file->path, orig, new_contents);
+            file->failed_errno = errno;
+        }
+        file->output.clear();
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     set_main_thread();
@@ -300,11 +442,15 @@ int main(int argc, char *argv[])
     /* Whether to indent (true) or just reformat to one job per line (false) */
     bool do_indent = true;
 
+    /* Whether to write the result back to the files given as arguments */
+    bool write_back = false;
+
     while (1)
     {
         const struct option long_options[] =
         {
             { "no-indent", no_argument, 0, 'i' },
+            { "write", no_argument, 0, 'w' },
             { "help", no_argument, 0, 'h' },
             { "version", no_argument, 0, 'v' },
             { "html", no_argument, 0, 1 },
@@ -313,7 +459,7 @@ int main(int argc, char *argv[])
         };
 
         int opt_index = 0;
-        int opt = getopt_long(argc, argv, "hvi", long_options, &opt_index);
+        int opt = getopt_long(argc, argv, "hviw", long_options, &opt_index);
         if (opt == -1)
             break;
 
@@ -346,6 +492,12 @@ int main(int argc, char *argv[])
                 break;
             }
 
+            case 'w':
+            {
+                write_back = true;
+                break;
+            }
+
             case 1:
             {
                 output_type = output_type_html;
@@ -365,32 +517,87 @@ int main(int argc, char *argv[])
         }
     }
 
-    const wcstring src = read_file(stdin);
-    const wcstring output_wtext = prettify(src, do_indent);
-
-    /* Maybe colorize */
-    std::vector<highlight_spec_t> colors;
-    if (output_type != output_type_plain_text)
+    if (write_back && output_type != output_type_plain_text)
     {
-        highlight_shell_no_io(output_wtext, colors, output_wtext.size(), NULL, env_vars_snapshot_t::current());
+        fwprintf(stderr, _(L"%ls: --write can not be combined with --ansi or --html\n"), program_name);
+        exit(1);
+    }
+    if (write_back && optind == argc)
+    {
+        fwprintf(stderr, _(L"%ls: --write requires file arguments\n"), program_name);
+        exit(1);
     }
 
-    std::string colored_output;
-    switch (output_type)
+    /* The texts to print. With no file arguments, that is standard input. */
+    std::vector<wcstring> output_wtexts;
+    int status = 0;
+    if (optind == argc)
     {
-        case output_type_plain_text:
-            colored_output = no_colorize(output_wtext);
-            break;
+        output_wtexts.push_back(prettify(read_file(stdin), do_indent));
+    }
+    else
+    {
+        /* The files are independent, so format them all at once, a thread per processor */
+        long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+        iothread_set_max_threads(thread_count > 0 ? (int)thread_count : 1);
 
-        case output_type_ansi:
-            colored_output = ansi_colorize(output_wtext, colors);
-            break;
+        std::vector<indent_file_t> files(argc - optind);
+        for (size_t i=0; i < files.size(); i++)
+        {
+            indent_file_t &file = files.at(i);
+            file.path = argv[optind + i];
+            file.do_indent = do_indent;
+            file.write_back = write_back;
+            file.failed_call = NULL;
+            file.failed_errno = 0;
+            iothread_perform(indent_file, &file);
+        }
+        iothread_drain_all();
 
-        case output_type_html:
-            colored_output = html_colorize(output_wtext, colors);
-            break;
+        for (size_t i=0; i < files.size(); i++)
+        {
+            indent_file_t &file = files.at(i);
+            if (file.failed_call != NULL)
+            {
+                fwprintf(stderr, L"%ls: %s: %s: %s\n", program_name, file.path.c_str(), file.failed_call, strerror(file.failed_errno));
+                status = 1;
+            }
+            else if (! write_back)
+            {
+                output_wtexts.push_back(wcstring());
+                output_wtexts.back().swap(file.output);
+            }
+        }
     }
 
-    fputs(colored_output.c_str(), stdout);
-    return 0;
+    for (size_t i=0; i < output_wtexts.size(); i++)
+    {
+        const wcstring &output_wtext = output_wtexts.at(i);
+
+        /* Maybe colorize */
+        std::vector<highlight_spec_t> colors;
+        if (output_type != output_type_plain_text)
+        {
+            highlight_shell_no_io(output_wtext, colors, output_wtext.size(), NULL, env_vars_snapshot_t::current());
+        }
+
+        std::string colored_output;
+        switch (output_type)
+        {
+            case output_type_plain_text:
+                colored_output = no_colorize(output_wtext);
+                break;
+
+            case output_type_ansi:
+                colored_output = ansi_colorize(output_wtext, colors);
+                break;
+
+            case output_type_html:
+                colored_output = html_colorize(output_wtext, colors);
+                break;
+        }
+
+        fputs(colored_output.c_str(), stdout);
+    }
+    return status;
 }
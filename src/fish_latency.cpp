@@ -0,0 +1,443 @@
+/** \file fish_latency.cpp
+  Measures keystroke to repaint latency of an interactive fish.
+
+  fish is started on a pseudo-terminal and fed scripted keystrokes. After each
+  measured keystroke, terminal output is read until there has been none for a
+  while; the latency of the keystroke is the time from writing it to the last
+  byte of output it caused. One tab separated line per scenario is printed to
+  stdout:
+
+      name  samples  p50_us  p99_us  max_us
+
+  The first line is a header naming these columns. fish runs with its own
+  configuration directory, holding a large history, and with a PATH of many
+  directories full of commands, so that history search, autosuggestions and
+  command completion have realistic amounts of work to do.
+
+  Usage: fish_latency [-f path/to/fish] [-n repetitions] [-q quiet_ms] [scenario...]
+*/
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/**
+   Number of items in the history fixture
+*/
+#define HISTORY_COUNT 50000
+
+/**
+   Number of directories in the PATH fixture, and of commands in each
+*/
+#define PATH_DIR_COUNT 100
+#define PATH_COMMAND_COUNT 50
+
+/**
+   How long fish may take to draw its first prompt, in milliseconds
+*/
+#define STARTUP_TIMEOUT_MS 10000
+
+/**
+   The pseudo-terminal master connected to fish
+*/
+static int s_master = -1;
+
+/**
+   The fish process
+*/
+static pid_t s_fish_pid = -1;
+
+/**
+   Milliseconds without output after which a keystroke's repaint is considered done
+*/
+static int s_quiet_ms = 100;
+
+/**
+   Names of the scenarios to run; all if empty
+*/
+static std::vector<std::string> s_scenarios;
+
+/* Keys, as sent by an xterm */
+#define KEY_CLEAR "\x03"
+#define KEY_TAB "\t"
+#define KEY_UP "\x1b[A"
+#define KEY_RIGHT "\x1b[C"
+
+static long long now_us()
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return 1000000ll*ts.tv_sec+ts.tv_nsec/1000;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ll*tv.tv_sec+tv.tv_usec;
+}
+
+static void die(const char *what)
+{
+    perror(what);
+    if (s_fish_pid > 0)
+        kill(s_fish_pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+/**
+   Read output from fish until there has been none for quiet_ms. Returns the time the last byte arrived, or start if nothing arrived.
+*/
+static long long drain_output(long long start, int quiet_ms)
+{
+    long long last = start;
+    for (;;)
+    {
+        struct pollfd pfd = { s_master, POLLIN, 0 };
+        int ret = poll(&pfd, 1, quiet_ms);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            die("poll");
+        if (ret == 0)
+            break;
+
+        char buf[4096];
+        ssize_t amt = read(s_master, buf, sizeof buf);
+        if (amt < 0 && errno == EINTR)
+            continue;
+        if (amt <= 0)
+        {
+            fprintf(stderr, "fish exited unexpectedly\n");
+            exit(EXIT_FAILURE);
+        }
+        last = now_us();
+    }
+    return last;
+}
+
+static void send_keys(const char *keys)
+{
+    size_t len = strlen(keys);
+    while (len > 0)
+    {
+        ssize_t amt = write(s_master, keys, len);
+        if (amt < 0 && errno == EINTR)
+            continue;
+        if (amt < 0)
+            die("write");
+        keys += amt;
+        len -= amt;
+    }
+}
+
+/**
+   Send keys without timing them, and wait for fish to finish reacting
+*/
+static void type_untimed(const char *keys)
+{
+    send_keys(keys);
+    drain_output(now_us(), s_quiet_ms);
+}
+
+/**
+   Send keys and return how long fish took to finish reacting, in microseconds. A key that fish did not react to at all, like accepting an autosuggestion that is not there, means the scenario is broken, so exit instead of recording it as instant.
+*/
+static long long type_timed(const char *keys)
+{
+    long long start = now_us();
+    send_keys(keys);
+    long long end = drain_output(start, s_quiet_ms);
+    if (end == start)
+    {
+        fprintf(stderr, "fish did not repaint after a measured key\n");
+        kill(s_fish_pid, SIGKILL);
+        exit(EXIT_FAILURE);
+    }
+    return end - start;
+}
+
+static void write_file(const std::string &path, const std::string &contents, mode_t mode)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0)
+        die(path.c_str());
+    if (write(fd, contents.data(), contents.size()) != (ssize_t)contents.size())
+        die(path.c_str());
+    close(fd);
+}
+
+static void make_dir(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0700) < 0 && errno != EEXIST)
+        die(path.c_str());
+}
+
+/**
+   Create the configuration, history and PATH fixtures in dir. Returns the PATH to run fish with.
+*/
+static std::string make_fixtures(const std::string &dir)
+{
+    make_dir(dir + "/config");
+    make_dir(dir + "/config/fish");
+    write_file(dir + "/config/fish/config.fish",
+               "set -g fish_greeting ''\n"
+               "function fish_prompt; echo -n '> '; end\n"
+               "function fish_title; end\n", 0600);
+
+    /* fish keeps its history in the configuration directory */
+    std::string history;
+    for (int i=0; i < HISTORY_COUNT; i++)
+    {
+        char item[128];
+        snprintf(item, sizeof item, "- cmd: echo history item %d --flag value\n  when: %d\n", i, 1400000000 + i);
+        history.append(item);
+    }
+    write_file(dir + "/config/fish/fish_history", history, 0600);
+
+    std::string path;
+    for (int i=0; i < PATH_DIR_COUNT; i++)
+    {
+        char bin[64];
+        snprintf(bin, sizeof bin, "/bin%d", i);
+        make_dir(dir + bin);
+        for (int j=0; j < PATH_COMMAND_COUNT; j++)
+        {
+            char cmd[64];
+            snprintf(cmd, sizeof cmd, "/fixture_cmd_%d_%d", i, j);
+            write_file(dir + bin + cmd, "#!/bin/sh\n", 0700);
+        }
+        path.append(dir + bin + ":");
+    }
+    const char *orig_path = getenv("PATH");
+    path.append(orig_path ? orig_path : "/usr/bin:/bin");
+    return path;
+}
+
+static void remove_fixtures(const std::string &dir)
+{
+    std::string cmd = "rm -rf '" + dir + "'";
+    if (system(cmd.c_str()) != 0)
+        fprintf(stderr, "Could not remove %s\n", dir.c_str());
+}
+
+/**
+   Start fish on a new pseudo-terminal and wait for its first prompt
+*/
+static void spawn_fish(const char *fish_path, const std::string &dir, const std::string &path)
+{
+    s_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (s_master < 0 || grantpt(s_master) < 0 || unlockpt(s_master) < 0)
+        die("posix_openpt");
+    const char *slave_name = ptsname(s_master);
+    if (slave_name == NULL)
+        die("ptsname");
+
+    struct winsize size = {};
+    size.ws_row = 40;
+    size.ws_col = 120;
+
+    s_fish_pid = fork();
+    if (s_fish_pid < 0)
+        die("fork");
+    if (s_fish_pid == 0)
+    {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0)
+            _exit(EXIT_FAILURE);
+#ifdef TIOCSCTTY
+        ioctl(slave, TIOCSCTTY, 0);
+#endif
+        ioctl(slave, TIOCSWINSZ, &size);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO)
+            close(slave);
+        close(s_master);
+
+        setenv("XDG_CONFIG_HOME", (dir + "/config").c_str(), 1);
+        setenv("PATH", path.c_str(), 1);
+        setenv("TERM", "xterm", 1);
+        execl(fish_path, fish_path, "-i", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    /* The first prompt has been drawn once fish has written something and gone quiet */
+    long long start = now_us();
+    if (drain_output(start, STARTUP_TIMEOUT_MS) == start)
+    {
+        fprintf(stderr, "fish did not draw a prompt\n");
+        kill(s_fish_pid, SIGKILL);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void stop_fish()
+{
+    type_untimed(KEY_CLEAR);
+    send_keys("exit\r");
+    close(s_master);
+    int status;
+    waitpid(s_fish_pid, &status, 0);
+}
+
+static bool should_run(const char *name)
+{
+    return s_scenarios.empty() || std::find(s_scenarios.begin(), s_scenarios.end(), name) != s_scenarios.end();
+}
+
+static void report(const char *name, std::vector<long long> samples)
+{
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    size_t count = samples.size();
+    printf("%s\t%lu\t%lld\t%lld\t%lld\n", name, (unsigned long)count,
+           samples.at(count * 50 / 100), samples.at(std::min(count - 1, count * 99 / 100)), samples.back());
+    fflush(stdout);
+}
+
+/* Typing a command one character at a time */
+static void scenario_typing(int reps, std::vector<long long> *samples)
+{
+    const char *line = "echo the quick brown fox";
+    for (int rep=0; rep < reps; rep++)
+    {
+        for (const char *c = line; *c; c++)
+        {
+            char key[2] = { *c, '\0' };
+            samples->push_back(type_timed(key));
+        }
+        type_untimed(KEY_CLEAR);
+    }
+}
+
+/* Completing a command name from the PATH */
+static void scenario_complete(int reps, std::vector<long long> *samples)
+{
+    for (int rep=0; rep < reps; rep++)
+    {
+        char prefix[64];
+        snprintf(prefix, sizeof prefix, "fixture_cmd_%d_", rep % PATH_DIR_COUNT);
+        type_untimed(prefix);
+        samples->push_back(type_timed(KEY_TAB));
+        type_untimed(KEY_CLEAR);
+    }
+}
+
+/* Searching backwards through the history for a substring */
+static void scenario_history_search(int reps, std::vector<long long> *samples)
+{
+    for (int rep=0; rep < reps; rep++)
+    {
+        char term[64];
+        snprintf(term, sizeof term, "item %d", rep % 100);
+        type_untimed(term);
+        for (int i=0; i < 5; i++)
+        {
+            samples->push_back(type_timed(KEY_UP));
+        }
+        type_untimed(KEY_CLEAR);
+    }
+}
+
+/* Accepting an autosuggestion from the history */
+static void scenario_autosuggest(int reps, std::vector<long long> *samples)
+{
+    for (int rep=0; rep < reps; rep++)
+    {
+        char prefix[64];
+        snprintf(prefix, sizeof prefix, "echo history item %d", HISTORY_COUNT - 1 - rep);
+        type_untimed(prefix);
+        samples->push_back(type_timed(KEY_RIGHT));
+        type_untimed(KEY_CLEAR);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *fish_path = "./fish";
+    int reps = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:q:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                fish_path = optarg;
+                break;
+            case 'n':
+                reps = atoi(optarg);
+                break;
+            case 'q':
+                s_quiet_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-f path/to/fish] [-n repetitions] [-q quiet_ms] [scenario...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    for (int i=optind; i < argc; i++)
+    {
+        s_scenarios.push_back(argv[i]);
+    }
+    if (reps <= 0 || s_quiet_ms <= 0)
+    {
+        fprintf(stderr, "%s: repetitions and quiet time must be positive\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char dir_template[] = "/tmp/fish_latency.XXXXXX";
+    if (mkdtemp(dir_template) == NULL)
+        die("mkdtemp");
+    const std::string dir = dir_template;
+    const std::string path = make_fixtures(dir);
+
+    spawn_fish(fish_path, dir, path);
+
+    printf("name\tsamples\tp50_us\tp99_us\tmax_us\n");
+
+    struct
+    {
+        const char *name;
+        void (*run)(int, std::vector<long long> *);
+    } scenarios[] =
+    {
+        { "typing", scenario_typing },
+        { "complete", scenario_complete },
+        { "history_search", scenario_history_search },
+        { "autosuggest_accept", scenario_autosuggest }
+    };
+    for (size_t i=0; i < sizeof scenarios / sizeof *scenarios; i++)
+    {
+        if (! should_run(scenarios[i].name))
+            continue;
+        std::vector<long long> samples;
+        scenarios[i].run(reps, &samples);
+        report(scenarios[i].name, samples);
+    }
+
+    stop_fish();
+    remove_fixtures(dir);
+    return 0;
+}
@@ -23,6 +23,7 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <functional>
 #include <iterator>
 
 #ifdef HAVE_GETOPT_H
@@ -67,6 +68,8 @@
 #include "utf8.h"
 #include "env_universal_common.h"
 #include "wcstringutil.h"
+#include "intern.h"
+#include "kill.h"
 
 static const char * const * s_arguments;
 static int s_test_run_count = 0;
@@ -264,6 +267,105 @@ static void test_escape_crazy()
     }
 }
 
+/* Escaping copies runs of ordinary characters in one go; check the characters around the runs are still handled */
+static void test_escape_runs()
+{
+    say(L"Testing escaping of ordinary text");
+    const struct test_t
+    {
+        const wchar_t *input;
+        escape_flags_t flags;
+        const wchar_t *expected;
+    } tests[] =
+    {
+        {L"plain", ESCAPE_ALL, L"plain"},
+        {L"two words", ESCAPE_ALL, L"'two words'"},
+        {L"two words", ESCAPE_ALL | ESCAPE_NO_QUOTED, L"two\\ words"},
+        {L"tab\there", ESCAPE_ALL, L"tab\\there"},
+        {L"end\n", ESCAPE_ALL, L"end\\n"},
+        {L"~/file", ESCAPE_ALL, L"'~/file'"},
+        {L"~/file", ESCAPE_ALL | ESCAPE_NO_TILDE, L"~/file"},
+        {L"café 中文", ESCAPE_ALL, L"'café 中文'"},
+        {L"it's", ESCAPE_ALL, L"it\\'s"},
+        {L"", 0, L"''"},
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++)
+    {
+        const wcstring escaped = escape_string(tests[i].input, tests[i].flags);
+        if (escaped != tests[i].expected)
+        {
+            err(L"In escaping '%ls', expected '%ls' but got '%ls'\n", tests[i].input, tests[i].expected, escaped.c_str());
+        }
+    }
+
+    wcstring output;
+    if (! unescape_string(L"abc'def ghi'jkl\"mno\\\\\"pqr", &output, UNESCAPE_DEFAULT) || output != L"abcdef ghijklmno\\pqr")
+    {
+        err(L"Unescaping mixed quotes gave '%ls'\n", output.c_str());
+    }
+}
+
+/* The strings interned by each thread of the intern test, and the pointers they got back */
+struct intern_test_batch_t
+{
+    wcstring_list_t strings;
+    std::vector<const wchar_t *> results;
+};
+
+static int test_intern_thread_call(intern_test_batch_t *batch)
+{
+    for (size_t i=0; i < batch->strings.size(); i++)
+    {
+        batch->results.push_back(intern(batch->strings.at(i).c_str()));
+    }
+    return 0;
+}
+
+static void test_intern()
+{
+    say(L"Testing string interning");
+
+    /* Enough strings to grow the table several times, interned from several threads at once */
+    const size_t string_count = 20000, thread_count = 4;
+    wcstring_list_t strings;
+    for (size_t i=0; i < string_count; i++)
+    {
+        strings.push_back(format_string(L"fish_test_intern_%lu", (unsigned long)i));
+    }
+
+    intern_test_batch_t batches[thread_count];
+    for (size_t t=0; t < thread_count; t++)
+    {
+        batches[t].strings = strings;
+        if (t % 2)
+            std::reverse(batches[t].strings.begin(), batches[t].strings.end());
+        iothread_perform(test_intern_thread_call, &batches[t]);
+    }
+    iothread_drain_all();
+
+    for (size_t i=0; i < string_count; i++)
+    {
+        const wchar_t *interned = intern(strings.at(i).c_str());
+        if (interned == strings.at(i).c_str() || strings.at(i) != interned)
+        {
+            err(L"intern returned a wrong string for '%ls'", strings.at(i).c_str());
+        }
+        for (size_t t=0; t < thread_count; t++)
+        {
+            size_t idx = (t % 2) ? string_count - 1 - i : i;
+            if (batches[t].results.at(idx) != interned)
+            {
+                err(L"intern returned different copies of '%ls'", strings.at(i).c_str());
+            }
+        }
+    }
+
+    if (intern_get_stats().count < string_count)
+    {
+        err(L"Intern statistics count %lu strings, expected at least %lu", (unsigned long)intern_get_stats().count, (unsigned long)string_count);
+    }
+}
+
 static void test_format(void)
 {
     say(L"Testing formatting functions");
@@ -307,6 +409,64 @@ static void test_format(void)
     format_long_safe(buff1, q);
     sprintf(buff2, "%ld", q);
     do_test(! strcmp(buff1, buff2));
+
+    /* Formats with only strings and integers are formatted without vswprintf; they must give the same result */
+    const wchar_t *null_str = NULL;
+    do_test(format_string(L"plain") == L"plain");
+    do_test(format_string(L"") == L"");
+    do_test(format_string(L"%ls: %d%%", L"name", -42) == L"name: -42%");
+    do_test(format_string(L"%ls|%lc|%i", null_str, (wint_t)L'\u00e9', 0) == L"(null)|\u00e9|0");
+    do_test(format_string(L"%u %lu %llu", UINT_MAX, ULONG_MAX, ULLONG_MAX) == L"4294967295 " + to_string<unsigned long>(ULONG_MAX) + L" 18446744073709551615");
+    do_test(format_string(L"%d %ld %lld", INT_MIN, LONG_MIN, LLONG_MIN) == L"-2147483648 " + to_string<long>(LONG_MIN) + L" -9223372036854775808");
+    do_test(format_string(L"%5d|%-3ls|%x", 42, L"a", 255) == L"   42|a  |ff");
+    wcstring appended = L"start ";
+    append_format(appended, L"%ls %lu", L"then", 7UL);
+    do_test(appended == L"start then 7");
+}
+
+/** Test the character width table */
+static void test_wcwidth()
+{
+    say(L"Testing character widths");
+
+    const struct
+    {
+        wchar_t wc;
+        int width;
+    } tests[] =
+    {
+        {L'\0', 0}, {L'\t', -1}, {0x7F, -1}, {0x9F, -1}, {L'a', 1}, {0xA0, 1}, {0xAD, 1},
+        {0x300, 0}, {0x36F, 0}, {0x370, 1}, {0x1100, 2}, {0x115F, 2}, {0x1160, 0}, {0x11FF, 0},
+        {0x200B, 0}, {0x2329, 2}, {0x2E80, 2}, {0x302A, 0}, {0x303F, 1}, {0x4E00, 2},
+        {0xAC00, 2}, {0xD7A3, 2}, {0xD7A4, 1}, {0xFEFF, 0}, {0xFF01, 2}, {0xFFE6, 2},
+        {0x10A01, 0}, {0x1F600, 1}, {0x20000, 2}, {0x2FFFD, 2}, {0x2FFFE, 1}, {0x3FFFD, 2},
+        {0xE0001, 0}, {0xE01EF, 0}, {0x10FFFF, 1}, {0x110000, 1}
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++)
+    {
+        int width = fish_wcwidth(tests[i].wc);
+        if (width != tests[i].width)
+        {
+            err(L"Width of U+%04lX is %d, expected %d", (unsigned long)tests[i].wc, width, tests[i].width);
+        }
+    }
+
+    do_test(fish_wcswidth(L"a\u4E00\u0301b", 4) == 4);
+    do_test(fish_wcswidth(L"ab\u4E00", 2) == 2);
+    do_test(fish_wcswidth(L"a\tb", 3) == -1);
+}
+
+/** Test the escape sequence that copies kills to the terminal's clipboard */
+static void test_osc52()
+{
+    say(L"Testing OSC 52 clipboard sequences");
+
+    do_test(kill_osc52_sequence(L"") == "\x1b]52;c;\x07");
+    do_test(kill_osc52_sequence(L"f") == "\x1b]52;c;Zg==\x07");
+    do_test(kill_osc52_sequence(L"fo") == "\x1b]52;c;Zm8=\x07");
+    do_test(kill_osc52_sequence(L"foo") == "\x1b]52;c;Zm9v\x07");
+    do_test(kill_osc52_sequence(L"foobar") == "\x1b]52;c;Zm9vYmFy\x07");
+    do_test(kill_osc52_sequence(L"a\nb") == "\x1b]52;c;YQpi\x07");
 }
 
 /**
@@ -497,6 +657,25 @@ static void test_tok()
         do_test(token.error == TOK_UNTERMINATED_SLICE);
         do_test(token.error_offset == 4);
     }
+    
+    /* Test leaving the text in the source */
+    {
+        const wcstring src = L"echo 'a b' 2>&1 # comment";
+        tok_t token;
+        tokenizer_t t(src.c_str(), TOK_SHOW_COMMENTS);
+        do_test(t.next(&token));
+        do_test(token.type == TOK_STRING && token.text.empty() && src.substr(token.offset, token.length) == L"echo");
+        do_test(t.next(&token));
+        do_test(token.type == TOK_STRING && token.text.empty() && src.substr(token.offset, token.length) == L"'a b'");
+        do_test(t.next(&token));
+        do_test(token.type == TOK_REDIRECT_FD && token.text == L"2");
+        do_test(t.next(&token));
+        do_test(token.type == TOK_STRING && token.text.empty() && src.substr(token.offset, token.length) == L"1");
+        do_test(t.next(&token));
+        do_test(token.type == TOK_COMMENT && token.text.empty() && src.substr(token.offset, token.length) == L"# comment");
+        do_test(t.text_of(token) == L"# comment");
+        do_test(! t.next(&token));
+    }
 
     /* Test redirection_type_for_string */
     if (redirection_type_for_string(L"<") != TOK_REDIRECT_IN) err(L"redirection_type_for_string failed on line %ld", (long)__LINE__);
@@ -561,6 +740,121 @@ static void test_iothread(void)
     delete int_ptr;
 }
 
+/* State shared by the iothread priority test's requests */
+static volatile bool s_iothread_priority_blocked;
+static wcstring s_iothread_priority_order;
+static pthread_mutex_t s_iothread_priority_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int test_iothread_priority_blocker(void *unused)
+{
+    while (s_iothread_priority_blocked)
+    {
+        usleep(1000);
+    }
+    return 0;
+}
+
+static int test_iothread_priority_record(wchar_t *name)
+{
+    scoped_lock locker(s_iothread_priority_lock);
+    s_iothread_priority_order.push_back(*name);
+    return 0;
+}
+
+static void test_iothread_priority(void)
+{
+    say(L"Testing iothread priorities");
+
+    /* With one worker, held up by the blocker, the remaining requests are queued and then started by priority */
+    iothread_drain_all();
+    iothread_set_max_threads(1);
+    iothread_drain_all();
+
+    wchar_t names[] = L"bnixBNIX";
+    s_iothread_priority_order.clear();
+    s_iothread_priority_blocked = true;
+    iothread_perform(test_iothread_priority_blocker, (void *)NULL);
+    if (iothread_perform_if_free(test_iothread_priority_record, &names[3], iothread_priority_interactive))
+    {
+        err(L"iothread_perform_if_free queued a request with no worker free");
+    }
+    iothread_perform(test_iothread_priority_record, &names[0], iothread_priority_background);
+    iothread_perform(test_iothread_priority_record, &names[1], iothread_priority_normal);
+    iothread_perform(test_iothread_priority_record, &names[2], iothread_priority_interactive);
+    iothread_perform(test_iothread_priority_record, &names[4], iothread_priority_background);
+    iothread_perform(test_iothread_priority_record, &names[5], iothread_priority_normal);
+    iothread_perform(test_iothread_priority_record, &names[6], iothread_priority_interactive);
+    s_iothread_priority_blocked = false;
+    iothread_drain_all();
+
+    if (s_iothread_priority_order != L"iInNbB")
+    {
+        err(L"iothread requests ran in order '%ls', expected 'iInNbB'", s_iothread_priority_order.c_str());
+    }
+
+    /* Once the worker is idle again, a request is queued */
+    if (! iothread_perform_if_free(test_iothread_priority_record, &names[7], iothread_priority_interactive))
+    {
+        err(L"iothread_perform_if_free did not queue a request with a worker idle");
+    }
+    iothread_drain_all();
+    if (s_iothread_priority_order != L"iInNbBX")
+    {
+        err(L"iothread requests ran in order '%ls', expected 'iInNbBX'", s_iothread_priority_order.c_str());
+    }
+
+    iothread_set_max_threads(0);
+}
+
+static int test_thread_job_staleness_call(int *is_stale)
+{
+    *is_stale = reader_thread_job_is_stale();
+    return 0;
+}
+
+static void test_thread_job_staleness(void)
+{
+    say(L"Testing background job staleness");
+
+    /* Only threads running a reader job with a cancellation token can become stale */
+    if (reader_thread_job_is_stale())
+        err(L"Main thread reports a stale job");
+
+    int is_stale = -1;
+    iothread_perform(test_thread_job_staleness_call, &is_stale);
+    iothread_drain_all();
+    if (is_stale != 0)
+        err(L"Background thread without a job token reports a stale job");
+}
+
+static void test_job_ids(void)
+{
+    say(L"Testing job IDs");
+
+    job_id_t first = acquire_job_id(), second = acquire_job_id(), third = acquire_job_id();
+    if (second != first + 1 || third != second + 1)
+        err(L"Job IDs %d, %d, %d are not consecutive", first, second, third);
+
+    /* Released IDs are reused lowest first */
+    release_job_id(second);
+    release_job_id(first);
+    job_id_t reused = acquire_job_id();
+    if (reused != first)
+        err(L"Expected job ID %d to be reused, got %d", first, reused);
+    reused = acquire_job_id();
+    if (reused != second)
+        err(L"Expected job ID %d to be reused, got %d", second, reused);
+
+    /* Releasing the last ID must not leave it behind as a free ID below the end */
+    release_job_id(third);
+    release_job_id(second);
+    job_id_t next = acquire_job_id();
+    if (next != second)
+        err(L"Expected job ID %d after releasing trailing IDs, got %d", second, next);
+    release_job_id(next);
+    release_job_id(first);
+}
+
 static parser_test_error_bits_t detect_argument_errors(const wcstring &src)
 {
     parse_node_tree_t tree;
@@ -773,6 +1067,138 @@ static void test_parser()
 
 }
 
+static void test_function_parse_cache()
+{
+    say(L"Testing cached function parse trees");
+    parser_t &parser = parser_t::principal_parser();
+
+    parser.eval(L"function fish_test_cached; set -g fish_test_cached_result a$argv; end", io_chain_t(), TOP);
+    shared_ptr<const parse_node_tree_t> first, second;
+    do_test(function_get_parsed_definition(L"fish_test_cached", NULL, &first));
+    do_test(first.get() != NULL);
+    do_test(function_get_parsed_definition(L"fish_test_cached", NULL, &second));
+    do_test(first.get() == second.get());
+
+    /* Calling it repeatedly runs the same tree */
+    parser.eval(L"fish_test_cached 1", io_chain_t(), TOP);
+    do_test(env_get_string(L"fish_test_cached_result") == L"a1");
+    parser.eval(L"fish_test_cached 2", io_chain_t(), TOP);
+    do_test(env_get_string(L"fish_test_cached_result") == L"a2");
+
+    /* Redefining it discards the tree */
+    parser.eval(L"function fish_test_cached; set -g fish_test_cached_result b$argv; end", io_chain_t(), TOP);
+    do_test(function_get_parsed_definition(L"fish_test_cached", NULL, &second));
+    do_test(second.get() != NULL && second.get() != first.get());
+    parser.eval(L"fish_test_cached 3", io_chain_t(), TOP);
+    do_test(env_get_string(L"fish_test_cached_result") == L"b3");
+
+    /* A copy behaves like the original */
+    parser.eval(L"functions --copy fish_test_cached fish_test_cached_copy; fish_test_cached_copy 4", io_chain_t(), TOP);
+    do_test(env_get_string(L"fish_test_cached_result") == L"b4");
+
+    function_remove(L"fish_test_cached");
+    function_remove(L"fish_test_cached_copy");
+    env_remove(L"fish_test_cached_result", ENV_GLOBAL);
+    do_test(! function_get_parsed_definition(L"fish_test_cached", NULL, NULL));
+}
+
+static void test_cmdsub_output()
+{
+    say(L"Testing command substitution output");
+
+    /* Lines split across several chunks of output */
+    const shared_ptr<io_buffer_t> buffer(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
+    do_test(buffer.get() != NULL);
+    buffer->split_lines_as_they_arrive();
+    buffer->out_buffer_append("ab", 2);
+    buffer->out_buffer_append("c\n\nd", 4);
+    buffer->out_buffer_append("ef\ngh", 5);
+    wcstring_list_t lines;
+    buffer->take_lines(&lines);
+    do_test(lines.size() == 4);
+    do_test(lines.size() == 4 && lines.at(0) == L"abc" && lines.at(1) == L"" && lines.at(2) == L"def" && lines.at(3) == L"gh");
+
+    /* Characters split across chunks, and invalid bytes, decode as they would in one piece */
+    const shared_ptr<io_buffer_t> buffer2(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
+    do_test(buffer2.get() != NULL);
+    buffer2->split_lines_as_they_arrive();
+    const char *text = "caf\xc3\xa9\n\xff\xc3\nx\n";
+    buffer2->out_buffer_append(text, 4);
+    buffer2->out_buffer_append(text + 4, strlen(text) - 4);
+    lines.clear();
+    buffer2->take_lines(&lines);
+    do_test(lines.size() == 3);
+    do_test(lines.size() == 3 && lines.at(0) == str2wcstring("caf\xc3\xa9") && lines.at(1) == str2wcstring("\xff\xc3") && lines.at(2) == L"x");
+
+    /* Output is only split with a nonempty IFS */
+    env_set(L"IFS", L"\n", ENV_GLOBAL);
+    lines.clear();
+    do_test(exec_subshell(L"printf '%s\\n' one two three", lines, true) == 0);
+    do_test(lines.size() == 3 && lines.at(2) == L"three");
+
+    /* Output longer than fish_read_limit is discarded */
+    env_set(L"fish_read_limit", L"8", ENV_GLOBAL);
+    lines.clear();
+    do_test(exec_subshell(L"echo short", lines, true) == 0);
+    do_test(lines.size() == 1 && lines.at(0) == L"short");
+    lines.clear();
+    do_test(exec_subshell(L"echo this is far too long", lines, true) == -1);
+    do_test(lines.empty());
+    do_test(proc_get_last_status() == STATUS_READ_TOO_MUCH);
+    env_remove(L"fish_read_limit", ENV_GLOBAL);
+
+    lines.clear();
+    do_test(exec_subshell(L"echo this is far too long", lines, true) == 0);
+    do_test(lines.size() == 1);
+    env_remove(L"IFS", ENV_GLOBAL);
+}
+
+/* Compare the word-at-a-time ASCII paths of the string conversions to converting one character at a time */
+static void test_ascii_fast_paths()
+{
+    say(L"Testing ASCII fast paths of string conversion");
+    const std::string non_ascii = "\xc3\xa9";
+    for (size_t len = 0; len < 40; len++)
+    {
+        for (size_t pos = 0; pos <= len; pos++)
+        {
+            /* pos ASCII characters, then a non-ASCII character, then some more ASCII */
+            std::string prefix, suffix;
+            for (size_t i = 0; i < pos; i++)
+                prefix.push_back('a' + i % 26);
+            for (size_t i = pos; i < len; i++)
+                suffix.push_back('A' + i % 26);
+            const std::string str = prefix + non_ascii + suffix;
+
+            if (utf8_ascii_prefix_length(str.data(), str.size()) != pos ||
+                utf8_ascii_prefix_length(prefix.data(), prefix.size()) != prefix.size())
+            {
+                err(L"Wrong ASCII prefix length for string of %lu characters with non-ASCII at %lu", (unsigned long)len, (unsigned long)pos);
+            }
+
+            /* str2wcstring, against converting the non-ASCII character by itself */
+            const wcstring wide = str2wcstring(str);
+            wcstring expected;
+            for (size_t i = 0; i < prefix.size(); i++)
+                expected.push_back((wchar_t)prefix.at(i));
+            expected.append(str2wcstring(non_ascii));
+            for (size_t i = 0; i < suffix.size(); i++)
+                expected.push_back((wchar_t)suffix.at(i));
+            if (wide != expected)
+                err(L"str2wcstring ASCII fast path differs for string of %lu characters with non-ASCII at %lu", (unsigned long)len, (unsigned long)pos);
+            if (wcs2string(wide) != str)
+                err(L"wcs2string ASCII fast path differs for string of %lu characters with non-ASCII at %lu", (unsigned long)len, (unsigned long)pos);
+
+            /* utf8_to_wchar, starting at an odd address */
+            const std::string shifted = "x" + str;
+            wchar_t converted[64] = {};
+            size_t count = utf8_to_wchar(shifted.data() + 1, str.size(), converted, 64, 0);
+            if (count != len + 1 || converted[pos] != 0xE9 || wcstring(converted, pos) != wcstring(expected, 0, pos) || wcstring(converted + pos + 1, len - pos) != wcstring(expected, expected.size() - suffix.size()))
+                err(L"utf8_to_wchar ASCII fast path differs for string of %lu characters with non-ASCII at %lu", (unsigned long)len, (unsigned long)pos);
+        }
+    }
+}
+
 /* Wait a while and then SIGINT the main thread */
 struct test_cancellation_info_t
 {
@@ -787,6 +1213,60 @@ static int signal_main(test_cancellation_info_t *info)
     return 0;
 }
 
+/**
+   Test that copies of io chains are independent, though they share storage
+*/
+static void test_io_chain()
+{
+    say(L"Testing io chains");
+    const shared_ptr<io_data_t> out(new io_fd_t(STDOUT_FILENO, STDERR_FILENO, true));
+    const shared_ptr<io_data_t> err_close(new io_close_t(STDERR_FILENO));
+    const shared_ptr<io_data_t> out_close(new io_close_t(STDOUT_FILENO));
+
+    io_chain_t empty;
+    if (! empty.empty() || empty.begin() != empty.end() || empty.has_io_for_fd(STDOUT_FILENO))
+    {
+        err(L"Empty io chain is not empty");
+    }
+
+    io_chain_t chain(out);
+    io_chain_t copy = chain;
+    copy.push_back(err_close);
+    copy.push_back(out_close);
+    if (chain.size() != 1 || copy.size() != 3)
+    {
+        err(L"Modifying a copy of an io chain changed the original: sizes %lu and %lu", (unsigned long)chain.size(), (unsigned long)copy.size());
+    }
+    if (chain.get_io_for_fd(STDOUT_FILENO) != out || copy.get_io_for_fd(STDOUT_FILENO) != out_close)
+    {
+        err(L"Wrong redirection found for stdout");
+    }
+    if (chain.has_io_for_fd(STDERR_FILENO) || ! copy.has_io_for_fd(STDERR_FILENO))
+    {
+        err(L"Wrong redirection found for stderr");
+    }
+
+    io_chain_t appended;
+    appended.append(chain);
+    appended.append(copy);
+    chain.remove(out);
+    if (! chain.empty() || appended.size() != 4 || appended.at(0) != out || appended.at(3) != out_close)
+    {
+        err(L"Appending io chains produced the wrong redirections");
+    }
+
+    copy.swap(empty);
+    if (! copy.empty() || empty.size() != 3)
+    {
+        err(L"Swapping io chains failed");
+    }
+    empty.clear();
+    if (! empty.empty() || appended.size() != 4)
+    {
+        err(L"Clearing an io chain changed a copy of it");
+    }
+}
+
 static void test_1_cancellation(const wchar_t *src)
 {
     shared_ptr<io_buffer_t> out_buff(io_buffer_t::create(STDOUT_FILENO, io_chain_t()));
@@ -841,6 +1321,38 @@ static void test_cancellation()
     reader_reset_interrupted();
 }
 
+/**
+   Test that blocking signals defers their handlers until the last block is removed, without masking them
+*/
+static void test_signal_block()
+{
+    say(L"Testing signal blocking");
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function __fish_test_usr1 --on-signal USR1; set -g __fish_test_usr1_seen yes; end", io_chain_t(), TOP);
+    env_remove(L"__fish_test_usr1_seen", ENV_GLOBAL);
+
+    signal_block();
+    signal_block();
+    sigset_t mask;
+    pthread_sigmask(SIG_BLOCK, NULL, &mask);
+    do_test(! sigismember(&mask, SIGUSR1));
+
+    raise(SIGUSR1);
+    event_fire(NULL);
+    do_test(env_get_string(L"__fish_test_usr1_seen").missing());
+
+    signal_unblock();
+    event_fire(NULL);
+    do_test(env_get_string(L"__fish_test_usr1_seen").missing());
+
+    signal_unblock();
+    event_fire(NULL);
+    do_test(env_get_string(L"__fish_test_usr1_seen") == L"yes");
+
+    parser.eval(L"functions -e __fish_test_usr1", io_chain_t(), TOP);
+    env_remove(L"__fish_test_usr1_seen", ENV_GLOBAL);
+}
+
 static void test_indents()
 {
     say(L"Testing indents");
@@ -1020,6 +1532,22 @@ static void test_utils()
 
     parse_util_cmdsubst_extent(a, 17, &begin, &end);
     if (begin != a + wcslen(L"echo (echo (")) err(L"parse_util_cmdsubst_extent failed on line %ld", (long)__LINE__);
+
+    /* Extents are remembered per buffer contents. Make sure a copy of the buffer gets pointers into the copy, and an edit is noticed. */
+    const wcstring copy = a;
+    parse_util_cmdsubst_extent(copy.c_str(), 17, &begin, &end);
+    if (begin != copy.c_str() + wcslen(L"echo (echo (")) err(L"parse_util_cmdsubst_extent failed on line %ld", (long)__LINE__);
+    const wchar_t *edited = L"echo (echo )echo hi";
+    parse_util_cmdsubst_extent(edited, 17, &begin, &end);
+    if (begin != edited || end != edited + wcslen(edited)) err(L"parse_util_cmdsubst_extent failed on line %ld", (long)__LINE__);
+
+    const wchar_t *tok_begin = NULL, *tok_end = NULL;
+    const wchar_t *b = L"echo foo bar";
+    parse_util_token_extent(b, 6, &tok_begin, &tok_end, NULL, NULL);
+    if (tok_begin != b + 5 || tok_end != b + 8) err(L"parse_util_token_extent failed on line %ld", (long)__LINE__);
+    b = L"echo f'o bar";
+    parse_util_token_extent(b, 6, &tok_begin, &tok_end, NULL, NULL);
+    if (tok_begin != b + 5 || tok_end != b + wcslen(b)) err(L"parse_util_token_extent failed on line %ld", (long)__LINE__);
 }
 
 /* UTF8 tests taken from Alexey Vatchenko's utf8 library. See http://www.bsdua.org/libbsdua.html */
@@ -1314,7 +1842,7 @@ public:
 class test_lru_t : public lru_cache_t<lru_node_test_t>
 {
 public:
-    test_lru_t() : lru_cache_t<lru_node_test_t>(16) { }
+    test_lru_t(bool segmented = false) : lru_cache_t<lru_node_test_t>(16, segmented) { }
 
     std::vector<lru_node_test_t *> evicted_nodes;
 
@@ -1342,14 +1870,77 @@ static void test_lru(void)
         do_test(! cache.add_node(node));
     }
     do_test(cache.evicted_nodes == expected_evicted);
+    do_test(cache.evictions() == 4);
     cache.evict_all_nodes();
     do_test(cache.evicted_nodes.size() == total_nodes);
+    do_test(cache.evictions() == 4);
     while (! cache.evicted_nodes.empty())
     {
         lru_node_t *node = cache.evicted_nodes.back();
         cache.evicted_nodes.pop_back();
         delete node;
     }
+
+    /* A segmented cache keeps nodes that were used again, even as more new nodes come in than it can hold */
+    test_lru_t segmented(true);
+    for (size_t i=0; i < 4; i++)
+    {
+        segmented.add_node(new lru_node_test_t(L"used" + to_string(i)));
+        do_test(segmented.get_node(L"used" + to_string(i)) != NULL);
+    }
+    for (size_t i=0; i < 100; i++)
+    {
+        segmented.add_node(new lru_node_test_t(to_string(i)));
+    }
+    do_test(segmented.size() == 16);
+    do_test(segmented.evictions() == 88);
+    for (size_t i=0; i < 4; i++)
+    {
+        do_test(segmented.get_node(L"used" + to_string(i)) != NULL);
+    }
+
+    /* Iteration goes from the least recently used new node to the most recently used protected node */
+    wcstring_list_t order;
+    for (test_lru_t::iterator iter = segmented.begin(); iter != segmented.end(); ++iter)
+    {
+        order.push_back((*iter)->key);
+    }
+    do_test(order.size() == 16 && order.front() == L"88" && order.at(11) == L"99" && order.back() == L"used3");
+
+    /* Shrinking the cache evicts the new nodes first */
+    segmented.set_capacity(4);
+    do_test(segmented.size() == 4 && segmented.capacity() == 4);
+    do_test(segmented.get_node(L"used0") != NULL && segmented.get_node(L"99") == NULL);
+    segmented.evict_all_nodes();
+    do_test(segmented.size() == 0);
+    for (size_t i=0; i < segmented.evicted_nodes.size(); i++)
+    {
+        delete segmented.evicted_nodes.at(i);
+    }
+
+    /* Nodes can still be found and evicted by key after the index grows */
+    test_lru_t large;
+    large.set_capacity(1000);
+    for (size_t i=0; i < 500; i++)
+    {
+        do_test(large.add_node(new lru_node_test_t(L"node" + to_string(i))));
+    }
+    do_test(large.size() == 500 && large.evictions() == 0);
+    for (size_t i=0; i < 500; i++)
+    {
+        lru_node_test_t *node = large.get_node(L"node" + to_string(i));
+        do_test(node != NULL && node->key == L"node" + to_string(i));
+    }
+    do_test(large.get_node(L"node500") == NULL);
+    do_test(large.evict_node(L"node250") && ! large.evict_node(L"node250"));
+    do_test(large.get_node(L"node250") == NULL && large.get_node(L"node251") != NULL);
+    do_test(large.add_node(new lru_node_test_t(L"node250")));
+    large.evict_all_nodes();
+    do_test(large.size() == 0 && large.evicted_nodes.size() == 501);
+    for (size_t i=0; i < large.evicted_nodes.size(); i++)
+    {
+        delete large.evicted_nodes.at(i);
+    }
 }
 
 /**
@@ -1514,6 +2105,16 @@ static void test_expand()
                 L"/tmp/fish_expand_test/b", L"/tmp/fish_expand_test/b/x", L"/tmp/fish_expand_test/bar", L"/tmp/fish_expand_test/bax", L"/tmp/fish_expand_test/bax/xxx", L"/tmp/fish_expand_test/baz", L"/tmp/fish_expand_test/baz/xxx", L"/tmp/fish_expand_test/baz/yyy", wnull,
                 L"Glob did the wrong thing 4");
     
+    /* A directory we may search but not read is still descended into by path */
+    if (system("mkdir -p /tmp/fish_expand_test/xonly/inner && touch /tmp/fish_expand_test/xonly/inner/file && chmod 111 /tmp/fish_expand_test/xonly")) err(L"mkdir failed");
+    expand_test(L"/tmp/fish_expand_test/x*/inner/*", 0,
+                L"/tmp/fish_expand_test/xonly/inner/file", wnull,
+                L"Glob did the wrong thing in an unreadable directory");
+    expand_test(L"/tmp/fish_expand_test/*/../b/x", 0,
+                L"/tmp/fish_expand_test/b/../b/x", L"/tmp/fish_expand_test/bax/../b/x", L"/tmp/fish_expand_test/baz/../b/x", L"/tmp/fish_expand_test/xonly/../b/x", wnull,
+                L"Glob did the wrong thing with a parent directory");
+    if (system("chmod 755 /tmp/fish_expand_test/xonly && rm -Rf /tmp/fish_expand_test/xonly")) err(L"rm failed");
+
     expand_test(L"/tmp/fish_expand_test/BA", EXPAND_FOR_COMPLETIONS,
                 L"/tmp/fish_expand_test/bar", L"/tmp/fish_expand_test/bax/",  L"/tmp/fish_expand_test/baz/", wnull,
                 L"Case insensitive test did the wrong thing");
@@ -1522,6 +2123,14 @@ static void test_expand()
                 L"/tmp/fish_expand_test/bar", L"/tmp/fish_expand_test/bax/",  L"/tmp/fish_expand_test/baz/", wnull,
                 L"Case insensitive test did the wrong thing");
 
+    expand_test(L"/tmp/fish_expand_test/ba", EXPAND_FOR_COMPLETIONS | EXPAND_NO_DESCRIPTIONS,
+                L"r", L"x/", L"z/", wnull,
+                L"Completion without descriptions did the wrong thing");
+
+    expand_test(L"/tmp/fish_expand_test/ba", EXPAND_FOR_COMPLETIONS | EXPAND_NO_DESCRIPTIONS | DIRECTORIES_ONLY,
+                L"x/", L"z/", wnull,
+                L"Directory completion without descriptions did the wrong thing");
+
     expand_test(L"/tmp/fish_expand_test/b/yyy", EXPAND_FOR_COMPLETIONS,
                 /* nothing! */ wnull,
                 L"Wrong fuzzy matching 1");
@@ -1573,6 +2182,152 @@ static void test_expand()
     if (system("rm -Rf /tmp/fish_expand_test")) err(L"rm failed");
 }
 
+/* Test recursive wildcards over a tree wide enough to be walked by several threads */
+static void test_expand_recursive_walk()
+{
+    say(L"Testing recursive wildcard expansion of a wide tree");
+    
+    /* 40 directories of 3 files each, and one subdirectory with one file each */
+    if (system("mkdir -p /tmp/fish_walk_test/")) err(L"mkdir failed");
+    for (int i=0; i < 40; i++)
+    {
+        char cmd[512];
+        snprintf(cmd, sizeof cmd, "mkdir -p /tmp/fish_walk_test/d%d/sub && touch /tmp/fish_walk_test/d%d/a.x /tmp/fish_walk_test/d%d/b.x /tmp/fish_walk_test/d%d/c.y /tmp/fish_walk_test/d%d/sub/e.x", i, i, i, i, i);
+        if (system(cmd)) err(L"mkdir failed");
+    }
+    
+    const wcstring wildcard = L"/tmp/fish_walk_test/**.x";
+    std::vector<completion_t> output;
+    if (expand_string(wildcard, &output, 0, NULL) != EXPAND_WILDCARD_MATCH)
+    {
+        err(L"Recursive wildcard found nothing");
+    }
+    else if (output.size() != 120)
+    {
+        err(L"Recursive wildcard found %lu files instead of 120", (unsigned long)output.size());
+    }
+    else
+    {
+        for (size_t i=1; i < output.size(); i++)
+        {
+            if (! completion_t::is_naturally_less_than(output.at(i-1), output.at(i)))
+            {
+                err(L"Recursive wildcard results are not sorted at '%ls'", output.at(i).completion.c_str());
+                break;
+            }
+        }
+    }
+    
+    /* A symlink back up the tree must not send us round in circles, and must give the same answer every time */
+    if (system("ln -s ../../d1 /tmp/fish_walk_test/d0/sub/loop")) err(L"ln failed");
+    std::vector<completion_t> first;
+    if (expand_string(wildcard, &first, 0, NULL) != EXPAND_WILDCARD_MATCH || first.size() != 120)
+    {
+        err(L"Recursive wildcard mishandled a symlink loop");
+    }
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        std::vector<completion_t> again;
+        bool same = (expand_string(wildcard, &again, 0, NULL) == EXPAND_WILDCARD_MATCH && again.size() == first.size());
+        for (size_t i=0; same && i < again.size(); i++)
+        {
+            same = (again.at(i).completion == first.at(i).completion);
+        }
+        if (! same)
+        {
+            err(L"Recursive wildcard gave different results for the same tree");
+            break;
+        }
+    }
+    
+    if (system("rm -Rf /tmp/fish_walk_test")) err(L"rm failed");
+}
+
+/* Turn * and ? into the internal wildcard characters */
+static wcstring internal_wildcard(const wchar_t *wc)
+{
+    wcstring result = wc;
+    for (size_t i=0; i < result.size(); i++)
+    {
+        if (result.at(i) == L'*') result.at(i) = ANY_STRING;
+        else if (result.at(i) == L'?') result.at(i) = ANY_CHAR;
+    }
+    return result;
+}
+
+static void test_wildcard_match(void)
+{
+    say(L"Testing wildcard matching");
+    
+    const struct
+    {
+        const wchar_t *str;
+        const wchar_t *wc;
+        bool leading_dots_fail_to_match;
+        bool expected;
+    } tests[] =
+    {
+        {L"foo", L"foo", false, true},
+        {L"foo", L"fo", false, false},
+        {L"", L"", false, true},
+        {L"", L"*", false, true},
+        {L"foo", L"*", false, true},
+        {L"foo", L"f*o", false, true},
+        {L"foo", L"f*x", false, false},
+        {L"foo", L"*o*o*", false, true},
+        {L"foo", L"*o*o*o*", false, false},
+        {L"abcabd", L"*ab?", false, true},
+        {L"abcabd", L"a*c*d", false, true},
+        {L"abcabd", L"a*c*e", false, false},
+        {L"abc", L"???", false, true},
+        {L"abc", L"????", false, false},
+        {L".foo", L"*", true, false},
+        {L".foo", L"*", false, true},
+        {L".foo", L"?foo", false, false},
+        {L".foo", L".*", true, true},
+        {L".", L"*", false, true},
+        {L".", L".*", true, false},
+        {L"..", L"..", true, true},
+        {L"x.foo", L"*.foo", true, true}
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++)
+    {
+        const wcstring wc = internal_wildcard(tests[i].wc);
+        if (wildcard_match(tests[i].str, wc, tests[i].leading_dots_fail_to_match) != tests[i].expected)
+        {
+            err(L"wildcard_match('%ls', '%ls') did not give %d", tests[i].str, tests[i].wc, tests[i].expected);
+        }
+        bool fuzzy_matched = (wildcard_match_fuzzy(tests[i].str, wc, tests[i].leading_dots_fail_to_match, fuzzy_match_exact) != fuzzy_match_none);
+        if (fuzzy_matched != tests[i].expected)
+        {
+            err(L"wildcard_match_fuzzy('%ls', '%ls') did not give %d", tests[i].str, tests[i].wc, tests[i].expected);
+        }
+    }
+    
+    /* A prepared pattern can be used many times */
+    const wildcard_pattern_t pattern(internal_wildcard(L"*.cpp"));
+    if (! pattern.match(L"wildcard.cpp") || pattern.match(L"wildcard.h") || ! pattern.match(L"fish.cpp"))
+    {
+        err(L"wildcard_pattern_t gave the wrong answer when reused");
+    }
+    
+    /* These would take exponential time with naive backtracking */
+    const wcstring many_as(64, L'a');
+    const wcstring nasty = internal_wildcard(L"*a*a*a*a*a*a*a*a*b");
+    if (wildcard_match(many_as, nasty))
+    {
+        err(L"wildcard_match matched a nasty pattern");
+    }
+    if (wildcard_match_fuzzy(many_as, nasty, false, fuzzy_match_exact) != fuzzy_match_none)
+    {
+        err(L"wildcard_match_fuzzy matched a nasty pattern");
+    }
+    if (wildcard_complete(many_as, nasty.c_str(), NULL, NULL, NULL, 0, 0))
+    {
+        err(L"wildcard_complete completed a nasty pattern");
+    }
+}
+
 static void test_fuzzy_match(void)
 {
     say(L"Testing fuzzy string matching");
@@ -1585,6 +2340,19 @@ static void test_fuzzy_match(void)
     if (string_fuzzy_match_string(L"LPH", L"ALPHA!").type != fuzzy_match_substring) err(L"test_fuzzy_match failed on line %ld", __LINE__);
     if (string_fuzzy_match_string(L"AA", L"ALPHA!").type != fuzzy_match_subsequence_insertions_only) err(L"test_fuzzy_match failed on line %ld", __LINE__);
     if (string_fuzzy_match_string(L"BB", L"ALPHA!").type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+    if (string_fuzzy_match_string(L"ALPHA!!", L"ALPHA!").type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+    if (string_fuzzy_match_string(L"HAH", L"ALPHA!").type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+
+    /* Matches worse than the limit are not reported */
+    if (string_fuzzy_match_string(L"alp", L"alpha", fuzzy_match_exact).type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+    if (string_fuzzy_match_string(L"alPh", L"ALPHA!", fuzzy_match_case_insensitive).type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+    if (string_fuzzy_match_string(L"LPH", L"ALPHA!", fuzzy_match_prefix_case_insensitive).type != fuzzy_match_none) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+
+    /* Distances */
+    const string_fuzzy_match_t substring = string_fuzzy_match_string(wcstring(L"PH"), wcstring(L"ALPHA!PH"));
+    if (substring.type != fuzzy_match_substring || substring.match_distance_first != 6 || substring.match_distance_second != 2) err(L"test_fuzzy_match failed on line %ld", __LINE__);
+    const string_fuzzy_match_t prefix = string_fuzzy_match_string(wcstring(L"alp"), wcstring(L"ALPHA!"));
+    if (prefix.type != fuzzy_match_prefix_case_insensitive || prefix.match_distance_first != 3) err(L"test_fuzzy_match failed on line %ld", __LINE__);
 }
 
 static void test_abbreviations(void)
@@ -1653,8 +2421,21 @@ static void test_abbreviations(void)
     expanded = reader_expand_abbreviation_in_command(L"command gc", wcslen(L"command gc"), &result);
     if (expanded) err(L"gc incorrectly expanded on line %ld", (long)__LINE__);
 
+    /* Changing the variable changes the abbreviations */
+    env_set(USER_ABBREVIATIONS_VARIABLE_NAME, L"gc=git commit", ENV_LOCAL);
+    if (! expand_abbreviation(L"gc", &result) || result != L"git commit") err(L"Abbreviations not updated on line %ld", (long)__LINE__);
+    if (expand_abbreviation(L"foo", &result)) err(L"Stale abbreviation on line %ld", (long)__LINE__);
+
+    /* A new scope hides them, and popping it shows them again */
+    env_push(true);
+    if (expand_abbreviation(L"gc", &result)) err(L"Hidden abbreviation expanded on line %ld", (long)__LINE__);
+    env_pop();
+    if (! expand_abbreviation(L"gc", &result) || result != L"git commit") err(L"Abbreviation not shown again on line %ld", (long)__LINE__);
 
     env_pop();
+
+    /* They are gone with the scope they were set in */
+    if (expand_abbreviation(L"gc", &result)) err(L"Abbreviation outlived its scope on line %ld", (long)__LINE__);
 }
 
 /** Test path functions */
@@ -1682,6 +2463,371 @@ static void test_path()
     if (! paths_are_equivalent(L"/", L"/")) err(L"Bug in canonical PATH code on line %ld", (long)__LINE__);
 }
 
+/* Returns the value of the given variable in the exported environment array, or NULL if it is not exported */
+static const char *exported_value(const char *name)
+{
+    size_t len = strlen(name);
+    for (const char * const *var = env_export_arr(false); *var != NULL; var++)
+    {
+        if (strncmp(*var, name, len) == 0 && (*var)[len] == '=')
+            return *var + len + 1;
+    }
+    return NULL;
+}
+
+static bool exported_value_is(const char *name, const char *expected)
+{
+    const char *val = exported_value(name);
+    return val != NULL && strcmp(val, expected) == 0;
+}
+
+/** Test the exported environment array as single variables change */
+static void test_export_array()
+{
+    say(L"Testing exported variable array");
+
+    env_set(L"fish_test_export", L"1", ENV_GLOBAL | ENV_EXPORT);
+    do_test(exported_value_is("fish_test_export", "1"));
+    env_set(L"fish_test_export", L"2", 0);
+    do_test(exported_value_is("fish_test_export", "2"));
+
+    /* Other variables are unaffected */
+    env_set(L"fish_test_export2", L"a" ARRAY_SEP_STR L"b", ENV_GLOBAL | ENV_EXPORT);
+    do_test(exported_value_is("fish_test_export2", "a\x1e" "b"));
+    do_test(exported_value_is("fish_test_export", "2"));
+
+    /* Local variables shadow global ones, exported or not */
+    env_push(true);
+    env_set(L"fish_test_export", L"3", ENV_LOCAL | ENV_EXPORT);
+    do_test(exported_value_is("fish_test_export", "3"));
+    env_set(L"fish_test_export", L"4", ENV_LOCAL | ENV_UNEXPORT);
+    do_test(exported_value("fish_test_export") == NULL);
+    env_remove(L"fish_test_export", ENV_LOCAL);
+    do_test(exported_value_is("fish_test_export", "2"));
+    env_set(L"fish_test_export", L"5", ENV_LOCAL | ENV_EXPORT);
+    env_pop();
+    do_test(exported_value_is("fish_test_export", "2"));
+
+    /* Unexporting and erasing */
+    env_set(L"fish_test_export", L"6", ENV_GLOBAL | ENV_UNEXPORT);
+    do_test(exported_value("fish_test_export") == NULL);
+    env_set(L"fish_test_export", L"7", ENV_GLOBAL | ENV_EXPORT);
+    do_test(exported_value_is("fish_test_export", "7"));
+    env_remove(L"fish_test_export", ENV_GLOBAL);
+    env_remove(L"fish_test_export2", ENV_GLOBAL);
+    do_test(exported_value("fish_test_export") == NULL);
+    do_test(exported_value("fish_test_export2") == NULL);
+}
+
+/** Test variable scopes with enough variables to grow their tables, and erasures */
+static void test_env_scopes()
+{
+    say(L"Testing variable scopes");
+
+    env_push(true);
+    for (int i=0; i < 1000; i++)
+    {
+        env_set(format_string(L"fish_test_var_%d", i), to_string(i).c_str(), ENV_LOCAL);
+    }
+    for (int i=0; i < 1000; i += 2)
+    {
+        env_remove(format_string(L"fish_test_var_%d", i), ENV_LOCAL);
+    }
+    /* Re-adding after erasing reuses the erased slots */
+    for (int i=0; i < 1000; i += 4)
+    {
+        env_set(format_string(L"fish_test_var_%d", i), L"again", ENV_LOCAL);
+    }
+
+    size_t found = 0;
+    for (int i=0; i < 1000; i++)
+    {
+        const env_var_t val = env_get_string(format_string(L"fish_test_var_%d", i));
+        if (i % 4 == 0)
+        {
+            if (val != L"again") err(L"Variable fish_test_var_%d has the wrong value", i);
+        }
+        else if (i % 2 == 0)
+        {
+            if (! val.missing()) err(L"Erased variable fish_test_var_%d still exists", i);
+        }
+        else if (val != to_string(i))
+        {
+            err(L"Variable fish_test_var_%d has the wrong value", i);
+        }
+        if (! val.missing())
+            found++;
+    }
+    do_test(found == 750);
+
+    const wcstring_list_t names = env_get_names(ENV_LOCAL);
+    size_t test_names = 0;
+    for (size_t i=0; i < names.size(); i++)
+    {
+        if (string_prefixes_string(L"fish_test_var_", names.at(i)))
+            test_names++;
+    }
+    do_test(test_names == 750);
+
+    /* Globals are found through the new scope, and shadowed by locals */
+    env_set(L"fish_test_var_1", L"global", ENV_GLOBAL);
+    do_test(env_get_string(L"fish_test_var_1") == L"1");
+    do_test(env_get_string(L"fish_test_var_1", ENV_GLOBAL) == L"global");
+    env_pop();
+    do_test(env_get_string(L"fish_test_var_1") == L"global");
+    do_test(env_get_string(L"fish_test_var_3").missing());
+    env_remove(L"fish_test_var_1", ENV_GLOBAL);
+}
+
+static int read_published_variable(wcstring *value)
+{
+    const env_var_t val = env_get_string(L"fish_test_published");
+    value->assign(val.missing() ? L"(missing)" : val);
+    return 0;
+}
+
+/* Returns the value of fish_test_published as seen from a background thread */
+static wcstring published_variable_value()
+{
+    wcstring value;
+    iothread_perform(read_published_variable, &value);
+    iothread_drain_all();
+    return value;
+}
+
+/** Test that background threads see variables as of the last publication */
+static void test_env_publish()
+{
+    say(L"Testing published variables");
+
+    env_set(L"fish_test_published", L"1", ENV_GLOBAL);
+    env_publish();
+    do_test(published_variable_value() == L"1");
+
+    /* Changes are invisible until published */
+    env_set(L"fish_test_published", L"2", ENV_GLOBAL);
+    do_test(published_variable_value() == L"1");
+    env_publish();
+    do_test(published_variable_value() == L"2");
+
+    /* Local scopes are published too */
+    env_push(true);
+    env_set(L"fish_test_published", L"3", ENV_LOCAL);
+    env_publish();
+    do_test(published_variable_value() == L"3");
+    env_pop();
+    env_publish();
+    do_test(published_variable_value() == L"2");
+
+    env_remove(L"fish_test_published", ENV_GLOBAL);
+    env_publish();
+    do_test(published_variable_value() == L"(missing)");
+}
+
+/** Test the wide character wrappers of path system calls */
+static void test_wutil_paths()
+{
+    say(L"Testing wide path wrappers");
+
+    if (system("rm -Rf /tmp/fish_wutil_test/")) err(L"Failed to remove /tmp/fish_wutil_test/");
+    if (system("mkdir -p /tmp/fish_wutil_test/sub && touch /tmp/fish_wutil_test/sub/file")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_wutil_test/caf`printf '\\351'`")) err(L"touch failed");
+
+    struct stat buf;
+    if (wstat(L"/tmp/fish_wutil_test/sub/file", &buf) != 0 || ! S_ISREG(buf.st_mode))
+        err(L"wstat failed on line %ld", (long)__LINE__);
+
+    /* A name that is not ASCII is not copied directly */
+    wcstring encoded = L"/tmp/fish_wutil_test/caf";
+    encoded.push_back(ENCODE_DIRECT_BASE + 0xe9);
+    if (waccess(encoded, F_OK) != 0)
+        err(L"waccess failed on a file with a non-ASCII name on line %ld", (long)__LINE__);
+
+    /* So is a path too long for the stack buffer */
+    wcstring long_path = L"/tmp/fish_wutil_test/sub";
+    while (long_path.size() < 1000)
+        long_path.append(L"/.");
+    long_path.append(L"/file");
+    if (lwstat(long_path, &buf) != 0 || ! S_ISREG(buf.st_mode))
+        err(L"lwstat failed on a long path on line %ld", (long)__LINE__);
+    if (wstat(long_path + L"-missing", &buf) == 0 || errno != ENOENT)
+        err(L"wstat found a missing file on line %ld", (long)__LINE__);
+
+    int dir_fd = wopen_cloexec(L"/tmp/fish_wutil_test", O_RDONLY);
+    if (dir_fd < 0)
+    {
+        err(L"wopen_cloexec failed on line %ld", (long)__LINE__);
+    }
+    else
+    {
+#ifdef HAVE_FSTATAT
+        if (wstatat(dir_fd, L"sub", &buf) != 0 || ! S_ISDIR(buf.st_mode))
+            err(L"wstatat failed on line %ld", (long)__LINE__);
+        if (lwstatat(dir_fd, L"sub/file", &buf) != 0 || ! S_ISREG(buf.st_mode))
+            err(L"lwstatat failed on line %ld", (long)__LINE__);
+        if (wstatat(dir_fd, L"missing", &buf) == 0)
+            err(L"wstatat found a missing file on line %ld", (long)__LINE__);
+#endif
+#ifdef HAVE_FACCESSAT
+        if (waccessat(dir_fd, encoded.substr(encoded.rfind(L'/') + 1), F_OK) != 0)
+            err(L"waccessat failed on line %ld", (long)__LINE__);
+#endif
+#ifdef HAVE_OPENAT
+        int fd = wopenat_cloexec(dir_fd, L"sub/file", O_RDONLY);
+        if (fd < 0)
+            err(L"wopenat_cloexec failed on line %ld", (long)__LINE__);
+        else
+            close(fd);
+#endif
+        close(dir_fd);
+    }
+
+    if (system("rm -Rf /tmp/fish_wutil_test/")) err(L"Failed to remove /tmp/fish_wutil_test/");
+}
+
+/** Test the command lookup cache */
+static void test_path_cache()
+{
+    say(L"Testing command lookup cache");
+
+    if (system("rm -Rf /tmp/fish_path_cache_test/")) err(L"Failed to remove /tmp/fish_path_cache_test/");
+    if (system("mkdir -p /tmp/fish_path_cache_test/first/ /tmp/fish_path_cache_test/second/")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_path_cache_test/second/fish_cache_cmd && chmod 755 /tmp/fish_path_cache_test/second/fish_cache_cmd")) err(L"touch failed");
+
+    env_push(true);
+    env_set(L"PATH", L"/tmp/fish_path_cache_test/first" ARRAY_SEP_STR L"/tmp/fish_path_cache_test/second", ENV_LOCAL | ENV_EXPORT);
+
+    wcstring path;
+    if (! path_get_path(L"fish_cache_cmd", &path) || path != L"/tmp/fish_path_cache_test/second/fish_cache_cmd")
+        err(L"Command not found in PATH on line %ld", (long)__LINE__);
+
+    /* Repeated lookups give the same answer */
+    path.clear();
+    if (! path_get_path(L"fish_cache_cmd", &path) || path != L"/tmp/fish_path_cache_test/second/fish_cache_cmd")
+        err(L"Cached lookup failed on line %ld", (long)__LINE__);
+    if (path_get_path(L"fish_cache_missing_cmd", NULL))
+        err(L"Missing command found on line %ld", (long)__LINE__);
+    if (path_get_path(L"fish_cache_missing_cmd", NULL))
+        err(L"Missing command found on line %ld", (long)__LINE__);
+
+    /* A command shadowing the cached one in an earlier directory must be seen */
+    if (system("touch /tmp/fish_path_cache_test/first/fish_cache_cmd && chmod 755 /tmp/fish_path_cache_test/first/fish_cache_cmd")) err(L"touch failed");
+    if (system("touch /tmp/fish_path_cache_test/first/fish_cache_missing_cmd && chmod 755 /tmp/fish_path_cache_test/first/fish_cache_missing_cmd")) err(L"touch failed");
+    path_cache_recheck();
+    if (! path_get_path(L"fish_cache_cmd", &path) || path != L"/tmp/fish_path_cache_test/first/fish_cache_cmd")
+        err(L"Stale cached lookup on line %ld", (long)__LINE__);
+    if (! path_get_path(L"fish_cache_missing_cmd", NULL))
+        err(L"Stale negative lookup on line %ld", (long)__LINE__);
+
+    /* Removing it must be seen too */
+    if (system("rm /tmp/fish_path_cache_test/first/fish_cache_cmd")) err(L"rm failed");
+    path_cache_recheck();
+    if (! path_get_path(L"fish_cache_cmd", &path) || path != L"/tmp/fish_path_cache_test/second/fish_cache_cmd")
+        err(L"Stale cached lookup on line %ld", (long)__LINE__);
+
+    /* Changing PATH empties the cache */
+    env_set(L"PATH", L"/tmp/fish_path_cache_test/first", ENV_LOCAL | ENV_EXPORT);
+    if (path_get_path(L"fish_cache_cmd", NULL))
+        err(L"Lookup used a cache for another PATH on line %ld", (long)__LINE__);
+
+    /* cd arguments are resolved through a cache too. Wait until the directories are old enough for their modification times to be trusted, so that results are cached. */
+    if (system("mkdir -p /tmp/fish_path_cache_test/cd/sub")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_path_cache_test/first/fish_cache_Alpha /tmp/fish_path_cache_test/first/fish_cache_alpine /tmp/fish_path_cache_test/first/fish_cache_beta")) err(L"touch failed");
+    if (system("chmod 755 /tmp/fish_path_cache_test/first/fish_cache_alpine")) err(L"chmod failed");
+    env_set(L"CDPATH", L"/tmp/fish_path_cache_test/cd", ENV_LOCAL);
+    sleep(2);
+
+    /* A file that is not executable is no command, but making it executable does not change its directory, so that must not be cached */
+    for (int i=0; i < 2; i++)
+    {
+        if (path_get_path(L"fish_cache_beta", NULL))
+            err(L"Command that is not executable found on line %ld", (long)__LINE__);
+    }
+    if (system("chmod 755 /tmp/fish_path_cache_test/first/fish_cache_beta")) err(L"chmod failed");
+    if (! path_get_path(L"fish_cache_beta", NULL))
+        err(L"Stale negative lookup after chmod on line %ld", (long)__LINE__);
+
+    const wchar_t *wd = L"/tmp/fish_path_cache_test/";
+    for (int i=0; i < 2; i++)
+    {
+        path.clear();
+        if (! path_get_cdpath(L"sub", &path, wd) || path != L"/tmp/fish_path_cache_test/cd/sub")
+            err(L"cd path not found on line %ld", (long)__LINE__);
+        if (path_get_cdpath(L"missing", NULL, wd) || errno != ENOENT)
+            err(L"Missing cd path found on line %ld", (long)__LINE__);
+    }
+
+    /* Creating and removing directories must be seen */
+    if (system("mkdir /tmp/fish_path_cache_test/cd/missing && rmdir /tmp/fish_path_cache_test/cd/sub")) err(L"mkdir failed");
+    path_cache_recheck();
+    if (! path_get_cdpath(L"missing", NULL, wd))
+        err(L"Stale negative cd path on line %ld", (long)__LINE__);
+    if (path_get_cdpath(L"sub", NULL, wd))
+        err(L"Stale cd path on line %ld", (long)__LINE__);
+
+    /* Changing CDPATH changes the candidates */
+    env_set(L"CDPATH", L"/tmp/fish_path_cache_test", ENV_LOCAL);
+    if (! path_get_cdpath(L"cd", &path, wd) || path != L"/tmp/fish_path_cache_test/cd")
+        err(L"cd path not found on line %ld", (long)__LINE__);
+    if (path_get_cdpath(L"missing", NULL, wd))
+        err(L"cd path used a cache for another CDPATH on line %ld", (long)__LINE__);
+
+    /* Directory listings answer prefix queries ignoring case, and are cached too */
+    for (int i=0; i < 2; i++)
+    {
+        std::vector<path_dir_entry_t> entries;
+        if (! path_get_dir_entries(L"/tmp/fish_path_cache_test/first/", L"fish_cache_al", &entries))
+            err(L"Directory not listed on line %ld", (long)__LINE__);
+        if (entries.size() != 2 || entries.at(0).name != L"fish_cache_Alpha" || entries.at(1).name != L"fish_cache_alpine")
+            err(L"Wrong directory entries on line %ld", (long)__LINE__);
+    }
+    std::vector<path_dir_entry_t> entries;
+    if (path_get_dir_entries(L"/tmp/fish_path_cache_test/missing/", L"", &entries) || ! entries.empty())
+        err(L"Missing directory listed on line %ld", (long)__LINE__);
+
+    /* Command names are completed from the listings. Only executables are completions, and permissions are not cached. */
+    std::vector<completion_t> completions;
+    complete(L"fish_cache_a", completions, COMPLETION_REQUEST_DEFAULT);
+    if (completions.size() != 1 || completions.at(0).completion != L"lpine")
+        err(L"Wrong command completions on line %ld", (long)__LINE__);
+    if (system("chmod 755 /tmp/fish_path_cache_test/first/fish_cache_Alpha")) err(L"chmod failed");
+    completions.clear();
+    complete(L"fish_cache_al", completions, COMPLETION_REQUEST_DEFAULT);
+    if (completions.size() != 2)
+        err(L"Wrong command completions on line %ld", (long)__LINE__);
+
+    /* New files must be seen */
+    if (system("touch /tmp/fish_path_cache_test/first/fish_cache_alto && chmod 755 /tmp/fish_path_cache_test/first/fish_cache_alto")) err(L"touch failed");
+    path_cache_recheck();
+    completions.clear();
+    complete(L"fish_cache_alt", completions, COMPLETION_REQUEST_DEFAULT);
+    if (completions.size() != 1 || completions.at(0).completion != L"o")
+        err(L"Stale command completions on line %ld", (long)__LINE__);
+
+    /* Function names are listed from the listings too, and merged with the loaded functions */
+    if (system("mkdir /tmp/fish_path_cache_test/functions && cd /tmp/fish_path_cache_test/functions && touch fish_cache_fn.fish _fish_cache_hidden.fish fish_cache_other.txt")) err(L"touch failed");
+    env_set(L"fish_function_path", L"/tmp/fish_path_cache_test/functions", ENV_LOCAL);
+    for (int hidden=0; hidden < 2; hidden++)
+    {
+        const wcstring_list_t names = function_get_names(hidden);
+        if (std::adjacent_find(names.begin(), names.end(), std::greater_equal<wcstring>()) != names.end())
+            err(L"Function names not sorted and unique on line %ld", (long)__LINE__);
+        const bool has_fn = std::find(names.begin(), names.end(), L"fish_cache_fn") != names.end();
+        const bool has_other = std::find(names.begin(), names.end(), L"fish_cache_other") != names.end();
+        const bool has_hidden = std::find(names.begin(), names.end(), L"_fish_cache_hidden") != names.end();
+        if (! has_fn || has_other || has_hidden != bool(hidden))
+            err(L"Wrong function names on line %ld", (long)__LINE__);
+    }
+    if (system("touch /tmp/fish_path_cache_test/functions/fish_cache_new.fish")) err(L"touch failed");
+    path_cache_recheck();
+    const wcstring_list_t names = function_get_names(false);
+    if (std::find(names.begin(), names.end(), L"fish_cache_new") == names.end())
+        err(L"Stale function names on line %ld", (long)__LINE__);
+
+    env_pop();
+    if (system("rm -Rf /tmp/fish_path_cache_test/")) err(L"Failed to remove /tmp/fish_path_cache_test/");
+}
+
 static void test_pager_navigation()
 {
     say(L"Testing pager navigation");
@@ -1787,6 +2933,62 @@ static void test_pager_navigation()
 
 }
 
+static void test_pager_filter()
+{
+    say(L"Testing pager search filter");
+
+    /* Each completion is too wide to fit two to a row, so the row count is the number of completions that pass the filter */
+    const wchar_t * const names[] = {L"apple_____", L"Apricot___", L"banana____", L"grape_____", L"cherry____"};
+    completion_list_t completions;
+    for (size_t i=0; i < sizeof names / sizeof *names; i++)
+    {
+        append_completion(&completions, names[i]);
+    }
+
+    pager_t pager;
+    pager.set_completions(completions);
+    pager.set_term_size(20, 24);
+    pager.set_fully_disclosed(true);
+    pager.set_search_field_shown(true);
+
+    /* Matches are substrings, or case insensitive prefixes. Extending the filter narrows the previous matches, other edits start over. */
+    const struct
+    {
+        const wchar_t *needle;
+        size_t count;
+    }
+    tests[] =
+    {
+        {L"", 5},
+        {L"ap", 3},
+        {L"apr", 1},
+        {L"aprx", 0},
+        {L"a", 4},
+        {L"AP", 2},
+        {L"", 5},
+    };
+    for (size_t i=0; i < sizeof tests / sizeof *tests; i++)
+    {
+        pager.search_field_line.text = tests[i].needle;
+        pager.refilter_completions();
+        page_rendering_t render = pager.render();
+        if (render.rows != tests[i].count)
+        {
+            err(L"Filter '%ls' shows %lu completions, expected %lu", tests[i].needle, (unsigned long)render.rows, (unsigned long)tests[i].count);
+        }
+    }
+
+    /* Hiding the search field drops the filter */
+    pager.search_field_line.text = L"apr";
+    pager.refilter_completions();
+    pager.set_search_field_shown(false);
+    pager.refilter_completions();
+    if (pager.render().rows != 5)
+    {
+        err(L"Hidden search field still filters completions");
+    }
+}
+
 enum word_motion_t
 {
     word_motion_left,
@@ -1918,6 +3120,51 @@ static void test_is_potential_path()
 
     do_test(is_potential_path(L"/usr", wds, PATH_REQUIRE_DIR, &tmp) && tmp == L"/usr/");
 
+    /* Directory listings are remembered; make sure changes to the directory are seen. Backdate it first, so that its listing is trusted. */
+    if (system("touch -t 200001010000 /tmp/is_potential_path_test/")) err(L"touch failed");
+    do_test(! is_potential_path(L"del", wds, 0, &tmp));
+    if (system("touch /tmp/is_potential_path_test/delta")) err(L"touch failed");
+    do_test(is_potential_path(L"del", wds, 0, &tmp) && tmp == L"delta");
+    if (system("ln -s alpha /tmp/is_potential_path_test/linked")) err(L"ln failed");
+    do_test(is_potential_path(L"lin", wds, PATH_REQUIRE_DIR, &tmp) && tmp == L"linked/");
+}
+
+/** Test paths_are_valid, using the directory test_is_potential_path made */
+static void test_paths_are_valid()
+{
+    say(L"Testing paths_are_valid");
+    const wcstring wd = L"/tmp/is_potential_path_test/";
+    wcstring_list_t paths;
+    paths.push_back(L"aardvark");
+    paths.push_back(L"nonexistent");
+    paths.push_back(L"alpha/");
+    paths.push_back(L"/tmp/is_potential_path_test/gamma");
+    paths.push_back(L"./beta");
+    paths.push_back(L"..");
+    paths.push_back(L"alpha/nothing");
+    paths.push_back(L"/");
+
+    std::vector<bool> valid;
+    do_test(! paths_are_valid(paths, wd, true, &valid));
+    do_test(valid.size() == paths.size());
+    for (size_t i=0; i < paths.size(); i++)
+    {
+        if (valid.at(i) != path_is_valid(paths.at(i), wd))
+            err(L"paths_are_valid disagrees with path_is_valid on '%ls'", paths.at(i).c_str());
+    }
+
+    paths.erase(paths.begin() + 1);
+    paths.pop_back();
+    paths.pop_back();
+    do_test(paths_are_valid(paths, wd, false, &valid));
+
+    /* A path inside a FIFO is not valid, and testing it does not wait for a writer */
+    if (mkfifo("/tmp/is_potential_path_test/fifo", 0600) != 0)
+        err(L"mkfifo failed");
+    paths.clear();
+    paths.push_back(L"fifo/inside");
+    do_test(! paths_are_valid(paths, wd, true, &valid));
+    unlink("/tmp/is_potential_path_test/fifo");
 }
 
 /** Test the 'test' builtin */
@@ -2042,6 +3289,27 @@ static void test_test()
     /* Make sure we can treat -S as a parameter instead of an operator. https://github.com/fish-shell/fish-shell/issues/601 */
     do_test(run_test_test(0, L"-S = -S"));
     do_test(run_test_test(1, L"! ! ! A"));
+
+    /* Several primaries on the same file share its stat and access results, including through symlinks */
+    if (system("rm -rf /tmp/fish_test_test && mkdir -p /tmp/fish_test_test")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_test_test/file && chmod 644 /tmp/fish_test_test/file")) err(L"touch failed");
+    if (system("ln -s file /tmp/fish_test_test/link && ln -s missing /tmp/fish_test_test/dangling")) err(L"ln failed");
+    do_test(run_test_test(0, L"-f /tmp/fish_test_test/file -a -r /tmp/fish_test_test/file -a -w /tmp/fish_test_test/file"));
+    do_test(run_test_test(1, L"-f /tmp/fish_test_test/file -a -r /tmp/fish_test_test/file -a -x /tmp/fish_test_test/file"));
+    do_test(run_test_test(0, L"-r /tmp/fish_test_test/file -a ! -x /tmp/fish_test_test/file -a -r /tmp/fish_test_test/file"));
+    do_test(run_test_test(0, L"-L /tmp/fish_test_test/link -a -f /tmp/fish_test_test/link -a ! -L /tmp/fish_test_test/file"));
+    do_test(run_test_test(0, L"-L /tmp/fish_test_test/dangling -a ! -e /tmp/fish_test_test/dangling -a ! -r /tmp/fish_test_test/dangling"));
+    do_test(run_test_test(0, L"! -e /tmp/fish_test_test/missing -a ! -r /tmp/fish_test_test/missing"));
+
+    /* A file primary followed by several files tests each of them */
+    do_test(run_test_test(0, L"-f /tmp/fish_test_test/file /tmp/fish_test_test/link"));
+    do_test(run_test_test(1, L"-f /tmp/fish_test_test/file /tmp/fish_test_test/dangling"));
+    do_test(run_test_test(0, L"-L /tmp/fish_test_test/link /tmp/fish_test_test/dangling"));
+    do_test(run_test_test(0, L"-d /bin /tmp/fish_test_test /tmp"));
+    do_test(run_test_test(1, L"-d /bin /tmp/fish_test_test/file /tmp"));
+    do_test(run_test_test(1, L"-n foo bar"));
+    do_test(run_test_test(1, L"-f /tmp/fish_test_test/file -a"));
+    if (system("rm -rf /tmp/fish_test_test")) err(L"rm failed");
 }
 
 /** Testing colors */
@@ -2059,6 +3327,65 @@ static void test_colors()
     do_test(rgb_color_t(L"magenta").is_named());
     do_test(rgb_color_t(L"MaGeNTa").is_named());
     do_test(rgb_color_t(L"mooganta").is_none());
+
+    /* Highlight colors are cached, but follow their variables */
+    env_set(L"fish_color_command", L"red", ENV_GLOBAL);
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"red"));
+    env_set(L"fish_color_command", L"blue", ENV_GLOBAL);
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"blue"));
+    env_push(true);
+    env_set(L"fish_color_command", L"green", ENV_LOCAL);
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"green"));
+    env_pop();
+    do_test(highlight_get_color(highlight_spec_command, false) == rgb_color_t(L"blue"));
+    env_remove(L"fish_color_command", ENV_GLOBAL);
+}
+
+/* Test that command descriptions are looked up once for a prefix, and reused for longer ones */
+static void test_complete_command_descriptions(void)
+{
+    say(L"Testing command description lookup");
+    
+    if (system("mkdir -p /tmp/fish_desc_test/")) err(L"mkdir failed");
+    if (system("touch /tmp/fish_desc_test/fishdesc_alpha /tmp/fish_desc_test/fishdesc_beta")) err(L"touch failed");
+    if (system("chmod 755 /tmp/fish_desc_test/fishdesc_alpha /tmp/fish_desc_test/fishdesc_beta")) err(L"chmod failed");
+    
+    /* Command substitutions are split into lines by IFS */
+    const env_var_t saved_ifs = env_get_string(L"IFS");
+    env_set(L"IFS", L"\n", ENV_GLOBAL);
+    
+    parser_t &parser = parser_t::principal_parser();
+    parser.eval(L"function __fish_describe_command; set -g fish_test_describe_calls $fish_test_describe_calls $argv; printf '%s\\t%s\\n' fishdesc_alpha 'first command' fishdesc_beta 'second command'; end", io_chain_t(), TOP);
+    
+    std::vector<completion_t> completions;
+    complete(L"/tmp/fish_desc_test/fishde", completions, COMPLETION_REQUEST_DESCRIPTIONS);
+    do_test(completions.size() == 2);
+    for (size_t i=0; i < completions.size(); i++)
+    {
+        const completion_t &c = completions.at(i);
+        do_test(c.completion == L"sc_alpha" || c.completion == L"sc_beta");
+        do_test(wcstring(c.description) == (c.completion == L"sc_alpha" ? L"First command" : L"Second command"));
+    }
+    
+    /* A longer prefix is answered from the cache */
+    completions.clear();
+    complete(L"/tmp/fish_desc_test/fishdesc_b", completions, COMPLETION_REQUEST_DESCRIPTIONS);
+    do_test(completions.size() == 1);
+    do_test(! completions.empty() && wcstring(completions.at(0).description) == L"Second command");
+    
+    env_var_t calls = env_get_string(L"fish_test_describe_calls");
+    do_test(calls == L"fishde");
+    
+    parser.eval(L"functions -e __fish_describe_command; set -e fish_test_describe_calls", io_chain_t(), TOP);
+    if (saved_ifs.missing())
+    {
+        env_remove(L"IFS", ENV_GLOBAL);
+    }
+    else
+    {
+        env_set(L"IFS", saved_ifs.c_str(), ENV_GLOBAL);
+    }
+    if (system("rm -Rf /tmp/fish_desc_test")) err(L"rm failed");
 }
 
 static void test_complete(void)
@@ -2071,6 +3398,19 @@ static void test_complete(void)
 
     complete_set_variable_names(&names);
 
+    /* Copies share the description, whether it is fixed or not */
+    {
+        const completion_t owned(L"a", L"Variable: some value");
+        const completion_t fixed(L"b", completion_fixed_desc_t(L"Directory"));
+        std::vector<completion_t> copies(2, owned);
+        copies.push_back(fixed);
+        copies.at(1) = copies.at(0);
+        do_test(copies.at(1).description == owned.description && wcscmp(owned.description, L"Variable: some value") == 0);
+        do_test(copies.at(2).description == fixed.description && completion_fixed_desc_t(L"Directory").str == fixed.description);
+        copies.at(0).set_description(wcstring());
+        do_test(wcscmp(copies.at(0).description, L"") == 0 && copies.at(1).description == owned.description);
+    }
+
     std::vector<completion_t> completions;
     complete(L"$F", completions, COMPLETION_REQUEST_DEFAULT);
     do_test(completions.size() == 3);
@@ -2137,6 +3477,104 @@ static void test_complete(void)
     do_test(completions.size() == 1);
     do_test(completions.at(0).completion == L"qux");
 
+    /* Options are found through the option index */
+    complete_add(L"optcmd", false, L'a', L"alpha", 0, NO_FILES, NULL, NULL, NULL, 0);
+    complete_add(L"optcmd", false, L'b', NULL, 0, EXCLUSIVE, NULL, L"bval", NULL, 0);
+    complete_add(L"optcmd", false, 0, L"color", 0, EXCLUSIVE, NULL, L"auto never", NULL, 0);
+    complete_add(L"optcmd", false, 0, L"old", 1, EXCLUSIVE, NULL, L"oldval", NULL, 0);
+    complete_add((wcstring(L"optc") + wchar_t(ANY_STRING)).c_str(), false, 0, NULL, 0, NO_FILES, NULL, L"wild", NULL, 0);
+
+    completions.clear();
+    complete(L"optcmd --al", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"pha");
+
+    completions.clear();
+    complete(L"optcmd --AL", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"--alpha");
+    do_test(completions.at(0).flags & COMPLETE_REPLACES_TOKEN);
+
+    completions.clear();
+    complete(L"optcmd --color=a", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"uto");
+
+    completions.clear();
+    complete(L"optcmd -b ", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 2);
+    do_test(completions.at(0).completion == L"bval");
+    do_test(completions.at(1).completion == L"wild");
+
+    completions.clear();
+    complete(L"optcmd -old ", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 2);
+    do_test(completions.at(0).completion == L"oldval");
+    do_test(completions.at(1).completion == L"wild");
+
+    completions.clear();
+    complete(L"optcmd -", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 5);
+    completions.clear();
+
+    complete(L"optcmd ", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1);
+    do_test(completions.at(0).completion == L"wild");
+
+    complete_remove(L"optcmd", false, 0, NULL, 0);
+    complete_remove((wcstring(L"optc") + wchar_t(ANY_STRING)).c_str(), false, 0, NULL, 0);
+    completions.clear();
+    complete(L"optcmd --al", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.empty());
+
+    /* Options added all at once work like options added one by one */
+    std::vector<complete_entry_opt_t> bulk_opts(2);
+    bulk_opts.at(0).short_opt = L'x';
+    bulk_opts.at(0).result_mode = NO_COMMON;
+    bulk_opts.at(0).old_mode = 0;
+    bulk_opts.at(0).comp = L"xval";
+    bulk_opts.at(0).flags = 0;
+    bulk_opts.at(1).short_opt = 0;
+    bulk_opts.at(1).long_opt = L"yank";
+    bulk_opts.at(1).result_mode = SHARED;
+    bulk_opts.at(1).old_mode = 0;
+    bulk_opts.at(1).flags = 0;
+    complete_add_options(L"bulkcmd", false, bulk_opts);
+
+    completions.clear();
+    complete(L"bulkcmd -", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 2);
+
+    completions.clear();
+    complete(L"bulkcmd -x", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(completions.size() == 1 && completions.at(0).completion == L"xval");
+
+    complete_remove(L"bulkcmd", false, 0, NULL, 0);
+
+    /* Condition results are reused for the same command line when asked to */
+    complete_add(L"condcmd", false, 0, NULL, 0, NO_FILES, L"set -g fish_test_conditions \"$fish_test_conditions\"x", L"cond", NULL, 0);
+    for (size_t i=0; i < 2; i++)
+    {
+        completions.clear();
+        complete(L"condcmd ", completions, COMPLETION_REQUEST_REUSE_CONDITIONS);
+        do_test(completions.size() == 1);
+    }
+    do_test(env_get_string(L"fish_test_conditions") == L"x");
+    completions.clear();
+    complete(L"condcmd c", completions, COMPLETION_REQUEST_REUSE_CONDITIONS);
+    do_test(completions.size() == 1);
+    do_test(env_get_string(L"fish_test_conditions") == L"xx");
+    complete_invalidate_conditions();
+    completions.clear();
+    complete(L"condcmd c", completions, COMPLETION_REQUEST_REUSE_CONDITIONS);
+    do_test(env_get_string(L"fish_test_conditions") == L"xxx");
+    completions.clear();
+    complete(L"condcmd c", completions, COMPLETION_REQUEST_DEFAULT);
+    do_test(env_get_string(L"fish_test_conditions") == L"xxxx");
+    complete_remove(L"condcmd", false, 0, NULL, 0);
+    complete_invalidate_conditions();
+    env_remove(L"fish_test_conditions", ENV_GLOBAL);
+
     /* Don't complete variable names in single quotes (#1023) */
     completions.clear();
     complete(L"echo '$Foo", completions, COMPLETION_REQUEST_DEFAULT);
@@ -2513,11 +3951,51 @@ static void test_input()
         input_queue_ch(desired_binding.at(idx));
     }
 
-    /* Now test */
-    wint_t c = input_readch();
-    if (c != R_DOWN_LINE)
+    /* Now test */
+    wint_t c = input_readch();
+    if (c != R_DOWN_LINE)
+    {
+        err(L"Expected to read char R_DOWN_LINE, but instead got %ls\n", describe_char(c).c_str());
+    }
+
+    /* When a longer binding does not match, the longest one that does is used, and the rest of the input is left for the next read. Bindings in other modes are ignored. */
+    input_mapping_add(L"z", L"end-of-line");
+    input_mapping_add(desired_binding.c_str(), L"forward-char", L"fish_test_mode");
+    const wcstring partial_sequence = prefix_binding + L'z';
+    for (size_t idx = 0; idx < partial_sequence.size(); idx++)
+    {
+        input_queue_ch(partial_sequence.at(idx));
+    }
+    c = input_readch();
+    if (c != R_UP_LINE)
+    {
+        err(L"Expected to read char R_UP_LINE, but instead got %ls\n", describe_char(c).c_str());
+    }
+    c = input_readch();
+    if (c != R_END_OF_LINE)
+    {
+        err(L"Expected to read char R_END_OF_LINE, but instead got %ls\n", describe_char(c).c_str());
+    }
+
+    /* Pasted text is read as a whole, without invoking the bindings it contains */
+    const wcstring pasted = desired_binding + L"\tx\ry";
+    const wcstring paste_sequence = L"\x1b[200~" + pasted + L"\x1b[201~";
+    for (size_t idx = 0; idx < paste_sequence.size(); idx++)
     {
-        err(L"Expected to read char R_DOWN_LINE, but instead got %ls\n", describe_char(c).c_str());
+        input_queue_ch(paste_sequence.at(idx));
+    }
+    c = input_readch();
+    if (c != R_BEGIN_PASTE)
+    {
+        err(L"Expected to read char R_BEGIN_PASTE, but instead got %ls\n", describe_char(c).c_str());
+    }
+    else
+    {
+        const wcstring text = input_read_bracketed_paste();
+        if (text != pasted)
+        {
+            err(L"Expected pasted text '%ls', but instead got '%ls'", pasted.c_str(), text.c_str());
+        }
     }
 }
 
@@ -2658,6 +4136,39 @@ static void test_universal_callbacks()
     if (system("rm -Rf /tmp/fish_uvars_test")) err(L"rm failed");
 }
 
+static void test_universal_reread()
+{
+    say(L"Testing rereading universal variables");
+    if (system("mkdir -p /tmp/fish_uvars_test/")) err(L"mkdir failed");
+    env_universal_t uvars1(UVARS_TEST_PATH);
+    env_universal_t uvars2(UVARS_TEST_PATH);
+
+    uvars1.set(L"alpha", L"1", false);
+    uvars1.set(L"beta", L"1", true);
+    uvars1.sync(NULL);
+    uvars2.sync(NULL);
+
+    /* Only the changed line is reported, and unchanged lines keep their values */
+    callback_data_list_t callbacks;
+    uvars1.set(L"alpha", L"2", false);
+    uvars1.sync(NULL);
+    uvars2.sync(&callbacks);
+    do_test(callbacks.size() == 1 && callbacks.at(0).key == L"alpha" && callbacks.at(0).val == L"2");
+    do_test(uvars2.get(L"alpha") == L"2");
+    do_test(uvars2.get(L"beta") == L"1" && uvars2.get_export(L"beta"));
+
+    /* Changing back to a line seen before */
+    callbacks.clear();
+    uvars1.set(L"alpha", L"1", false);
+    uvars1.sync(NULL);
+    uvars2.sync(&callbacks);
+    do_test(callbacks.size() == 1 && callbacks.at(0).key == L"alpha" && callbacks.at(0).val == L"1");
+    do_test(uvars2.get(L"alpha") == L"1");
+    do_test(uvars2.get(L"beta") == L"1" && uvars2.get_export(L"beta"));
+
+    if (system("rm -Rf /tmp/fish_uvars_test")) err(L"rm failed");
+}
+
 bool poll_notifier(universal_notifier_t *note)
 {
     bool result = false;
@@ -2699,6 +4210,11 @@ static void trigger_or_wait_for_notification(universal_notifier_t *notifier, uni
             usleep(1000000 / 25);
             break;
             
+        case universal_notifier_t::strategy_file_watch:
+            // The notification is the variables file being replaced
+            if (system("echo '# test' > /tmp/fish_uvars_test/varsfile.tmp && mv /tmp/fish_uvars_test/varsfile.tmp /tmp/fish_uvars_test/varsfile.txt")) err(L"Replacing the variables file failed");
+            break;
+            
         case universal_notifier_t::strategy_named_pipe:
         case universal_notifier_t::strategy_null:
             break;
@@ -2780,6 +4296,86 @@ static void test_notifiers_with_strategy(universal_notifier_t::notifier_strategy
     }
 }
 
+static void test_autoload_builtin_scripts()
+{
+    say(L"Testing autoloading builtin scripts");
+    const builtin_script_t scripts[] = {{L"bundled_a", "function bundled_a; end"}, {L"bundled_b", "function bundled_b; end"}};
+    const size_t script_count = sizeof scripts / sizeof *scripts;
+
+    if (system("rm -Rf /tmp/fish_autoload_test; mkdir -p /tmp/fish_autoload_test/override; touch /tmp/fish_autoload_test/override/bundled_b.fish"))
+    {
+        err(L"Unable to create autoload test directory");
+    }
+
+    /* The data directory does not exist; the scripts stand in for it */
+    autoload_set_data_directory(L"/tmp/fish_autoload_test/data");
+    env_set(L"fish_autoload_test_path", L"/tmp/fish_autoload_test/override", ENV_GLOBAL);
+    {
+        autoload_t loader(L"fish_autoload_test_path", scripts, script_count, L"functions");
+        do_test(! loader.can_load(L"bundled_a", env_vars_snapshot_t::current()));
+        do_test(loader.can_load(L"bundled_b", env_vars_snapshot_t::current()));
+    }
+
+    env_set(L"fish_autoload_test_path", L"/tmp/fish_autoload_test/override" ARRAY_SEP_STR L"/tmp/fish_autoload_test/data/functions", ENV_GLOBAL);
+    {
+        autoload_t loader(L"fish_autoload_test_path", scripts, script_count, L"functions");
+        do_test(loader.can_load(L"bundled_a", env_vars_snapshot_t::current()));
+        do_test(loader.can_load(L"bundled_b", env_vars_snapshot_t::current()));
+        do_test(! loader.can_load(L"bundled_c", env_vars_snapshot_t::current()));
+    }
+
+    /* Scripts without a subdirectory take precedence over the path */
+    env_set(L"fish_autoload_test_path", L"/nonexistent", ENV_GLOBAL);
+    {
+        autoload_t loader(L"fish_autoload_test_path", scripts, script_count);
+        do_test(loader.can_load(L"bundled_a", env_vars_snapshot_t::current()));
+    }
+
+    env_remove(L"fish_autoload_test_path", ENV_GLOBAL);
+    autoload_set_data_directory(L"");
+    if (system("rm -Rf /tmp/fish_autoload_test"))
+    {
+        err(L"Unable to remove autoload test directory");
+    }
+}
+
+static void test_autoload_directory_listing()
+{
+    say(L"Testing autoload directory listings");
+    if (system("rm -Rf /tmp/fish_autoload_test; mkdir -p /tmp/fish_autoload_test/a /tmp/fish_autoload_test/b; touch /tmp/fish_autoload_test/b/listed_fn.fish"))
+    {
+        err(L"Unable to create autoload test directory");
+    }
+
+    env_set(L"fish_autoload_test_path", L"/tmp/fish_autoload_test/a" ARRAY_SEP_STR L"/tmp/fish_autoload_test/nonexistent" ARRAY_SEP_STR L"/tmp/fish_autoload_test/b", ENV_GLOBAL);
+    autoload_t loader(L"fish_autoload_test_path", NULL, 0);
+    do_test(loader.can_load(L"listed_fn", env_vars_snapshot_t::current()));
+    do_test(! loader.can_load(L"unlisted_fn", env_vars_snapshot_t::current()));
+
+    /* A file added right after the directory was listed must still be found */
+    if (system("touch /tmp/fish_autoload_test/a/new_fn.fish"))
+    {
+        err(L"Unable to create autoload test file");
+    }
+    do_test(loader.can_load(L"new_fn", env_vars_snapshot_t::current()));
+
+    /* A file added once the listing is trusted changes the directory's modification time */
+    sleep(2);
+    do_test(! loader.can_load(L"later_fn", env_vars_snapshot_t::current()));
+    if (system("touch /tmp/fish_autoload_test/b/later_fn2.fish"))
+    {
+        err(L"Unable to create autoload test file");
+    }
+    sleep(2);
+    do_test(loader.can_load(L"later_fn2", env_vars_snapshot_t::current()));
+
+    env_remove(L"fish_autoload_test_path", ENV_GLOBAL);
+    if (system("rm -Rf /tmp/fish_autoload_test"))
+    {
+        err(L"Unable to remove autoload test directory");
+    }
+}
+
 static void test_universal_notifiers()
 {
     if (system("mkdir -p /tmp/fish_uvars_test/ && touch /tmp/fish_uvars_test/varsfile.txt")) err(L"mkdir failed");
@@ -2788,6 +4384,9 @@ static void test_universal_notifiers()
 #if __APPLE__
     test_notifiers_with_strategy(universal_notifier_t::strategy_notifyd);
 #endif
+#if HAVE_SYS_INOTIFY_H || HAVE_SYS_EVENT_H
+    test_notifiers_with_strategy(universal_notifier_t::strategy_file_watch);
+#endif
     
     if (system("rm -Rf /tmp/fish_uvars_test/")) err(L"rm failed");
 }
@@ -2798,6 +4397,12 @@ public:
     static void test_history(void);
     static void test_history_merge(void);
     static void test_history_formats(void);
+    static void test_history_index(void);
+    static void test_history_prefix(void);
+    static void test_history_binary(void);
+    static void test_history_vacuum(void);
+    static void test_history_file_detection(void);
+    static void test_history_snapshot(void);
     static void test_history_speed(void);
 
     static void test_history_races(void);
@@ -2841,6 +4446,39 @@ void history_tests_t::test_history(void)
     history_search_t search3(history, L"Alpha");
     test_history_matches(search3, 0);
 
+    /* Test counting the most used commands. Ties go to the more recent command, and only words in command position that could name a function count. */
+    history.clear();
+    history.add(L"git status");
+    history.add(L"ls -l | grep foo");
+    history.add(L"if test -d x; cd x; end");
+    history.add(L"git log; and ls");
+    history.add(L"./configure");
+    history.add(L"$EDITOR file");
+    history.add(L"command grep bar file");
+    wcstring_list_t most_used = history.most_used_commands(4, 100);
+    const wchar_t * const expected_most_used[] = {L"grep", L"git", L"ls", L"test"};
+    do_test(most_used == wcstring_list_t(expected_most_used, expected_most_used + 4));
+    do_test(history.most_used_commands(10, 1) == wcstring_list_t(1, L"grep"));
+
+    /* $history lists each command once, at its most recent use, and can be indexed without listing the rest */
+    history.clear();
+    history.add(L"one");
+    history.add(L"two");
+    history.add(L"one");
+    history.add(L"three");
+    history.add(L"two");
+    do_test(history.distinct_item_at_index(1).str() == L"two");
+    do_test(history.distinct_item_at_index(2).str() == L"three");
+    do_test(history.distinct_item_at_index(3).str() == L"one");
+    do_test(history.distinct_item_at_index(4).empty());
+    do_test(history.distinct_item_count() == 3);
+    history.remove(L"three");
+    do_test(history.distinct_item_at_index(2).str() == L"one");
+    do_test(history.distinct_item_count() == 2);
+    wcstring representation;
+    history.get_string_representation(&representation, L" ");
+    do_test(representation == L"two one");
+
     /* Test history escaping and unescaping, yaml, etc. */
     history_item_list_t before, after;
     history.clear();
@@ -3033,10 +4671,11 @@ void history_tests_t::test_history_merge(void)
     const wcstring texts[count] = {L"History 1", L"History 2", L"History 3"};
     const wcstring alt_texts[count] = {L"History Alt 1", L"History Alt 2", L"History Alt 3"};
 
-    /* Make sure history is clear */
+    /* Make sure history is clear. Items are only saved when we say so, because a vacuum, which adding an item starts every so often, would rewrite the file under the other histories. */
     for (size_t i=0; i < count; i++)
     {
         hists[i]->clear();
+        hists[i]->disable_automatic_saving();
     }
 
     /* Make sure we don't add an item in the same second as we created the history */
@@ -3068,6 +4707,7 @@ void history_tests_t::test_history_merge(void)
     /* Make a new history. It should contain everything. The time_barrier() is so that the timestamp is newer, since we only pick up items whose timestamp is before the birth stamp. */
     time_barrier();
     history_t *everything = new history_t(name);
+    everything->disable_automatic_saving();
     for (size_t i=0; i < count; i++)
     {
         do_test(history_contains(everything, texts[i]));
@@ -3098,6 +4738,23 @@ void history_tests_t::test_history_merge(void)
         }
     }
 
+    /* Items appended by another history are picked up by scanning just what was appended, so the first history keeps its file state */
+    const wcstring appended_text = L"History Appended";
+    time_barrier();
+    everything->add(appended_text);
+    everything->save();
+    time_barrier();
+    do_test(! history_contains(hists[0], appended_text));
+    do_test(hists[0]->loaded_old);
+    const size_t old_item_count = hists[0]->old_items->offsets.size();
+    hists[0]->incorporate_external_changes();
+    do_test(hists[0]->loaded_old);
+    do_test(hists[0]->old_items->offsets.size() > old_item_count);
+    do_test(history_contains(hists[0], appended_text));
+    for (size_t j=0; j < count; j++)
+    {
+        do_test(history_contains(hists[0], texts[j]));
+    }
 
     /* Clean up */
     for (size_t i=0; i < 3; i++)
@@ -3108,6 +4765,418 @@ void history_tests_t::test_history_merge(void)
     delete everything; //not as scary as it looks
 }
 
+/* Checks that the given history contains exactly the given items, most recent last */
+static void test_history_items_equal(history_t *hist, const wcstring_list_t &items)
+{
+    for (size_t i=0; i < items.size(); i++)
+    {
+        history_item_t item = hist->item_at_index(items.size() - i);
+        if (item.str() != items.at(i))
+        {
+            err(L"Expected '%ls', found '%ls' at history index %lu", items.at(i).c_str(), item.str().c_str(), (unsigned long)(items.size() - i));
+        }
+    }
+    do_test(hist->item_at_index(items.size() + 1).empty());
+}
+
+void history_tests_t::test_history_index(void)
+{
+    say(L"Testing history index");
+    const wcstring name = L"index_test";
+    wcstring index_path;
+    do_test(path_get_config(index_path));
+    index_path.append(L"/index_test_history.idx");
+
+    history_t *hist = new history_t(name);
+    hist->clear();
+    do_test(waccess(index_path, F_OK) != 0);
+
+    /* Loading a history with enough unindexed items writes the index */
+    wcstring_list_t items;
+    for (size_t i=0; i < 200; i++)
+    {
+        items.push_back(format_string(L"index item %lu", (unsigned long)i));
+        hist->add(items.back());
+    }
+    hist->save();
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+    do_test(waccess(index_path, F_OK) == 0);
+
+    /* Append items beyond the indexed region; they must be picked up by scanning the tail */
+    time_barrier();
+    for (size_t i=0; i < 100; i++)
+    {
+        items.push_back(format_string(L"appended item %lu", (unsigned long)i));
+        hist->add(items.back());
+    }
+    hist->save();
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+
+    /* Searches over old items go through the trigram index */
+    history_search_t search1(*hist, L"item 15");
+    test_history_matches(search1, 12);
+    do_test(search1.current_string() == L"appended item 15");
+    history_search_t search2(*hist, L"index item 19", HISTORY_SEARCH_TYPE_PREFIX);
+    test_history_matches(search2, 11);
+    history_search_t search3(*hist, L"no such item");
+    test_history_matches(search3, 0);
+    delete hist;
+
+    /* A corrupt index must be ignored */
+    FILE *f = wfopen(index_path, "w");
+    do_test(f != NULL);
+    if (f)
+    {
+        fputs("fishidx1 garbage garbage garbage garbage garbage garbage garbage garbage", f);
+        fclose(f);
+    }
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+
+    hist->clear();
+    do_test(waccess(index_path, F_OK) != 0);
+    delete hist;
+}
+
+static wcstring_list_t history_item_strings(const history_item_list_t &items)
+{
+    wcstring_list_t result;
+    for (size_t i=0; i < items.size(); i++)
+    {
+        result.push_back(items.at(i).str());
+    }
+    return result;
+}
+
+void history_tests_t::test_history_prefix(void)
+{
+    say(L"Testing history prefix lookup");
+    const wcstring name = L"prefix_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+
+    /* Old items are looked up through the prefix index. Items used more often rank higher. */
+    const wchar_t * const old_items[] = {L"git status", L"git log", L"git status", L"git log", L"git status", L"git stash", L"ls"};
+    for (size_t i=0; i < sizeof old_items / sizeof *old_items; i++)
+    {
+        hist->add(old_items[i]);
+    }
+    hist->save();
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    const wchar_t * const expected1[] = {L"git status", L"git log", L"git stash"};
+    do_test(history_item_strings(hist->items_with_prefix(L"git", 10)) == wcstring_list_t(expected1, expected1 + 3));
+    const wchar_t * const expected2[] = {L"git status", L"git stash"};
+    do_test(history_item_strings(hist->items_with_prefix(L"git s", 10)) == wcstring_list_t(expected2, expected2 + 2));
+    do_test(hist->items_with_prefix(L"git", 1).size() == 1);
+    do_test(hist->items_with_prefix(L"gitk", 10).empty());
+
+    /* Rewriting the file merges duplicates but keeps their uses, in either format */
+    do_test(hist->set_file_format(history_type_fish_2_0));
+    do_test(history_item_strings(hist->items_with_prefix(L"git", 10)) == wcstring_list_t(expected1, expected1 + 3));
+    do_test(hist->set_file_format(history_type_fish_binary));
+    do_test(history_item_strings(hist->items_with_prefix(L"git", 10)) == wcstring_list_t(expected1, expected1 + 3));
+    do_test(hist->set_file_format(history_type_fish_2_0));
+
+    /* New items add to the counts of old items with the same contents and stand in for them, and deleted items are skipped */
+    hist->add(L"git stash");
+    hist->add(L"git stash --all");
+    hist->remove(L"git log");
+    const wchar_t * const expected3[] = {L"git status", L"git stash", L"git stash --all"};
+    const history_item_list_t found = hist->items_with_prefix(L"git", 10);
+    do_test(history_item_strings(found) == wcstring_list_t(expected3, expected3 + 3));
+    do_test(found.size() == 3 && found.at(1).timestamp() > found.at(0).timestamp());
+
+    hist->clear();
+    delete hist;
+}
+
+/* Searches the old items of the binary history test, which old items rule out by comparing their commands as they are stored */
+static void test_history_old_item_searches(history_t *hist)
+{
+    history_search_t contains_newline(*hist, L"\nwith a \\ sec");
+    test_history_matches(contains_newline, 100);
+    history_search_t contains_number(*hist, L"item 42\n");
+    test_history_matches(contains_number, 1);
+    history_search_t short_term(*hist, L"42");
+    test_history_matches(short_term, 1);
+    history_search_t prefix(*hist, L"binary item 9", HISTORY_SEARCH_TYPE_PREFIX);
+    test_history_matches(prefix, 11);
+    history_search_t missing(*hist, L"item 42\\", HISTORY_SEARCH_TYPE_CONTAINS);
+    test_history_matches(missing, 0);
+}
+
+void history_tests_t::test_history_binary(void)
+{
+    say(L"Testing binary history format");
+    const wcstring name = L"binary_test";
+    wcstring history_path;
+    do_test(path_get_config(history_path));
+    history_path.append(L"/binary_test_history");
+
+    history_t *hist = new history_t(name);
+    hist->clear();
+    wcstring_list_t items;
+    for (size_t i=0; i < 100; i++)
+    {
+        items.push_back(format_string(L"binary item %lu\nwith a \\ second line", (unsigned long)i));
+        history_item_t item(items.back(), time(NULL));
+        if (i % 2)
+            item.required_paths.push_back(L"/some/path");
+        hist->add(item);
+    }
+    do_test(hist->set_file_format(history_type_fish_binary));
+    delete hist;
+
+    /* Reading the file back must produce the same items */
+    time_barrier();
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+    do_test(hist->item_at_index(1).get_required_paths().size() == 1);
+    do_test(hist->item_at_index(2).get_required_paths().empty());
+    test_history_old_item_searches(hist);
+
+    /* Appending preserves the format */
+    items.push_back(L"appended binary item");
+    hist->add(items.back());
+    hist->save();
+    delete hist;
+
+    char magic[8] = {};
+    FILE *f = wfopen(history_path, "r");
+    do_test(f != NULL && fread(magic, 1, sizeof magic, f) == sizeof magic && ! memcmp(magic, "\0fishbin", sizeof magic));
+    if (f) fclose(f);
+
+    time_barrier();
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+
+    /* Converting back yields a text file with the same items */
+    do_test(hist->set_file_format(history_type_fish_2_0));
+    delete hist;
+    f = wfopen(history_path, "r");
+    do_test(f != NULL && fread(magic, 1, 6, f) == 6 && ! memcmp(magic, "- cmd:", 6));
+    if (f) fclose(f);
+
+    time_barrier();
+    hist = new history_t(name);
+    test_history_items_equal(hist, items);
+    test_history_old_item_searches(hist);
+    hist->clear();
+    delete hist;
+}
+
+void history_tests_t::test_history_file_detection(void)
+{
+    say(L"Testing history file detection");
+    if (system("mkdir -p /tmp/fish_file_detection/ && touch /tmp/fish_file_detection/a /tmp/fish_file_detection/b"))
+    {
+        err(L"mkdir failed");
+    }
+
+    history_t *hist = new history_t(L"file_detection_test");
+    hist->clear();
+
+    /* The first command starts a detection; the others are queued while it runs, and tested together after it */
+    const wchar_t * const commands[] =
+    {
+        L"ls /tmp/fish_file_detection/a /tmp/fish_file_detection/missing",
+        L"cat /tmp/fish_file_detection/b /tmp/fish_file_detection/a",
+        L"echo -n no paths here",
+        L"rm /tmp/fish_file_detection/missing",
+        L"touch /tmp/fish_file_detection/a"
+    };
+    for (size_t i=0; i < sizeof commands / sizeof *commands; i++)
+    {
+        hist->add_pending_with_file_detection(commands[i]);
+    }
+    hist->resolve_pending();
+
+    /* The completion of the first detection may start the second one, after the first drain stopped waiting */
+    iothread_drain_all();
+    iothread_drain_all();
+    do_test(! hist->file_detection_running);
+    do_test(hist->file_detection_queue.empty());
+    do_test(hist->disable_automatic_save_counter == 0);
+
+    const wchar_t * const expected[] =
+    {
+        L"/tmp/fish_file_detection/a",
+        L"",
+        L"",
+        L"/tmp/fish_file_detection/b /tmp/fish_file_detection/a",
+        L"/tmp/fish_file_detection/a"
+    };
+    for (size_t i=0; i < sizeof expected / sizeof *expected; i++)
+    {
+        history_item_t item = hist->item_at_index(i + 1);
+        wcstring paths;
+        for (size_t j=0; j < item.get_required_paths().size(); j++)
+        {
+            if (j > 0) paths.push_back(L' ');
+            paths.append(item.get_required_paths().at(j));
+        }
+        if (paths != expected[i])
+        {
+            err(L"Item '%ls' has paths '%ls', expected '%ls'", item.str().c_str(), paths.c_str(), expected[i]);
+        }
+    }
+
+    hist->clear();
+    delete hist;
+    if (system("rm -Rf /tmp/fish_file_detection"))
+    {
+        err(L"rm failed");
+    }
+}
+
+/* Searches a history over and over on a background thread, while the main thread changes it */
+struct history_snapshot_search_t
+{
+    history_t *history;
+    size_t searches;
+    size_t failures;
+};
+
+static int test_history_snapshot_search(history_snapshot_search_t *ctx)
+{
+    for (size_t i=0; i < 200; i++)
+    {
+        history_search_t search(*ctx->history, L"item two");
+        if (! search.go_backwards() || search.current_string() != L"old item two")
+            ctx->failures++;
+        if (ctx->history->items_with_prefix(L"old item", 10).size() != 2)
+            ctx->failures++;
+        ctx->searches++;
+    }
+    return 0;
+}
+
+void history_tests_t::test_history_snapshot(void)
+{
+    say(L"Testing history snapshots");
+    const wcstring name = L"snapshot_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+    hist->add(L"old item one");
+    hist->add(L"old item two");
+    hist->save();
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    hist->add(L"new item");
+
+    /* A snapshot is shared until the items change, and does not change with them */
+    shared_ptr<const history_snapshot_t> before = hist->snapshot();
+    do_test(before->size() == 3);
+    do_test(hist->snapshot() == before);
+    hist->add(L"newer item");
+    do_test(before->size() == 3);
+    do_test(before->item_at_index(1).str() == L"new item");
+    shared_ptr<const history_snapshot_t> after = hist->snapshot();
+    do_test(after != before);
+    do_test(after->size() == 4);
+    do_test(after->item_at_index(1).str() == L"newer item");
+
+    /* Old items stay readable after the history lets go of the file they are in, and deleted items go away once the file is rewritten */
+    hist->remove(L"old item one");
+    hist->save();
+    do_test(before->item_at_index(3).str() == L"old item one");
+    do_test(hist->snapshot()->size() == 3);
+    do_test(hist->snapshot()->item_at_index(3).str() == L"old item two");
+
+    /* Search while adding and saving. A search that finds the history busy uses the last published snapshot, so publish one with both old items first. */
+    hist->add(L"old item one");
+    do_test(hist->snapshot()->size() == 4);
+    history_snapshot_search_t ctx = {hist, 0, 0};
+    iothread_perform(test_history_snapshot_search, &ctx);
+    for (size_t i=0; i < 200; i++)
+    {
+        hist->add(format_string(L"racing item %lu", (unsigned long)i));
+        if (i % 20 == 0)
+            hist->save();
+    }
+    iothread_drain_all();
+    do_test(ctx.searches == 200);
+    do_test(ctx.failures == 0);
+
+    hist->clear();
+    delete hist;
+}
+
+void history_tests_t::test_history_vacuum(void)
+{
+    say(L"Testing background history vacuum");
+    const wcstring name = L"vacuum_test";
+    history_t *hist = new history_t(name);
+    hist->clear();
+
+    /* Avoid a randomly timed vacuum, then append a duplicate and force one */
+    hist->countdown_to_vacuum = 100;
+    hist->add(L"dup");
+    hist->add(L"other");
+    hist->countdown_to_vacuum = 0;
+    hist->add(L"dup");
+
+    /* This save may be deferred until the vacuum completes; save() waits for it */
+    hist->add(L"after vacuum");
+    hist->save();
+    do_test(! hist->vacuum_in_progress);
+    delete hist;
+
+    /* The duplicate must be gone from the file, and nothing lost */
+    time_barrier();
+    hist = new history_t(name);
+    wcstring_list_t expected;
+    expected.push_back(L"other");
+    expected.push_back(L"dup");
+    expected.push_back(L"after vacuum");
+    test_history_items_equal(hist, expected);
+
+    /* Duplicates added while saving is disabled are merged on save, and keep their uses */
+    hist->disable_automatic_saving();
+    hist->add(L"repeated");
+    hist->add(L"first");
+    hist->add(L"repeated");
+    hist->add(L"second");
+    hist->add(L"repeated");
+    hist->enable_automatic_saving();
+    do_test(hist->new_items.size() == 3);
+    do_test(hist->new_items.at(2).str() == L"repeated" && hist->new_items.at(2).get_use_count() == 3);
+    delete hist;
+
+    time_barrier();
+    hist = new history_t(name);
+    expected.clear();
+    expected.push_back(L"other");
+    expected.push_back(L"dup");
+    expected.push_back(L"after vacuum");
+    expected.push_back(L"first");
+    expected.push_back(L"second");
+    expected.push_back(L"repeated");
+    test_history_items_equal(hist, expected);
+    do_test(hist->item_at_index(1).get_use_count() == 3);
+
+    /* Running a command twice in a row merges it with itself, and counts both uses */
+    hist->add(L"twice");
+    hist->add(L"twice");
+    do_test(hist->item_at_index(1).str() == L"twice" && hist->item_at_index(1).get_use_count() == 2);
+    do_test(hist->item_at_index(2).str() == L"repeated");
+    hist->clear();
+    delete hist;
+}
+
 static bool install_sample_history(const wchar_t *name)
 {
     char command[512];
@@ -3310,6 +5379,46 @@ void history_tests_t::test_history_speed(void)
     delete hist;
 }
 
+/* Measure how much memory the tree of a large script takes, before and after compacting it */
+static void test_new_parser_memory(void)
+{
+    say(L"Measuring parse tree memory");
+    if (sizeof(parse_node_t) > 20)
+    {
+        err(L"Parse nodes have grown to %lu bytes", (unsigned long)sizeof(parse_node_t));
+    }
+
+    wcstring src;
+    for (size_t i=0; i < 2000; i++)
+    {
+        append_format(src, L"function f%lu --description 'Function %lu'\n", (unsigned long)i, (unsigned long)i);
+        src.append(L"    if test (count $argv) -gt 1; echo $argv[1] | string split / >/dev/null; else; set -l x a b c; end\n");
+        src.append(L"end\n");
+    }
+
+    double start = timef();
+    parse_node_tree_t tree;
+    if (! parse_tree_from_string(src, parse_flag_none, &tree, NULL))
+    {
+        err(L"Failed to parse the generated script");
+        return;
+    }
+    double parsed = timef();
+
+    const size_t used = tree.size() * sizeof(parse_node_t);
+    const size_t reserved = tree.capacity() * sizeof(parse_node_t);
+    tree.compact();
+    const size_t compacted = tree.capacity() * sizeof(parse_node_t);
+    if (compacted != used)
+    {
+        err(L"Compacted tree keeps %lu bytes for %lu bytes of nodes", (unsigned long)compacted, (unsigned long)used);
+    }
+
+    say(L"%lu lines: %lu nodes of %lu bytes, %lu KB reserved, %lu KB after compacting, parsed in %.0f ms",
+        (unsigned long)(2000 * 3), (unsigned long)tree.size(), (unsigned long)sizeof(parse_node_t),
+        (unsigned long)(reserved / 1024), (unsigned long)(compacted / 1024), (parsed - start) * 1000);
+}
+
 static void test_new_parser_correctness(void)
 {
     say(L"Testing new parser!");
@@ -3984,6 +6093,54 @@ static void test_highlighting(void)
     }
 }
 
+/* Highlights the text after highlighting previous, so that the unchanged statements of previous may be reused */
+static std::vector<highlight_spec_t> highlight_after(const wcstring &previous, const wcstring &text)
+{
+    std::vector<highlight_spec_t> previous_colors(previous.size());
+    highlight_shell(previous, previous_colors, previous.size(), NULL, env_vars_snapshot_t());
+    std::vector<highlight_spec_t> colors(text.size());
+    highlight_shell(text, colors, text.size(), NULL, env_vars_snapshot_t());
+    return colors;
+}
+
+static void test_highlighting_incremental(void)
+{
+    say(L"Testing incremental syntax highlighting");
+
+    /* Pairs of a command line and an edit of it */
+    const wchar_t * const edits[][2] =
+    {
+        {L"ls /tmp; echo hello", L"ls /tmp; echo hello world"},
+        {L"echo a | cat; command ls", L"echo ab | cat; command ls"},
+        {L"for i in 1 2; echo $i; end", L"for i in 1 2 3; echo $i; end"},
+        {L"echo (ls); fish_test_nonexistent_command", L"echo (ls) ; fish_test_nonexistent_command"},
+        {L"ls; builtin ls", L"ls; ls"},
+        {L"ls; builtin ls", L"ls; builtin ls; ls"},
+        {L"ls; echo 'x", L"ls; echo 'x'"},
+        {L"cd /tmp; echo foo", L"cd /tmpx; echo foo"},
+        {L"echo foo\nls\nfish_test_nonexistent_command", L"echo fo\nls\nfish_test_nonexistent_command"}
+    };
+
+    for (size_t i=0; i < sizeof edits / sizeof *edits; i++)
+    {
+        const wcstring before = edits[i][0], after = edits[i][1];
+
+        /* Highlighting after something unrelated colors everything from scratch */
+        const std::vector<highlight_spec_t> expected = highlight_after(L"true", after);
+        const std::vector<highlight_spec_t> actual = highlight_after(before, after);
+        if (actual != expected)
+        {
+            err(L"Incremental highlighting of '%ls' after '%ls' differs from highlighting it from scratch", after.c_str(), before.c_str());
+        }
+
+        /* The same in reverse */
+        if (highlight_after(after, before) != highlight_after(L"true", before))
+        {
+            err(L"Incremental highlighting of '%ls' after '%ls' differs from highlighting it from scratch", before.c_str(), after.c_str());
+        }
+    }
+}
+
 static void test_wcstring_tok(void)
 {
     say(L"Testing wcstring_tok");
@@ -4062,40 +6219,67 @@ int main(int argc, char **argv)
     signal_reset_handlers();
 
     if (should_test_function("highlighting")) test_highlighting();
+    if (should_test_function("highlighting")) test_highlighting_incremental();
     if (should_test_function("new_parser_ll2")) test_new_parser_ll2();
     if (should_test_function("new_parser_fuzzing")) test_new_parser_fuzzing(); //fuzzing is expensive
     if (should_test_function("new_parser_correctness")) test_new_parser_correctness();
+    if (should_test_function("new_parser_memory")) test_new_parser_memory();
     if (should_test_function("new_parser_ad_hoc")) test_new_parser_ad_hoc();
     if (should_test_function("new_parser_errors")) test_new_parser_errors();
     if (should_test_function("error_messages")) test_error_messages();
     if (should_test_function("escape")) test_unescape_sane();
     if (should_test_function("escape")) test_escape_crazy();
+    if (should_test_function("escape")) test_escape_runs();
+    if (should_test_function("intern")) test_intern();
     if (should_test_function("format")) test_format();
+    if (should_test_function("wcwidth")) test_wcwidth();
+    if (should_test_function("osc52")) test_osc52();
     if (should_test_function("convert")) test_convert();
     if (should_test_function("convert_nulls")) test_convert_nulls();
     if (should_test_function("tok")) test_tok();
     if (should_test_function("iothread")) test_iothread();
+    if (should_test_function("iothread_priority")) test_iothread_priority();
+    if (should_test_function("job_staleness")) test_thread_job_staleness();
+    if (should_test_function("job_ids")) test_job_ids();
     if (should_test_function("parser")) test_parser();
+    if (should_test_function("function_parse_cache")) test_function_parse_cache();
+    if (should_test_function("cmdsub_output")) test_cmdsub_output();
+    if (should_test_function("io_chain")) test_io_chain();
     if (should_test_function("cancellation")) test_cancellation();
+    if (should_test_function("signal_block")) test_signal_block();
     if (should_test_function("indents")) test_indents();
     if (should_test_function("utils")) test_utils();
     if (should_test_function("utf8")) test_utf8();
+    if (should_test_function("ascii_fast_paths")) test_ascii_fast_paths();
     if (should_test_function("escape_sequences")) test_escape_sequences();
     if (should_test_function("lru")) test_lru();
     if (should_test_function("expand")) test_expand();
+    if (should_test_function("expand")) test_expand_recursive_walk();
+    if (should_test_function("wildcard_match")) test_wildcard_match();
     if (should_test_function("fuzzy_match")) test_fuzzy_match();
     if (should_test_function("abbreviations")) test_abbreviations();
     if (should_test_function("test")) test_test();
     if (should_test_function("path")) test_path();
+    if (should_test_function("wutil_paths")) test_wutil_paths();
+    if (should_test_function("path_cache")) test_path_cache();
+    if (should_test_function("export_array")) test_export_array();
+    if (should_test_function("env_scopes")) test_env_scopes();
+    if (should_test_function("env_publish")) test_env_publish();
     if (should_test_function("pager_navigation")) test_pager_navigation();
+    if (should_test_function("pager_filter")) test_pager_filter();
     if (should_test_function("word_motion")) test_word_motion();
     if (should_test_function("is_potential_path")) test_is_potential_path();
+    if (should_test_function("is_potential_path")) test_paths_are_valid();
     if (should_test_function("colors")) test_colors();
     if (should_test_function("complete")) test_complete();
+    if (should_test_function("complete")) test_complete_command_descriptions();
     if (should_test_function("input")) test_input();
     if (should_test_function("universal")) test_universal();
     if (should_test_function("universal")) test_universal_callbacks();
+    if (should_test_function("universal")) test_universal_reread();
     if (should_test_function("notifiers")) test_universal_notifiers();
+    if (should_test_function("autoload")) test_autoload_builtin_scripts();
+    if (should_test_function("autoload")) test_autoload_directory_listing();
     if (should_test_function("completion_insertions")) test_completion_insertions();
     if (should_test_function("autosuggestion_ignores")) test_autosuggestion_ignores();
     if (should_test_function("autosuggestion_combining")) test_autosuggestion_combining();
@@ -4105,6 +6289,12 @@ int main(int argc, char **argv)
     if (should_test_function("history_merge")) history_tests_t::test_history_merge();
     if (should_test_function("history_races")) history_tests_t::test_history_races();
     if (should_test_function("history_formats")) history_tests_t::test_history_formats();
+    if (should_test_function("history_index")) history_tests_t::test_history_index();
+    if (should_test_function("history_prefix")) history_tests_t::test_history_prefix();
+    if (should_test_function("history_binary")) history_tests_t::test_history_binary();
+    if (should_test_function("history_vacuum")) history_tests_t::test_history_vacuum();
+    if (should_test_function("history_file_detection")) history_tests_t::test_history_file_detection();
+    if (should_test_function("history_snapshot")) history_tests_t::test_history_snapshot();
     //history_tests_t::test_history_speed();
 
     say(L"Encountered %d errors in low-level tests", err_count);
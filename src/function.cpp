@@ -13,7 +13,8 @@
 #include <pthread.h>
 #include <map>
 #include <set>
-#include <dirent.h>
+#include <algorithm>
+#include <vector>
 #include <stddef.h>
 #include <string>
 #include <utility>
@@ -22,6 +23,7 @@
 #include "fallback.h" // IWYU pragma: keep
 
 #include "autoload.h"
+#include "builtin_scripts.h"
 #include "function.h"
 #include "common.h"
 #include "intern.h"
@@ -29,6 +31,7 @@
 #include "reader.h"
 #include "parser_keywords.h"
 #include "env.h"
+#include "path.h"
 
 /**
    Table containing all functions
@@ -55,7 +58,7 @@ public:
 static function_autoload_t function_autoloader;
 
 /** Constructor */
-function_autoload_t::function_autoload_t() : autoload_t(L"fish_function_path", NULL, 0)
+function_autoload_t::function_autoload_t() : autoload_t(L"fish_function_path", internal_function_scripts, internal_function_scripts_count, L"functions")
 {
 }
 
@@ -103,45 +106,39 @@ static int load(const wcstring &name)
 }
 
 /**
-   Insert a list of all dynamically loaded functions into the
-   specified list.
+   Append the names of all the functions that could be autoloaded to the
+   specified list. The directory listings come from path_get_dir_entries, which
+   caches them until the directories change, so this does not list every
+   directory each time.
 */
-static void autoload_names(std::set<wcstring> &names, int get_hidden)
+static void autoload_names(wcstring_list_t &names, int get_hidden)
 {
-    size_t i;
-
-    const env_var_t path_var_wstr =  env_get_string(L"fish_function_path");
-    if (path_var_wstr.missing())
+    const env_var_t path_var = env_get_string(L"fish_function_path");
+    if (path_var.missing())
         return;
-    const wchar_t *path_var = path_var_wstr.c_str();
 
     wcstring_list_t path_list;
-
     tokenize_variable_array(path_var, path_list);
-    for (i=0; i<path_list.size(); i++)
+
+    std::vector<path_dir_entry_t> entries;
+    for (size_t i=0; i<path_list.size(); i++)
     {
-        const wcstring &ndir_str = path_list.at(i);
-        const wchar_t *ndir = (wchar_t *)ndir_str.c_str();
-        DIR *dir = wopendir(ndir);
-        if (!dir)
+        entries.clear();
+        if (! path_get_dir_entries(path_list.at(i), wcstring(), &entries))
             continue;
 
-        wcstring name;
-        while (wreaddir(dir, name))
+        for (size_t j=0; j < entries.size(); j++)
         {
-            const wchar_t *fn = name.c_str();
-            const wchar_t *suffix;
-            if (!get_hidden && fn[0] == L'_')
+            const wcstring &name = entries.at(j).name;
+            if (!get_hidden && name.at(0) == L'_')
                 continue;
 
-            suffix = wcsrchr(fn, L'.');
-            if (suffix && (wcscmp(suffix, L".fish") == 0))
+            const size_t suffix = name.rfind(L'.');
+            if (suffix != wcstring::npos && name.compare(suffix, wcstring::npos, L".fish") == 0)
             {
-                wcstring name(fn, suffix - fn);
-                names.insert(name);
+                names.push_back(wcstring(name, 0, suffix));
             }
         }
-        closedir(dir);
     }
 }
 
@@ -185,7 +182,8 @@ function_info_t::function_info_t(const function_info_t &data, const wchar_t *fil
     named_arguments(data.named_arguments),
     inherit_vars(data.inherit_vars),
     is_autoload(autoload),
-    shadows(data.shadows)
+    shadows(data.shadows),
+    parsed_definition(data.parsed_definition)
 {
 }
 
@@ -288,6 +286,34 @@ bool function_get_definition(const wcstring &name, wcstring *out_definition)
     return func != NULL;
 }
 
+bool function_get_parsed_definition(const wcstring &name, wcstring *out_definition, shared_ptr<const parse_node_tree_t> *out_tree)
+{
+    scoped_lock lock(functions_lock);
+    const function_info_t *func = function_get(name);
+    if (func == NULL)
+        return false;
+
+    if (func->parsed_definition.get() == NULL)
+    {
+        parse_node_tree_t *tree = new parse_node_tree_t();
+        if (parse_tree_from_string(func->definition, parse_flag_none, tree, NULL))
+        {
+            tree->compact();
+            func->parsed_definition.reset(tree);
+        }
+        else
+        {
+            delete tree;
+        }
+    }
+
+    if (out_definition)
+        out_definition->assign(func->definition);
+    if (out_tree)
+        *out_tree = func->parsed_definition;
+    return true;
+}
+
 wcstring_list_t function_get_named_arguments(const wcstring &name)
 {
     scoped_lock lock(functions_lock);
@@ -354,7 +380,7 @@ bool function_copy(const wcstring &name, const wcstring &new_name)
 
 wcstring_list_t function_get_names(int get_hidden)
 {
-    std::set<wcstring> names;
+    wcstring_list_t names;
     scoped_lock lock(functions_lock);
     autoload_names(names, get_hidden);
 
@@ -368,9 +394,40 @@ wcstring_list_t function_get_names(int get_hidden)
         {
             if (name.empty() || name.at(0) == L'_') continue;
         }
-        names.insert(name);
+        names.push_back(name);
+    }
+
+    /* Functions that are loaded are usually in the path too, so sort out the duplicates */
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+}
+
+void function_get_memory_stats(std::vector<memory_stats_t> *out)
+{
+    memory_stats_t stats(L"functions");
+    scoped_lock lock(functions_lock);
+    for (function_map_t::const_iterator iter = loaded_functions.begin(); iter != loaded_functions.end(); ++iter)
+    {
+        const function_info_t &info = iter->second;
+        stats.entries++;
+        stats.bytes += TREE_NODE_OVERHEAD + sizeof *iter + wcstring_heap_size(iter->first);
+        stats.bytes += wcstring_heap_size(info.definition) + wcstring_heap_size(info.description);
+        stats.bytes += info.named_arguments.capacity() * sizeof(wcstring);
+        for (size_t i=0; i < info.named_arguments.size(); i++)
+        {
+            stats.bytes += wcstring_heap_size(info.named_arguments.at(i));
+        }
+        for (std::map<wcstring, env_var_t>::const_iterator var = info.inherit_vars.begin(); var != info.inherit_vars.end(); ++var)
+        {
+            stats.bytes += TREE_NODE_OVERHEAD + sizeof *var + wcstring_heap_size(var->first) + wcstring_heap_size(var->second);
+        }
+        if (info.parsed_definition)
+        {
+            stats.bytes += sizeof(parse_node_tree_t) + info.parsed_definition->capacity() * sizeof(parse_node_t);
+        }
     }
-    return wcstring_list_t(names.begin(), names.end());
+    out->push_back(stats);
 }
 
 const wchar_t *function_get_definition_file(const wcstring &name)
@@ -16,6 +16,8 @@
 #include "common.h"
 #include "event.h"
 #include "env.h"
+#include "io.h"
+#include "parse_tree.h"
 
 class parser_t;
 
@@ -92,6 +94,9 @@ public:
 
     /** Set to true if invoking this function shadows the variables of the underlying function. */
     const bool shadows;
+
+    /** The parse tree of the definition, shared by all invocations. It is created on first use. Redefining the function replaces the whole function_info_t, and with it the tree. */
+    mutable shared_ptr<const parse_node_tree_t> parsed_definition;
 };
 
 
@@ -114,6 +119,11 @@ void function_remove(const wcstring &name);
 */
 bool function_get_definition(const wcstring &name, wcstring *out_definition);
 
+/**
+   Returns true if the function with the name name exists, and gets its definition and the parse tree of the definition. The tree is parsed on first use and then reused until the function is redefined. If the definition does not parse, the tree is NULL; evaluating the definition as a string then reports the errors.
+*/
+bool function_get_parsed_definition(const wcstring &name, wcstring *out_definition, shared_ptr<const parse_node_tree_t> *out_tree);
+
 /**
    Returns by reference the description of the function with the name \c name.
    Returns true if the function exists and has a nonempty description, false if it does not.
@@ -136,12 +146,19 @@ int function_exists(const wcstring &name);
 int function_exists_no_autoload(const wcstring &name, const env_vars_snapshot_t &vars);
 
 /**
-   Returns all function names.
+   Returns all function names, sorted. The function directories are listed
+   with path_get_dir_entries, whose listings may be up to a second old; call
+   path_cache_recheck first to see files added just now.
 
    \param get_hidden whether to include hidden functions, i.e. ones starting with an underscore
 */
 wcstring_list_t function_get_names(int get_hidden);
 
+/**
+   Appends an estimate of the memory held by the loaded functions to out, including their definitions and the parse trees made of them
+*/
+void function_get_memory_stats(std::vector<memory_stats_t> *out);
+
 /**
    Returns tha absolute path of the file where the specified function
    was defined. Returns 0 if the file was defined on the commandline.
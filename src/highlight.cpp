@@ -30,10 +30,19 @@
 #include "wildcard.h"
 #include "path.h"
 #include "history.h"
+#include "reader.h"
 #include "parse_tree.h"
+#include "lru.h"
 
 #define CURSOR_POSITION_INVALID ((size_t)(-1))
 
+/**
+   The number of seconds for which the colors of a statement may be reused
+   by a later highlight of an edited command line. Past that, the statement
+   is colored again, so that e.g. newly installed commands are noticed.
+*/
+#define HIGHLIGHT_STATEMENT_CACHE_MAX_AGE 2.0
+
 /**
    Number of elements in the highlight_var array
 */
@@ -111,29 +120,169 @@ static wcstring apply_working_directory(const wcstring &path, const wcstring &wo
     }
 }
 
-/* Determine if the filesystem containing the given fd is case insensitive. */
-typedef std::map<wcstring, bool> case_sensitivity_cache_t;
-bool fs_is_case_insensitive(const wcstring &path, int fd, case_sensitivity_cache_t &case_sensitivity_cache)
+/* Determine if the filesystem containing the given fd is case insensitive. A -1 value from fpathconf means error (so assume case sensitive), a 1 value means case sensitive, and a 0 value means case insensitive. If _PC_CASE_SENSITIVE is not defined, assume case sensitive. */
+static bool fs_is_case_insensitive(int fd)
 {
-    /* If _PC_CASE_SENSITIVE is not defined, assume case sensitive */
-    bool result = false;
 #ifdef _PC_CASE_SENSITIVE
-    /* Try the cache first */
-    case_sensitivity_cache_t::iterator cache = case_sensitivity_cache.find(path);
-    if (cache != case_sensitivity_cache.end())
+    return fpathconf(fd, _PC_CASE_SENSITIVE) == 0;
+#else
+    return false;
+#endif
+}
+
+/* An entry of a directory listing. Whether it is a directory is only known up front if readdir told us; symlinks and entries of unknown type are resolved with stat when someone asks. */
+struct dir_listing_entry_t
+{
+    wcstring name;
+    enum { entry_not_dir, entry_dir, entry_unknown } kind;
+};
+
+/* The entries of a directory, in readdir order, as read while the directory had the given mtime. The directory is the node's key. */
+class dir_listing_node_t : public lru_node_t
+{
+public:
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+
+    /* When we read the directory. An mtime in the same second says nothing about changes made after we read it, so such a listing is not trusted. */
+    time_t listed_at;
+
+    bool case_insensitive;
+    std::vector<dir_listing_entry_t> entries;
+
+    dir_listing_node_t(const wcstring &dir) : lru_node_t(dir), dev(0), ino(0), mtime(0), listed_at(0), case_insensitive(false) {}
+
+    bool is_current(const struct stat &buf) const
+    {
+        return buf.st_dev == dev && buf.st_ino == ino && buf.st_mtime == mtime && mtime < listed_at;
+    }
+};
+
+class dir_listing_cache_t : public lru_cache_t<dir_listing_node_t>
+{
+    virtual void node_was_evicted(dir_listing_node_t *node)
     {
-        /* Use the cached value */
-        result = cache->second;
+        delete node;
+    }
+
+public:
+    dir_listing_cache_t() : lru_cache_t<dir_listing_node_t>(64) {}
+};
+
+/* Directories listed while highlighting and validating autosuggestions. Typing a path asks about the same directories on every keystroke, so they are only reread when they change. */
+static dir_listing_cache_t s_dir_listings;
+static pthread_mutex_t s_dir_listings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads the directory dir_name, whose stat is buf. Returns NULL if the directory can't be read or the job went stale while reading it. */
+static dir_listing_node_t *read_dir_listing(const wcstring &dir_name, const struct stat &buf)
+{
+    DIR *dir = wopendir(dir_name);
+    if (! dir)
+        return NULL;
+
+    dir_listing_node_t *node = new dir_listing_node_t(dir_name);
+    node->dev = buf.st_dev;
+    node->ino = buf.st_ino;
+    node->mtime = buf.st_mtime;
+    node->listed_at = time(NULL);
+    node->case_insensitive = fs_is_case_insensitive(dirfd(dir));
+
+    dir_listing_entry_t entry;
+    mode_t type = 0;
+    while (wreaddir_with_type(dir, entry.name, &type))
+    {
+        if (reader_thread_job_is_stale())
+        {
+            delete node;
+            node = NULL;
+            break;
+        }
+        if (type == S_IFDIR)
+            entry.kind = dir_listing_entry_t::entry_dir;
+        else if (type == 0 || type == S_IFLNK)
+            entry.kind = dir_listing_entry_t::entry_unknown;
+        else
+            entry.kind = dir_listing_entry_t::entry_not_dir;
+        node->entries.push_back(entry);
+    }
+    closedir(dir);
+    return node;
+}
+
+/* Looks in the directory dir_name for the first entry whose name base_name prefixes, that is also a directory if require_dir is set. Returns by reference its name, whether it is a directory (only determined if require_dir is set), and whether the directory's filesystem is case insensitive (in which case so was the comparison). */
+static bool find_dir_entry_with_prefix(const wcstring &dir_name, const wcstring &base_name, bool require_dir, wcstring *out_name, bool *out_is_dir, bool *out_case_insensitive)
+{
+    struct stat buf;
+    if (wstat(dir_name, &buf) != 0 || ! S_ISDIR(buf.st_mode))
+        return false;
+
+    scoped_lock locker(s_dir_listings_lock);
+    dir_listing_node_t *node = s_dir_listings.get_node(dir_name);
+    if (node != NULL && ! node->is_current(buf))
+    {
+        s_dir_listings.evict_node(dir_name);
+        node = NULL;
+    }
+    if (node == NULL)
+    {
+        /* Don't hold the lock while reading the directory. Someone else may have added it by the time we are done; if so, use theirs. */
+        locker.unlock();
+        dir_listing_node_t *new_node = read_dir_listing(dir_name, buf);
+        if (new_node == NULL)
+            return false;
+        locker.lock();
+        if (! s_dir_listings.add_node(new_node))
+        {
+            delete new_node;
+        }
+        node = s_dir_listings.get_node(dir_name);
+        if (node == NULL)
+            return false;
+    }
+
+    /* Determine which function to call to check for prefixes */
+    bool (*prefix_func)(const wcstring &, const wcstring &);
+    if (node->case_insensitive)
+    {
+        prefix_func = string_prefixes_string_case_insensitive;
     }
     else
     {
-        /* Ask the system. A -1 value means error (so assume case sensitive), a 1 value means case sensitive, and a 0 value means case insensitive */
-        long ret = fpathconf(fd, _PC_CASE_SENSITIVE);
-        result = (ret == 0);
-        case_sensitivity_cache[path] = result;
+        prefix_func = string_prefixes_string;
     }
-#endif
-    return result;
+
+    for (size_t i=0; i < node->entries.size(); i++)
+    {
+        const dir_listing_entry_t &entry = node->entries.at(i);
+        if (! prefix_func(base_name, entry.name))
+            continue;
+
+        bool is_dir = false;
+        if (require_dir)
+        {
+            /* Symlinks to directories count as directories, but the directory's mtime does not tell us if a link was retargeted, so always resolve them */
+            if (entry.kind == dir_listing_entry_t::entry_unknown)
+            {
+                wcstring full_path = dir_name;
+                append_path_component(full_path, entry.name);
+                struct stat entry_buf;
+                is_dir = (wstat(full_path, &entry_buf) == 0 && S_ISDIR(entry_buf.st_mode));
+            }
+            else
+            {
+                is_dir = (entry.kind == dir_listing_entry_t::entry_dir);
+            }
+            if (! is_dir)
+                continue;
+        }
+
+        *out_name = entry.name;
+        *out_is_dir = is_dir;
+        *out_case_insensitive = node->case_insensitive;
+        return true;
+    }
+    return false;
 }
 
 /* Tests whether the specified string cpath is the prefix of anything we could cd to. directories is a list of possible parent directories (typically either the working directory, or the cdpath). This does I/O!
@@ -194,10 +343,7 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
         /* Don't test the same path multiple times, which can happen if the path is absolute and the CDPATH contains multiple entries */
         std::set<wcstring> checked_paths;
 
-        /* Keep a cache of which paths / filesystems are case sensitive */
-        case_sensitivity_cache_t case_sensitivity_cache;
-
-        for (size_t wd_idx = 0; wd_idx < directories.size() && ! result; wd_idx++)
+        for (size_t wd_idx = 0; wd_idx < directories.size() && ! result && ! reader_thread_job_is_stale(); wd_idx++)
         {
             const wcstring &wd = directories.at(wd_idx);
 
@@ -223,8 +369,6 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
             }
             else
             {
-                DIR *dir = NULL;
-
                 /* We do not end with a slash; it does not have to be a directory */
                 const wcstring dir_name = wdirname(abs_path);
                 const wcstring base_name = wbasename(abs_path);
@@ -234,56 +378,44 @@ bool is_potential_path(const wcstring &const_path, const wcstring_list_t &direct
                     if (out_path)
                         *out_path = clean_path;
                 }
-                else if ((dir = wopendir(dir_name)))
+                else
                 {
-                    // We opened the dir_name; look for a string where the base name prefixes it
+                    // Look for an entry of dir_name that the base name prefixes
                     wcstring ent;
-
-                    // Check if we're case insensitive
-                    bool case_insensitive = fs_is_case_insensitive(dir_name, dirfd(dir), case_sensitivity_cache);
-
-                    // Don't ask for the is_dir value unless we care, because it can cause extra filesystem acces */
-                    bool is_dir = false;
-                    while (wreaddir_resolving(dir, dir_name, ent, require_dir ? &is_dir : NULL))
+                    bool is_dir = false, case_insensitive = false;
+                    if (find_dir_entry_with_prefix(dir_name, base_name, require_dir, &ent, &is_dir, &case_insensitive))
                     {
-
-                        /* Determine which function to call to check for prefixes */
-                        bool (*prefix_func)(const wcstring &, const wcstring &);
-                        if (case_insensitive)
+                        result = true;
+                        if (out_path)
                         {
-                            prefix_func = string_prefixes_string_case_insensitive;
-                        }
-                        else
-                        {
-                            prefix_func = string_prefixes_string;
-                        }
+                            /* We want to return the path in the same "form" as it was given. Take the given path, get its basename. Append that to the output if the basename actually prefixes the path (which it won't if the given path contains no slashes), and isn't a slash (so we don't duplicate slashes). Then append the directory entry. */
 
-                        if (prefix_func(base_name, ent) && (! require_dir || is_dir))
-                        {
-                            result = true;
-                            if (out_path)
+                            bool (*prefix_func)(const wcstring &, const wcstring &);
+                            if (case_insensitive)
                             {
-                                /* We want to return the path in the same "form" as it was given. Take the given path, get its basename. Append that to the output if the basename actually prefixes the path (which it won't if the given path contains no slashes), and isn't a slash (so we don't duplicate slashes). Then append the directory entry. */
+                                prefix_func = string_prefixes_string_case_insensitive;
+                            }
+                            else
+                            {
+                                prefix_func = string_prefixes_string;
+                            }
 
-                                out_path->clear();
-                                const wcstring path_base = wdirname(const_path);
+                            out_path->clear();
+                            const wcstring path_base = wdirname(const_path);
 
 
-                                if (prefix_func(path_base, const_path))
-                                {
-                                    out_path->append(path_base);
-                                    if (! string_suffixes_string(L"/", *out_path))
-                                        out_path->push_back(L'/');
-                                }
-                                out_path->append(ent);
-                                /* We actually do want a trailing / for directories, since it makes autosuggestion a bit nicer */
-                                if (is_dir)
+                            if (prefix_func(path_base, const_path))
+                            {
+                                out_path->append(path_base);
+                                if (! string_suffixes_string(L"/", *out_path))
                                     out_path->push_back(L'/');
                             }
-                            break;
+                            out_path->append(ent);
+                            /* We actually do want a trailing / for directories, since it makes autosuggestion a bit nicer */
+                            if (is_dir)
+                                out_path->push_back(L'/');
                         }
                     }
-                    closedir(dir);
                 }
             }
         }
@@ -352,7 +484,20 @@ bool plain_statement_get_expanded_command(const wcstring &src, const parse_node_
 }
 
 
-rgb_color_t highlight_get_color(highlight_spec_t highlight, bool is_background)
+/**
+   Colors resolved by highlight_get_color, keyed by the highlight spec and whether it was asked for as a background. A repaint asks for the same few colors over and over; this saves looking up and parsing their variables each time.
+*/
+typedef std::map<std::pair<highlight_spec_t, bool>, rgb_color_t> highlight_color_cache_t;
+static highlight_color_cache_t s_highlight_color_cache;
+
+void highlight_invalidate_colors()
+{
+    ASSERT_IS_MAIN_THREAD();
+    s_highlight_color_cache.clear();
+}
+
+/* Resolves the color from the variables */
+static rgb_color_t highlight_resolve_color(highlight_spec_t highlight, bool is_background)
 {
     rgb_color_t result = rgb_color_t::normal();
 
@@ -402,6 +547,20 @@ rgb_color_t highlight_get_color(highlight_spec_t highlight, bool is_background)
     return result;
 }
 
+rgb_color_t highlight_get_color(highlight_spec_t highlight, bool is_background)
+{
+    ASSERT_IS_MAIN_THREAD();
+    const highlight_color_cache_t::key_type key(highlight, is_background);
+    highlight_color_cache_t::const_iterator iter = s_highlight_color_cache.find(key);
+    if (iter != s_highlight_color_cache.end())
+    {
+        return iter->second;
+    }
+    const rgb_color_t result = highlight_resolve_color(highlight, is_background);
+    s_highlight_color_cache.insert(std::make_pair(key, result));
+    return result;
+}
+
 
 static bool has_expand_reserved(const wcstring &str)
 {
@@ -920,6 +1079,56 @@ static void color_argument_internal(const wcstring &buffstr, std::vector<highlig
 }
 
 /* Syntax highlighter helper */
+/** The colors computed for a plain statement, which a later highlight may reuse if the statement is unchanged */
+struct highlight_cached_statement_t
+{
+    /** Where the statement started in the command line */
+    size_t source_start;
+
+    /** The decoration of the statement, which affects whether its command is valid */
+    enum parse_statement_decoration_t decoration;
+
+    /** When the colors were computed */
+    double when;
+
+    /** The colors, one per character of the statement */
+    std::vector<highlight_spec_t> colors;
+};
+
+/**
+   The result of the last completed highlight_shell call. Coloring plain
+   statements is what requires I/O, so when the command line is edited,
+   the statements outside the edited region reuse their colors from here
+   instead of being colored again.
+*/
+struct highlight_cache_t
+{
+    /** The command line that was highlighted */
+    wcstring buff;
+
+    /** The working directory it was highlighted in */
+    wcstring working_directory;
+
+    /** The values of env_vars_snapshot_t::highlighting_keys it was highlighted with */
+    std::vector<env_var_t> var_values;
+
+    /** The statements whose colors may be reused, ordered by source_start */
+    std::vector<highlight_cached_statement_t> statements;
+};
+
+static pthread_mutex_t s_highlight_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static highlight_cache_t s_highlight_cache;
+
+static bool cached_statement_starts_before(const highlight_cached_statement_t &statement, size_t pos)
+{
+    return statement.source_start < pos;
+}
+
+static bool cached_statements_ordered(const highlight_cached_statement_t &a, const highlight_cached_statement_t &b)
+{
+    return a.source_start < b.source_start;
+}
+
 class highlighter_t
 {
     /* The string we're highlighting. Note this is a reference memmber variable (to avoid copying)! We must not outlive this! */
@@ -944,6 +1153,27 @@ class highlighter_t
     /* The parse tree of the buff */
     parse_node_tree_t parse_tree;
 
+    /* A previous highlight whose statement colors we may reuse, or NULL */
+    const highlight_cache_t *previous;
+
+    /* The lengths of the common prefix and suffix of buff and previous->buff */
+    size_t unchanged_prefix_length, unchanged_suffix_length;
+
+    /* The statements colored (or reused) by this highlight, for a later highlight to reuse */
+    std::vector<highlight_cached_statement_t> statement_colors;
+
+    /* Color a plain statement: its command, arguments and redirections */
+    void color_plain_statement(const parse_node_t &node);
+
+    /* Copy the colors of a plain statement from the previous highlight if it is unchanged. Returns whether it did. */
+    bool reuse_plain_statement_colors(const parse_node_t &node, enum parse_statement_decoration_t decoration);
+
+    /* Whether the cursor is in or just after the given node. The colors of such nodes depend on the cursor position. */
+    bool node_contains_cursor(const parse_node_t &node) const
+    {
+        return cursor_pos >= node.source_start && cursor_pos - node.source_start <= node.source_length;
+    }
+
     /* Color an argument */
     void color_argument(const parse_node_t &node);
 
@@ -965,16 +1195,83 @@ class highlighter_t
 public:
 
     /* Constructor */
-    highlighter_t(const wcstring &str, size_t pos, const env_vars_snapshot_t &ev, const wcstring &wd, bool can_do_io) : buff(str), cursor_pos(pos), vars(ev), io_ok(can_do_io), working_directory(wd), color_array(str.size())
+    highlighter_t(const wcstring &str, size_t pos, const env_vars_snapshot_t &ev, const wcstring &wd, bool can_do_io) : buff(str), cursor_pos(pos), vars(ev), io_ok(can_do_io), working_directory(wd), color_array(str.size()), previous(NULL), unchanged_prefix_length(0), unchanged_suffix_length(0)
     {
         /* Parse the tree */
         parse_tree_from_string(buff, parse_flag_continue_after_error | parse_flag_include_comments, &this->parse_tree, NULL);
     }
 
+    /* Reuse the colors of unchanged statements from the given previous highlight, which must outlive us */
+    void set_previous_highlight(const highlight_cache_t *prev);
+
     /* Perform highlighting, returning an array of colors */
     const color_array_t &highlight();
+
+    /* The statements colored by highlight(), for a later highlight to reuse */
+    std::vector<highlight_cached_statement_t> &get_statement_colors()
+    {
+        return statement_colors;
+    }
 };
 
+void highlighter_t::set_previous_highlight(const highlight_cache_t *prev)
+{
+    this->previous = prev;
+    this->unchanged_prefix_length = 0;
+    this->unchanged_suffix_length = 0;
+    if (prev == NULL)
+        return;
+
+    const wcstring &old_buff = prev->buff;
+    const size_t max_common = std::min(old_buff.size(), buff.size());
+    size_t prefix = 0;
+    while (prefix < max_common && old_buff.at(prefix) == buff.at(prefix))
+        prefix++;
+    size_t suffix = 0;
+    while (prefix + suffix < max_common && old_buff.at(old_buff.size() - suffix - 1) == buff.at(buff.size() - suffix - 1))
+        suffix++;
+    this->unchanged_prefix_length = prefix;
+    this->unchanged_suffix_length = suffix;
+}
+
+bool highlighter_t::reuse_plain_statement_colors(const parse_node_t &node, enum parse_statement_decoration_t decoration)
+{
+    if (this->previous == NULL || ! node.has_source() || this->node_contains_cursor(node))
+        return false;
+
+    /* The statement must lie entirely within the unchanged prefix or suffix. Find where it was in the previous command line. */
+    const size_t start = node.source_start, end = node.source_start + node.source_length;
+    size_t old_start;
+    if (end <= this->unchanged_prefix_length)
+    {
+        old_start = start;
+    }
+    else if (start >= buff.size() - this->unchanged_suffix_length)
+    {
+        old_start = start - buff.size() + this->previous->buff.size();
+    }
+    else
+    {
+        return false;
+    }
+
+    /* There must have been a statement with the same extent and decoration there */
+    const std::vector<highlight_cached_statement_t> &old_statements = this->previous->statements;
+    std::vector<highlight_cached_statement_t>::const_iterator where = std::lower_bound(old_statements.begin(), old_statements.end(), old_start, cached_statement_starts_before);
+    if (where == old_statements.end() || where->source_start != old_start || where->colors.size() != node.source_length || where->decoration != decoration)
+        return false;
+
+    if (timef() - where->when > HIGHLIGHT_STATEMENT_CACHE_MAX_AGE)
+        return false;
+
+    std::copy(where->colors.begin(), where->colors.end(), this->color_array.begin() + start);
+
+    highlight_cached_statement_t reused = *where;
+    reused.source_start = start;
+    this->statement_colors.push_back(reused);
+    return true;
+}
+
 void highlighter_t::color_node(const parse_node_t &node, highlight_spec_t color)
 {
     // Can only color nodes with valid source ranges
@@ -1309,6 +1606,59 @@ static bool command_is_valid(const wcstring &cmd, enum parse_statement_decoratio
     return is_valid;
 }
 
+void highlighter_t::color_plain_statement(const parse_node_t &node)
+{
+    /* Get the decoration from the parent */
+    enum parse_statement_decoration_t decoration = parse_tree.decoration_for_plain_statement(node);
+
+    if (this->reuse_plain_statement_colors(node, decoration))
+        return;
+
+    /* Color the command */
+    const parse_node_t *cmd_node = parse_tree.get_child(node, 0, parse_token_type_string);
+    if (cmd_node != NULL && cmd_node->has_source())
+    {
+        bool is_valid_cmd = false;
+        if (! this->io_ok)
+        {
+            /* We cannot check if the command is invalid, so just assume it's valid */
+            is_valid_cmd = true;
+        }
+        else
+        {
+            /* Check to see if the command is valid */
+            wcstring cmd(buff, cmd_node->source_start, cmd_node->source_length);
+
+            /* Try expanding it. If we cannot, it's an error. */
+            bool expanded = expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES | EXPAND_SKIP_JOBS);
+            if (expanded && ! has_expand_reserved(cmd))
+            {
+                is_valid_cmd = command_is_valid(cmd, decoration, working_directory, vars);
+            }
+        }
+        this->color_node(*cmd_node, is_valid_cmd ? highlight_spec_command : highlight_spec_error);
+    }
+
+    /* Color the arguments and redirections */
+    const parse_node_t *list_node = parse_tree.get_child(node, 1, symbol_arguments_or_redirections_list);
+    if (list_node != NULL)
+    {
+        this->color_arguments(*list_node);
+        this->color_redirections(*list_node);
+    }
+
+    /* Remember the colors, unless they depend on the cursor position (via command substitutions) */
+    if (node.has_source() && ! this->node_contains_cursor(node))
+    {
+        highlight_cached_statement_t computed;
+        computed.source_start = node.source_start;
+        computed.decoration = decoration;
+        computed.when = timef();
+        computed.colors.assign(this->color_array.begin() + node.source_start, this->color_array.begin() + node.source_start + node.source_length);
+        this->statement_colors.push_back(computed);
+    }
+}
+
 const highlighter_t::color_array_t & highlighter_t::highlight()
 {
     // If we are doing I/O, we must be in a background thread
@@ -1387,33 +1737,7 @@ const highlighter_t::color_array_t & highlighter_t::highlight()
 
             case symbol_plain_statement:
             {
-                /* Get the decoration from the parent */
-                enum parse_statement_decoration_t decoration = parse_tree.decoration_for_plain_statement(node);
-
-                /* Color the command */
-                const parse_node_t *cmd_node = parse_tree.get_child(node, 0, parse_token_type_string);
-                if (cmd_node != NULL && cmd_node->has_source())
-                {
-                    bool is_valid_cmd = false;
-                    if (! this->io_ok)
-                    {
-                        /* We cannot check if the command is invalid, so just assume it's valid */
-                        is_valid_cmd = true;
-                    }
-                    else
-                    {
-                        /* Check to see if the command is valid */
-                        wcstring cmd(buff, cmd_node->source_start, cmd_node->source_length);
-
-                        /* Try expanding it. If we cannot, it's an error. */
-                        bool expanded = expand_one(cmd, EXPAND_SKIP_CMDSUBST | EXPAND_SKIP_VARIABLES | EXPAND_SKIP_JOBS);
-                        if (expanded && ! has_expand_reserved(cmd))
-                        {
-                            is_valid_cmd = command_is_valid(cmd, decoration, working_directory, vars);
-                        }
-                    }
-                    this->color_node(*cmd_node, is_valid_cmd ? highlight_spec_command : highlight_spec_error);
-                }
+                this->color_plain_statement(node);
             }
             break;
 
@@ -1421,8 +1745,8 @@ const highlighter_t::color_array_t & highlighter_t::highlight()
             case symbol_arguments_or_redirections_list:
             case symbol_argument_list:
             {
-                /* Only work on root lists, so that we don't re-color child lists */
-                if (parse_tree.argument_list_is_root(node))
+                /* Only work on root lists, so that we don't re-color child lists. The lists of plain statements were colored with the statement. */
+                if (parse_tree.argument_list_is_root(node) && parse_tree.get_parent(node, symbol_plain_statement) == NULL)
                 {
                     this->color_arguments(node);
                     this->color_redirections(node);
@@ -1487,9 +1811,40 @@ void highlight_shell(const wcstring &buff, std::vector<highlight_spec_t> &color,
     /* Do something sucky and get the current working directory on this background thread. This should really be passed in. */
     const wcstring working_directory = env_get_pwd_slash();
 
+    /* Snapshot the variables that affect highlighting */
+    std::vector<env_var_t> var_values;
+    for (size_t i=0; env_vars_snapshot_t::highlighting_keys[i] != NULL; i++)
+    {
+        var_values.push_back(vars.get(env_vars_snapshot_t::highlighting_keys[i]));
+    }
+
+    /* Get the previous highlight, if it was done in the same circumstances */
+    highlight_cache_t previous;
+    {
+        scoped_lock locker(s_highlight_cache_lock);
+        if (s_highlight_cache.working_directory == working_directory && s_highlight_cache.var_values == var_values)
+        {
+            previous = s_highlight_cache;
+        }
+    }
+
     /* Highlight it! */
     highlighter_t highlighter(buff, pos, vars, working_directory, true /* can do IO */);
+    highlighter.set_previous_highlight(&previous);
     color = highlighter.highlight();
+
+    /* Save our statement colors for the next highlight, unless we gave up early; then some were computed incompletely */
+    if (! reader_thread_job_is_stale())
+    {
+        std::vector<highlight_cached_statement_t> &statements = highlighter.get_statement_colors();
+        std::sort(statements.begin(), statements.end(), cached_statements_ordered);
+
+        scoped_lock locker(s_highlight_cache_lock);
+        s_highlight_cache.buff = buff;
+        s_highlight_cache.working_directory = working_directory;
+        s_highlight_cache.var_values.swap(var_values);
+        s_highlight_cache.statements.swap(statements);
+    }
 }
 
 void highlight_shell_no_io(const wcstring &buff, std::vector<highlight_spec_t> &color, size_t pos, wcstring_list_t *error, const env_vars_snapshot_t &vars)
@@ -108,6 +108,11 @@ void highlight_universal(const wcstring &buffstr, std::vector<highlight_spec_t>
 */
 rgb_color_t highlight_get_color(highlight_spec_t highlight, bool is_background);
 
+/**
+   Forget the colors highlight_get_color has resolved. Call this whenever a fish_color_ or fish_pager_color_ variable may have changed.
+*/
+void highlight_invalidate_colors();
+
 /** Given a command 'str' from the history, try to determine whether we ought to suggest it by specially recognizing the command.
     Returns true if we validated the command. If so, returns by reference whether the suggestion is valid or not.
 */
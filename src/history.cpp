@@ -31,6 +31,8 @@
 #include "env.h"
 #include "lru.h"
 #include "parse_constants.h"
+#include "parser_keywords.h"
+#include "tokenizer.h"
 #include <map>
 #include <algorithm>
 
@@ -43,8 +45,11 @@ Our history format is intended to be valid YAML. Here it is:
     paths:
       - /path/to/something
       - /path/to/something_else
+    uses: 3
 
-  Newlines are replaced by \n. Backslashes are replaced by \\.
+  Newlines are replaced by \n. Backslashes are replaced by \\. The "uses" key appears when rewriting the file merged several uses of a command into one item.
+
+There is also a compact binary format, which is opt-in via history_t::set_file_format(). It starts with HISTORY_BINARY_MAGIC and is followed by length-prefixed records, so that items can be located by skipping over records and decoded in place without any unescaping. See history_binary_record_header_t.
 */
 
 /** When we rewrite the history, the number of items we keep */
@@ -108,6 +113,18 @@ public:
         assert(buffer.at(buffer.size() - 1) == '\0');
     }
 
+    /* Append raw bytes, which may include nulls */
+    void append_bytes(const void *bytes, size_t len)
+    {
+        size_t required_size = offset + len + 1;
+        if (required_size > buffer.size())
+        {
+            buffer.resize(required_size, '\0');
+        }
+        memmove(&buffer.at(offset), bytes, len);
+        offset += len;
+    }
+
     /* Output to a given fd, resetting our buffer. Returns true on success, false on error */
     bool flush_to_fd(int fd)
     {
@@ -155,20 +172,54 @@ static bool history_file_lock(int fd, short type)
     struct flock flk = {};
     flk.l_type = type;
     flk.l_whence = SEEK_SET;
-    int ret = fcntl(fd, F_SETLKW, (void *)&flk);
+    int ret;
+    do
+    {
+        /* Blocking signals does not mask them, so a signal may interrupt the wait */
+        ret = fcntl(fd, F_SETLKW, (void *)&flk);
+    }
+    while (ret == -1 && errno == EINTR);
     return ret != -1;
 }
 
+/* Create and open a temporary file from the given mkstemp-style template, returning the fd (or -1) and the path by reference. The file is opened for reading and writing. Try up to 10 times. We don't use mkstemps because we want to open it CLO_EXEC. This should almost always succeed on the first try. */
+static int create_temporary_file(const wcstring &name_template, wcstring *out_path)
+{
+    int out_fd = -1;
+    for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++)
+    {
+        char *narrow_str = wcs2str(name_template.c_str());
+#if HAVE_MKOSTEMP
+        out_fd = mkostemp(narrow_str, O_CLOEXEC);
+        if (out_fd >= 0)
+        {
+            *out_path = str2wcstring(narrow_str);
+        }
+#else
+        if (narrow_str && mktemp(narrow_str))
+        {
+            /* It was successfully templated; try opening it atomically */
+            *out_path = str2wcstring(narrow_str);
+            out_fd = wopen_cloexec(*out_path, O_RDWR | O_CREAT | O_EXCL | O_TRUNC, 0600);
+        }
+#endif
+        free(narrow_str);
+    }
+    return out_fd;
+}
+
 /* Our LRU cache is used for restricting the amount of history we have, and limiting how long we order it. */
 class history_lru_node_t : public lru_node_t
 {
 public:
     time_t timestamp;
     path_list_t required_paths;
+    uint32_t use_count;
     history_lru_node_t(const history_item_t &item) :
         lru_node_t(item.str()),
         timestamp(item.timestamp()),
-        required_paths(item.required_paths)
+        required_paths(item.required_paths),
+        use_count(item.use_count)
     {}
 };
 
@@ -185,8 +236,8 @@ protected:
 public:
     history_lru_cache_t(size_t max) : lru_cache_t<history_lru_node_t>(max) { }
 
-    /* Function to add a history item */
-    void add_item(const history_item_t &item)
+    /* Function to add a history item. If distinct_uses is set, the uses of an item with the same contents are added to those already recorded; otherwise the item may stand for uses we have already seen. */
+    void add_item(const history_item_t &item, bool distinct_uses)
     {
         /* Skip empty items */
         if (item.empty())
@@ -196,6 +247,10 @@ public:
         history_lru_node_t *node = this->get_node(item.str());
         if (node != NULL)
         {
+            if (distinct_uses)
+                node->use_count += item.get_use_count();
+            else
+                node->use_count = std::max(node->use_count, item.get_use_count());
             node->timestamp = std::max(node->timestamp, item.timestamp());
             /* What to do about paths here? Let's just ignore them */
         }
@@ -219,12 +274,25 @@ static void escape_yaml(std::string *str);
 /** Undoes escape_yaml */
 static void unescape_yaml(std::string *str);
 
+/* FNV-1a hash of the contents of an item, used to find duplicates among new items */
+static uint64_t history_contents_hash(const wcstring &contents)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i < contents.size(); i++)
+    {
+        hash ^= (uint32_t)contents[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 /* We can merge two items if they are the same command. We use the more recent timestamp, more recent identifier, and the longer list of required paths. */
 bool history_item_t::merge(const history_item_t &item)
 {
     bool result = false;
     if (this->contents == item.contents)
     {
+        this->use_count += item.use_count;
         this->creation_timestamp = std::max(this->creation_timestamp, item.creation_timestamp);
         if (this->required_paths.size() < item.required_paths.size())
         {
@@ -239,11 +307,11 @@ bool history_item_t::merge(const history_item_t &item)
     return result;
 }
 
-history_item_t::history_item_t(const wcstring &str) : contents(str), creation_timestamp(time(NULL)), identifier(0)
+history_item_t::history_item_t(const wcstring &str) : contents(str), creation_timestamp(time(NULL)), identifier(0), use_count(1)
 {
 }
 
-history_item_t::history_item_t(const wcstring &str, time_t when, history_identifier_t ident) : contents(str), creation_timestamp(when), identifier(ident)
+history_item_t::history_item_t(const wcstring &str, time_t when, history_identifier_t ident) : contents(str), creation_timestamp(when), identifier(ident), use_count(1)
 {
 }
 
@@ -267,7 +335,7 @@ bool history_item_t::matches_search(const wcstring &term, enum history_search_ty
 }
 
 /* Append our YAML history format to the provided vector at the given offset, updating the offset */
-static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, history_output_buffer_t *buffer)
+static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, uint32_t use_count, history_output_buffer_t *buffer)
 {
     std::string cmd = wcs2string(wcmd);
     escape_yaml(&cmd);
@@ -288,6 +356,96 @@ static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp, const
             buffer->append("    - ", path.c_str(), "\n");
         }
     }
+
+    if (use_count > 1)
+    {
+        char use_count_str[32];
+        snprintf(use_count_str, sizeof use_count_str, "%lu", (unsigned long)use_count);
+        buffer->append("  uses: ", use_count_str, "\n");
+    }
+}
+
+/* The binary format starts with this magic (which includes a leading null, so it can never look like a text history file) */
+#define HISTORY_BINARY_MAGIC "\0fishbin"
+#define HISTORY_BINARY_MAGIC_LEN (sizeof HISTORY_BINARY_MAGIC - 1)
+
+/* Each record in the binary format starts with this header, followed by the command, and then path_count paths, each preceded by a uint32_t length. Strings are narrow and not null terminated. record_length counts the bytes after the record_length field itself. Records are not aligned, so headers are read via memcpy. A use_count of 0, as written before the field was used, means 1. */
+struct history_binary_record_header_t
+{
+    uint32_t record_length;
+    uint32_t cmd_length;
+    uint32_t path_count;
+    uint32_t use_count;
+    int64_t timestamp;
+};
+
+/* Append our binary history format to the provided buffer */
+static void append_binary_to_buffer(const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, uint32_t use_count, history_output_buffer_t *buffer)
+{
+    const std::string cmd = wcs2string(wcmd);
+    std::vector<std::string> paths;
+    paths.reserve(required_paths.size());
+    size_t paths_length = 0;
+    for (path_list_t::const_iterator iter = required_paths.begin(); iter != required_paths.end(); ++iter)
+    {
+        paths.push_back(wcs2string(*iter));
+        paths_length += sizeof(uint32_t) + paths.back().size();
+    }
+
+    history_binary_record_header_t header = {};
+    header.record_length = (uint32_t)(sizeof header - sizeof header.record_length + cmd.size() + paths_length);
+    header.cmd_length = (uint32_t)cmd.size();
+    header.path_count = (uint32_t)paths.size();
+    header.use_count = use_count;
+    header.timestamp = timestamp;
+    buffer->append_bytes(&header, sizeof header);
+    buffer->append_bytes(cmd.data(), cmd.size());
+    for (size_t i=0; i < paths.size(); i++)
+    {
+        const uint32_t path_length = (uint32_t)paths.at(i).size();
+        buffer->append_bytes(&path_length, sizeof path_length);
+        buffer->append_bytes(paths.at(i).data(), path_length);
+    }
+}
+
+/* Append an item to the provided buffer in the given format */
+static void append_item_to_buffer(history_file_type_t type, const wcstring &wcmd, time_t timestamp, const path_list_t &required_paths, uint32_t use_count, history_output_buffer_t *buffer)
+{
+    if (type == history_type_fish_binary)
+    {
+        append_binary_to_buffer(wcmd, timestamp, required_paths, use_count, buffer);
+    }
+    else
+    {
+        append_yaml_to_buffer(wcmd, timestamp, required_paths, use_count, buffer);
+    }
+}
+
+/* Determines whether the binary record of the given length at the given address is well formed, i.e. its header is consistent with its length. Populates the header by reference. */
+static bool read_binary_record_header(const char *record, size_t len, history_binary_record_header_t *header)
+{
+    if (len < sizeof *header)
+        return false;
+
+    memcpy(header, record, sizeof *header);
+    const size_t record_end = sizeof header->record_length + (size_t)header->record_length;
+    if (record_end > len || record_end < sizeof *header || header->cmd_length > record_end - sizeof *header)
+        return false;
+
+    /* Walk over the paths to ensure they fit */
+    size_t cursor = sizeof *header + header->cmd_length;
+    for (uint32_t i=0; i < header->path_count; i++)
+    {
+        uint32_t path_length;
+        if (record_end - cursor < sizeof path_length)
+            return false;
+        memcpy(&path_length, record + cursor, sizeof path_length);
+        cursor += sizeof path_length;
+        if (record_end - cursor < path_length)
+            return false;
+        cursor += path_length;
+    }
+    return cursor == record_end;
 }
 
 // Parse a timestamp line that looks like this: spaces, "when:", spaces, timestamp, newline
@@ -501,6 +659,41 @@ static size_t offset_of_next_item_fish_1_x(const char *begin, size_t mmap_length
     return result;
 }
 
+// Same as offset_of_next_item_fish_2_0, but for the binary format
+static size_t offset_of_next_item_fish_binary(const char *begin, size_t mmap_length, size_t *inout_cursor, time_t cutoff_timestamp)
+{
+    size_t cursor = *inout_cursor;
+    size_t result = (size_t)(-1);
+
+    /* Skip the magic */
+    if (cursor < HISTORY_BINARY_MAGIC_LEN)
+        cursor = std::min(mmap_length, (size_t)HISTORY_BINARY_MAGIC_LEN);
+
+    uint32_t record_length;
+    while (mmap_length - cursor >= sizeof record_length)
+    {
+        /* Stop at a partially written record, leaving the cursor at its start */
+        memcpy(&record_length, begin + cursor, sizeof record_length);
+        if (record_length > mmap_length - cursor - sizeof record_length)
+            break;
+
+        const size_t record_start = cursor;
+        cursor += sizeof record_length + record_length;
+
+        /* Skip malformed records, and records created after our cutoff */
+        history_binary_record_header_t header;
+        if (! read_binary_record_header(begin + record_start, cursor - record_start, &header))
+            continue;
+        if (cutoff_timestamp != 0 && header.timestamp > (int64_t)cutoff_timestamp)
+            continue;
+
+        result = record_start;
+        break;
+    }
+    *inout_cursor = cursor;
+    return result;
+}
+
 // Returns the offset of the next item based on the given history type, or -1
 static size_t offset_of_next_item(const char *begin, size_t mmap_length, history_file_type_t mmap_type, size_t *inout_cursor, time_t cutoff_timestamp)
 {
@@ -515,6 +708,10 @@ static size_t offset_of_next_item(const char *begin, size_t mmap_length, history
             result = offset_of_next_item_fish_1_x(begin, mmap_length, inout_cursor, cutoff_timestamp);
             break;
 
+        case history_type_fish_binary:
+            result = offset_of_next_item_fish_binary(begin, mmap_length, inout_cursor, cutoff_timestamp);
+            break;
+
         default:
         case history_type_unknown:
             // Oh well
@@ -534,43 +731,69 @@ history_t & history_t::history_with_name(const wcstring &name)
     return *current;
 }
 
+/* Returns the number of old items, which may be NULL */
+static size_t old_item_count(const shared_ptr<const history_old_items_t> &items)
+{
+    return items ? items->offsets.size() : 0;
+}
+
 history_t::history_t(const wcstring &pname) :
     name(pname),
     first_unwritten_new_item_index(0),
+    new_items_may_have_duplicates(false),
     has_pending_item(false),
     disable_automatic_save_counter(0),
-    mmap_start(NULL),
-    mmap_length(0),
-    mmap_type(history_file_type_t(-1)),
+    file_detection_running(false),
     mmap_file_id(kInvalidFileID),
     boundary_timestamp(time(NULL)),
     countdown_to_vacuum(-1),
+    mmap_scanned_length(0),
     loaded_old(false),
+    snapshot_stale(false),
+    distinct_item_scan_index(1),
+    vacuum_in_progress(false),
     chaos_mode(false)
 {
     pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&snapshot_lock, NULL);
+    pthread_cond_init(&vacuum_cond, NULL);
 }
 
 history_t::~history_t()
 {
+    {
+        scoped_lock locker(lock);
+        this->wait_for_background_vacuum();
+    }
+    for (size_t i=0; i < file_detection_queue.size(); i++)
+    {
+        delete file_detection_queue.at(i);
+    }
+    pthread_cond_destroy(&vacuum_cond);
+    pthread_mutex_destroy(&snapshot_lock);
     pthread_mutex_destroy(&lock);
 }
 
 void history_t::add(const history_item_t &item, bool pending)
 {
     scoped_lock locker(lock);
+    invalidate_distinct_items();
 
     /* Try merging with the last item */
     if (! new_items.empty() && new_items.back().merge(item))
     {
         /* We merged, so we don't have to add anything. Maybe this item was pending, but it just got merged with an item that is not pending, so pending just becomes false. */
         this->has_pending_item = false;
+        update_snapshot();
     }
     else
     {
-        /* We have to add a new item */
+        /* We have to add a new item. Searches get it before we save, so that they need not wait for the file. */
         new_items.push_back(item);
+        if (! new_item_hashes.insert(history_contents_hash(item.str())).second)
+            new_items_may_have_duplicates = true;
         this->has_pending_item = pending;
+        update_snapshot();
         save_internal_unless_disabled();
     }
 }
@@ -603,7 +826,7 @@ void history_t::save_internal_unless_disabled()
         vacuum = true;
     }
 
-    /* This might be a good candidate for moving to a background thread */
+    /* Saving only appends; if we vacuum, that happens on a background thread */
     time_profiler_t profiler(vacuum ? "save_internal vacuum" : "save_internal no vacuum");
     this->save_internal(vacuum);
 
@@ -627,6 +850,8 @@ void history_t::add(const wcstring &str, history_identifier_t ident, bool pendin
 
 void history_t::remove(const wcstring &str)
 {
+    scoped_lock locker(lock);
+
     /* Add to our list of deleted items */
     deleted_items.insert(str);
 
@@ -637,6 +862,7 @@ void history_t::remove(const wcstring &str)
         if (new_items.at(idx).str() == str)
         {
             new_items.erase(new_items.begin() + idx);
+            invalidate_distinct_items();
 
             /* If this index is before our first_unwritten_new_item_index, then subtract one from that index so it stays pointing at the same item. If it is equal to or larger, then we have not yet writen this item, so we don't have to adjust the index. */
             if (idx < first_unwritten_new_item_index)
@@ -646,6 +872,7 @@ void history_t::remove(const wcstring &str)
         }
     }
     assert(first_unwritten_new_item_index <= new_items.size());
+    update_snapshot();
 }
 
 void history_t::set_valid_file_paths(const wcstring_list_t &valid_file_paths, history_identifier_t ident)
@@ -665,12 +892,50 @@ void history_t::set_valid_file_paths(const wcstring_list_t &valid_file_paths, hi
         {
             /* Found it */
             iter->required_paths = valid_file_paths;
+            update_snapshot();
             break;
         }
     }
 }
 
-void history_t::get_string_representation(wcstring *result, const wcstring &separator)
+void history_t::set_valid_file_paths(const std::vector<file_detection_context_t *> &contexts)
+{
+    scoped_lock locker(lock);
+
+    /* The items are likely to be at the end of new_items, in the order of the contexts, so search backwards from where the last one was found */
+    history_item_list_t::reverse_iterator start = new_items.rbegin();
+    for (size_t i = contexts.size(); i > 0; i--)
+    {
+        const file_detection_context_t *ctx = contexts.at(i - 1);
+        if (ctx->history_item_identifier == 0)
+        {
+            continue;
+        }
+
+        history_item_list_t::reverse_iterator iter = start;
+        while (iter != new_items.rend() && iter->identifier != ctx->history_item_identifier)
+        {
+            ++iter;
+        }
+        if (iter == new_items.rend())
+        {
+            /* Out of order, or merged away; look through everything */
+            iter = new_items.rbegin();
+            while (iter != new_items.rend() && iter->identifier != ctx->history_item_identifier)
+            {
+                ++iter;
+            }
+        }
+        if (iter != new_items.rend())
+        {
+            iter->required_paths = ctx->valid_paths;
+            start = iter;
+        }
+    }
+    update_snapshot();
+}
+
+void history_t::get_string_representation(wcstring *result, const wcstring &separator, void (*after_item)())
 {
     scoped_lock locker(lock);
 
@@ -699,14 +964,15 @@ void history_t::get_string_representation(wcstring *result, const wcstring &sepa
             result->append(separator);
         result->append(iter->str());
         first = false;
+        if (after_item)
+            after_item();
     }
 
     /* Append old items */
     load_old_if_needed();
-    for (std::deque<size_t>::reverse_iterator iter = old_item_offsets.rbegin(); iter != old_item_offsets.rend(); ++iter)
+    for (size_t position = old_item_count(old_items); position > 0; position--)
     {
-        size_t offset = *iter;
-        const history_item_t item = history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        const history_item_t item = old_items->item_at(position - 1);
 
         /* Skip duplicates */
         if (! seen.insert(item.str()).second)
@@ -716,24 +982,27 @@ void history_t::get_string_representation(wcstring *result, const wcstring &sepa
             result->append(separator);
         result->append(item.str());
         first = false;
+        if (after_item)
+            after_item();
     }
 }
 
 history_item_t history_t::item_at_index(size_t idx)
 {
     scoped_lock locker(lock);
+    return item_at_index_locked(idx);
+}
+
+history_item_t history_t::item_at_index_locked(size_t idx)
+{
+    ASSERT_IS_LOCKED(lock);
 
     /* 0 is considered an invalid index */
     assert(idx > 0);
     idx--;
 
-    /* Determine how many "resolved" (non-pending) items we have. We can have at most one pending item, and it's always the last one. */
-    size_t resolved_new_item_count = new_items.size();
-    if (this->has_pending_item && resolved_new_item_count > 0)
-    {
-        resolved_new_item_count -= 1;
-    }
-    
+    const size_t resolved_new_item_count = this->resolved_new_item_count();
+
     /* idx=0 corresponds to the last resolved item */
     if (idx < resolved_new_item_count)
     {
@@ -743,124 +1012,780 @@ history_item_t history_t::item_at_index(size_t idx)
     /* Now look in our old items */
     idx -= resolved_new_item_count;
     load_old_if_needed();
-    size_t old_item_count = old_item_offsets.size();
-    if (idx < old_item_count)
+    const size_t old_count = old_item_count(old_items);
+    if (idx < old_count)
     {
-        /* idx=0 corresponds to last item in old_item_offsets */
-        size_t offset = old_item_offsets.at(old_item_count - idx - 1);
-        return history_t::decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        /* idx=0 corresponds to the last old item */
+        return old_items->item_at(old_count - idx - 1);
     }
 
     /* Index past the valid range, so return an empty history item */
     return history_item_t(wcstring(), 0);
 }
 
-/* Read one line, stripping off any newline, and updating cursor. Note that our input string is NOT null terminated; it's just a memory mapped file. */
-static size_t read_line(const char *base, size_t cursor, size_t len, std::string &result)
+void history_t::invalidate_distinct_items(void)
 {
-    /* Locate the newline */
-    assert(cursor <= len);
-    const char *start = base + cursor;
-    const char *newline = (char *)memchr(start, '\n', len - cursor);
-    if (newline != NULL)
+    ASSERT_IS_LOCKED(lock);
+    distinct_item_indexes.clear();
+    distinct_item_hashes.clear();
+    distinct_item_scan_index = 1;
+}
+
+shared_ptr<const history_snapshot_t> history_t::snapshot(void)
+{
+    shared_ptr<const history_snapshot_t> stale;
     {
-        /* We found a newline. */
-        result.assign(start, newline - start);
+        scoped_lock locker(snapshot_lock);
+        if (published_snapshot && ! snapshot_stale)
+            return published_snapshot;
+        stale = published_snapshot;
+    }
 
-        /* Return the amount to advance the cursor; skip over the newline */
-        return newline - start + 1;
+    /* The items changed since the last snapshot. A background search takes the stale one rather than wait while we save. The main thread changes the items itself, so it must see them. */
+    if (stale && ! is_main_thread())
+    {
+        if (pthread_mutex_trylock(&lock) != 0)
+            return stale;
+        load_old_if_needed();
+        const shared_ptr<const history_snapshot_t> result = publish_snapshot();
+        VOMIT_ON_FAILURE(pthread_mutex_unlock(&lock));
+        return result;
     }
-    else
+
+    scoped_lock locker(lock);
+    load_old_if_needed();
+    return publish_snapshot();
+}
+
+shared_ptr<const history_snapshot_t> history_t::publish_snapshot(void)
+{
+    ASSERT_IS_LOCKED(lock);
+    assert(loaded_old);
+
+    /* Another search may have got here first */
+    if (published_snapshot && ! snapshot_stale)
+        return published_snapshot;
+
+    shared_ptr<history_snapshot_t> result(new history_snapshot_t());
+    const size_t new_item_count = this->resolved_new_item_count();
+    result->new_items.assign(new_items.begin(), new_items.begin() + new_item_count);
+    for (size_t i=0; i < new_item_count; i++)
     {
-        /* We ran off the end */
-        result.clear();
-        return len - cursor;
+        const history_item_t &item = new_items.at(i);
+        result->new_prefix_index.add_item(item.str(), item.timestamp(), item.get_use_count());
     }
+    result->new_prefix_index.finish();
+    result->old_items = old_items;
+    result->deleted_items = deleted_items;
+
+    scoped_lock locker(snapshot_lock);
+    published_snapshot = result;
+    snapshot_stale = false;
+    return result;
 }
 
-/* Trims leading spaces in the given string, returning how many there were */
-static size_t trim_leading_spaces(std::string &str)
+void history_t::update_snapshot(void)
 {
-    size_t i = 0, max = str.size();
-    while (i < max && str[i] == ' ')
-        i++;
-    str.erase(0, i);
-    return i;
+    ASSERT_IS_LOCKED(lock);
+
+    /* Building a snapshot copies and indexes every new item, so it is left to the next search rather than done for every change */
+    scoped_lock locker(snapshot_lock);
+    snapshot_stale = true;
 }
 
-static bool extract_prefix_and_unescape_yaml(std::string *key, std::string *value, const std::string &line)
+void history_t::find_distinct_items(size_t count)
 {
-    size_t where = line.find(":");
-    if (where != std::string::npos)
+    ASSERT_IS_LOCKED(lock);
+
+    /* Load old items before looking at any, so they cannot appear behind the ones we have found */
+    load_old_if_needed();
+    const size_t item_count = this->resolved_new_item_count() + old_item_count(old_items);
+    while (distinct_item_indexes.size() < count && distinct_item_scan_index <= item_count)
     {
-        key->assign(line, 0, where);
+        const size_t idx = distinct_item_scan_index++;
+        const history_item_t item = item_at_index_locked(idx);
+        if (item.empty())
+            continue;
 
-        // skip a space after the : if necessary
-        size_t val_start = where + 1;
-        if (val_start < line.size() && line.at(val_start) == ' ')
-            val_start++;
-        value->assign(line, val_start, line.size() - val_start);
+        /* Only items whose hashes collide have to be compared */
+        const uint64_t hash = history_contents_hash(item.str());
+        typedef std::multimap<uint64_t, size_t>::const_iterator iter_t;
+        std::pair<iter_t, iter_t> range = distinct_item_hashes.equal_range(hash);
+        bool seen = false;
+        for (iter_t iter = range.first; iter != range.second && ! seen; ++iter)
+        {
+            seen = (item_at_index_locked(distinct_item_indexes.at(iter->second)).str() == item.str());
+        }
 
-        unescape_yaml(key);
-        unescape_yaml(value);
+        if (! seen)
+        {
+            distinct_item_hashes.insert(std::make_pair(hash, distinct_item_indexes.size()));
+            distinct_item_indexes.push_back(idx);
+        }
     }
-    return where != std::string::npos;
 }
 
-/* Decode an item via the fish 2.0 format */
-history_item_t history_t::decode_item_fish_2_0(const char *base, size_t len)
+history_item_t history_t::distinct_item_at_index(size_t idx)
 {
-    wcstring cmd;
-    time_t when = 0;
-    path_list_t paths;
+    scoped_lock locker(lock);
+    assert(idx > 0);
+    find_distinct_items(idx);
+    if (idx > distinct_item_indexes.size())
+        return history_item_t(wcstring(), 0);
+    return item_at_index_locked(distinct_item_indexes.at(idx - 1));
+}
 
-    size_t indent = 0, cursor = 0;
-    std::string key, value, line;
-    
-    /* Read the "- cmd:" line */
-    size_t advance = read_line(base, cursor, len, line);
-    trim_leading_spaces(line);
-    if (! extract_prefix_and_unescape_yaml(&key, &value, line) || key != "- cmd")
+size_t history_t::distinct_item_count(void)
+{
+    scoped_lock locker(lock);
+    find_distinct_items((size_t)(-1));
+    return distinct_item_indexes.size();
+}
+
+size_t history_t::resolved_new_item_count() const
+{
+    ASSERT_IS_LOCKED(lock);
+
+    /* We can have at most one pending item, and it's always the last one. */
+    size_t result = new_items.size();
+    if (this->has_pending_item && result > 0)
     {
-        goto done;
+        result -= 1;
     }
-    
-    cursor += advance;
-    cmd = str2wcstring(value);
+    return result;
+}
 
-    /* Read the remaining lines */
-    for (;;)
+size_t history_snapshot_t::size() const
+{
+    return new_items.size() + old_item_count(old_items);
+}
+
+history_item_t history_snapshot_t::item_at_index(size_t idx) const
+{
+    /* 0 is considered an invalid index */
+    assert(idx > 0);
+    idx--;
+
+    /* idx=0 corresponds to the last new item */
+    if (idx < new_items.size())
     {
-        /* Read a line */
-        size_t advance = read_line(base, cursor, len, line);
+        return new_items.at(new_items.size() - idx - 1);
+    }
 
-        /* Count and trim leading spaces */
-        size_t this_indent = trim_leading_spaces(line);
-        if (indent == 0)
-            indent = this_indent;
+    idx -= new_items.size();
+    const size_t old_count = old_item_count(old_items);
+    if (idx < old_count)
+    {
+        return old_items->item_at(old_count - idx - 1);
+    }
 
-        if (this_indent == 0 || indent != this_indent)
-            break;
+    /* Index past the valid range, so return an empty history item */
+    return history_item_t(wcstring(), 0);
+}
 
-        if (! extract_prefix_and_unescape_yaml(&key, &value, line))
-            break;
+size_t history_snapshot_t::next_candidate_index(const wcstring &term, const history_encoded_term_t &encoded_term, enum history_search_type_t search_type, size_t idx) const
+{
+    assert(idx > 0);
 
-        /* We are definitely going to consume this line */
-        cursor += advance;
+    /* New items are in memory, and are cheap to test directly */
+    const size_t new_item_count = new_items.size();
+    if (idx <= new_item_count || ! old_items)
+    {
+        return idx;
+    }
 
-        if (key == "when")
+    /* Short terms cannot use the index */
+    const size_t old_count = old_items->offsets.size();
+    const history_trigram_index_t *trigram_index = (term.size() >= 3) ? &old_items->get_trigram_index() : NULL;
+
+    for (; idx <= new_item_count + old_count; idx++)
+    {
+        /* Positions count up from the oldest item, while indexes count up from the newest */
+        if (trigram_index)
         {
-            /* Parse an int from the timestamp. Should this fail, strtol returns 0; that's acceptable. */
-            char *end = NULL;
-            long tmp = strtol(value.c_str(), &end, 0);
-            when = tmp;
+            const size_t old_idx = idx - 1 - new_item_count;
+            long position = trigram_index->find_candidate(term, (uint32_t)(old_count - old_idx - 1));
+            if (position < 0)
+                break;
+            idx = new_item_count + (old_count - (size_t)position);
         }
-        else if (key == "paths")
-        {
-            /* Read lines starting with " - " until we can't read any more */
-            for (;;)
-            {
-                size_t advance = read_line(base, cursor, len, line);
+
+        if (old_items->view_at(old_count - (idx - new_item_count)).may_match_search(encoded_term, search_type))
+            return idx;
+    }
+    return new_item_count + old_count + 1;
+}
+
+/* Orders commands by how often they were used, then by how recently */
+struct command_use_t
+{
+    wcstring command;
+    size_t count;
+    size_t first_seen;
+
+    bool operator<(const command_use_t &other) const
+    {
+        if (count != other.count)
+            return count > other.count;
+        return first_seen < other.first_seen;
+    }
+};
+
+wcstring_list_t history_t::most_used_commands(size_t max_count, size_t item_limit)
+{
+    const shared_ptr<const history_snapshot_t> items = this->snapshot();
+    std::map<wcstring, size_t> positions;
+    std::vector<command_use_t> uses;
+    for (size_t idx = 1; idx <= item_limit; idx++)
+    {
+        const history_item_t item = items->item_at_index(idx);
+        if (item.empty())
+            break;
+
+        const wcstring &str = item.str();
+        tokenizer_t tok(str.c_str(), TOK_SQUASH_ERRORS);
+        tok_t token;
+        bool in_command_position = true;
+        while (tok.next(&token))
+        {
+            if (token.type != TOK_STRING)
+            {
+                in_command_position = (token.type == TOK_PIPE || token.type == TOK_END || token.type == TOK_BACKGROUND);
+                continue;
+            }
+            if (! in_command_position)
+                continue;
+
+            const wcstring word = tok.text_of(token);
+            in_command_position = parser_keywords_is_subcommand(word);
+
+            /* Quoted, expanded or path-like words are not function names */
+            if (word.find_first_of(L"$*?{}()[]~\\'\"/%") != wcstring::npos || parser_keywords_is_reserved(word))
+                continue;
+
+            std::map<wcstring, size_t>::iterator where = positions.find(word);
+            if (where == positions.end())
+            {
+                positions[word] = uses.size();
+                command_use_t use = {word, 1, uses.size()};
+                uses.push_back(use);
+            }
+            else
+            {
+                uses.at(where->second).count++;
+            }
+        }
+    }
+
+    std::sort(uses.begin(), uses.end());
+    wcstring_list_t result;
+    for (size_t i=0; i < uses.size() && i < max_count; i++)
+    {
+        result.push_back(uses.at(i).command);
+    }
+    return result;
+}
+
+history_file_map_t::history_file_map_t(const char *map_start, size_t map_length) : start(map_start), length(map_length)
+{
+}
+
+history_file_map_t::~history_file_map_t()
+{
+    munmap((void *)start, length);
+}
+
+history_old_items_t::history_old_items_t(const shared_ptr<const history_file_map_t> &file_map, history_file_type_t file_type) : map(file_map), type(file_type)
+{
+    pthread_mutex_init(&index_lock, NULL);
+}
+
+history_old_items_t::~history_old_items_t()
+{
+    pthread_mutex_destroy(&index_lock);
+}
+
+history_item_t history_old_items_t::item_at(size_t position) const
+{
+    const size_t offset = offsets.at(position);
+    return history_t::decode_item(map->start + offset, map->length - offset, type);
+}
+
+history_item_view_t history_old_items_t::view_at(size_t position) const
+{
+    const size_t offset = offsets.at(position);
+    return history_item_view_t(map->start + offset, map->length - offset, type);
+}
+
+void history_old_items_t::inherit_indexes(const history_old_items_t &base)
+{
+    scoped_lock locker(base.index_lock);
+    assert(base.offsets.size() <= offsets.size());
+    if (base.trigram_index.is_built())
+    {
+        trigram_index = base.trigram_index;
+        for (size_t i=base.offsets.size(); i < offsets.size(); i++)
+        {
+            trigram_index.add_item(item_at(i).str(), (uint32_t)i);
+        }
+    }
+    if (base.prefix_index.is_built())
+    {
+        prefix_index = base.prefix_index;
+        for (size_t i=base.offsets.size(); i < offsets.size(); i++)
+        {
+            const history_item_t item = item_at(i);
+            prefix_index.add_item(item.str(), item.timestamp(), item.get_use_count());
+        }
+        prefix_index.finish();
+    }
+}
+
+const history_trigram_index_t &history_old_items_t::get_trigram_index() const
+{
+    /* Once built, the index is never modified, so it can be used after we unlock */
+    scoped_lock locker(index_lock);
+    if (! trigram_index.is_built())
+    {
+        time_profiler_t profiler("build_trigram_index");
+        trigram_index.prepare();
+        for (size_t i=0; i < offsets.size(); i++)
+        {
+            trigram_index.add_item(item_at(i).str(), (uint32_t)i);
+        }
+    }
+    return trigram_index;
+}
+
+const history_prefix_index_t &history_old_items_t::get_prefix_index() const
+{
+    scoped_lock locker(index_lock);
+    if (! prefix_index.is_built())
+    {
+        time_profiler_t profiler("build_prefix_index");
+        for (size_t i=0; i < offsets.size(); i++)
+        {
+            const history_item_t item = item_at(i);
+            prefix_index.add_item(item.str(), item.timestamp(), item.get_use_count());
+        }
+        prefix_index.finish();
+    }
+    return prefix_index;
+}
+
+size_t history_old_items_t::index_memory_size() const
+{
+    scoped_lock locker(index_lock);
+    return trigram_index.memory_size() + prefix_index.memory_size();
+}
+
+/* The number of buckets in the trigram index. Must be a power of 2. */
+#define HISTORY_TRIGRAM_BUCKET_COUNT (1 << 16)
+
+/* Weighs a use of an item by its age, so that recent uses count for more */
+static double frecency_weight(time_t now, time_t when)
+{
+    const time_t age = now - when;
+    if (age < 60 * 60)
+        return 4.0;
+    if (age < 24 * 60 * 60)
+        return 2.0;
+    if (age < 7 * 24 * 60 * 60)
+        return 1.0;
+    return 0.5;
+}
+
+/* An item found by items_with_prefix, either a new item or an old one */
+struct prefix_candidate_t
+{
+    bool is_new;
+    size_t where;
+    uint32_t count;
+    time_t newest_timestamp;
+    double score;
+
+    bool operator<(const prefix_candidate_t &other) const
+    {
+        if (score != other.score)
+            return score > other.score;
+        return newest_timestamp > other.newest_timestamp;
+    }
+};
+
+static bool prefix_entry_contents_less_than(const history_prefix_index_t::entry_t &entry, const wcstring &contents)
+{
+    return entry.contents < contents;
+}
+
+history_item_list_t history_t::items_with_prefix(const wcstring &prefix, size_t max_count)
+{
+    return this->snapshot()->items_with_prefix(prefix, max_count);
+}
+
+history_item_list_t history_snapshot_t::items_with_prefix(const wcstring &prefix, size_t max_count) const
+{
+    const time_t now = time(NULL);
+
+    /* A new item stands in for the old items with the same contents, since it is newer. The first candidates line up with the new entries, so that old entries can find theirs. */
+    typedef std::pair<history_prefix_index_t::const_iterator, history_prefix_index_t::const_iterator> entry_range_t;
+    const entry_range_t new_range = new_prefix_index.entries_with_prefix(prefix);
+    std::vector<prefix_candidate_t> candidates;
+    for (history_prefix_index_t::const_iterator iter = new_range.first; iter != new_range.second; ++iter)
+    {
+        const history_item_t &item = new_items.at(iter->newest_position);
+        const uint32_t count = deleted_items.count(iter->contents) ? 0 : iter->count;
+        prefix_candidate_t candidate = {true, iter->newest_position, count, item.timestamp(), 0};
+        candidates.push_back(candidate);
+    }
+
+    entry_range_t old_range;
+    if (old_items)
+    {
+        old_range = old_items->get_prefix_index().entries_with_prefix(prefix);
+    }
+    for (history_prefix_index_t::const_iterator iter = old_range.first; iter != old_range.second; ++iter)
+    {
+        if (deleted_items.count(iter->contents))
+            continue;
+
+        history_prefix_index_t::const_iterator new_entry = std::lower_bound(new_range.first, new_range.second, iter->contents, prefix_entry_contents_less_than);
+        if (new_entry != new_range.second && new_entry->contents == iter->contents)
+        {
+            prefix_candidate_t &candidate = candidates.at(new_entry - new_range.first);
+            if (candidate.count > 0)
+                candidate.count += iter->count;
+        }
+        else
+        {
+            prefix_candidate_t candidate = {false, iter->newest_position, iter->count, iter->newest_timestamp, 0};
+            candidates.push_back(candidate);
+        }
+    }
+
+    /* Score the candidates, dropping deleted items */
+    size_t kept = 0;
+    for (size_t i=0; i < candidates.size(); i++)
+    {
+        prefix_candidate_t candidate = candidates.at(i);
+        if (candidate.count == 0)
+            continue;
+        candidate.score = candidate.count * frecency_weight(now, candidate.newest_timestamp);
+        candidates.at(kept++) = candidate;
+    }
+    candidates.resize(kept);
+
+    const size_t result_count = std::min(max_count, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + result_count, candidates.end());
+
+    history_item_list_t result;
+    for (size_t i=0; i < result_count; i++)
+    {
+        const prefix_candidate_t &candidate = candidates.at(i);
+        if (candidate.is_new)
+        {
+            result.push_back(new_items.at(candidate.where));
+        }
+        else
+        {
+            result.push_back(old_items->item_at(candidate.where));
+        }
+    }
+    return result;
+}
+
+void history_prefix_index_t::clear()
+{
+    entries.clear();
+    sorted_count = 0;
+    item_count = 0;
+    built = false;
+}
+
+size_t history_prefix_index_t::memory_size() const
+{
+    size_t result = entries.capacity() * sizeof(entry_t);
+    for (size_t i=0; i < entries.size(); i++)
+    {
+        result += wcstring_heap_size(entries[i].contents);
+    }
+    return result;
+}
+
+void history_prefix_index_t::add_item(const wcstring &contents, time_t timestamp, uint32_t use_count)
+{
+    entry_t entry;
+    entry.contents = contents;
+    entry.count = use_count;
+    entry.newest_position = (uint32_t)item_count;
+    entry.newest_timestamp = timestamp;
+    entries.push_back(entry);
+    item_count++;
+}
+
+static bool prefix_entry_precedes(const history_prefix_index_t::entry_t &a, const history_prefix_index_t::entry_t &b)
+{
+    return a.contents < b.contents;
+}
+
+void history_prefix_index_t::finish()
+{
+    /* Sort the new entries and merge them in. Both sorts are stable, so entries with the same contents stay in increasing position. */
+    std::stable_sort(entries.begin() + sorted_count, entries.end(), prefix_entry_precedes);
+    std::inplace_merge(entries.begin(), entries.begin() + sorted_count, entries.end(), prefix_entry_precedes);
+
+    /* Merge runs of entries with the same contents into the last one, which is the newest */
+    size_t out = 0;
+    for (size_t i=0; i < entries.size(); i++)
+    {
+        if (out > 0 && entries[out - 1].contents == entries[i].contents)
+        {
+            entry_t &merged = entries[out - 1];
+            merged.count += entries[i].count;
+            merged.newest_position = entries[i].newest_position;
+            merged.newest_timestamp = entries[i].newest_timestamp;
+        }
+        else
+        {
+            if (out != i)
+            {
+                entry_t &moved = entries[out];
+                moved.contents.swap(entries[i].contents);
+                moved.count = entries[i].count;
+                moved.newest_position = entries[i].newest_position;
+                moved.newest_timestamp = entries[i].newest_timestamp;
+            }
+            out++;
+        }
+    }
+    entries.resize(out);
+    sorted_count = entries.size();
+    built = true;
+}
+
+/* Orders an entry before the prefix if it sorts before it, and after it if it sorts after it without starting with it, so that the entries starting with the prefix are those equal to it */
+struct prefix_entry_compare_t
+{
+    bool operator()(const history_prefix_index_t::entry_t &entry, const wcstring &prefix) const
+    {
+        return entry.contents < prefix;
+    }
+
+    bool operator()(const wcstring &prefix, const history_prefix_index_t::entry_t &entry) const
+    {
+        return prefix < entry.contents && ! string_prefixes_string(prefix, entry.contents);
+    }
+};
+
+std::pair<history_prefix_index_t::const_iterator, history_prefix_index_t::const_iterator> history_prefix_index_t::entries_with_prefix(const wcstring &prefix) const
+{
+    assert(sorted_count == entries.size());
+    return std::equal_range(entries.begin(), entries.end(), prefix, prefix_entry_compare_t());
+}
+
+size_t history_trigram_index_t::bucket_for_trigram(const wchar_t *trigram)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i=0; i < 3; i++)
+    {
+        hash ^= (uint32_t)trigram[i];
+        hash *= 16777619U;
+    }
+    return hash & (HISTORY_TRIGRAM_BUCKET_COUNT - 1);
+}
+
+void history_trigram_index_t::clear()
+{
+    std::vector<posting_list_t>().swap(buckets);
+}
+
+size_t history_trigram_index_t::memory_size() const
+{
+    size_t result = buckets.capacity() * sizeof(posting_list_t);
+    for (size_t i=0; i < buckets.size(); i++)
+    {
+        result += buckets[i].capacity() * sizeof(uint32_t);
+    }
+    return result;
+}
+
+void history_trigram_index_t::prepare()
+{
+    buckets.assign(HISTORY_TRIGRAM_BUCKET_COUNT, posting_list_t());
+}
+
+void history_trigram_index_t::add_item(const wcstring &contents, uint32_t position)
+{
+    assert(is_built());
+    if (contents.size() < 3)
+        return;
+
+    /* Add the position to each bucket once, even if the item contains a trigram more than once */
+    std::vector<size_t> item_buckets;
+    item_buckets.reserve(contents.size() - 2);
+    for (size_t i=0; i + 3 <= contents.size(); i++)
+    {
+        item_buckets.push_back(bucket_for_trigram(contents.c_str() + i));
+    }
+    std::sort(item_buckets.begin(), item_buckets.end());
+    item_buckets.erase(std::unique(item_buckets.begin(), item_buckets.end()), item_buckets.end());
+    for (size_t i=0; i < item_buckets.size(); i++)
+    {
+        posting_list_t &list = buckets.at(item_buckets.at(i));
+        assert(list.empty() || list.back() < position);
+        list.push_back(position);
+    }
+}
+
+long history_trigram_index_t::find_candidate(const wcstring &term, uint32_t max_position) const
+{
+    assert(is_built());
+    if (term.size() < 3)
+        return max_position;
+
+    std::vector<const posting_list_t *> lists;
+    for (size_t i=0; i + 3 <= term.size(); i++)
+    {
+        lists.push_back(&buckets.at(bucket_for_trigram(term.c_str() + i)));
+    }
+
+    /* Leapfrog intersection: walk the lists round-robin, lowering the candidate to the largest position each list has at or below it, until every list agrees */
+    uint32_t candidate = max_position;
+    size_t agreeing = 0;
+    for (size_t i=0; agreeing < lists.size(); i = (i + 1) % lists.size())
+    {
+        const posting_list_t &list = *lists.at(i);
+        posting_list_t::const_iterator where = std::upper_bound(list.begin(), list.end(), candidate);
+        if (where == list.begin())
+        {
+            return -1;
+        }
+        uint32_t found = *(where - 1);
+        if (found == candidate)
+        {
+            agreeing++;
+        }
+        else
+        {
+            candidate = found;
+            agreeing = 1;
+        }
+    }
+    return candidate;
+}
+
+/* Read one line, stripping off any newline, and updating cursor. Note that our input string is NOT null terminated; it's just a memory mapped file. */
+static size_t read_line(const char *base, size_t cursor, size_t len, std::string &result)
+{
+    /* Locate the newline */
+    assert(cursor <= len);
+    const char *start = base + cursor;
+    const char *newline = (char *)memchr(start, '\n', len - cursor);
+    if (newline != NULL)
+    {
+        /* We found a newline. */
+        result.assign(start, newline - start);
+
+        /* Return the amount to advance the cursor; skip over the newline */
+        return newline - start + 1;
+    }
+    else
+    {
+        /* We ran off the end */
+        result.clear();
+        return len - cursor;
+    }
+}
+
+/* Trims leading spaces in the given string, returning how many there were */
+static size_t trim_leading_spaces(std::string &str)
+{
+    size_t i = 0, max = str.size();
+    while (i < max && str[i] == ' ')
+        i++;
+    str.erase(0, i);
+    return i;
+}
+
+static bool extract_prefix_and_unescape_yaml(std::string *key, std::string *value, const std::string &line)
+{
+    size_t where = line.find(":");
+    if (where != std::string::npos)
+    {
+        key->assign(line, 0, where);
+
+        // skip a space after the : if necessary
+        size_t val_start = where + 1;
+        if (val_start < line.size() && line.at(val_start) == ' ')
+            val_start++;
+        value->assign(line, val_start, line.size() - val_start);
+
+        unescape_yaml(key);
+        unescape_yaml(value);
+    }
+    return where != std::string::npos;
+}
+
+/* Decode an item via the fish 2.0 format */
+history_item_t history_t::decode_item_fish_2_0(const char *base, size_t len)
+{
+    wcstring cmd;
+    time_t when = 0;
+    path_list_t paths;
+    uint32_t use_count = 1;
+
+    size_t indent = 0, cursor = 0;
+    std::string key, value, line;
+    
+    /* Read the "- cmd:" line */
+    size_t advance = read_line(base, cursor, len, line);
+    trim_leading_spaces(line);
+    if (! extract_prefix_and_unescape_yaml(&key, &value, line) || key != "- cmd")
+    {
+        goto done;
+    }
+    
+    cursor += advance;
+    cmd = str2wcstring(value);
+
+    /* Read the remaining lines */
+    for (;;)
+    {
+        /* Read a line */
+        size_t advance = read_line(base, cursor, len, line);
+
+        /* Count and trim leading spaces */
+        size_t this_indent = trim_leading_spaces(line);
+        if (indent == 0)
+            indent = this_indent;
+
+        if (this_indent == 0 || indent != this_indent)
+            break;
+
+        if (! extract_prefix_and_unescape_yaml(&key, &value, line))
+            break;
+
+        /* We are definitely going to consume this line */
+        cursor += advance;
+
+        if (key == "when")
+        {
+            /* Parse an int from the timestamp. Should this fail, strtol returns 0; that's acceptable. */
+            char *end = NULL;
+            long tmp = strtol(value.c_str(), &end, 0);
+            when = tmp;
+        }
+        else if (key == "uses")
+        {
+            unsigned long tmp = strtoul(value.c_str(), NULL, 10);
+            if (tmp > 1 && tmp <= UINT32_MAX)
+                use_count = (uint32_t)tmp;
+        }
+        else if (key == "paths")
+        {
+            /* Read lines starting with " - " until we can't read any more */
+            for (;;)
+            {
+                size_t advance = read_line(base, cursor, len, line);
                 if (trim_leading_spaces(line) <= indent)
                     break;
 
@@ -880,6 +1805,33 @@ history_item_t history_t::decode_item_fish_2_0(const char *base, size_t len)
 done:
     history_item_t result(cmd, when);
     result.required_paths.swap(paths);
+    result.use_count = use_count;
+    return result;
+}
+
+/* Decode an item via the binary format. The strings are converted directly out of the mapped record. */
+history_item_t history_t::decode_item_fish_binary(const char *base, size_t len)
+{
+    history_binary_record_header_t header;
+    if (! read_binary_record_header(base, len, &header))
+    {
+        return history_item_t(wcstring(), 0);
+    }
+
+    size_t cursor = sizeof header;
+    history_item_t result(str2wcstring(base + cursor, header.cmd_length), (time_t)header.timestamp);
+    result.use_count = std::max(header.use_count, (uint32_t)1);
+    cursor += header.cmd_length;
+
+    result.required_paths.reserve(header.path_count);
+    for (uint32_t i=0; i < header.path_count; i++)
+    {
+        uint32_t path_length;
+        memcpy(&path_length, base + cursor, sizeof path_length);
+        cursor += sizeof path_length;
+        result.required_paths.push_back(str2wcstring(base + cursor, path_length));
+        cursor += path_length;
+    }
     return result;
 }
 
@@ -891,11 +1843,70 @@ history_item_t history_t::decode_item(const char *base, size_t len, history_file
             return history_t::decode_item_fish_1_x(base, len);
         case history_type_fish_2_0:
             return history_t::decode_item_fish_2_0(base, len);
+        case history_type_fish_binary:
+            return history_t::decode_item_fish_binary(base, len);
         default:
             return history_item_t(L"");
     }
 }
 
+history_encoded_term_t::history_encoded_term_t(const wcstring &term) : utf8(wcs2string(term)), escaped(utf8), has_backslash(utf8.find('\\') != std::string::npos)
+{
+    escape_yaml(&escaped);
+}
+
+history_item_view_t::history_item_view_t(const char *base, size_t len, history_file_type_t t) : cmd(NULL), cmd_length(0), type(t)
+{
+    if (type == history_type_fish_2_0)
+    {
+        /* The command is the rest of the "- cmd:" line, as decode_item_fish_2_0 reads it */
+        size_t cursor = 0;
+        while (cursor < len && base[cursor] == ' ')
+            cursor++;
+        const size_t prefix_len = strlen("- cmd:");
+        if (len - cursor >= prefix_len && ! memcmp(base + cursor, "- cmd:", prefix_len))
+        {
+            cursor += prefix_len;
+            if (cursor < len && base[cursor] == ' ')
+                cursor++;
+            const char *newline = (const char *)memchr(base + cursor, '\n', len - cursor);
+            cmd = base + cursor;
+            cmd_length = (newline ? newline - cmd : len - cursor);
+        }
+    }
+    else if (type == history_type_fish_binary)
+    {
+        history_binary_record_header_t header;
+        if (read_binary_record_header(base, len, &header))
+        {
+            cmd = base + sizeof header;
+            cmd_length = header.cmd_length;
+        }
+    }
+}
+
+bool history_item_view_t::may_match_search(const history_encoded_term_t &term, enum history_search_type_t search_type) const
+{
+    if (cmd == NULL || (type == history_type_fish_2_0 && term.has_backslash))
+        return true;
+
+    /* Escaping maps each character to its own sequence, and no sequence begins another, so the escaped command starts with the escaped term exactly when the command starts with the term. A term found inside the escaped command may overlap an escape sequence, though. */
+    const std::string &encoded = (type == history_type_fish_2_0 ? term.escaped : term.utf8);
+    if (encoded.size() > cmd_length)
+        return false;
+    switch (search_type)
+    {
+        case HISTORY_SEARCH_TYPE_CONTAINS:
+            return std::search(cmd, cmd + cmd_length, encoded.begin(), encoded.end()) != cmd + cmd_length || encoded.empty();
+
+        case HISTORY_SEARCH_TYPE_PREFIX:
+            return ! memcmp(cmd, encoded.data(), encoded.size());
+
+        default:
+            return true;
+    }
+}
+
 /**
    Remove backslashes from all newlines. This makes a string from the
    history file better formated for on screen display.
@@ -982,69 +1993,266 @@ history_item_t history_t::decode_item_fish_1_x(const char *begin, size_t length)
                         timestamp = tm;
                     }
 
-                }
+                }
+
+                out.clear();
+                timestamp_mode = false;
+                continue;
+            }
+            if (!was_backslash)
+                break;
+        }
+
+        if (first_char)
+        {
+            if (c == L'#')
+                timestamp_mode = true;
+        }
+
+        first_char = false;
+
+        out.push_back(c);
+
+        was_backslash = ((c == L'\\') && !was_backslash);
+
+    }
+
+    out = history_unescape_newlines_fish_1_x(out);
+    return history_item_t(out, timestamp);
+}
+
+
+/* Try to infer the history file type based on inspecting the data */
+static history_file_type_t infer_file_type(const char *data, size_t len)
+{
+    history_file_type_t result = history_type_unknown;
+    if (len > 0)
+    {
+        if (len >= HISTORY_BINARY_MAGIC_LEN && ! memcmp(data, HISTORY_BINARY_MAGIC, HISTORY_BINARY_MAGIC_LEN))
+        {
+            result = history_type_fish_binary;
+        }
+        else if (data[0] == '#')
+        {
+            /* Old fish started with a # */
+            result = history_type_fish_1_x;
+        }
+        else
+        {
+            /* Assume new fish */
+            result = history_type_fish_2_0;
+        }
+    }
+    return result;
+}
+
+/* Returns the timestamp of the fish 2.0 item at the given offset, or 0 if it has none */
+static time_t timestamp_of_item_fish_2_0(const char *begin, size_t mmap_length, size_t offset)
+{
+    const char * const end = begin + mmap_length;
+    time_t timestamp = 0;
+    for (const char *interior_line = next_line(begin + offset, end - (begin + offset));
+            interior_line != NULL && interior_line[0] == ' ';
+            interior_line = next_line(interior_line, end - interior_line))
+    {
+        if (parse_timestamp(interior_line, &timestamp))
+            break;
+    }
+    return timestamp;
+}
+
+/* Returns the timestamp of the item at the given offset, or 0 if it has none. Only the indexable types are supported. */
+static time_t timestamp_of_item(const char *begin, size_t mmap_length, history_file_type_t type, size_t offset)
+{
+    if (type == history_type_fish_binary)
+    {
+        history_binary_record_header_t header;
+        return read_binary_record_header(begin + offset, mmap_length - offset, &header) ? (time_t)header.timestamp : 0;
+    }
+    assert(type == history_type_fish_2_0);
+    return timestamp_of_item_fish_2_0(begin, mmap_length, offset);
+}
+
+/*
+
+The history index is a sidecar file (fish_history.idx) recording the offset and timestamp of every item in a fish 2.0 or binary history file, so that populate_from_mmap() need only scan the part of the file appended since the index was written. Here is its layout, in native byte order:
+
+  history_index_header_t
+  history_index_entry_t[entry_count]
+
+The header identifies the history file it describes, and the number of bytes of it that were indexed. Since history files are append-only, an index remains valid for its prefix until the file is replaced; to guard against inode reuse, we also hash the bytes just before the indexed length. Like the history file, the index is written to a temporary file and moved into place, so readers never see a partial index. A stale or corrupt index is simply ignored.
+*/
+
+#define HISTORY_INDEX_MAGIC "fishidx1"
+
+/* Only write an index if we found at least this many items that it does not cover. Small histories are cheap to scan and don't get an index at all. */
+#define HISTORY_INDEX_REWRITE_THRESHOLD 64
+
+/* How many bytes before the indexed length are hashed to validate the index */
+#define HISTORY_INDEX_HASH_LENGTH 256
+
+struct history_index_header_t
+{
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t generation;
+    uint64_t indexed_length;
+    uint64_t tail_hash;
+    uint64_t entry_count;
+};
+
+struct history_index_entry_t
+{
+    uint64_t offset;
+    int64_t timestamp;
+};
+
+typedef std::vector<history_index_entry_t> history_index_entry_list_t;
+
+/* FNV-1a hash of the (up to) HISTORY_INDEX_HASH_LENGTH bytes that end at the given length */
+static uint64_t history_index_tail_hash(const char *tail_end, size_t length)
+{
+    size_t hash_len = std::min(length, (size_t)HISTORY_INDEX_HASH_LENGTH);
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *cursor = tail_end - hash_len; cursor < tail_end; cursor++)
+    {
+        hash ^= (unsigned char)*cursor;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Reads the index at the given path. If it describes a prefix of the mapped history file with the given file ID, appends its entries and returns the indexed length; otherwise returns 0. */
+static size_t read_history_index(const wcstring &index_path, const file_id_t &file_id, const char *map_start, size_t map_len, history_index_entry_list_t *entries)
+{
+    int fd = wopen_cloexec(index_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
 
-                out.clear();
-                timestamp_mode = false;
-                continue;
-            }
-            if (!was_backslash)
-                break;
-        }
+    size_t result = 0;
+    history_index_header_t header = {};
+    if (read_loop(fd, &header, sizeof header) == (ssize_t)sizeof header &&
+            ! memcmp(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic) &&
+            header.device == (uint64_t)file_id.device &&
+            header.inode == (uint64_t)file_id.inode &&
+            header.generation == (uint64_t)file_id.generation &&
+            header.indexed_length > 0 && header.indexed_length <= map_len &&
+            header.entry_count <= header.indexed_length &&
+            header.tail_hash == history_index_tail_hash(map_start + header.indexed_length, header.indexed_length))
+    {
+        const size_t old_size = entries->size();
+        entries->resize(old_size + header.entry_count);
+        const size_t entries_len = header.entry_count * sizeof(history_index_entry_t);
+        bool ok = (header.entry_count == 0 || read_loop(fd, &entries->at(old_size), entries_len) == (ssize_t)entries_len);
 
-        if (first_char)
+        /* Offsets must be increasing and within the indexed region */
+        for (size_t i = old_size; ok && i < entries->size(); i++)
         {
-            if (c == L'#')
-                timestamp_mode = true;
+            uint64_t offset = entries->at(i).offset;
+            ok = offset < header.indexed_length && (i == old_size || offset > entries->at(i - 1).offset);
         }
 
-        first_char = false;
+        if (ok)
+        {
+            result = header.indexed_length;
+        }
+        else
+        {
+            entries->resize(old_size);
+        }
+    }
+    close(fd);
+    return result;
+}
 
-        out.push_back(c);
+/* Writes an index for the history file with the given file ID. tail_hash is the history_index_tail_hash() of the indexed contents. */
+static void write_history_index(const wcstring &index_path, const file_id_t &file_id, size_t indexed_length, uint64_t tail_hash, const history_index_entry_list_t &entries)
+{
+    wcstring tmp_name;
+    int out_fd = create_temporary_file(index_path + L".XXXXXX", &tmp_name);
+    if (out_fd < 0)
+        return;
 
-        was_backslash = ((c == L'\\') && !was_backslash);
+    history_index_header_t header = {};
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof header.magic);
+    header.device = (uint64_t)file_id.device;
+    header.inode = (uint64_t)file_id.inode;
+    header.generation = (uint64_t)file_id.generation;
+    header.indexed_length = indexed_length;
+    header.tail_hash = tail_hash;
+    header.entry_count = entries.size();
 
+    bool ok = write_loop(out_fd, (const char *)&header, sizeof header) >= 0;
+    if (ok && ! entries.empty())
+    {
+        ok = write_loop(out_fd, (const char *)&entries.at(0), entries.size() * sizeof(history_index_entry_t)) >= 0;
     }
+    close(out_fd);
 
-    out = history_unescape_newlines_fish_1_x(out);
-    return history_item_t(out, timestamp);
+    if (! ok || 0 > wrename(tmp_name, index_path))
+    {
+        debug(2, L"Error when writing history index file");
+        wunlink(tmp_name);
+    }
 }
 
-
-/* Try to infer the history file type based on inspecting the data */
-static history_file_type_t infer_file_type(const char *data, size_t len)
+void history_t::populate_from_mmap(const shared_ptr<const history_file_map_t> &map)
 {
-    history_file_type_t result = history_type_unknown;
-    if (len > 0)
+    const char * const mmap_start = map->start;
+    const size_t mmap_length = map->length;
+    const history_file_type_t mmap_type = infer_file_type(mmap_start, mmap_length);
+    shared_ptr<history_old_items_t> items(new history_old_items_t(map, mmap_type));
+    if (mmap_type == history_type_fish_2_0 || mmap_type == history_type_fish_binary)
     {
-        /* Old fish started with a # */
-        if (data[0] == '#')
+        /* Offsets and timestamps of every item, including those past our boundary timestamp, so that we can write them to the index */
+        history_index_entry_list_t entries;
+        const wcstring index_path = history_filename(name, L".idx");
+        size_t cursor = read_history_index(index_path, mmap_file_id, mmap_start, mmap_length, &entries);
+        const size_t indexed_count = entries.size();
+
+        /* Scan the tail that the index does not cover */
+        for (;;)
         {
-            result = history_type_fish_1_x;
+            size_t offset = offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, 0);
+            if (offset == (size_t)(-1))
+                break;
+
+            history_index_entry_t entry = {offset, timestamp_of_item(mmap_start, mmap_length, mmap_type, offset)};
+            entries.push_back(entry);
         }
-        else
+
+        /* Remember the items that are not newer than our boundary. An item without a timestamp is always remembered. */
+        for (history_index_entry_list_t::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
         {
-            /* Assume new fish */
-            result = history_type_fish_2_0;
+            if (iter->timestamp <= (int64_t)boundary_timestamp)
+                items->offsets.push_back((size_t)iter->offset);
+            else
+                newer_item_offsets.push_back((size_t)iter->offset);
         }
-    }
-    return result;
-}
+        mmap_scanned_length = cursor;
 
-void history_t::populate_from_mmap(void)
-{
-    mmap_type = infer_file_type(mmap_start, mmap_length);
-    size_t cursor = 0;
-    for (;;)
+        /* If the index was missing or is getting stale, update it. The cursor is left at the end of the last complete line, which is where the next scan must resume. */
+        if (entries.size() - indexed_count >= HISTORY_INDEX_REWRITE_THRESHOLD && cursor > 0)
+        {
+            write_history_index(index_path, mmap_file_id, cursor, history_index_tail_hash(mmap_start + cursor, cursor), entries);
+        }
+    }
+    else
     {
-        size_t offset = offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, boundary_timestamp);
-        // If we get back -1, we're done
-        if (offset == (size_t)(-1))
-            break;
+        size_t cursor = 0;
+        for (;;)
+        {
+            size_t offset = offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, boundary_timestamp);
+            // If we get back -1, we're done
+            if (offset == (size_t)(-1))
+                break;
 
-        // Remember this item
-        old_item_offsets.push_back(offset);
+            // Remember this item
+            items->offsets.push_back(offset);
+        }
     }
+    old_items = items;
 }
 
 /* Do a private, read-only map of the entirety of a history file with the given name. Returns true if successful. Returns the mapped memory region by reference. */
@@ -1100,12 +2308,14 @@ bool history_t::load_old_if_needed(void)
     //signal_block();
 
     bool ok = false;
-    if (map_file(name, &mmap_start, &mmap_length, &mmap_file_id))
+    const char *map_start = NULL;
+    size_t map_length = 0;
+    if (map_file(name, &map_start, &map_length, &mmap_file_id))
     {
         // Here we've mapped the file
         ok = true;
         time_profiler_t profiler("populate_from_mmap");
-        this->populate_from_mmap();
+        this->populate_from_mmap(shared_ptr<const history_file_map_t>(new history_file_map_t(map_start, map_length)));
     }
 
     //signal_unblock();
@@ -1146,6 +2356,9 @@ bool history_search_t::go_backwards()
     if (idx == max_idx)
         return false;
 
+    if (! snapshot)
+        snapshot = history->snapshot();
+
     const bool main_thread = is_main_thread();
 
     while (++idx < max_idx)
@@ -1155,7 +2368,10 @@ bool history_search_t::go_backwards()
             return false;
         }
 
-        const history_item_t item = history->item_at_index(idx);
+        /* Skip over items that we can rule out without decoding them */
+        idx = snapshot->next_candidate_index(term, encoded_term, search_type, idx);
+
+        const history_item_t item = snapshot->item_at_index(idx);
         /* We're done if it's empty or we cancelled */
         if (item.empty())
         {
@@ -1177,6 +2393,9 @@ bool history_search_t::go_backwards()
 void history_search_t::go_to_end(void)
 {
     prev_matches.clear();
+
+    /* Start over with the current items */
+    snapshot.reset();
 }
 
 /** Returns if we are at the end, which is where we start. */
@@ -1289,44 +2508,156 @@ static wcstring history_filename(const wcstring &name, const wcstring &suffix)
 void history_t::clear_file_state()
 {
     ASSERT_IS_LOCKED(lock);
-    /* Erase everything we know about our file */
-    if (mmap_start != NULL && mmap_start != MAP_FAILED)
+    /* Erase everything we know about our file. Snapshots keep the old items they have, and the file stays mapped until they are done with it. */
+    old_items.reset();
+    loaded_old = false;
+    newer_item_offsets.clear();
+    mmap_scanned_length = 0;
+    invalidate_distinct_items();
+}
+
+bool history_t::incorporate_appended_items(void)
+{
+    ASSERT_IS_LOCKED(lock);
+    if (! old_items || (old_items->type != history_type_fish_2_0 && old_items->type != history_type_fish_binary))
+        return false;
+    const char * const mmap_start = old_items->map->start;
+    const size_t mmap_length = old_items->map->length;
+    const history_file_type_t mmap_type = old_items->type;
+
+    const char *new_start = NULL;
+    size_t new_length = 0;
+    file_id_t new_id = kInvalidFileID;
+    if (! map_file(name, &new_start, &new_length, &new_id))
+        return false;
+    const shared_ptr<const history_file_map_t> new_map(new history_file_map_t(new_start, new_length));
+
+    /* Rewriting the file (vacuuming, deleting items, changing the format) always moves a new file into place. Beyond that, make sure the file only grew, and that it still ends the part we mapped the same way. */
+    const size_t check_length = std::min(mmap_length, (size_t)256);
+    if (new_id.device != mmap_file_id.device || new_id.inode != mmap_file_id.inode || new_length < mmap_length ||
+            memcmp(new_start + mmap_length - check_length, mmap_start + mmap_length - check_length, check_length) != 0)
     {
-        munmap((void *)mmap_start, mmap_length);
+        return false;
     }
-    mmap_start = NULL;
-    mmap_length = 0;
-    loaded_old = false;
-    old_item_offsets.clear();
+
+    /* Offsets into the old map are just as good in the new one */
+    mmap_file_id = new_id;
+
+    /* The candidates are the items we passed over as too new, followed by those that were appended */
+    std::deque<size_t> candidates;
+    candidates.swap(newer_item_offsets);
+    size_t cursor = mmap_scanned_length;
+    for (;;)
+    {
+        size_t offset = offset_of_next_item(new_start, new_length, mmap_type, &cursor, 0);
+        if (offset == (size_t)(-1))
+            break;
+        candidates.push_back(offset);
+    }
+    mmap_scanned_length = cursor;
+
+    std::deque<size_t> now_old;
+    for (size_t i=0; i < candidates.size(); i++)
+    {
+        const size_t offset = candidates.at(i);
+        if (timestamp_of_item(new_start, new_length, mmap_type, offset) <= boundary_timestamp)
+            now_old.push_back(offset);
+        else
+            newer_item_offsets.push_back(offset);
+    }
+
+    /* Our old items are shared with snapshots, so the new ones go in a copy, which refers to the new map. If nothing became old, we keep the items we have, along with the old map, which holds all of them. */
+    if (now_old.empty())
+        return true;
+
+    shared_ptr<history_old_items_t> items(new history_old_items_t(new_map, mmap_type));
+    const std::vector<size_t> &offsets = old_items->offsets;
+
+    /* Items in the indexes are identified by position. If the new old items all come after the existing ones, they just extend the indexes; otherwise they have to be rebuilt. */
+    if (offsets.empty() || now_old.front() > offsets.back())
+    {
+        items->offsets.reserve(offsets.size() + now_old.size());
+        items->offsets.assign(offsets.begin(), offsets.end());
+        items->offsets.insert(items->offsets.end(), now_old.begin(), now_old.end());
+        items->inherit_indexes(*old_items);
+    }
+    else
+    {
+        std::merge(offsets.begin(), offsets.end(), now_old.begin(), now_old.end(), std::back_inserter(items->offsets));
+    }
+    old_items = items;
+    invalidate_distinct_items();
+    return true;
 }
 
 void history_t::compact_new_items()
 {
-    /* Keep only the most recent items with the given contents. This algorithm could be made more efficient, but likely would consume more memory too. */
-    std::set<wcstring> seen;
+    /* Every added item had a hash no other new item had, so there is nothing to do */
+    if (! new_items_may_have_duplicates)
+        return;
+    new_items_may_have_duplicates = false;
+
+    /* Keep only the most recent items with the given contents. Walk from newest to oldest, remembering the items we keep by the hash of their contents, so that only items whose hashes collide are compared. */
+    typedef std::multimap<uint64_t, size_t> kept_map_t;
+    kept_map_t kept;
+    std::vector<bool> duplicate(new_items.size(), false);
     size_t idx = new_items.size();
     while (idx--)
     {
-        const history_item_t &item = new_items[idx];
-        if (! seen.insert(item.contents).second)
+        const history_item_t &item = new_items.at(idx);
+        const uint64_t hash = history_contents_hash(item.str());
+        std::pair<kept_map_t::iterator, kept_map_t::iterator> range = kept.equal_range(hash);
+        kept_map_t::iterator match = range.first;
+        while (match != range.second && new_items.at(match->second).str() != item.str())
+            ++match;
+
+        if (match == range.second)
         {
-            // This item was not inserted because it was already in the set, so delete the item at this index
-            new_items.erase(new_items.begin() + idx);
+            kept.insert(std::make_pair(hash, idx));
+            continue;
+        }
+
+        duplicate.at(idx) = true;
+        if (idx >= first_unwritten_new_item_index)
+        {
+            /* Neither this item nor the newer one is in the file yet, so the newer one has to carry our uses */
+            history_item_t &newer = new_items.at(match->second);
+            newer.use_count += item.use_count;
+        }
+    }
 
+    /* Delete the duplicates in one pass */
+    size_t written_duplicates = 0, dest = 0;
+    for (idx = 0; idx < new_items.size(); idx++)
+    {
+        if (duplicate.at(idx))
+        {
+            /* Decrement first_unwritten_new_item_index if we are deleting a previously written item */
             if (idx < first_unwritten_new_item_index)
-            {
-                /* Decrement first_unwritten_new_item_index if we are deleting a previously written item */
-                first_unwritten_new_item_index--;
-            }
+                written_duplicates++;
+            continue;
         }
+        if (dest != idx)
+            new_items.at(dest) = new_items.at(idx);
+        dest++;
+    }
+
+    if (dest < new_items.size())
+    {
+        new_items.erase(new_items.begin() + dest, new_items.end());
+        invalidate_distinct_items();
+        update_snapshot();
+        first_unwritten_new_item_index -= written_duplicates;
     }
+
+    /* Forget the hashes of items that are gone */
+    new_item_hashes.clear();
+    for (kept_map_t::const_iterator iter = kept.begin(); iter != kept.end(); ++iter)
+        new_item_hashes.insert(iter->first);
 }
 
-bool history_t::save_internal_via_rewrite()
+bool history_t::rewrite_file(history_file_type_t output_type, const history_item_list_t &new_items, const std::set<wcstring> &deleted_items)
 {
-    /* This must be called while locked */
-    ASSERT_IS_LOCKED(lock);
-
     bool ok = false;
 
     wcstring tmp_name_template = history_filename(name, L".XXXXXX");
@@ -1344,6 +2675,8 @@ bool history_t::save_internal_via_rewrite()
         if (map_file(name, &local_mmap_start, &local_mmap_size, NULL))
         {
             const history_file_type_t local_mmap_type = infer_file_type(local_mmap_start, local_mmap_size);
+            if (output_type == history_type_unknown)
+                output_type = local_mmap_type;
             size_t cursor = 0;
             for (;;)
             {
@@ -1365,7 +2698,7 @@ bool history_t::save_internal_via_rewrite()
                     if (new_item_iter->timestamp() < old_item.timestamp())
                     {
                         /* This "new item" is in fact older. */
-                        lru.add_item(*new_item_iter);
+                        lru.add_item(*new_item_iter, false);
                     }
                     else
                     {
@@ -1374,59 +2707,57 @@ bool history_t::save_internal_via_rewrite()
                     }
                 }
 
-                /* Now add this old item */
-                lru.add_item(old_item);
+                /* Now add this old item. Each item in the file stands for uses of its own. */
+                lru.add_item(old_item, true);
             }
             munmap((void *)local_mmap_start, local_mmap_size);
         }
 
-        /* Insert any remaining new items */
+        /* Insert any remaining new items. Those we have saved are in the file already, so they do not add uses. */
         for (; new_item_iter != new_items.end(); ++new_item_iter)
         {
-            lru.add_item(*new_item_iter);
+            lru.add_item(*new_item_iter, false);
         }
 
-        signal_block();
+        /* Preserve the binary format; anything else (including fish 1.x) is written in the fish 2.0 format */
+        if (output_type != history_type_fish_binary)
+            output_type = history_type_fish_2_0;
 
-        /* Try to create a temporary file, up to 10 times. We don't use mkstemps because we want to open it CLO_EXEC. This should almost always succeed on the first try. */
-        int out_fd = -1;
-        wcstring tmp_name;
-        for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++)
-        {
-            char *narrow_str = wcs2str(tmp_name_template.c_str());
-#if HAVE_MKOSTEMP
-            out_fd = mkostemp(narrow_str, O_CLOEXEC);
-            if (out_fd >= 0)
-            {
-                tmp_name = str2wcstring(narrow_str);
-            }
-#else
-            if (narrow_str && mktemp(narrow_str))
-            {
-                /* It was successfully templated; try opening it atomically */
-                tmp_name = str2wcstring(narrow_str);
-                out_fd = wopen_cloexec(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0600);
-            }
-#endif
-            free(narrow_str);
-        }
+        /* Background threads already have all signals blocked */
+        const bool block_signals = is_main_thread();
+        if (block_signals) signal_block();
 
+        wcstring tmp_name;
+        int out_fd = create_temporary_file(tmp_name_template, &tmp_name);
         if (out_fd >= 0)
         {
-            /* Write them out */
+            /* Write them out, remembering where each item lands so we can index the new file */
             bool errored = false;
             history_output_buffer_t buffer;
+            size_t written_length = 0;
+            history_index_entry_list_t index_entries;
+            if (output_type == history_type_fish_binary)
+            {
+                buffer.append_bytes(HISTORY_BINARY_MAGIC, HISTORY_BINARY_MAGIC_LEN);
+            }
             for (history_lru_cache_t::iterator iter = lru.begin(); iter != lru.end(); ++iter)
             {
                 const history_lru_node_t *node = *iter;
-                append_yaml_to_buffer(node->key, node->timestamp, node->required_paths, &buffer);
-                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE && ! buffer.flush_to_fd(out_fd))
+                const history_index_entry_t entry = {written_length + buffer.output_size(), node->timestamp};
+                index_entries.push_back(entry);
+                append_item_to_buffer(output_type, node->key, node->timestamp, node->required_paths, node->use_count, &buffer);
+                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE)
                 {
-                    errored = true;
-                    break;
+                    written_length += buffer.output_size();
+                    if (! buffer.flush_to_fd(out_fd))
+                    {
+                        errored = true;
+                        break;
+                    }
                 }
             }
 
+            written_length += buffer.output_size();
             if (! errored && buffer.flush_to_fd(out_fd))
             {
                 ok = true;
@@ -1447,16 +2778,34 @@ bool history_t::save_internal_via_rewrite()
                 {
                     debug(2, L"Error when renaming history file");
                 }
+                else if (index_entries.size() >= HISTORY_INDEX_REWRITE_THRESHOLD)
+                {
+                    /* Index the file we just wrote, so the next load does not have to scan it. Read back its tail to compute the validation hash. */
+                    char tail[HISTORY_INDEX_HASH_LENGTH];
+                    size_t tail_len = std::min(written_length, sizeof tail);
+                    if (pread(out_fd, tail, tail_len, written_length - tail_len) == (ssize_t)tail_len)
+                    {
+                        write_history_index(history_filename(name, L".idx"), file_id_for_fd(out_fd), written_length, history_index_tail_hash(tail + tail_len, written_length), index_entries);
+                    }
+                }
             }
             close(out_fd);
         }
 
-        signal_unblock();
+        if (block_signals) signal_unblock();
 
         /* Make sure we clear all nodes, since this doesn't happen automatically */
         lru.evict_all_nodes();
     }
+    return ok;
+}
+
+bool history_t::save_internal_via_rewrite(history_file_type_t output_type)
+{
+    /* This must be called while locked */
+    ASSERT_IS_LOCKED(lock);
 
+    bool ok = this->rewrite_file(output_type, new_items, deleted_items);
     if (ok)
     {
         /* We've saved everything, so we have no more unsaved items */
@@ -1465,8 +2814,9 @@ bool history_t::save_internal_via_rewrite()
         /* We deleted our deleted items */
         this->deleted_items.clear();
 
-        /* Our history has been written to the file, so clear our state so we can re-reference the file. */
+        /* Our history has been written to the file, so clear our state so we can re-reference the file. Searches have to pick up the file too, since deleted items are gone from it. */
         this->clear_file_state();
+        this->update_snapshot();
     }
 
 
@@ -1489,15 +2839,17 @@ bool history_t::save_internal_via_appending()
     /* Get the path to the real history file */
     wcstring history_path = history_filename(name, wcstring());
 
-    signal_block();
+    /* We may be called on a background thread after a vacuum, which has all signals blocked already */
+    const bool block_signals = is_main_thread();
+    if (block_signals) signal_block();
 
-    /* Open the file */
-    int out_fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
-    if (out_fd >= 0)
+    /* Open the file. We open it for reading too, so we can determine its format. */
+    int out_fd = -1;
+    for (size_t attempt = 0; attempt < 3 && out_fd < 0; attempt++)
     {
-        /* Check to see if the file changed */
-        if (file_id_for_fd(out_fd) != mmap_file_id)
-            file_changed = true;
+        out_fd = wopen_cloexec(history_path, O_RDWR | O_APPEND);
+        if (out_fd < 0)
+            break;
 
         /* Exclusive lock on the entire file. This is released when we close the file (below). This may fail on (e.g.) lockless NFS. If so, proceed as if it did not fail; the risk is that we may get interleaved history items, which is considered better than no history, or forcing everything through the slow copy-move mode. We try to minimize this possibility by writing with O_APPEND.
 
@@ -1505,6 +2857,22 @@ bool history_t::save_internal_via_appending()
         */
         if (! chaos_mode) history_file_lock(out_fd, F_WRLCK);
 
+        /* If another shell vacuumed the file while we waited for the lock, we would be appending to a file that has been replaced; try again with the new one. */
+        file_id_t fd_id = file_id_for_fd(out_fd), path_id = file_id_for_path(history_path);
+        if (fd_id.device != path_id.device || fd_id.inode != path_id.inode)
+        {
+            close(out_fd);
+            out_fd = -1;
+        }
+    }
+
+    if (out_fd >= 0)
+    {
+        /* Check to see if the file changed. Appends (ours or other shells') leave our map valid; incorporate_external_changes picks them up. */
+        file_id_t current_id = file_id_for_fd(out_fd);
+        if (current_id.device != mmap_file_id.device || current_id.inode != mmap_file_id.inode)
+            file_changed = true;
+
         /* We (hopefully successfully) took the exclusive lock. Append to the file.
            Note that this is sketchy for a few reasons:
              - Another shell may have appended its own items with a later timestamp, so our file may no longer be sorted by timestamp.
@@ -1519,12 +2887,17 @@ bool history_t::save_internal_via_appending()
 
         /* So far so good. Write all items at or after first_unwritten_new_item_index. Note that we write even a pending item - pending items are ignored by history within the command itself, but should still be written to the file. */
 
+        /* Items must be written in the format of the file. Only the binary format needs to be preserved; text formats get fish 2.0 items. */
+        char magic[HISTORY_BINARY_MAGIC_LEN];
+        ssize_t magic_len = pread(out_fd, magic, sizeof magic, 0);
+        const history_file_type_t file_type = magic_len > 0 ? infer_file_type(magic, (size_t)magic_len) : history_type_unknown;
+
         bool errored = false;
         history_output_buffer_t buffer;
         while (first_unwritten_new_item_index < new_items.size())
         {
             const history_item_t &item = new_items.at(first_unwritten_new_item_index);
-            append_yaml_to_buffer(item.str(), item.timestamp(), item.get_required_paths(), &buffer);
+            append_item_to_buffer(file_type, item.str(), item.timestamp(), item.get_required_paths(), item.get_use_count(), &buffer);
             if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE)
             {
                 errored = ! buffer.flush_to_fd(out_fd);
@@ -1543,9 +2916,9 @@ bool history_t::save_internal_via_appending()
         close(out_fd);
     }
 
-    signal_unblock();
+    if (block_signals) signal_unblock();
 
-    /* If someone has replaced the file, forget our file state */
+    /* If someone has replaced the file, forget our file state. Searches keep their snapshot until our items change, since a vacuumed file holds the same items. */
     if (file_changed)
     {
         this->clear_file_state();
@@ -1564,29 +2937,89 @@ void history_t::save_internal(bool vacuum)
     if (first_unwritten_new_item_index >= new_items.size() && deleted_items.empty())
         return;
 
+    /* If a vacuum is running, it will save our items once it completes */
+    if (vacuum_in_progress)
+        return;
+
     /* Compact our new items so we don't have duplicates */
     this->compact_new_items();
 
     /* Try saving. If we have items to delete, we have to rewrite the file. If we do not, we can append to it. */
     bool ok = false;
-    if (! vacuum && deleted_items.empty())
+    if (deleted_items.empty())
     {
         /* Try doing a fast append */
         ok = save_internal_via_appending();
     }
     if (! ok)
     {
-        /* We did not or could not append; rewrite the file ("vacuum" it) */
+        /* We could not append; rewrite the file. This also happens if there is no file yet. */
         ok = this->save_internal_via_rewrite();
     }
+    else if (vacuum)
+    {
+        /* Our items are all in the file, so the vacuum only has to compact the file. Do that in the background. */
+        this->start_background_vacuum();
+    }
 }
 
 void history_t::save(void)
 {
     scoped_lock locker(lock);
+    this->wait_for_background_vacuum();
     this->save_internal(false);
 }
 
+void history_t::start_background_vacuum()
+{
+    ASSERT_IS_LOCKED(lock);
+    assert(! vacuum_in_progress);
+    vacuum_in_progress = true;
+    env_publish();
+    iothread_perform(threaded_vacuum, this, iothread_priority_background);
+}
+
+void history_t::wait_for_background_vacuum()
+{
+    ASSERT_IS_LOCKED(lock);
+    while (vacuum_in_progress)
+    {
+        VOMIT_ON_FAILURE(pthread_cond_wait(&vacuum_cond, &lock));
+    }
+}
+
+int history_t::threaded_vacuum(history_t *hist)
+{
+    ASSERT_IS_BACKGROUND_THREAD();
+
+    /* Compact the file without holding the lock. We pass no new or deleted items: every new item was appended before the vacuum started, and deletions force a foreground rewrite. */
+    time_profiler_t profiler("threaded_vacuum");
+    bool ok = hist->rewrite_file(history_type_unknown, history_item_list_t(), std::set<wcstring>());
+
+    scoped_lock locker(hist->lock);
+    hist->vacuum_in_progress = false;
+
+    /* Append anything whose saving was deferred while we ran. Deletions are left for the next foreground save. Our mmap is of the old file; appending notices that and clears it. */
+    if (hist->first_unwritten_new_item_index < hist->new_items.size() && hist->deleted_items.empty() && hist->disable_automatic_save_counter == 0)
+    {
+        hist->compact_new_items();
+        hist->save_internal_via_appending();
+    }
+
+    /* Wake anyone waiting for us. Note that once we release the lock, hist may be deleted. */
+    VOMIT_ON_FAILURE(pthread_cond_broadcast(&hist->vacuum_cond));
+    return ok;
+}
+
+bool history_t::set_file_format(history_file_type_t type)
+{
+    assert(type == history_type_fish_2_0 || type == history_type_fish_binary);
+    scoped_lock locker(lock);
+    this->wait_for_background_vacuum();
+    this->compact_new_items();
+    return this->save_internal_via_rewrite(type);
+}
+
 void history_t::disable_automatic_saving()
 {
     scoped_lock locker(lock);
@@ -1606,14 +3039,21 @@ void history_t::enable_automatic_saving()
 void history_t::clear(void)
 {
     scoped_lock locker(lock);
+    this->wait_for_background_vacuum();
     new_items.clear();
+    new_item_hashes.clear();
+    new_items_may_have_duplicates = false;
+    invalidate_distinct_items();
     deleted_items.clear();
     first_unwritten_new_item_index = 0;
-    old_item_offsets.clear();
     wcstring filename = history_filename(name, L"");
     if (! filename.empty())
+    {
         wunlink(filename);
+        wunlink(history_filename(name, L".idx"));
+    }
     this->clear_file_state();
+    this->update_snapshot();
 
 }
 
@@ -1629,7 +3069,7 @@ bool history_t::is_empty(void)
     if (loaded_old)
     {
         /* If we've loaded old items, see if we have any offsets */
-        empty = old_item_offsets.empty();
+        empty = (old_item_count(old_items) == 0);
     }
     else
     {
@@ -1721,7 +3161,7 @@ void history_t::populate_from_bash(FILE *stream)
 
 void history_t::incorporate_external_changes()
 {
-    /* To incorporate new items, we simply update our timestamp to now, so that items from previous instances get added. We then clear the file state so that we remap the file. Note that this is somehwhat expensive because we will be going back over old items. An optimization would be to preserve old_item_offsets so that they don't have to be recomputed. (However, then items *deleted* in other instances would not show up here). */
+    /* To incorporate new items, we simply update our timestamp to now, so that items from previous instances get added. If other instances only appended to the file, we just pick up the appended items, along with those we had passed over as too new. If the file was rewritten (which is how items deleted in other instances go away), we clear the file state so that we remap the file. */
     time_t new_timestamp = time(NULL);
     scoped_lock locker(lock);
 
@@ -1729,7 +3169,9 @@ void history_t::incorporate_external_changes()
     if (new_timestamp > this->boundary_timestamp)
     {
         this->boundary_timestamp = new_timestamp;
-        this->clear_file_state();
+        if (! this->incorporate_appended_items())
+            this->clear_file_state();
+        this->update_snapshot();
     }
 }
 
@@ -1748,6 +3190,60 @@ void history_destroy()
 }
 
 
+void history_t::get_memory_stats(std::vector<memory_stats_t> *out)
+{
+    scoped_lock locker(lock);
+
+    memory_stats_t new_stats(L"history " + name + L" new items");
+    new_stats.entries = new_items.size();
+    for (size_t i=0; i < new_items.size(); i++)
+    {
+        const history_item_t &item = new_items[i];
+        new_stats.bytes += sizeof item + wcstring_heap_size(item.contents);
+        new_stats.bytes += item.required_paths.capacity() * sizeof(wcstring);
+        for (size_t j=0; j < item.required_paths.size(); j++)
+        {
+            new_stats.bytes += wcstring_heap_size(item.required_paths[j]);
+        }
+    }
+    new_stats.bytes += new_item_hashes.size() * (TREE_NODE_OVERHEAD + sizeof(uint64_t));
+    for (std::set<wcstring>::const_iterator iter = deleted_items.begin(); iter != deleted_items.end(); ++iter)
+    {
+        new_stats.bytes += TREE_NODE_OVERHEAD + sizeof(wcstring) + wcstring_heap_size(*iter);
+    }
+    out->push_back(new_stats);
+
+    memory_stats_t old_stats(L"history " + name + L" old item offsets");
+    old_stats.entries = old_item_count(old_items) + newer_item_offsets.size();
+    old_stats.bytes = old_stats.entries * sizeof(size_t);
+    out->push_back(old_stats);
+
+    memory_stats_t file_stats(L"history " + name + L" mapped file");
+    file_stats.entries = old_items ? 1 : 0;
+    file_stats.bytes = old_items ? old_items->map->length : 0;
+    out->push_back(file_stats);
+
+    memory_stats_t index_stats(L"history " + name + L" indexes");
+    index_stats.bytes = old_items ? old_items->index_memory_size() : 0;
+    if (published_snapshot)
+    {
+        index_stats.entries = published_snapshot->new_prefix_index.indexed_item_count();
+        index_stats.bytes += published_snapshot->new_prefix_index.memory_size();
+    }
+    index_stats.bytes += distinct_item_indexes.capacity() * sizeof(size_t);
+    index_stats.bytes += distinct_item_hashes.size() * (TREE_NODE_OVERHEAD + sizeof(uint64_t) + sizeof(size_t));
+    out->push_back(index_stats);
+}
+
+void history_get_memory_stats(std::vector<memory_stats_t> *out)
+{
+    scoped_lock locker(hist_lock);
+    for (std::map<wcstring, history_t *>::iterator iter = histories.begin(); iter != histories.end(); ++iter)
+    {
+        iter->second->get_memory_stats(out);
+    }
+}
+
 void history_sanity_check()
 {
     /*
@@ -1759,20 +3255,14 @@ int file_detection_context_t::perform_file_detection(bool test_all)
 {
     ASSERT_IS_BACKGROUND_THREAD();
     valid_paths.clear();
-    int result = 1;
-    for (path_list_t::const_iterator iter = potential_paths.begin(); iter != potential_paths.end(); ++iter)
+    std::vector<bool> valid;
+    int result = ::paths_are_valid(potential_paths, working_directory, test_all, &valid) ? 1 : 0;
+    for (size_t i=0; i < potential_paths.size(); i++)
     {
-        if (path_is_valid(*iter, working_directory))
+        if (valid.at(i))
         {
             /* Push the original (possibly relative) path */
-            valid_paths.push_back(*iter);
-        }
-        else
-        {
-            /* Not a valid path */
-            result = 0;
-            if (! test_all)
-                break;
+            valid_paths.push_back(potential_paths.at(i));
         }
     }
     return result;
@@ -1791,25 +3281,105 @@ file_detection_context_t::file_detection_context_t(history_t *hist, history_iden
 {
 }
 
-static int threaded_perform_file_detection(file_detection_context_t *ctx)
+int history_t::threaded_perform_file_detection(std::vector<file_detection_context_t *> *contexts)
 {
     ASSERT_IS_BACKGROUND_THREAD();
-    assert(ctx != NULL);
-    return ctx->perform_file_detection(true /* test all */);
+    assert(contexts != NULL);
+
+    /* Commands run in the same directory are tested together, so that a path they share is tested once, and paths in the same directory go through a single descriptor for it */
+    const size_t count = contexts->size();
+    std::vector<bool> handled(count, false);
+    for (size_t i=0; i < count; i++)
+    {
+        if (handled.at(i))
+        {
+            continue;
+        }
+        const wcstring &working_directory = contexts->at(i)->working_directory;
+
+        std::vector<size_t> members;
+        std::map<wcstring, size_t> path_indexes;
+        path_list_t paths;
+        for (size_t j=i; j < count; j++)
+        {
+            const file_detection_context_t *ctx = contexts->at(j);
+            if (handled.at(j) || ctx->working_directory != working_directory)
+            {
+                continue;
+            }
+            handled.at(j) = true;
+            members.push_back(j);
+            for (size_t k=0; k < ctx->potential_paths.size(); k++)
+            {
+                const wcstring &path = ctx->potential_paths.at(k);
+                if (path_indexes.insert(std::make_pair(path, paths.size())).second)
+                {
+                    paths.push_back(path);
+                }
+            }
+        }
+
+        std::vector<bool> valid;
+        ::paths_are_valid(paths, working_directory, true /* test all */, &valid);
+
+        for (size_t m=0; m < members.size(); m++)
+        {
+            file_detection_context_t *ctx = contexts->at(members.at(m));
+            ctx->valid_paths.clear();
+            for (size_t k=0; k < ctx->potential_paths.size(); k++)
+            {
+                const wcstring &path = ctx->potential_paths.at(k);
+                if (valid.at(path_indexes[path]))
+                {
+                    /* Push the original (possibly relative) path */
+                    ctx->valid_paths.push_back(path);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void history_t::perform_file_detection_done(std::vector<file_detection_context_t *> *contexts, int success)
+{
+    ASSERT_IS_MAIN_THREAD();
+    assert(contexts != NULL && ! contexts->empty());
+    history_t *history = contexts->front()->history;
+
+    /* Now that file detection is done, update the history items with the valid file paths */
+    history->set_valid_file_paths(*contexts);
+
+    /* Done with the contexts */
+    for (size_t i=0; i < contexts->size(); i++)
+    {
+        delete contexts->at(i);
+    }
+    delete contexts;
+
+    /* Test whatever was queued meanwhile before allowing saving again, so the queued items don't get saved without their paths */
+    history->file_detection_running = false;
+    history->start_file_detection();
+    history->enable_automatic_saving();
 }
 
-static void perform_file_detection_done(file_detection_context_t *ctx, int success)
+void history_t::start_file_detection(void)
 {
     ASSERT_IS_MAIN_THREAD();
+    if (file_detection_running || file_detection_queue.empty())
+    {
+        return;
+    }
+    file_detection_running = true;
 
-    /* Now that file detection is done, update the history item with the valid file paths */
-    ctx->history->set_valid_file_paths(ctx->valid_paths, ctx->history_item_identifier);
+    std::vector<file_detection_context_t *> *contexts = new std::vector<file_detection_context_t *>();
+    contexts->swap(file_detection_queue);
 
-    /* Allow saving again */
-    ctx->history->enable_automatic_saving();
+    /* Prevent saving until we're done, so we have time to get the paths */
+    this->disable_automatic_saving();
 
-    /* Done with the context. */
-    delete ctx;
+    /* Kick it off. It updates the items on the main thread, so we can't race with adding them */
+    env_publish();
+    iothread_perform(threaded_perform_file_detection, perform_file_detection_done, contexts, iothread_priority_background);
 }
 
 static bool string_could_be_path(const wcstring &potential_path)
@@ -1876,15 +3446,11 @@ void history_t::add_pending_with_file_detection(const wcstring &str)
         static history_identifier_t sLastIdentifier = 0;
         identifier = ++sLastIdentifier;
 
-        /* Create a new detection context */
+        /* Queue a new detection context. If a detection is running, this command is tested along with any others added before it finishes */
         file_detection_context_t *context = new file_detection_context_t(this, identifier);
         context->potential_paths.swap(potential_paths);
-
-        /* Prevent saving until we're done, so we have time to get the paths */
-        this->disable_automatic_saving();
-
-        /* Kick it off. Even though we haven't added the item yet, it updates the item on the main thread, so we can't race */
-        iothread_perform(threaded_perform_file_detection, perform_file_detection_done, context);
+        file_detection_queue.push_back(context);
+        this->start_file_detection();
     }
 
     /* Actually add the item to the history. */
@@ -1902,4 +3468,6 @@ void history_t::resolve_pending()
 {
     scoped_lock locker(lock);
     this->has_pending_item = false;
+    invalidate_distinct_items();
+    update_snapshot();
 }
@@ -7,9 +7,11 @@
 
 #include "common.h"
 #include "wutil.h"
+#include "io.h"
 #include <deque>
 #include <vector>
 #include <utility>
+#include <map>
 #include <set>
 #include <pthread.h>
 #include <stddef.h>
@@ -21,10 +23,11 @@
 /* fish supports multiple shells writing to history at once. Here is its strategy:
 
 1. All history files are append-only. Data, once written, is never modified.
-2. A history file may be re-written ("vacuumed"). This involves reading in the file and writing a new one, while performing maintenance tasks: discarding items in an LRU fashion until we reach the desired maximum count, removing duplicates, and sorting them by timestamp (eventually, not implemented yet). The new file is atomically moved into place via rename().
+2. A history file may be re-written ("vacuumed"). Vacuuming happens on a background thread, after our new items have been appended. This involves reading in the file and writing a new one, while performing maintenance tasks: discarding items in an LRU fashion until we reach the desired maximum count, removing duplicates, and sorting them by timestamp (eventually, not implemented yet). The new file is atomically moved into place via rename().
 3. History files are mapped in via mmap(). Before the file is mapped, the file takes a fcntl read lock. The purpose of this lock is to avoid seeing a transient state where partial data has been written to the file.
 4. History is appended to under a fcntl write lock.
-5. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can trigger race conditions. This is useful for testing.
+5. To avoid rescanning the whole file on every load, the offsets and timestamps of its items are cached in a sidecar index file. The index is rewritten atomically like the history file, and is ignored if it does not match the history file.
+6. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can trigger race conditions. This is useful for testing.
 */
 
 typedef std::vector<wcstring> path_list_t;
@@ -44,13 +47,14 @@ class history_item_t
 {
     friend class history_t;
     friend class history_lru_node_t;
+    friend class history_snapshot_t;
     friend class history_tests_t;
 
 private:
     explicit history_item_t(const wcstring &str);
     explicit history_item_t(const wcstring &, time_t, history_identifier_t ident = 0);
 
-    /** Attempts to merge two compatible history items together */
+    /** Attempts to merge two compatible history items together. The uses of item are counted as uses of this one. */
     bool merge(const history_item_t &item);
 
     /** The actual contents of the entry */
@@ -64,6 +68,9 @@ private:
 
     /** Paths that we require to be valid for this item to be autosuggested */
     path_list_t required_paths;
+
+    /** How many uses of the command this item stands for, since rewriting the history file merges duplicates */
+    uint32_t use_count;
     
 public:
     const wcstring &str() const
@@ -89,6 +96,11 @@ public:
         return required_paths;
     }
 
+    uint32_t get_use_count() const
+    {
+        return use_count;
+    }
+
     bool operator==(const history_item_t &other) const
     {
         return contents == other.contents &&
@@ -104,12 +116,227 @@ enum history_file_type_t
 {
     history_type_unknown,
     history_type_fish_2_0,
-    history_type_fish_1_x
+    history_type_fish_1_x,
+    history_type_fish_binary
+};
+
+/* A search term encoded the way commands are stored in history files: as UTF-8, which the binary format stores as is and the fish 2.0 format escapes. Old items can be compared against it without decoding them. */
+struct history_encoded_term_t
+{
+    std::string utf8;
+    std::string escaped;
+
+    /* Files that were not written by fish may escape backslashes differently, so a term with a backslash is not compared escaped */
+    bool has_backslash;
+
+    history_encoded_term_t() : has_backslash(false) {}
+    explicit history_encoded_term_t(const wcstring &term);
+};
+
+/* A view of the command of an old item, as stored in the mmap'd history file. Comparing it against a search term neither decodes the item nor allocates. It points into the mapped file, so it may only be used while the old items it came from are referenced. */
+class history_item_view_t
+{
+    /* The stored command, or NULL if the format is one we cannot view */
+    const char *cmd;
+    size_t cmd_length;
+    history_file_type_t type;
+
+public:
+    history_item_view_t(const char *base, size_t len, history_file_type_t type);
+
+    /* Whether the command may match the given search. It does if it matches; it may also if the term overlaps escapes in the stored command, so a match has to be confirmed on the decoded item. */
+    bool may_match_search(const history_encoded_term_t &term, enum history_search_type_t search_type) const;
+};
+
+/* An inverted index from trigrams to the old (mmap'd) history items that contain them, used to skip items that cannot match a search. Trigrams are hashed into a fixed number of buckets, so the index may report false positives, but never false negatives. Items are identified by their position among the old items. */
+class history_trigram_index_t
+{
+    /* Each bucket is a list of item positions, in increasing order */
+    typedef std::vector<uint32_t> posting_list_t;
+    std::vector<posting_list_t> buckets;
+
+    /* Returns the bucket index for the trigram starting at the given string */
+    static size_t bucket_for_trigram(const wchar_t *trigram);
+
+public:
+    /* Whether the index has been built */
+    bool is_built() const
+    {
+        return ! buckets.empty();
+    }
+
+    /* Discards the index */
+    void clear();
+
+    /* Prepares an empty index */
+    void prepare();
+
+    /* Adds an item at the given position, which must be larger than that of any item added before */
+    void add_item(const wcstring &contents, uint32_t position);
+
+    /* Returns the largest position <= max_position of an item that may contain the given term, or -1 if there is none. Terms shorter than a trigram match everything. */
+    long find_candidate(const wcstring &term, uint32_t max_position) const;
+
+    /* Returns an estimate of the bytes the index takes */
+    size_t memory_size() const;
 };
 
+/* A sorted index of the distinct contents of history items, recording how often and how recently each was used, so that the items starting with a prefix can be found by binary search and ranked without scanning history. Items are identified by their position in the list they were added from. */
+class history_prefix_index_t
+{
+public:
+    struct entry_t
+    {
+        wcstring contents;
+
+        /* How many uses the items with these contents stand for */
+        uint32_t count;
+
+        /* The position and timestamp of the newest of them */
+        uint32_t newest_position;
+        time_t newest_timestamp;
+    };
+
+private:
+    /* Sorted by contents, except for the entries after sorted_count, which were added since the last call to finish() */
+    std::vector<entry_t> entries;
+    size_t sorted_count;
+
+    /* How many items have been added */
+    size_t item_count;
+
+    bool built;
+
+public:
+    history_prefix_index_t() : sorted_count(0), item_count(0), built(false)
+    {
+    }
+
+    /* Whether the index has been built */
+    bool is_built() const
+    {
+        return built;
+    }
+
+    /* The number of items added, which is the position of the next one */
+    size_t indexed_item_count() const
+    {
+        return item_count;
+    }
+
+    /* Discards the index */
+    void clear();
+
+    /* Adds the item at the next position. Call finish() before searching. */
+    void add_item(const wcstring &contents, time_t timestamp, uint32_t use_count);
+
+    /* Sorts in the items added since the last call, merging duplicates */
+    void finish();
+
+    typedef std::vector<entry_t>::const_iterator const_iterator;
+
+    /* Returns the range of entries whose contents start with the given prefix */
+    std::pair<const_iterator, const_iterator> entries_with_prefix(const wcstring &prefix) const;
+
+    /* Returns an estimate of the bytes the index takes */
+    size_t memory_size() const;
+};
+
+/* A read-only mapping of a history file, unmapped once nothing refers to it */
+class history_file_map_t
+{
+    /* No copying */
+    history_file_map_t(const history_file_map_t &);
+    history_file_map_t &operator=(const history_file_map_t &);
+
+public:
+    const char * const start;
+    const size_t length;
+
+    /* Takes ownership of the given mapping */
+    history_file_map_t(const char *map_start, size_t map_length);
+    ~history_file_map_t();
+};
+
+/* The old items of a history: those of its file that are not newer than its boundary timestamp, identified by their offsets into the mapped file, oldest first. Once shared, it is never modified, except that its indexes are built on first use under a lock of its own, so any thread holding a reference may read it without the history's lock. */
+class history_old_items_t
+{
+    /* No copying */
+    history_old_items_t(const history_old_items_t &);
+    history_old_items_t &operator=(const history_old_items_t &);
+
+    /* Lock protecting the indexes while they are built */
+    mutable pthread_mutex_t index_lock;
+
+    /* Indexes of the items, built on first use */
+    mutable history_trigram_index_t trigram_index;
+    mutable history_prefix_index_t prefix_index;
+
+public:
+    /* The mapped file */
+    const shared_ptr<const history_file_map_t> map;
+
+    /* The format of the file */
+    const history_file_type_t type;
+
+    /* Offsets of the items in the mapped file. Only filled in before the items are shared. */
+    std::vector<size_t> offsets;
+
+    history_old_items_t(const shared_ptr<const history_file_map_t> &file_map, history_file_type_t file_type);
+    ~history_old_items_t();
+
+    /* Decodes the item at the given position */
+    history_item_t item_at(size_t position) const;
+
+    /* Returns a view of the command of the item at the given position */
+    history_item_view_t view_at(size_t position) const;
+
+    /* Takes over the indexes that base has built, which must be for the first of our items, and extends them to the rest. */
+    void inherit_indexes(const history_old_items_t &base);
+
+    /* Return the indexes, building them if necessary */
+    const history_trigram_index_t &get_trigram_index() const;
+    const history_prefix_index_t &get_prefix_index() const;
+
+    /* Returns an estimate of the bytes the indexes take */
+    size_t index_memory_size() const;
+};
+
+/* The searchable items of a history at one moment: the old items it had loaded, and a copy of its resolved new items. History searches and autosuggestions work on a snapshot, so they never hold the history's lock while they look through items, and never wait for a save. Immutable once published. Items are numbered as by history_t::item_at_index. */
+class history_snapshot_t
+{
+public:
+    /* The resolved new items, oldest first */
+    history_item_list_t new_items;
+
+    /* Prefix index of new_items */
+    history_prefix_index_t new_prefix_index;
+
+    /* The old items, or NULL if the history has no file */
+    shared_ptr<const history_old_items_t> old_items;
+
+    /* Contents deleted since the file was last rewritten */
+    std::set<wcstring> deleted_items;
+
+    /* The number of items */
+    size_t size() const;
+
+    /* Returns the item at the given index, or an empty item past the end */
+    history_item_t item_at_index(size_t idx) const;
+
+    /* Returns the smallest index >= idx whose item may match the given search, which is for the given term, also given encoded. Old items are ruled out with the trigram index, and by comparing their commands as they are stored, without decoding them. Indexes past the last item mean that there are no more candidates. */
+    size_t next_candidate_index(const wcstring &term, const history_encoded_term_t &encoded_term, enum history_search_type_t search_type, size_t idx) const;
+
+    /* Implementation of history_t::items_with_prefix */
+    history_item_list_t items_with_prefix(const wcstring &prefix, size_t max_count) const;
+};
+
+struct file_detection_context_t;
+
 class history_t
 {
     friend class history_tests_t;
+    friend class history_old_items_t;
 private:
     /** No copying */
     history_t(const history_t&);
@@ -139,23 +366,36 @@ private:
     /** The index of the first new item that we have not yet written. */
     size_t first_unwritten_new_item_index;
 
+    /** Hashes of the contents of new items, so that adding an item can tell whether it may duplicate one of them without comparing strings. May still hold the hashes of removed items. */
+    std::set<uint64_t> new_item_hashes;
+
+    /** Whether an item was added whose hash was already in new_item_hashes, so that compact_new_items has something to do */
+    bool new_items_may_have_duplicates;
+
     /** Whether we have a pending item. If so, the most recently added item is ignored by item_at_index. */
     bool has_pending_item;
     
+    /** The number of new items that are not pending, and so are visible to item_at_index. Must be called while locked. */
+    size_t resolved_new_item_count() const;
+
     /** Whether we should disable saving to the file for a time */
     uint32_t disable_automatic_save_counter;
 
-    /** Deleted item contents. */
-    std::set<wcstring> deleted_items;
+    /** Commands added by add_pending_with_file_detection whose arguments are waiting to be tested as paths. Only used on the main thread, so not protected by the lock. */
+    std::vector<file_detection_context_t *> file_detection_queue;
+
+    /** Whether a background file detection is running. Commands queued meanwhile are tested together once it finishes. */
+    bool file_detection_running;
 
-    /** The mmaped region for the history file */
-    const char *mmap_start;
+    /** Hands every queued command to a single background file detection, unless one is already running */
+    void start_file_detection(void);
 
-    /** The size of the mmap'd region */
-    size_t mmap_length;
+    /** The background and main thread halves of a file detection */
+    static int threaded_perform_file_detection(std::vector<file_detection_context_t *> *contexts);
+    static void perform_file_detection_done(std::vector<file_detection_context_t *> *contexts, int success);
 
-    /** The type of file we mmap'd */
-    history_file_type_t mmap_type;
+    /** Deleted item contents. */
+    std::set<wcstring> deleted_items;
 
     /** The file ID of the file we mmap'd */
     file_id_t mmap_file_id;
@@ -166,26 +406,86 @@ private:
     /** How many items we add until the next vacuum. Initially a random value. */
     int countdown_to_vacuum;
 
-    /** Figure out the offsets of our mmap data */
-    void populate_from_mmap(void);
+    /** Figure out the offsets of the items of the given mapped file, and make them our old items */
+    void populate_from_mmap(const shared_ptr<const history_file_map_t> &map);
 
-    /** List of old items, as offsets into out mmap data */
-    std::deque<size_t> old_item_offsets;
+    /** Our old items, once loaded. NULL if we have no file. */
+    shared_ptr<const history_old_items_t> old_items;
+
+    /** Items of our mmap data that are newer than the boundary timestamp, as offsets. incorporate_external_changes() makes them old once the boundary passes them. Only kept for the formats that have timestamps (fish 2.0 and binary). */
+    std::deque<size_t> newer_item_offsets;
+
+    /** Where populate_from_mmap stopped scanning our mmap data: the end of the last complete item. Items appended to the file later start here. */
+    size_t mmap_scanned_length;
+
+    /** Remaps the history file and picks up the items appended to it since we mapped it, by scanning only the appended part. Returns false if the file was replaced or rewritten, or has no timestamps, in which case the file state must be reloaded instead. Must be called while locked. */
+    bool incorporate_appended_items(void);
 
     /** Whether we've loaded old items */
     bool loaded_old;
 
+    /** The snapshot last published for searches, or NULL if none was asked for yet. Only changed while holding both lock and snapshot_lock, so either is enough to read it; searches take snapshot_lock, so that they can pick it up while we save. */
+    shared_ptr<const history_snapshot_t> published_snapshot;
+
+    /** Whether the items changed since published_snapshot was built. Protected like published_snapshot. */
+    bool snapshot_stale;
+
+    /** Lock protecting published_snapshot and snapshot_stale. Only held to copy or replace them. Taken after lock when both are held. */
+    pthread_mutex_t snapshot_lock;
+
+    /** Builds a snapshot of our items and publishes it, unless the published one is current. Old items must have been loaded. Must be called while locked. */
+    shared_ptr<const history_snapshot_t> publish_snapshot(void);
+
+    /** Marks the published snapshot as stale after the items changed. The next search builds a new one. Must be called while locked. */
+    void update_snapshot(void);
+
+    /** The indexes, as passed to item_at_index, of the items that $history lists: the most recent item with each contents. Found lazily by find_distinct_items, and discarded whenever the items change. */
+    std::vector<size_t> distinct_item_indexes;
+
+    /** Hashes of the contents of the items found so far, mapped to their positions in distinct_item_indexes */
+    std::multimap<uint64_t, size_t> distinct_item_hashes;
+
+    /** The next index find_distinct_items looks at */
+    size_t distinct_item_scan_index;
+
+    /** Discards the distinct items found so far. Must be called while locked. */
+    void invalidate_distinct_items(void);
+
+    /** Looks for distinct items until there are at least count of them, or no more items. Must be called while locked. */
+    void find_distinct_items(size_t count);
+
+    /** Implementation of item_at_index. Must be called while locked. */
+    history_item_t item_at_index_locked(size_t idx);
+
     /** Loads old if necessary */
     bool load_old_if_needed(void);
 
     /** Memory maps the history file if necessary */
     bool mmap_if_needed(void);
 
-    /** Deletes duplicates in new_items. */
+    /** Deletes duplicates in new_items, keeping the most recent of each. Uses of unwritten duplicates are added to the item that is kept. */
     void compact_new_items();
 
-    /** Saves history by rewriting the file */
-    bool save_internal_via_rewrite();
+    /** Rewrites the history file, merging in the given new items and dropping the given deleted items, in the given format (or that of the existing file if history_type_unknown). This does not touch our state and does not require the lock, so it may be called from a background thread. Returns true on success. */
+    bool rewrite_file(history_file_type_t output_type, const history_item_list_t &new_items, const std::set<wcstring> &deleted_items);
+
+    /** Saves history by rewriting the file. The file is written in the given format, or in the format of the existing file if that is history_type_unknown. */
+    bool save_internal_via_rewrite(history_file_type_t output_type = history_type_unknown);
+
+    /** Whether a vacuum is running on a background thread. Saves are deferred until it completes, so that items we append are not lost when the vacuumed file is moved into place. */
+    bool vacuum_in_progress;
+
+    /** Signalled when a background vacuum completes */
+    pthread_cond_t vacuum_cond;
+
+    /** Starts vacuuming the history file on a background thread. Must be called while locked. */
+    void start_background_vacuum();
+
+    /** Waits for a background vacuum, if any, to complete. Must be called while locked. */
+    void wait_for_background_vacuum();
+
+    /** Vacuums the history file. Runs on a background thread. */
+    static int threaded_vacuum(history_t *hist);
 
     /** Saves history by appending to the file */
     bool save_internal_via_appending();
@@ -205,6 +505,7 @@ private:
     /* Versioned decoding */
     static history_item_t decode_item_fish_2_0(const char *base, size_t len);
     static history_item_t decode_item_fish_1_x(const char *base, size_t len);
+    static history_item_t decode_item_fish_binary(const char *base, size_t len);
     static history_item_t decode_item(const char *base, size_t len, history_file_type_t type);
 
 public:
@@ -214,6 +515,9 @@ public:
     /** Determines whether the history is empty. Unfortunately this cannot be const, since it may require populating the history. */
     bool is_empty(void);
 
+    /** Appends estimates of the memory this history holds to out: its new items, the offsets of its old items, the mapped history file, and its indexes */
+    void get_memory_stats(std::vector<memory_stats_t> *out);
+
     /** Add a new history item to the end. If pending is set, the item will not be returned by item_at_index until a call to resolve_pending(). Pending items are tracked with an offset into the array of new items, so adding a non-pending item has the effect of resolving all pending items. */
     void add(const wcstring &str, history_identifier_t ident = 0, bool pending = false);
 
@@ -236,20 +540,41 @@ public:
     /** Irreversibly clears history */
     void clear();
 
+    /** Rewrites the history file in the given format, which must be history_type_fish_2_0 or history_type_fish_binary. Subsequent saves preserve the format of the file. Returns true on success. */
+    bool set_file_format(history_file_type_t type);
+
     /** Populates from a bash history file */
     void populate_from_bash(FILE *f);
 
     /** Incorporates the history of other shells into this history */
     void incorporate_external_changes();
 
-    /* Gets all the history into a string with ARRAY_SEP_STR. This is intended for the $history environment variable. This may be long! */
-    void get_string_representation(wcstring *result, const wcstring &separator);
+    /* Gets all the history into a string with ARRAY_SEP_STR. This is intended for the $history environment variable. This may be long! If after_item is given, it is called after each item is appended, e.g. to write out what there is so far. */
+    void get_string_representation(wcstring *result, const wcstring &separator, void (*after_item)() = NULL);
+
+    /** Returns the item at the given index of $history, which lists each command once, at its most recent use. The most recent item is at index 1. Returns an empty item past the end. Only looks at as many items as it needs to. */
+    history_item_t distinct_item_at_index(size_t idx);
+
+    /** Returns the number of items in $history */
+    size_t distinct_item_count(void);
 
     /** Sets the valid file paths for the history item with the given identifier */
     void set_valid_file_paths(const wcstring_list_t &valid_file_paths, history_identifier_t ident);
 
+    /** Sets the valid file paths of several items at once, from the valid_paths and history_item_identifier of each context */
+    void set_valid_file_paths(const std::vector<file_detection_context_t *> &contexts);
+
     /** Return the specified history at the specified index. 0 is the index of the current commandline. (So the most recent item is at index 1.) */
     history_item_t item_at_index(size_t idx);
+
+    /** Returns a snapshot of the current items, loading old items if necessary. Only takes the lock if the items changed since the last snapshot was taken. Off the main thread, returns the last snapshot rather than wait for the lock. */
+    shared_ptr<const history_snapshot_t> snapshot(void);
+
+    /** Returns up to max_count of the commands run in the most recent item_limit items, most used first. Only the words in command position that could name a function are counted. */
+    wcstring_list_t most_used_commands(size_t max_count, size_t item_limit);
+
+    /** Returns up to max_count distinct items that start with the given prefix, ranked by frecency: items used often come first, with recent uses counting for more. Deleted items are skipped. */
+    history_item_list_t items_with_prefix(const wcstring &prefix, size_t max_count);
 };
 
 class history_search_t
@@ -258,6 +583,9 @@ class history_search_t
     /** The history in which we are searching */
     history_t * history;
 
+    /** The items we search, taken from the history when the search starts */
+    shared_ptr<const history_snapshot_t> snapshot;
+
     /** Our type */
     enum history_search_type_t search_type;
 
@@ -271,6 +599,9 @@ class history_search_t
     /** The search term */
     wcstring term;
 
+    /** The search term as old items store it */
+    history_encoded_term_t encoded_term;
+
     /** Additional strings to skip (sorted) */
     wcstring_list_t external_skips;
 
@@ -313,7 +644,8 @@ public:
     history_search_t(history_t &hist, const wcstring &str, enum history_search_type_t type = HISTORY_SEARCH_TYPE_CONTAINS) :
         history(&hist),
         search_type(type),
-        term(str)
+        term(str),
+        encoded_term(str)
     {}
 
     /* Default constructor */
@@ -341,6 +673,11 @@ void history_destroy();
 */
 void history_sanity_check();
 
+/**
+   Appends estimates of the memory every loaded history holds to out
+*/
+void history_get_memory_stats(std::vector<memory_stats_t> *out);
+
 /* A helper class for threaded detection of paths */
 struct file_detection_context_t
 {
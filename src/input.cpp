@@ -41,6 +41,7 @@
 #include "io.h"
 #include "output.h"
 #include <vector>
+#include <map>
 #include <algorithm>
 
 #define DEFAULT_TERM L"ansi"
@@ -253,6 +254,84 @@ static const wchar_t code_arr[] =
 /** Mappings for the current input mode */
 static std::vector<input_mapping_t> mapping_list;
 
+/**
+   A prefix trie of the sequences bound in one mode, so that the mapping for the pending input is found by reading along a single path instead of trying each mapping in turn. Node 0 is the root. Mappings are referred to by their index in mapping_list.
+*/
+struct input_mapping_trie_t
+{
+    struct node_t
+    {
+        /** The children of this node and the characters leading to them, sorted by character */
+        std::vector<std::pair<wchar_t, size_t> > children;
+
+        /** The mapping whose sequence ends at this node, or -1 */
+        long mapping;
+
+        node_t() : mapping(-1)
+        {
+        }
+    };
+
+    std::vector<node_t> nodes;
+
+    /** The mapping with the empty sequence, used when no other matches, or -1 */
+    long generic;
+
+    input_mapping_trie_t() : nodes(1), generic(-1)
+    {
+    }
+
+    /** Returns the child of the given node for the given character, or 0 if there is none */
+    size_t child(size_t node, wchar_t c) const
+    {
+        const std::vector<std::pair<wchar_t, size_t> > &children = nodes.at(node).children;
+        std::vector<std::pair<wchar_t, size_t> >::const_iterator iter = std::lower_bound(children.begin(), children.end(), std::pair<wchar_t, size_t>(c, 0));
+        return (iter != children.end() && iter->first == c) ? iter->second : 0;
+    }
+
+    void add(const wcstring &seq, long mapping_idx)
+    {
+        size_t node = 0;
+        for (size_t i = 0; i < seq.size(); i++)
+        {
+            size_t next = child(node, seq.at(i));
+            if (next == 0)
+            {
+                next = nodes.size();
+                nodes.push_back(node_t());
+                std::vector<std::pair<wchar_t, size_t> > &children = nodes.at(node).children;
+                const std::pair<wchar_t, size_t> entry(seq.at(i), next);
+                children.insert(std::lower_bound(children.begin(), children.end(), entry), entry);
+            }
+            node = next;
+        }
+        if (node == 0)
+            generic = mapping_idx;
+        else
+            nodes.at(node).mapping = mapping_idx;
+    }
+};
+
+/** Tries of the mappings of each mode, rebuilt from mapping_list after it changes */
+static std::map<wcstring, input_mapping_trie_t> mapping_tries;
+static bool mapping_tries_valid = false;
+
+static const input_mapping_trie_t &input_mapping_trie_for_mode(const wcstring &mode)
+{
+    if (! mapping_tries_valid)
+    {
+        mapping_tries.clear();
+        for (size_t i = 0; i < mapping_list.size(); i++)
+        {
+            const input_mapping_t &m = mapping_list.at(i);
+            mapping_tries[m.mode].add(m.seq, (long)i);
+        }
+        mapping_tries_valid = true;
+    }
+    /* Modes without mappings get an empty trie */
+    return mapping_tries[mode];
+}
+
 /* Terminfo map list */
 static std::vector<terminfo_mapping_t> terminfo_mappings;
 
@@ -336,6 +415,7 @@ static void input_mapping_insert_sorted(const input_mapping_t &new_mapping)
 {
     std::vector<input_mapping_t>::iterator loc = std::lower_bound(mapping_list.begin(), mapping_list.end(), new_mapping, length_is_greater_than);
     mapping_list.insert(loc, new_mapping);
+    mapping_tries_valid = false;
 }
 
 /* Adds an input mapping */
@@ -599,10 +679,14 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
            -f execute), we won't see that until all other commands have also
            been run. */
         int last_status = proc_get_last_status();
+        /* The commands may start programs that read the terminal, or a
+           nested reader that turns bracketed paste off on its way out */
+        bool was_bracketed_paste = reader_set_bracketed_paste(false);
         for (wcstring_list_t::const_iterator it = m.commands.begin(), end = m.commands.end(); it != end; ++it)
         {
             parser_t::principal_parser().eval(it->c_str(), io_chain_t(), TOP);
         }
+        reader_set_bracketed_paste(was_bracketed_paste);
         proc_set_last_status(last_status);
         input_common_next_ch(R_NULL);
     }
@@ -619,15 +703,20 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
 
 
 /**
-   Try reading the specified function mapping
+   The sequences that a terminal in bracketed paste mode sends around pasted text
 */
-static bool input_mapping_is_match(const input_mapping_t &m)
+#define BRACKETED_PASTE_START L"\x1b[200~"
+#define BRACKETED_PASTE_END L"\x1b[201~"
+
+/**
+   Try reading the specified sequence. If it does not match, the characters read are put back.
+*/
+static bool input_sequence_is_match(const wcstring &seq)
 {
     wint_t c = 0;
     int j;
 
-    //debug(0, L"trying mapping %ls\n", escape(m.seq.c_str(), ESCAPE_ALL).c_str());
-    const wchar_t *str = m.seq.c_str();
+    const wchar_t *str = seq.c_str();
     for (j=0; str[j] != L'\0'; j++)
     {
         bool timed = (j > 0 && iswcntrl(str[0]));
@@ -654,7 +743,7 @@ static bool input_mapping_is_match(const input_mapping_t &m)
         input_common_next_ch(c);
         for (k=j-1; k>=0; k--)
         {
-            input_common_next_ch(m.seq[k]);
+            input_common_next_ch(str[k]);
         }
     }
 
@@ -669,37 +758,42 @@ void input_queue_ch(wint_t ch)
 
 static void input_mapping_execute_matching_or_generic(bool allow_commands)
 {
-    const input_mapping_t *generic = NULL;
-
-    const wcstring bind_mode = input_get_bind_mode();
-
-    for (int i = 0; i < mapping_list.size(); i++)
+    const input_mapping_trie_t &trie = input_mapping_trie_for_mode(input_get_bind_mode());
+
+    /* Read along the trie for as long as the input may still lead to a longer sequence, remembering the longest bound sequence seen. Once the first character is a control character (e.g. escape), stop waiting for the rest of a sequence after a timeout. */
+    wcstring read_chars;
+    size_t node = 0;
+    long match = -1;
+    size_t match_length = 0;
+    while (! trie.nodes.at(node).children.empty())
     {
-        const input_mapping_t &m = mapping_list.at(i);
+        bool timed = (! read_chars.empty() && iswcntrl(read_chars.at(0)));
+        wchar_t c = input_common_readch(timed);
+        read_chars.push_back(c);
 
-        //debug(0, L"trying mapping (%ls,%ls,%ls)\n", escape(m.seq.c_str(), ESCAPE_ALL).c_str(),
-        //           m.mode.c_str(), m.sets_mode.c_str());
+        node = trie.child(node, c);
+        if (node == 0)
+            break;
 
-        if (m.mode != bind_mode)
+        if (trie.nodes.at(node).mapping >= 0)
         {
-            //debug(0, L"skipping mapping because mode %ls != %ls\n", m.mode.c_str(), input_get_bind_mode().c_str());
-            continue;
+            match = trie.nodes.at(node).mapping;
+            match_length = read_chars.size();
         }
+    }
 
-        if (m.seq.length() == 0)
-        {
-            generic = &m;
-        }
-        else if (input_mapping_is_match(m))
-        {
-            input_mapping_execute(m, allow_commands);
-            return;
-        }
+    /* Return the characters past the matched sequence */
+    for (size_t k = read_chars.size(); k > match_length; k--)
+    {
+        input_common_next_ch(read_chars.at(k - 1));
     }
 
-    if (generic)
+    if (match < 0)
+        match = trie.generic;
+
+    if (match >= 0)
     {
-        input_mapping_execute(*generic, allow_commands);
+        input_mapping_execute(mapping_list.at(match), allow_commands);
     }
     else
     {
@@ -788,6 +882,13 @@ wint_t input_readch(bool allow_commands)
         else
         {
             input_common_next_ch(c);
+
+            /* Pasted text is read as a whole instead of being matched against the key bindings character by character */
+            if (c == L'\x1b' && input_sequence_is_match(BRACKETED_PASTE_START))
+            {
+                return R_BEGIN_PASTE;
+            }
+
             input_mapping_execute_matching_or_generic(allow_commands);
             // regarding allow_commands, we're in a loop, but if a fish command
             // is executed, R_NULL is unread, so the next pass through the loop
@@ -796,6 +897,28 @@ wint_t input_readch(bool allow_commands)
     }
 }
 
+wcstring input_read_bracketed_paste()
+{
+    const wcstring paste_end = BRACKETED_PASTE_END;
+    wcstring result;
+    for (;;)
+    {
+        wchar_t c = input_common_readch(0);
+        if (c == R_EOF)
+        {
+            input_common_next_ch(c);
+            break;
+        }
+        result.push_back(c);
+        if (c == paste_end.at(paste_end.size() - 1) && string_suffixes_string(paste_end, result))
+        {
+            result.resize(result.size() - paste_end.size());
+            break;
+        }
+    }
+    return result;
+}
+
 std::vector<input_mapping_name_t> input_mapping_get_names()
 {
     // Sort the mappings by the user specification order, so we can return them in the same order that the user specified them in
@@ -825,6 +948,7 @@ bool input_mapping_erase(const wcstring &sequence, const wcstring &mode)
         if (sequence == it->seq && mode == it->mode)
         {
             mapping_list.erase(it);
+            mapping_tries_valid = false;
             result = true;
             break;
         }
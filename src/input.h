@@ -126,6 +126,14 @@ wint_t input_readch(bool allow_commands = true);
  */
 void input_queue_ch(wint_t ch);
 
+/**
+   Read the text of a bracketed paste, after input_readch has returned
+   R_BEGIN_PASTE, up to the sequence that ends the paste. The text is
+   returned as the terminal sent it, without matching it against any
+   key bindings.
+*/
+wcstring input_read_bracketed_paste();
+
 
 /**
    Add a key mapping from the specified sequence to the specified command
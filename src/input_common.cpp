@@ -27,6 +27,7 @@ Implementation file for the low level input library
 #include "env_universal_common.h"
 #include "env.h"
 #include "iothread.h"
+#include "proc.h"
 
 /**
    Time in milliseconds to wait for another byte to be available for
@@ -98,6 +99,9 @@ static wint_t readb()
     {
         /* Flush callbacks */
         input_flush_callbacks();
+        
+        /* We may wait a long time; write out any universal variable changes first */
+        env_universal_flush();
 
         fd_set fdset;
         int fd_max = 0;
@@ -122,6 +126,14 @@ static wint_t readb()
             FD_SET(notifier_fd, &fdset);
             fd_max = maxi(fd_max, notifier_fd);
         }
+
+        /* Wake up to report finished background jobs, even if their SIGCHLD arrived before we started to select */
+        int child_status_fd = proc_child_status_fd();
+        if (child_status_fd > 0)
+        {
+            FD_SET(child_status_fd, &fdset);
+            fd_max = maxi(fd_max, child_status_fd);
+        }
         
         /* Get its suggested delay (possibly none) */
         struct timeval tv = {};
@@ -194,6 +206,23 @@ static wint_t readb()
                 }
             }
 
+            if (child_status_fd > 0 && FD_ISSET(child_status_fd, &fdset))
+            {
+                proc_drain_child_status_fd();
+                if (interrupt_handler)
+                {
+                    int res = interrupt_handler();
+                    if (res)
+                    {
+                        return res;
+                    }
+                    if (has_lookahead())
+                    {
+                        return lookahead_pop();
+                    }
+                }
+            }
+
             if (FD_ISSET(STDIN_FILENO, &fdset))
             {
                 if (read_blocked(0, arr, 1) != 1)
@@ -212,6 +241,19 @@ static wint_t readb()
     return arr[0];
 }
 
+bool input_common_has_pending_input()
+{
+    if (has_lookahead())
+    {
+        return true;
+    }
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    struct timeval tm = {0, 0};
+    return select(1, &fds, 0, 0, &tm) > 0;
+}
+
 wchar_t input_common_readch(int timed)
 {
     if (! has_lookahead())
@@ -21,7 +21,14 @@ enum
        happened.
     */
     R_NULL = INPUT_COMMON_RESERVED,
-    R_EOF
+    R_EOF,
+
+    /**
+       R_BEGIN_PASTE is returned by input_readch when the terminal
+       starts sending pasted text in bracketed paste mode. The text
+       itself is read with input_read_bracketed_paste.
+    */
+    R_BEGIN_PASTE
 }
 ;
 
@@ -46,6 +53,12 @@ void input_common_destroy();
 */
 wchar_t input_common_readch(int timed);
 
+/**
+   Return whether there is input waiting to be read, either already queued or
+   on fd 0. Never blocks.
+*/
+bool input_common_has_pending_input();
+
 /**
    Enqueue a character or a readline function to the queue of unread
    characters that input_readch will return before actually reading from fd
@@ -6,71 +6,174 @@
 #include "config.h" // IWYU pragma: keep
 
 #include <wchar.h>
+#include <string.h>
+#include <assert.h>
 #include <pthread.h>
 #include <vector>
-#include <algorithm>
 
 #include "fallback.h" // IWYU pragma: keep
 #include "common.h"
 #include "intern.h"
 
-/** Comparison function for intern'd strings */
-class string_table_compare_t
+/*
+   The intern'd strings are kept in a hash table using open addressing with linear probing, and looking up a string
+   that is already intern'd takes no lock. This works because a slot only ever changes from empty to holding a string,
+   and a table that gets too full is copied into a larger one, which is then published. A reader therefore sees either
+   a string or an empty slot, and an empty slot sends it to the locked path, which looks again in the current table.
+   Tables are never freed, since readers may still be probing an old one.
+
+   The string pointer is written after a barrier, and readers only look at the string through that pointer. The hash
+   is only a hint: a reader that sees a stale hash just takes the locked path. With C++11 these would be atomics.
+*/
+struct intern_slot_t
 {
-public:
-    bool operator()(const wchar_t *a, const wchar_t *b) const
-    {
-        return wcscmp(a, b) < 0;
-    }
+    volatile size_t hash;
+    const wchar_t * volatile str;
+};
+
+struct intern_table_t
+{
+    size_t mask;
+    size_t count;
+    intern_slot_t *slots;
 };
 
-/* A sorted vector ends up being a little more memory efficient than a std::set for the intern'd string table */
-#define USE_SET 0
-#if USE_SET
-/** The table of intern'd strings */
-typedef std::set<const wchar_t *, string_table_compare_t> string_table_t;
-#else
-/** The table of intern'd strings */
-typedef std::vector<const wchar_t *> string_table_t;
-#endif
+/** The initial number of slots; a power of two */
+#define INTERN_TABLE_INITIAL_SIZE 1024
+
+/** How many wide characters to allocate at a time for copies of intern'd strings. Longer strings get their own allocation. */
+#define INTERN_ARENA_BLOCK_SIZE 16384
 
-static string_table_t string_table;
+/** The current table. Replaced with a larger one under intern_lock. */
+static intern_table_t * volatile s_table = NULL;
 
-/** The lock to provide thread safety for intern'd strings */
+/** The lock to provide thread safety for intern'd strings. Taken to add strings, not to find them. */
 static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static const wchar_t *intern_with_dup(const wchar_t *in, bool dup)
+/** The unused end of the current arena block, protected by intern_lock */
+static wchar_t *s_arena_next = NULL;
+static size_t s_arena_remaining = 0;
+
+/** Statistics, protected by intern_lock */
+static size_t s_arena_bytes = 0;
+static unsigned long s_locked_lookups = 0;
+
+/** FNV-1a */
+static size_t intern_hash(const wchar_t *str)
 {
-    if (!in)
-        return NULL;
+    size_t hash = 2166136261u;
+    for (; *str; str++)
+    {
+        hash ^= (size_t)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-//  debug( 0, L"intern %ls", in );
-    scoped_lock lock(intern_lock);
-    const wchar_t *result;
+static intern_table_t *intern_table_create(size_t size)
+{
+    intern_table_t *table = new intern_table_t;
+    table->mask = size - 1;
+    table->count = 0;
+    table->slots = new intern_slot_t[size];
+    memset(table->slots, 0, size * sizeof *table->slots);
+    return table;
+}
 
-#if USE_SET
-    string_table_t::const_iterator iter = string_table.find(in);
-    if (iter != string_table.end())
+/* Returns the slot holding the string, or the empty slot where it belongs */
+static const intern_slot_t *intern_table_probe(const intern_table_t *table, const wchar_t *in, size_t hash)
+{
+    for (size_t idx = hash & table->mask;; idx = (idx + 1) & table->mask)
     {
-        result = *iter;
+        const intern_slot_t *slot = &table->slots[idx];
+        const wchar_t *str = slot->str;
+        if (str == NULL || (slot->hash == hash && wcscmp(str, in) == 0))
+            return slot;
     }
-    else
+}
+
+/* Returns the intern'd copy of a string, or NULL if there is none, without locking */
+static const wchar_t *intern_find(const intern_table_t *table, const wchar_t *in, size_t hash)
+{
+    return table ? intern_table_probe(table, in, hash)->str : NULL;
+}
+
+/* Copy a string into the arena. Call with intern_lock held. */
+static const wchar_t *intern_arena_copy(const wchar_t *in)
+{
+    size_t len = wcslen(in) + 1;
+    s_arena_bytes += len * sizeof(wchar_t);
+    if (len > INTERN_ARENA_BLOCK_SIZE / 4)
+        return wcsdup(in);
+
+    if (len > s_arena_remaining)
     {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(result);
+        /* The rest of the old block is abandoned */
+        s_arena_next = new wchar_t[INTERN_ARENA_BLOCK_SIZE];
+        s_arena_remaining = INTERN_ARENA_BLOCK_SIZE;
     }
-#else
-    string_table_t::iterator iter = std::lower_bound(string_table.begin(), string_table.end(), in, string_table_compare_t());
-    if (iter != string_table.end() && wcscmp(*iter, in) == 0)
+    wchar_t *result = s_arena_next;
+    wmemcpy(result, in, len);
+    s_arena_next += len;
+    s_arena_remaining -= len;
+    return result;
+}
+
+/* Add a string the table does not have. Call with intern_lock held. */
+static void intern_table_add(const wchar_t *str, size_t hash)
+{
+    intern_table_t *table = s_table;
+
+    /* Keep the table at most half full. Readers keep using the old table until the new one is published. */
+    if (table == NULL || 2 * (table->count + 1) > table->mask + 1)
     {
-        result = *iter;
+        intern_table_t *grown = intern_table_create(table ? 2 * (table->mask + 1) : INTERN_TABLE_INITIAL_SIZE);
+        if (table != NULL)
+        {
+            for (size_t i=0; i <= table->mask; i++)
+            {
+                const intern_slot_t &old_slot = table->slots[i];
+                if (old_slot.str == NULL)
+                    continue;
+                intern_slot_t *slot = const_cast<intern_slot_t *>(intern_table_probe(grown, old_slot.str, old_slot.hash));
+                slot->hash = old_slot.hash;
+                slot->str = old_slot.str;
+            }
+            grown->count = table->count;
+        }
+        __sync_synchronize();
+        s_table = grown;
+        table = grown;
     }
-    else
+
+    intern_slot_t *slot = const_cast<intern_slot_t *>(intern_table_probe(table, str, hash));
+    assert(slot->str == NULL);
+    slot->hash = hash;
+    __sync_synchronize();
+    slot->str = str;
+    table->count++;
+}
+
+static const wchar_t *intern_with_dup(const wchar_t *in, bool dup)
+{
+    if (!in)
+        return NULL;
+
+    const size_t hash = intern_hash(in);
+    const wchar_t *result = intern_find(s_table, in, hash);
+    if (result != NULL)
+        return result;
+
+    scoped_lock lock(intern_lock);
+    s_locked_lookups++;
+
+    /* Another thread may have added it, possibly to a newer table */
+    result = intern_find(s_table, in, hash);
+    if (result == NULL)
     {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(iter, result);
+        result = dup ? intern_arena_copy(in) : in;
+        intern_table_add(result, hash);
     }
-#endif
     return result;
 }
 
@@ -84,3 +187,15 @@ const wchar_t *intern_static(const wchar_t *in)
 {
     return intern_with_dup(in, false);
 }
+
+intern_stats_t intern_get_stats()
+{
+    scoped_lock lock(intern_lock);
+    intern_stats_t result;
+    const intern_table_t *table = s_table;
+    result.count = table ? table->count : 0;
+    result.capacity = table ? table->mask + 1 : 0;
+    result.bytes = s_arena_bytes;
+    result.locked_lookups = s_locked_lookups;
+    return result;
+}
@@ -7,6 +7,8 @@
 #ifndef FISH_INTERN_H
 #define FISH_INTERN_H
 
+#include <stddef.h>
+
 /**
    Return an identical copy of the specified string from a pool of unique strings. If the string was not in the pool, add a copy.
 
@@ -23,4 +25,16 @@ const wchar_t *intern(const wchar_t *in);
 */
 const wchar_t *intern_static(const wchar_t *in);
 
+/** Statistics about the pool of intern'd strings */
+struct intern_stats_t
+{
+    size_t count; /** How many strings are intern'd */
+    size_t capacity; /** How many slots the hash table has */
+    size_t bytes; /** How many bytes the copied strings take */
+    unsigned long locked_lookups; /** Lookups that had to take the lock, because the string was not yet intern'd */
+};
+
+/** Return statistics about the pool of intern'd strings */
+intern_stats_t intern_get_stats();
+
 #endif
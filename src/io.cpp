@@ -49,6 +49,84 @@ void io_buffer_t::print() const
             is_input ? "yes" : "no", (unsigned long) out_buffer_size());
 }
 
+void io_buffer_t::out_buffer_append(const char *ptr, size_t count)
+{
+    if (discarded)
+        return;
+
+    total_size += count;
+    if (limit > 0 && total_size > limit)
+    {
+        /* Too much. Free what we have, and ignore the rest. */
+        discarded = true;
+        std::vector<char>().swap(out_buffer);
+        wcstring_list_t().swap(out_lines);
+        return;
+    }
+
+    if (! split_lines)
+    {
+        out_buffer.insert(out_buffer.end(), ptr, ptr + count);
+        return;
+    }
+
+    /* Find the end of the last line completed by this data */
+    const char * const end = ptr + count;
+    const char *tail = end;
+    while (tail > ptr && tail[-1] != '\n')
+        tail--;
+
+    if (tail == ptr)
+    {
+        /* No line was completed */
+        out_buffer.insert(out_buffer.end(), ptr, end);
+        return;
+    }
+
+    /* Decode all the completed lines in one pass, then slice them out of the wide text. The first line may have begun in an earlier call, in which case its start is in out_buffer. */
+    decode_arena.clear();
+    if (out_buffer.empty())
+    {
+        str2wcstring_append(ptr, tail - ptr, &decode_arena);
+    }
+    else
+    {
+        out_buffer.insert(out_buffer.end(), ptr, tail);
+        str2wcstring_append(&out_buffer.at(0), out_buffer.size(), &decode_arena);
+        out_buffer.clear();
+    }
+
+    size_t line_start = 0, newline;
+    while ((newline = decode_arena.find(L'\n', line_start)) != wcstring::npos)
+    {
+        out_lines.push_back(wcstring());
+        out_lines.back().assign(decode_arena, line_start, newline - line_start);
+        line_start = newline + 1;
+    }
+    out_buffer.insert(out_buffer.end(), tail, end);
+}
+
+void io_buffer_t::take_lines(wcstring_list_t *out)
+{
+    assert(split_lines);
+    if (! out_buffer.empty())
+    {
+        out_lines.push_back(str2wcstring(&out_buffer.at(0), out_buffer.size()));
+        out_buffer.clear();
+    }
+
+    if (out->empty())
+    {
+        out->swap(out_lines);
+    }
+    else
+    {
+        out->insert(out->end(), out_lines.begin(), out_lines.end());
+    }
+    out_lines.clear();
+    wcstring().swap(decode_arena);
+}
+
 void io_buffer_t::read()
 {
     exec_close(pipe_fd[1]);
@@ -70,6 +148,11 @@ void io_buffer_t::read()
             {
                 break;
             }
+            else if (l<0 && errno == EINTR)
+            {
+                /* Blocking signals does not mask them; just try again */
+                continue;
+            }
             else if (l<0)
             {
                 /*
@@ -97,6 +180,38 @@ void io_buffer_t::read()
     }
 }
 
+bool io_buffer_t::read_available()
+{
+    while (1)
+    {
+        char b[4096];
+        ssize_t l = ::read(pipe_fd[0], b, sizeof b);
+        if (l == 0)
+        {
+            return false;
+        }
+        else if (l < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (l < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+
+            debug(1,
+                  _(L"An error occured while reading output from code block on file descriptor %d"),
+                  pipe_fd[0]);
+            wperror(L"io_buffer_t::read_available");
+            return false;
+        }
+        else
+        {
+            out_buffer_append(b, l);
+        }
+    }
+}
+
 bool io_buffer_t::avoid_conflicts_with_io_chain(const io_chain_t &ios)
 {
     bool result = pipe_avoid_conflicts_with_io_chain(this->pipe_fd, ios);
@@ -152,14 +267,55 @@ io_buffer_t::~io_buffer_t()
     */
 }
 
+io_chain_t::io_list_t &io_chain_t::mutable_ios()
+{
+    if (! ios)
+    {
+        ios.reset(new io_list_t());
+    }
+    else if (! ios.unique())
+    {
+        ios.reset(new io_list_t(*ios));
+    }
+    return *ios;
+}
+
+/* The list that empty chains iterate over */
+static const std::vector<shared_ptr<io_data_t> > &empty_io_list()
+{
+    static const std::vector<shared_ptr<io_data_t> > empty_list;
+    return empty_list;
+}
+
+io_chain_t::const_iterator io_chain_t::begin() const
+{
+    return ios ? ios->begin() : empty_io_list().begin();
+}
+
+io_chain_t::const_iterator io_chain_t::end() const
+{
+    return ios ? ios->end() : empty_io_list().end();
+}
+
+void io_chain_t::clear()
+{
+    ios.reset();
+}
+
+void io_chain_t::swap(io_chain_t &other)
+{
+    ios.swap(other.ios);
+}
+
 void io_chain_t::remove(const shared_ptr<const io_data_t> &element)
 {
-    // See if you can guess why std::find doesn't work here
-    for (io_chain_t::iterator iter = this->begin(); iter != this->end(); ++iter)
+    size_t idx = this->size();
+    while (idx--)
     {
-        if (*iter == element)
+        if (this->at(idx) == element)
         {
-            this->erase(iter);
+            io_list_t &list = this->mutable_ios();
+            list.erase(list.begin() + idx);
             break;
         }
     }
@@ -169,18 +325,30 @@ void io_chain_t::push_back(const shared_ptr<io_data_t> &element)
 {
     // Ensure we never push back NULL
     assert(element.get() != NULL);
-    std::vector<shared_ptr<io_data_t> >::push_back(element);
+    this->mutable_ios().push_back(element);
 }
 
 void io_chain_t::push_front(const shared_ptr<io_data_t> &element)
 {
     assert(element.get() != NULL);
-    this->insert(this->begin(), element);
+    io_list_t &list = this->mutable_ios();
+    list.insert(list.begin(), element);
 }
 
 void io_chain_t::append(const io_chain_t &chain)
 {
-    this->insert(this->end(), chain.begin(), chain.end());
+    if (chain.empty())
+    {
+        return;
+    }
+    if (this->empty())
+    {
+        /* Share the other chain's redirections instead of copying them */
+        this->ios = chain.ios;
+        return;
+    }
+    io_list_t &list = this->mutable_ios();
+    list.insert(list.end(), chain.begin(), chain.end());
 }
 
 void io_print(const io_chain_t &chain)
@@ -207,11 +375,10 @@ void io_print(const io_chain_t &chain)
     }
 }
 
-/* If the given fd is used by the io chain, duplicates it repeatedly until an fd not used in the io chain is found, or we run out. If we return a new fd or an error, closes the old one. Any fd created is marked close-on-exec. Returns -1 on failure (in which case the given fd is still closed). */
-static int move_fd_to_unused(int fd, const io_chain_t &io_chain)
+int move_fd_to_unused(int fd, const io_chain_t &io_chain)
 {
     int new_fd = fd;
-    if (fd >= 0 && io_chain.get_io_for_fd(fd).get() != NULL)
+    if (fd >= 0 && io_chain.has_io_for_fd(fd))
     {
         /* We have fd >= 0, and it's a conflict. dup it and recurse. Note that we recurse before anything is closed; this forces the kernel to give us a new one (or report fd exhaustion). */
         int tmp_fd;
@@ -272,13 +439,27 @@ bool pipe_avoid_conflicts_with_io_chain(int fds[2], const io_chain_t &ios)
     return success;
 }
 
+/* Return whether any IO in the chain is for the given fd */
+bool io_chain_t::has_io_for_fd(int fd) const
+{
+    size_t idx = this->size();
+    while (idx--)
+    {
+        if (this->at(idx)->fd == fd)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Return the last IO for the given fd */
 shared_ptr<const io_data_t> io_chain_t::get_io_for_fd(int fd) const
 {
     size_t idx = this->size();
     while (idx--)
     {
-        const shared_ptr<const io_data_t> &data = this->at(idx);
+        const shared_ptr<io_data_t> &data = this->at(idx);
         if (data->fd == fd)
         {
             return data;
@@ -313,12 +494,11 @@ shared_ptr<io_data_t> io_chain_get(io_chain_t &src, int fd)
 }
 
 io_chain_t::io_chain_t(const shared_ptr<io_data_t> &data) :
-    std::vector<shared_ptr<io_data_t> >(1, data)
+    ios(new io_list_t(1, data))
 {
-
 }
 
-io_chain_t::io_chain_t() : std::vector<shared_ptr<io_data_t> >()
+io_chain_t::io_chain_t() : ios()
 {
 }
 
@@ -12,10 +12,12 @@
 // C++11 or libc++ (which is a C++11-only library, but the memory header works OK in C++03)
 #include <memory>
 using std::shared_ptr;
+using std::weak_ptr;
 #else
 // C++03 or libstdc++
 #include <tr1/memory>
 using std::tr1::shared_ptr;
+using std::tr1::weak_ptr;
 #endif
 
 #include "common.h"
@@ -134,12 +136,36 @@ class io_chain_t;
 class io_buffer_t : public io_pipe_t
 {
 private:
-    /** buffer to save output in */
+    /** buffer to save output in. When splitting lines, this holds only the last, incomplete line. */
     std::vector<char> out_buffer;
 
+    /** Whether to split the output into lines as it arrives */
+    bool split_lines;
+
+    /** The complete lines of output, if splitting lines */
+    wcstring_list_t out_lines;
+
+    /** Scratch storage that the completed lines of each chunk of output are decoded into, before being split */
+    wcstring decode_arena;
+
+    /** The number of bytes of output to accept, or 0 for no limit */
+    size_t limit;
+
+    /** The number of bytes of output received */
+    size_t total_size;
+
+    /** Whether the output exceeded the limit, and was discarded */
+    bool discarded;
+
     io_buffer_t(int f):
         io_pipe_t(IO_BUFFER, f, false /* not input */),
-        out_buffer()
+        out_buffer(),
+        split_lines(false),
+        out_lines(),
+        decode_arena(),
+        limit(0),
+        total_size(0),
+        discarded(false)
     {
     }
 
@@ -149,11 +175,31 @@ public:
     virtual ~io_buffer_t();
 
     /** Function to append to the buffer */
-    void out_buffer_append(const char *ptr, size_t count)
+    void out_buffer_append(const char *ptr, size_t count);
+
+    /**
+       Makes the buffer split its output into lines at newlines as it arrives, converting each line to a wide string right away. This way the full output is never held as bytes as well as wide strings. Must be called before any output arrives. The lines are then retrieved with take_lines(); the byte buffer holds only an incomplete last line.
+    */
+    void split_lines_as_they_arrive(void)
     {
-        out_buffer.insert(out_buffer.end(), ptr, ptr + count);
+        split_lines = true;
     }
 
+    /** Sets the number of bytes of output to accept, or 0 for no limit. If the output is longer, it is all discarded. */
+    void set_limit(size_t bytes)
+    {
+        limit = bytes;
+    }
+
+    /** Returns whether the output exceeded the limit and was discarded */
+    bool output_discarded(void) const
+    {
+        return discarded;
+    }
+
+    /** Moves the lines of a buffer that splits lines into the given list, including any final line not terminated by a newline */
+    void take_lines(wcstring_list_t *out);
+
     /** Function to get a pointer to the buffer */
     char *out_buffer_ptr(void)
     {
@@ -179,6 +225,11 @@ public:
     */
     void read();
 
+    /**
+       Reads the output that is available on the input pipe without waiting for more. The output pipe must have been closed already. Returns false once there is no more output to read, at eof or on error.
+    */
+    bool read_available();
+
     /**
        Create a IO_BUFFER type io redirection, complete with a pipe and a
        vector<char> for output. The default file descriptor used is STDOUT_FILENO
@@ -191,17 +242,64 @@ public:
     static io_buffer_t *create(int fd, const io_chain_t &conflicts);
 };
 
-class io_chain_t : public std::vector<shared_ptr<io_data_t> >
+/**
+   A list of io redirections, applied in order.
+
+   Chains are passed down to every job and block, and most are copied far more
+   often than they are changed, so copies share the list of redirections. A
+   copy costs one reference count, and a chain only duplicates the list when
+   it is changed while shared. An empty chain allocates nothing.
+*/
+class io_chain_t
 {
+    typedef std::vector<shared_ptr<io_data_t> > io_list_t;
+
+    /** The redirections, or NULL if there are none. Shared between copies of the chain, and so not modified unless unique. */
+    shared_ptr<io_list_t> ios;
+
+    /** Returns the redirections for modification, first making a private copy if they are shared */
+    io_list_t &mutable_ios();
+
 public:
+    typedef io_list_t::const_iterator const_iterator;
+
     io_chain_t();
     io_chain_t(const shared_ptr<io_data_t> &);
 
+    size_t size() const
+    {
+        return ios ? ios->size() : 0;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    const shared_ptr<io_data_t> &at(size_t idx) const
+    {
+        return ios->at(idx);
+    }
+
+    const shared_ptr<io_data_t> &operator[](size_t idx) const
+    {
+        return (*ios)[idx];
+    }
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    void clear();
+    void swap(io_chain_t &other);
+
     void remove(const shared_ptr<const io_data_t> &element);
     void push_back(const shared_ptr<io_data_t> &element);
     void push_front(const shared_ptr<io_data_t> &element);
     void append(const io_chain_t &chain);
 
+    /** Returns whether the chain contains a redirection for the given fd. Cheaper than get_io_for_fd, since it takes no reference. */
+    bool has_io_for_fd(int fd) const;
+
     shared_ptr<const io_data_t> get_io_for_fd(int fd) const;
     shared_ptr<io_data_t> get_io_for_fd(int fd);
 };
@@ -213,6 +311,9 @@ public:
 shared_ptr<const io_data_t> io_chain_get(const io_chain_t &src, int fd);
 shared_ptr<io_data_t> io_chain_get(io_chain_t &src, int fd);
 
+/* If the given fd is used by the io chain, duplicates it repeatedly until an fd not used in the io chain is found, or we run out. If we return a new fd or an error, closes the old one. Any fd created is marked close-on-exec. Returns -1 on failure (in which case the given fd is still closed). */
+int move_fd_to_unused(int fd, const io_chain_t &io_chain);
+
 /* Given a pair of fds, if an fd is used by the given io chain, duplicate that fd repeatedly until we find one that does not conflict, or we run out of fds. Returns the new fds by reference, closing the old ones. If we get an error, returns false (in which case both fds are closed and set to -1). */
 bool pipe_avoid_conflicts_with_io_chain(int fds[2], const io_chain_t &ios);
 
@@ -38,6 +38,7 @@ struct SpawnRequest_t
     void (*completionCallback)(void *, int);
     void *context;
     int handlerResult;
+    iothread_priority_t priority;
 };
 
 struct MainThreadRequest_t
@@ -48,10 +49,15 @@ struct MainThreadRequest_t
     volatile bool done;
 };
 
-/* Spawn support. Requests are allocated and come in on request_queue. They go out on result_queue, at which point they can be deallocated. s_active_thread_count is also protected by the lock. */
+/* Spawn support. Requests are allocated and come in on one of the request queues, one per priority. They go out on result_queue, at which point they can be deallocated. The thread counts are also protected by the lock.
+
+   Worker threads are persistent: once spawned, a worker waits on s_spawn_queue_condition for more work instead of exiting. New workers are spawned only when a request arrives, no worker is idle, and there are fewer than s_max_thread_count workers. */
 static pthread_mutex_t s_spawn_queue_lock;
-static std::queue<SpawnRequest_t *> s_request_queue;
+static pthread_cond_t s_spawn_queue_condition;
+static std::queue<SpawnRequest_t *> s_request_queues[iothread_priority_count];
 static int s_active_thread_count;
+static int s_idle_thread_count;
+static int s_max_thread_count = IO_MAX_THREADS;
 
 static pthread_mutex_t s_result_queue_lock;
 static std::queue<SpawnRequest_t *> s_result_queue;
@@ -65,6 +71,20 @@ static std::queue<MainThreadRequest_t *> s_main_thread_request_queue;
 /* Notifying pipes */
 static int s_read_pipe, s_write_pipe;
 
+/* Called in the child after a fork. The worker threads were not copied into the child, so forget about them, and about the requests they would have performed for the parent. A worker may have held the lock at the time of the fork, so reinitialize it. */
+static void iothread_forget_threads_after_fork(void)
+{
+    VOMIT_ON_FAILURE(pthread_mutex_init(&s_spawn_queue_lock, NULL));
+    VOMIT_ON_FAILURE(pthread_cond_init(&s_spawn_queue_condition, NULL));
+    for (int priority = 0; priority < iothread_priority_count; priority++)
+    {
+        std::queue<SpawnRequest_t *> empty;
+        std::swap(s_request_queues[priority], empty);
+    }
+    s_active_thread_count = 0;
+    s_idle_thread_count = 0;
+}
+
 static void iothread_init(void)
 {
     static bool inited = false;
@@ -74,10 +94,12 @@ static void iothread_init(void)
 
         /* Initialize some locks */
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_spawn_queue_lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&s_spawn_queue_condition, NULL));
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_result_queue_lock, NULL));
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_main_thread_request_queue_lock, NULL));
         VOMIT_ON_FAILURE(pthread_mutex_init(&s_main_thread_performer_lock, NULL));
         VOMIT_ON_FAILURE(pthread_cond_init(&s_main_thread_performer_condition, NULL));
+        VOMIT_ON_FAILURE(pthread_atfork(NULL, NULL, iothread_forget_threads_after_fork));
 
         /* Initialize the completion pipes */
         int pipes[2] = {0, 0};
@@ -94,21 +116,38 @@ static void iothread_init(void)
 static void add_to_queue(struct SpawnRequest_t *req)
 {
     ASSERT_IS_LOCKED(s_spawn_queue_lock);
-    s_request_queue.push(req);
+    assert(req->priority >= 0 && req->priority < iothread_priority_count);
+    s_request_queues[req->priority].push(req);
 }
 
+/* Returns the oldest request of the highest priority that has any, or NULL if all queues are empty */
 static SpawnRequest_t *dequeue_spawn_request(void)
 {
     ASSERT_IS_LOCKED(s_spawn_queue_lock);
     SpawnRequest_t *result = NULL;
-    if (! s_request_queue.empty())
+    for (int priority = 0; priority < iothread_priority_count && result == NULL; priority++)
     {
-        result = s_request_queue.front();
-        s_request_queue.pop();
+        std::queue<SpawnRequest_t *> &queue = s_request_queues[priority];
+        if (! queue.empty())
+        {
+            result = queue.front();
+            queue.pop();
+        }
     }
     return result;
 }
 
+static bool request_queues_are_empty(void)
+{
+    ASSERT_IS_LOCKED(s_spawn_queue_lock);
+    for (int priority = 0; priority < iothread_priority_count; priority++)
+    {
+        if (! s_request_queues[priority].empty())
+            return false;
+    }
+    return true;
+}
+
 static void enqueue_thread_result(SpawnRequest_t *req)
 {
     scoped_lock lock(s_result_queue_lock);
@@ -124,9 +163,20 @@ static void *this_thread()
 static void *iothread_worker(void *unused)
 {
     scoped_lock locker(s_spawn_queue_lock);
-    struct SpawnRequest_t *req;
-    while ((req = dequeue_spawn_request()) != NULL)
+    for (;;)
     {
+        struct SpawnRequest_t *req = dequeue_spawn_request();
+        if (req == NULL)
+        {
+            /* Exit if the pool has been shrunk below our count. Otherwise wait for more work. */
+            if (s_active_thread_count > s_max_thread_count)
+                break;
+            s_idle_thread_count += 1;
+            VOMIT_ON_FAILURE(pthread_cond_wait(&s_spawn_queue_condition, &s_spawn_queue_lock));
+            s_idle_thread_count -= 1;
+            continue;
+        }
+
         IOTHREAD_LOG fprintf(stderr, "pthread %p dequeued %p\n", this_thread(), req);
         /* Unlock the queue while we execute the request */
         locker.unlock();
@@ -151,7 +201,7 @@ static void *iothread_worker(void *unused)
         locker.lock();
     }
     
-    /* We believe we have exhausted the thread request queue. We want to decrement s_active_thread_count and exit. But it's possible that a request just came in. Furthermore, it's possible that the main thread saw that s_active_thread_count is full, and decided to not spawn a new thread, trusting in one of the existing threads to handle it. But we've already committed to not handling anything else. Therefore, we have to decrement s_active_thread_count under the lock, which we still hold. Likewise, the main thread must check the value under the lock. */
+    /* The pool was shrunk and the request queues are empty. We have to decrement s_active_thread_count under the lock, which we still hold, since the main thread decides whether to spawn a new thread based on its value. */
     ASSERT_IS_LOCKED(s_spawn_queue_lock);
     assert(s_active_thread_count > 0);
     s_active_thread_count -= 1;
@@ -183,9 +233,31 @@ static void iothread_spawn()
     VOMIT_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &saved_set, NULL));
 }
 
-int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context)
+/* Queues a request and wakes or reserves a worker for it. Returns whether a new worker must be spawned, which the caller does once it has released the lock. */
+static bool queue_request_locked(SpawnRequest_t *req)
 {
-    ASSERT_IS_MAIN_THREAD();
+    ASSERT_IS_LOCKED(s_spawn_queue_lock);
+    add_to_queue(req);
+    if (s_idle_thread_count > 0)
+    {
+        /* Wake an idle worker. Note it may not be the one that ends up taking this request, but some worker will. */
+        VOMIT_ON_FAILURE(pthread_cond_signal(&s_spawn_queue_condition));
+    }
+    else if (s_active_thread_count < s_max_thread_count)
+    {
+        s_active_thread_count++;
+        return true;
+    }
+    return false;
+}
+
+int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context, iothread_priority_t priority)
+{
+    /* Completions are serviced on the main thread, so only it may ask for them */
+    if (completionCallback != NULL)
+    {
+        ASSERT_IS_MAIN_THREAD();
+    }
     ASSERT_IS_NOT_FORKED_CHILD();
     iothread_init();
 
@@ -194,18 +266,14 @@ int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(voi
     req->handler = handler;
     req->completionCallback = completionCallback;
     req->context = context;
+    req->priority = priority;
 
     int local_thread_count = -1;
     bool spawn_new_thread = false;
     {
-        /* Lock around a local region. Note that we can only access s_active_thread_count under the lock. */
+        /* Lock around a local region. Note that we can only access the thread counts under the lock. */
         scoped_lock lock(s_spawn_queue_lock);
-        add_to_queue(req);
-        if (s_active_thread_count < IO_MAX_THREADS)
-        {
-            s_active_thread_count++;
-            spawn_new_thread = true;
-        }
+        spawn_new_thread = queue_request_locked(req);
         local_thread_count = s_active_thread_count;
     }
     
@@ -219,6 +287,58 @@ int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(voi
     return local_thread_count;
 }
 
+bool iothread_perform_if_free_base(int (*handler)(void *), void *context, iothread_priority_t priority)
+{
+    ASSERT_IS_NOT_FORKED_CHILD();
+    iothread_init();
+
+    bool spawn_new_thread = false;
+    {
+        scoped_lock lock(s_spawn_queue_lock);
+
+        /* Each queued request will take one of the idle workers */
+        size_t queued = 0;
+        for (int i = 0; i < iothread_priority_count; i++)
+        {
+            queued += s_request_queues[i].size();
+        }
+        const size_t free_workers = (size_t)s_idle_thread_count + (size_t)std::max(0, s_max_thread_count - s_active_thread_count);
+        if (queued >= free_workers)
+            return false;
+
+        struct SpawnRequest_t *req = new SpawnRequest_t();
+        req->handler = handler;
+        req->completionCallback = NULL;
+        req->context = context;
+        req->priority = priority;
+        spawn_new_thread = queue_request_locked(req);
+    }
+
+    if (spawn_new_thread)
+    {
+        iothread_spawn();
+    }
+    return true;
+}
+
+void iothread_set_max_threads(int count)
+{
+    ASSERT_IS_MAIN_THREAD();
+    iothread_init();
+    if (count <= 0)
+        count = IO_MAX_THREADS;
+    count = std::min(count, (int)IO_MAX_THREADS);
+
+    scoped_lock lock(s_spawn_queue_lock);
+    s_max_thread_count = count;
+
+    /* Wake the idle workers so that any in excess can exit */
+    if (s_active_thread_count > s_max_thread_count)
+    {
+        VOMIT_ON_FAILURE(pthread_cond_broadcast(&s_spawn_queue_condition));
+    }
+}
+
 int iothread_port(void)
 {
     iothread_init();
@@ -259,9 +379,9 @@ static bool iothread_wait_for_pending_completions(long timeout_usec)
     return ret > 0;
 }
 
-/* Note that this function is quite sketchy. In particular, it drains threads, not requests, meaning that it may leave requests on the queue. This is the desired behavior (it may be called before fork, and we don't want to bother servicing requests before we fork), but in the test suite we depend on it draining all requests. In practice, this works, because a thread in practice won't exit while there is outstanding requests.
+/* Waits until every queued request has been performed and every worker is idle, servicing completions meanwhile. The idle workers remain; they have no lock held and are blocked on a condition, so they are safe to fork around.
  
-  At the moment, this function is only used in the test suite and in a drain-all-threads-before-fork compatibility mode that no architecture requires, so it's OK that it's terrible.
+  At the moment, this function is only used in the test suite and in a drain-all-threads-before-fork compatibility mode that no architecture requires.
 */
 void iothread_drain_all(void)
 {
@@ -277,7 +397,7 @@ void iothread_drain_all(void)
 #endif
     
     /* Nasty polling via select(). */
-    while (s_active_thread_count > 0)
+    while (s_idle_thread_count < s_active_thread_count || ! request_queues_are_empty())
     {
         locker.unlock();
         if (iothread_wait_for_pending_completions(1000))
@@ -286,6 +406,10 @@ void iothread_drain_all(void)
         }
         locker.lock();
     }
+    locker.unlock();
+
+    /* A worker posts its result before it goes idle, so the last completions may not have been serviced yet. Their wakeup bytes are left in the pipe, which is harmless: servicing an empty result queue does nothing. */
+    iothread_service_result_queue();
 #if TIME_DRAIN
     double after = timef();
     printf("(Waited %.02f msec for %d thread(s) to drain)\n", 1000 * (after - now), thread_count);
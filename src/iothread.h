@@ -5,15 +5,47 @@
 #ifndef FISH_IOTHREAD_H
 #define FISH_IOTHREAD_H
 
+/**
+  Priority classes of iothread requests. Queued requests are started in order of priority, and in the order they were made within a priority.
+*/
+enum iothread_priority_t
+{
+    /** Work the user is waiting on while typing, like syntax highlighting */
+    iothread_priority_interactive,
+
+    /** The default */
+    iothread_priority_normal,
+
+    /** Work nobody is waiting on, like history file detection */
+    iothread_priority_background,
+
+    iothread_priority_count
+};
+
 /**
  Runs a command on a thread.
 
  \param handler The function to execute on a background thread. Accepts an arbitrary context pointer, and returns an int, which is passed to the completionCallback.
  \param completionCallback The function to execute on the main thread once the background thread is complete. Accepts an int (the return value of handler) and the context.
  \param context A arbitary context pointer to pass to the handler and completion callback.
- \return A sequence number, currently not very useful.
+ \param priority The priority class of the request.
+ \return The number of worker threads, for informational purposes only.
+
+ Must be called on the main thread, except for requests without a completionCallback, which a worker may also make.
 */
-int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context);
+int iothread_perform_base(int (*handler)(void *), void (*completionCallback)(void *, int), void *context, iothread_priority_t priority);
+
+/**
+  Like iothread_perform_base without a completion callback, but only queues the request if a worker can start on it right away: an idle worker that no queued request will take, or room to spawn another. Any thread may call this.
+
+  \return Whether the request was queued. If not, the handler was not run, and the caller may run it itself.
+*/
+bool iothread_perform_if_free_base(int (*handler)(void *), void *context, iothread_priority_t priority);
+
+/**
+  Sets the maximum number of worker threads. Values that are not positive restore the default, which is also the upper limit. Workers in excess of a lowered limit exit once they become idle.
+*/
+void iothread_set_max_threads(int count);
 
 /**
   Gets the fd on which to listen for completion callbacks.
@@ -25,7 +57,7 @@ int iothread_port(void);
 /** Services one iothread competion callback. */
 void iothread_service_completion(void);
 
-/** Waits for all iothreads to terminate. */
+/** Waits until all queued iothread requests have been performed and their completions serviced. */
 void iothread_drain_all(void);
 
 /** Performs a function on the main thread, blocking until it completes */
@@ -33,16 +65,22 @@ int iothread_perform_on_main_base(int (*handler)(void *), void *context);
 
 /** Helper templates */
 template<typename T>
-int iothread_perform(int (*handler)(T *), void (*completionCallback)(T *, int), T *context)
+int iothread_perform(int (*handler)(T *), void (*completionCallback)(T *, int), T *context, iothread_priority_t priority = iothread_priority_normal)
 {
-    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))completionCallback, static_cast<void *>(context));
+    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))completionCallback, static_cast<void *>(context), priority);
 }
 
 /* Variant that takes no completion callback */
 template<typename T>
-int iothread_perform(int (*handler)(T *), T *context)
+int iothread_perform(int (*handler)(T *), T *context, iothread_priority_t priority = iothread_priority_normal)
+{
+    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))0, static_cast<void *>(context), priority);
+}
+
+template<typename T>
+bool iothread_perform_if_free(int (*handler)(T *), T *context, iothread_priority_t priority = iothread_priority_normal)
 {
-    return iothread_perform_base((int (*)(void *))handler, (void (*)(void *, int))0, static_cast<void *>(context));
+    return iothread_perform_if_free_base((int (*)(void *))handler, static_cast<void *>(context), priority);
 }
 
 template<typename T>
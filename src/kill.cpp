@@ -9,9 +9,16 @@
 #include "config.h" // IWYU pragma: keep
 
 #include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <algorithm>
 #include <list>
 #include <string>
+#include <vector>
 
 #include "fallback.h" // IWYU pragma: keep
 #include "kill.h"
@@ -19,6 +26,10 @@
 #include "env.h"
 #include "exec.h"
 #include "path.h"
+#include "wutil.h" // IWYU pragma: keep
+#include "signal.h"
+#include "iothread.h"
+#include "postfork.h"
 
 /** Kill ring */
 typedef std::list<wcstring> kill_list_t;
@@ -29,6 +40,11 @@ static kill_list_t kill_list;
 */
 static wcstring cut_buffer;
 
+/**
+   Full path of the xsel command, or empty if it is not installed
+*/
+static wcstring xsel_path;
+
 /**
    Test if the xsel command is installed.  Since this is called often,
    cache the result.
@@ -38,20 +54,362 @@ static int has_xsel()
     static signed char res=-1;
     if (res < 0)
     {
-        res = !! path_get_path(L"xsel", NULL);
+        res = !! path_get_path(L"xsel", &xsel_path);
     }
 
     return res;
 }
 
+/**
+   Turn the contents of the clipboard into the string that goes into
+   the killring. The lines are joined with backslash escapes, since we
+   don't really like tabs, newlines, etc. anyway.
+*/
+static wcstring clipboard_kill_entry(const wcstring &contents)
+{
+    wcstring result;
+    size_t start = 0;
+    while (start < contents.size())
+    {
+        size_t end = contents.find(L'\n', start);
+        if (end == wcstring::npos)
+            end = contents.size();
+
+        if (start > 0)
+            result.append(L"\\n");
+        result.append(escape_string(wcstring(contents, start, end - start), 0));
+        start = end + 1;
+    }
+    return result;
+}
+
+/**
+   Merge text that was read from the clipboard into the killring, if
+   it is not what we put there ourselves.
+*/
+static void kill_merge_clipboard(const wcstring &contents)
+{
+    const wcstring new_cut_buffer = clipboard_kill_entry(contents);
+    if (! new_cut_buffer.empty() && cut_buffer != new_cut_buffer)
+    {
+        cut_buffer = new_cut_buffer;
+        kill_list.push_front(new_cut_buffer);
+    }
+}
+
+std::string kill_osc52_sequence(const wcstring &str)
+{
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const std::string data = wcs2string(str);
+
+    std::string result = "\x1b]52;c;";
+    for (size_t i = 0; i < data.size(); i += 3)
+    {
+        size_t left = data.size() - i;
+        unsigned long bits = (unsigned long)(unsigned char)data[i] << 16;
+        if (left > 1)
+            bits |= (unsigned long)(unsigned char)data[i + 1] << 8;
+        if (left > 2)
+            bits |= (unsigned long)(unsigned char)data[i + 2];
+
+        result.push_back(digits[(bits >> 18) & 63]);
+        result.push_back(digits[(bits >> 12) & 63]);
+        result.push_back(left > 1 ? digits[(bits >> 6) & 63] : '=');
+        result.push_back(left > 2 ? digits[bits & 63] : '=');
+    }
+    result.push_back('\x07');
+    return result;
+}
+
+#if FISH_USE_POSIX_SPAWN
+
+/**
+   How long a yank waits for xsel to read the clipboard, in
+   milliseconds. xsel itself is told to give up a little earlier.
+*/
+#define CLIPBOARD_READ_TIMEOUT_MSEC 250
+#define CLIPBOARD_READ_XSEL_TIMEOUT "200"
+
+/**
+   A copy of a kill to the clipboard, run on a background thread.
+   Everything it needs from the shell is copied on the main thread when
+   it is started.
+*/
+struct clipboard_write_t
+{
+    /** Path to xsel, and the exported variables to run it with */
+    std::string path;
+    std::vector<std::string> env;
+
+    /** The text to copy */
+    std::string data;
+};
+
+/**
+   Whether xsel is copying a kill in the background. Only one copy runs
+   at a time.
+*/
+static bool clipboard_busy = false;
+
+/**
+   The latest kill that still has to be copied to the clipboard. Older
+   ones are overwritten by it anyway, so only this one is kept.
+*/
+static bool clipboard_write_pending = false;
+static std::string clipboard_pending_write;
+
+static int clipboard_open_pipe(int fd[2])
+{
+    int res;
+    while ((res = pipe(fd)) && errno == EINTR)
+        ;
+    if (res == 0)
+    {
+        set_cloexec(fd[0]);
+        set_cloexec(fd[1]);
+    }
+    return res;
+}
+
+/**
+   Starts xsel to copy to the clipboard from its stdin, or to write the
+   clipboard to its stdout. Returns its pid and puts our end of the pipe
+   in \c out_fd, or returns 0 on failure.
+
+   xsel is put in a process group of its own so that it does not get
+   keyboard signals meant for the shell. It is never waited for here:
+   the shell reaps all its children, and a waitpid for xsel could race
+   with that. This also runs on a background thread, and so must not
+   touch any shell state.
+*/
+static pid_t clipboard_spawn_xsel(const char *path, bool is_write, const char * const *envv, int *out_fd)
+{
+    const char *const write_argv[] = {"xsel", "-i", "-b", NULL};
+    const char *const read_argv[] = {"xsel", "-o", "-t", CLIPBOARD_READ_XSEL_TIMEOUT, "-b", NULL};
+
+    int fd[2];
+    if (clipboard_open_pipe(fd) != 0)
+        return 0;
+
+    /* Our end of the pipe, and the fd in xsel it is connected to */
+    int our_fd = is_write ? fd[1] : fd[0];
+    int their_fd = is_write ? fd[0] : fd[1];
+    int target_fd = is_write ? STDIN_FILENO : STDOUT_FILENO;
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    if (posix_spawnattr_init(&attr) != 0)
+    {
+        close(fd[0]);
+        close(fd[1]);
+        return 0;
+    }
+    if (posix_spawn_file_actions_init(&actions) != 0)
+    {
+        posix_spawnattr_destroy(&attr);
+        close(fd[0]);
+        close(fd[1]);
+        return 0;
+    }
+
+    sigset_t sigdefault, sigmask;
+    get_signals_with_handlers(&sigdefault);
+    sigemptyset(&sigmask);
+
+    int err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    if (! err)
+        err = posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    if (! err)
+        err = posix_spawnattr_setsigmask(&attr, &sigmask);
+    if (! err)
+        err = posix_spawnattr_setpgroup(&attr, 0);
+    if (! err)
+        err = posix_spawn_file_actions_adddup2(&actions, their_fd, target_fd);
+    if (! err && target_fd != STDIN_FILENO)
+        err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (! err && target_fd != STDOUT_FILENO)
+        err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    if (! err)
+        err = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid = 0;
+    if (! err)
+    {
+        err = posix_spawn(&pid, path, &actions, &attr,
+                          const_cast<char * const *>(is_write ? write_argv : read_argv),
+                          const_cast<char * const *>(envv));
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(their_fd);
+
+    if (err)
+    {
+        close(our_fd);
+        return 0;
+    }
+
+    *out_fd = our_fd;
+    return pid;
+}
+
+/**
+   Copies a kill to the clipboard. This runs on a background thread.
+*/
+static int clipboard_run_write(clipboard_write_t *req)
+{
+    null_terminated_array_t<char> envv(req->env);
+    int fd = -1;
+    if (clipboard_spawn_xsel(req->path.c_str(), true, envv.get(), &fd) == 0)
+        return 0;
+
+    bool ok = write_loop(fd, req->data.data(), req->data.size()) >= 0;
+    close(fd);
+    return ok;
+}
+
+static void clipboard_start_next();
+
+static void clipboard_write_done(clipboard_write_t *req, int ok)
+{
+    ASSERT_IS_MAIN_THREAD();
+    delete req;
+
+    clipboard_busy = false;
+    clipboard_start_next();
+}
+
+/**
+   Starts xsel for the waiting copy, unless it is still running for the
+   previous one.
+*/
+static void clipboard_start_next()
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (clipboard_busy || ! clipboard_write_pending)
+        return;
+
+    clipboard_write_t *req = new clipboard_write_t();
+    req->data.swap(clipboard_pending_write);
+    clipboard_write_pending = false;
+    req->path = wcs2string(xsel_path);
+    for (const char * const *var = env_export_arr(false); *var != NULL; var++)
+    {
+        req->env.push_back(*var);
+    }
+
+    clipboard_busy = true;
+    iothread_perform(clipboard_run_write, clipboard_write_done, req, iothread_priority_background);
+}
+
+/**
+   Reads the clipboard with xsel into \c out, waiting at most
+   CLIPBOARD_READ_TIMEOUT_MSEC for it. If xsel does not finish in time,
+   it is killed and false is returned.
+*/
+static bool clipboard_read(std::string *out)
+{
+    ASSERT_IS_MAIN_THREAD();
+    int fd = -1;
+    pid_t pid = clipboard_spawn_xsel(wcs2string(xsel_path).c_str(), false, env_export_arr(false), &fd);
+    if (pid == 0)
+        return false;
+
+    const double deadline = timef() + CLIPBOARD_READ_TIMEOUT_MSEC / 1000.0;
+    bool ok = false;
+    for (;;)
+    {
+        double left = deadline - timef();
+        if (left <= 0)
+            break;
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = (long)(left * 1000000);
+        int res = select(fd + 1, &fds, NULL, NULL, &tv);
+        if (res < 0 && errno != EINTR)
+            break;
+        if (res <= 0)
+            continue;
+
+        char buff[4096];
+        ssize_t amt = read(fd, buff, sizeof buff);
+        if (amt > 0)
+        {
+            out->append(buff, amt);
+        }
+        else if (amt == 0)
+        {
+            ok = true;
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+    close(fd);
+
+    /* Only the main thread reaps children, so xsel can not have been reaped yet and its pid is still ours */
+    if (! ok)
+        kill(pid, SIGKILL);
+    return ok;
+}
+
+#endif
+
+/**
+   Whether the X clipboard can be used through xsel
+*/
+static bool x_clipboard_available()
+{
+    return has_xsel() && ! env_get_string(L"DISPLAY").missing();
+}
+
+/**
+   Copy a kill to the X clipboard
+*/
+static void kill_copy_to_x_buffer(const wcstring &str)
+{
+    if (! x_clipboard_available())
+        return;
+
+#if FISH_USE_POSIX_SPAWN
+    clipboard_pending_write = wcs2string(str);
+    clipboard_write_pending = true;
+    clipboard_start_next();
+#else
+    wcstring cmd = L"echo -n ";
+    cmd.append(escape(str.c_str(), ESCAPE_ALL));
+    cmd.append(L" | xsel -i -b");
+    if (exec_subshell(cmd, false /* do not apply exit status */) == -1)
+    {
+        /*
+           Do nothing on failiure
+        */
+    }
+#endif
+}
+
+/**
+   Whether kills are sent to the terminal with the OSC 52 escape
+   sequence
+*/
+static bool osc52_enabled()
+{
+    const env_var_t var = env_get_string(L"fish_clipboard_osc52");
+    return ! var.missing_or_empty() && from_string<bool>(var);
+}
+
 void kill_add(const wcstring &str)
 {
     ASSERT_IS_MAIN_THREAD();
     if (str.empty())
         return;
 
-    wcstring cmd;
-    wcstring escaped_str;
     kill_list.push_front(str);
 
     /*
@@ -65,31 +423,10 @@ void kill_add(const wcstring &str)
     const env_var_t clipboard_wstr = env_get_string(L"FISH_CLIPBOARD_CMD");
     if (!clipboard_wstr.missing())
     {
-        escaped_str = escape(str.c_str(), ESCAPE_ALL);
-        cmd.assign(L"echo -n ");
+        wcstring escaped_str = escape(str.c_str(), ESCAPE_ALL);
+        wcstring cmd = L"echo -n ";
         cmd.append(escaped_str);
         cmd.append(clipboard_wstr);
-    }
-    else
-    {
-        /* This is for sending the kill to the X copy-and-paste buffer */
-        if (!has_xsel())
-        {
-            return;
-        }
-
-        const env_var_t disp_wstr = env_get_string(L"DISPLAY");
-        if (!disp_wstr.missing())
-        {
-            escaped_str = escape(str.c_str(), ESCAPE_ALL);
-            cmd.assign(L"echo -n ");
-            cmd.append(escaped_str);
-            cmd.append(L" | xsel -i -b");
-        }
-    }
-
-    if (! cmd.empty())
-    {
         if (exec_subshell(cmd, false /* do not apply exit status */) == -1)
         {
             /*
@@ -98,7 +435,22 @@ void kill_add(const wcstring &str)
         }
 
         cut_buffer = escaped_str;
+        return;
+    }
+
+    /* The terminal puts the text in the clipboard itself, so no process is needed */
+    if (osc52_enabled())
+    {
+        const std::string seq = kill_osc52_sequence(str);
+        write_loop(STDOUT_FILENO, seq.data(), seq.size());
+    }
+    else
+    {
+        kill_copy_to_x_buffer(str);
     }
+
+    /* What reading the clipboard back would give, so that it is not added to the killring twice */
+    cut_buffer = clipboard_kill_entry(str);
 }
 
 /**
@@ -138,45 +490,38 @@ const wchar_t *kill_yank_rotate()
 /**
    Check the X clipboard. If it has been changed, add the new
    clipboard contents to the fish killring.
+
+   With posix_spawn, the yank waits only a short time for xsel. While
+   one of our kills is still being copied, that kill is already at the
+   front of the killring and the clipboard is not read.
 */
 static void kill_check_x_buffer()
 {
-    if (!has_xsel())
+    if (! x_clipboard_available())
         return;
 
-    const env_var_t disp = env_get_string(L"DISPLAY");
-    if (! disp.missing())
+#if FISH_USE_POSIX_SPAWN
+    if (clipboard_busy || clipboard_write_pending)
+        return;
+
+    std::string contents;
+    if (clipboard_read(&contents))
+    {
+        kill_merge_clipboard(str2wcstring(contents));
+    }
+#else
+    wcstring_list_t list;
+    if (exec_subshell(L"xsel -t 500 -b", list, false /* do not apply exit status */) != -1)
     {
-        size_t i;
-        wcstring cmd = L"xsel -t 500 -b";
-        wcstring new_cut_buffer=L"";
-        wcstring_list_t list;
-        if (exec_subshell(cmd, list, false /* do not apply exit status */) != -1)
+        wcstring contents;
+        for (size_t i=0; i<list.size(); i++)
         {
-
-            for (i=0; i<list.size(); i++)
-            {
-                wcstring next_line = escape_string(list.at(i), 0);
-                if (i > 0) new_cut_buffer += L"\\n";
-                new_cut_buffer += next_line;
-            }
-
-            if (new_cut_buffer.size() > 0)
-            {
-                /*
-                  The buffer is inserted with backslash escapes,
-                  since we don't really like tabs, newlines,
-                  etc. anyway.
-                */
-
-                if (cut_buffer != new_cut_buffer)
-                {
-                    cut_buffer = new_cut_buffer;
-                    kill_list.push_front(new_cut_buffer);
-                }
-            }
+            if (i > 0) contents.push_back(L'\n');
+            contents.append(list.at(i));
         }
+        kill_merge_clipboard(contents);
     }
+#endif
 }
 
 
@@ -24,6 +24,9 @@ const wchar_t *kill_yank_rotate();
 /** Paste from the killring */
 const wchar_t *kill_yank();
 
+/** Returns the OSC 52 escape sequence that asks the terminal to put \c str in the clipboard */
+std::string kill_osc52_sequence(const wcstring &str);
+
 /** Sanity check */
 void kill_sanity_check();
 
@@ -8,21 +8,9 @@
 
 #include <assert.h>
 #include <wchar.h>
-#include <map>
-#include <set>
-#include <list>
+#include <vector>
 #include "common.h"
 
-/** A predicate to compare dereferenced pointers */
-struct dereference_less_t
-{
-    template <typename ptr_t>
-    bool operator()(ptr_t p1, ptr_t p2) const
-    {
-        return *p1 < *p2;
-    }
-};
-
 class lru_node_t
 {
     template<class T> friend class lru_cache_t;
@@ -30,21 +18,24 @@ class lru_node_t
     /** Our linked list pointer */
     lru_node_t *prev, *next;
 
+    /** The next node in our hash bucket */
+    lru_node_t *hash_next;
+
+    /** The hash of our key */
+    size_t key_hash;
+
+    /** Whether we are in the protected segment of a segmented cache */
+    bool is_protected;
+
 public:
     /** The key used to look up in the cache */
     const wcstring key;
 
     /** Constructor */
-    lru_node_t(const wcstring &pkey) : prev(NULL), next(NULL), key(pkey) { }
+    lru_node_t(const wcstring &pkey) : prev(NULL), next(NULL), hash_next(NULL), key_hash(0), is_protected(false), key(pkey) { }
 
     /** Virtual destructor that does nothing for classes that inherit lru_node_t */
     virtual ~lru_node_t() {}
-
-    /** operator< for std::set */
-    bool operator<(const lru_node_t &other) const
-    {
-        return key < other.key;
-    }
 };
 
 template<class node_type_t>
@@ -53,42 +44,143 @@ class lru_cache_t
 private:
 
     /** Max node count. This may be (transiently) exceeded by add_node_without_eviction, which is used from background threads. */
-    const size_t max_node_count;
+    size_t max_node_count;
 
     /** Count of nodes */
     size_t node_count;
 
-    /** The set of nodes */
-    typedef std::set<lru_node_t *, dereference_less_t> node_set_t;
-    node_set_t node_set;
+    /** Whether the cache is segmented. A segmented cache keeps nodes that have been used again after they were added in a protected segment, so that a run of nodes used only once cannot push them out. */
+    const bool segmented;
 
-    void promote_node(node_type_t *node)
+    /** Count of nodes in the protected segment */
+    size_t protected_count;
+
+    /** Count of nodes evicted to stay within max_node_count */
+    unsigned long eviction_count;
+
+    /** The nodes, indexed by the hash of their keys and chained through hash_next. The bucket count is a power of two, and at least the node count, so that chains stay short. */
+    std::vector<lru_node_t *> buckets;
+
+    /** FNV-1a, as in intern.cpp */
+    static size_t hash_key(const wcstring &key)
     {
-        /* We should never promote the mouth */
-        assert(node != &mouth);
+        size_t hash = 2166136261u;
+        for (size_t i=0; i < key.size(); i++)
+        {
+            hash ^= (size_t)key[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
 
-        /* First unhook us */
+    /** Returns the link that points to the node with the given key and hash, or to NULL at the end of its chain if there is none */
+    lru_node_t **find_link(const wcstring &key, size_t hash)
+    {
+        if (buckets.empty())
+            return NULL;
+        lru_node_t **link = &buckets[hash & (buckets.size() - 1)];
+        while (*link != NULL && ((*link)->key_hash != hash || (*link)->key != key))
+        {
+            link = &(*link)->hash_next;
+        }
+        return link;
+    }
+
+    /** Double the bucket count, and redistribute the nodes */
+    void grow_buckets(void)
+    {
+        std::vector<lru_node_t *> old_buckets(buckets.empty() ? 16 : buckets.size() * 2, NULL);
+        old_buckets.swap(buckets);
+        const size_t mask = buckets.size() - 1;
+        for (size_t i=0; i < old_buckets.size(); i++)
+        {
+            lru_node_t *node = old_buckets[i];
+            while (node != NULL)
+            {
+                lru_node_t *next = node->hash_next;
+                node->hash_next = buckets[node->key_hash & mask];
+                buckets[node->key_hash & mask] = node;
+                node = next;
+            }
+        }
+    }
+
+    /** The most nodes the protected segment may hold. The rest of the cache is kept for new nodes. */
+    size_t max_protected_count(void) const
+    {
+        return max_node_count - max_node_count / 5;
+    }
+
+    static void unlink_node(lru_node_t *node)
+    {
         node->prev->next = node->next;
         node->next->prev = node->prev;
+    }
 
-        /* Put us after the mouth */
-        node->next = mouth.next;
+    static void link_node_after(lru_node_t *node, lru_node_t *where)
+    {
+        node->next = where->next;
         node->next->prev = node;
-        node->prev = &mouth;
-        mouth.next = node;
+        node->prev = where;
+        where->next = node;
+    }
+
+    /** Demote the least recently used protected nodes until the protected segment fits */
+    void trim_protected_segment(void)
+    {
+        while (protected_count > max_protected_count())
+        {
+            lru_node_t *demoted = protected_mouth.prev;
+            unlink_node(demoted);
+            demoted->is_protected = false;
+            protected_count--;
+            link_node_after(demoted, &mouth);
+        }
+    }
+
+    void promote_node(node_type_t *node)
+    {
+        /* We should never promote the mouth */
+        assert(node != &mouth && node != &protected_mouth);
+
+        /* First unhook us */
+        unlink_node(node);
+
+        if (! segmented)
+        {
+            /* Put us after the mouth */
+            link_node_after(node, &mouth);
+            return;
+        }
+
+        /* We've been used again, so we belong in the protected segment */
+        if (! node->is_protected)
+        {
+            node->is_protected = true;
+            protected_count++;
+        }
+        link_node_after(node, &protected_mouth);
+        trim_protected_segment();
     }
 
     void evict_node(node_type_t *condemned_node)
     {
         /* We should never evict the mouth */
-        assert(condemned_node != NULL && condemned_node != &mouth);
+        assert(condemned_node != NULL && condemned_node != &mouth && condemned_node != &protected_mouth);
 
         /* Remove it from the linked list */
-        condemned_node->prev->next = condemned_node->next;
-        condemned_node->next->prev = condemned_node->prev;
+        unlink_node(condemned_node);
+        if (condemned_node->is_protected)
+        {
+            condemned_node->is_protected = false;
+            protected_count--;
+        }
 
-        /* Remove us from the set */
-        node_set.erase(condemned_node);
+        /* Remove us from our hash bucket */
+        lru_node_t **link = find_link(condemned_node->key, condemned_node->key_hash);
+        assert(link != NULL && *link == condemned_node);
+        *link = condemned_node->hash_next;
+        condemned_node->hash_next = NULL;
         node_count--;
 
         /* Tell ourselves */
@@ -97,13 +189,26 @@ private:
 
     void evict_last_node(void)
     {
-        /* Simple */
-        evict_node((node_type_t *)mouth.prev);
+        /* Evict new nodes first, and protected ones only if there are none */
+        lru_node_t *last = (mouth.prev != &mouth ? mouth.prev : protected_mouth.prev);
+        evict_node(static_cast<node_type_t *>(last));
+    }
+
+    /** Returns the node used next after the given one, walking the unprotected nodes before the protected ones */
+    lru_node_t *get_previous(lru_node_t *node)
+    {
+        node = node->prev;
+        return node == &mouth ? protected_mouth.prev : node;
     }
 
-    static lru_node_t *get_previous(lru_node_t *node)
+    /** Evict the least recently used nodes until we are within max_node_count */
+    void evict_excess_nodes(void)
     {
-        return node->prev;
+        while (node_count > max_node_count)
+        {
+            evict_last_node();
+            eviction_count++;
+        }
     }
 
 protected:
@@ -111,16 +216,20 @@ protected:
     /** Head of the linked list */
     lru_node_t mouth;
 
+    /** Head of the linked list of protected nodes. This is empty unless we are segmented. */
+    lru_node_t protected_mouth;
+
     /** Overridable callback for when a node is evicted */
     virtual void node_was_evicted(node_type_t *node) { }
 
 public:
 
     /** Constructor */
-    lru_cache_t(size_t max_size = 1024) : max_node_count(max_size), node_count(0), mouth(wcstring())
+    lru_cache_t(size_t max_size = 1024, bool segment = false) : max_node_count(max_size), node_count(0), segmented(segment), protected_count(0), eviction_count(0), mouth(wcstring()), protected_mouth(wcstring())
     {
-        /* Hook up the mouth to itself: a one node circularly linked list! */
+        /* Hook up the mouths to themselves: one node circularly linked lists! */
         mouth.prev = mouth.next = &mouth;
+        protected_mouth.prev = protected_mouth.next = &protected_mouth;
     }
 
     /** Note that we do not evict nodes in our destructor (even though they typically need to be deleted by their creator). */
@@ -130,36 +239,25 @@ public:
     /** Returns the node for a given key, or NULL */
     node_type_t *get_node(const wcstring &key)
     {
-        node_type_t *result = NULL;
-
-        /* Construct a fake node as our key */
-        lru_node_t node_key(key);
-
-        /* Look for it in the set */
-        node_set_t::iterator iter = node_set.find(&node_key);
+        lru_node_t **link = find_link(key, hash_key(key));
+        if (link == NULL || *link == NULL)
+            return NULL;
 
-        /* If we found a node, promote and return it */
-        if (iter != node_set.end())
-        {
-            result = static_cast<node_type_t*>(*iter);
-            promote_node(result);
-        }
+        /* We found a node, so promote and return it */
+        node_type_t *result = static_cast<node_type_t*>(*link);
+        promote_node(result);
         return result;
     }
 
     /** Evicts the node for a given key, returning true if a node was evicted. */
     bool evict_node(const wcstring &key)
     {
-        /* Construct a fake node as our key */
-        lru_node_t node_key(key);
-
-        /* Look for it in the set */
-        node_set_t::iterator iter = node_set.find(&node_key);
-        if (iter == node_set.end())
+        lru_node_t **link = find_link(key, hash_key(key));
+        if (link == NULL || *link == NULL)
             return false;
 
         /* Evict the given node */
-        evict_node(static_cast<node_type_t*>(*iter));
+        evict_node(static_cast<node_type_t*>(*link));
         return true;
     }
 
@@ -171,8 +269,7 @@ public:
             return false;
 
         /* Evict */
-        while (node_count > max_node_count)
-            evict_last_node();
+        evict_excess_nodes();
 
         /* Success */
         return true;
@@ -183,15 +280,22 @@ public:
     {
         assert(node != NULL && node != &mouth);
 
-        /* Try inserting; return false if it was already in the set */
-        if (! node_set.insert(node).second)
+        /* Try inserting; return false if a node with the key is already in the cache */
+        const size_t hash = hash_key(node->key);
+        lru_node_t **link = find_link(node->key, hash);
+        if (link != NULL && *link != NULL)
             return false;
+        if (node_count >= buckets.size())
+        {
+            grow_buckets();
+            link = find_link(node->key, hash);
+        }
+        node->key_hash = hash;
+        node->hash_next = NULL;
+        *link = node;
 
         /* Add the node after the mouth */
-        node->next = mouth.next;
-        node->next->prev = node;
-        node->prev = &mouth;
-        mouth.next = node;
+        link_node_after(node, &mouth);
 
         /* Update the count. This may push us over the maximum node count. */
         node_count++;
@@ -206,6 +310,26 @@ public:
         return node_count;
     }
 
+    /** Returns the max node count */
+    size_t capacity(void) const
+    {
+        return max_node_count;
+    }
+
+    /** Sets the max node count, evicting nodes if we have too many */
+    void set_capacity(size_t max_size)
+    {
+        max_node_count = max_size;
+        trim_protected_segment();
+        evict_excess_nodes();
+    }
+
+    /** Returns how many nodes we have evicted to stay within the max node count */
+    unsigned long evictions(void) const
+    {
+        return eviction_count;
+    }
+
     /** Evicts all nodes */
     void evict_all_nodes(void)
     {
@@ -218,16 +342,17 @@ public:
     /** Iterator for walking nodes, from least recently used to most */
     class iterator
     {
+        lru_cache_t *cache;
         lru_node_t *node;
     public:
-        iterator(lru_node_t *val) : node(val) { }
+        iterator(lru_cache_t *c, lru_node_t *val) : cache(c), node(val) { }
         void operator++()
         {
-            node = lru_cache_t::get_previous(node);
+            node = cache->get_previous(node);
         }
         void operator++(int x)
         {
-            node = lru_cache_t::get_previous(node);
+            node = cache->get_previous(node);
         }
         bool operator==(const iterator &other)
         {
@@ -245,11 +370,11 @@ public:
 
     iterator begin()
     {
-        return iterator(mouth.prev);
+        return iterator(this, mouth.prev != &mouth ? mouth.prev : protected_mouth.prev);
     }
     iterator end()
     {
-        return iterator(&mouth);
+        return iterator(this, &protected_mouth);
     }
 };
 
@@ -89,37 +89,76 @@ unsigned char index_for_color(rgb_color_t c)
 }
 
 
-static bool write_color_escape(char *todo, unsigned char idx, bool is_fg)
+/**
+   The escape sequences write_color_escape has produced for each color index, so that a repaint does not run tparm and tputs for every color change. There is one cache for the foreground and one for the background. Each remembers the terminfo string and color count it was made with, and is emptied when they change.
+*/
+struct color_escape_cache_t
 {
-    bool result = false;
-    if (idx < 16 || term256_support_is_native())
+    std::string capability;
+    int colors;
+    std::string escapes[256];
+    bool cached[256];
+
+    color_escape_cache_t() : colors(-1)
     {
-        /* Use tparm */
-        writembs(tparm(todo, idx));
-        result = true;
+        memset(cached, 0, sizeof cached);
     }
-    else
+};
+
+static color_escape_cache_t s_color_escape_caches[2];
+
+/** Writes the given bytes with the current writer */
+static void write_escape(const std::string &escape)
+{
+    int (*writer)(char) = output_get_writer();
+    if (writer)
     {
-        /* We are attempting to bypass the term here. Generate the ANSI escape sequence ourself. */
-        char stridx[128];
-        format_long_safe(stridx, idx);
-        char buff[128] = "\x1b[";
-        strcat(buff, is_fg ? "38;5;" : "48;5;");
-        strcat(buff, stridx);
-        strcat(buff, "m");
+        for (size_t i=0; i < escape.size(); i++)
+        {
+            writer(escape[i]);
+        }
+    }
+}
 
-        int (*writer)(char) = output_get_writer();
-        if (writer)
+static bool write_color_escape(char *todo, unsigned char idx, bool is_fg)
+{
+    color_escape_cache_t &cache = s_color_escape_caches[is_fg ? 0 : 1];
+    if (cache.colors != max_colors || cache.capability != todo)
+    {
+        cache.capability = todo;
+        cache.colors = max_colors;
+        memset(cache.cached, 0, sizeof cache.cached);
+    }
+
+    if (! cache.cached[idx])
+    {
+        if (idx < 16 || term256_support_is_native())
         {
-            for (size_t i=0; buff[i]; i++)
+            /* Use tparm. Sequences with padding need tputs, so they are not cached. */
+            const char *escape = tparm(todo, idx);
+            if (escape == NULL || strstr(escape, "$<") != NULL)
             {
-                writer(buff[i]);
+                writembs(tparm(todo, idx));
+                return true;
             }
+            cache.escapes[idx] = escape;
         }
-
-        result = true;
+        else
+        {
+            /* We are attempting to bypass the term here. Generate the ANSI escape sequence ourself. */
+            char stridx[128];
+            format_long_safe(stridx, idx);
+            char buff[128] = "\x1b[";
+            strcat(buff, is_fg ? "38;5;" : "48;5;");
+            strcat(buff, stridx);
+            strcat(buff, "m");
+            cache.escapes[idx] = buff;
+        }
+        cache.cached[idx] = true;
     }
-    return result;
+
+    write_escape(cache.escapes[idx]);
+    return true;
 }
 
 static bool write_foreground_color(unsigned char idx)
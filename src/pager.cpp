@@ -5,6 +5,7 @@
 #include <wctype.h>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include "util.h"
 #include "wutil.h" // IWYU pragma: keep - needed for wgettext
 #include "pager.h"
@@ -71,18 +72,19 @@ static int print_max(const wcstring &str, highlight_spec_t color, int max, bool
     for (size_t i=0; i < str.size(); i++)
     {
         wchar_t c = str.at(i);
+        int width = fish_wcwidth(c);
 
-        if (written + wcwidth(c) > max)
+        if (written + width > max)
             break;
-        if ((written + wcwidth(c) == max) && (has_more || i + 1 < str.size()))
+        if ((written + width == max) && (has_more || i + 1 < str.size()))
         {
             line->append(ellipsis_char, color);
-            written += wcwidth(ellipsis_char);
+            written += fish_wcwidth(ellipsis_char);
             break;
         }
 
         line->append(c, color);
-        written += wcwidth(c);
+        written += width;
     }
     return written;
 }
@@ -349,28 +351,51 @@ void pager_t::measure_completion_infos(comp_info_list_t *infos, const wcstring &
     recalc_min_widths(infos);
 }
 
-/* Indicates if the given completion info passes any filtering we have */
-bool pager_t::completion_info_passes_filter(const comp_t &info) const
+static wcstring lowercase_string(const wcstring &str)
 {
-    /* If we have no filter, everything passes */
-    if (! search_field_shown || this->search_field_line.empty())
-        return true;
+    wcstring result(str);
+    for (size_t i=0; i < result.size(); i++)
+    {
+        result[i] = towlower(result[i]);
+    }
+    return result;
+}
 
-    const wcstring &needle = this->search_field_line.text;
+/* Compute the strings the search field matches against */
+static void compute_filter_haystacks(comp_info_list_t *infos, const wcstring &prefix)
+{
+    for (size_t i=0; i < infos->size(); i++)
+    {
+        comp_t *comp = &infos->at(i);
+        comp->haystacks.clear();
+        comp->haystacks.reserve(comp->comp.size() + 1);
+        comp->haystacks.push_back(comp->desc);
+        for (size_t j=0; j < comp->comp.size(); j++)
+        {
+            comp->haystacks.push_back(prefix + comp->comp.at(j));
+        }
 
-    /* We do substring matching */
-    const fuzzy_match_type_t limit = fuzzy_match_substring;
+        comp->lowercase_haystacks.clear();
+        comp->lowercase_haystacks.reserve(comp->haystacks.size());
+        for (size_t j=0; j < comp->haystacks.size(); j++)
+        {
+            comp->lowercase_haystacks.push_back(lowercase_string(comp->haystacks.at(j)));
+        }
+    }
+}
 
-    /* Match against the description */
-    if (string_fuzzy_match_string(needle, info.desc, limit).type != fuzzy_match_none)
-    {
+/* Indicates if the given completion info passes any filtering we have */
+bool pager_t::completion_info_passes_filter(const comp_t &info, const wcstring &needle, const wcstring &lowercase_needle) const
+{
+    /* If we have no filter, everything passes */
+    if (needle.empty())
         return true;
-    }
 
-    /* Match against the completion strings */
-    for (size_t i=0; i < info.comp.size(); i++)
+    /* Match against the description and the completion strings. This is string_fuzzy_match_string up to fuzzy_match_substring: a substring match, or a case insensitive prefix match (which covers the exact and prefix matches) */
+    for (size_t i=0; i < info.haystacks.size(); i++)
     {
-        if (string_fuzzy_match_string(needle, prefix + info.comp.at(i), limit).type != fuzzy_match_none)
+        if (info.haystacks.at(i).find(needle) != wcstring::npos ||
+                string_prefixes_string(lowercase_needle, info.lowercase_haystacks.at(i)))
         {
             return true;
         }
@@ -383,15 +408,42 @@ bool pager_t::completion_info_passes_filter(const comp_t &info) const
 /* Update completion_infos from unfiltered_completion_infos, to reflect the filter */
 void pager_t::refilter_completions()
 {
-    this->completion_infos.clear();
-    for (size_t i=0; i < this->unfiltered_completion_infos.size(); i++)
+    const wcstring needle = search_field_shown ? this->search_field_line.text : wcstring();
+    const wcstring lowercase_needle = lowercase_string(needle);
+
+    /* Anything that passes a filter also passes the filters it extends, so as the user types we only need to look at what passed before. Other edits rescan the whole list. */
+    if (this->filter_valid && string_prefixes_string(this->filter_needle, needle))
     {
-        const comp_t &info = this->unfiltered_completion_infos.at(i);
-        if (this->completion_info_passes_filter(info))
+        if (needle.size() == this->filter_needle.size())
+            return;
+
+        size_t kept = 0;
+        for (size_t i=0; i < this->completion_infos.size(); i++)
         {
-            this->completion_infos.push_back(info);
+            if (this->completion_info_passes_filter(this->completion_infos.at(i), needle, lowercase_needle))
+            {
+                if (kept != i)
+                    std::swap(this->completion_infos.at(kept), this->completion_infos.at(i));
+                kept++;
+            }
         }
+        this->completion_infos.resize(kept);
     }
+    else
+    {
+        this->completion_infos.clear();
+        for (size_t i=0; i < this->unfiltered_completion_infos.size(); i++)
+        {
+            const comp_t &info = this->unfiltered_completion_infos.at(i);
+            if (this->completion_info_passes_filter(info, needle, lowercase_needle))
+            {
+                this->completion_infos.push_back(info);
+            }
+        }
+    }
+    this->filter_needle = needle;
+    this->filter_valid = true;
+    this->column_widths_cache.clear();
 }
 
 void pager_t::set_completions(const completion_list_t &raw_completions)
@@ -406,7 +458,11 @@ void pager_t::set_completions(const completion_list_t &raw_completions)
     // Compute their various widths
     measure_completion_infos(&unfiltered_completion_infos, prefix);
 
+    // Compute what the search field matches against
+    compute_filter_haystacks(&unfiltered_completion_infos, prefix);
+
     // Refilter them
+    this->filter_valid = false;
     this->refilter_completions();
 }
 
@@ -419,9 +475,49 @@ void pager_t::set_term_size(int w, int h)
 {
     assert(w > 0);
     assert(h > 0);
-    available_term_width = w;
+    /* We are told the size on every repaint, but minimum widths only depend on the width */
+    if (w != available_term_width)
+    {
+        available_term_width = w;
+        /* The unfiltered infos too, since a filter that is widened again copies from them */
+        recalc_min_widths(&unfiltered_completion_infos);
+        recalc_min_widths(&completion_infos);
+        column_widths_cache.clear();
+    }
     available_term_height = h;
-    recalc_min_widths(&completion_infos);
+}
+
+/* Returns the preferred and minimum widths of the columns when showing lst in cols columns of row_count rows */
+const pager_t::column_widths_t &pager_t::column_widths(size_t cols, size_t row_count, const comp_info_list_t &lst) const
+{
+    std::map<size_t, column_widths_t>::iterator iter = column_widths_cache.find(cols);
+    if (iter != column_widths_cache.end())
+        return iter->second;
+
+    column_widths_t &widths = column_widths_cache[cols];
+    widths.pref_width.resize(cols, 0);
+    widths.min_width.resize(cols, 0);
+    for (size_t col = 0; col < cols; col++)
+    {
+        for (size_t row = 0; row < row_count; row++)
+        {
+            if (lst.size() <= col*row_count + row)
+                break;
+
+            const comp_t *c = &lst.at(col*row_count + row);
+            int pref = c->pref_width;
+            int min = c->min_width;
+
+            if (col != cols-1)
+            {
+                pref += 2;
+                min += 2;
+            }
+            widths.min_width[col] = maxi(widths.min_width[col], min);
+            widths.pref_width[col] = maxi(widths.pref_width[col], pref);
+        }
+    }
+    return widths;
 }
 
 /**
@@ -484,29 +580,11 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
         return true;
 
     /* Calculate how wide the list would be */
-    for (long col = 0; col < cols; col++)
+    const column_widths_t &widths = this->column_widths(cols, row_count, lst);
+    for (size_t col = 0; col < cols; col++)
     {
-        for (long row = 0; row<row_count; row++)
-        {
-            int pref,min;
-            const comp_t *c;
-            if (lst.size() <= col*row_count + row)
-                continue;
-
-            c = &lst.at(col*row_count + row);
-            pref = c->pref_width;
-            min = c->min_width;
-
-            if (col != cols-1)
-            {
-                pref += 2;
-                min += 2;
-            }
-            min_width[col] = maxi(min_width[col],
-                                  min);
-            pref_width[col] = maxi(pref_width[col],
-                                   pref);
-        }
+        min_width[col] = widths.min_width.at(col);
+        pref_width[col] = widths.pref_width.at(col);
         min_tot_width += min_width[col];
         pref_tot_width += pref_width[col];
     }
@@ -663,7 +741,7 @@ void pager_t::update_rendering(page_rendering_t *rendering) const
     }
 }
 
-pager_t::pager_t() : available_term_width(0), available_term_height(0), selected_completion_idx(PAGER_SELECTION_NONE), suggested_row_start(0), fully_disclosed(false), search_field_shown(false)
+pager_t::pager_t() : available_term_width(0), available_term_height(0), selected_completion_idx(PAGER_SELECTION_NONE), suggested_row_start(0), fully_disclosed(false), search_field_shown(false), filter_valid(false)
 {
 }
 
@@ -963,6 +1041,9 @@ void pager_t::clear()
 {
     unfiltered_completion_infos.clear();
     completion_infos.clear();
+    column_widths_cache.clear();
+    filter_needle.clear();
+    filter_valid = false;
     prefix.clear();
     selected_completion_idx = PAGER_SELECTION_NONE;
     fully_disclosed = false;
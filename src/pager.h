@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <string>
 #include <vector>
+#include <map>
 #include "common.h"
 #include "complete.h"
 #include "screen.h"
@@ -86,7 +87,11 @@ public:
         /** Minimum acceptable width */
         int min_width;
 
-        comp_t() : comp(), desc(), representative(L""), comp_width(0), desc_width(0), pref_width(0), min_width(0)
+        /** The strings the search field is matched against (the description, then each completion string with the prefix), and their lowercase forms */
+        wcstring_list_t haystacks;
+        wcstring_list_t lowercase_haystacks;
+
+        comp_t() : comp(), desc(), representative(L""), comp_width(0), desc_width(0), pref_width(0), min_width(0), haystacks(), lowercase_haystacks()
         {
         }
     };
@@ -100,14 +105,30 @@ private:
     /* The unfiltered list. Note there's a lot of duplication here. */
     comp_info_list_t unfiltered_completion_infos;
 
+    /* The search field text that completion_infos was filtered with, if filter_valid is set */
+    wcstring filter_needle;
+    bool filter_valid;
+
     wcstring prefix;
 
+    /* The preferred and minimum width of each column, for some number of columns */
+    struct column_widths_t
+    {
+        std::vector<int> pref_width;
+        std::vector<int> min_width;
+    };
+
+    /* Column widths of the filtered completions by number of columns. Finding them visits every completion, and we render again on every change of selection, so they are kept until the completions or the terminal width change. */
+    mutable std::map<size_t, column_widths_t> column_widths_cache;
+
+    const column_widths_t &column_widths(size_t cols, size_t row_count, const comp_info_list_t &lst) const;
+
     bool completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst, page_rendering_t *rendering, size_t suggested_start_row) const;
 
     void recalc_min_widths(comp_info_list_t * lst) const;
     void measure_completion_infos(std::vector<comp_t> *infos, const wcstring &prefix) const;
 
-    bool completion_info_passes_filter(const comp_t &info) const;
+    bool completion_info_passes_filter(const comp_t &info, const wcstring &needle, const wcstring &lowercase_needle) const;
 
     void completion_print(size_t cols, int *width_per_column, size_t row_start, size_t row_stop, const wcstring &prefix, const comp_info_list_t &lst, page_rendering_t *rendering) const;
     line_t completion_print_item(const wcstring &prefix, const comp_t *c, size_t row, size_t column, int width, bool secondary, bool selected, page_rendering_t *rendering) const;
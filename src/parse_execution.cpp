@@ -17,8 +17,10 @@
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
+#include <map>
 #include <string>
 #include <memory> // IWYU pragma: keep - suggests <tr1/memory> instead
+#include <utility>
 #include <vector>
 #include "env.h"
 #include "event.h"
@@ -66,7 +68,7 @@ static wcstring profiling_cmd_name_for_redirectable_block(const parse_node_t &no
     return result;
 }
 
-parse_execution_context_t::parse_execution_context_t(const parse_node_tree_t &t, const wcstring &s, parser_t *p, int initial_eval_level) : tree(t), src(s), parser(p), eval_level(initial_eval_level), executing_node_idx(NODE_OFFSET_INVALID), cached_lineno_offset(0), cached_lineno_count(0)
+parse_execution_context_t::parse_execution_context_t(const shared_ptr<const parse_node_tree_t> &t, const wcstring &s, parser_t *p, int initial_eval_level) : tree_holder(t), tree(*t), src(s), parser(p), eval_level(initial_eval_level), executing_node_idx(NODE_OFFSET_INVALID), cached_lineno_offset(0), cached_lineno_count(0)
 {
 }
 
@@ -527,6 +529,150 @@ parse_execution_result_t parse_execution_context_t::run_for_statement(const pars
 }
 
 
+/**
+   The maximum number of switch statements whose compiled cases are cached.
+   When it is exceeded, the cache is emptied.
+*/
+#define SWITCH_CACHE_MAX_STATEMENTS 256
+
+/**
+   Returns whether expanding the given argument always produces the same
+   result: it has no variables, command substitutions, brace, home directory or
+   process expansions, and no unquoted wildcards, which match files.
+*/
+static bool case_argument_is_constant(const wcstring &arg)
+{
+    wchar_t quote = L'\0';
+    for (size_t i=0; i < arg.size(); i++)
+    {
+        const wchar_t c = arg.at(i);
+        if (c == L'\\')
+        {
+            /* Whatever is escaped, it is not expanded */
+            i++;
+        }
+        else if (quote != L'\0')
+        {
+            if (c == quote)
+                quote = L'\0';
+            else if (quote == L'"' && c == L'$')
+                return false;
+        }
+        else if (c == L'\'' || c == L'"')
+        {
+            quote = c;
+        }
+        else if (wcschr(L"$(){}*?", c) != NULL)
+        {
+            return false;
+        }
+        else if (i == 0 && (c == L'~' || c == L'%'))
+        {
+            return false;
+        }
+    }
+    return quote == L'\0';
+}
+
+/**
+   The cases of a switch statement, with the arguments that expand the same way
+   every time expanded once, ahead of time.
+*/
+struct compiled_switch_t
+{
+    struct case_t
+    {
+        /** The case_item node */
+        node_offset_t item;
+
+        /** Whether some argument must be expanded every time the switch runs. If so, the case has no patterns or literals, and is matched like before compiling. */
+        bool is_dynamic;
+
+        /** The arguments that contain wildcards */
+        std::vector<wildcard_pattern_t> patterns;
+    };
+
+    std::vector<case_t> cases;
+
+    /** The arguments without wildcards, mapped to the index of the first case that has them */
+    std::map<wcstring, size_t> literals;
+};
+
+/** A cache of compiled switch statements, keyed by their tree and node. Entries only watch their tree, so the cache does not keep trees alive: once a tree is freed, its entries are stale (its address may belong to a new tree) and are dropped. A running switch holds on to its compiled cases, since expanding an argument may run another switch, which may empty the cache. */
+struct switch_cache_entry_t
+{
+    weak_ptr<const parse_node_tree_t> tree;
+    shared_ptr<const compiled_switch_t> compiled;
+};
+typedef std::map<std::pair<const parse_node_tree_t *, node_offset_t>, switch_cache_entry_t> switch_cache_t;
+static switch_cache_t s_switch_cache;
+
+/* Drop the cache entries whose tree has been freed */
+static void switch_cache_remove_stale()
+{
+    switch_cache_t::iterator iter = s_switch_cache.begin();
+    while (iter != s_switch_cache.end())
+    {
+        if (iter->second.tree.expired())
+            s_switch_cache.erase(iter++);
+        else
+            ++iter;
+    }
+}
+
+/* Compile the cases of a switch statement in the given tree */
+static void compile_switch_cases(const parse_node_tree_t &tree, const wcstring &src, const parse_node_t &statement, compiled_switch_t *out)
+{
+    const parse_node_t *case_item_list = tree.get_child(statement, 3, symbol_case_item_list);
+    const parse_node_t *case_item;
+    while ((case_item = tree.next_node_in_node_list(*case_item_list, symbol_case_item, &case_item_list)) != NULL)
+    {
+        out->cases.push_back(compiled_switch_t::case_t());
+        compiled_switch_t::case_t &compiled = out->cases.back();
+        const size_t case_idx = out->cases.size() - 1;
+        compiled.item = static_cast<node_offset_t>(case_item - &tree.at(0));
+        compiled.is_dynamic = false;
+
+        /* Expand the arguments like run_switch_statement would, if they are constant */
+        std::vector<wildcard_pattern_t> patterns;
+        wcstring_list_t literals;
+        const parse_node_t &arg_list = *tree.get_child(*case_item, 1, symbol_argument_list);
+        const parse_node_tree_t::parse_node_list_t argument_nodes = tree.find_nodes(arg_list, symbol_argument);
+        for (size_t i=0; i < argument_nodes.size() && ! compiled.is_dynamic; i++)
+        {
+            const wcstring arg_str = argument_nodes.at(i)->get_source(src);
+            std::vector<completion_t> arg_expanded;
+            if (! case_argument_is_constant(arg_str) || expand_string(arg_str, &arg_expanded, EXPAND_NO_DESCRIPTIONS, NULL) != EXPAND_OK)
+            {
+                compiled.is_dynamic = true;
+                break;
+            }
+            for (size_t j=0; j < arg_expanded.size(); j++)
+            {
+                const wcstring unescaped_arg = parse_util_unescape_wildcards(arg_expanded.at(j).completion);
+                /* wildcard_match treats backslashes specially, so only match arguments without them by comparing strings */
+                if (wildcard_has(unescaped_arg, true) || unescaped_arg.find(L'\\') != wcstring::npos)
+                {
+                    patterns.push_back(wildcard_pattern_t(unescaped_arg));
+                }
+                else
+                {
+                    literals.push_back(unescaped_arg);
+                }
+            }
+        }
+
+        if (! compiled.is_dynamic)
+        {
+            compiled.patterns.swap(patterns);
+            for (size_t i=0; i < literals.size(); i++)
+            {
+                out->literals.insert(std::make_pair(literals.at(i), case_idx));
+            }
+        }
+    }
+}
+
 parse_execution_result_t parse_execution_context_t::run_switch_statement(const parse_node_t &statement)
 {
     assert(statement.type == symbol_switch_statement);
@@ -580,11 +726,33 @@ parse_execution_result_t parse_execution_context_t::run_switch_statement(const p
         parser->push_block(sb);
 
 
-        /* Expand case statements */
-        const parse_node_t *case_item_list = get_child(statement, 3, symbol_case_item_list);
+        /* Compile the case statements, or find them compiled by an earlier run of this switch */
+        const switch_cache_t::key_type cache_key(&tree, this->get_offset(statement));
+        switch_cache_t::iterator cached = s_switch_cache.find(cache_key);
+        if (cached == s_switch_cache.end() || cached->second.tree.expired())
+        {
+            switch_cache_remove_stale();
+            if (s_switch_cache.size() >= SWITCH_CACHE_MAX_STATEMENTS)
+                s_switch_cache.clear();
+            compiled_switch_t *new_compiled = new compiled_switch_t();
+            compile_switch_cases(tree, src, statement, new_compiled);
+            cached = s_switch_cache.insert(std::make_pair(cache_key, switch_cache_entry_t())).first;
+            cached->second.tree = tree_holder;
+            cached->second.compiled.reset(new_compiled);
+        }
+        const shared_ptr<const compiled_switch_t> compiled_holder = cached->second.compiled;
+        const compiled_switch_t &compiled = *compiled_holder;
+
+        /* A literal argument matches first, unless some case before it matches */
+        size_t case_count = compiled.cases.size();
+        const std::map<wcstring, size_t>::const_iterator literal = compiled.literals.find(switch_value_expanded);
+        if (literal != compiled.literals.end())
+        {
+            case_count = literal->second;
+        }
 
         /* Loop while we don't have a match but do have more of the list */
-        while (matching_case_item == NULL && case_item_list != NULL)
+        for (size_t case_idx = 0; matching_case_item == NULL && case_idx < case_count; case_idx++)
         {
             if (should_cancel_execution(sb))
             {
@@ -592,12 +760,19 @@ parse_execution_result_t parse_execution_context_t::run_switch_statement(const p
                 break;
             }
 
-            /* Get the next item and the remainder of the list */
-            const parse_node_t *case_item = tree.next_node_in_node_list(*case_item_list, symbol_case_item, &case_item_list);
-            if (case_item == NULL)
+            const compiled_switch_t::case_t &compiled_case = compiled.cases.at(case_idx);
+            const parse_node_t *case_item = &tree.at(compiled_case.item);
+            if (! compiled_case.is_dynamic)
             {
-                /* No more items */
-                break;
+                for (size_t i=0; i < compiled_case.patterns.size(); i++)
+                {
+                    if (compiled_case.patterns.at(i).match(switch_value_expanded))
+                    {
+                        matching_case_item = case_item;
+                        break;
+                    }
+                }
+                continue;
             }
 
             /* Pull out the argument list */
@@ -626,6 +801,11 @@ parse_execution_result_t parse_execution_context_t::run_switch_statement(const p
             }
         }
 
+        if (result == parse_execution_success && matching_case_item == NULL && case_count < compiled.cases.size())
+        {
+            matching_case_item = &tree.at(compiled.cases.at(case_count).item);
+        }
+
         if (result == parse_execution_success && matching_case_item != NULL)
         {
             /* Success, evaluate the job list */
@@ -912,8 +1092,13 @@ parse_execution_result_t parse_execution_context_t::populate_plain_process(job_t
     wcstring path_to_external_command;
     if (process_type == EXTERNAL || process_type == INTERNAL_EXEC)
     {
-        /* Determine the actual command. This may be an implicit cd. */
+        /* Determine the actual command. This may be an implicit cd. Commands the lookup cache has found are trusted, so that a loop running the same command does not stat all of $PATH on every pass. A command it has not found may have been installed just now, so look again before giving up on it. */
         bool has_command = path_get_path(cmd, &path_to_external_command);
+        if (! has_command)
+        {
+            path_cache_recheck();
+            has_command = path_get_path(cmd, &path_to_external_command);
+        }
 
         /* If there was no command, then we care about the value of errno after checking for it, to distinguish between e.g. no file vs permissions problem */
         const int no_cmd_err_code = errno;
@@ -980,6 +1165,32 @@ parse_execution_result_t parse_execution_context_t::populate_plain_process(job_t
     return parse_execution_success;
 }
 
+/* Whether the command substitutions of an argument list should be run at once, as asked for by fish_parallel_cmdsubst */
+static bool parallel_cmdsubst_enabled()
+{
+    const env_var_t var = env_get_string(L"fish_parallel_cmdsubst");
+    return ! var.missing_or_empty() && from_string<bool>(var);
+}
+
+/* Appends the command substitutions in the arguments to out, in the order expansion runs them. Nested substitutions are part of the one containing them. */
+static void get_argument_cmdsubsts(const parse_node_tree_t::parse_node_list_t &argument_nodes, const wcstring &src, wcstring_list_t *out)
+{
+    for (size_t i=0; i < argument_nodes.size(); i++)
+    {
+        const parse_node_t &arg_node = *argument_nodes.at(i);
+        if (wmemchr(src.c_str() + arg_node.source_start, L'(', arg_node.source_length) == NULL)
+            continue;
+
+        const wcstring arg_str = arg_node.get_source(src);
+        size_t cursor = 0, start, end;
+        wcstring contents;
+        while (parse_util_locate_cmdsubst_range(arg_str, &cursor, &contents, &start, &end, false) > 0)
+        {
+            out->push_back(contents);
+        }
+    }
+}
+
 /* Determine the list of arguments, expanding stuff. Reports any errors caused by expansion. If we have a wildcard that could not be expanded, report the error and continue. */
 parse_execution_result_t parse_execution_context_t::determine_arguments(const parse_node_t &parent, wcstring_list_t *out_arguments)
 {
@@ -989,6 +1200,16 @@ parse_execution_result_t parse_execution_context_t::determine_arguments(const pa
     /* Get all argument nodes underneath the statement. We guess we'll have that many arguments (but may have more or fewer, if there are wildcards involved) */
     const parse_node_tree_t::parse_node_list_t argument_nodes = tree.find_nodes(parent, symbol_argument);
     out_arguments->reserve(out_arguments->size() + argument_nodes.size());
+
+    /* If asked to, run the command substitutions of the arguments at once, so that their expansion below only collects their output */
+    std::auto_ptr<subshell_prefetch_t> prefetch;
+    wcstring_list_t cmdsubsts;
+    get_argument_cmdsubsts(argument_nodes, src, &cmdsubsts);
+    if (cmdsubsts.size() > 1 && parallel_cmdsubst_enabled())
+    {
+        prefetch.reset(new subshell_prefetch_t(cmdsubsts));
+    }
+
     for (size_t i=0; i < argument_nodes.size(); i++)
     {
         const parse_node_t &arg_node = *argument_nodes.at(i);
@@ -1324,6 +1545,10 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
     /* Save the node index */
     scoped_push<node_offset_t> saved_node_offset(&executing_node_idx, this->get_offset(job_node));
 
+    /* Streaming profiling support */
+    profile_stream_t &profile_stream = parser->stream_profiler();
+    scoped_profile_frame_t profile_frame(profile_stream, profile_stream.active() ? parser->profile_location() : wcstring(), false);
+
     /* Profiling support */
     long long start_time = 0, parse_time = 0, exec_time = 0;
     profile_item_t *profile_item = this->parser->create_profile_item();
@@ -34,7 +34,9 @@ enum parse_execution_result_t
 class parse_execution_context_t
 {
 private:
-    const parse_node_tree_t tree;
+    /* The tree is shared, so that e.g. a function's parsed definition can be executed repeatedly without copying it */
+    const shared_ptr<const parse_node_tree_t> tree_holder;
+    const parse_node_tree_t &tree;
     const wcstring src;
     io_chain_t block_io;
     parser_t * const parser;
@@ -116,7 +118,7 @@ private:
     int line_offset_of_character_at_offset(size_t char_idx);
 
 public:
-    parse_execution_context_t(const parse_node_tree_t &t, const wcstring &s, parser_t *p, int initial_eval_level);
+    parse_execution_context_t(const shared_ptr<const parse_node_tree_t> &t, const wcstring &s, parser_t *p, int initial_eval_level);
 
     /* Returns the current eval level */
     int current_eval_level() const
@@ -481,7 +481,89 @@ PRODUCTIONS(end_command) =
 };
 RESOLVE_ONLY(end_command)
 
-#define TEST(sym) case (symbol_##sym): production_list = & productions_ ## sym ; resolver = resolve_ ## sym ; break;
+typedef production_option_idx_t (*resolver_t)(const parse_token_t &input1, const parse_token_t &input2);
+
+/* How each symbol picks its production. Most symbols look at nothing but the type and keyword of the first token; for those the choice is precomputed into s_production_table below. The rest also look at the second token (e.g. 'function -h' or 'command --help') and must call their resolver. */
+struct symbol_productions_t
+{
+    parse_token_type_t symbol;
+    const production_options_t *productions;
+    resolver_t resolver;
+    bool needs_token2;
+};
+
+#define SYMBOL(sym, needs_token2) { symbol_##sym, &productions_##sym, resolve_##sym, needs_token2 }
+
+/* Indexed by symbol, so this must be kept in the order of parse_token_type_t */
+static const symbol_productions_t s_symbol_productions[] =
+{
+    SYMBOL(job_list, false),
+    SYMBOL(job, false),
+    SYMBOL(job_continuation, false),
+    SYMBOL(statement, true),
+    SYMBOL(block_statement, false),
+    SYMBOL(block_header, false),
+    SYMBOL(for_header, false),
+    SYMBOL(while_header, false),
+    SYMBOL(begin_header, false),
+    SYMBOL(function_header, false),
+    SYMBOL(if_statement, false),
+    SYMBOL(if_clause, false),
+    SYMBOL(else_clause, false),
+    SYMBOL(else_continuation, false),
+    SYMBOL(switch_statement, false),
+    SYMBOL(case_item_list, false),
+    SYMBOL(case_item, false),
+    SYMBOL(boolean_statement, false),
+    SYMBOL(decorated_statement, true),
+    SYMBOL(plain_statement, false),
+    SYMBOL(arguments_or_redirections_list, false),
+    SYMBOL(argument_or_redirection, false),
+    SYMBOL(argument_list, false),
+    SYMBOL(freestanding_argument_list, false),
+    SYMBOL(argument, false),
+    SYMBOL(redirection, false),
+    SYMBOL(optional_background, false),
+    SYMBOL(end_command, false)
+};
+
+#define FIRST_SYMBOL symbol_job_list
+#define SYMBOL_COUNT (sizeof s_symbol_productions / sizeof *s_symbol_productions)
+#define TERMINAL_COUNT (LAST_TERMINAL_TYPE - FIRST_TERMINAL_TYPE + 1)
+#define KEYWORD_COUNT (LAST_KEYWORD + 1)
+
+/* The production chosen by each symbol for each (token type, keyword) of the first token. Entries for symbols that need the second token are unused. */
+static production_option_idx_t s_production_table[SYMBOL_COUNT][TERMINAL_COUNT][KEYWORD_COUNT];
+
+/* Fills in s_production_table from the resolvers, which remain the description of the grammar. This runs during static initialization, before any thread can parse. */
+static struct production_table_builder_t
+{
+    production_table_builder_t()
+    {
+        const parse_token_t no_token = {token_type_invalid, parse_keyword_none, false, false, 0, 0};
+        for (size_t sym = 0; sym < SYMBOL_COUNT; sym++)
+        {
+            const symbol_productions_t &entry = s_symbol_productions[sym];
+            assert(entry.symbol == FIRST_SYMBOL + sym);
+            for (size_t type = 0; type < TERMINAL_COUNT; type++)
+            {
+                for (size_t keyword = 0; keyword < KEYWORD_COUNT; keyword++)
+                {
+                    production_option_idx_t which = NO_PRODUCTION;
+                    if (! entry.needs_token2)
+                    {
+                        parse_token_t token1 = no_token;
+                        token1.type = static_cast<parse_token_type_t>(FIRST_TERMINAL_TYPE + type);
+                        token1.keyword = static_cast<parse_keyword_t>(keyword);
+                        which = entry.resolver(token1, no_token);
+                    }
+                    s_production_table[sym][type][keyword] = which;
+                }
+            }
+        }
+    }
+} s_production_table_builder;
+
 const production_t *parse_productions::production_for_token(parse_token_type_t node_type, const parse_token_t &input1, const parse_token_t &input2, production_option_idx_t *out_which_production, wcstring *out_error_text)
 {
     const bool log_it = false;
@@ -490,76 +572,33 @@ const production_t *parse_productions::production_for_token(parse_token_type_t n
         fprintf(stderr, "Resolving production for %ls with input token <%ls>\n", token_type_description(node_type).c_str(), input1.describe().c_str());
     }
 
-    /* Fetch the list of productions and the function to resolve them */
-    const production_options_t *production_list = NULL;
-    production_option_idx_t (*resolver)(const parse_token_t &input1, const parse_token_t &input2) = NULL;
-    switch (node_type)
+    /* Only symbols have productions */
+    if (node_type < FIRST_SYMBOL || node_type >= FIRST_SYMBOL + SYMBOL_COUNT)
     {
-            TEST(job_list)
-            TEST(job)
-            TEST(statement)
-            TEST(job_continuation)
-            TEST(boolean_statement)
-            TEST(block_statement)
-            TEST(if_statement)
-            TEST(if_clause)
-            TEST(else_clause)
-            TEST(else_continuation)
-            TEST(switch_statement)
-            TEST(decorated_statement)
-            TEST(case_item_list)
-            TEST(case_item)
-            TEST(argument_list)
-            TEST(freestanding_argument_list)
-            TEST(block_header)
-            TEST(for_header)
-            TEST(while_header)
-            TEST(begin_header)
-            TEST(function_header)
-            TEST(plain_statement)
-            TEST(arguments_or_redirections_list)
-            TEST(argument_or_redirection)
-            TEST(argument)
-            TEST(redirection)
-            TEST(optional_background)
-            TEST(end_command)
-
-        case parse_token_type_string:
-        case parse_token_type_pipe:
-        case parse_token_type_redirection:
-        case parse_token_type_background:
-        case parse_token_type_end:
-        case parse_token_type_terminate:
-            fprintf(stderr, "Terminal token type %ls passed to %s\n", token_type_description(node_type).c_str(), __FUNCTION__);
-            PARSER_DIE();
-            break;
-
-        case parse_special_type_parse_error:
-        case parse_special_type_tokenizer_error:
-        case parse_special_type_comment:
-            fprintf(stderr, "Special type %ls passed to %s\n", token_type_description(node_type).c_str(), __FUNCTION__);
-            PARSER_DIE();
-            break;
-
-
-        case token_type_invalid:
-            fprintf(stderr, "token_type_invalid passed to %s\n", __FUNCTION__);
-            PARSER_DIE();
-            break;
-
+        fprintf(stderr, "Non-symbol type %ls passed to %s\n", token_type_description(node_type).c_str(), __FUNCTION__);
+        PARSER_DIE();
     }
-    PARSE_ASSERT(production_list != NULL);
-    PARSE_ASSERT(resolver != NULL);
+    PARSE_ASSERT(input1.type >= FIRST_TERMINAL_TYPE && input1.type <= LAST_TERMINAL_TYPE);
+    PARSE_ASSERT(input1.keyword <= LAST_KEYWORD);
 
-    const production_t *result = NULL;
-    production_option_idx_t which = resolver(input1, input2);
+    const size_t sym = node_type - FIRST_SYMBOL;
+    const symbol_productions_t &entry = s_symbol_productions[sym];
+    production_option_idx_t which;
+    if (entry.needs_token2)
+    {
+        which = entry.resolver(input1, input2);
+    }
+    else
+    {
+        which = s_production_table[sym][input1.type - FIRST_TERMINAL_TYPE][input1.keyword];
+    }
 
     if (log_it)
     {
         fprintf(stderr, "\tresolved to %u\n", (unsigned)which);
     }
 
-
+    const production_t *result = NULL;
     if (which == NO_PRODUCTION)
     {
         if (log_it)
@@ -570,10 +609,9 @@ const production_t *parse_productions::production_for_token(parse_token_type_t n
     }
     else
     {
-        PARSE_ASSERT(production_is_valid(*production_list, which));
-        result = &((*production_list)[which]);
+        PARSE_ASSERT(production_is_valid(*entry.productions, which));
+        result = &((*entry.productions)[which]);
     }
     *out_which_production = which;
     return result;
 }
-
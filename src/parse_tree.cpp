@@ -513,6 +513,12 @@ struct parse_stack_element_t
     }
 };
 
+/* Estimate the number of nodes parsing some source will produce, from its length. The functions and completions we ship produce about one node for every two characters. */
+static size_t estimated_node_count(size_t source_length)
+{
+    return 64 + source_length / 2;
+}
+
 /* The parser itself, private implementation of class parse_t. This is a hand-coded table-driven LL parser. Most hand-coded LL parsers are recursive descent, but recursive descent parsers are difficult to "pause", unlike table-driven parsers. */
 class parse_ll_t
 {
@@ -629,11 +635,11 @@ class parse_ll_t
 
 public:
 
-    /* Constructor */
-    parse_ll_t(enum parse_token_type_t goal) : fatal_errored(false), should_generate_error_messages(true)
+    /* Constructor. The source length is used to estimate how many nodes we will produce, so that the node storage is allocated once. */
+    parse_ll_t(enum parse_token_type_t goal, size_t source_length) : fatal_errored(false), should_generate_error_messages(true)
     {
         this->symbol_stack.reserve(16);
-        this->nodes.reserve(64);
+        this->nodes.reserve(estimated_node_count(source_length));
         this->reset_symbols_and_nodes(goal);
     }
 
@@ -1211,8 +1217,8 @@ static parse_keyword_t keyword_with_name(const wchar_t *name)
     return result;
 }
 
-/* Given a token, returns the keyword it matches, or parse_keyword_none. */
-static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
+/* Given a token and its text (which need not be nul-terminated), returns the keyword it matches, or parse_keyword_none. */
+static parse_keyword_t keyword_for_token(token_type tok, const wchar_t *tok_txt, size_t tok_len)
 {
     /* Only strings can be keywords */
     if (tok != TOK_STRING)
@@ -1223,9 +1229,8 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
     /* If tok_txt is clean (which most are), we can compare it directly. Otherwise we have to expand it. We only expand quotes, and we don't want to do expensive expansions like tilde expansions. So we do our own "cleanliness" check; if we find a character not in our allowed set we know it's not a keyword, and if we never find a quote we don't have to expand! Note that this lowercase set could be shrunk to be just the characters that are in keywords. */
     parse_keyword_t result = parse_keyword_none;
     bool needs_expand = false, all_chars_valid = true;
-    const wchar_t *tok_txt = token.c_str();
     const wchar_t *chars_allowed_in_keywords = L"abcdefghijklmnopqrstuvwxyz'\"";
-    for (size_t i=0; tok_txt[i] != L'\0'; i++)
+    for (size_t i=0; i < tok_len; i++)
     {
         wchar_t c = tok_txt[i];
         if (! wcschr(chars_allowed_in_keywords, c))
@@ -1242,12 +1247,19 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
         /* Expand if necessary */
         if (! needs_expand)
         {
-            result = keyword_with_name(tok_txt);
+            /* The text is a slice of the source, so terminate a copy of it. Anything too long for the buffer is not a keyword. */
+            wchar_t name[16];
+            if (tok_len < sizeof name / sizeof *name)
+            {
+                wmemcpy(name, tok_txt, tok_len);
+                name[tok_len] = L'\0';
+                result = keyword_with_name(name);
+            }
         }
         else
         {
             wcstring storage;
-            if (unescape_string(tok_txt, &storage, 0))
+            if (unescape_string(wcstring(tok_txt, tok_len), &storage, 0))
             {
                 result = keyword_with_name(storage.c_str());
             }
@@ -1262,13 +1274,13 @@ static const parse_token_t kInvalidToken = {token_type_invalid, parse_keyword_no
 /* Terminal token */
 static const parse_token_t kTerminalToken = {parse_token_type_terminate, parse_keyword_none, false, false, SOURCE_OFFSET_INVALID, 0};
 
-static inline bool is_help_argument(const wcstring &txt)
+static inline bool is_help_argument(const wchar_t *txt, size_t len)
 {
-    return contains(txt, L"-h", L"--help");
+    return (len == 2 && ! wcsncmp(txt, L"-h", 2)) || (len == 6 && ! wcsncmp(txt, L"--help", 6));
 }
 
-/* Return a new parse token, advancing the tokenizer */
-static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token)
+/* Return a new parse token, advancing the tokenizer. The tokenizer leaves the text of strings in the source, so we look at them there. */
+static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token, const wcstring &source)
 {
     if (! tok->next(token))
     {
@@ -1278,10 +1290,17 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token)
     parse_token_t result;
 
     /* Set the type, keyword, and whether there's a dash prefix. Note that this is quite sketchy, because it ignores quotes. This is the historical behavior. For example, `builtin --names` lists builtins, but `builtin "--names"` attempts to run --names as a command. Amazingly as of this writing (10/12/13) nobody seems to have noticed this. Squint at it really hard and it even starts to look like a feature. */
+    const wchar_t *txt = token->text.c_str();
+    size_t txt_len = token->text.size();
+    if (token->type == TOK_STRING)
+    {
+        txt = source.c_str() + token->offset;
+        txt_len = token->length;
+    }
     result.type = parse_token_type_from_tokenizer_token(token->type);
-    result.keyword = keyword_for_token(token->type, token->text);
-    result.has_dash_prefix = !token->text.empty() && token->text.at(0) == L'-';
-    result.is_help_argument = result.has_dash_prefix && is_help_argument(token->text);
+    result.keyword = keyword_for_token(token->type, txt, txt_len);
+    result.has_dash_prefix = txt_len > 0 && txt[0] == L'-';
+    result.is_help_argument = result.has_dash_prefix && is_help_argument(txt, txt_len);
     
     /* These assertions are totally bogus. Basically our tokenizer works in size_t but we work in uint32_t to save some space. If we have a source file larger than 4 GB, we'll probably just crash. */
     assert(token->offset < SOURCE_OFFSET_INVALID);
@@ -1295,7 +1314,7 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token)
 
 bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags, parse_node_tree_t *output, parse_error_list_t *errors, parse_token_type_t goal)
 {
-    parse_ll_t parser(goal);
+    parse_ll_t parser(goal, str.size());
     parser.set_should_generate_error_messages(errors != NULL);
 
     /* Construct the tokenizer */
@@ -1323,7 +1342,7 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
     {
         /* Push a new token onto the queue */
         queue[0] = queue[1];
-        queue[1] = next_parse_token(&tok, &tokenizer_token);
+        queue[1] = next_parse_token(&tok, &tokenizer_token, str);
 
         /* If we are leaving things unterminated, then don't pass parse_token_type_terminate */
         if (queue[0].type == parse_token_type_terminate && (parse_flags & parse_flag_leave_unterminated))
@@ -279,11 +279,65 @@ int parse_util_locate_cmdsubst_range(const wcstring &str, size_t *inout_cursor_o
     return parse_util_locate_brackets_range(str, inout_cursor_offset, out_contents, out_start, out_end, accept_incomplete, L'(', L')');
 }
 
-void parse_util_cmdsubst_extent(const wchar_t *buff, size_t cursor_pos, const wchar_t **a, const wchar_t **b)
+/* Kinds of extent queries remembered by the extent memo */
+enum extent_kind_t
 {
-    const wchar_t * const cursor = buff + cursor_pos;
+    extent_cmdsubst,
+    extent_process,
+    extent_job,
+    extent_token,
+    extent_kind_count
+};
+
+/* The number of pointers an extent query produces; token extents have the most */
+#define EXTENT_MAX_RESULTS 4
+
+/* The most recent query of one kind. The reader, the completion machinery and the commandline builtin ask for extents around the same cursor of the same command line several times per keystroke (token_extent itself starts from cmdsubst_extent), and each query scans the buffer from the start. The memo is keyed on the contents of the buffer and the cursor, so any edit of the command line invalidates it. Results are stored as offsets into the buffer so they can be handed out relative to whichever copy of it the caller has. */
+struct extent_memo_t
+{
+    bool valid;
+    wcstring buff;
+    size_t cursor_pos;
+    long results[EXTENT_MAX_RESULTS]; /* offsets, or -1 for NULL */
+};
 
-    CHECK(buff,);
+static extent_memo_t s_extent_memo[extent_kind_count];
+
+/* Completions are computed off the main thread too */
+static pthread_mutex_t s_extent_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Looks for a memoized query. On success, sets the result pointers (relative to buff) and returns true */
+static bool extent_memo_get(extent_kind_t kind, const wchar_t *buff, size_t bufflen, size_t cursor_pos, const wchar_t **results, size_t result_count)
+{
+    scoped_lock lock(s_extent_memo_lock);
+    const extent_memo_t &memo = s_extent_memo[kind];
+    if (! memo.valid || memo.cursor_pos != cursor_pos || memo.buff.size() != bufflen || wmemcmp(memo.buff.data(), buff, bufflen) != 0)
+    {
+        return false;
+    }
+    for (size_t i=0; i < result_count; i++)
+    {
+        results[i] = memo.results[i] < 0 ? NULL : buff + memo.results[i];
+    }
+    return true;
+}
+
+static void extent_memo_set(extent_kind_t kind, const wchar_t *buff, size_t bufflen, size_t cursor_pos, const wchar_t * const *results, size_t result_count)
+{
+    scoped_lock lock(s_extent_memo_lock);
+    extent_memo_t &memo = s_extent_memo[kind];
+    memo.valid = true;
+    memo.buff.assign(buff, bufflen);
+    memo.cursor_pos = cursor_pos;
+    for (size_t i=0; i < result_count; i++)
+    {
+        memo.results[i] = results[i] ? results[i] - buff : -1;
+    }
+}
+
+static void compute_cmdsubst_extent(const wchar_t *buff, size_t cursor_pos, const wchar_t **a, const wchar_t **b)
+{
+    const wchar_t * const cursor = buff + cursor_pos;
 
     const size_t bufflen = wcslen(buff);
     assert(cursor_pos <= bufflen);
@@ -334,6 +388,22 @@ void parse_util_cmdsubst_extent(const wchar_t *buff, size_t cursor_pos, const wc
     if (b != NULL) *b = bp;
 }
 
+void parse_util_cmdsubst_extent(const wchar_t *buff, size_t cursor_pos, const wchar_t **a, const wchar_t **b)
+{
+    CHECK(buff,);
+
+    const size_t bufflen = wcslen(buff);
+    const wchar_t *results[2];
+    if (! extent_memo_get(extent_cmdsubst, buff, bufflen, cursor_pos, results, 2))
+    {
+        compute_cmdsubst_extent(buff, cursor_pos, &results[0], &results[1]);
+        extent_memo_set(extent_cmdsubst, buff, bufflen, cursor_pos, results, 2);
+    }
+
+    if (a != NULL) *a = results[0];
+    if (b != NULL) *b = results[1];
+}
+
 /**
    Get the beginning and end of the job or process definition under the cursor
 */
@@ -434,12 +504,34 @@ static void job_or_process_extent(const wchar_t *buff,
     free(buffcpy);
 }
 
+/* Memoized job_or_process_extent */
+static void memoized_job_or_process_extent(const wchar_t *buff,
+                                           size_t pos,
+                                           const wchar_t **a,
+                                           const wchar_t **b,
+                                           int process)
+{
+    CHECK(buff,);
+
+    const extent_kind_t kind = process ? extent_process : extent_job;
+    const size_t bufflen = wcslen(buff);
+    const wchar_t *results[2];
+    if (! extent_memo_get(kind, buff, bufflen, pos, results, 2))
+    {
+        job_or_process_extent(buff, pos, &results[0], &results[1], process);
+        extent_memo_set(kind, buff, bufflen, pos, results, 2);
+    }
+
+    if (a) *a = results[0];
+    if (b) *b = results[1];
+}
+
 void parse_util_process_extent(const wchar_t *buff,
                                size_t pos,
                                const wchar_t **a,
                                const wchar_t **b)
 {
-    job_or_process_extent(buff, pos, a, b, 1);
+    memoized_job_or_process_extent(buff, pos, a, b, 1);
 }
 
 void parse_util_job_extent(const wchar_t *buff,
@@ -447,16 +539,16 @@ void parse_util_job_extent(const wchar_t *buff,
                            const wchar_t **a,
                            const wchar_t **b)
 {
-    job_or_process_extent(buff,pos,a, b, 0);
+    memoized_job_or_process_extent(buff, pos, a, b, 0);
 }
 
 
-void parse_util_token_extent(const wchar_t *buff,
-                             size_t cursor_pos,
-                             const wchar_t **tok_begin,
-                             const wchar_t **tok_end,
-                             const wchar_t **prev_begin,
-                             const wchar_t **prev_end)
+static void compute_token_extent(const wchar_t *buff,
+                                 size_t cursor_pos,
+                                 const wchar_t **tok_begin,
+                                 const wchar_t **tok_end,
+                                 const wchar_t **prev_begin,
+                                 const wchar_t **prev_end)
 {
     const wchar_t *a = NULL, *b = NULL, *pa = NULL, *pb = NULL;
 
@@ -499,7 +591,7 @@ void parse_util_token_extent(const wchar_t *buff,
         */
         if (token.type == TOK_STRING)
         {
-            tok_end += token.text.size();
+            tok_end += token.length;
         }
 
         /*
@@ -520,7 +612,7 @@ void parse_util_token_extent(const wchar_t *buff,
         if (token.type == TOK_STRING && tok_end >= offset_within_cmdsubst)
         {
             a = cmdsubst_begin + token.offset;
-            b = a + token.text.size();
+            b = a + token.length;
             break;
         }
 
@@ -530,7 +622,7 @@ void parse_util_token_extent(const wchar_t *buff,
         if (token.type == TOK_STRING)
         {
             pa = cmdsubst_begin + token.offset;
-            pb = pa + token.text.size();
+            pb = pa + token.length;
         }
     }
 
@@ -561,6 +653,29 @@ void parse_util_token_extent(const wchar_t *buff,
 
 }
 
+void parse_util_token_extent(const wchar_t *buff,
+                             size_t cursor_pos,
+                             const wchar_t **tok_begin,
+                             const wchar_t **tok_end,
+                             const wchar_t **prev_begin,
+                             const wchar_t **prev_end)
+{
+    CHECK(buff,);
+
+    const size_t bufflen = wcslen(buff);
+    const wchar_t *results[4] = {NULL, NULL, NULL, NULL};
+    if (! extent_memo_get(extent_token, buff, bufflen, cursor_pos, results, 4))
+    {
+        compute_token_extent(buff, cursor_pos, &results[0], &results[1], &results[2], &results[3]);
+        extent_memo_set(extent_token, buff, bufflen, cursor_pos, results, 4);
+    }
+
+    if (tok_begin) *tok_begin = results[0];
+    if (tok_end) *tok_end = results[1];
+    if (prev_begin) *prev_begin = results[2];
+    if (prev_end) *prev_end = results[3];
+}
+
 wcstring parse_util_unescape_wildcards(const wcstring &str)
 {
     wcstring result;
@@ -599,24 +714,23 @@ wcstring parse_util_unescape_wildcards(const wcstring &str)
 
 /**
    Find the outermost quoting style of current token. Returns 0 if
-   token is not quoted.
+   token is not quoted. The token is the cmd_len characters at cmd.
 
 */
-static wchar_t get_quote(const wcstring &cmd_str, size_t len)
+static wchar_t get_quote(const wchar_t *cmd, size_t cmd_len, size_t len)
 {
     size_t i=0;
     wchar_t res=0;
-    const wchar_t * const cmd = cmd_str.c_str();
 
     while (1)
     {
-        if (!cmd[i])
+        if (i >= cmd_len || !cmd[i])
             break;
 
         if (cmd[i] == L'\\')
         {
             i++;
-            if (!cmd[i])
+            if (i >= cmd_len || !cmd[i])
                 break;
             i++;
         }
@@ -655,7 +769,7 @@ void parse_util_get_parameter_info(const wcstring &cmd, const size_t pos, wchar_
             break;
 
         if (token.type == TOK_STRING)
-            last_quote = get_quote(token.text, pos - token.offset);
+            last_quote = get_quote(cmd.c_str() + token.offset, token.length, pos - token.offset);
 
         if (out_type != NULL)
             *out_type = token.type;
@@ -1287,7 +1401,7 @@ parser_test_error_bits_t parse_util_detect_errors_in_argument(const parse_node_t
     return err;
 }
 
-parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src, parse_error_list_t *out_errors, bool allow_incomplete)
+parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src, parse_error_list_t *out_errors, bool allow_incomplete, parse_node_tree_t *out_tree)
 {
     parse_node_tree_t node_tree;
     parse_error_list_t parse_errors;
@@ -1551,6 +1665,11 @@ parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src, pars
         out_errors->swap(parse_errors);
     }
 
+    if (out_tree && res == 0)
+    {
+        out_tree->swap(node_tree);
+    }
+
     return res;
 
 }
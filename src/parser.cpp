@@ -7,6 +7,8 @@ The fish parser. Contains functions for parsing and evaluating code.
 #include "config.h" // IWYU pragma: keep
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <assert.h>
 #include <string>
@@ -15,6 +17,7 @@ The fish parser. Contains functions for parsing and evaluating code.
 #include "fallback.h"
 #include "common.h"
 #include "wutil.h"
+#include "util.h"
 #include "proc.h"
 #include "parser.h"
 #include "function.h"
@@ -467,6 +470,190 @@ void parser_t::emit_profiling(const char *path) const
     }
 }
 
+/* How often a streaming profile is rewritten, in microseconds */
+static const long long kProfileStreamWriteInterval = 1000000;
+
+profile_stream_t::profile_stream_t() : folded(false), is_active(false), generation(0), last_write_time(0)
+{
+}
+
+bool profile_stream_t::start(const wcstring &new_path, bool new_folded)
+{
+    /* Make sure we can write the file before we claim to be profiling */
+    int fd = wopen_cloexec(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    close(fd);
+
+    frames.clear();
+    function_stats.clear();
+    line_stats.clear();
+    folded_stats.clear();
+    /* The file is rewritten until profiling stops, and a relative path means the directory we are in now, not the one we may have changed to by then */
+    if (string_prefixes_string(L"/", new_path))
+        path = new_path;
+    else
+        path = env_get_pwd_slash() + new_path;
+    folded = new_folded;
+    is_active = true;
+    generation++;
+    last_write_time = get_time();
+    return true;
+}
+
+void profile_stream_t::stop()
+{
+    if (is_active)
+    {
+        this->write();
+        is_active = false;
+        frames.clear();
+    }
+}
+
+unsigned int profile_stream_t::push_frame(const wcstring &name, bool is_function)
+{
+    frame_t frame;
+    frame.name = name;
+    frame.is_function = is_function;
+    if (! frames.empty())
+    {
+        frame.folded_stack = frames.back().folded_stack;
+        frame.folded_stack.push_back(L';');
+    }
+    /* Semicolons separate frames in the folded format */
+    size_t stack_start = frame.folded_stack.size();
+    frame.folded_stack.append(name);
+    std::replace(frame.folded_stack.begin() + stack_start, frame.folded_stack.end(), L';', L',');
+    frame.start_time = get_time();
+    frame.child_time = 0;
+    frame.start_forks = g_fork_count;
+    frame.child_forks = 0;
+    frames.push_back(frame);
+    return generation;
+}
+
+void profile_stream_t::pop_frame(unsigned int frame_generation)
+{
+    if (! is_active || frame_generation != generation || frames.empty())
+    {
+        return;
+    }
+
+    const long long now = get_time();
+    const frame_t &frame = frames.back();
+    const long long total = now - frame.start_time;
+    const long long self = std::max(total - frame.child_time, 0LL);
+    const int forks = g_fork_count - frame.start_forks;
+
+    profile_stats_t &stats = (frame.is_function ? function_stats : line_stats)[frame.name];
+    stats.calls++;
+    stats.self += self;
+    stats.forks += std::max(forks - frame.child_forks, 0);
+
+    /* Don't count the time of a recursive call twice */
+    bool is_recursive = false;
+    for (size_t i = 0; i + 1 < frames.size(); i++)
+    {
+        if (frames.at(i).is_function == frame.is_function && frames.at(i).name == frame.name)
+        {
+            is_recursive = true;
+            break;
+        }
+    }
+    if (! is_recursive)
+    {
+        stats.total += total;
+    }
+
+    folded_stats[frame.folded_stack] += self;
+
+    frames.pop_back();
+    if (! frames.empty())
+    {
+        frames.back().child_time += total;
+        frames.back().child_forks += forks;
+    }
+
+    if (now - last_write_time >= kProfileStreamWriteInterval)
+    {
+        last_write_time = now;
+        this->write();
+    }
+}
+
+/* Sorts profile rows by descending self time */
+struct profile_row_t
+{
+    const wchar_t *kind;
+    const wcstring *location;
+    const profile_stats_t *stats;
+
+    bool operator<(const profile_row_t &other) const
+    {
+        return stats->self > other.stats->self;
+    }
+};
+
+static void append_profile_rows(const std::map<wcstring, profile_stats_t> &stats, const wchar_t *kind, std::vector<profile_row_t> *rows)
+{
+    for (std::map<wcstring, profile_stats_t>::const_iterator iter = stats.begin(); iter != stats.end(); ++iter)
+    {
+        profile_row_t row = {kind, &iter->first, &iter->second};
+        rows->push_back(row);
+    }
+}
+
+void profile_stream_t::write() const
+{
+    wcstring out;
+    if (folded)
+    {
+        for (std::map<wcstring, long long>::const_iterator iter = folded_stats.begin(); iter != folded_stats.end(); ++iter)
+        {
+            append_format(out, L"%ls %lld\n", iter->first.c_str(), iter->second);
+        }
+    }
+    else
+    {
+        std::vector<profile_row_t> rows;
+        append_profile_rows(function_stats, L"function ", &rows);
+        append_profile_rows(line_stats, L"", &rows);
+        std::stable_sort(rows.begin(), rows.end());
+
+        out.append(_(L"Calls\tTotal\tSelf\tForks\tLocation\n"));
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            const profile_row_t &row = rows.at(i);
+            append_format(out, L"%lu\t%lld\t%lld\t%lu\t%ls%ls\n", row.stats->calls, row.stats->total, row.stats->self, row.stats->forks, row.kind, row.location->c_str());
+        }
+    }
+
+    /* The shell keeps running, so don't let children inherit the file */
+    int fd = wopen_cloexec(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        debug(1, _(L"Could not write profiling information to file '%ls'"), path.c_str());
+        return;
+    }
+    const std::string narrow = wcs2string(out);
+    if (write_loop(fd, narrow.data(), narrow.size()) < 0)
+    {
+        wperror(L"write");
+    }
+    close(fd);
+}
+
+wcstring parser_t::profile_location() const
+{
+    const wchar_t *file = this->current_filename();
+    wcstring result = file ? file : _(L"Standard input");
+    append_format(result, L":%d", this->get_lineno());
+    return result;
+}
+
 void parser_t::expand_argument_list(const wcstring &arg_list_src, std::vector<completion_t> *output_arg_list)
 {
     assert(output_arg_list != NULL);
@@ -837,9 +1024,10 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
     }
 
     /* Parse the source into a tree, if we can */
-    parse_node_tree_t tree;
+    parse_node_tree_t *tree = new parse_node_tree_t();
+    const shared_ptr<const parse_node_tree_t> tree_holder(tree);
     parse_error_list_t error_list;
-    if (! parse_tree_from_string(cmd, parse_flag_none, &tree, this->show_errors ? &error_list : NULL))
+    if (! parse_tree_from_string(cmd, parse_flag_none, tree, this->show_errors ? &error_list : NULL))
     {
         if (this->show_errors)
         {
@@ -854,6 +1042,21 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
         return 1;
     }
 
+    return this->eval(cmd, tree_holder, io, block_type);
+}
+
+int parser_t::eval(const wcstring &cmd, const shared_ptr<const parse_node_tree_t> &tree, const io_chain_t &io, enum block_type_t block_type)
+{
+    CHECK_BLOCK(1);
+    assert(tree.get() != NULL);
+
+    if (block_type != TOP && block_type != SUBST)
+    {
+        debug(1, INVALID_SCOPE_ERR_MSG, parser_t::get_block_desc(block_type));
+        bugreport();
+        return 1;
+    }
+
     //print_stderr(block_stack_description());
 
 
@@ -865,7 +1068,7 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
     execution_contexts.push_back(ctx);
 
     /* Execute the first node */
-    if (! tree.empty())
+    if (! tree->empty())
     {
         this->eval_block_node(0, io, block_type);
     }
@@ -16,6 +16,7 @@
 #include "parse_constants.h"
 
 #include <vector>
+#include <map>
 
 /**
    event_blockage_t represents a block on events of the specified type
@@ -229,6 +230,89 @@ struct profile_item_t
     wcstring cmd;
 };
 
+/** Aggregated statistics for one function or source line in a streaming profile. Times are in microseconds. */
+struct profile_stats_t
+{
+    /** How often the function was called or the line was run */
+    unsigned long calls;
+
+    /** Time spent in it, including nested calls. Recursive calls are only counted once. */
+    long long total;
+
+    /** Time spent in it, excluding nested calls */
+    long long self;
+
+    /** Number of forks made directly on its behalf */
+    unsigned long forks;
+
+    profile_stats_t() : calls(0), total(0), self(0), forks(0)
+    {
+    }
+};
+
+/**
+   A streaming profile, enabled with 'status --profile-start'. Unlike the profile written by 'fish --profile', which keeps one item per job until the shell exits, this keeps aggregated statistics per function and per source line, and periodically rewrites its file with them. It is either a table, or folded stacks as read by flamegraph tools.
+*/
+class profile_stream_t
+{
+    struct frame_t
+    {
+        /** The function name, or file:line */
+        wcstring name;
+
+        /** Whether this is a function call, rather than a job on a source line */
+        bool is_function;
+
+        /** The names of this frame and all frames below it, separated by semicolons */
+        wcstring folded_stack;
+
+        long long start_time;
+        long long child_time;
+        int start_forks;
+        int child_forks;
+    };
+
+    std::vector<frame_t> frames;
+
+    std::map<wcstring, profile_stats_t> function_stats;
+    std::map<wcstring, profile_stats_t> line_stats;
+
+    /** Self times keyed by folded stack */
+    std::map<wcstring, long long> folded_stats;
+
+    wcstring path;
+    bool folded;
+    bool is_active;
+
+    /** Incremented on each start, so frames pushed before a restart are not popped afterwards */
+    unsigned int generation;
+
+    long long last_write_time;
+
+public:
+    profile_stream_t();
+
+    /** Start profiling, discarding earlier statistics. Returns false and sets errno if path cannot be written. */
+    bool start(const wcstring &path, bool folded);
+
+    /** Write the final statistics and stop profiling */
+    void stop();
+
+    bool active() const
+    {
+        return is_active;
+    }
+
+    /** Begin timing a frame. Returns the generation to hand to pop_frame. */
+    unsigned int push_frame(const wcstring &name, bool is_function);
+
+    /** Finish timing the innermost frame, writing the statistics if enough time has passed since the last write */
+    void pop_frame(unsigned int generation);
+
+    /** Rewrite the profile file with the current statistics */
+    void write() const;
+};
+
 class parse_execution_context_t;
 class completion_t;
 
@@ -265,6 +349,9 @@ private:
     /** List of profile items, allocated with new */
     std::vector<profile_item_t *> profile_items;
 
+    /** The streaming profile */
+    profile_stream_t profile_stream;
+
     /* No copying allowed */
     parser_t(const parser_t&);
     parser_t& operator=(const parser_t&);
@@ -307,6 +394,13 @@ public:
     */
     int eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type);
 
+    /**
+      Evaluate the expressions contained in cmd, which has already been parsed into tree, as with parse_tree_from_string using parse_flag_none. The tree is not copied, so it may be shared by repeated evaluations.
+
+      \return 0 on success, 1 otherwise
+    */
+    int eval(const wcstring &cmd, const shared_ptr<const parse_node_tree_t> &tree, const io_chain_t &io, enum block_type_t block_type);
+
     /** Evaluates a block node at the given node offset in the topmost execution context */
     int eval_block_node(node_offset_t node_idx, const io_chain_t &io, enum block_type_t block_type);
 
@@ -381,6 +475,15 @@ public:
     /* Returns a new profile item if profiling is active. The caller should fill it in. The parser_t will clean it up. */
     profile_item_t *create_profile_item();
 
+    /** Returns the streaming profile */
+    profile_stream_t &stream_profiler()
+    {
+        return profile_stream;
+    }
+
+    /** Returns the current file and line as a streaming profile location */
+    wcstring profile_location() const;
+
     /**
        Test if the specified string can be parsed, or if more bytes need
        to be read first. The result will have the PARSER_TEST_ERROR bit
@@ -430,4 +533,34 @@ public:
     void stack_trace(size_t block_idx, wcstring &buff) const;
 };
 
+/**
+   Times a function call or job in the parser's streaming profile for as long as it is in scope, if streaming profiling is active.
+*/
+class scoped_profile_frame_t
+{
+    profile_stream_t *stream;
+    unsigned int generation;
+
+    scoped_profile_frame_t(const scoped_profile_frame_t &);
+    void operator=(const scoped_profile_frame_t &);
+
+public:
+    scoped_profile_frame_t(profile_stream_t &s, const wcstring &name, bool is_function) : stream(NULL), generation(0)
+    {
+        if (s.active())
+        {
+            stream = &s;
+            generation = s.push_frame(name, is_function);
+        }
+    }
+
+    ~scoped_profile_frame_t()
+    {
+        if (stream != NULL)
+        {
+            stream->pop_frame(generation);
+        }
+    }
+};
+
 #endif
@@ -5,8 +5,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include "fallback.h" // IWYU pragma: keep
 #include "common.h"
@@ -15,12 +21,53 @@
 #include "path.h"
 #include "expand.h"
 
+/* Without O_DIRECTORY, testing a path inside something that is not a directory still fails with ENOTDIR */
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
 /**
    Unexpected error in path_get_path()
 */
 #define MISSING_COMMAND_ERR_MSG _( L"Error while searching for command '%ls'" )
 
-static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const env_var_t &bin_path_var)
+/**
+   The number of seconds during which a command lookup may reuse the recorded
+   status change times of the PATH directories without stat'ing them again.
+*/
+#define PATH_CACHE_RECHECK_INTERVAL 1
+
+/**
+   The maximum number of commands in the lookup cache. When it is exceeded, the
+   cache is emptied; this bounds the memory used by the negative entries created
+   while a command name is being typed.
+*/
+#define PATH_CACHE_MAX_ENTRIES 4096
+
+/** Returns the list of directories to search for commands, given the value of $PATH */
+static wcstring path_bin_path_from_var(const env_var_t &bin_path_var)
+{
+    if (! bin_path_var.missing())
+    {
+        return bin_path_var;
+    }
+    else if (contains(PREFIX L"/bin", L"/bin", L"/usr/bin"))
+    {
+        return L"/bin" ARRAY_SEP_STR L"/usr/bin";
+    }
+    else
+    {
+        return L"/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR PREFIX L"/bin";
+    }
+}
+
+/**
+   Searches bin_path for cmd. If dirs_consulted is not NULL, it is set to the
+   number of (nonempty) PATH directories whose contents the result depends on.
+   If saw_unusable is not NULL, it is set to whether one of them has an entry
+   named cmd that could not be used, like a file that is not executable.
+*/
+static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const wcstring &bin_path, size_t *dirs_consulted, bool *saw_unusable)
 {
     int err = ENOENT;
 
@@ -57,29 +104,16 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const en
     }
     else
     {
-        wcstring bin_path;
-        if (! bin_path_var.missing())
-        {
-            bin_path = bin_path_var;
-        }
-        else
-        {
-            if (contains(PREFIX L"/bin", L"/bin", L"/usr/bin"))
-            {
-                bin_path = L"/bin" ARRAY_SEP_STR L"/usr/bin";
-            }
-            else
-            {
-                bin_path = L"/bin" ARRAY_SEP_STR L"/usr/bin" ARRAY_SEP_STR PREFIX L"/bin";
-            }
-        }
-
+        size_t consulted = 0;
         wcstring nxt_path;
         wcstokenizer tokenizer(bin_path, ARRAY_SEP_STR);
         while (tokenizer.next(nxt_path))
         {
             if (nxt_path.empty())
                 continue;
+            consulted++;
+            if (dirs_consulted)
+                *dirs_consulted = consulted;
             append_path_component(nxt_path, cmd);
             if (waccess(nxt_path, X_OK)==0)
             {
@@ -99,15 +133,20 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const en
                     return true;
                 }
                 err = EACCES;
+                if (saw_unusable)
+                    *saw_unusable = true;
 
             }
             else
             {
                 switch (errno)
                 {
+                    case EACCES:
+                        if (saw_unusable)
+                            *saw_unusable = true;
+                        break;
                     case ENOENT:
                     case ENAMETOOLONG:
-                    case EACCES:
                     case ENOTDIR:
                         break;
                     default:
@@ -126,14 +165,437 @@ static bool path_get_path_core(const wcstring &cmd, wcstring *out_path, const en
     return false;
 }
 
+/** A PATH directory, as last seen by the command lookup cache */
+struct path_cache_dir_t
+{
+    /** The directory */
+    wcstring path;
+
+    /** Whether the directory could be stat'ed */
+    bool exists;
+
+    /** The status change time of the directory, which changes with its contents and with its permissions */
+    time_t change_time;
+};
+
+/** The cached result of looking up a command */
+struct path_cache_entry_t
+{
+    /** Whether the command was found */
+    bool found;
+
+    /** The value of errno after a failed lookup */
+    int err;
+
+    /** The full path of the command, if it was found */
+    wcstring path;
+
+    /** The number of leading PATH directories this result depends on */
+    size_t dirs_consulted;
+};
+
+/**
+   Cache of command lookups. The cache is tied to one value of $PATH; looking up
+   a command with a different $PATH starts a new cache. Entries are dropped when
+   the status change time of a directory they depend on changes, which happens
+   whenever a file is added to or removed from it, and when its permissions
+   change. Failures to find a command because a file was not executable are
+   not cached, since making the file executable changes only the file.
+*/
+static pthread_mutex_t path_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The value of $PATH the cache belongs to */
+static wcstring path_cache_bin_path;
+
+/** The directories of path_cache_bin_path, in search order */
+static std::vector<path_cache_dir_t> path_cache_dirs;
+
+/** Index of the first directory changed too recently to trust its status change time, or npos */
+static size_t path_cache_first_racy_dir = wcstring::npos;
+
+/** When the directories were last stat'ed, or 0 to force a recheck */
+static time_t path_cache_last_checked = 0;
+
+/** Incremented whenever entries are dropped, so that lookups racing with that do not store stale results */
+static unsigned long path_cache_generation = 0;
+
+/** The cached lookups, keyed by command name */
+typedef std::map<wcstring, path_cache_entry_t> path_cache_map_t;
+static path_cache_map_t path_cache_entries;
+
+/** Stat the PATH directories and drop the entries depending on any that changed. Call with the lock held. */
+static void path_cache_recheck_dirs_locked(void)
+{
+    ASSERT_IS_LOCKED(path_cache_lock);
+    time_t now = time(NULL);
+    if (path_cache_last_checked != 0 && now - path_cache_last_checked < PATH_CACHE_RECHECK_INTERVAL)
+        return;
+
+    size_t first_changed = wcstring::npos;
+    path_cache_first_racy_dir = wcstring::npos;
+    for (size_t i=0; i < path_cache_dirs.size(); i++)
+    {
+        path_cache_dir_t &dir = path_cache_dirs.at(i);
+        struct stat buf;
+        bool exists = (wstat(dir.path, &buf) == 0);
+        time_t change_time = exists ? buf.st_ctime : 0;
+        if (exists != dir.exists || change_time != dir.change_time)
+        {
+            dir.exists = exists;
+            dir.change_time = change_time;
+            if (first_changed == wcstring::npos)
+                first_changed = i;
+        }
+
+        /* A directory modified within the resolution of its timestamp may be modified again without the timestamp changing */
+        if (exists && change_time >= now - 1 && path_cache_first_racy_dir == wcstring::npos)
+            path_cache_first_racy_dir = i;
+    }
+    path_cache_last_checked = now;
+
+    if (first_changed != wcstring::npos)
+    {
+        path_cache_map_t::iterator iter = path_cache_entries.begin();
+        while (iter != path_cache_entries.end())
+        {
+            if (iter->second.dirs_consulted > first_changed)
+            {
+                path_cache_entries.erase(iter++);
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+        path_cache_generation++;
+    }
+}
+
+/** Make the cache belong to bin_path, emptying it if it belonged to another $PATH. Call with the lock held. */
+static void path_cache_set_bin_path_locked(const wcstring &bin_path)
+{
+    ASSERT_IS_LOCKED(path_cache_lock);
+    if (bin_path == path_cache_bin_path && ! path_cache_dirs.empty())
+        return;
+
+    path_cache_bin_path = bin_path;
+    path_cache_dirs.clear();
+    path_cache_entries.clear();
+    path_cache_last_checked = 0;
+    path_cache_generation++;
+
+    wcstring nxt_path;
+    wcstokenizer tokenizer(bin_path, ARRAY_SEP_STR);
+    while (tokenizer.next(nxt_path))
+    {
+        if (nxt_path.empty())
+            continue;
+        path_cache_dir_t dir;
+        dir.path = nxt_path;
+        dir.exists = false;
+        dir.change_time = 0;
+        path_cache_dirs.push_back(dir);
+    }
+}
+
+/** Returns whether lookups in bin_path may be cached. Relative directories depend on the working directory, so they may not. */
+static bool path_bin_path_is_cacheable(const wcstring &bin_path)
+{
+    wcstring nxt_path;
+    wcstokenizer tokenizer(bin_path, ARRAY_SEP_STR);
+    while (tokenizer.next(nxt_path))
+    {
+        if (! nxt_path.empty() && nxt_path.at(0) != L'/')
+            return false;
+    }
+    return true;
+}
+
+static bool path_get_path_cached(const wcstring &cmd, wcstring *out_path, const env_var_t &bin_path_var)
+{
+    const wcstring bin_path = path_bin_path_from_var(bin_path_var);
+
+    /* Full paths are checked directly */
+    if (cmd.find(L'/') != wcstring::npos || ! path_bin_path_is_cacheable(bin_path))
+    {
+        return path_get_path_core(cmd, out_path, bin_path, NULL, NULL);
+    }
+
+    unsigned long generation;
+    {
+        scoped_lock locker(path_cache_lock);
+        path_cache_set_bin_path_locked(bin_path);
+        path_cache_recheck_dirs_locked();
+
+        path_cache_map_t::const_iterator where = path_cache_entries.find(cmd);
+        if (where != path_cache_entries.end())
+        {
+            const path_cache_entry_t &entry = where->second;
+            if (entry.found)
+            {
+                if (out_path)
+                    out_path->assign(entry.path);
+                return true;
+            }
+            errno = entry.err;
+            return false;
+        }
+        generation = path_cache_generation;
+    }
+
+    /* Not cached. Look it up without holding the lock, since this may touch a slow filesystem. */
+    path_cache_entry_t entry;
+    entry.dirs_consulted = 0;
+    bool saw_unusable = false;
+    entry.found = path_get_path_core(cmd, &entry.path, bin_path, &entry.dirs_consulted, &saw_unusable);
+    entry.err = errno;
+
+    /* A file that is there but could not be used may become usable through chmod, which does not change its directory. Such failures are rare, so just look them up again every time. */
+    if (! entry.found && saw_unusable)
+    {
+        errno = entry.err;
+        return false;
+    }
+
+    {
+        scoped_lock locker(path_cache_lock);
+        bool racy = (path_cache_first_racy_dir != wcstring::npos && path_cache_first_racy_dir < entry.dirs_consulted);
+        if (generation == path_cache_generation && bin_path == path_cache_bin_path && ! racy)
+        {
+            if (path_cache_entries.size() >= PATH_CACHE_MAX_ENTRIES)
+                path_cache_entries.clear();
+            path_cache_entries[cmd] = entry;
+        }
+    }
+
+    if (entry.found && out_path)
+        out_path->swap(entry.path);
+    errno = entry.err;
+    return entry.found;
+}
+
+void path_invalidate_cache(void)
+{
+    scoped_lock locker(path_cache_lock);
+    path_cache_bin_path.clear();
+    path_cache_dirs.clear();
+    path_cache_entries.clear();
+    path_cache_last_checked = 0;
+    path_cache_generation++;
+}
+
+/** The directories that cached cd resolutions depend on, as last seen */
+struct cdpath_cache_dir_t
+{
+    /** The status change time of the directory, or -1 if it could not be stat'ed */
+    time_t change_time;
+
+    /** When the directory was last stat'ed, or 0 to force a recheck */
+    time_t last_checked;
+};
+
+/** The cached result of resolving a cd argument */
+struct cdpath_cache_entry_t
+{
+    /** Whether a directory was found */
+    bool found;
+
+    /** The value of errno after a failed resolution */
+    int err;
+
+    /** The directory, if one was found */
+    wcstring path;
+
+    /** The parents of the candidate paths that were tried, with their status change times when the result was cached */
+    std::vector<std::pair<wcstring, time_t> > parents;
+
+    /** When the parents were last compared, and the value of cdpath_cache_recheck_count then */
+    time_t last_checked;
+    unsigned long recheck_count;
+};
+
+/**
+   Cache of cd argument resolutions, for path_get_cdpath. Entries are keyed by
+   the list of candidate paths, which is derived from the argument, the working
+   directory and $CDPATH, so a change to any of them just misses the cache.
+   Entries are dropped when the status change time of a parent directory of a
+   candidate changes, which happens whenever an entry is added to or removed
+   from it, and when its permissions change.
+*/
+static pthread_mutex_t cdpath_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef std::map<wcstring, cdpath_cache_dir_t> cdpath_cache_dir_map_t;
+static cdpath_cache_dir_map_t cdpath_cache_dirs;
+
+typedef std::map<wcstring, cdpath_cache_entry_t> cdpath_cache_map_t;
+static cdpath_cache_map_t cdpath_cache_entries;
+
+/** Incremented by path_cache_recheck, so that entries compared with their parents since are compared again */
+static unsigned long cdpath_cache_recheck_count = 0;
+
+/** Returns the status change time of the given directory, or -1 if it could not be stat'ed, trusting a time recorded less than PATH_CACHE_RECHECK_INTERVAL ago. Sets *racy if the directory was changed too recently for its change time to be trusted. Call with the lock held. */
+static time_t cdpath_cache_dir_change_time_locked(const wcstring &dir, time_t now, bool *racy)
+{
+    ASSERT_IS_LOCKED(cdpath_cache_lock);
+    cdpath_cache_dir_t &entry = cdpath_cache_dirs[dir];
+    if (entry.last_checked == 0 || now - entry.last_checked >= PATH_CACHE_RECHECK_INTERVAL)
+    {
+        struct stat buf;
+        entry.change_time = (wstat(dir, &buf) == 0) ? buf.st_ctime : -1;
+        entry.last_checked = now;
+    }
+
+    /* A directory modified within the resolution of its timestamp may be modified again without the timestamp changing */
+    if (entry.change_time >= now - 1)
+        *racy = true;
+    return entry.change_time;
+}
+
+/**
+   The maximum number of directories in the listing cache. When it is exceeded,
+   the cache is emptied.
+*/
+#define DIR_LISTING_CACHE_MAX_DIRS 64
+
+/** A cached directory listing, for path_get_dir_entries */
+struct dir_listing_cache_entry_t
+{
+    /** The entries, sorted by dir_entry_less */
+    std::vector<path_dir_entry_t> entries;
+
+    /** The modification time of the directory when it was listed */
+    time_t mod_time;
+
+    /** When the modification time was last compared, or 0 to force a comparison */
+    time_t last_checked;
+};
+
+/**
+   Cache of directory listings, keyed by directory. A listing is dropped when
+   the modification time of its directory changes. Listings of directories
+   modified too recently for their modification time to be trusted are not
+   cached at all.
+*/
+static pthread_mutex_t dir_listing_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef std::map<wcstring, dir_listing_cache_entry_t> dir_listing_cache_map_t;
+static dir_listing_cache_map_t dir_listing_cache_entries;
+
+/** The order of a listing: case-insensitive, so that the names sharing a case-insensitive prefix are adjacent */
+static bool dir_entry_less(const path_dir_entry_t &a, const path_dir_entry_t &b)
+{
+    return wcscasecmp(a.name.c_str(), b.name.c_str()) < 0;
+}
+
+static bool dir_entry_less_than_prefix(const path_dir_entry_t &a, const wcstring &prefix)
+{
+    return wcscasecmp(a.name.c_str(), prefix.c_str()) < 0;
+}
+
+/** Append the entries of a sorted listing that begin with prefix, ignoring case */
+static void dir_listing_append_matches(const std::vector<path_dir_entry_t> &entries, const wcstring &prefix, std::vector<path_dir_entry_t> *out)
+{
+    std::vector<path_dir_entry_t>::const_iterator iter = std::lower_bound(entries.begin(), entries.end(), prefix, dir_entry_less_than_prefix);
+    for (; iter != entries.end(); ++iter)
+    {
+        if (wcsncasecmp(iter->name.c_str(), prefix.c_str(), prefix.size()) != 0)
+            break;
+        out->push_back(*iter);
+    }
+}
+
+bool path_get_dir_entries(const wcstring &dir, const wcstring &prefix, std::vector<path_dir_entry_t> *out)
+{
+    assert(out != NULL);
+    time_t now = time(NULL);
+    {
+        scoped_lock locker(dir_listing_cache_lock);
+        dir_listing_cache_map_t::iterator where = dir_listing_cache_entries.find(dir);
+        if (where != dir_listing_cache_entries.end())
+        {
+            dir_listing_cache_entry_t &entry = where->second;
+            bool valid = true;
+            if (entry.last_checked == 0 || now - entry.last_checked >= PATH_CACHE_RECHECK_INTERVAL)
+            {
+                struct stat buf;
+                valid = (wstat(dir, &buf) == 0 && buf.st_mtime == entry.mod_time);
+                entry.last_checked = now;
+            }
+
+            if (valid)
+            {
+                dir_listing_append_matches(entry.entries, prefix, out);
+                return true;
+            }
+            dir_listing_cache_entries.erase(where);
+        }
+    }
+
+    /* Not cached. List the directory without holding the lock. Stat it first, so that a change made while we read it changes the modification time we record. */
+    struct stat buf;
+    if (wstat(dir, &buf) != 0)
+        return false;
+    DIR *dir_fp = wopendir(dir);
+    if (dir_fp == NULL)
+        return false;
+
+    dir_listing_cache_entry_t entry;
+    entry.mod_time = buf.st_mtime;
+    entry.last_checked = now;
+    path_dir_entry_t dir_entry;
+    while (wreaddir_with_type(dir_fp, dir_entry.name, &dir_entry.type))
+    {
+        entry.entries.push_back(dir_entry);
+    }
+    closedir(dir_fp);
+    std::sort(entry.entries.begin(), entry.entries.end(), dir_entry_less);
+    dir_listing_append_matches(entry.entries, prefix, out);
+
+    /* A directory modified within the resolution of its timestamp may be modified again without the timestamp changing */
+    if (entry.mod_time < now - 1)
+    {
+        scoped_lock locker(dir_listing_cache_lock);
+        if (dir_listing_cache_entries.size() >= DIR_LISTING_CACHE_MAX_DIRS)
+            dir_listing_cache_entries.clear();
+        dir_listing_cache_entry_t &cached = dir_listing_cache_entries[dir];
+        cached.entries.swap(entry.entries);
+        cached.mod_time = entry.mod_time;
+        cached.last_checked = entry.last_checked;
+    }
+    return true;
+}
+
+void path_cache_recheck(void)
+{
+    {
+        scoped_lock locker(path_cache_lock);
+        path_cache_last_checked = 0;
+    }
+
+    {
+        scoped_lock locker(dir_listing_cache_lock);
+        for (dir_listing_cache_map_t::iterator iter = dir_listing_cache_entries.begin(); iter != dir_listing_cache_entries.end(); ++iter)
+        {
+            iter->second.last_checked = 0;
+        }
+    }
+
+    scoped_lock locker(cdpath_cache_lock);
+    for (cdpath_cache_dir_map_t::iterator iter = cdpath_cache_dirs.begin(); iter != cdpath_cache_dirs.end(); ++iter)
+    {
+        iter->second.last_checked = 0;
+    }
+    cdpath_cache_recheck_count++;
+}
+
 bool path_get_path(const wcstring &cmd, wcstring *out_path, const env_vars_snapshot_t &vars)
 {
-    return path_get_path_core(cmd, out_path, vars.get(L"PATH"));
+    return path_get_path_cached(cmd, out_path, vars.get(L"PATH"));
 }
 
 bool path_get_path(const wcstring &cmd, wcstring *out_path)
 {
-    return path_get_path_core(cmd, out_path, env_get_string(L"PATH"));
+    return path_get_path_cached(cmd, out_path, env_get_string(L"PATH"));
 }
 
 bool path_get_cdpath(const wcstring &dir, wcstring *out, const wchar_t *wd, const env_vars_snapshot_t &env_vars)
@@ -148,15 +610,65 @@ bool path_get_cdpath(const wcstring &dir, wcstring *out, const wchar_t *wd, cons
         assert(wd[len - 1] == L'/');
     }
 
+    const bool relative_to_wd = (string_prefixes_string(L"./", dir) ||
+                                 string_prefixes_string(L"../", dir) ||
+                                 dir == L"." || dir == L"..");
+    const bool uses_cdpath = (dir.at(0) != L'/' && ! relative_to_wd);
+    env_var_t cdpath = uses_cdpath ? env_vars.get(L"CDPATH") : env_var_t::missing_var();
+    if (cdpath.missing_or_empty())
+        cdpath = L"."; //We'll change this to the wd if we have one
+
+    /* The candidates depend only on the argument, the working directory and $CDPATH (unless that has a tilde, which we don't cache), so they make the key for the cache. Only cacheable resolutions are stored. */
+    wcstring key = dir;
+    key.push_back(L'\0');
+    if (wd)
+        key.append(wd);
+    if (uses_cdpath)
+    {
+        key.push_back(L'\0');
+        key.append(cdpath);
+    }
+
+    {
+        scoped_lock locker(cdpath_cache_lock);
+        cdpath_cache_map_t::iterator where = cdpath_cache_entries.find(key);
+        if (where != cdpath_cache_entries.end())
+        {
+            cdpath_cache_entry_t &entry = where->second;
+            const time_t now = time(NULL);
+            bool unchanged = true, racy = false;
+            if (entry.recheck_count != cdpath_cache_recheck_count || now - entry.last_checked >= PATH_CACHE_RECHECK_INTERVAL)
+            {
+                for (size_t i=0; i < entry.parents.size() && unchanged; i++)
+                {
+                    unchanged = (cdpath_cache_dir_change_time_locked(entry.parents.at(i).first, now, &racy) == entry.parents.at(i).second);
+                }
+                entry.last_checked = now;
+                entry.recheck_count = cdpath_cache_recheck_count;
+            }
+
+            if (unchanged && ! racy)
+            {
+                if (! entry.found)
+                {
+                    errno = entry.err;
+                    return false;
+                }
+                if (out)
+                    out->assign(entry.path);
+                return true;
+            }
+            cdpath_cache_entries.erase(where);
+        }
+    }
+
     wcstring_list_t paths;
     if (dir.at(0) == L'/')
     {
         /* Absolute path */
         paths.push_back(dir);
     }
-    else if (string_prefixes_string(L"./", dir) ||
-             string_prefixes_string(L"../", dir) ||
-             dir == L"." || dir == L"..")
+    else if (relative_to_wd)
     {
         /* Path is relative to the working directory */
         wcstring path;
@@ -168,12 +680,8 @@ bool path_get_cdpath(const wcstring &dir, wcstring *out, const wchar_t *wd, cons
     else
     {
         // Respect CDPATH
-        env_var_t path = env_vars.get(L"CDPATH");
-        if (path.missing_or_empty())
-            path = L"."; //We'll change this to the wd if we have one
-
         wcstring nxt_path;
-        wcstokenizer tokenizer(path, ARRAY_SEP_STR);
+        wcstokenizer tokenizer(cdpath, ARRAY_SEP_STR);
         while (tokenizer.next(nxt_path))
         {
 
@@ -196,11 +704,21 @@ bool path_get_cdpath(const wcstring &dir, wcstring *out, const wchar_t *wd, cons
         }
     }
 
+    /* Relative candidates depend on the working directory of the process, and tildes on $HOME, so those are not cached */
+    bool cacheable = (! uses_cdpath || cdpath.find(L'~') == wcstring::npos);
+    for (wcstring_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter)
+    {
+        if (iter->at(0) != L'/')
+            cacheable = false;
+    }
+
     bool success = false;
+    size_t tried = 0;
     for (wcstring_list_t::const_iterator iter = paths.begin(); iter != paths.end(); ++iter)
     {
         struct stat buf;
         const wcstring &dir = *iter;
+        tried++;
         if (wstat(dir, &buf) == 0)
         {
             if (S_ISDIR(buf.st_mode))
@@ -217,6 +735,37 @@ bool path_get_cdpath(const wcstring &dir, wcstring *out, const wchar_t *wd, cons
         }
     }
 
+    if (cacheable)
+    {
+        /* The parents are stat'ed after the candidates, so a change in between either shows up as a recent modification, or is seen on the next recheck */
+        cdpath_cache_entry_t entry;
+        entry.found = success;
+        entry.err = err;
+        if (success)
+            entry.path = paths.at(tried - 1);
+
+        scoped_lock locker(cdpath_cache_lock);
+        const time_t now = time(NULL);
+        bool racy = false;
+        for (size_t i=0; i < tried; i++)
+        {
+            const wcstring parent = wdirname(paths.at(i));
+            entry.parents.push_back(std::make_pair(parent, cdpath_cache_dir_change_time_locked(parent, now, &racy)));
+        }
+
+        entry.last_checked = now;
+        entry.recheck_count = cdpath_cache_recheck_count;
+        if (! racy)
+        {
+            if (cdpath_cache_entries.size() >= PATH_CACHE_MAX_ENTRIES)
+            {
+                cdpath_cache_entries.clear();
+                cdpath_cache_dirs.clear();
+            }
+            cdpath_cache_entries[key] = entry;
+        }
+    }
+
     if (! success)
         errno = err;
     return success;
@@ -387,6 +936,82 @@ bool path_is_valid(const wcstring &path, const wcstring &working_directory)
     return path_is_valid;
 }
 
+bool paths_are_valid(const wcstring_list_t &paths, const wcstring &working_directory, bool test_all, std::vector<bool> *out_valid)
+{
+    out_valid->assign(paths.size(), false);
+
+#ifdef HAVE_FACCESSAT
+    /* Group the paths by the directory they're in, by index. The special paths that path_is_valid knows about, and paths ending in a slash, are just tested directly. */
+    typedef std::map<wcstring, std::vector<size_t> > paths_by_dir_t;
+    paths_by_dir_t paths_by_dir;
+    for (size_t i=0; i < paths.size(); i++)
+    {
+        const wcstring &path = paths.at(i);
+        if (path.empty() || path == L"." || path == L"./" || path == L".." || path == L"../" || path.at(path.size() - 1) == L'/')
+        {
+            (*out_valid)[i] = path_is_valid(path, working_directory);
+            if (! (*out_valid)[i] && ! test_all)
+                return false;
+            continue;
+        }
+
+        const wcstring full_path = (path.at(0) == L'/' ? path : working_directory + path);
+        const size_t slash = full_path.rfind(L'/');
+        /* No slash means a relative path and no working directory, so the path is relative to the current directory, just like it would be for access() */
+        wcstring dir;
+        if (slash == wcstring::npos)
+            dir = L".";
+        else if (slash == 0)
+            dir = L"/";
+        else
+            dir.assign(full_path, 0, slash);
+        paths_by_dir[dir].push_back(i);
+    }
+
+    bool all_valid = true;
+    for (paths_by_dir_t::const_iterator iter = paths_by_dir.begin(); iter != paths_by_dir.end() && (all_valid || test_all); ++iter)
+    {
+        const std::vector<size_t> &indexes = iter->second;
+
+        /* Opening a directory needs read permission, but testing a path in it only needs search permission. If we can't open it, fall back to testing each path in full. The path may name a FIFO or a device rather than a directory, and opening those must neither block nor have effects. */
+        const int dir_fd = wopen_cloexec(iter->first, O_RDONLY | O_DIRECTORY | O_NONBLOCK);
+        for (size_t j=0; j < indexes.size() && (all_valid || test_all); j++)
+        {
+            const size_t idx = indexes.at(j);
+            const wcstring &path = paths.at(idx);
+            bool valid;
+            if (dir_fd < 0)
+            {
+                valid = path_is_valid(path, working_directory);
+            }
+            else
+            {
+                const size_t slash = path.rfind(L'/');
+                valid = (0 == waccessat(dir_fd, slash == wcstring::npos ? path : path.substr(slash + 1), F_OK));
+            }
+            (*out_valid)[idx] = valid;
+            all_valid = all_valid && valid;
+        }
+        if (dir_fd >= 0)
+            close(dir_fd);
+    }
+    /* Account for the paths that were tested directly */
+    for (size_t i=0; i < paths.size() && all_valid; i++)
+    {
+        all_valid = (*out_valid)[i];
+    }
+    return all_valid;
+#else
+    bool all_valid = true;
+    for (size_t i=0; i < paths.size() && (all_valid || test_all); i++)
+    {
+        (*out_valid)[i] = path_is_valid(paths.at(i), working_directory);
+        all_valid = all_valid && (*out_valid)[i];
+    }
+    return all_valid;
+#endif
+}
+
 bool paths_are_same_file(const wcstring &path1, const wcstring &path2)
 {
     if (paths_are_equivalent(path1, path2))
@@ -10,6 +10,8 @@
 #define FISH_PATH_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <vector>
 #include "common.h"
 #include "env.h"
 
@@ -30,6 +32,9 @@ bool path_get_config(wcstring &path);
 /**
    Finds the full path of an executable. Returns YES if successful.
 
+   Lookups are cached. A cached result is used as long as $PATH and the
+   status change times of the directories it lists are unchanged.
+
    \param cmd The name of the executable.
    \param output_or_NULL If non-NULL, store the full path.
    \param vars The environment variables snapshot to use
@@ -39,6 +44,45 @@ bool path_get_path(const wcstring &cmd,
                    wcstring *output_or_NULL,
                    const env_vars_snapshot_t &vars = env_vars_snapshot_t::current());
 
+/**
+   Empties the command lookup cache used by path_get_path. This is called
+   when $PATH changes.
+*/
+void path_invalidate_cache(void);
+
+/**
+   Makes the next path_get_path, path_get_cdpath and path_get_dir_entries
+   calls stat the directories their cached results depend on again, instead
+   of trusting times recorded less than a second ago. Call
+   this before a lookup that must see commands or directories created just now,
+   such as looking again for a command to execute that was not found.
+*/
+void path_cache_recheck(void);
+
+/** An entry of a directory listing */
+struct path_dir_entry_t
+{
+    /** The name of the entry */
+    wcstring name;
+
+    /** The type of the entry as readdir reported it, as for wreaddir_with_type */
+    mode_t type;
+};
+
+/**
+   Appends to out the entries of the directory dir whose names begin with
+   prefix, ignoring case, or all of its entries if prefix is empty. The entries
+   are appended in case-insensitive order.
+
+   Listings are cached, and reused as long as the modification time of the
+   directory is unchanged, with the same recheck interval as path_get_path. The
+   cache only tells which names exist; properties of the files themselves, like
+   their permissions, may have changed since.
+
+   \return false if the directory could not be read
+*/
+bool path_get_dir_entries(const wcstring &dir, const wcstring &prefix, std::vector<path_dir_entry_t> *out);
+
 /**
    Returns the full path of the specified directory, using the CDPATH
    variable as a list of base directories for relative paths. The
@@ -57,6 +101,9 @@ bool path_get_path(const wcstring &cmd,
    \param wd The working directory, or NULL to use the default. The working directory should have a slash appended at the end.
    \param vars The environment variable snapshot to use (for the CDPATH variable)
    \return 0 if the command can not be found, the path of the command otherwise. The path should be free'd with free().
+
+   Results are cached like those of path_get_path, so that highlighting and
+   autosuggesting cd arguments does not stat every candidate on every keystroke.
 */
 bool path_get_cdpath(const wcstring &dir,
                      wcstring *out_or_NULL,
@@ -80,6 +127,9 @@ bool paths_are_equivalent(const wcstring &p1, const wcstring &p2);
 
 bool path_is_valid(const wcstring &path, const wcstring &working_directory);
 
+/** Like path_is_valid, for a list of paths. Sets (*out_valid)[i] to whether paths[i] is valid, and returns whether all of them are. If test_all is false, stops at the first invalid path found; paths not tested yet are reported as invalid. Paths in the same directory are tested through a single descriptor for that directory. */
+bool paths_are_valid(const wcstring_list_t &paths, const wcstring &working_directory, bool test_all, std::vector<bool> *out_valid);
+
 /** Returns whether the two paths refer to the same file */
 bool paths_are_same_file(const wcstring &path1, const wcstring &path2);
 
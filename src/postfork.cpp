@@ -305,12 +305,17 @@ pid_t execute_fork(bool wait_for_threads_to_die)
     int i;
 
     g_fork_count++;
+    syscall_count(SYSCALL_FORK);
+
+    sigset_t saved_mask;
+    signal_mask_for_fork(&saved_mask);
 
     for (i=0; i<FORK_LAPS; i++)
     {
         pid = fork();
         if (pid >= 0)
         {
+            signal_fork_done(pid, &saved_mask);
             return pid;
         }
 
@@ -386,6 +391,12 @@ bool fork_actions_make_spawn_properties(posix_spawnattr_t *attr, posix_spawn_fil
     if (! err)
         err = posix_spawnattr_setflags(attr, flags);
 
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+    /* A foreground job that starts a new process group must be handed the terminal before it runs, or it may be stopped for reading it. The fork path does this in the child via set_child_group; here the child does it before applying any redirection, just like there. */
+    if (! err && job_get_flag(j, JOB_CONTROL) && job_get_flag(j, JOB_TERMINAL) && job_get_flag(j, JOB_FOREGROUND) && j->pgid == 0 && isatty(STDIN_FILENO))
+        err = posix_spawn_file_actions_addtcsetpgrp_np(actions, STDIN_FILENO);
+#endif
+
     if (! err && should_set_parent_group_id)
         err = posix_spawnattr_setpgroup(attr, desired_parent_group_id);
 
@@ -532,7 +543,7 @@ void safe_report_exec_error(int err, const char *actual_cmd, const char * const
 
         case ENOENT:
         {
-            /* ENOENT is returned by exec() when the path fails, but also returned by posix_spawn if an open file action fails. These cases appear to be impossible to distinguish. We address this by not using posix_spawn for file redirections, so all the ENOENTs we find must be errors from exec(). */
+            /* ENOENT is returned by exec() when the path fails, but also returned by posix_spawn if an open file action fails. These cases appear to be impossible to distinguish. We address this by opening redirected files before calling posix_spawn, so all the ENOENTs we find must be errors from exec(). */
             char interpreter_buff[128] = {}, *interpreter;
             interpreter = get_interpreter(actual_cmd, interpreter_buff, sizeof interpreter_buff);
             if (interpreter && 0 != access(interpreter, X_OK))
@@ -17,12 +17,15 @@ Some of the code in this file is based on code from the Glibc manual.
 #include <wchar.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <pthread.h>
 #include <wctype.h>
 #include <algorithm>
 #include <memory> // IWYU pragma: keep - suggests <tr1/memory> instead
 #include <vector>
+#include <map>
+#include <set>
 
 #include <unistd.h>
 #include <signal.h>
@@ -64,7 +67,7 @@ Some of the code in this file is based on code from the Glibc manual.
 /**
    Size of buffer for reading buffered output
 */
-#define BUFFER_SIZE 4096
+#define BUFFER_SIZE 65536
 
 /**
 	Status of last process to exit
@@ -152,9 +155,45 @@ static event_t event(0);
 */
 static std::vector<int> interactive_stack;
 
+/**
+   A pipe that the SIGCHLD handler writes a byte to, so that select_try and the reader's select wake up as soon as a child changes state, even if the
+   signal arrives just before we start to select. Both ends are non-blocking and close-on-exec. -1 if it could not be made.
+*/
+static int s_sigchld_pipe[2] = {-1, -1};
+
 void proc_init()
 {
     proc_push_interactive(0);
+
+    if (s_sigchld_pipe[0] < 0)
+    {
+        int fds[2];
+        if (pipe(fds) == 0)
+        {
+            for (int i=0; i < 2; i++)
+            {
+                set_cloexec(fds[i]);
+                make_fd_nonblocking(fds[i]);
+            }
+            s_sigchld_pipe[0] = fds[0];
+            s_sigchld_pipe[1] = fds[1];
+        }
+    }
+}
+
+int proc_child_status_fd()
+{
+    return s_sigchld_pipe[0];
+}
+
+void proc_drain_child_status_fd()
+{
+    if (s_sigchld_pipe[0] >= 0)
+    {
+        char drain[64];
+        while (read(s_sigchld_pipe[0], drain, sizeof drain) > 0)
+            ;
+    }
 }
 
 
@@ -206,25 +245,26 @@ int proc_get_last_status()
     return last_status;
 }
 
-/* Basic thread safe job IDs. The vector consumed_job_ids has a true value wherever the job ID corresponding to that slot is in use. The job ID corresponding to slot 0 is 1. */
+/* Basic thread safe job IDs. The vector consumed_job_ids has a true value wherever the job ID corresponding to that slot is in use. The job ID corresponding to slot 0 is 1. The set free_job_ids holds the unused job IDs below the end of the vector, so the lowest one is found without scanning every slot. */
 static pthread_mutex_t job_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static std::vector<bool> consumed_job_ids;
+static std::set<job_id_t> free_job_ids;
 
 job_id_t acquire_job_id(void)
 {
     scoped_lock lock(job_id_lock);
 
-    /* Find the index of the first 0 slot */
-    std::vector<bool>::iterator slot = std::find(consumed_job_ids.begin(), consumed_job_ids.end(), false);
-    if (slot != consumed_job_ids.end())
+    if (! free_job_ids.empty())
     {
-        /* We found a slot. Note that slot 0 corresponds to job ID 1. */
-        *slot = true;
-        return (job_id_t)(slot - consumed_job_ids.begin() + 1);
+        /* Reuse the lowest free job ID. Note that slot 0 corresponds to job ID 1. */
+        job_id_t jid = *free_job_ids.begin();
+        free_job_ids.erase(free_job_ids.begin());
+        consumed_job_ids.at(jid - 1) = true;
+        return jid;
     }
     else
     {
-        /* We did not find a slot; create a new slot. The size of the vector is now the job ID (since it is one larger than the slot). */
+        /* No free job ID; create a new slot. The size of the vector is now the job ID (since it is one larger than the slot). */
         consumed_job_ids.push_back(true);
         return (job_id_t)consumed_job_ids.size();
     }
@@ -240,14 +280,87 @@ void release_job_id(job_id_t jid)
     assert(slot < count);
     assert(consumed_job_ids.at(slot) == true);
 
-    /* Clear it and then resize the vector to eliminate unused trailing job IDs */
+    /* Clear it. If it is the last slot, shrink the vector to eliminate unused trailing job IDs, which are no longer free IDs below the end. Jobs mostly run one at a time, so this is the common case, and needs no set insertion. */
     consumed_job_ids.at(slot) = false;
-    while (count--)
+    if (slot + 1 < count)
     {
-        if (consumed_job_ids.at(count))
-            break;
+        free_job_ids.insert(jid);
+        return;
+    }
+    consumed_job_ids.pop_back();
+    while (! consumed_job_ids.empty() && ! consumed_job_ids.back())
+    {
+        free_job_ids.erase((job_id_t)consumed_job_ids.size());
+        consumed_job_ids.pop_back();
+    }
+}
+
+/**
+   Index from process ID to the job containing that process, so that handle_child_status and job_get_from_pid do not have to walk every process of every job each time a child changes state. Jobs are indexed once they are launched and removed when they are destroyed. A lookup that misses, or that finds a process which has already completed and whose pid may have been reused, falls back to searching the job list. Only used from the main thread.
+*/
+typedef std::map<pid_t, job_t *> pid_index_t;
+static pid_index_t s_pid_index;
+
+void job_index_pids(job_t *j)
+{
+    ASSERT_IS_MAIN_THREAD();
+    for (const process_t *p = j->first_process; p; p = p->next)
+    {
+        if (p->pid > 0)
+            s_pid_index[p->pid] = j;
+    }
+}
+
+static void job_unindex_pids(const job_t *j)
+{
+    for (const process_t *p = j->first_process; p; p = p->next)
+    {
+        pid_index_t::iterator iter = s_pid_index.find(p->pid);
+        if (iter != s_pid_index.end() && iter->second == j)
+            s_pid_index.erase(iter);
+    }
+}
+
+/**
+   Find the process with the specified pid, and the job it is part of. Also returns the process before it in the job, or NULL if it is the first one.
+*/
+static job_t *job_find_process(pid_t pid, process_t **out_proc, process_t **out_prev)
+{
+    pid_index_t::const_iterator iter = s_pid_index.find(pid);
+    if (iter != s_pid_index.end())
+    {
+        job_t *j = iter->second;
+        process_t *prev = NULL;
+        for (process_t *p = j->first_process; p; p = p->next)
+        {
+            if (p->pid == pid && ! p->completed)
+            {
+                *out_proc = p;
+                *out_prev = prev;
+                return j;
+            }
+            prev = p;
+        }
+    }
+
+    job_t *j;
+    job_iterator_t jobs;
+    while ((j = jobs.next()))
+    {
+        process_t *prev = NULL;
+        for (process_t *p = j->first_process; p; p = p->next)
+        {
+            if (p->pid == pid)
+            {
+                s_pid_index[pid] = j;
+                *out_proc = p;
+                *out_prev = prev;
+                return j;
+            }
+            prev = p;
+        }
     }
-    consumed_job_ids.resize(count + 1);
+    return NULL;
 }
 
 job_t *job_get(job_id_t id)
@@ -259,6 +372,10 @@ job_t *job_get(job_id_t id)
 job_t *job_get_from_pid(int pid)
 {
     ASSERT_IS_MAIN_THREAD();
+    /* A job's pgid is normally the pid of its first process */
+    pid_index_t::const_iterator iter = s_pid_index.find(pid);
+    if (iter != s_pid_index.end() && iter->second->pgid == pid)
+        return iter->second;
     return parser_t::principal_parser().job_get_from_pid(pid);
 }
 
@@ -420,41 +537,33 @@ static void handle_child_status(pid_t pid, int status)
       write( 2, mess, strlen(mess ));
     */
 
-    job_iterator_t jobs;
-    while (! found_proc && (j = jobs.next()))
+    process_t *prev = NULL;
+    j = job_find_process(pid, &p, &prev);
+    if (j != NULL)
     {
-        process_t *prev=0;
-        for (p=j->first_process; p; p=p->next)
+        /*				snprintf( mess,
+          MESS_SIZE,
+          "Process %d is %ls from job %ls\n",
+          (int) pid, p->actual_cmd, j->command );
+          write( 2, mess, strlen(mess ));
+        */
+
+        mark_process_status(j, p, status);
+        if (p->completed && prev != 0)
         {
-            if (pid == p->pid)
+            if (!prev->completed && prev->pid)
             {
-                /*				snprintf( mess,
+                /*					snprintf( mess,
                   MESS_SIZE,
-                  "Process %d is %ls from job %ls\n",
-                  (int) pid, p->actual_cmd, j->command );
+                  "Kill previously uncompleted process %ls (%d)\n",
+                  prev->actual_cmd,
+                  prev->pid );
                   write( 2, mess, strlen(mess ));
                 */
-
-                mark_process_status(j, p, status);
-                if (p->completed && prev != 0)
-                {
-                    if (!prev->completed && prev->pid)
-                    {
-                        /*					snprintf( mess,
-                          MESS_SIZE,
-                          "Kill previously uncompleted process %ls (%d)\n",
-                          prev->actual_cmd,
-                          prev->pid );
-                          write( 2, mess, strlen(mess ));
-                        */
-                        kill(prev->pid,SIGPIPE);
-                    }
-                }
-                found_proc = true;
-                break;
+                kill(prev->pid,SIGPIPE);
             }
-            prev = p;
         }
+        found_proc = true;
     }
 
 
@@ -542,6 +651,7 @@ job_t::job_t(job_id_t jobid, const io_chain_t &bio) :
 
 job_t::~job_t()
 {
+    job_unindex_pids(this);
     if (first_process != NULL)
         delete first_process;
     release_job_id(job_id);
@@ -630,6 +740,16 @@ void job_handle_signal(int signal, siginfo_t *info, void *con)
 {
     /* This is the only place that this generation count is modified. It's OK if it overflows. */
     s_sigchld_generation_count += 1;
+
+    /* Wake up select_try and the reader. If the pipe is full, there is a wakeup pending already. */
+    if (s_sigchld_pipe[1] >= 0)
+    {
+        int saved_errno = errno;
+        char c = 0;
+        ssize_t ignored = write(s_sigchld_pipe[1], &c, 1);
+        (void)ignored;
+        errno = saved_errno;
+    }
 }
 
 /* Given a command like "cat file", truncate it to a reasonable length */
@@ -691,6 +811,11 @@ void proc_fire_event(const wchar_t *msg, int type, pid_t pid, int status)
 
     event.type=type;
     event.param1.pid = pid;
+    if (! event_is_observed(event))
+    {
+        event_fire(NULL);
+        return;
+    }
 
     event.arguments.push_back(msg);
     event.arguments.push_back(to_string<int>(pid));
@@ -952,6 +1077,9 @@ void proc_update_jiffies()
     {
         for (p=job->first_process; p; p=p->next)
         {
+            /* A completed process has been reaped, so its pid may belong to another process by now */
+            if (p->completed)
+                continue;
             gettimeofday(&p->last_time, 0);
             p->last_jiffies = proc_get_jiffies(p);
         }
@@ -996,13 +1124,28 @@ static int select_try(job_t *j)
         int retval;
         struct timeval tv;
 
-        tv.tv_sec=0;
-        tv.tv_usec=10000;
+        /* Also wake up when a child changes state. Then we only need to poll quickly to notice that a tab completion was cancelled. The long timeout is a safety net in case a child changes state while no SIGCHLD handler is installed. */
+        const int sigchld_fd = s_sigchld_pipe[0];
+        if (sigchld_fd >= 0)
+        {
+            FD_SET(sigchld_fd, &fds);
+            maxfd = maxi(maxfd, sigchld_fd);
+        }
+        const bool poll_quickly = sigchld_fd < 0 || reader_thread_job_can_become_stale();
+
+        tv.tv_sec = poll_quickly ? 0 : 1;
+        tv.tv_usec = poll_quickly ? 10000 : 0;
 
         retval =select(maxfd+1, &fds, 0, 0, &tv);
         if (retval == 0) {
             debug(3, L"select_try hit timeout\n");
         }
+        if (retval > 0 && sigchld_fd >= 0 && FD_ISSET(sigchld_fd, &fds))
+        {
+            /* Our caller looks for finished children after every select anyway */
+            proc_drain_child_status_fd();
+            retval -= 1;
+        }
         return retval > 0;
     }
 
@@ -1073,10 +1216,33 @@ static void read_try(job_t *j)
    a job that has previously been stopped. In that case, we need to
    set the terminal attributes to those saved in the job.
  */
+/* Like tcsetpgrp and tcsetattr, but retry if a signal interrupts them. Blocking signals does not mask them, so this can happen while the terminal is handed over. */
+static int tcsetpgrp_retry(int fd, pid_t pgrp)
+{
+    int ret;
+    do
+    {
+        ret = tcsetpgrp(fd, pgrp);
+    }
+    while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+static int tcsetattr_retry(int fd, int actions, const struct termios *modes)
+{
+    int ret;
+    do
+    {
+        ret = tcsetattr(fd, actions, modes);
+    }
+    while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
 static bool terminal_give_to_job(job_t *j, int cont)
 {
 
-    if (tcsetpgrp(0, j->pgid))
+    if (tcsetpgrp_retry(0, j->pgid))
     {
         debug(1,
               _(L"Could not send job %d ('%ls') to foreground"),
@@ -1088,7 +1254,7 @@ static bool terminal_give_to_job(job_t *j, int cont)
 
     if (cont)
     {
-        if (tcsetattr(0, TCSADRAIN, &j->tmodes))
+        if (tcsetattr_retry(0, TCSADRAIN, &j->tmodes))
         {
             debug(1,
                   _(L"Could not send job %d ('%ls') to foreground"),
@@ -1109,7 +1275,7 @@ static bool terminal_give_to_job(job_t *j, int cont)
 static int terminal_return_from_job(job_t *j)
 {
 
-    if (tcsetpgrp(0, getpgrp()))
+    if (tcsetpgrp_retry(0, getpgrp()))
     {
         debug(1, _(L"Could not return shell to foreground"));
         wperror(L"tcsetpgrp");
@@ -1219,6 +1385,7 @@ void job_continue(job_t *j, bool cont)
             /*
                Wait for job to report.
             */
+            bool interrupted_for_completion = false;
             while (! reader_exit_forced() && ! job_is_stopped(j) && ! job_is_completed(j))
             {
 //					debug( 1, L"select_try()" );
@@ -1255,6 +1422,19 @@ void job_continue(job_t *j, bool cont)
                         break;
                     }
                 }
+
+                /* A command substitution run by tab completion is interrupted, like with ^C, once the user has typed something, so that they don't wait for a completion they no longer want. The output of such jobs is buffered, so we come by here every few milliseconds. */
+                if (! interrupted_for_completion && ! job_is_completed(j) && reader_thread_job_is_stale())
+                {
+                    interrupted_for_completion = true;
+                    for (process_t *p = j->first_process; p; p = p->next)
+                    {
+                        if (! p->completed && p->pid != 0)
+                        {
+                            kill(p->pid, SIGINT);
+                        }
+                    }
+                }
             }
         }
     }
@@ -43,6 +43,11 @@
 */
 #define STATUS_UNMATCHED_WILDCARD 124
 
+/**
+   The status code used when a command substitution produced more output than fish_read_limit allows
+*/
+#define STATUS_READ_TOO_MUCH 122
+
 /**
    The status code used for normal exit in a  builtin
 */
@@ -500,6 +505,11 @@ job_t *job_get(job_id_t id);
 */
 job_t *job_get_from_pid(int pid);
 
+/**
+   Add the processes of a launched job to the index used to find the job of a process by its pid.
+*/
+void job_index_pids(job_t *j);
+
 /**
    Tests if the job is stopped
 */
@@ -578,6 +588,18 @@ void proc_fire_event(const wchar_t *msg, int type, pid_t pid, int status);
 */
 void proc_init();
 
+/**
+   Returns a file descriptor that becomes readable whenever a child
+   process changes state, or -1 if there is none. Once it is
+   readable, call proc_drain_child_status_fd and then job_reap.
+*/
+int proc_child_status_fd();
+
+/**
+   Consume the pending notifications on proc_child_status_fd.
+*/
+void proc_drain_child_status_fd();
+
 /**
    Clean up before exiting
 */
@@ -47,6 +47,8 @@ commence.
 #include <fcntl.h>
 #include <wchar.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #include "fallback.h"
@@ -73,6 +75,7 @@ commence.
 #include "signal.h"
 #include "screen.h"
 #include "iothread.h"
+#include "path.h"
 #include "intern.h"
 #include "parse_util.h"
 #include "parse_tree.h"
@@ -121,6 +124,13 @@ commence.
 */
 #define READAHEAD_MAX 256
 
+/**
+   The minimum time in seconds between repaints while more input is
+   waiting to be read, e.g. during a paste. Once the input has been
+   handled, the command line is repainted right away.
+*/
+#define REPAINT_MIN_INTERVAL 0.05
+
 /**
    A mode for calling the reader_kill function. In this mode, the new
    string is appended to the current contents of the kill buffer.
@@ -160,8 +170,72 @@ commence.
 /* Any time the contents of a buffer changes, we update the generation count. This allows for our background highlighting thread to notice it and skip doing work that it would otherwise have to do. This variable should really be of some kind of interlocked or atomic type that guarantees we're not reading stale cache values. With C++11 we should use atomics, but until then volatile should work as well, at least on x86.*/
 static volatile unsigned int s_generation_count;
 
-/* This pthreads generation count is set when an autosuggestion background thread starts up, so it can easily check if the work it is doing is no longer useful. */
-static pthread_key_t generation_count_key;
+/* This pthreads key holds the cancellation token of the background job running on a thread, if any, so the job can easily check if the work it is doing is no longer useful. */
+static pthread_key_t job_token_key;
+
+/**
+   A cancellation token for a background job of the reader, like
+   highlighting or autosuggestion. It records the generation count the
+   job was started for. While it is in scope, reader_thread_job_is_stale()
+   on its thread reports whether the command line has changed since then.
+   Tokens are scoped because iothread workers go on to run unrelated work.
+*/
+class reader_job_token_t
+{
+    const unsigned int generation_count;
+
+public:
+    explicit reader_job_token_t(unsigned int gen) : generation_count(gen)
+    {
+        VOMIT_ON_FAILURE(pthread_setspecific(job_token_key, this));
+    }
+
+    virtual ~reader_job_token_t()
+    {
+        VOMIT_ON_FAILURE(pthread_setspecific(job_token_key, NULL));
+    }
+
+    virtual bool is_stale() const
+    {
+        return generation_count != s_generation_count;
+    }
+};
+
+/* How often, in seconds, a completion token looks for input */
+static const double kCompletionInputPollInterval = 0.02;
+
+/**
+   A cancellation token for tab completion, which runs on the main thread
+   and may take a long time. It goes stale as soon as the user types
+   something, so they needn't wait for a completion they have moved on
+   from; the keys are then read as usual. Input that was already waiting
+   when completion started is typeahead and doesn't count.
+*/
+class reader_completion_token_t : public reader_job_token_t
+{
+    const bool watch_input;
+    mutable bool input_arrived;
+    mutable double last_poll;
+
+public:
+    reader_completion_token_t() : reader_job_token_t(s_generation_count), watch_input(! input_common_has_pending_input()), input_arrived(false), last_poll(timef())
+    {
+    }
+
+    virtual bool is_stale() const
+    {
+        if (! input_arrived && watch_input)
+        {
+            const double now = timef();
+            if (now - last_poll >= kCompletionInputPollInterval)
+            {
+                last_poll = now;
+                input_arrived = input_common_has_pending_input();
+            }
+        }
+        return input_arrived || reader_job_token_t::is_stale();
+    }
+};
 
 static void set_command_line_and_position(editable_line_t *el, const wcstring &new_str, size_t pos);
 
@@ -352,6 +426,17 @@ public:
     /** Whether a screen reset is needed after a repaint. */
     bool screen_reset_needed;
 
+    /** When the command line was last painted, for limiting repaints while input is pending */
+    double last_repaint_time;
+
+    /** Whether highlighting the command line has been put off until pending input has been handled, and the adjustment to its bracket matching position */
+    bool highlight_deferred;
+    int deferred_highlight_pos_adjust;
+
+    /** Whether running the prompt commands has been put off until pending input has been handled (see fish_async_prompt), and the exit status they should see */
+    bool prompt_deferred;
+    int deferred_prompt_status;
+
     /** Whether the reader should exit on ^C. */
     bool exit_on_interrupt;
 
@@ -377,6 +462,11 @@ public:
         search_mode(0),
         repaint_needed(0),
         screen_reset_needed(0),
+        last_repaint_time(0),
+        highlight_deferred(false),
+        deferred_highlight_pos_adjust(0),
+        prompt_deferred(false),
+        deferred_prompt_status(0),
         exit_on_interrupt(0)
     {
     }
@@ -436,12 +526,40 @@ static void reader_super_highlight_me_plenty(int highlight_pos_adjust = 0, bool
 static int exit_forced;
 
 
+/**
+   Whether the terminal has been asked to use bracketed paste mode,
+   where it marks pasted text with escape sequences.
+*/
+static bool s_bracketed_paste_enabled = false;
+
+bool reader_set_bracketed_paste(bool enable)
+{
+    const bool was_enabled = s_bracketed_paste_enabled;
+    if (enable == was_enabled)
+        return was_enabled;
+
+    if (enable)
+    {
+        const env_var_t term = env_get_string(L"TERM");
+        if (! isatty(STDOUT_FILENO) || term.missing() || term == L"dumb")
+            return was_enabled;
+        write_loop(STDOUT_FILENO, "\x1b[?2004h", 8);
+    }
+    else
+    {
+        write_loop(STDOUT_FILENO, "\x1b[?2004l", 8);
+    }
+    s_bracketed_paste_enabled = enable;
+    return was_enabled;
+}
+
 /**
    Give up control of terminal
 */
 static void term_donate()
 {
     set_color(rgb_color_t::normal(), rgb_color_t::normal());
+    reader_set_bracketed_paste(false);
 
     while (1)
     {
@@ -616,6 +734,7 @@ static void reader_repaint()
             focused_on_pager);
 
     data->repaint_needed = false;
+    data->last_repaint_time = timef();
 }
 
 /** Internal helper function for handling killing parts of text. */
@@ -877,8 +996,13 @@ int reader_reading_interrupted()
 
 bool reader_thread_job_is_stale()
 {
-    ASSERT_IS_BACKGROUND_THREAD();
-    return (void*)(uintptr_t) s_generation_count != pthread_getspecific(generation_count_key);
+    const reader_job_token_t *token = static_cast<const reader_job_token_t *>(pthread_getspecific(job_token_key));
+    return token != NULL && token->is_stale();
+}
+
+bool reader_thread_job_can_become_stale()
+{
+    return pthread_getspecific(job_token_key) != NULL;
 }
 
 void reader_write_title(const wcstring &cmd)
@@ -959,6 +1083,15 @@ void reader_write_title(const wcstring &cmd)
 */
 static void exec_prompt()
 {
+    /* A deferred prompt sees the exit status of the command that preceded it, not that of any key bindings run since */
+    const bool was_deferred = data->prompt_deferred;
+    const int status = proc_get_last_status();
+    if (was_deferred)
+    {
+        proc_set_last_status(data->deferred_prompt_status);
+        data->prompt_deferred = false;
+    }
+
     /* Clear existing prompts */
     data->left_prompt_buff.clear();
     data->right_prompt_buff.clear();
@@ -1012,11 +1145,23 @@ static void exec_prompt()
 
     /* Write the screen title */
     reader_write_title(L"");
+
+    if (was_deferred)
+        proc_set_last_status(status);
+}
+
+/**
+   Whether the previous prompt should be shown while the prompt commands have not been run for a new command line, as asked for by fish_async_prompt
+*/
+static bool async_prompt_enabled()
+{
+    const env_var_t var = env_get_string(L"fish_async_prompt");
+    return ! var.missing_or_empty() && from_string<bool>(var);
 }
 
 void reader_init()
 {
-    VOMIT_ON_FAILURE(pthread_key_create(&generation_count_key, NULL));
+    VOMIT_ON_FAILURE(pthread_key_create(&job_token_key, NULL));
 
     /* Save the initial terminal mode */
     tcgetattr(STDIN_FILENO, &terminal_mode_on_startup);
@@ -1048,7 +1193,7 @@ void reader_init()
 
 void reader_destroy()
 {
-    pthread_key_delete(generation_count_key);
+    pthread_key_delete(job_token_key);
 }
 
 void restore_term_mode()
@@ -1079,6 +1224,25 @@ void reader_repaint_needed()
     }
 }
 
+/** Whether reader_repaint_if_needed_one_arg is queued as an input callback */
+static bool s_repaint_callback_queued = false;
+
+static void reader_repaint_if_needed_one_arg(void * unused)
+{
+    s_repaint_callback_queued = false;
+    reader_repaint_if_needed();
+}
+
+/** Make sure reader_repaint_if_needed runs before we next wait for input */
+static void queue_repaint_callback()
+{
+    if (! s_repaint_callback_queued)
+    {
+        s_repaint_callback_queued = true;
+        input_common_add_callback(reader_repaint_if_needed_one_arg, NULL);
+    }
+}
+
 void reader_repaint_if_needed()
 {
     if (data == NULL)
@@ -1087,6 +1251,36 @@ void reader_repaint_if_needed()
     bool needs_reset = data->screen_reset_needed;
     bool needs_repaint = needs_reset || data->repaint_needed;
 
+    /* While more input is waiting, repaint at most once per REPAINT_MIN_INTERVAL, and leave any deferred highlighting for when the input has been handled. */
+    bool input_pending = (needs_repaint || data->highlight_deferred) && input_common_has_pending_input();
+    if (needs_repaint && ! needs_reset && input_pending && timef() - data->last_repaint_time < REPAINT_MIN_INTERVAL)
+    {
+        queue_repaint_callback();
+        return;
+    }
+
+    /* Run deferred prompt commands once the input waiting for them has been handled */
+    if (data->prompt_deferred)
+    {
+        if (input_common_has_pending_input())
+        {
+            queue_repaint_callback();
+        }
+        else
+        {
+            needs_reset = true;
+            needs_repaint = true;
+        }
+    }
+
+    if (data->highlight_deferred && ! input_pending)
+    {
+        /* The command line may have been edited since the highlight was deferred */
+        const editable_line_t *el = &data->command_line;
+        reader_super_highlight_me_plenty(el->position > 0 ? data->deferred_highlight_pos_adjust : 0);
+        needs_repaint = true;
+    }
+
     if (needs_reset)
     {
         exec_prompt();
@@ -1101,13 +1295,19 @@ void reader_repaint_if_needed()
     }
 }
 
-static void reader_repaint_if_needed_one_arg(void * unused)
+/** Request a repaint once pending background work and input have been handled, so that a burst of requests paints only once */
+static void reader_repaint_soon()
 {
-    reader_repaint_if_needed();
+    if (data == NULL)
+        return;
+    data->repaint_needed = true;
+    queue_repaint_callback();
 }
 
 void reader_react_to_color_change()
 {
+    highlight_invalidate_colors();
+
     if (! data)
         return;
 
@@ -1115,7 +1315,7 @@ void reader_react_to_color_change()
     {
         data->repaint_needed = true;
         data->screen_reset_needed = true;
-        input_common_add_callback(reader_repaint_if_needed_one_arg, NULL);
+        queue_repaint_callback();
     }
 }
 
@@ -1258,12 +1458,20 @@ static bool insert_string(editable_line_t *el, const wcstring &str, bool allow_e
     {
         data->suppress_autosuggestion = false;
         
-        /* Syntax highlight. Note we must have that buff_pos > 0 because we just added something nonzero to its length  */
+        /* Syntax highlight. Note we must have that buff_pos > 0 because we just added something nonzero to its length. If more input is waiting (e.g. during a paste), put it off until that has been handled. */
         assert(el->position > 0);
-        reader_super_highlight_me_plenty(-1);
+        if (input_common_has_pending_input())
+        {
+            data->highlight_deferred = true;
+            data->deferred_highlight_pos_adjust = -1;
+        }
+        else
+        {
+            reader_super_highlight_me_plenty(-1);
+        }
     }
     
-    reader_repaint();
+    reader_repaint_needed();
 
     return true;
 }
@@ -1410,22 +1618,207 @@ static void completion_insert(const wchar_t *val, complete_flags_t flags)
     data->suppress_autosuggestion = true;
 }
 
+/* Autosuggestion candidates from history are validated in parallel, in batches of this size */
+#define AUTOSUGGEST_VALIDATION_BATCH_SIZE 4
+
+/* How many candidates from history we consider at first, best ranked first. If none of them is valid, we look at four times as many, and so on. */
+#define AUTOSUGGEST_CANDIDATE_LIMIT 256
+
+/* How long we wait for a batch of candidates to be validated before giving up on the slow ones, in microseconds */
+#define AUTOSUGGEST_VALIDATION_BUDGET_USEC (100 * 1000)
+
+/* Shared state for validating a batch of autosuggestion candidates, each as its own iothread request. Requests that run over the time budget are abandoned rather than waited for, so the batch is reference counted, and freed by whoever releases it last. */
+class autosuggest_validation_batch_t
+{
+    /* No copying */
+    autosuggest_validation_batch_t(const autosuggest_validation_batch_t &);
+    autosuggest_validation_batch_t &operator=(const autosuggest_validation_batch_t &);
+
+    size_t refcount;
+
+public:
+    enum result_t
+    {
+        result_pending,
+        result_valid,
+        result_invalid
+    };
+
+    /* Protects refcount and results */
+    pthread_mutex_t lock;
+
+    /* Signalled whenever a result comes in */
+    pthread_cond_t cond;
+
+    const std::vector<history_item_t> candidates;
+    std::vector<result_t> results;
+    history_t * const history;
+    const wcstring working_directory;
+    const env_vars_snapshot_t vars;
+    const unsigned int generation_count;
+
+    autosuggest_validation_batch_t(const std::vector<history_item_t> &cands, history_t *hist, const wcstring &wd, const env_vars_snapshot_t &vs, unsigned int gen) :
+        refcount(1),
+        candidates(cands),
+        results(cands.size(), result_pending),
+        history(hist),
+        working_directory(wd),
+        vars(vs),
+        generation_count(gen)
+    {
+        VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&cond, NULL));
+    }
+
+    ~autosuggest_validation_batch_t()
+    {
+        VOMIT_ON_FAILURE(pthread_cond_destroy(&cond));
+        VOMIT_ON_FAILURE(pthread_mutex_destroy(&lock));
+    }
+
+    void retain()
+    {
+        scoped_lock locker(lock);
+        refcount++;
+    }
+
+    /* Drops a reference, deleting the batch if it was the last one */
+    void release()
+    {
+        bool last;
+        {
+            scoped_lock locker(lock);
+            assert(refcount > 0);
+            last = (--refcount == 0);
+        }
+        if (last)
+            delete this;
+    }
+};
+
+/* Identifies one candidate of a batch for a validation request */
+struct autosuggest_validation_job_t
+{
+    autosuggest_validation_batch_t *batch;
+    size_t idx;
+};
+
+/* Validates one candidate of a batch and records the result. Call without the batch lock held. */
+static void validate_autosuggestion_candidate(autosuggest_validation_batch_t *batch, size_t idx)
+{
+    file_detection_context_t detector(batch->history);
+    detector.working_directory = batch->working_directory;
+    bool valid = autosuggest_validate_from_history(batch->candidates.at(idx), detector, batch->working_directory, batch->vars);
+
+    scoped_lock locker(batch->lock);
+    batch->results.at(idx) = valid ? autosuggest_validation_batch_t::result_valid : autosuggest_validation_batch_t::result_invalid;
+    VOMIT_ON_FAILURE(pthread_cond_broadcast(&batch->cond));
+}
+
+static int perform_autosuggest_validation(autosuggest_validation_job_t *param)
+{
+    autosuggest_validation_job_t *job = static_cast<autosuggest_validation_job_t *>(param);
+    autosuggest_validation_batch_t *batch = job->batch;
+    const size_t idx = job->idx;
+    delete job;
+
+    /* Let expansion notice if the main thread has moved on */
+    reader_job_token_t token(batch->generation_count);
+
+    validate_autosuggestion_candidate(batch, idx);
+    batch->release();
+    return 0;
+}
+
+/* Validates the given candidates, returning the index of the first valid one in history order, or -1 if there is none. This runs on a worker already, so the first candidate is validated right here, and the others are handed to workers only while some are free; waiting on requests that no worker can start would just run out the time budget. Candidates not handed off are validated here, in order, when they are reached. Candidates that are still being validated when the time budget runs out are treated as invalid. */
+static long validate_autosuggestion_candidates(const std::vector<history_item_t> &candidates, history_t *history, const wcstring &working_directory, const env_vars_snapshot_t &vars, unsigned int generation_count)
+{
+    ASSERT_IS_BACKGROUND_THREAD();
+    autosuggest_validation_batch_t *batch = new autosuggest_validation_batch_t(candidates, history, working_directory, vars, generation_count);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long long deadline_usec = (long long)now.tv_sec * 1000000 + now.tv_usec + AUTOSUGGEST_VALIDATION_BUDGET_USEC;
+    struct timespec deadline;
+    deadline.tv_sec = (time_t)(deadline_usec / 1000000);
+    deadline.tv_nsec = (long)(deadline_usec % 1000000) * 1000;
+
+    /* Whether each candidate was handed to a worker */
+    std::vector<bool> queued(candidates.size(), false);
+    for (size_t i=1; i < candidates.size(); i++)
+    {
+        autosuggest_validation_job_t *job = new autosuggest_validation_job_t();
+        job->batch = batch;
+        job->idx = i;
+        batch->retain();
+
+        /* A candidate stuck on a hung filesystem keeps its worker busy until it returns, but the worker rejoins the pool then, and the pool stays bounded */
+        if (! iothread_perform_if_free(perform_autosuggest_validation, job, iothread_priority_interactive))
+        {
+            batch->release();
+            delete job;
+            break;
+        }
+        queued.at(i) = true;
+    }
+
+    long result = -1;
+    {
+        scoped_lock locker(batch->lock);
+        bool out_of_time = false;
+        for (;;)
+        {
+            /* Find the first candidate that may still be valid. If we're out of time, pending candidates count as invalid. */
+            size_t idx = 0;
+            while (idx < candidates.size() && (batch->results.at(idx) == autosuggest_validation_batch_t::result_invalid || (out_of_time && batch->results.at(idx) == autosuggest_validation_batch_t::result_pending)))
+            {
+                idx++;
+            }
+
+            if (idx == candidates.size())
+                break;
+
+            if (batch->results.at(idx) == autosuggest_validation_batch_t::result_valid)
+            {
+                result = (long)idx;
+                break;
+            }
+
+            if (! queued.at(idx))
+            {
+                /* Nobody else will validate this one */
+                locker.unlock();
+                validate_autosuggestion_candidate(batch, idx);
+                locker.lock();
+            }
+            /* Otherwise a worker is still validating it, so wait for more results */
+            else if (pthread_cond_timedwait(&batch->cond, &batch->lock, &deadline) == ETIMEDOUT)
+            {
+                out_of_time = true;
+            }
+
+            if (reader_thread_job_is_stale())
+                break;
+        }
+    }
+    batch->release();
+    return result;
+}
+
 struct autosuggestion_context_t
 {
     wcstring search_string;
     wcstring autosuggestion;
     size_t cursor_pos;
-    history_search_t searcher;
-    file_detection_context_t detector;
+    history_t * const history;
     const wcstring working_directory;
     const env_vars_snapshot_t vars;
     const unsigned int generation_count;
 
-    autosuggestion_context_t(history_t *history, const wcstring &term, size_t pos) :
+    autosuggestion_context_t(history_t *hist, const wcstring &term, size_t pos) :
         search_string(term),
         cursor_pos(pos),
-        searcher(*history, term, HISTORY_SEARCH_TYPE_PREFIX),
-        detector(history),
+        history(hist),
         working_directory(env_get_pwd_slash()),
         vars(env_vars_snapshot_t::highlighting_keys),
         generation_count(s_generation_count)
@@ -1443,7 +1836,7 @@ struct autosuggestion_context_t
             return 0;
         }
 
-        VOMIT_ON_FAILURE(pthread_setspecific(generation_count_key, (void*)(uintptr_t) generation_count));
+        reader_job_token_t token(generation_count);
 
         /* Let's make sure we aren't using the empty string */
         if (search_string.empty())
@@ -1451,18 +1844,45 @@ struct autosuggestion_context_t
             return 0;
         }
 
-        while (! reader_thread_job_is_stale() && searcher.go_backwards())
+        /* History items starting with the search string, ranked by how often and how recently they were used */
+        size_t candidate_limit = AUTOSUGGEST_CANDIDATE_LIMIT;
+        history_item_list_t ranked = history->items_with_prefix(search_string, candidate_limit);
+
+        /* Validate history items in batches, so that a slow filesystem only stalls us for a single time budget */
+        size_t next_ranked = 0;
+        while (! reader_thread_job_is_stale())
         {
-            history_item_t item = searcher.current_item();
+            if (next_ranked >= ranked.size())
+            {
+                /* None of the candidates was valid. Older items that are used less may be, so look further down the ranking, past the ones we have tried. */
+                if (ranked.size() < candidate_limit)
+                    break;
+                candidate_limit *= 4;
+                ranked = history->items_with_prefix(search_string, candidate_limit);
+                if (next_ranked >= ranked.size())
+                    break;
+            }
+
+            std::vector<history_item_t> candidates;
+            while (candidates.size() < AUTOSUGGEST_VALIDATION_BATCH_SIZE && next_ranked < ranked.size())
+            {
+                const history_item_t &item = ranked.at(next_ranked++);
 
-            /* Skip items with newlines because they make terrible autosuggestions */
-            if (item.str().find('\n') != wcstring::npos)
+                /* Skip items with newlines because they make terrible autosuggestions */
+                if (item.str().find('\n') != wcstring::npos)
+                    continue;
+
+                candidates.push_back(item);
+            }
+
+            if (candidates.empty())
                 continue;
 
-            if (autosuggest_validate_from_history(item, detector, working_directory, vars))
+            long valid_idx = validate_autosuggestion_candidates(candidates, history, working_directory, vars, generation_count);
+            if (valid_idx >= 0)
             {
                 /* The command autosuggestion was handled specially, so we're done */
-                this->autosuggestion = searcher.current_string();
+                this->autosuggestion = candidates.at(valid_idx).str();
                 return 1;
             }
         }
@@ -1537,7 +1957,7 @@ static void autosuggest_completed(autosuggestion_context_t *ctx, int result)
         /* Autosuggestion is active and the search term has not changed, so we're good to go */
         data->autosuggestion = ctx->autosuggestion;
         sanity_check();
-        reader_repaint();
+        reader_repaint_soon();
     }
     delete ctx;
 }
@@ -1551,7 +1971,8 @@ static void update_autosuggestion(void)
     {
         const editable_line_t *el = data->active_edit_line();
         autosuggestion_context_t *ctx = new autosuggestion_context_t(data->history, el->text, el->position);
-        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx);
+        env_publish();
+        iothread_perform(threaded_autosuggest, autosuggest_completed, ctx, iothread_priority_interactive);
     }
 }
 
@@ -1996,7 +2417,10 @@ static void reader_interactive_init()
     /* See if we are running interactively.  */
     pid_t shell_pgid;
 
+    /* This runs setupterm and reads the key sequences from terminfo */
+    long long input_start = get_monotonic_time();
     input_init();
+    startup_timing_report(L"input_init (terminfo)", input_start);
     kill_init();
     shell_pgid = getpgrp();
 
@@ -2293,7 +2717,8 @@ static void handle_token_history(int forward, int reset)
         {
 
             //debug( 3, L"new '%ls'", data->token_history_buff.c_str() );
-            tokenizer_t tok(data->token_history_buff.c_str(), TOK_ACCEPT_UNFINISHED);
+            const wchar_t *token_history = data->token_history_buff.c_str();
+            tokenizer_t tok(token_history, TOK_ACCEPT_UNFINISHED);
             tok_t token;
             while (tok.next(&token))
             {
@@ -2301,7 +2726,8 @@ static void handle_token_history(int forward, int reset)
                 {
                     case TOK_STRING:
                     {
-                        if (token.text.find(data->search_buff) != wcstring::npos)
+                        const wchar_t *text_begin = token_history + token.offset, *text_end = text_begin + token.length;
+                        if (std::search(text_begin, text_end, data->search_buff.begin(), data->search_buff.end()) != text_end)
                         {
                             //debug( 3, L"Found token at pos %d\n", tok_get_pos( &tok ) );
                             if (token.offset >= current_pos)
@@ -2310,10 +2736,11 @@ static void handle_token_history(int forward, int reset)
                             }
                             //debug( 3, L"ok pos" );
 
-                            if (find(data->search_prev.begin(), data->search_prev.end(), token.text) == data->search_prev.end())
+                            const wcstring text(text_begin, text_end);
+                            if (find(data->search_prev.begin(), data->search_prev.end(), text) == data->search_prev.end())
                             {
                                 data->token_history_pos = token.offset;
-                                str = token.text;
+                                str = text;
                             }
 
                         }
@@ -2713,6 +3140,7 @@ public:
     {
     }
 
+    /* Returns 1 if the colors were computed, 0 if the request went stale first */
     int perform_highlight()
     {
         if (generation_count != s_generation_count)
@@ -2720,11 +3148,14 @@ public:
             // The gen count has changed, so don't do anything
             return 0;
         }
+
+        /* Let the highlighter give up early if the gen count changes while it works. Its colors are then incomplete. */
+        reader_job_token_t token(generation_count);
         if (! string_to_highlight.empty())
         {
             highlight_function(string_to_highlight, colors, match_highlight_pos, NULL /* error */, vars);
         }
-        return 0;
+        return reader_thread_job_is_stale() ? 0 : 1;
     }
 };
 
@@ -2750,7 +3181,7 @@ static void highlight_search(void)
 static void highlight_complete(background_highlight_context_t *ctx, int result)
 {
     ASSERT_IS_MAIN_THREAD();
-    if (ctx->string_to_highlight == data->command_line.text)
+    if (result && ctx->string_to_highlight == data->command_line.text)
     {
         /* The data hasn't changed, so swap in our colors. The colors may not have changed, so do nothing if they have not. */
         assert(ctx->colors.size() == data->command_line.size());
@@ -2759,7 +3190,7 @@ static void highlight_complete(background_highlight_context_t *ctx, int result)
             data->colors.swap(ctx->colors);
             sanity_check();
             highlight_search();
-            reader_repaint();
+            reader_repaint_soon();
         }
     }
 
@@ -2790,6 +3221,7 @@ static void reader_super_highlight_me_plenty(int match_highlight_pos_adjust, boo
     assert(match_highlight_pos >= 0);
 
     reader_sanity_check();
+    data->highlight_deferred = false;
 
     highlight_function_t highlight_func = no_io ? highlight_shell_no_io : data->highlight_function;
     background_highlight_context_t *ctx = new background_highlight_context_t(el->text, match_highlight_pos, highlight_func);
@@ -2803,7 +3235,8 @@ static void reader_super_highlight_me_plenty(int match_highlight_pos_adjust, boo
     else
     {
         // Highlighting including I/O proceeds in the background
-        iothread_perform(threaded_highlight, highlight_complete, ctx);
+        env_publish();
+        iothread_perform(threaded_highlight, highlight_complete, ctx, iothread_priority_interactive);
     }
     highlight_search();
 
@@ -2911,6 +3344,99 @@ static bool selection_is_at_top()
 }
 
 
+/* How many of the most used commands to prewarm, and how many history items to count them in */
+static const size_t kPrewarmCommandCount = 24;
+static const size_t kPrewarmHistoryItems = 512;
+
+/* The variables consulted when looking for autoloadable files */
+static const wchar_t * const prewarm_keys[] = {L"fish_function_path", L"fish_complete_path", NULL};
+
+struct autoload_prewarm_t
+{
+    history_t * const history;
+    const env_vars_snapshot_t vars;
+
+    /* The commands whose function and completion files exist, to be loaded on the main thread */
+    wcstring_list_t functions;
+    wcstring_list_t completions;
+    size_t next_function;
+    size_t next_completion;
+
+    explicit autoload_prewarm_t(history_t *hist) :
+        history(hist),
+        vars(prewarm_keys),
+        next_function(0),
+        next_completion(0)
+    {
+    }
+};
+
+/* Picks the most used commands from history and probes for their files, which fills the autoloaders' directory listings off of the main thread */
+static int threaded_prewarm(autoload_prewarm_t *ctx)
+{
+    ASSERT_IS_BACKGROUND_THREAD();
+    const wcstring_list_t commands = ctx->history->most_used_commands(kPrewarmCommandCount, kPrewarmHistoryItems);
+    for (size_t i=0; i < commands.size(); i++)
+    {
+        const wcstring &cmd = commands.at(i);
+        if (function_exists_no_autoload(cmd, ctx->vars))
+            ctx->functions.push_back(cmd);
+        if (complete_can_load(cmd, ctx->vars))
+            ctx->completions.push_back(cmd);
+    }
+    return 0;
+}
+
+/* Loads the prewarmed files, a few at a time so that typing is not held up. Loading runs fish script, so this only happens at the interactive command line, and never while another reader (like that of the read builtin) is active. */
+static void prewarm_load_some(void *arg)
+{
+    autoload_prewarm_t *ctx = static_cast<autoload_prewarm_t *>(arg);
+    if (data == NULL || data->next != NULL || data->end_loop)
+    {
+        if (data == NULL)
+        {
+            delete ctx;
+        }
+        else
+        {
+            input_common_add_callback(prewarm_load_some, ctx);
+        }
+        return;
+    }
+
+    while (! input_common_has_pending_input())
+    {
+        if (ctx->next_function < ctx->functions.size())
+        {
+            function_exists(ctx->functions.at(ctx->next_function++));
+        }
+        else if (ctx->next_completion < ctx->completions.size())
+        {
+            complete_load(ctx->completions.at(ctx->next_completion++), false);
+        }
+        else
+        {
+            delete ctx;
+            return;
+        }
+    }
+    input_common_add_callback(prewarm_load_some, ctx);
+}
+
+static void prewarm_completed(autoload_prewarm_t *ctx, int unused)
+{
+    prewarm_load_some(ctx);
+}
+
+/* Preloads the functions and completions of the commands used most, so that their first use after startup does not wait for them */
+static void prewarm_autoloads(void)
+{
+    if (data->history == NULL)
+        return;
+    autoload_prewarm_t *ctx = new autoload_prewarm_t(data->history);
+    iothread_perform(threaded_prewarm, prewarm_completed, ctx, iothread_priority_background);
+}
+
 /**
    Read interactively. Read input from stdin while providing editing
    facilities.
@@ -2929,6 +3455,9 @@ static int read_i(void)
 
     data->prev_end_loop=0;
 
+    /* This finishes once the first prompt is up */
+    prewarm_autoloads();
+
     while ((!data->end_loop) && (!sanity_check()))
     {
         event_fire_generic(L"fish_prompt");
@@ -3078,15 +3607,37 @@ const wchar_t *reader_readline(int nchars)
     data->cycle_command_line.clear();
     data->cycle_cursor_pos = 0;
 
+    /* Commands run since the last command line may have changed what completion conditions test */
+    complete_invalidate_conditions();
+
+    /* They may also have created commands or directories, which highlighting should see right away */
+    path_cache_recheck();
+
+    /* And changed the abbreviations, which highlighting threads only read once parsed here */
+    expand_abbreviations_update();
+
     data->search_buff.clear();
     data->search_mode = NO_SEARCH;
 
-    exec_prompt();
+    /* With fish_async_prompt, show the previous prompt right away and run the prompt commands once input is idle, so that keys typed meanwhile are handled without waiting for them */
+    if (async_prompt_enabled() && ! (data->left_prompt_buff.empty() && data->right_prompt_buff.empty()))
+    {
+        data->prompt_deferred = true;
+        data->deferred_prompt_status = proc_get_last_status();
+        queue_repaint_callback();
+    }
+    else
+    {
+        exec_prompt();
+    }
 
     reader_super_highlight_me_plenty();
     s_reset(&data->screen, screen_reset_abandon_line);
     reader_repaint();
 
+    /* Startup ends with the first prompt */
+    startup_timings_end();
+
     /*
      get the current terminal modes. These will be restored when the
      function returns.
@@ -3113,6 +3664,7 @@ const wchar_t *reader_readline(int nchars)
          but it should be ignored. (Example: Trying to add a tilde
          (~) to digit)
          */
+        reader_set_bracketed_paste(true);
         while (1)
         {
             int was_interactive_read = is_interactive_read;
@@ -3349,7 +3901,19 @@ const wchar_t *reader_readline(int nchars)
                     const wcstring buffcpy = wcstring(cmdsub_begin, token_end);
 
                     //fprintf(stderr, "Complete (%ls)\n", buffcpy.c_str());
-                    data->complete_func(buffcpy, comp, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS | COMPLETION_REQUEST_FUZZY_MATCH);
+                    bool completion_cancelled;
+                    {
+                        reader_completion_token_t token;
+                        data->complete_func(buffcpy, comp, COMPLETION_REQUEST_DEFAULT | COMPLETION_REQUEST_DESCRIPTIONS | COMPLETION_REQUEST_FUZZY_MATCH | COMPLETION_REQUEST_REUSE_CONDITIONS);
+                        completion_cancelled = token.is_stale();
+                    }
+                    if (completion_cancelled)
+                    {
+                        /* The user typed something while we were completing. What we found may be incomplete, so drop it and handle their keys. */
+                        comp.clear();
+                        comp_empty = true;
+                        break;
+                    }
 
                     /* Munge our completions */
                     sort_and_make_unique(comp);
@@ -3484,6 +4048,43 @@ const wchar_t *reader_readline(int nchars)
                 break;
             }
 
+            /* The terminal sent pasted text in bracketed paste mode. Insert it as a whole, without running key bindings for it. */
+            case R_BEGIN_PASTE:
+            {
+                wcstring text = input_read_bracketed_paste();
+
+                /* Terminals send line breaks as carriage returns. Other control characters would only confuse the command line. */
+                wcstring pasted;
+                pasted.reserve(text.size());
+                for (size_t i = 0; i < text.size(); i++)
+                {
+                    wchar_t wc = text.at(i);
+                    if (wc == L'\r')
+                    {
+                        if (i + 1 < text.size() && text.at(i + 1) == L'\n')
+                            continue;
+                        wc = L'\n';
+                    }
+                    if (wc < 32 && wc != L'\n' && wc != L'\t')
+                        continue;
+                    pasted.push_back(wc);
+                }
+
+                if (0 < nchars)
+                {
+                    size_t room = (size_t)nchars > data->command_line.size() ? (size_t)nchars - data->command_line.size() : 0;
+                    if (pasted.size() > room)
+                        pasted.resize(room);
+                }
+
+                editable_line_t *el = data->active_edit_line();
+                if (insert_string(el, pasted) && el == &data->command_line)
+                {
+                    clear_pager();
+                }
+                break;
+            }
+
             /* Escape was pressed */
             case L'\x1b':
             {
@@ -4178,6 +4779,10 @@ const wchar_t *reader_readline(int nchars)
         reader_repaint_if_needed();
     }
 
+    /* A prompt that was never run is stale by the next command line */
+    data->prompt_deferred = false;
+
+    reader_set_bracketed_paste(false);
     writestr(L"\n");
 
     /* Ensure we have no pager contents when we exit */
@@ -4221,6 +4826,87 @@ int reader_has_pager_contents()
     return ! data->current_page_rendering.screen_data.empty();
 }
 
+/**
+   Read the rest of a regular file by mapping it, and decode it straight
+   into \c out_str. This skips the intermediate copy of the bytes. Returns
+   false if the file should not be mapped, in which case nothing has been
+   read.
+
+   A file that is truncated while it is mapped raises SIGBUS when the
+   missing pages are touched, so files modified in the last couple of
+   seconds, which may still be being written, are read instead. So are
+   files with a size of zero, which on procfs and some FUSE file systems
+   means the size is unknown rather than that there is nothing to read.
+*/
+static bool read_ni_mapped(int des, wcstring *out_str)
+{
+    struct stat buf;
+    if (fstat(des, &buf) != 0 || ! S_ISREG(buf.st_mode) || buf.st_size == 0)
+        return false;
+
+    if (buf.st_mtime >= time(NULL) - 2)
+        return false;
+
+    /* Scripts on stdin may have been read partially already */
+    off_t start = lseek(des, 0, SEEK_CUR);
+    if (start < 0 || start > buf.st_size)
+        return false;
+
+    size_t length = (size_t)buf.st_size;
+    if ((off_t)length != buf.st_size)
+        return false;
+
+    if ((size_t)start < length)
+    {
+        void *map = mmap(0, length, PROT_READ, MAP_PRIVATE, des, 0);
+        if (map == MAP_FAILED)
+            return false;
+
+        *out_str = str2wcstring((const char *)map + start, length - (size_t)start);
+        munmap(map, length);
+    }
+
+    lseek(des, buf.st_size, SEEK_SET);
+    return true;
+}
+
+/**
+   Read the rest of a file descriptor that can not be mapped, like a
+   pipe, and decode it into \c out_str. Returns false on error.
+*/
+static bool read_ni_stream(int des, wcstring *out_str)
+{
+    std::string acc;
+    for (;;)
+    {
+        char buff[4096];
+        ssize_t c = read(des, buff, sizeof buff);
+        if (c > 0)
+        {
+            acc.append(buff, c);
+        }
+        else if (c == 0)
+        {
+            break;
+        }
+        else if (errno == EINTR)
+        {
+            /* We got a signal, just keep going */
+        }
+        else if ((errno == EAGAIN || errno == EWOULDBLOCK) && make_fd_blocking(des) == 0)
+        {
+            /* We succeeded in making the fd blocking, keep going */
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    *out_str = str2wcstring(acc);
+    return true;
+}
+
 /**
    Read non-interactively.  Read input from stdin without displaying
    the prompt, using syntax highlighting. This is used for reading
@@ -4229,9 +4915,6 @@ int reader_has_pager_contents()
 static int read_ni(int fd, const io_chain_t &io)
 {
     parser_t &parser = parser_t::principal_parser();
-    FILE *in_stream;
-    wchar_t *buff=0;
-    std::vector<char> acc;
 
     int des = (fd == STDIN_FILENO ? dup(STDIN_FILENO) : fd);
     int res=0;
@@ -4242,77 +4925,47 @@ static int read_ni(int fd, const io_chain_t &io)
         return 1;
     }
 
-    in_stream = fdopen(des, "r");
-    if (in_stream != 0)
+    wcstring str;
+    if (! read_ni_mapped(des, &str) && ! read_ni_stream(des, &str))
     {
-        while (!feof(in_stream))
-        {
-            char buff[4096];
-            size_t c = fread(buff, 1, 4096, in_stream);
-
-            if (ferror(in_stream))
-            {
-                if (errno == EINTR)
-                {
-                    /* We got a signal, just keep going. Be sure that we call insert() below because we may get data as well as EINTR. */
-                    clearerr(in_stream);
-                }
-                else if ((errno == EAGAIN || errno == EWOULDBLOCK) && make_fd_blocking(des) == 0)
-                {
-                    /* We succeeded in making the fd blocking, keep going */
-                    clearerr(in_stream);
-                }
-                else
-                {
-                    /* Fatal error */
-                    debug(1, _(L"Error while reading from file descriptor"));
-
-                    /* Reset buffer on error. We won't evaluate incomplete files. */
-                    acc.clear();
-                    break;
-                }
-            }
+        /* Fatal error */
+        debug(1, _(L"Error while reading from file descriptor"));
 
-            acc.insert(acc.end(), buff, buff + c);
-        }
-
-        wcstring str = acc.empty() ? wcstring() : str2wcstring(&acc.at(0), acc.size());
-        acc.clear();
+        /* We won't evaluate incomplete files. */
+        str.clear();
+    }
 
-        if (fclose(in_stream))
-        {
-            debug(1,
-                  _(L"Error while closing input stream"));
-            wperror(L"fclose");
-            res = 1;
-        }
+    if (close(des))
+    {
+        debug(1,
+              _(L"Error while closing input stream"));
+        wperror(L"close");
+        res = 1;
+    }
 
-        /* Swallow a BOM (#1518) */
-        if (! str.empty() && str.at(0) == UTF8_BOM_WCHAR)
-        {
-            str.erase(0, 1);
-        }
+    /* Swallow a BOM (#1518) */
+    if (! str.empty() && str.at(0) == UTF8_BOM_WCHAR)
+    {
+        str.erase(0, 1);
+    }
 
-        parse_error_list_t errors;
-        if (! parse_util_detect_errors(str, &errors, false /* do not accept incomplete */))
-        {
-            parser.eval(str, io, TOP);
-        }
-        else
-        {
-            wcstring sb;
-            parser.get_backtrace(str, errors, &sb);
-            fwprintf(stderr, L"%ls", sb.c_str());
-            res = 1;
-        }
+    /* Run the tree that error detection built, rather than parsing the file a second time. The tree is only good
+       for this process: its nodes are offsets into the wide string we just decoded, and functions defined here keep
+       their own copy of the source and parse it when first called. So there is no cache of parsed files on disk
+       that other shells could map; each shell parses a file once per source. */
+    parse_error_list_t errors;
+    parse_node_tree_t *tree = new parse_node_tree_t();
+    const shared_ptr<const parse_node_tree_t> tree_holder(tree);
+    if (! parse_util_detect_errors(str, &errors, false /* do not accept incomplete */, tree))
+    {
+        parser.eval(str, tree_holder, io, TOP);
     }
     else
     {
-        debug(1,
-              _(L"Error while opening input stream"));
-        wperror(L"fdopen");
-        free(buff);
-        res=1;
+        wcstring sb;
+        parser.get_backtrace(str, errors, &sb);
+        fwprintf(stderr, L"%ls", sb.c_str());
+        res = 1;
     }
     return res;
 }
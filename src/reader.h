@@ -120,6 +120,13 @@ void reader_pop_current_filename();
 */
 void reader_write_title(const wcstring &cmd);
 
+/**
+   Turn bracketed paste mode on while a command line is read, and off
+   before anything else gets to read from the terminal. Returns whether
+   it was on before, so that callers can restore it.
+*/
+bool reader_set_bracketed_paste(bool enable);
+
 /**
    Call this function to tell the reader that a repaint is needed, and
    should be performed when possible.
@@ -191,13 +198,23 @@ void reader_reset_interrupted();
 int reader_reading_interrupted();
 
 /**
-   Returns true if the current reader generation count does not equal the
-   generation count the current thread was started with.
-   Note 1: currently only valid for autocompletion threads! Other threads don't
-   set the threadlocal generation count when they start up.
+   Returns true if the current thread is running a background job for the
+   reader, like highlighting or autosuggestion, and the command line has
+   changed since the job started, so its result will be thrown away. Long
+   running work should check this periodically and give up early. On the
+   main thread, this is true during tab completion once the user has typed
+   something. Returns false otherwise.
 */
 bool reader_thread_job_is_stale();
 
+/**
+   Returns true if reader_thread_job_is_stale() may become true on the
+   current thread, i.e. while it's running a job for the reader. Code that
+   blocks waiting for something else should wake up regularly to check it
+   while this is true.
+*/
+bool reader_thread_job_can_become_stale();
+
 /**
    Read one line of input. Before calling this function, reader_push() must have
    been called in order to set up a valid reader environment. If nchars > 0,
@@ -35,6 +35,7 @@ efficient way for transforming that to the desired screen content.
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <map>
 
 
 #include "fallback.h"
@@ -133,97 +134,127 @@ static bool allow_soft_wrap(void)
 }
 
 
-/* Returns the number of characters in the escape code starting at 'code' (which should initially contain \x1b) */
-size_t escape_code_length(const wchar_t *code)
+/**
+   A terminfo escape sequence recognized by escape_code_length, possibly with an alternative form. The longer of the two that matches is used.
+*/
+struct terminfo_escape_t
 {
-    assert(code != NULL);
+    std::string seq;
+    std::string alt;
+};
 
-    /* The only escape codes we recognize start with \x1b */
-    if (code[0] != L'\x1b')
-        return 0;
+/**
+   The terminfo escape sequences recognized by escape_code_length, in the order they are tried. They are formatted with tparm once per terminal, instead of for every escape character of every prompt on every repaint.
+*/
+static std::vector<terminfo_escape_t> s_terminfo_escapes;
+static TERMINAL *s_terminfo_escapes_term = NULL;
 
-    size_t resulting_length = 0;
-    bool found = false;
+static const std::vector<terminfo_escape_t> &terminfo_escapes()
+{
+    if (cur_term == s_terminfo_escapes_term)
+        return s_terminfo_escapes;
 
-    if (cur_term != NULL)
+    s_terminfo_escapes.clear();
+    s_terminfo_escapes_term = cur_term;
+    if (cur_term == NULL)
+        return s_terminfo_escapes;
+
+    /*
+     Detect these terminfo color escapes with parameter
+     value 0..7, all of which don't move the cursor
+     */
+    char * const esc[] =
     {
-        /*
-         Detect these terminfo color escapes with parameter
-         value 0..7, all of which don't move the cursor
-         */
-        char * const esc[] =
-        {
-            set_a_foreground,
-            set_a_background,
-            set_foreground,
-            set_background,
-        };
+        set_a_foreground,
+        set_a_background,
+        set_foreground,
+        set_background,
+    };
 
-        for (size_t p=0; p < sizeof esc / sizeof *esc && !found; p++)
-        {
-            if (!esc[p])
-                continue;
+    for (size_t p=0; p < sizeof esc / sizeof *esc; p++)
+    {
+        if (!esc[p])
+            continue;
 
-            for (size_t k=0; k<8; k++)
+        for (size_t k=0; k<8; k++)
+        {
+            const char *seq = tparm(esc[p],k);
+            if (seq)
             {
-                size_t len = try_sequence(tparm(esc[p],k), code);
-                if (len)
-                {
-                    resulting_length = len;
-                    found = true;
-                    break;
-                }
+                terminfo_escape_t escape;
+                escape.seq = seq;
+                s_terminfo_escapes.push_back(escape);
             }
         }
     }
 
-    if (cur_term != NULL)
-    {
+    /*
+     Detect these semi-common terminfo escapes without any
+     parameter values, all of which don't move the cursor
+     */
+    char * const esc2[] =
+    {
+        enter_bold_mode,
+        exit_attribute_mode,
+        enter_underline_mode,
+        exit_underline_mode,
+        enter_standout_mode,
+        exit_standout_mode,
+        flash_screen,
+        enter_subscript_mode,
+        exit_subscript_mode,
+        enter_superscript_mode,
+        exit_superscript_mode,
+        enter_blink_mode,
+        enter_italics_mode,
+        exit_italics_mode,
+        enter_reverse_mode,
+        enter_shadow_mode,
+        exit_shadow_mode,
+        enter_standout_mode,
+        exit_standout_mode,
+        enter_secure_mode
+    };
+
+    for (size_t p=0; p < sizeof esc2 / sizeof *esc2; p++)
+    {
+        if (!esc2[p])
+            continue;
         /*
-         Detect these semi-common terminfo escapes without any
-         parameter values, all of which don't move the cursor
+         Test both padded and unpadded version, just to
+         be safe. Most versions of tparm don't actually
+         seem to do anything these days.
          */
-        char * const esc2[] =
-        {
-            enter_bold_mode,
-            exit_attribute_mode,
-            enter_underline_mode,
-            exit_underline_mode,
-            enter_standout_mode,
-            exit_standout_mode,
-            flash_screen,
-            enter_subscript_mode,
-            exit_subscript_mode,
-            enter_superscript_mode,
-            exit_superscript_mode,
-            enter_blink_mode,
-            enter_italics_mode,
-            exit_italics_mode,
-            enter_reverse_mode,
-            enter_shadow_mode,
-            exit_shadow_mode,
-            enter_standout_mode,
-            exit_standout_mode,
-            enter_secure_mode
-        };
-
-
-
-        for (size_t p=0; p < sizeof esc2 / sizeof *esc2 && !found; p++)
+        terminfo_escape_t escape;
+        const char *padded = tparm(esc2[p]);
+        if (padded)
+            escape.seq = padded;
+        escape.alt = esc2[p];
+        s_terminfo_escapes.push_back(escape);
+    }
+    return s_terminfo_escapes;
+}
+
+/* Returns the number of characters in the escape code starting at 'code' (which should initially contain \x1b) */
+size_t escape_code_length(const wchar_t *code)
+{
+    assert(code != NULL);
+
+    /* The only escape codes we recognize start with \x1b */
+    if (code[0] != L'\x1b')
+        return 0;
+
+    size_t resulting_length = 0;
+    bool found = false;
+
+    const std::vector<terminfo_escape_t> &escapes = terminfo_escapes();
+    for (size_t i=0; i < escapes.size() && !found; i++)
+    {
+        size_t len = maxi(try_sequence(escapes[i].seq.c_str(), code), try_sequence(escapes[i].alt.c_str(), code));
+        if (len)
         {
-            if (!esc2[p])
-                continue;
-            /*
-             Test both padded and unpadded version, just to
-             be safe. Most versions of tparm don't actually
-             seem to do anything these days.
-             */
-            size_t len = maxi(try_sequence(tparm(esc2[p]), code), try_sequence(esc2[p], code));
-            if (len)
-            {
-                resulting_length = len;
-                found = true;
-            }
+            resulting_length = len;
+            found = true;
         }
     }
 
@@ -344,7 +375,7 @@ struct prompt_layout_t
    to detect common escape sequences that may be embeded in a prompt,
    such as color codes.
 */
-static prompt_layout_t calc_prompt_layout(const wchar_t *prompt)
+static prompt_layout_t compute_prompt_layout(const wchar_t *prompt)
 {
     size_t current_line_width = 0;
     size_t j;
@@ -388,6 +419,40 @@ static prompt_layout_t calc_prompt_layout(const wchar_t *prompt)
     return prompt_layout;
 }
 
+/**
+   The maximum number of prompt layouts to remember. The same few prompts are laid out on every repaint.
+*/
+#define PROMPT_LAYOUT_CACHE_SIZE 16
+
+typedef std::map<wcstring, prompt_layout_t> prompt_layout_cache_t;
+static prompt_layout_cache_t s_prompt_layout_cache;
+static TERMINAL *s_prompt_layout_cache_term = NULL;
+
+/**
+   Like compute_prompt_layout, but remembers the layouts of recent prompts. Layouts depend on the escape sequences of the terminal, so they are forgotten when it changes.
+*/
+static prompt_layout_t calc_prompt_layout(const wchar_t *prompt)
+{
+    ASSERT_IS_MAIN_THREAD();
+    if (s_prompt_layout_cache_term != cur_term)
+    {
+        s_prompt_layout_cache.clear();
+        s_prompt_layout_cache_term = cur_term;
+    }
+
+    const wcstring key = prompt;
+    prompt_layout_cache_t::const_iterator iter = s_prompt_layout_cache.find(key);
+    if (iter != s_prompt_layout_cache.end())
+        return iter->second;
+
+    if (s_prompt_layout_cache.size() >= PROMPT_LAYOUT_CACHE_SIZE)
+        s_prompt_layout_cache.clear();
+
+    const prompt_layout_t layout = compute_prompt_layout(prompt);
+    s_prompt_layout_cache.insert(std::make_pair(key, layout));
+    return layout;
+}
+
 static size_t calc_prompt_lines(const wcstring &prompt)
 {
     // Hack for the common case where there's no newline at all
@@ -755,7 +820,7 @@ static size_t line_shared_prefix(const line_t &a, const line_t &b)
     for (idx=0; idx < max; idx++)
     {
         wchar_t ac = a.char_at(idx), bc = b.char_at(idx);
-        if (fish_wcwidth(ac) < 1 || fish_wcwidth(bc) < 1)
+        if (a.width_at(idx) < 1 || b.width_at(idx) < 1)
         {
             /* Possible combining mark, return one index prior */
             if (idx > 0) idx--;
@@ -769,6 +834,99 @@ static size_t line_shared_prefix(const line_t &a, const line_t &b)
     return idx;
 }
 
+/** Returns whether the character at idx takes up a cell of its own, without combining marks that follow it */
+static bool line_cell_is_plain(const line_t &line, size_t idx)
+{
+    if (line.width_at(idx) < 1)
+        return false;
+    return idx + 1 == line.size() || line.width_at(idx + 1) >= 1;
+}
+
+/**
+   Finds the characters of a line by the column they are displayed in. Columns must be asked for in increasing order, so that a whole line is looked up in one pass.
+*/
+class line_column_finder_t
+{
+    const line_t &line;
+    size_t idx;
+    int column;
+
+public:
+    explicit line_column_finder_t(const line_t &l) : line(l), idx(0), column(0)
+    {
+    }
+
+    /** Returns whether a character starts at the given column, and if so its index */
+    bool find(int target, size_t *out_idx)
+    {
+        while (idx < line.size() && column < target)
+        {
+            column += maxi(0, line.width_at(idx));
+            idx++;
+        }
+        if (idx < line.size() && column == target)
+        {
+            *out_idx = idx;
+            return true;
+        }
+        return false;
+    }
+};
+
+/**
+   Returns the number of characters, starting at index start of the desired line, that are already on the screen in the same columns with the same colors. Their width is returned in out_width.
+*/
+static size_t line_matching_run(const line_t &desired, size_t start, int start_column, line_column_finder_t *actual_cells, const line_t &actual, int *out_width)
+{
+    size_t idx = start;
+    int width = 0;
+    for (; idx < desired.size(); idx++)
+    {
+        size_t actual_idx;
+        if (! line_cell_is_plain(desired, idx) || ! actual_cells->find(start_column + width, &actual_idx) || ! line_cell_is_plain(actual, actual_idx))
+            break;
+        if (desired.char_at(idx) != actual.char_at(actual_idx) || desired.color_at(idx) != actual.color_at(actual_idx))
+            break;
+        width += maxi(0, desired.width_at(idx));
+    }
+    *out_width = width;
+    return idx - start;
+}
+
+/** Returns the number of bytes s_move needs to move the cursor the given number of steps to the right */
+static size_t cursor_right_cost(int steps)
+{
+    size_t cost = steps * strlen(cursor_right);
+    if (parm_right_cursor != NULL && parm_right_cursor[0] != '\0')
+    {
+        cost = mini(cost, strlen(tparm(parm_right_cursor, steps)));
+    }
+    return cost;
+}
+
+/**
+   Remembers the pen color most recently set while writing characters during one update, so that a run of characters with the same color does not look up and set the color for each of them. Anything else that may change the color must invalidate it.
+*/
+struct color_run_cache_t
+{
+    bool valid;
+    highlight_spec_t color;
+
+    color_run_cache_t() : valid(false), color(0)
+    {
+    }
+};
+
+static void s_set_color_cached(screen_t *s, data_buffer_t *b, highlight_spec_t c, color_run_cache_t *cache)
+{
+    if (! cache->valid || cache->color != c)
+    {
+        s_set_color(s, b, c);
+        cache->valid = true;
+        cache->color = c;
+    }
+}
+
 /* We are about to output one or more characters onto the screen at the given x, y. If we are at the end of previous line, and the previous line is marked as soft wrapping, then tweak the screen so we believe we are already in the target position. This lets the terminal take care of wrapping, which means that if you copy and paste the text, it won't have an embedded newline.  */
 static bool perform_any_impending_soft_wrap(screen_t *scr, int x, int y)
 {
@@ -903,6 +1061,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         scr->actual.cursor.x = (int)left_prompt_width;
     }
 
+    color_run_cache_t color_cache;
     for (size_t i=0; i < scr->desired.line_count(); i++)
     {
         const line_t &o_line = scr->desired.line(i);
@@ -922,7 +1081,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             const size_t shared_prefix = line_shared_prefix(o_line, s_line);
             if (shared_prefix > 0)
             {
-                int prefix_width = fish_wcswidth(&o_line.text.at(0), shared_prefix);
+                int prefix_width = o_line.prefix_width(shared_prefix);
                 if (prefix_width > skip_remaining)
                     skip_remaining = prefix_width;
             }
@@ -949,7 +1108,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         size_t j = 0;
         for (; j < o_line.size(); j++)
         {
-            int width = fish_wcwidth_min_0(o_line.char_at(j));
+            int width = maxi(0, o_line.width_at(j));
             if (skip_remaining < width)
                 break;
             skip_remaining -= width;
@@ -959,12 +1118,13 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         /* Skip over zero-width characters (e.g. combining marks at the end of the prompt) */
         for (; j < o_line.size(); j++)
         {
-            int width = fish_wcwidth_min_0(o_line.char_at(j));
+            int width = maxi(0, o_line.width_at(j));
             if (width > 0)
                 break;
         }
 
         /* Now actually output stuff */
+        line_column_finder_t actual_cells(s_line);
         for (; j < o_line.size(); j++)
         {
             /* If we are about to output into the last column, clear the screen first. If we clear the screen after we output into the last column, it can erase the last character due to the sticky right cursor. If we clear the screen too early, we can defeat soft wrapping. */
@@ -975,11 +1135,34 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
                 has_cleared_screen = true;
             }
 
+            /* Characters already on the screen past the shared prefix (e.g. after a token that was only recolored) need not be written again. Skip over them if moving the cursor is cheaper than writing them, or if they run to the end of the line. The end of a soft wrapped line is always written so that the terminal keeps wrapping it. */
+            if (! should_clear_screen_this_line)
+            {
+                int run_width = 0;
+                size_t run_length = line_matching_run(o_line, j, current_width, &actual_cells, s_line, &run_width);
+                bool skip_run = false;
+                if (run_length > 0 && j + run_length == o_line.size())
+                {
+                    skip_run = ! o_line.is_soft_wrapped;
+                }
+                else if (run_length > 0)
+                {
+                    skip_run = cursor_right_cost(run_width) < run_length;
+                }
+
+                if (skip_run)
+                {
+                    current_width += run_width;
+                    j += run_length - 1;
+                    continue;
+                }
+            }
+
             perform_any_impending_soft_wrap(scr, current_width, (int)i);
             s_move(scr, &output, current_width, (int)i);
-            s_set_color(scr, &output, o_line.color_at(j));
+            s_set_color_cached(scr, &output, o_line.color_at(j), &color_cache);
             s_write_char(scr, &output, o_line.char_at(j));
-            current_width += fish_wcwidth_min_0(o_line.char_at(j));
+            current_width += maxi(0, o_line.width_at(j));
         }
 
         /* Clear the screen if we have not done so yet. */
@@ -1007,13 +1190,14 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         }
         else
         {
-            int prev_width = (s_line.text.empty() ? 0 : fish_wcswidth(&s_line.text.at(0), s_line.text.size()));
+            int prev_width = s_line.prefix_width(s_line.size());
             clear_remainder = prev_width > current_width;
 
         }
         if (clear_remainder)
         {
             s_set_color(scr, &output, 0xffffffff);
+            color_cache.valid = false;
             s_move(scr, &output, current_width, (int)i);
             s_write_mbs(&output, clr_eol);
         }
@@ -1024,6 +1208,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             s_move(scr, &output, (int)(screen_width - right_prompt_width), (int)i);
             s_set_color(scr, &output, 0xffffffff);
             s_write_str(&output, right_prompt);
+            color_cache.valid = false;
             scr->actual.cursor.x += right_prompt_width;
 
             /* We output in the last column. Some terms (Linux) push the cursor further right, past the window. Others make it "stick." Since we don't really know which is which, issue a cr so it goes back to the left.
@@ -28,9 +28,12 @@ struct line_t
 {
     std::vector<wchar_t> text;
     std::vector<highlight_spec_t> colors;
+
+    /* The fish_wcwidth of each character in text, computed once when it is appended, since screen updates look at widths over and over */
+    std::vector<int> widths;
     bool is_soft_wrapped;
 
-    line_t() : text(), colors(), is_soft_wrapped(false)
+    line_t() : text(), colors(), widths(), is_soft_wrapped(false)
     {
     }
 
@@ -38,20 +41,21 @@ struct line_t
     {
         text.clear();
         colors.clear();
+        widths.clear();
     }
 
     void append(wchar_t txt, highlight_spec_t color)
     {
         text.push_back(txt);
         colors.push_back(color);
+        widths.push_back(fish_wcwidth(txt));
     }
 
     void append(const wchar_t *txt, highlight_spec_t color)
     {
         for (size_t i=0; txt[i]; i++)
         {
-            text.push_back(txt[i]);
-            colors.push_back(color);
+            append(txt[i], color);
         }
     }
 
@@ -72,10 +76,30 @@ struct line_t
         return colors.at(idx);
     }
 
+    /* The fish_wcwidth of the character at idx */
+    int width_at(size_t idx) const
+    {
+        return widths.at(idx);
+    }
+
+    /* Like fish_wcswidth of the first count characters: their total width, or -1 if any of them is a control character */
+    int prefix_width(size_t count) const
+    {
+        int result = 0;
+        for (size_t i=0; i < count; i++)
+        {
+            if (widths.at(i) < 0)
+                return -1;
+            result += widths.at(i);
+        }
+        return result;
+    }
+
     void append_line(const line_t &line)
     {
         text.insert(text.end(), line.text.begin(), line.text.end());
         colors.insert(colors.end(), line.colors.begin(), line.colors.end());
+        widths.insert(widths.end(), line.widths.begin(), line.widths.end());
     }
 
 };
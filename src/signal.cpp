@@ -45,9 +45,28 @@ struct lookup_entry
 };
 
 /**
-   The number of signal blocks in place. Increased by signal_block, decreased by signal_unblock.
+   The number of signal blocks in place. Increased by signal_block,
+   decreased by signal_unblock. Signal handlers read it: while it is
+   positive they only note the signal in s_deferred_signals.
 */
-static int block_count=0;
+static volatile sig_atomic_t block_count=0;
+
+/**
+   Signals that arrived while blocked, to be raised again when the
+   last block is removed
+*/
+static volatile sig_atomic_t s_deferred_signals[NSIG];
+
+/**
+   Whether there are any deferred signals
+*/
+static volatile sig_atomic_t s_any_deferred_signals = 0;
+
+/**
+   Whether all signals are masked in the kernel. This is true in the
+   child after execute_fork, until it removes its last block.
+*/
+static bool s_signals_masked = false;
 
 
 /**
@@ -416,11 +435,32 @@ const wchar_t *signal_get_desc(int sig)
     return _(L"Unknown");
 }
 
+/**
+   Called first by each signal handler. If signals are blocked, note
+   the signal so that signal_unblock raises it again, and return true;
+   the handler should then return without doing anything else.
+*/
+static bool signal_defer(int sig)
+{
+    if (! block_count)
+        return false;
+
+    if (sig > 0 && sig < NSIG)
+    {
+        s_deferred_signals[sig] = 1;
+        s_any_deferred_signals = 1;
+    }
+    return true;
+}
+
 /**
    Standard signal handler
 */
 static void default_handler(int signal, siginfo_t *info, void *context)
 {
+    if (signal_defer(signal))
+        return;
+
     if (event_is_signal_observed(signal))
     {
         event_fire_signal(signal);
@@ -432,6 +472,9 @@ static void default_handler(int signal, siginfo_t *info, void *context)
 */
 static void handle_winch(int sig, siginfo_t *info, void *context)
 {
+    if (signal_defer(sig))
+        return;
+
     common_handle_winch(sig);
     default_handler(sig, 0, 0);
 }
@@ -442,6 +485,9 @@ static void handle_winch(int sig, siginfo_t *info, void *context)
 */
 static void handle_hup(int sig, siginfo_t *info, void *context)
 {
+    if (signal_defer(sig))
+        return;
+
     if (event_is_signal_observed(SIGHUP))
     {
         default_handler(sig, 0, 0);
@@ -455,6 +501,9 @@ static void handle_hup(int sig, siginfo_t *info, void *context)
 /** Handle sigterm. The only thing we do is restore the front process ID, then die. */
 static void handle_term(int sig, siginfo_t *info, void *context)
 {
+    if (signal_defer(sig))
+        return;
+
     restore_term_foreground_process_group();
     signal(SIGTERM, SIG_DFL);
     raise(SIGTERM);
@@ -466,6 +515,9 @@ static void handle_term(int sig, siginfo_t *info, void *context)
 */
 static void handle_int(int sig, siginfo_t *info, void *context)
 {
+    if (signal_defer(sig))
+        return;
+
     reader_handle_int(sig);
     default_handler(sig, info, context);
 }
@@ -475,6 +527,9 @@ static void handle_int(int sig, siginfo_t *info, void *context)
 */
 static void handle_chld(int sig, siginfo_t *info, void *context)
 {
+    if (signal_defer(sig))
+        return;
+
     job_handle_signal(sig, info, context);
     default_handler(sig, info, context);
 }
@@ -506,7 +561,13 @@ void signal_set_handlers()
         return;
 
     sigemptyset(& act.sa_mask);
-    act.sa_flags=SA_SIGINFO;
+    /*
+      signal_block does not mask signals, so the handlers run (and only
+      note the signal) inside blocked regions. Restart the system calls
+      they interrupt, so that opening a FIFO or waiting for a child there
+      does not fail with EINTR.
+    */
+    act.sa_flags=SA_SIGINFO | SA_RESTART;
     act.sa_sigaction = &default_handler;
 
     /*
@@ -542,7 +603,7 @@ void signal_set_handlers()
         sigaction(SIGTTOU, &act, 0);
 
         act.sa_sigaction = &handle_int;
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         if (sigaction(SIGINT, &act, 0))
         {
             wperror(L"sigaction");
@@ -550,7 +611,7 @@ void signal_set_handlers()
         }
 
         act.sa_sigaction = &handle_chld;
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         if (sigaction(SIGCHLD, &act, 0))
         {
             wperror(L"sigaction");
@@ -558,7 +619,7 @@ void signal_set_handlers()
         }
 
 #ifdef SIGWINCH
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         act.sa_sigaction= &handle_winch;
         if (sigaction(SIGWINCH, &act, 0))
         {
@@ -567,7 +628,7 @@ void signal_set_handlers()
         }
 #endif
 
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         act.sa_sigaction= &handle_hup;
         if (sigaction(SIGHUP, &act, 0))
         {
@@ -576,7 +637,7 @@ void signal_set_handlers()
         }
 
         // SIGTERM restores the terminal controlling process before dying
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         act.sa_sigaction= &handle_term;
         if (sigaction(SIGTERM, &act, 0))
         {
@@ -599,7 +660,7 @@ void signal_set_handlers()
         act.sa_handler=SIG_DFL;
 
         act.sa_sigaction = &handle_chld;
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         if (sigaction(SIGCHLD, &act, 0))
         {
             wperror(L"sigaction");
@@ -627,7 +688,7 @@ void signal_handle(int sig, int do_handle)
     sigemptyset(&act.sa_mask);
     if (do_handle)
     {
-        act.sa_flags = SA_SIGINFO;
+        act.sa_flags = SA_SIGINFO | SA_RESTART;
         act.sa_sigaction = &default_handler;
     }
     else
@@ -654,14 +715,6 @@ void get_signals_with_handlers(sigset_t *set)
 void signal_block()
 {
     ASSERT_IS_MAIN_THREAD();
-    sigset_t chldset;
-
-    if (!block_count)
-    {
-        sigfillset(&chldset);
-        VOMIT_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &chldset, NULL));
-    }
-
     block_count++;
 //	debug( 0, L"signal block level increased to %d", block_count );
 }
@@ -669,7 +722,6 @@ void signal_block()
 void signal_unblock()
 {
     ASSERT_IS_MAIN_THREAD();
-    sigset_t chldset;
 
     block_count--;
 
@@ -682,12 +734,60 @@ void signal_unblock()
 
     if (!block_count)
     {
-        sigfillset(&chldset);
-        VOMIT_ON_FAILURE(pthread_sigmask(SIG_UNBLOCK, &chldset, 0));
+        if (s_signals_masked)
+        {
+            sigset_t chldset;
+            sigfillset(&chldset);
+            VOMIT_ON_FAILURE(pthread_sigmask(SIG_UNBLOCK, &chldset, 0));
+            s_signals_masked = false;
+        }
+
+        /*
+          Deliver the signals that arrived while blocked, as unmasking
+          them would have. Each flag is cleared before the signal is
+          raised, and a signal that arrives now is handled at once.
+        */
+        if (s_any_deferred_signals)
+        {
+            s_any_deferred_signals = 0;
+            for (int sig=1; sig < NSIG; sig++)
+            {
+                if (s_deferred_signals[sig])
+                {
+                    s_deferred_signals[sig] = 0;
+                    raise(sig);
+                }
+            }
+        }
     }
 //	debug( 0, L"signal block level decreased to %d", block_count );
 }
 
+void signal_mask_for_fork(sigset_t *saved)
+{
+    sigset_t chldset;
+    sigfillset(&chldset);
+    VOMIT_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &chldset, saved));
+}
+
+void signal_fork_done(pid_t pid, const sigset_t *saved)
+{
+    if (pid == 0)
+    {
+        /* The child keeps everything masked until its last block is removed. The signals the parent deferred were not sent to the child. */
+        s_signals_masked = true;
+        s_any_deferred_signals = 0;
+        for (int sig=1; sig < NSIG; sig++)
+        {
+            s_deferred_signals[sig] = 0;
+        }
+    }
+    else
+    {
+        VOMIT_ON_FAILURE(pthread_sigmask(SIG_SETMASK, saved, NULL));
+    }
+}
+
 bool signal_is_blocked()
 {
     return !!block_count;
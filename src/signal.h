@@ -43,7 +43,9 @@ void signal_set_handlers();
 void signal_handle(int sig, int do_handle);
 
 /**
-  Block all signals
+  Block all signals. This costs no system call: while blocked, fish's
+  signal handlers only note the signals they receive, and the last
+  signal_unblock raises them again.
 */
 void signal_block();
 
@@ -52,6 +54,20 @@ void signal_block();
 */
 void signal_unblock();
 
+/**
+   Mask all signals in the kernel before calling fork, so that the child
+   can't run fish's handlers before it resets them. The previous mask is
+   stored in \c saved.
+*/
+void signal_mask_for_fork(sigset_t *saved);
+
+/**
+   Call after fork with its result. The parent's mask is restored from
+   \c saved. The child keeps all signals masked until it removes its
+   last block with signal_unblock.
+*/
+void signal_fork_done(pid_t pid, const sigset_t *saved);
+
 /**
    Returns true if signals are being blocked
 */
@@ -109,6 +109,15 @@ bool tokenizer_t::next(struct tok_t *result)
     return true;
 }
 
+wcstring tokenizer_t::text_of(const tok_t &token) const
+{
+    if (token.type == TOK_STRING || token.type == TOK_COMMENT)
+    {
+        return wcstring(this->orig_buff + token.offset, token.length);
+    }
+    return token.text;
+}
+
 /**
    Tests if this character can be a part of a string. The redirect ^ is allowed unless it's the first character.
    Hash (#) starts a comment if it's the first character in a token; otherwise it is considered a string character.
@@ -156,7 +165,6 @@ static int myal(wchar_t c)
 */
 void tokenizer_t::read_string()
 {
-    long len;
     int do_loop=1;
     size_t paran_count=0;
     
@@ -379,9 +387,8 @@ void tokenizer_t::read_string()
     }
 
 
-    len = this->buff - start;
-
-    this->last_token.assign(start, len);
+    /* The text stays in the source; next() reports where */
+    this->last_token.clear();
     this->last_type = TOK_STRING;
 }
 
@@ -390,12 +397,10 @@ void tokenizer_t::read_string()
 */
 void tokenizer_t::read_comment()
 {
-    const wchar_t *start = this->buff;
     while (*(this->buff)!= L'\n' && *(this->buff)!= L'\0')
         this->buff++;
 
-    size_t len = this->buff - start;
-    this->last_token.assign(start, len);
+    this->last_token.clear();
     this->last_type = TOK_COMMENT;
 }
 
@@ -646,6 +651,7 @@ void tokenizer_t::tok_next()
             break;
         case L'&':
             this->last_type = TOK_BACKGROUND;
+            this->last_token.clear();
             this->buff++;
             break;
 
@@ -718,7 +724,7 @@ wcstring tok_first(const wcstring &str)
     tok_t token;
     if (t.next(&token) && token.type == TOK_STRING)
     {
-        result.swap(token.text);
+        result.assign(str, token.offset, token.length);
     }
     return result;
 }
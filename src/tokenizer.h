@@ -71,7 +71,7 @@ typedef unsigned int tok_flags_t;
 
 struct tok_t
 {
-    /* The text of the token, or an error message for type error */
+    /* For type error, the error message. For redirections and pipes, the fd being redirected. Strings and comments are not copied: their text is the range of the source given by offset and length (see tokenizer_t::text_of) */
     wcstring text;
     
     /* The type of the token */
@@ -152,6 +152,9 @@ public:
     
     /** Returns the next token by reference. Returns true if we got one, false if we're at the end. */
     bool next(struct tok_t *result);
+
+    /** Returns a copy of the text of the given token. For strings and comments, this is the source text of the token; for other types it is the token's text field. */
+    wcstring text_of(const tok_t &token) const;
 };
 
 
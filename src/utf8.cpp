@@ -16,6 +16,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "utf8.h"
 
@@ -44,6 +45,26 @@ bool is_wchar_ucs2()
 static size_t utf8_to_wchar_internal(const char *in, size_t insize, utf8_wchar_t *out, size_t outsize, int flags);
 static size_t wchar_to_utf8_internal(const utf8_wchar_t *in, size_t insize, char *out, size_t outsize, int flags);
 
+size_t utf8_ascii_prefix_length(const char *in, size_t insize)
+{
+    /* A word with the high bit of each byte set */
+    typedef unsigned long ascii_word_t;
+    const ascii_word_t high_bits = (ascii_word_t)(-1) / 0xFF * 0x80;
+
+    size_t len = 0;
+    while (insize - len >= sizeof(ascii_word_t))
+    {
+        ascii_word_t word;
+        memcpy(&word, in + len, sizeof word);
+        if (word & high_bits)
+            break;
+        len += sizeof(ascii_word_t);
+    }
+    while (len < insize && (in[len] & 0x80) == 0)
+        len++;
+    return len;
+}
+
 static bool safe_copy_wchar_to_utf8_wchar(const wchar_t *in, utf8_wchar_t *out, size_t count)
 {
     bool result = true;
@@ -247,6 +268,20 @@ static size_t utf8_to_wchar_internal(const char *in, size_t insize, utf8_wchar_t
 
     for (; p < lim; p += n)
     {
+        /* Convert a run of ASCII in one go */
+        if ((*p & 0x80) == 0)
+        {
+            n = utf8_ascii_prefix_length((const char *)p, lim - p);
+            total += n;
+            if (out == NULL)
+                continue;
+            if ((size_t)(wlim - out) < n)
+                return (0);		/* no space left */
+            for (i = 0; i < n; i++)
+                *out++ = p[i];
+            continue;
+        }
+
         if (__utf8_forbitten(*p) != 0 &&
                 (flags & UTF8_IGNORE_ERROR) == 0)
             return (0);
@@ -37,4 +37,7 @@ size_t wchar_to_utf8(const wchar_t *in, size_t insize, char *out, size_t outsize
 
 bool is_wchar_ucs2();
 
+/* Returns the number of bytes at the start of the given string that are ASCII. Checks a machine word at a time, so long ASCII runs are cheap to find. */
+size_t utf8_ascii_prefix_length(const char *in, size_t insize);
+
 #endif /* !_UTF8_H_ */
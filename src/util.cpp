@@ -12,6 +12,7 @@
 #include <wchar.h>
 #include <math.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
@@ -107,3 +108,15 @@ long long get_time()
     return 1000000ll*time_struct.tv_sec+time_struct.tv_usec;
 }
 
+long long get_monotonic_time()
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return 1000000ll*ts.tv_sec+ts.tv_nsec/1000;
+    }
+#endif
+    return get_time();
+}
+
@@ -68,4 +68,9 @@ int wcsfilecmp(const wchar_t *a, const wchar_t *b);
 */
 long long get_time();
 
+/**
+   Get the current time in microseconds from a clock that does not jump when the system time is set. The starting point is arbitrary. Where there is no such clock, this is get_time().
+*/
+long long get_monotonic_time();
+
 #endif
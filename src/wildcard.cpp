@@ -20,6 +20,12 @@ wildcards using **.
 #include <wctype.h>
 #include <string>
 #include <utility>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <fcntl.h>
 
 #include "fallback.h"
 #include "wutil.h"
@@ -28,6 +34,7 @@ wildcards using **.
 #include "complete.h"
 #include "reader.h"
 #include "expand.h"
+#include "path.h"
 #include <map>
 
 /**
@@ -80,19 +87,6 @@ wildcards using **.
 */
 #define COMPLETE_DIRECTORY_DESC _( L"Directory" )
 
-/* Finds an internal (ANY_STRING, etc.) style wildcard, or wcstring::npos */
-static size_t wildcard_find(const wchar_t *wc)
-{
-    for (size_t i=0; wc[i] != L'\0'; i++)
-    {
-        if (wc[i] == ANY_CHAR || wc[i] == ANY_STRING || wc[i] == ANY_STRING_RECURSIVE)
-        {
-            return i;
-        }
-    }
-    return wcstring::npos;
-}
-
 // Implementation of wildcard_has. Needs to take the length to handle embedded nulls (#1631)
 static bool wildcard_has_impl(const wchar_t *str, size_t len, bool internal)
 {
@@ -132,14 +126,75 @@ bool wildcard_has(const wcstring &str, bool internal)
 }
 
 
+/* Memoize failures only up to this many (string position, wildcard position) pairs; beyond it, matching is just slower */
+static const size_t kWildcardMemoMaxSize = 1 << 20;
+
+static bool is_any_string(wchar_t c)
+{
+    return c == ANY_STRING || c == ANY_STRING_RECURSIVE;
+}
+
+wildcard_pattern_t::wildcard_pattern_t(const wcstring &w) :
+    wc(w),
+    wc_len(wcslen(w.c_str())),
+    any_string_count(0),
+    memo_str(NULL)
+{
+    this->next_wildcard.resize(this->wc_len + 1, wcstring::npos);
+    for (size_t i = this->wc_len; i > 0; i--)
+    {
+        const wchar_t c = this->wc.at(i - 1);
+        bool is_wildcard = (c == ANY_CHAR || is_any_string(c));
+        this->next_wildcard.at(i - 1) = is_wildcard ? i - 1 : this->next_wildcard.at(i);
+        if (is_any_string(c))
+        {
+            this->any_string_count++;
+        }
+    }
+}
+
+bool wildcard_pattern_t::begin_memo(const wchar_t *str) const
+{
+    this->memo_str = NULL;
+    if (this->any_string_count < 2)
+    {
+        return false;
+    }
+    const size_t size = (wcslen(str) + 1) * (this->wc_len + 1);
+    if (size > kWildcardMemoMaxSize)
+    {
+        return false;
+    }
+    this->memo_str = str;
+    this->memo_failed.assign(size, false);
+    return true;
+}
+
+bool wildcard_pattern_t::memo_has_failed(const wchar_t *str, const wchar_t *w) const
+{
+    if (this->memo_str == NULL)
+    {
+        return false;
+    }
+    return this->memo_failed.at((str - this->memo_str) * (this->wc_len + 1) + (w - this->wc.c_str()));
+}
+
+void wildcard_pattern_t::memo_set_failed(const wchar_t *str, const wchar_t *w) const
+{
+    if (this->memo_str != NULL)
+    {
+        this->memo_failed.at((str - this->memo_str) * (this->wc_len + 1) + (w - this->wc.c_str())) = true;
+    }
+}
+
 /**
-   Check whether the string str matches the wildcard string wc.
+   Check whether the string str matches the wildcard string wc, which points into our wildcard.
 
    \param str String to be matched.
    \param wc The wildcard.
    \param is_first Whether files beginning with dots should not be matched against wildcards.
 */
-static enum fuzzy_match_type_t wildcard_match_internal(const wchar_t *str, const wchar_t *wc, bool leading_dots_fail_to_match, bool is_first, enum fuzzy_match_type_t max_type)
+enum fuzzy_match_type_t wildcard_pattern_t::match_internal(const wchar_t *str, const wchar_t *wc, bool leading_dots_fail_to_match, bool is_first, enum fuzzy_match_type_t max_type) const
 {
     if (*str == 0 && *wc==0)
     {
@@ -155,13 +210,13 @@ static enum fuzzy_match_type_t wildcard_match_internal(const wchar_t *str, const
     }
     
     /* Hackish fuzzy match support */
-    if (! wildcard_has(wc, true))
+    if (this->next_wildcard.at(wc - this->wc.c_str()) == wcstring::npos)
     {
         const string_fuzzy_match_t match = string_fuzzy_match_string(wc, str);
         return (match.type <= max_type ? match.type : fuzzy_match_none);
     }
 
-    if (*wc == ANY_STRING || *wc == ANY_STRING_RECURSIVE)
+    if (is_any_string(*wc))
     {
         /* Ignore hidden file */
         if (leading_dots_fail_to_match && is_first && *str == L'.')
@@ -175,14 +230,19 @@ static enum fuzzy_match_type_t wildcard_match_internal(const wchar_t *str, const
             return fuzzy_match_exact;
         }
 
-        /* Try all submatches */
+        /* Try all submatches, skipping the ones we already know fail */
         do
         {
-            enum fuzzy_match_type_t subresult = wildcard_match_internal(str, wc+1, leading_dots_fail_to_match, false, max_type);
+            if (this->memo_has_failed(str, wc+1))
+            {
+                continue;
+            }
+            enum fuzzy_match_type_t subresult = this->match_internal(str, wc+1, leading_dots_fail_to_match, false, max_type);
             if (subresult != fuzzy_match_none)
             {
                 return subresult;
             }
+            this->memo_set_failed(str, wc+1);
         } while (*str++ != 0);
         return fuzzy_match_none;
     }
@@ -201,16 +261,74 @@ static enum fuzzy_match_type_t wildcard_match_internal(const wchar_t *str, const
             return fuzzy_match_none;
         }
 
-        return wildcard_match_internal(str+1, wc+1, leading_dots_fail_to_match, false, max_type);
+        return this->match_internal(str+1, wc+1, leading_dots_fail_to_match, false, max_type);
     }
     else if (*wc == *str)
     {
-        return wildcard_match_internal(str+1, wc+1, leading_dots_fail_to_match, false, max_type);
+        return this->match_internal(str+1, wc+1, leading_dots_fail_to_match, false, max_type);
     }
 
     return fuzzy_match_none;
 }
 
+bool wildcard_pattern_t::match(const wcstring &str_in, bool leading_dots_fail_to_match) const
+{
+    /* Without fuzzy matching this is an ordinary glob, apart from the rules for leading dots, so we can match it greedily from left to right, going back to the most recent ANY_STRING when stuck. */
+    const wchar_t * const str = str_in.c_str();
+    const wchar_t * const wc = this->wc.c_str();
+    if (this->next_wildcard.at(0) == wcstring::npos)
+    {
+        return wcscmp(str, wc) == 0;
+    }
+    if (leading_dots_fail_to_match && contains(str, L".", L".."))
+    {
+        return wcscmp(str, wc) == 0;
+    }
+    if (str[0] == L'.' && (wc[0] == ANY_CHAR || (leading_dots_fail_to_match && is_any_string(wc[0]))))
+    {
+        return false;
+    }
+
+    size_t s = 0, w = 0;
+    size_t star_s = 0, star_w = wcstring::npos;
+    while (str[s] != L'\0')
+    {
+        if (is_any_string(wc[w]))
+        {
+            star_w = w++;
+            star_s = s;
+        }
+        else if (wc[w] != L'\0' && (wc[w] == ANY_CHAR || wc[w] == str[s]))
+        {
+            s++;
+            w++;
+        }
+        else if (star_w != wcstring::npos)
+        {
+            /* Let the last ANY_STRING swallow one more character */
+            w = star_w + 1;
+            s = ++star_s;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (is_any_string(wc[w]))
+    {
+        w++;
+    }
+    return wc[w] == L'\0';
+}
+
+enum fuzzy_match_type_t wildcard_pattern_t::match_fuzzy(const wcstring &str, bool leading_dots_fail_to_match, enum fuzzy_match_type_t max_type) const
+{
+    this->begin_memo(str.c_str());
+    enum fuzzy_match_type_t result = this->match_internal(str.c_str(), this->wc.c_str(), leading_dots_fail_to_match, true /* first */, max_type);
+    this->memo_str = NULL;
+    return result;
+}
+
 
 /* This does something horrible refactored from an even more horrible function */
 static wcstring resolve_description(wcstring *completion, const wchar_t *explicit_desc, wcstring(*desc_func)(const wcstring &))
@@ -238,13 +356,13 @@ static wcstring resolve_description(wcstring *completion, const wchar_t *explici
 }
 
 /* A transient parameter pack needed by wildcard_complete.f */
-struct wc_complete_pack_t
+struct wildcard_pattern_t::complete_params_t
 {
     const wcstring &orig; // the original string, transient
     const wchar_t *desc; // literal description
     wcstring(*desc_func)(const wcstring &); // function for generating descriptions
     expand_flags_t expand_flags;
-    wc_complete_pack_t(const wcstring &str) : orig(str) {}
+    complete_params_t(const wcstring &str) : orig(str) {}
 };
 
 /* Weirdly specific and non-reusable helper function that makes its one call site much clearer */
@@ -267,17 +385,17 @@ static bool has_prefix_match(const std::vector<completion_t> *comps, size_t firs
 /**
  Matches the string against the wildcard, and if the wildcard is a
  possible completion of the string, the remainder of the string is
- inserted into the out vector.
+ inserted into the out vector. str points into params.orig, and wc into our wildcard.
  
  We ignore ANY_STRING_RECURSIVE here. The consequence is that you cannot
  tab complete ** wildcards. This is historic behavior.
  */
-static bool wildcard_complete_internal(const wchar_t *str,
-                                       const wchar_t *wc,
-                                       const wc_complete_pack_t &params,
-                                       complete_flags_t flags,
-                                       std::vector<completion_t> *out,
-                                       bool is_first_call = false)
+bool wildcard_pattern_t::complete_internal(const wchar_t *str,
+                                           const wchar_t *wc,
+                                           const complete_params_t &params,
+                                           complete_flags_t flags,
+                                           std::vector<completion_t> *out,
+                                           bool is_first_call) const
 {
     assert(str != NULL);
     assert(wc != NULL);
@@ -289,23 +407,16 @@ static bool wildcard_complete_internal(const wchar_t *str,
     }
     
     /* Locate the next wildcard character position, e.g. ANY_CHAR or ANY_STRING */
-    const size_t next_wc_char_pos = wildcard_find(wc);
+    const size_t wc_pos = wc - this->wc.c_str();
+    const size_t next_wc_char_pos = this->next_wildcard.at(wc_pos) == wcstring::npos ? wcstring::npos : this->next_wildcard.at(wc_pos) - wc_pos;
     
     /* Maybe we have no more wildcards at all. This includes the empty string. */
     if (next_wc_char_pos == wcstring::npos)
     {
-        string_fuzzy_match_t match = string_fuzzy_match_string(wc, str);
-        
-        /* If we're allowing fuzzy match, any match is OK. Otherwise we require a prefix match. */
-        bool match_acceptable;
-        if (params.expand_flags & EXPAND_FUZZY_MATCH)
-        {
-            match_acceptable = match.type != fuzzy_match_none;
-        }
-        else
-        {
-            match_acceptable = match_type_shares_prefix(match.type);
-        }
+        /* If we're allowing fuzzy match, any match is OK. Otherwise we require a prefix match, so don't look for the others. */
+        const bool fuzzy = (params.expand_flags & EXPAND_FUZZY_MATCH) != 0;
+        string_fuzzy_match_t match = string_fuzzy_match_string(wc, str, fuzzy ? fuzzy_match_none : fuzzy_match_prefix_case_insensitive);
+        bool match_acceptable = match.type != fuzzy_match_none;
         
         if (match_acceptable && out != NULL)
         {
@@ -329,12 +440,12 @@ static bool wildcard_complete_internal(const wchar_t *str,
         if (wcsncmp(str, wc, next_wc_char_pos) == 0)
         {
             // Normal match
-            return wildcard_complete_internal(str + next_wc_char_pos, wc + next_wc_char_pos, params, flags, out);
+            return this->complete_internal(str + next_wc_char_pos, wc + next_wc_char_pos, params, flags, out, false);
         }
         else if (wcsncasecmp(str, wc, next_wc_char_pos) == 0)
         {
             // Case insensitive match
-            return wildcard_complete_internal(str + next_wc_char_pos, wc + next_wc_char_pos, params, flags | COMPLETE_REPLACES_TOKEN, out);
+            return this->complete_internal(str + next_wc_char_pos, wc + next_wc_char_pos, params, flags | COMPLETE_REPLACES_TOKEN, out, false);
         }
         else
         {
@@ -357,7 +468,7 @@ static bool wildcard_complete_internal(const wchar_t *str,
                 }
                 else
                 {
-                    return wildcard_complete_internal(str + 1, wc + 1, params, flags, out);
+                    return this->complete_internal(str + 1, wc + 1, params, flags, out, false);
                 }
                 break;
             }
@@ -367,15 +478,19 @@ static bool wildcard_complete_internal(const wchar_t *str,
                 /* Hackish. If this is the last character of the wildcard, then just complete with the empty string. This fixes cases like "f*<tab>" -> "f*o" */
                 if (wc[1] == L'\0')
                 {
-                    return wildcard_complete_internal(L"", L"", params, flags, out);
+                    return this->complete_internal(str + wcslen(str), wc + 1, params, flags, out, false);
                 }
                 
-                /* Try all submatches. #929: if the recursive call gives us a prefix match, just stop. This is sloppy - what we really want to do is say, once we've seen a match of a particular type, ignore all matches of that type further down the string, such that the wildcard produces the "minimal match.". */
+                /* Try all submatches. #929: if the recursive call gives us a prefix match, just stop. This is sloppy - what we really want to do is say, once we've seen a match of a particular type, ignore all matches of that type further down the string, such that the wildcard produces the "minimal match.". Whether a submatch fails doesn't depend on the flags or on out, so failures are remembered. */
                 bool has_match = false;
                 for (size_t i=0; str[i] != L'\0'; i++)
                 {
+                    if (this->memo_has_failed(str + i, wc + 1))
+                    {
+                        continue;
+                    }
                     const size_t before_count = out ? out->size() : 0;
-                    if (wildcard_complete_internal(str + i, wc + 1, params, flags, out))
+                    if (this->complete_internal(str + i, wc + 1, params, flags, out, false))
                     {
                         /* We found a match */
                         has_match = true;
@@ -386,6 +501,10 @@ static bool wildcard_complete_internal(const wchar_t *str,
                             break;
                         }
                     }
+                    else
+                    {
+                        this->memo_set_failed(str + i, wc + 1);
+                    }
                 }
                 return has_match;
             }
@@ -402,6 +521,24 @@ static bool wildcard_complete_internal(const wchar_t *str,
     assert(0 && "Unreachable code reached");
 }
 
+bool wildcard_pattern_t::complete(const wcstring &str,
+                                  const wchar_t *desc,
+                                  wcstring(*desc_func)(const wcstring &),
+                                  std::vector<completion_t> *out,
+                                  expand_flags_t expand_flags,
+                                  complete_flags_t flags) const
+{
+    // Note out may be NULL
+    complete_params_t params(str);
+    params.desc = desc;
+    params.desc_func = desc_func;
+    params.expand_flags = expand_flags;
+    this->begin_memo(str.c_str());
+    bool result = this->complete_internal(str.c_str(), this->wc.c_str(), params, flags, out, true /* first call */);
+    this->memo_str = NULL;
+    return result;
+}
+
 bool wildcard_complete(const wcstring &str,
                        const wchar_t *wc,
                        const wchar_t *desc,
@@ -410,25 +547,19 @@ bool wildcard_complete(const wcstring &str,
                        expand_flags_t expand_flags,
                        complete_flags_t flags)
 {
-    // Note out may be NULL
     assert(wc != NULL);
-    wc_complete_pack_t params(str);
-    params.desc = desc;
-    params.desc_func = desc_func;
-    params.expand_flags = expand_flags;
-    return wildcard_complete_internal(str.c_str(), wc, params, flags, out, true /* first call */);
+    return wildcard_pattern_t(wc).complete(str, desc, desc_func, out, expand_flags, flags);
 }
 
 
 bool wildcard_match(const wcstring &str, const wcstring &wc, bool leading_dots_fail_to_match)
 {
-    enum fuzzy_match_type_t match = wildcard_match_internal(str.c_str(), wc.c_str(), leading_dots_fail_to_match, true /* first */, fuzzy_match_exact);
-    return match != fuzzy_match_none;
+    return wildcard_pattern_t(wc).match(str, leading_dots_fail_to_match);
 }
         
 enum fuzzy_match_type_t wildcard_match_fuzzy(const wcstring &str, const wcstring &wc, bool leading_dots_fail_to_match, enum fuzzy_match_type_t max_type)
 {
-    return wildcard_match_internal(str.c_str(), wc.c_str(), leading_dots_fail_to_match, true /* first */, max_type);
+    return wildcard_pattern_t(wc).match_fuzzy(str, leading_dots_fail_to_match, max_type);
 }
 
 /**
@@ -554,19 +685,41 @@ static wcstring file_get_desc(const wcstring &filename,
 /** Test if the given file is an executable (if EXECUTABLES_ONLY) or directory (if DIRECTORIES_ONLY).
     If it matches, call wildcard_complete() with some description that we make up.
     Note that the filename came from a readdir() call, so we know it exists.
+    file_type is the type readdir reported, as from wreaddir_with_type(). If it is known and not a symlink, and no description is wanted, we don't need to stat the file at all.
  */
 static bool wildcard_test_flags_then_complete(const wcstring &filepath,
                                               const wcstring &filename,
-                                              const wchar_t *wc,
+                                              const wildcard_pattern_t &wc,
                                               expand_flags_t expand_flags,
-                                              std::vector<completion_t> *out)
+                                              std::vector<completion_t> *out,
+                                              mode_t file_type)
 {
     /* Check if it will match before stat() */
-    if (! wildcard_complete(filename, wc, NULL, NULL, NULL, expand_flags, 0))
+    if (! wc.complete(filename, NULL, NULL, NULL, expand_flags, 0))
     {
         return false;
     }
 
+    const bool wants_desc = !(expand_flags & EXPAND_NO_DESCRIPTIONS);
+    if (! wants_desc && file_type != 0 && file_type != S_IFLNK)
+    {
+        /* The type from readdir is all we need */
+        const bool is_directory = (file_type == S_IFDIR);
+        if ((expand_flags & DIRECTORIES_ONLY) && ! is_directory)
+        {
+            return false;
+        }
+        if ((expand_flags & EXECUTABLES_ONLY) && (file_type != S_IFREG || waccess(filepath, X_OK) != 0))
+        {
+            return false;
+        }
+        if (is_directory)
+        {
+            return wc.complete(filename + L'/', L"", NULL, out, expand_flags, COMPLETE_NO_SPACE);
+        }
+        return wc.complete(filename, L"", NULL, out, expand_flags, 0);
+    }
+
     struct stat lstat_buf = {}, stat_buf = {};
     int stat_res = -1;
     int stat_errno = 0;
@@ -617,7 +770,6 @@ static bool wildcard_test_flags_then_complete(const wcstring &filepath,
     }
     
     /* Compute the description */
-    bool wants_desc = !(expand_flags & EXPAND_NO_DESCRIPTIONS);
     wcstring desc;
     if (wants_desc)
     {
@@ -634,11 +786,99 @@ static bool wildcard_test_flags_then_complete(const wcstring &filepath,
     /* Append a / if this is a directory */
     if (is_directory)
     {
-        return wildcard_complete(filename + L'/', wc, desc.c_str(), NULL, out, expand_flags, COMPLETE_NO_SPACE);
+        return wc.complete(filename + L'/', desc.c_str(), NULL, out, expand_flags, COMPLETE_NO_SPACE);
     }
     else
     {
-        return wildcard_complete(filename, wc, desc.c_str(), NULL, out, expand_flags, 0);
+        return wc.complete(filename, desc.c_str(), NULL, out, expand_flags, 0);
+    }
+}
+
+/* The most threads a recursive wildcard expansion uses, counting the thread that started it */
+static const long kWildcardWalkMaxThreads = 8;
+
+/* How many directories must be waiting before a recursive expansion starts more threads */
+static const size_t kWildcardWalkSpawnThreshold = 16;
+
+class wildcard_expander_t;
+
+/* The shared state of a recursive wildcard expansion spread over several threads. Each directory that the expansion descends into is a task, and any thread may run it. Everything except cancelled is protected by the lock. */
+struct wildcard_walk_t
+{
+    struct task_t
+    {
+        wcstring base_dir;
+        const wchar_t *wc;
+    };
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Directories waiting to be expanded */
+    std::deque<task_t> tasks;
+
+    /* How many tasks are being run */
+    size_t running_count;
+
+    /* Set when there are no tasks left, to tell the workers to exit */
+    bool finished;
+
+    /* Set by the thread that started the expansion when it is interrupted. Workers poll it without the lock. */
+    volatile bool cancelled;
+
+    /* Set when some directory was reached by two different tasks. Which one gets there first depends on how the threads are scheduled, so the results are thrown away and the walk is redone by one thread, to give the same answer as always. */
+    bool revisited;
+
+    /* The file IDs we have visited, used to avoid symlink loops, each with the task that got there first. Directories visited before the walk started have task 0. */
+    std::map<file_id_t, unsigned long> visited_files;
+
+    /* The ID of the most recently started task */
+    unsigned long last_task_id;
+
+    /* The helper threads and their expanders, whose results are merged at the end */
+    std::vector<pthread_t> threads;
+    std::vector<wildcard_expander_t *> workers;
+
+    /* The completion lists the workers were given. Workers put their results in their walk_results instead, so these stay empty, but they must outlive the workers. A deque, so adding one does not move the others. */
+    std::deque<std::vector<completion_t> > worker_completions;
+
+    wildcard_walk_t() : running_count(0), finished(false), cancelled(false), revisited(false), last_task_id(0)
+    {
+        VOMIT_ON_FAILURE(pthread_mutex_init(&lock, NULL));
+        VOMIT_ON_FAILURE(pthread_cond_init(&cond, NULL));
+    }
+
+    ~wildcard_walk_t()
+    {
+        VOMIT_ON_FAILURE(pthread_cond_destroy(&cond));
+        VOMIT_ON_FAILURE(pthread_mutex_destroy(&lock));
+    }
+};
+
+/* Whether directories are walked through the fd of their parent, so the kernel need not resolve the whole path of every directory again */
+#if defined(HAVE_OPENAT) && defined(HAVE_FDOPENDIR) && defined(O_DIRECTORY)
+#define WILDCARD_USE_DIR_FDS 1
+#else
+#define WILDCARD_USE_DIR_FDS 0
+#endif
+
+/* Open the subdirectory name of the directory open as parent_fd. Returns -1 if that fails, or if parent_fd is -1, in which case the subdirectory must be opened by its path. */
+static int open_subdir(int parent_fd, const wcstring &name)
+{
+#if WILDCARD_USE_DIR_FDS
+    if (parent_fd >= 0)
+    {
+        return wopenat_cloexec(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    }
+#endif
+    return -1;
+}
+
+static void close_dir_fd(int fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
     }
 }
 
@@ -668,8 +908,56 @@ class wildcard_expander_t
     /* whether we have successfully added any completions */
     bool did_add;
     
-    /* We are a trailing slash - expand at the end */
-    void expand_trailing_slash(const wcstring &base_dir);
+    /* The parallel walk we are part of, or NULL */
+    wildcard_walk_t *walk;
+    
+    /* Whether we are a helper thread of the walk, as opposed to the expander that started it */
+    bool is_walk_worker;
+    
+    /* The ID of the walk task we are running */
+    unsigned long task_id;
+    
+    /* Whether we may start a parallel walk */
+    bool allow_parallel_walk;
+    
+    /* Our results while we are part of a walk */
+    std::vector<completion_t> walk_results;
+    
+    /* Expand the subtree rooted at base_dir, spreading the directories over several threads. Only used for ordinary (not completion) expansion, whose results get sorted afterwards, so the order in which directories finish does not matter. */
+    void expand_in_parallel(const wcstring &base_dir, const wchar_t *wc);
+    
+    /* Run tasks from our walk until there are none left */
+    void run_walk_tasks();
+    
+    /* Start the helper threads of our walk. Called with the walk locked. */
+    void spawn_walk_workers();
+    
+    static void *walk_worker_main(void *expander);
+    
+    /* Record that we are descending into the given directory. Returns false if we have been there already, because of a symlink loop. */
+    bool mark_visited(const file_id_t &file_id)
+    {
+        if (this->walk == NULL)
+        {
+            return this->visited_files.insert(file_id).second;
+        }
+        scoped_lock locker(this->walk->lock);
+        std::pair<std::map<file_id_t, unsigned long>::iterator, bool> inserted = this->walk->visited_files.insert(std::make_pair(file_id, this->task_id));
+        if (! inserted.second)
+        {
+            /* Within a single task the order is always the same */
+            unsigned long first_task_id = inserted.first->second;
+            if (first_task_id != 0 && first_task_id != this->task_id)
+            {
+                this->walk->revisited = true;
+            }
+            return false;
+        }
+        return true;
+    }
+    
+    /* We are a trailing slash - expand at the end. Takes ownership of base_dir_fd, as expand() does. */
+    void expand_trailing_slash(const wcstring &base_dir, int base_dir_fd);
     
     /* Given a directory base_dir, which is opened as base_dir_fp, expand an intermediate segment of the wildcard.
        Treat ANY_STRING_RECURSIVE as ANY_STRING.
@@ -690,12 +978,20 @@ class wildcard_expander_t
      */
     void expand_last_segment(const wcstring &base_dir, DIR *base_dir_fp, const wcstring &wc);
     
-    /* Indicate whether we should cancel wildcard expansion. This latches 'interrupt' */
+    /* Indicate whether we should cancel wildcard expansion. This latches 'interrupt'. Helper threads of a walk learn of it from the thread that started the walk. */
     bool interrupted()
     {
+        if (is_walk_worker)
+        {
+            return walk->cancelled;
+        }
         if (! did_interrupt)
         {
-            did_interrupt = (is_main_thread() ? reader_interrupted() : reader_thread_job_is_stale());
+            did_interrupt = (is_main_thread() ? (reader_interrupted() || reader_thread_job_is_stale()) : reader_thread_job_is_stale());
+            if (did_interrupt && walk != NULL)
+            {
+                walk->cancelled = true;
+            }
         }
         return did_interrupt;
     }
@@ -704,6 +1000,12 @@ class wildcard_expander_t
     {
         /* This function is only for the non-completions case */
         assert(! (this->flags & EXPAND_FOR_COMPLETIONS));
+        if (this->walk != NULL)
+        {
+            /* The starting thread removes duplicates when it merges the results */
+            append_completion(&this->walk_results, result);
+            return;
+        }
         if (this->completion_set.insert(result).second)
         {
             append_completion(this->resolved_completions, result);
@@ -711,16 +1013,16 @@ class wildcard_expander_t
         }
     }
     
-    void try_add_completion_result(const wcstring &filepath, const wcstring &filename, const wcstring &wildcard)
+    void try_add_completion_result(const wcstring &filepath, const wcstring &filename, const wildcard_pattern_t &wildcard, mode_t file_type)
     {
         /* This function is only for the completions case */
         assert(this->flags & EXPAND_FOR_COMPLETIONS);
         size_t before = this->resolved_completions->size();
-        if (wildcard_test_flags_then_complete(filepath, filename, wildcard.c_str(), this->flags, this->resolved_completions))
+        if (wildcard_test_flags_then_complete(filepath, filename, wildcard, this->flags, this->resolved_completions, file_type))
         {
             /* Hack. We added this completion result based on the last component of the wildcard.
                Prepend all prior components of the wildcard to each completion that replaces its token. */
-            size_t wc_len = wildcard.size();
+            size_t wc_len = wildcard.wildcard().size();
             size_t orig_wc_len = wcslen(this->original_wildcard);
             assert(wc_len <= orig_wc_len);
             const wcstring wc_base(this->original_wildcard, orig_wc_len - wc_len);
@@ -736,9 +1038,22 @@ class wildcard_expander_t
         }
     }
     
-    /* Helper to resolve an empty base directory */
-    static DIR *open_dir(const wcstring &base_dir)
+    /* Helper to open base_dir for reading. If base_dir_fd is an fd open on it, that is used instead of the path, and is taken over by the DIR. An empty base_dir is the working directory. */
+    static DIR *open_dir(const wcstring &base_dir, int base_dir_fd)
     {
+#if WILDCARD_USE_DIR_FDS
+        if (base_dir_fd >= 0)
+        {
+            DIR *dir = fdopendir(base_dir_fd);
+            if (dir == NULL)
+            {
+                close(base_dir_fd);
+            }
+            return dir;
+        }
+#else
+        assert(base_dir_fd < 0);
+#endif
         return wopendir(base_dir.empty() ? L"." : base_dir);
     }
     
@@ -750,7 +1065,11 @@ public:
         flags(f),
         resolved_completions(r),
         did_interrupt(false),
-        did_add(false)
+        did_add(false),
+        walk(NULL),
+        is_walk_worker(false),
+        task_id(0),
+        allow_parallel_walk(true)
     {
         assert(resolved_completions != NULL);
         
@@ -761,8 +1080,8 @@ public:
         }
     }
     
-    /* Do wildcard expansion. This is recursive. */
-    void expand(const wcstring &base_dir, const wchar_t *wc);
+    /* Do wildcard expansion. This is recursive. base_dir_fd is an fd open on base_dir, which expand() takes ownership of, or -1 to go by the path. */
+    void expand(const wcstring &base_dir, const wchar_t *wc, int base_dir_fd = -1);
     
     int status_code() const
     {
@@ -777,16 +1096,18 @@ public:
     }
 };
 
-void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir)
+void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir, int base_dir_fd)
 {
     if (interrupted())
     {
+        close_dir_fd(base_dir_fd);
         return;
     }
     
     if (! (flags & EXPAND_FOR_COMPLETIONS))
     {
         /* Trailing slash and not accepting incomplete, e.g. `echo /tmp/`. Insert this file if it exists. */
+        close_dir_fd(base_dir_fd);
         if (waccess(base_dir, F_OK))
         {
             this->add_expansion_result(base_dir);
@@ -795,15 +1116,17 @@ void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir)
     else
     {
         /* Trailing slashes and accepting incomplete, e.g. `echo /tmp/<tab>`. Everything is added. */
-        DIR *dir = open_dir(base_dir);
+        DIR *dir = open_dir(base_dir, base_dir_fd);
         if (dir)
         {
+            const wildcard_pattern_t pattern(L"");
             wcstring next;
-            while (wreaddir(dir, next) && ! interrupted())
+            mode_t file_type = 0;
+            while (wreaddir_with_type(dir, next, &file_type) && ! interrupted())
             {
                 if (! next.empty() && next.at(0) != L'.')
                 {
-                    this->try_add_completion_result(base_dir + next, next, L"");
+                    this->try_add_completion_result(base_dir + next, next, pattern, file_type);
                 }
             }
             closedir(dir);
@@ -811,36 +1134,203 @@ void wildcard_expander_t::expand_trailing_slash(const wcstring &base_dir)
     }
 }
 
+/* Stat the entry name of the directory dir, whose path is base_dir. Where we can, go through the directory's fd, so its path is not resolved again for every entry. */
+static int stat_dir_entry(DIR *dir, const wcstring &base_dir, const wcstring &name, struct stat *buf)
+{
+#ifdef HAVE_FSTATAT
+    return wstatat(dirfd(dir), name, buf);
+#else
+    return wstat(base_dir + name, buf);
+#endif
+}
+
 void wildcard_expander_t::expand_intermediate_segment(const wcstring &base_dir, DIR *base_dir_fp, const wcstring &wc_segment, const wchar_t *wc_remainder)
 {
+    const wildcard_pattern_t pattern(wc_segment);
     wcstring name_str;
     while (!interrupted() && wreaddir_for_dirs(base_dir_fp, &name_str))
     {
         /* Note that it's critical we ignore leading dots here, else we may descend into . and .. */
-        if (! wildcard_match(name_str, wc_segment, true))
+        if (! pattern.match(name_str, true))
         {
             /* Doesn't match the wildcard for this segment, skip it */
             continue;
         }
         
-        wcstring full_path = base_dir + name_str;
         struct stat buf;
-        if (0 != wstat(full_path, &buf) || !S_ISDIR(buf.st_mode))
+        if (0 != stat_dir_entry(base_dir_fp, base_dir, name_str, &buf) || !S_ISDIR(buf.st_mode))
         {
             /* We either can't stat it, or we did but it's not a directory */
             continue;
         }
 
         const file_id_t file_id = file_id_t::file_id_from_stat(&buf);
-        if (!this->visited_files.insert(file_id).second)
+        if (!this->mark_visited(file_id))
         {
             /* Symlink loop! This directory was already visited, so skip it */
             continue;
         }
 
-        /* We made it through. Perform normal wildcard expansion on this new directory, starting at our tail_wc, which includes the ANY_STRING_RECURSIVE guy. */
+        /* We made it through. Perform normal wildcard expansion on this new directory, starting at our tail_wc, which includes the ANY_STRING_RECURSIVE guy. In a parallel walk, leave it for whichever thread is free. */
+        wcstring full_path = base_dir + name_str;
         full_path.push_back(L'/');
-        this->expand(full_path, wc_remainder);
+        if (this->walk != NULL)
+        {
+            const wildcard_walk_t::task_t task = {full_path, wc_remainder};
+            scoped_lock locker(this->walk->lock);
+            this->walk->tasks.push_back(task);
+            VOMIT_ON_FAILURE(pthread_cond_signal(&this->walk->cond));
+        }
+        else
+        {
+            this->expand(full_path, wc_remainder, open_subdir(dirfd(base_dir_fp), name_str));
+        }
+    }
+}
+
+void *wildcard_expander_t::walk_worker_main(void *expander)
+{
+    static_cast<wildcard_expander_t *>(expander)->run_walk_tasks();
+    return NULL;
+}
+
+void wildcard_expander_t::spawn_walk_workers()
+{
+    ASSERT_IS_LOCKED(walk->lock);
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count > kWildcardWalkMaxThreads)
+    {
+        thread_count = kWildcardWalkMaxThreads;
+    }
+
+    /* Like the iothreads, helper threads must never receive signals */
+    sigset_t new_set, saved_set;
+    sigfillset(&new_set);
+    VOMIT_ON_FAILURE(pthread_sigmask(SIG_BLOCK, &new_set, &saved_set));
+    for (long i=1; i < thread_count; i++)
+    {
+        walk->worker_completions.push_back(std::vector<completion_t>());
+        wildcard_expander_t *worker = new wildcard_expander_t(this->original_base, this->original_wildcard, this->flags, &walk->worker_completions.back());
+        worker->walk = this->walk;
+        worker->is_walk_worker = true;
+
+        pthread_t thread = 0;
+        if (pthread_create(&thread, NULL, walk_worker_main, worker) != 0)
+        {
+            /* We'll manage with the threads we have */
+            delete worker;
+            break;
+        }
+        walk->threads.push_back(thread);
+        walk->workers.push_back(worker);
+    }
+    VOMIT_ON_FAILURE(pthread_sigmask(SIG_SETMASK, &saved_set, NULL));
+}
+
+void wildcard_expander_t::run_walk_tasks()
+{
+    wildcard_walk_t * const w = this->walk;
+    scoped_lock locker(w->lock);
+    for (;;)
+    {
+        if (w->tasks.empty() && w->running_count == 0)
+        {
+            /* Everything is done */
+            w->finished = true;
+            VOMIT_ON_FAILURE(pthread_cond_broadcast(&w->cond));
+        }
+        if (w->finished)
+        {
+            break;
+        }
+
+        if (w->tasks.empty())
+        {
+            if (is_walk_worker)
+            {
+                VOMIT_ON_FAILURE(pthread_cond_wait(&w->cond, &w->lock));
+            }
+            else
+            {
+                /* Wake up now and then to check whether we've been interrupted */
+                struct timeval now;
+                gettimeofday(&now, NULL);
+                struct timespec until;
+                until.tv_sec = now.tv_sec;
+                until.tv_nsec = (now.tv_usec + 10000) * 1000;
+                if (until.tv_nsec >= 1000000000)
+                {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&w->cond, &w->lock, &until);
+                locker.unlock();
+                this->interrupted();
+                locker.lock();
+            }
+            continue;
+        }
+
+        const wildcard_walk_t::task_t task = w->tasks.front();
+        w->tasks.pop_front();
+        w->running_count++;
+        this->task_id = ++w->last_task_id;
+        if (! is_walk_worker && w->threads.empty() && w->tasks.size() >= kWildcardWalkSpawnThreshold)
+        {
+            this->spawn_walk_workers();
+        }
+
+        locker.unlock();
+        this->expand(task.base_dir, task.wc);
+        locker.lock();
+        w->running_count--;
+    }
+}
+
+void wildcard_expander_t::expand_in_parallel(const wcstring &base_dir, const wchar_t *wc)
+{
+    assert(this->walk == NULL && ! (this->flags & EXPAND_FOR_COMPLETIONS));
+    wildcard_walk_t walk_state;
+    const wildcard_walk_t::task_t first_task = {base_dir, wc};
+    walk_state.tasks.push_back(first_task);
+    for (std::set<file_id_t>::const_iterator iter = this->visited_files.begin(); iter != this->visited_files.end(); ++iter)
+    {
+        walk_state.visited_files.insert(std::make_pair(*iter, 0UL));
+    }
+
+    this->walk = &walk_state;
+    this->run_walk_tasks();
+    for (size_t i=0; i < walk_state.threads.size(); i++)
+    {
+        VOMIT_ON_FAILURE(pthread_join(walk_state.threads.at(i), NULL));
+    }
+    this->walk = NULL;
+
+    std::vector<completion_t> results;
+    results.swap(this->walk_results);
+    for (size_t i=0; i < walk_state.workers.size(); i++)
+    {
+        wildcard_expander_t *worker = walk_state.workers.at(i);
+        results.insert(results.end(), worker->walk_results.begin(), worker->walk_results.end());
+        delete worker;
+    }
+
+    if (walk_state.revisited && ! this->interrupted())
+    {
+        /* Go back to where we started and walk the tree in order, so that the first path to a directory wins, as it always has */
+        this->allow_parallel_walk = false;
+        this->expand(base_dir, wc);
+        this->allow_parallel_walk = true;
+        return;
+    }
+
+    for (std::map<file_id_t, unsigned long>::const_iterator iter = walk_state.visited_files.begin(); iter != walk_state.visited_files.end(); ++iter)
+    {
+        this->visited_files.insert(iter->first);
+    }
+    for (size_t i=0; i < results.size(); i++)
+    {
+        this->add_expansion_result(results.at(i).completion);
     }
 }
         
@@ -865,14 +1355,14 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
             continue;
         }
         
-        wcstring new_full_path = base_dir + name_str;
-        new_full_path.push_back(L'/');
         struct stat buf;
-        if (0 != wstat(new_full_path, &buf) || !S_ISDIR(buf.st_mode))
+        if (0 != stat_dir_entry(base_dir_fp, base_dir, name_str, &buf) || !S_ISDIR(buf.st_mode))
         {
             /* We either can't stat it, or we did but it's not a directory */
             continue;
         }
+        wcstring new_full_path = base_dir + name_str;
+        new_full_path.push_back(L'/');
         
         // Ok, this directory matches. Recurse to it.
         // Then perform serious surgery on each result!
@@ -881,7 +1371,7 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
         // We also have to mark the completion as replacing and fuzzy
         const size_t before = this->resolved_completions->size();
         
-        this->expand(new_full_path, wc_remainder);
+        this->expand(new_full_path, wc_remainder, open_subdir(dirfd(base_dir_fp), name_str));
         const size_t after = this->resolved_completions->size();
         
         assert(before <= after);
@@ -921,17 +1411,19 @@ void wildcard_expander_t::expand_literal_intermediate_segment_with_fuzz(const wc
 
 void wildcard_expander_t::expand_last_segment(const wcstring &base_dir, DIR *base_dir_fp, const wcstring &wc)
 {
+    const wildcard_pattern_t pattern(wc);
     wcstring name_str;
-    while (wreaddir(base_dir_fp, name_str))
+    mode_t file_type = 0;
+    while (wreaddir_with_type(base_dir_fp, name_str, &file_type))
     {
         if (flags & EXPAND_FOR_COMPLETIONS)
         {
-            this->try_add_completion_result(base_dir + name_str, name_str, wc);
+            this->try_add_completion_result(base_dir + name_str, name_str, pattern, file_type);
         }
         else
         {
             // Normal wildcard expansion, not for completions
-            if (wildcard_match(name_str, wc, true /* skip files with leading dots */))
+            if (pattern.match(name_str, true /* skip files with leading dots */))
             {
                 this->add_expansion_result(base_dir + name_str);
             }
@@ -955,12 +1447,13 @@ void wildcard_expander_t::expand_last_segment(const wcstring &base_dir, DIR *bas
  base_dir: the "working directory" against which the wildcard is to be resolved
  wc: the wildcard string itself, e.g. foo*bar/baz (where * is acutally ANY_CHAR)
 */
-void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc)
+void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc, int base_dir_fd)
 {
     assert(wc != NULL);
     
     if (interrupted())
     {
+        close_dir_fd(base_dir_fd);
         return;
     }
     
@@ -978,12 +1471,12 @@ void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc)
         assert(! segment_has_wildcards);
         if (is_last_segment)
         {
-            this->expand_trailing_slash(base_dir);
+            this->expand_trailing_slash(base_dir, base_dir_fd);
         }
         else
         {
             /* Multiple adjacent slashes in the wildcard. Just skip them. */
-            this->expand(base_dir, next_slash + 1);
+            this->expand(base_dir, next_slash + 1, base_dir_fd);
         }
     }
     else if (! segment_has_wildcards && ! is_last_segment)
@@ -998,23 +1491,33 @@ void wildcard_expander_t::expand(const wcstring &base_dir, const wchar_t *wc)
         
         /* This just trumps everything */
         size_t before = this->resolved_completions->size();
-        this->expand(base_dir + wc_segment + L'/', wc_remainder);
+        this->expand(base_dir + wc_segment + L'/', wc_remainder, open_subdir(base_dir_fd, wc_segment));
         if ((this->flags & EXPAND_FUZZY_MATCH) && this->resolved_completions->size() == before)
         {
             /* Nothing was found with the literal match. Try a fuzzy match (#94). */
             assert(this->flags & EXPAND_FOR_COMPLETIONS);
-            DIR *base_dir_fd = open_dir(base_dir);
-            if (base_dir_fd != NULL)
+            DIR *base_dir_fp = open_dir(base_dir, base_dir_fd);
+            if (base_dir_fp != NULL)
             {
-                this->expand_literal_intermediate_segment_with_fuzz(base_dir, base_dir_fd, wc_segment, wc_remainder);
-                closedir(base_dir_fd);
+                this->expand_literal_intermediate_segment_with_fuzz(base_dir, base_dir_fp, wc_segment, wc_remainder);
+                closedir(base_dir_fp);
             }
         }
+        else
+        {
+            close_dir_fd(base_dir_fd);
+        }
+    }
+    else if (this->walk == NULL && this->allow_parallel_walk && ! (this->flags & EXPAND_FOR_COMPLETIONS) && wc_segment.find(ANY_STRING_RECURSIVE) != wcstring::npos)
+    {
+        /* A recursive wildcard may have a large tree to walk. Its tasks go by path, since they may be run on any thread. */
+        close_dir_fd(base_dir_fd);
+        this->expand_in_parallel(base_dir, wc);
     }
     else
     {
         assert(! wc_segment.empty() && (segment_has_wildcards || is_last_segment));
-        DIR *dir = open_dir(base_dir);
+        DIR *dir = open_dir(base_dir, base_dir_fd);
         if (dir)
         {
             if (is_last_segment)
@@ -1068,3 +1571,30 @@ int wildcard_expand_string(const wcstring &wc, const wcstring &base_dir, expand_
     expander.expand(base_dir, wc.c_str());
     return expander.status_code();
 }
+
+int wildcard_complete_dir_entries(const wcstring &name, const wcstring &base_dir, expand_flags_t flags, std::vector<completion_t> *output)
+{
+    assert(output != NULL);
+    assert(flags & EXPAND_FOR_COMPLETIONS);
+    assert(! wildcard_has(name, true));
+    
+    /* Without fuzzy matching, only names sharing a prefix with name, possibly differing in case, can be completions */
+    const wcstring prefix = (flags & EXPAND_FUZZY_MATCH) ? wcstring() : name;
+    std::vector<path_dir_entry_t> entries;
+    if (! path_get_dir_entries(base_dir, prefix, &entries))
+    {
+        return 0;
+    }
+    
+    const wildcard_pattern_t pattern(name);
+    bool did_add = false;
+    for (size_t i=0; i < entries.size(); i++)
+    {
+        const path_dir_entry_t &entry = entries.at(i);
+        if (wildcard_test_flags_then_complete(base_dir + entry.name, entry.name, pattern, flags, output, entry.type))
+        {
+            did_add = true;
+        }
+    }
+    return did_add;
+}
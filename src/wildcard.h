@@ -66,6 +66,24 @@ enum
 
 */
 int wildcard_expand_string(const wcstring &wc, const wcstring &base_dir, expand_flags_t flags, std::vector<completion_t> *out);
+
+/**
+   Completes name with the entries of the directory base_dir. This is like
+   wildcard_expand_string(base_dir + name, L"", flags | EXPAND_FOR_COMPLETIONS, out),
+   except that completions replacing the token hold just the entry name, and
+   the entries come from the cached listing of path_get_dir_entries instead of
+   reading the directory every time. Used for completing command names in
+   $PATH, whose directories can be large and rarely change.
+
+   \param name The name to complete, which must not contain wildcards
+   \param base_dir The directory, which must end with a slash
+   \param flags Flags for the search, which must include EXPAND_FOR_COMPLETIONS
+   \param out The list in which to put the output
+
+   \return 1 if matches were found, 0 otherwise
+*/
+int wildcard_complete_dir_entries(const wcstring &name, const wcstring &base_dir, expand_flags_t flags, std::vector<completion_t> *out);
+
 /**
    Test whether the given wildcard matches the string. Does not perform any I/O.
 
@@ -79,6 +97,57 @@ bool wildcard_match(const wcstring &str, const wcstring &wc, bool leading_dots_f
 /* Like wildcard_match, but returns a fuzzy match type */
 enum fuzzy_match_type_t wildcard_match_fuzzy(const wcstring &str, const wcstring &wc, bool leading_dots_fail_to_match = false, enum fuzzy_match_type_t max_type = fuzzy_match_none);
 
+/**
+   A wildcard prepared for testing against many strings, e.g. every entry in a directory. Preparing it finds the wildcard characters once, instead of rescanning the wildcard for each string. Matching remembers which positions in the string and the wildcard have already failed to match each other, so that wildcards with several ANY_STRINGs, like *a*a*a*b, take polynomial rather than exponential time.
+
+   The wildcard is in the internal form, with ANY_STRING and friends. A pattern has scratch space for matching, so it must not be shared between threads.
+*/
+class wildcard_pattern_t
+{
+    /* The wildcard */
+    const wcstring wc;
+
+    /* The length of the wildcard up to its first embedded null, where matching stops, like it always has */
+    const size_t wc_len;
+
+    /* next_wildcard.at(i) is the position in wc of the first wildcard character at or after i, or npos. It has wc_len + 1 entries. */
+    std::vector<size_t> next_wildcard;
+
+    /* How many ANY_STRING and ANY_STRING_RECURSIVE characters the wildcard has. Fewer than two can't backtrack badly, so there's no need to remember failures. */
+    size_t any_string_count;
+
+    /* The string being matched, and the positions that failed to match, indexed by string position * (wc_len + 1) + wildcard position */
+    mutable const wchar_t *memo_str;
+    mutable std::vector<bool> memo_failed;
+
+    /* Set up the memo for matching the given string, returning whether it's in use */
+    bool begin_memo(const wchar_t *str) const;
+    bool memo_has_failed(const wchar_t *str, const wchar_t *wc) const;
+    void memo_set_failed(const wchar_t *str, const wchar_t *wc) const;
+
+    enum fuzzy_match_type_t match_internal(const wchar_t *str, const wchar_t *wc, bool leading_dots_fail_to_match, bool is_first, enum fuzzy_match_type_t max_type) const;
+
+    struct complete_params_t;
+    bool complete_internal(const wchar_t *str, const wchar_t *wc, const complete_params_t &params, complete_flags_t flags, std::vector<completion_t> *out, bool is_first_call) const;
+
+public:
+    explicit wildcard_pattern_t(const wcstring &wc);
+
+    const wcstring &wildcard() const
+    {
+        return wc;
+    }
+
+    /* Like wildcard_match */
+    bool match(const wcstring &str, bool leading_dots_fail_to_match = false) const;
+
+    /* Like wildcard_match_fuzzy */
+    enum fuzzy_match_type_t match_fuzzy(const wcstring &str, bool leading_dots_fail_to_match = false, enum fuzzy_match_type_t max_type = fuzzy_match_none) const;
+
+    /* Like wildcard_complete */
+    bool complete(const wcstring &str, const wchar_t *desc, wcstring(*desc_func)(const wcstring &), std::vector<completion_t> *out, expand_flags_t expand_flags, complete_flags_t flags) const;
+};
+
 /** Check if the specified string contains wildcards */
 bool wildcard_has(const wcstring &, bool internal);
 bool wildcard_has(const wchar_t *, bool internal);
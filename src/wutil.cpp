@@ -41,6 +41,53 @@ const file_id_t kInvalidFileID = {(dev_t)-1LL, (ino_t)-1LL, (uint64_t)-1LL, -1,
 #endif
 #endif
 
+/* Calls counted by syscall_count(), indexed by syscall_counter_t */
+static unsigned long s_syscall_counts[SYSCALL_COUNTER_COUNT];
+
+/**
+   A path converted to a narrow string for passing to a system call. Paths are short and almost always ASCII, so those are copied into a buffer on the stack; anything else goes through wcs2string().
+*/
+class narrow_path_t
+{
+    char local[256];
+    std::string converted;
+    const char *str;
+
+    /* No copying */
+    narrow_path_t(const narrow_path_t &);
+    void operator=(const narrow_path_t &);
+
+public:
+    explicit narrow_path_t(const wcstring &path)
+    {
+        const size_t len = path.size();
+        if (len < sizeof local)
+        {
+            size_t i;
+            for (i=0; i < len; i++)
+            {
+                const wchar_t wc = path[i];
+                if (wc <= 0 || wc >= 0x80)
+                    break;
+                local[i] = (char)wc;
+            }
+            if (i == len)
+            {
+                local[len] = '\0';
+                str = local;
+                return;
+            }
+        }
+        converted = wcs2string(path);
+        str = converted.c_str();
+    }
+
+    const char *c_str() const
+    {
+        return str;
+    }
+};
+
 /* Lock to protect wgettext */
 static pthread_mutex_t wgettext_lock;
 
@@ -50,6 +97,7 @@ static wgettext_map_t wgettext_map;
 
 bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &out_name, bool *out_is_dir)
 {
+    syscall_count(SYSCALL_READDIR);
     struct dirent *d = readdir(dir);
     if (!d) return false;
 
@@ -87,6 +135,7 @@ bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &ou
             fullpath.push_back('/');
             fullpath.append(d->d_name);
             struct stat buf;
+            syscall_count(SYSCALL_STAT);
             if (stat(fullpath.c_str(), &buf) != 0)
             {
                 is_dir = false;
@@ -103,6 +152,7 @@ bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &ou
 
 bool wreaddir(DIR *dir, std::wstring &out_name)
 {
+    syscall_count(SYSCALL_READDIR);
     struct dirent *d = readdir(dir);
     if (!d) return false;
 
@@ -110,11 +160,37 @@ bool wreaddir(DIR *dir, std::wstring &out_name)
     return true;
 }
 
+bool wreaddir_with_type(DIR *dir, std::wstring &out_name, mode_t *out_type)
+{
+    syscall_count(SYSCALL_READDIR);
+    struct dirent *d = readdir(dir);
+    if (!d) return false;
+
+    out_name = str2wcstring(d->d_name);
+    mode_t type = 0;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+    switch (d->d_type)
+    {
+        case DT_DIR: type = S_IFDIR; break;
+        case DT_REG: type = S_IFREG; break;
+        case DT_LNK: type = S_IFLNK; break;
+        case DT_CHR: type = S_IFCHR; break;
+        case DT_BLK: type = S_IFBLK; break;
+        case DT_FIFO: type = S_IFIFO; break;
+        case DT_SOCK: type = S_IFSOCK; break;
+        default: type = 0; break;
+    }
+#endif // HAVE_STRUCT_DIRENT_D_TYPE
+    *out_type = type;
+    return true;
+}
+
 bool wreaddir_for_dirs(DIR *dir, wcstring *out_name)
 {
     struct dirent *result = NULL;
     while (result == NULL)
     {
+        syscall_count(SYSCALL_READDIR);
         struct dirent *d = readdir(dir);
         if (!d) break;
         
@@ -233,10 +309,11 @@ bool set_cloexec(int fd)
     }
 }
 
-static int wopen_internal(const wcstring &pathname, int flags, mode_t mode, bool cloexec)
+/* Open pathname relative to dir_fd, which is only used if use_dir_fd is set */
+static int wopen_internal(bool use_dir_fd, int dir_fd, const wcstring &pathname, int flags, mode_t mode, bool cloexec)
 {
     ASSERT_IS_NOT_FORKED_CHILD();
-    cstring tmp = wcs2string(pathname);
+    const narrow_path_t tmp(pathname);
     /* Prefer to use O_CLOEXEC. It has to both be defined and nonzero. */
 #ifdef O_CLOEXEC
     if (cloexec && (O_CLOEXEC != 0))
@@ -245,7 +322,13 @@ static int wopen_internal(const wcstring &pathname, int flags, mode_t mode, bool
         cloexec = false;
     }
 #endif
+    syscall_count(SYSCALL_OPEN);
+#ifdef HAVE_OPENAT
+    int fd = use_dir_fd ? ::openat(dir_fd, tmp.c_str(), flags, mode) : ::open(tmp.c_str(), flags, mode);
+#else
+    assert(! use_dir_fd);
     int fd = ::open(tmp.c_str(), flags, mode);
+#endif
     if (cloexec && fd >= 0 && ! set_cloexec(fd))
     {
         close(fd);
@@ -257,33 +340,69 @@ static int wopen_internal(const wcstring &pathname, int flags, mode_t mode, bool
 
 int wopen_cloexec(const wcstring &pathname, int flags, mode_t mode)
 {
-    return wopen_internal(pathname, flags, mode, true);
+    return wopen_internal(false, -1, pathname, flags, mode, true);
 }
 
+#ifdef HAVE_OPENAT
+int wopenat_cloexec(int dir_fd, const wcstring &name, int flags, mode_t mode)
+{
+    return wopen_internal(true, dir_fd, name, flags, mode, true);
+}
+#endif
+
 DIR *wopendir(const wcstring &name)
 {
-    const cstring tmp = wcs2string(name);
+    const narrow_path_t tmp(name);
+    syscall_count(SYSCALL_OPENDIR);
     return opendir(tmp.c_str());
 }
 
 int wstat(const wcstring &file_name, struct stat *buf)
 {
-    const cstring tmp = wcs2string(file_name);
+    const narrow_path_t tmp(file_name);
+    syscall_count(SYSCALL_STAT);
     return stat(tmp.c_str(), buf);
 }
 
 int lwstat(const wcstring &file_name, struct stat *buf)
 {
-    const cstring tmp = wcs2string(file_name);
+    const narrow_path_t tmp(file_name);
+    syscall_count(SYSCALL_LSTAT);
     return lstat(tmp.c_str(), buf);
 }
 
 int waccess(const wcstring &file_name, int mode)
 {
-    const cstring tmp = wcs2string(file_name);
+    const narrow_path_t tmp(file_name);
+    syscall_count(SYSCALL_ACCESS);
     return access(tmp.c_str(), mode);
 }
 
+#ifdef HAVE_FSTATAT
+int wstatat(int dir_fd, const wcstring &name, struct stat *buf)
+{
+    const narrow_path_t tmp(name);
+    syscall_count(SYSCALL_STAT);
+    return fstatat(dir_fd, tmp.c_str(), buf, 0);
+}
+
+int lwstatat(int dir_fd, const wcstring &name, struct stat *buf)
+{
+    const narrow_path_t tmp(name);
+    syscall_count(SYSCALL_LSTAT);
+    return fstatat(dir_fd, tmp.c_str(), buf, AT_SYMLINK_NOFOLLOW);
+}
+#endif
+
+#ifdef HAVE_FACCESSAT
+int waccessat(int dir_fd, const wcstring &name, int mode)
+{
+    const narrow_path_t tmp(name);
+    syscall_count(SYSCALL_ACCESS);
+    return faccessat(dir_fd, tmp.c_str(), mode, 0);
+}
+#endif
+
 int wunlink(const wcstring &file_name)
 {
     const cstring tmp = wcs2string(file_name);
@@ -629,3 +748,38 @@ bool file_id_t::operator<(const file_id_t &rhs) const
     if (! ret) ret = compare(change_nanoseconds, rhs.change_nanoseconds);
     return ret < 0;
 }
+
+void syscall_count(syscall_counter_t which)
+{
+    __sync_fetch_and_add(&s_syscall_counts[which], 1);
+}
+
+const wchar_t *syscall_counter_name(syscall_counter_t which)
+{
+    switch (which)
+    {
+        case SYSCALL_STAT: return L"stat";
+        case SYSCALL_LSTAT: return L"lstat";
+        case SYSCALL_ACCESS: return L"access";
+        case SYSCALL_OPEN: return L"open";
+        case SYSCALL_OPENDIR: return L"opendir";
+        case SYSCALL_READDIR: return L"readdir";
+        case SYSCALL_FORK: return L"fork";
+        case SYSCALL_SPAWN: return L"spawn";
+        case SYSCALL_SUBSHELL: return L"subshell";
+        default: return L"";
+    }
+}
+
+unsigned long syscall_counter_get(syscall_counter_t which)
+{
+    return __sync_fetch_and_add(&s_syscall_counts[which], 0);
+}
+
+void syscall_counters_reset()
+{
+    for (size_t i=0; i < SYSCALL_COUNTER_COUNT; i++)
+    {
+        __sync_fetch_and_and(&s_syscall_counts[i], 0);
+    }
+}
@@ -50,6 +50,32 @@ int lwstat(const wcstring &file_name, struct stat *buf);
 */
 int waccess(const wcstring &pathname, int mode);
 
+#ifdef HAVE_FSTATAT
+/**
+   Wide character version of fstatat(). name is relative to the directory open as dir_fd, which saves the kernel from resolving the directory's path again.
+*/
+int wstatat(int dir_fd, const wcstring &name, struct stat *buf);
+
+/**
+   Like wstatat(), but does not follow a symlink, like lstat().
+*/
+int lwstatat(int dir_fd, const wcstring &name, struct stat *buf);
+#endif
+
+#ifdef HAVE_FACCESSAT
+/**
+   Wide character version of faccessat(), relative to the directory open as dir_fd.
+*/
+int waccessat(int dir_fd, const wcstring &name, int mode);
+#endif
+
+#ifdef HAVE_OPENAT
+/**
+   Wide character version of openat(), relative to the directory open as dir_fd, that also sets the close-on-exec flag.
+*/
+int wopenat_cloexec(int dir_fd, const wcstring &name, int flags, mode_t mode = 0);
+#endif
+
 /**
    Wide character version of unlink().
 */
@@ -94,6 +120,11 @@ wchar_t *wrealpath(const wcstring &pathname, wchar_t *resolved_path);
 bool wreaddir(DIR *dir, std::wstring &out_name);
 bool wreaddir_resolving(DIR *dir, const std::wstring &dir_path, std::wstring &out_name, bool *out_is_dir);
 
+/**
+ Like wreaddir, but also report the type of the entry as readdir gave it, as the S_IFMT bits of a mode (e.g. S_IFDIR), or 0 if the type is not known. Symlinks are reported as S_IFLNK and are not resolved.
+*/
+bool wreaddir_with_type(DIR *dir, std::wstring &out_name, mode_t *out_type);
+
 /**
  Like wreaddir, but skip items that are known to not be directories.
  If this requires a stat (i.e. the file is a symlink), then return it.
@@ -135,6 +166,33 @@ int wrename(const wcstring &oldName, const wcstring &newName);
 /** Like wcstol(), but fails on a value outside the range of an int */
 int fish_wcstoi(const wchar_t *str, wchar_t ** endptr, int base);
 
+/** The kinds of call counted by syscall_count() */
+enum syscall_counter_t
+{
+    SYSCALL_STAT, /** wstat */
+    SYSCALL_LSTAT, /** lwstat */
+    SYSCALL_ACCESS, /** waccess */
+    SYSCALL_OPEN, /** wopen_cloexec */
+    SYSCALL_OPENDIR, /** wopendir */
+    SYSCALL_READDIR, /** the wreaddir family */
+    SYSCALL_FORK, /** execute_fork */
+    SYSCALL_SPAWN, /** posix_spawn of an external command */
+    SYSCALL_SUBSHELL, /** exec_subshell, for command substitutions and autoloading */
+    SYSCALL_COUNTER_COUNT
+};
+
+/** Count one call of the given kind. May be called from any thread. */
+void syscall_count(syscall_counter_t which);
+
+/** Return the name of the given counter, as printed by status --print-syscall-stats */
+const wchar_t *syscall_counter_name(syscall_counter_t which);
+
+/** Return how many calls of the given kind were counted since the counters were last reset */
+unsigned long syscall_counter_get(syscall_counter_t which);
+
+/** Set every counter to zero */
+void syscall_counters_reset();
+
 /** Class for representing a file's inode. We use this to detect and avoid symlink loops, among other things. While an inode / dev pair is sufficient to distinguish co-existing files, Linux seems to aggressively re-use inodes, so it cannot determine if a file has been deleted (ABA problem). Therefore we include richer information. */
 struct file_id_t
 {
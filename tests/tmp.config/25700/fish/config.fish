@@ -0,0 +1 @@
+set fish_function_path '/root/repo/tests/tmp.config/25700/fish/functions' '/root/repo/share/functions'